@@ -0,0 +1,537 @@
+/* Copyright (c) 2023 Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* This file implements the API in homa_bypass.h. It is an experimental
+ * prototype, not a supported variant of Homa: rather than a real
+ * userspace kernel shim, it reuses the unit-test mock layer, so locks are
+ * no-ops, call_rcu callbacks run immediately, and csum_partial doesn't
+ * compute checksums. The Homa protocol code
+ * (homa_incoming.c, homa_outgoing.c, etc.) is compiled unchanged, in the
+ * same way as for unit tests; test/mock.c supplies the kernel facilities
+ * it needs, with mock_copy_data set so that message data is really copied,
+ * mock_bypass set so that the mocks don't log or track allocations, and
+ * mock_xmit_hook set so that outgoing packets come here instead of
+ * going to the IP layer. Incoming packets are fed directly to
+ * homa_softirq and timer and pacer work is done by homa_bypass_poll, so
+ * everything runs on the caller's thread.
+ */
+
+#include "homa_impl.h"
+#include "ccutils.h"
+#include "mock.h"
+#include "utils.h"
+#define KSELFTEST_NOT_MAIN 1
+#include "kselftest_harness.h"
+#include "homa_bypass.h"
+
+/* It isn't safe to include time.h (it conflicts with kernel headers),
+ * so declare the one C library function needed here.
+ */
+struct bypass_timespec {
+	long tv_sec;
+	long tv_nsec;
+};
+extern int clock_gettime(int clock_id, struct bypass_timespec *tp);
+
+/* Storage normally provided by test/main.c; the mock layer reports
+ * internal errors by marking __current_test as failed.
+ */
+struct __test_metadata *__test_list;
+struct __test_metadata *__current_test;
+unsigned int __test_count;
+unsigned int __fixture_count;
+int __constructor_order;
+
+static struct __test_metadata bypass_metadata = {.name = "homa_bypass"};
+
+/**
+ * define HOMA_BYPASS_MAX_SOCKETS - Largest number of sockets that can be
+ * open at once in a homa_bypass instance.
+ */
+#define HOMA_BYPASS_MAX_SOCKETS 64
+
+/**
+ * define HOMA_BYPASS_MAX_IOVS - Largest iovcnt that homa_bypass_sendv and
+ * homa_bypass_replyv will copy on the stack (larger vectors are copied
+ * to the heap).
+ */
+#define HOMA_BYPASS_MAX_IOVS 16
+
+/* Configuration passed to homa_bypass_init. */
+static struct homa_bypass_config bypass_config;
+static struct homa_bypass_ops bypass_ops;
+
+/* Open sockets, indexed by the values returned by homa_bypass_socket;
+ * NULL means the slot is free.
+ */
+static struct homa_sock *bypass_socks[HOMA_BYPASS_MAX_SOCKETS];
+
+/* Outgoing packets are assembled here (IP header plus Homa packet). */
+static char *bypass_frame;
+
+/* Identifier for the next IPv4 packet. */
+static __u16 bypass_ip_id;
+
+/* get_cycles() time when homa_timer should next be invoked. */
+static __u64 bypass_next_tick;
+
+/* Interval between timer ticks, in get_cycles() units (1 ms). */
+static __u64 bypass_tick_cycles;
+
+/**
+ * bypass_cpu_khz() - Measure the rate of get_cycles (the TSC).
+ *
+ * Return:  Clock rate in kHz.
+ */
+static unsigned int bypass_cpu_khz(void)
+{
+	struct bypass_timespec start, now;
+	__u64 start_cycles = get_cycles();
+	long ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ns = (now.tv_sec - start.tv_sec) * 1000000000L
+				+ (now.tv_nsec - start.tv_nsec);
+	} while (ns < 10000000);
+	return ((get_cycles() - start_cycles) * 1000000) / ns;
+}
+
+/**
+ * bypass_ip_checksum() - Compute the checksum for an IPv4 header.
+ * @iph:    Header whose check field is 0.
+ *
+ * Return:  Value for iph->check.
+ */
+static __sum16 bypass_ip_checksum(const struct iphdr *iph)
+{
+	const __u16 *p = (const __u16 *) iph;
+	__u32 sum = 0;
+	int i;
+
+	for (i = 0; i < iph->ihl * 2; i++)
+		sum += p[i];
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (__force __sum16) ~sum;
+}
+
+/**
+ * bypass_xmit() - Installed as mock_xmit_hook: adds an IP header to an
+ * outgoing Homa packet and passes it to the backend.
+ * @skb:    Packet to transmit; data starts with the Homa header. The
+ *          packet is freed here.
+ * @daddr:  Destination address.
+ * @tos:    Value for the TOS (IPv4) or traffic class (IPv6) field.
+ *
+ * Return:  0 for success, otherwise a negative errno.
+ */
+static int bypass_xmit(struct sk_buff *skb, const struct in6_addr *daddr,
+		int tos)
+{
+	int ip_length = bypass_config.ipv6 ? sizeof(struct ipv6hdr)
+			: sizeof(struct iphdr);
+	int length = ip_length + skb->len;
+	int result;
+
+	if (unlikely((length > bypass_config.mtu)
+			|| (skb_headlen(skb) != skb->len))) {
+		/* There is no GSO (see homa_bypass_socket) and no
+		 * zero-copy, so this shouldn't happen.
+		 */
+		kfree_skb(skb);
+		return -EMSGSIZE;
+	}
+	if (bypass_config.ipv6) {
+		struct ipv6hdr *ip6h = (struct ipv6hdr *) bypass_frame;
+
+		memset(ip6h, 0, sizeof(*ip6h));
+		ip6h->version = 6;
+		ip6h->priority = tos >> 4;
+		ip6h->flow_lbl[0] = (tos & 0xf) << 4;
+		ip6h->payload_len = htons(skb->len);
+		ip6h->nexthdr = IPPROTO_HOMA;
+		ip6h->hop_limit = 64;
+		ip6h->saddr = bypass_config.local_addr;
+		ip6h->daddr = *daddr;
+	} else {
+		struct iphdr *iph = (struct iphdr *) bypass_frame;
+
+		memset(iph, 0, sizeof(*iph));
+		iph->version = 4;
+		iph->ihl = 5;
+		iph->tos = tos;
+		iph->tot_len = htons(length);
+		iph->id = htons(bypass_ip_id++);
+		iph->frag_off = htons(IP_DF);
+		iph->ttl = 64;
+		iph->protocol = IPPROTO_HOMA;
+		iph->saddr = ipv6_to_ipv4(bypass_config.local_addr);
+		iph->daddr = ipv6_to_ipv4(*daddr);
+		iph->check = bypass_ip_checksum(iph);
+	}
+	memcpy(bypass_frame + ip_length, skb->data, skb->len);
+	result = bypass_ops.xmit(bypass_ops.context, bypass_frame, length,
+			daddr);
+	kfree_skb(skb);
+	return result;
+}
+
+/**
+ * bypass_sock() - Map a socket number to the corresponding socket.
+ * @sock:   Value returned by homa_bypass_socket.
+ *
+ * Return:  The socket, or NULL if @sock doesn't refer to an open socket.
+ */
+static struct homa_sock *bypass_sock(int sock)
+{
+	if ((sock < 0) || (sock >= HOMA_BYPASS_MAX_SOCKETS))
+		return NULL;
+	return bypass_socks[sock];
+}
+
+/**
+ * homa_bypass_init() - Initialize Homa; must be invoked before any other
+ * function in this file.
+ * @config:   Describes the local host and network.
+ * @ops:      Describes the packet I/O backend.
+ *
+ * Return:    0 for success, otherwise a negative errno.
+ */
+int homa_bypass_init(const struct homa_bypass_config *config,
+		const struct homa_bypass_ops *ops)
+{
+	int ip_length = config->ipv6 ? sizeof(struct ipv6hdr)
+			: sizeof(struct iphdr);
+	int err;
+
+	if ((ops->xmit == NULL) || (config->mtu < ip_length
+			+ sizeof(struct data_header) + 100))
+		return -EINVAL;
+	bypass_config = *config;
+	bypass_ops = *ops;
+	__current_test = &bypass_metadata;
+	bypass_metadata.passed = 1;
+
+	/* Use real time and real data copies, and route outgoing packets
+	 * to the backend.
+	 */
+	mock_cycles = ~0;
+	cpu_khz = bypass_cpu_khz();
+	mock_copy_data = 1;
+	mock_bypass = 1;
+	mock_xmit_hook = bypass_xmit;
+	mock_ipv6 = config->ipv6 != 0;
+
+	bypass_frame = kmalloc(config->mtu, GFP_KERNEL);
+	if (!bypass_frame)
+		return -ENOMEM;
+	err = homa_init(homa);
+	if (err) {
+		kfree(bypass_frame);
+		bypass_frame = NULL;
+		return err;
+	}
+	if (config->link_mbps > 0) {
+		homa->link_mbps = config->link_mbps;
+		homa_outgoing_sysctl_changed(homa);
+	}
+	bypass_tick_cycles = cpu_khz;
+	bypass_next_tick = get_cycles() + bypass_tick_cycles;
+	return 0;
+}
+
+/**
+ * homa_bypass_destroy() - Close all sockets and release all of the
+ * resources used by Homa.
+ */
+void homa_bypass_destroy(void)
+{
+	int i;
+
+	for (i = 0; i < HOMA_BYPASS_MAX_SOCKETS; i++)
+		homa_bypass_close(i);
+	homa_destroy(homa);
+	kfree(bypass_frame);
+	bypass_frame = NULL;
+	mock_xmit_hook = NULL;
+}
+
+/**
+ * homa_bypass_socket() - Open a new Homa socket.
+ * @port:         Port to bind the socket to (it must be less than
+ *                HOMA_MIN_DEFAULT_PORT), or 0 to let Homa choose a port
+ *                (for clients).
+ * @buf_region:   Buffer space for incoming messages, just as for the
+ *                SO_HOMA_SET_BUF socket option; must remain valid until
+ *                the socket is closed.
+ * @region_size:  Number of bytes at @buf_region.
+ *
+ * Return:        A socket number for use in other functions, or a negative
+ *                errno.
+ */
+int homa_bypass_socket(int port, void *buf_region, size_t region_size)
+{
+	struct homa_sock *hsk;
+	int sock, err;
+
+	for (sock = 0; sock < HOMA_BYPASS_MAX_SOCKETS; sock++) {
+		if (!bypass_socks[sock])
+			break;
+	}
+	if (sock >= HOMA_BYPASS_MAX_SOCKETS)
+		return -EMFILE;
+	hsk = kmalloc(sizeof(*hsk), GFP_KERNEL);
+	if (!hsk)
+		return -ENOMEM;
+	mock_sock_init(hsk, homa, 0);
+
+	/* MTU-sized GSO limits ensure that every skb is exactly one packet
+	 * on the wire; the backend doesn't segment.
+	 */
+	mock_mtu = bypass_config.mtu;
+	mock_net_device.gso_max_size = bypass_config.mtu;
+
+	err = homa_sock_bind(&homa->port_map, hsk, port);
+	if (err)
+		goto error;
+	homa_pool_destroy(&hsk->buffer_pool);
+	err = homa_pool_init(hsk, buf_region, region_size, 0, 0);
+	if (err)
+		goto error;
+	bypass_socks[sock] = hsk;
+	return sock;
+
+error:
+	homa_sock_destroy(hsk);
+	kfree(hsk);
+	return err;
+}
+
+/**
+ * homa_bypass_close() - Close a socket opened by homa_bypass_socket; any
+ * outstanding RPCs on the socket are aborted.
+ * @sock:   Socket number; does nothing if the socket isn't open.
+ */
+void homa_bypass_close(int sock)
+{
+	struct homa_sock *hsk = bypass_sock(sock);
+
+	if (!hsk)
+		return;
+	homa_sock_destroy(hsk);
+	kfree(hsk);
+	bypass_socks[sock] = NULL;
+}
+
+/**
+ * homa_bypass_poll() - Perform background work (pacing, and timer
+ * processing such as retransmission). Should be invoked frequently,
+ * e.g. each time through the application's main loop.
+ *
+ * Return:  Nonzero if a timer tick was processed.
+ */
+int homa_bypass_poll(void)
+{
+	__u64 now = get_cycles();
+	int ticked = 0;
+
+	homa_check_pacer(homa, 0);
+	if (now >= bypass_next_tick) {
+		homa_timer(homa);
+		bypass_next_tick = now + bypass_tick_cycles;
+		ticked = 1;
+	}
+
+	/* The protocol code occasionally logs through UNIT_LOG; discard
+	 * the log so it doesn't grow without bound.
+	 */
+	unit_log_clear();
+	return ticked;
+}
+
+/**
+ * homa_bypass_rx() - Process an incoming packet. Packets that aren't
+ * Homa packets for the configured address family are ignored.
+ * @packet:   Packet contents, starting with the IP header; the caller can
+ *            reuse this memory as soon as this function returns.
+ * @length:   Number of bytes at @packet.
+ */
+void homa_bypass_rx(const void *packet, size_t length)
+{
+	const struct iphdr *iph = packet;
+	struct sk_buff *skb;
+	int ip_length;
+
+	if (length < sizeof(struct iphdr))
+		return;
+	if (bypass_config.ipv6) {
+		const struct ipv6hdr *ip6h = packet;
+
+		ip_length = sizeof(struct ipv6hdr);
+		if ((ip6h->version != 6) || (ip6h->nexthdr != IPPROTO_HOMA)
+				|| (length < ip_length))
+			return;
+		if (length > ip_length + ntohs(ip6h->payload_len))
+			length = ip_length + ntohs(ip6h->payload_len);
+	} else {
+		ip_length = iph->ihl * 4;
+		if ((iph->version != 4) || (iph->protocol != IPPROTO_HOMA)
+				|| (ip_length < sizeof(struct iphdr)))
+			return;
+		if (length > ntohs(iph->tot_len))
+			length = ntohs(iph->tot_len);
+	}
+	if (length < ip_length + sizeof(struct common_header))
+		return;
+
+	skb = alloc_skb(length, GFP_ATOMIC);
+	if (!skb)
+		return;
+	skb_reset_network_header(skb);
+	memcpy(skb_put(skb, length), packet, length);
+	skb_pull(skb, ip_length);
+	skb_reset_transport_header(skb);
+	homa_softirq(skb);
+}
+
+/**
+ * bypass_send() - Common code for homa_bypass_sendv and homa_bypass_replyv.
+ * @sock:          Socket number from homa_bypass_socket.
+ * @iov:           Describes the chunks of the message.
+ * @iovcnt:        Number of elements in @iov.
+ * @dest_addr:     Address of the message's destination.
+ * @args:          Same as the homa_sendmsg_args passed to sendmsg; the
+ *                 id of a new RPC is returned here.
+ *
+ * Return:         0 for success, otherwise a negative errno.
+ */
+static int bypass_send(int sock, const struct iovec *iov, int iovcnt,
+		const sockaddr_in_union *dest_addr,
+		struct homa_sendmsg_args *args)
+{
+	struct homa_sock *hsk = bypass_sock(sock);
+	struct iovec local_iovs[HOMA_BYPASS_MAX_IOVS];
+	struct iovec *iovs = local_iovs;
+	struct iov_iter iter;
+	size_t length = 0;
+	int i, result;
+
+	if (!hsk)
+		return -EBADF;
+	if ((iovcnt < 0) || (iovcnt > UIO_MAXIOV))
+		return -EINVAL;
+	if (dest_addr->in6.sin6_family != hsk->inet.sk.sk_family)
+		return -EAFNOSUPPORT;
+
+	/* The iov_iter functions modify the iovecs as they copy data, so
+	 * make a private copy.
+	 */
+	if (iovcnt > HOMA_BYPASS_MAX_IOVS) {
+		iovs = kmalloc(iovcnt * sizeof(*iovs), GFP_KERNEL);
+		if (!iovs)
+			return -ENOMEM;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		iovs[i] = iov[i];
+		length += iov[i].iov_len;
+	}
+	iov_iter_init(&iter, WRITE, iovs, iovcnt, length);
+	result = __homa_sendmsg(hsk, args, (sockaddr_in_union *) dest_addr,
+			&iter, 0);
+	if (iovs != local_iovs)
+		kfree(iovs);
+	return result;
+}
+
+/**
+ * homa_bypass_sendv() - Send a request message; same as homa_sendv
+ * except for the socket argument.
+ * @sock:               Socket number from homa_bypass_socket.
+ * @iov:                Describes the chunks of the request message.
+ * @iovcnt:             Number of elements in @iov.
+ * @dest_addr:          Address of the server.
+ * @id:                 If non-NULL, the id of the new RPC is stored here.
+ * @completion_cookie:  Returned by homa_bypass_recv when the RPC completes.
+ *
+ * Return:              0 for success, otherwise a negative errno.
+ */
+int homa_bypass_sendv(int sock, const struct iovec *iov, int iovcnt,
+		const sockaddr_in_union *dest_addr, uint64_t *id,
+		uint64_t completion_cookie)
+{
+	struct homa_sendmsg_args args;
+	int result;
+
+	args.id = 0;
+	args.completion_cookie = completion_cookie;
+	result = bypass_send(sock, iov, iovcnt, dest_addr, &args);
+	if ((result == 0) && id)
+		*id = args.id;
+	return result;
+}
+
+/**
+ * homa_bypass_replyv() - Send a response message; same as homa_replyv
+ * except for the socket argument.
+ * @sock:          Socket number from homa_bypass_socket.
+ * @iov:           Describes the chunks of the response message.
+ * @iovcnt:        Number of elements in @iov.
+ * @dest_addr:     Address of the client (as returned by homa_bypass_recv).
+ * @id:            Id of the request (as returned by homa_bypass_recv).
+ *
+ * Return:         0 for success, otherwise a negative errno.
+ */
+int homa_bypass_replyv(int sock, const struct iovec *iov, int iovcnt,
+		const sockaddr_in_union *dest_addr, uint64_t id)
+{
+	struct homa_sendmsg_args args;
+
+	args.id = id;
+	args.completion_cookie = 0;
+	return bypass_send(sock, iov, iovcnt, dest_addr, &args);
+}
+
+/**
+ * homa_bypass_recv() - Receive a message; similar to recvmsg on a Homa
+ * socket, except that it never blocks (HOMA_RECVMSG_NONBLOCKING is
+ * always set): the caller should keep processing incoming packets and
+ * try again if it returns -EAGAIN.
+ * @sock:       Socket number from homa_bypass_socket.
+ * @args:       Same as the struct homa_recvmsg_args passed to recvmsg
+ *              through msg_control (including the bpages to return).
+ * @src_addr:   The address of the message's sender is stored here.
+ *
+ * Return:      The length of the message, or a negative errno.
+ */
+ssize_t homa_bypass_recv(int sock, struct homa_recvmsg_args *args,
+		sockaddr_in_union *src_addr)
+{
+	struct homa_sock *hsk = bypass_sock(sock);
+	struct msghdr msg;
+	int addr_len;
+
+	if (!hsk)
+		return -EBADF;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = src_addr;
+	msg.msg_namelen = sizeof(*src_addr);
+	msg.msg_control = args;
+	msg.msg_controllen = sizeof(*args);
+	args->flags |= HOMA_RECVMSG_NONBLOCKING;
+	return homa_recvmsg(&hsk->inet.sk, &msg, HOMA_MAX_MESSAGE_LENGTH, 0,
+			&addr_len);
+}
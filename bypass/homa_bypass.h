@@ -0,0 +1,115 @@
+/* Copyright (c) 2023 Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* This file defines the API for libhoma_bypass, which runs the Homa
+ * protocol code in user space on top of a packet I/O backend such as
+ * AF_XDP or DPDK. The application (or a thin driver for its backend)
+ * passes incoming IP packets to homa_bypass_rx, transmits the packets
+ * handed to homa_bypass_ops.xmit, and calls homa_bypass_poll regularly.
+ * Messages are sent and received with the same arguments (and the same
+ * buffer pool discipline) as Homa's kernel API, but without any system
+ * calls.
+ *
+ * This is an experimental prototype, not a supported variant of Homa. It
+ * is built on the unit-test mock layer (test/mock.c) rather than a real
+ * userspace shim, which means:
+ * - A homa_bypass instance has no real locking and runs RCU callbacks
+ *   immediately, so it is only safe from a single thread.
+ * - Incoming checksums are not verified; the backend must drop damaged
+ *   packets (e.g. using NIC checksum offload).
+ * - It has not been built or tested as part of Homa's regular builds.
+ *
+ * A homa_bypass instance is not thread-safe: all of the functions below
+ * must be invoked from a single thread, in run-to-completion style. To use
+ * multiple cores, run one instance per core (e.g., one per hardware queue),
+ * each with its own local address or port range.
+ */
+
+#ifndef _HOMA_BYPASS_H
+#define _HOMA_BYPASS_H
+
+#include "homa.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * struct homa_bypass_ops - Describes the packet I/O backend.
+ */
+struct homa_bypass_ops {
+	/**
+	 * @xmit: Transmit a packet. @packet starts with an IPv4 or IPv6
+	 * header (the backend must add the link-level header) and it is
+	 * only valid until @xmit returns. @daddr is the packet's destination
+	 * (IPv4 addresses are IPv4-mapped), for use in neighbor lookup.
+	 * Returns 0 for success or a negative errno.
+	 */
+	int (*xmit)(void *context, const void *packet, size_t length,
+			const struct in6_addr *daddr);
+
+	/** @context: Passed to @xmit. */
+	void *context;
+};
+
+/**
+ * struct homa_bypass_config - Parameters for homa_bypass_init.
+ */
+struct homa_bypass_config {
+	/**
+	 * @local_addr: Source address for outgoing packets (IPv4-mapped
+	 * if @ipv6 is zero).
+	 */
+	struct in6_addr local_addr;
+
+	/** @ipv6: Nonzero means use IPv6; zero means IPv4. */
+	int ipv6;
+
+	/**
+	 * @mtu: Largest packet the backend can transmit, including the IP
+	 * header but not the link-level header.
+	 */
+	int mtu;
+
+	/**
+	 * @link_mbps: Bandwidth of the uplink, in Mbits/sec (used by
+	 * Homa's pacer); 0 means use Homa's default.
+	 */
+	int link_mbps;
+};
+
+extern int     homa_bypass_init(const struct homa_bypass_config *config,
+		const struct homa_bypass_ops *ops);
+extern void    homa_bypass_destroy(void);
+extern int     homa_bypass_socket(int port, void *buf_region,
+		size_t region_size);
+extern void    homa_bypass_close(int sock);
+extern int     homa_bypass_poll(void);
+extern ssize_t homa_bypass_recv(int sock, struct homa_recvmsg_args *args,
+		sockaddr_in_union *src_addr);
+extern void    homa_bypass_rx(const void *packet, size_t length);
+extern int     homa_bypass_sendv(int sock, const struct iovec *iov,
+		int iovcnt, const sockaddr_in_union *dest_addr,
+		uint64_t *id, uint64_t completion_cookie);
+extern int     homa_bypass_replyv(int sock, const struct iovec *iov,
+		int iovcnt, const sockaddr_in_union *dest_addr,
+		uint64_t id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _HOMA_BYPASS_H */
@@ -38,9 +38,11 @@ extern "C"
 
 /**
  * define HOMA_MAX_MESSAGE_LENGTH - Maximum bytes of payload in a Homa
- * request or response message.
+ * request or response message. Messages longer than
+ * HOMA_MAX_UNSTREAMED_LENGTH can only be received with
+ * HOMA_RECVMSG_STREAM.
  */
-#define HOMA_MAX_MESSAGE_LENGTH 1000000
+#define HOMA_MAX_MESSAGE_LENGTH 10000000
 
 /**
  * define HOMA_BPAGE_SIZE - Number of bytes in pages used for receive
@@ -50,11 +52,22 @@ extern "C"
 #define HOMA_BPAGE_SIZE (1 << HOMA_BPAGE_SHIFT)
 
 /**
- * define HOMA_MAX_BPAGES: The largest number of bpages that will be required
- * to store an incoming message.
+ * define HOMA_MAX_BPAGES: The largest number of bpages that can be returned
+ * by a single recvmsg call.
  */
-#define HOMA_MAX_BPAGES ((HOMA_MAX_MESSAGE_LENGTH + HOMA_BPAGE_SIZE - 1) \
-		>> HOMA_BPAGE_SHIFT)
+#define HOMA_MAX_BPAGES 16
+
+/**
+ * define HOMA_MAX_UNSTREAMED_LENGTH - Largest message that can be returned
+ * in its entirety by a single recvmsg call; longer messages must be received
+ * in pieces with HOMA_RECVMSG_STREAM.
+ */
+#define HOMA_MAX_UNSTREAMED_LENGTH 1000000
+#if !defined(__cplusplus)
+_Static_assert(HOMA_MAX_UNSTREAMED_LENGTH
+		<= (HOMA_MAX_BPAGES << HOMA_BPAGE_SHIFT),
+		"HOMA_MAX_UNSTREAMED_LENGTH needs too many bpages");
+#endif
 
 /**
  * define HOMA_MIN_DEFAULT_PORT - The 16-bit port space is divided into
@@ -101,6 +114,149 @@ _Static_assert(sizeof(struct homa_sendmsg_args) <= 16,
 		"homa_sendmsg_args grew");
 #endif
 
+/**
+ * define HOMA_MAX_SEND_BATCH - Largest number of messages that can be
+ * sent with a single HOMAIOCSEND ioctl (see homa_sendmmsg).
+ */
+#define HOMA_MAX_SEND_BATCH 256
+
+/**
+ * struct homa_sendmmsg_msg - Describes one of the messages sent by
+ * homa_sendmmsg.
+ */
+struct homa_sendmmsg_msg {
+	/**
+	 * @id: (in/out) Same as the field of the same name in struct
+	 * homa_sendmsg_args.
+	 */
+	uint64_t id;
+
+	/**
+	 * @completion_cookie: (in) Same as the field of the same name in
+	 * struct homa_sendmsg_args.
+	 */
+	uint64_t completion_cookie;
+
+	/** @dest_addr: (in) Address of the message's destination. */
+	sockaddr_in_union dest_addr;
+
+	/** @iovcnt: (in) Number of entries in @iov. */
+	uint32_t iovcnt;
+
+	/** @iov: (in) Describes the chunks of the message's data. */
+	const struct iovec *iov;
+
+	/**
+	 * @error: (out) 0 means the message was accepted for delivery;
+	 * otherwise this is a negative errno value describing why the
+	 * message couldn't be sent.
+	 */
+	int32_t error;
+
+	uint32_t _pad[1];
+};
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_sendmmsg_msg) >= 64,
+		"homa_sendmmsg_msg shrunk");
+_Static_assert(sizeof(struct homa_sendmmsg_msg) <= 64,
+		"homa_sendmmsg_msg grew");
+#endif
+
+/**
+ * struct homa_sendmmsg_args - Structure that passes arguments and results
+ * between user space and the HOMAIOCSEND ioctl.
+ */
+struct homa_sendmmsg_args {
+	/**
+	 * @num_msgs: (in) Number of entries in @msgs; must not exceed
+	 * HOMA_MAX_SEND_BATCH.
+	 */
+	uint32_t num_msgs;
+
+	uint32_t _pad[1];
+
+	/** @msgs: (in/out) Describes the messages to send. */
+	struct homa_sendmmsg_msg *msgs;
+};
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_sendmmsg_args) >= 16,
+		"homa_sendmmsg_args shrunk");
+_Static_assert(sizeof(struct homa_sendmmsg_args) <= 16,
+		"homa_sendmmsg_args grew");
+#endif
+
+/**
+ * define HOMA_MAX_MCAST_DESTS - Largest number of destinations for a
+ * single HOMAIOCMCAST ioctl (see homa_sendmcast).
+ */
+#define HOMA_MAX_MCAST_DESTS 1024
+
+/**
+ * struct homa_mcast_dest - Describes one of the destinations for a
+ * request sent with homa_sendmcast.
+ */
+struct homa_mcast_dest {
+	/**
+	 * @id: (out) Identifier for the new RPC sent to this destination
+	 * (only valid if @error is 0).
+	 */
+	uint64_t id;
+
+	/**
+	 * @completion_cookie: (in) Same as the field of the same name in
+	 * struct homa_sendmsg_args.
+	 */
+	uint64_t completion_cookie;
+
+	/** @dest_addr: (in) Address of the destination. */
+	sockaddr_in_union dest_addr;
+
+	/**
+	 * @error: (out) 0 means the request was accepted for delivery to
+	 * this destination; otherwise this is a negative errno value
+	 * describing why it couldn't be sent.
+	 */
+	int32_t error;
+
+	uint32_t _pad[2];
+};
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_mcast_dest) >= 56,
+		"homa_mcast_dest shrunk");
+_Static_assert(sizeof(struct homa_mcast_dest) <= 56,
+		"homa_mcast_dest grew");
+#endif
+
+/**
+ * struct homa_mcast_args - Structure that passes arguments and results
+ * between user space and the HOMAIOCMCAST ioctl.
+ */
+struct homa_mcast_args {
+	/** @iov: (in) Describes the chunks of the request's data. */
+	const struct iovec *iov;
+
+	/** @iovcnt: (in) Number of entries in @iov. */
+	uint32_t iovcnt;
+
+	/**
+	 * @num_dests: (in) Number of entries in @dests; must not exceed
+	 * HOMA_MAX_MCAST_DESTS.
+	 */
+	uint32_t num_dests;
+
+	/**
+	 * @dests: (in/out) One entry for each destination; the same
+	 * request will be sent (as a separate RPC) to each of them.
+	 */
+	struct homa_mcast_dest *dests;
+};
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_mcast_args) >= 24,
+		"homa_mcast_args shrunk");
+_Static_assert(sizeof(struct homa_mcast_args) <= 24,
+		"homa_mcast_args grew");
+#endif
+
 /**
  * struct homa_recvmsg_args - Provides information needed by Homa's
  * recvmsg; passed to recvmsg using the msg_control field.
@@ -168,7 +324,100 @@ _Static_assert(sizeof(struct homa_recvmsg_args) <= 120,
 #define HOMA_RECVMSG_REQUEST       0x01
 #define HOMA_RECVMSG_RESPONSE      0x02
 #define HOMA_RECVMSG_NONBLOCKING   0x04
-#define HOMA_RECVMSG_VALID_FLAGS   0x07
+#define HOMA_RECVMSG_STREAM        0x08
+#define HOMA_RECVMSG_VALID_FLAGS   0x0f
+
+/**
+ * define HOMA_MAX_RECV_BATCH - Largest number of messages that can be
+ * returned by a single batched recvmsg call (see struct homa_recvmmsg_args).
+ */
+#define HOMA_MAX_RECV_BATCH 64
+
+/**
+ * struct homa_recvmmsg_msg - Describes one of the messages returned by a
+ * batched recvmsg call.
+ */
+struct homa_recvmmsg_msg {
+	/** @id: (out) Id of the RPC for this message. */
+	uint64_t id;
+
+	/**
+	 * @completion_cookie: (out) Same as the field of the same name in
+	 * struct homa_recvmsg_args.
+	 */
+	uint64_t completion_cookie;
+
+	/**
+	 * @length: (out) Length of the message in bytes, or a negative
+	 * errno value if the RPC failed.
+	 */
+	int32_t length;
+
+	/**
+	 * @num_bpages: (in/out) Number of valid entries in @bpage_offsets.
+	 * On output describes the buffers for this message; on input,
+	 * describes buffers from a previous batch that are being returned
+	 * to Homa (see num_msgs in struct homa_recvmmsg_args).
+	 */
+	uint32_t num_bpages;
+
+	/** @peer_addr: (out) Address of the sender of the message. */
+	sockaddr_in_union peer_addr;
+
+	uint32_t _pad[1];
+
+	/**
+	 * @bpage_offsets: (in/out) Same as the field of the same name in
+	 * struct homa_recvmsg_args.
+	 */
+	uint32_t bpage_offsets[HOMA_MAX_BPAGES];
+};
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_recvmmsg_msg) >= 120,
+		"homa_recvmmsg_msg shrunk");
+_Static_assert(sizeof(struct homa_recvmmsg_msg) <= 120,
+		"homa_recvmmsg_msg grew");
+#endif
+
+/**
+ * struct homa_recvmmsg_args - Passed to recvmsg in place of struct
+ * homa_recvmsg_args (with msg_controllen set to the size of this struct)
+ * in order to receive several messages with a single kernel call.
+ */
+struct homa_recvmmsg_args {
+	/**
+	 * @flags: (in) Same as the field of the same name in struct
+	 * homa_recvmsg_args. Only the first message is waited for; once
+	 * one message has been found, recvmsg returns as many additional
+	 * messages as are ready, without blocking.
+	 */
+	int flags;
+
+	/**
+	 * @num_msgs: (in/out) On input, the number of leading entries in
+	 * @msgs that describe buffers from a previous call; these buffers
+	 * are returned to Homa. On output, the number of entries in @msgs
+	 * that describe newly received messages.
+	 */
+	uint32_t num_msgs;
+
+	/**
+	 * @max_msgs: (in) Number of entries available at @msgs; must not
+	 * exceed HOMA_MAX_RECV_BATCH.
+	 */
+	uint32_t max_msgs;
+
+	uint32_t _pad[1];
+
+	/** @msgs: Array of descriptors for messages. */
+	struct homa_recvmmsg_msg *msgs;
+};
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_recvmmsg_args) >= 24,
+		"homa_recvmmsg_args shrunk");
+_Static_assert(sizeof(struct homa_recvmmsg_args) <= 24,
+		"homa_recvmmsg_args grew");
+#endif
 
 /**
  * struct homa_abort_args - Structure that passes arguments and results
@@ -204,6 +453,391 @@ struct homa_set_buf_args {
 	size_t length;
 };
 
+/** define SO_HOMA_SET_RINGS: setsockopt option for enabling I/O rings. */
+#define SO_HOMA_SET_RINGS 11
+
+/**
+ * define SO_HOMA_ZEROCOPY: setsockopt option for enabling zero-copy
+ * transmission. The option value is an int: outgoing messages at least
+ * this long are transmitted directly from user pages, and a notification
+ * is posted on the socket's error queue (MSG_ERRQUEUE) once the pages can
+ * be reused. 0 disables zero-copy (the default).
+ */
+#define SO_HOMA_ZEROCOPY 12
+
+/**
+ * define SO_HOMA_BUF_EXTENTS: setsockopt option that reserves part of the
+ * buffer region for large messages. The option value is a uint64_t byte
+ * count; that many bytes at the end of the region (rounded down to a
+ * multiple of HOMA_BPAGE_SIZE) are used to give each message longer than
+ * HOMA_BPAGE_SIZE a range of consecutive bpages, so that the message is
+ * contiguous in the region. Must be set before SO_HOMA_SET_BUF; 0 (the
+ * default) disables extents.
+ */
+#define SO_HOMA_BUF_EXTENTS 13
+
+/**
+ * define SO_HOMA_BUF_NODES: setsockopt option that divides the buffer region
+ * among NUMA nodes. The option value is an int n: the part of the region
+ * before any extent area (see SO_HOMA_BUF_EXTENTS) is split into n equal
+ * sub-regions, where sub-region i is assumed to reside on node i (the
+ * application should bind it there, e.g. with mbind). Incoming messages
+ * are then placed, when possible, in the sub-region for the node where
+ * the thread receiving on the socket runs. Must be set before
+ * SO_HOMA_SET_BUF; 0 (the default) disables NUMA placement.
+ */
+#define SO_HOMA_BUF_NODES 14
+
+/**
+ * define SO_HOMA_SOFTIRQ_COPY: setsockopt option for copying incoming data
+ * to the buffer region as packets arrive. The option value is an int:
+ * for incoming messages at least this long, each packet is copied into
+ * the message's buffer space by the core that receives it (in SoftIRQ),
+ * rather than by the thread that invokes recvmsg. The buffer region is
+ * pinned in memory while the socket exists. Must be set before
+ * SO_HOMA_SET_BUF; 0 (the default) disables SoftIRQ copying.
+ */
+#define SO_HOMA_SOFTIRQ_COPY 15
+
+/**
+ * define SO_HOMA_POOL_STATS: getsockopt option that returns a
+ * struct homa_pool_stats describing the socket's buffer pool.
+ */
+#define SO_HOMA_POOL_STATS 16
+
+/**
+ * struct homa_pool_stats - getsockopt result for SO_HOMA_POOL_STATS. The
+ * counters are cumulative over the life of the socket.
+ */
+struct homa_pool_stats {
+	/** @num_bpages: Total number of bpages in the buffer region. */
+	uint32_t num_bpages;
+
+	/**
+	 * @free_bpages: Number of bpages not currently committed to any
+	 * message (bpages in the extent area aren't counted).
+	 */
+	uint32_t free_bpages;
+
+	/**
+	 * @waiting_rpcs: Number of incoming messages that are waiting for
+	 * buffer space; their packets are dropped and no grants are sent
+	 * for them until space is available.
+	 */
+	uint32_t waiting_rpcs;
+
+	/**
+	 * @bpages_needed: Number of free bpages needed before the first of
+	 * the waiting messages can be admitted; 0 if @waiting_rpcs is 0.
+	 */
+	uint32_t bpages_needed;
+
+	/**
+	 * @alloc_failures: Number of times an incoming message couldn't
+	 * be given buffer space and had to wait.
+	 */
+	uint64_t alloc_failures;
+
+	/**
+	 * @dropped_bytes: Bytes of incoming data discarded because their
+	 * message had no buffer space.
+	 */
+	uint64_t dropped_bytes;
+
+	/**
+	 * @grant_skips: Number of times the grant scheduler passed over
+	 * a message on this socket because it had no buffer space.
+	 */
+	uint64_t grant_skips;
+};
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_pool_stats) >= 40,
+		"homa_pool_stats shrunk");
+_Static_assert(sizeof(struct homa_pool_stats) <= 40,
+		"homa_pool_stats grew");
+#endif
+
+/**
+ * define SO_HOMA_WEIGHT: setsockopt option that sets the socket's share of
+ * the host's incoming and paced outgoing bandwidth, relative to other Homa
+ * sockets. The option value is an int between 1 (the default) and
+ * HOMA_MAX_WEIGHT. Weights are only used when the weighted_shares sysctl
+ * parameter is nonzero: then messages are scheduled SRPT within each
+ * socket, but bandwidth is divided among sockets in proportion to their
+ * weights.
+ */
+#define SO_HOMA_WEIGHT 17
+
+/** define HOMA_MAX_WEIGHT: largest value allowed for SO_HOMA_WEIGHT. */
+#define HOMA_MAX_WEIGHT 1000
+
+/**
+ * define SO_HOMA_SHARE_STATS: getsockopt option that returns a
+ * struct homa_share_stats for the socket.
+ */
+#define SO_HOMA_SHARE_STATS 18
+
+/**
+ * struct homa_share_stats - getsockopt result for SO_HOMA_SHARE_STATS.
+ * The counters are cumulative over the life of the socket.
+ */
+struct homa_share_stats {
+	/** @weight: The socket's current weight (see SO_HOMA_WEIGHT). */
+	uint32_t weight;
+
+	/** @_pad: Reserved; Homa always returns zero here. */
+	uint32_t _pad;
+
+	/** @granted_bytes: Bytes granted to incoming messages. */
+	uint64_t granted_bytes;
+
+	/**
+	 * @paced_bytes: Bytes of outgoing messages transmitted by the
+	 * pacer (data that could be sent immediately isn't counted).
+	 */
+	uint64_t paced_bytes;
+
+	/**
+	 * @share_limited: Number of times an incoming message wasn't
+	 * granted because the socket had already received its share of
+	 * the grants.
+	 */
+	uint64_t share_limited;
+};
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_share_stats) >= 32,
+		"homa_share_stats shrunk");
+_Static_assert(sizeof(struct homa_share_stats) <= 32,
+		"homa_share_stats grew");
+#endif
+
+/**
+ * struct homa_ring_ctl - Occupies the first bytes of the region passed
+ * to SO_HOMA_SET_RINGS; holds the indexes for the submission and
+ * completion rings. All indexes increase monotonically (they are reduced
+ * modulo the ring size to obtain entry positions).
+ */
+struct homa_ring_ctl {
+	/** @sq_head: Index of the next submission entry Homa will consume. */
+	uint32_t sq_head;
+
+	/** @sq_tail: Index of the next submission entry the app will fill. */
+	uint32_t sq_tail;
+
+	/** @cq_head: Index of the next completion the app will consume. */
+	uint32_t cq_head;
+
+	/** @cq_tail: Index of the next completion entry Homa will fill. */
+	uint32_t cq_tail;
+
+	/**
+	 * @flags: Bits set by Homa, such as HOMA_RING_NEED_WAKEUP; see
+	 * below.
+	 */
+	uint32_t flags;
+
+	uint32_t _pad[11];
+};
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_ring_ctl) == 64,
+		"homa_ring_ctl changed size");
+#endif
+
+/**
+ * define HOMA_RING_NEED_WAKEUP - Set in homa_ring_ctl.flags when the
+ * kernel polling thread for a ring has gone to sleep; the application must
+ * invoke HOMAIOCRING to wake it up after adding submissions.
+ */
+#define HOMA_RING_NEED_WAKEUP   1
+
+/* Values for the opcode field of struct homa_ring_sqe. */
+#define HOMA_SQE_SEND           1
+#define HOMA_SQE_RELEASE        2
+
+/**
+ * struct homa_ring_sqe - An entry in the submission ring.
+ */
+struct homa_ring_sqe {
+	/** @opcode: Operation to perform, such as HOMA_SQE_SEND. */
+	uint32_t opcode;
+
+	uint32_t _pad[1];
+
+	/**
+	 * @user_data: Returned in the completion for a HOMA_SQE_SEND;
+	 * not interpreted by Homa.
+	 */
+	uint64_t user_data;
+
+	union {
+		/** @send: Describes the message for HOMA_SQE_SEND. */
+		struct homa_sendmmsg_msg send;
+
+		/** @release: Buffers to return for HOMA_SQE_RELEASE. */
+		struct {
+			uint32_t num_bpages;
+			uint32_t bpage_offsets[HOMA_MAX_BPAGES];
+		} release;
+	};
+};
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_ring_sqe) == 88,
+		"homa_ring_sqe changed size");
+#endif
+
+/* Values for the type field of struct homa_ring_cqe. */
+#define HOMA_CQE_MESSAGE        1
+#define HOMA_CQE_SEND           2
+
+/**
+ * struct homa_ring_cqe - An entry in the completion ring.
+ */
+struct homa_ring_cqe {
+	/**
+	 * @type: HOMA_CQE_MESSAGE means @msg describes an incoming message
+	 * (or failed RPC), exactly as for a batched recvmsg.
+	 * HOMA_CQE_SEND reports the outcome of a HOMA_SQE_SEND: @msg.id
+	 * holds the RPC's id and @msg.length holds 0 or a negative errno.
+	 */
+	uint32_t type;
+
+	uint32_t _pad[1];
+
+	/** @user_data: Copied from the sqe, for HOMA_CQE_SEND. */
+	uint64_t user_data;
+
+	/** @msg: Information about the completion. */
+	struct homa_recvmmsg_msg msg;
+};
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_ring_cqe) == 136,
+		"homa_ring_cqe changed size");
+#endif
+
+/** struct homa_set_rings_args - setsockopt argument for SO_HOMA_SET_RINGS. */
+struct homa_set_rings_args {
+	/**
+	 * @start: First byte of the ring region: a struct homa_ring_ctl
+	 * followed by @sq_entries submission entries and then @cq_entries
+	 * completion entries.
+	 */
+	void *start;
+
+	/** @length: Total number of bytes available at @start. */
+	size_t length;
+
+	/** @sq_entries: Size of the submission ring (a power of 2). */
+	uint32_t sq_entries;
+
+	/** @cq_entries: Size of the completion ring (a power of 2). */
+	uint32_t cq_entries;
+
+	/**
+	 * @recv_flags: HOMA_RECVMSG_REQUEST, HOMA_RECVMSG_RESPONSE, or both:
+	 * selects which incoming messages are posted to the completion ring.
+	 */
+	int recv_flags;
+
+	/**
+	 * @poll_usecs: Nonzero means Homa will create a kernel thread that
+	 * services the rings without any system calls; the thread sleeps
+	 * (setting HOMA_RING_NEED_WAKEUP) after it has been idle for this
+	 * many microseconds. Zero means rings are serviced only during
+	 * HOMAIOCRING calls.
+	 */
+	int poll_usecs;
+};
+
+/**
+ * struct homa_ring_enter_args - Structure that passes arguments between
+ * user space and the HOMAIOCRING ioctl.
+ */
+struct homa_ring_enter_args {
+	/**
+	 * @min_complete: Don't return until at least this many incoming
+	 * messages have been posted to the completion ring (only used
+	 * if there is no polling thread; 0 means don't wait).
+	 */
+	uint32_t min_complete;
+
+	uint32_t _pad[3];
+};
+
+/**
+ * define HOMA_METRICS_MAGIC - Value of the magic field in
+ * struct homa_metrics_header ("HMET").
+ */
+#define HOMA_METRICS_MAGIC      0x484d4554
+
+/**
+ * define HOMA_METRICS_VERSION - Value of the version field in struct
+ * homa_metrics_header. Incremented whenever the layout of
+ * /proc/net/homa_metrics_bin changes in a way that isn't described by
+ * the schema.
+ */
+#define HOMA_METRICS_VERSION    1
+
+/**
+ * struct homa_metrics_header - Occupies the first bytes of
+ * /proc/net/homa_metrics_bin. It is followed by @num_fields instances of
+ * struct homa_metrics_field (the schema), then by @num_cores records of
+ * @core_bytes bytes each, one per core, containing that core's counters.
+ * Each counter is a uint64_t in host byte order.
+ */
+struct homa_metrics_header {
+	/** @magic: Always HOMA_METRICS_MAGIC. */
+	uint32_t magic;
+
+	/** @version: Always HOMA_METRICS_VERSION. */
+	uint16_t version;
+
+	/** @header_bytes: sizeof(struct homa_metrics_header). */
+	uint16_t header_bytes;
+
+	/** @num_fields: Number of entries in the schema. */
+	uint32_t num_fields;
+
+	/** @num_cores: Number of per-core records in the file. */
+	uint32_t num_cores;
+
+	/**
+	 * @core_bytes: Size of each per-core record; always a multiple
+	 * of 8.
+	 */
+	uint32_t core_bytes;
+
+	/** @cores_offset: Offset within the file of the record for core 0. */
+	uint32_t cores_offset;
+
+	/** @cpu_khz: Clock rate for the RDTSC counter, in khz. */
+	uint64_t cpu_khz;
+
+	uint64_t _pad[2];
+};
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_metrics_header) == 48,
+		"homa_metrics_header changed size");
+#endif
+
+/**
+ * struct homa_metrics_field - Describes one counter (or array of counters)
+ * in the per-core records of /proc/net/homa_metrics_bin.
+ */
+struct homa_metrics_field {
+	/** @name: NULL-terminated name of the counter. */
+	char name[40];
+
+	/** @offset: Byte offset of the counter within each per-core record. */
+	uint32_t offset;
+
+	/** @count: Number of consecutive uint64_t values for the counter. */
+	uint32_t count;
+};
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_metrics_field) == 48,
+		"homa_metrics_field changed size");
+#endif
+
 /**
  * Meanings of the bits in Homa's flag word, which can be set using
  * "sysctl /net/homa/flags".
@@ -222,6 +856,9 @@ struct homa_set_buf_args {
 
 #define HOMAIOCREPLY  _IOWR(0x89, 0xe2, struct homa_reply_args)
 #define HOMAIOCABORT  _IOWR(0x89, 0xe3, struct homa_abort_args)
+#define HOMAIOCSEND   _IOWR(0x89, 0xe4, struct homa_sendmmsg_args)
+#define HOMAIOCRING   _IOWR(0x89, 0xe5, struct homa_ring_enter_args)
+#define HOMAIOCMCAST  _IOWR(0x89, 0xe6, struct homa_mcast_args)
 #define HOMAIOCFREEZE _IO(0x89, 0xef)
 
 extern int     homa_abortp(int fd, struct homa_abort_args *args);
@@ -239,6 +876,10 @@ extern ssize_t homa_replyv(int sockfd, const struct iovec *iov,
 		int iovcnt, const sockaddr_in_union *dest_addr,
 		uint64_t id);
 extern int     homa_abort(int sockfd, uint64_t id, int error);
+extern int     homa_sendmmsg(int sockfd, struct homa_sendmmsg_msg *msgs,
+		int num_msgs);
+extern int     homa_sendmcast(int sockfd, const struct iovec *iov,
+		int iovcnt, struct homa_mcast_dest *dests, int num_dests);
 
 #ifdef __cplusplus
 }
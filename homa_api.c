@@ -197,6 +197,61 @@ int homa_sendv(int sockfd, const struct iovec *iov, int iovcnt,
 	return result;
 }
 
+/**
+ * homa_sendmmsg() - Send several request and/or response messages with a
+ * single kernel call.
+ * @sockfd:     File descriptor for the socket on which to send the messages.
+ * @msgs:       Describes the messages to send. For each entry, an @id of 0
+ *              means the message is a new request (and the id of the new
+ *              RPC will be returned in @id); otherwise the message is a
+ *              response for the RPC given by @id. The @error field of each
+ *              entry will be set to indicate whether that message was sent.
+ * @num_msgs:   Number of entries in @msgs (at most HOMA_MAX_SEND_BATCH).
+ *
+ * Return:      The number of messages accepted for delivery. If an error
+ *              prevented any messages from being processed, -1 is
+ *              returned and errno is set appropriately.
+ */
+int homa_sendmmsg(int sockfd, struct homa_sendmmsg_msg *msgs, int num_msgs)
+{
+	struct homa_sendmmsg_args args;
+
+	args.num_msgs = num_msgs;
+	args._pad[0] = 0;
+	args.msgs = msgs;
+	return ioctl(sockfd, HOMAIOCSEND, &args);
+}
+
+/**
+ * homa_sendmcast() - Send the same request message to several destinations
+ * with a single kernel call. The message data is copied from user space
+ * only once and shared by all of the resulting RPCs, which is much cheaper
+ * than sending the message separately to each destination.
+ * @sockfd:     File descriptor for the socket on which to send the requests.
+ * @iov:        Pointer to array that describes the chunks of the message.
+ * @iovcnt:     Number of elements in @iov.
+ * @dests:      One entry for each destination. On return, the @id field
+ *              of each entry holds the id of the RPC for that destination
+ *              and the @error field indicates whether the request was sent
+ *              to that destination.
+ * @num_dests:  Number of entries in @dests (at most HOMA_MAX_MCAST_DESTS).
+ *
+ * Return:      The number of destinations to which the request was sent.
+ *              If an error prevented the request from being sent to any
+ *              destination, -1 is returned and errno is set appropriately.
+ */
+int homa_sendmcast(int sockfd, const struct iovec *iov, int iovcnt,
+		struct homa_mcast_dest *dests, int num_dests)
+{
+	struct homa_mcast_args args;
+
+	args.iov = iov;
+	args.iovcnt = iovcnt;
+	args.num_dests = num_dests;
+	args.dests = dests;
+	return ioctl(sockfd, HOMAIOCMCAST, &args);
+}
+
 /**
  * homa_abort() - Terminate the execution of an RPC.
  * @sockfd:     File descriptor for the socket associated with the RPC.
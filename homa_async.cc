@@ -0,0 +1,436 @@
+/* Copyright (c) 2023 Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "homa_async.h"
+
+/**
+ * homa::async_message::reset() - Give up ownership of the message, if any,
+ * returning its buffer space to the socket.
+ */
+void homa::async_message::reset()
+{
+	if (msg == nullptr)
+		return;
+	sock->release(msg);
+	msg = nullptr;
+}
+
+/**
+ * homa::async_socket::async_socket() - Constructor for async_sockets.
+ * No messages are received until either start is invoked or the
+ * application begins invoking process.
+ * @fd:          Homa socket to use for RPCs. The caller is responsible for
+ *               setting up buffering on the socket using setsockopt with the
+ *               SO_HOMA_SET_BUF option, and for closing the socket after
+ *               this object has been destroyed.
+ * @buf_region:  Location of the buffer region that was allocated for
+ *               this socket.
+ * @num_workers: Number of worker threads to create for executing callbacks
+ *               and request handlers; 0 means they execute on the thread
+ *               that invokes process.
+ * @busy_poll:   True means the poller thread spins rather than sleeping
+ *               while it waits for messages (lower latency, but it
+ *               consumes an entire core).
+ */
+homa::async_socket::async_socket(int fd, void *buf_region, int num_workers,
+		bool busy_poll)
+	: sock_fd(fd)
+	, wake_fd(eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC))
+	, busy_poll(busy_poll)
+	, receiver(fd, buf_region)
+	, handler()
+	, next_cookie(1)
+	, pending_mutex()
+	, pending()
+	, release_mutex()
+	, released()
+	, task_mutex()
+	, task_cond()
+	, tasks()
+	, stopping(false)
+	, poll_thread()
+	, workers()
+{
+	for (int i = 0; i < num_workers; i++)
+		workers.emplace_back(&async_socket::worker, this);
+}
+
+/**
+ * homa::async_socket::~async_socket() - Destructor for async_sockets.
+ * Outstanding RPCs complete with the error ECANCELED.
+ */
+homa::async_socket::~async_socket()
+{
+	std::unordered_map<uint64_t, response_callback> orphans;
+
+	stop();
+	release_pending();
+	{
+		std::lock_guard<std::mutex> lock(pending_mutex);
+		orphans.swap(pending);
+	}
+	for (auto &entry : orphans)
+		entry.second(async_message(), ECANCELED);
+	release_pending();
+	if (wake_fd >= 0)
+		close(wake_fd);
+}
+
+/**
+ * homa::async_socket::call() - Issue an RPC, invoking a callback when it
+ * completes.
+ * @dest:      Address of the server.
+ * @iov:       Describes the request message; the data is copied before
+ *             this method returns.
+ * @iovcnt:    Number of entries in @iov.
+ * @callback:  Invoked when the response arrives or the RPC fails. It
+ *             may be invoked before this method returns.
+ * Return:     0 means the request was sent. Otherwise -1 is returned, errno
+ *             describes the problem, and @callback will not be invoked.
+ */
+int homa::async_socket::call(const sockaddr_in_union *dest,
+		const struct iovec *iov, int iovcnt, response_callback callback)
+{
+	uint64_t cookie = next_cookie.fetch_add(1);
+	uint64_t id;
+
+	/* The callback must be registered before the request is sent,
+	 * since the response could arrive before homa_sendv returns.
+	 */
+	{
+		std::lock_guard<std::mutex> lock(pending_mutex);
+		pending[cookie] = std::move(callback);
+	}
+	if (homa_sendv(sock_fd, iov, iovcnt, dest, &id, cookie) < 0) {
+		int error = errno;
+		std::lock_guard<std::mutex> lock(pending_mutex);
+		pending.erase(cookie);
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * homa::async_socket::call() - Issue an RPC, returning a future for its
+ * response.
+ * @dest:      Address of the server.
+ * @iov:       Describes the request message; the data is copied before
+ *             this method returns.
+ * @iovcnt:    Number of entries in @iov.
+ * Return:     A future for the response. If the RPC fails, get() on the
+ *             future throws std::system_error.
+ */
+std::future<homa::async_message> homa::async_socket::call(
+		const sockaddr_in_union *dest, const struct iovec *iov,
+		int iovcnt)
+{
+	auto promise = std::make_shared<std::promise<async_message>>();
+	std::future<async_message> result = promise->get_future();
+
+	if (call(dest, iov, iovcnt, [promise](async_message msg, int error) {
+		if (error)
+			promise->set_exception(std::make_exception_ptr(
+					std::system_error(error,
+					std::generic_category())));
+		else
+			promise->set_value(std::move(msg));
+	}) < 0)
+		promise->set_exception(std::make_exception_ptr(
+				std::system_error(errno,
+				std::generic_category())));
+	return result;
+}
+
+/**
+ * homa::async_socket::call() - Issue an RPC whose request is in a single
+ * contiguous buffer, returning a future for its response.
+ * @dest:      Address of the server.
+ * @request:   First byte of the request message.
+ * @length:    Number of bytes in the request message.
+ * Return:     A future for the response. If the RPC fails, get() on the
+ *             future throws std::system_error.
+ */
+std::future<homa::async_message> homa::async_socket::call(
+		const sockaddr_in_union *dest, const void *request,
+		size_t length)
+{
+	struct iovec iov;
+
+	iov.iov_base = const_cast<void *>(request);
+	iov.iov_len = length;
+	return call(dest, &iov, 1);
+}
+
+/**
+ * homa::async_socket::dispatch() - Arrange for the appropriate callback or
+ * handler to be invoked for an incoming message.
+ * @msg:     Newly received message.
+ */
+void homa::async_socket::dispatch(multi_receiver::message *msg)
+{
+	task t;
+
+	t.msg = msg;
+	t.error = 0;
+	t.request = msg->is_request();
+	if (t.request) {
+		if (!handler || (msg->length() < 0)) {
+			receiver.release(msg);
+			return;
+		}
+	} else {
+		std::lock_guard<std::mutex> lock(pending_mutex);
+		auto it = pending.find(msg->completion_cookie());
+		if (it == pending.end()) {
+			receiver.release(msg);
+			return;
+		}
+		t.callback = std::move(it->second);
+		pending.erase(it);
+	}
+	if (msg->length() < 0) {
+		t.error = -msg->length();
+		t.msg = nullptr;
+		receiver.release(msg);
+	}
+
+	if (workers.empty()) {
+		run(t);
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(task_mutex);
+		tasks.push_back(std::move(t));
+	}
+	task_cond.notify_one();
+}
+
+/**
+ * homa::async_socket::poller() - Top-level method for the poller thread:
+ * repeatedly invokes process until stop is invoked.
+ */
+void homa::async_socket::poller()
+{
+	struct pollfd fds[2];
+
+	fds[0].fd = sock_fd;
+	fds[1].fd = wake_fd;
+	fds[1].events = POLLIN;
+	while (!stopping.load()) {
+		if (!busy_poll) {
+			/* Don't wait for new messages if there is no room
+			 * for them; an application release will wake us.
+			 */
+			release_pending();
+			fds[0].events = receiver.num_free() ? POLLIN : 0;
+			if ((::poll(fds, 2, -1) < 0) && (errno != EINTR))
+				break;
+		}
+		if ((process() < 0) && (errno != EINTR))
+			break;
+	}
+}
+
+/**
+ * homa::async_socket::process() - Return released buffer space to Homa,
+ * then receive all of the messages that are ready (without blocking) and
+ * dispatch them. This method is invoked by the poller thread, if there is
+ * one; otherwise the application must invoke it whenever fd() or
+ * event_fd() becomes readable. It must not be invoked concurrently.
+ * Return:   The number of messages received, or -1 if an error occurred,
+ *           in which case errno describes it.
+ */
+int homa::async_socket::process()
+{
+	multi_receiver::message *msgs[HOMA_MAX_RECV_BATCH];
+	int flags = HOMA_RECVMSG_RESPONSE | HOMA_RECVMSG_NONBLOCKING;
+	uint64_t count;
+	int num_msgs;
+
+	/* Reset the eventfd; an error just means it wasn't readable. */
+	if (!busy_poll && (read(wake_fd, &count, sizeof(count)) < 0))
+		count = 0;
+	release_pending();
+	if (receiver.num_free() == 0) {
+		receiver.flush();
+		return 0;
+	}
+	if (handler)
+		flags |= HOMA_RECVMSG_REQUEST;
+	num_msgs = receiver.receive(flags, msgs);
+	if (num_msgs < 0)
+		return (errno == EAGAIN) ? 0 : -1;
+	for (int i = 0; i < num_msgs; i++)
+		dispatch(msgs[i]);
+	return num_msgs;
+}
+
+/**
+ * homa::async_socket::release() - Invoked by async_message when the
+ * application no longer needs a message. May be invoked on any thread.
+ * @msg:    The message.
+ */
+void homa::async_socket::release(multi_receiver::message *msg)
+{
+	uint64_t one = 1;
+
+	{
+		std::lock_guard<std::mutex> lock(release_mutex);
+		released.push_back(msg);
+	}
+
+	/* Wake the thread running process, so the buffer space gets
+	 * back to Homa promptly.
+	 */
+	if (!busy_poll && (write(wake_fd, &one, sizeof(one)) < 0))
+		return;
+}
+
+/**
+ * homa::async_socket::release_pending() - Pass all of the messages
+ * released by the application to @receiver. Must be invoked only by the
+ * thread running process (or after that thread has exited).
+ */
+void homa::async_socket::release_pending()
+{
+	std::vector<multi_receiver::message *> msgs;
+
+	{
+		std::lock_guard<std::mutex> lock(release_mutex);
+		msgs.swap(released);
+	}
+	for (multi_receiver::message *msg : msgs)
+		receiver.release(msg);
+}
+
+/**
+ * homa::async_socket::reply() - Send the response for an incoming request.
+ * @request:  The request, as passed to the request handler. It must
+ *            still refer to the message, but the message's contents
+ *            need not be accessed after this method returns.
+ * @iov:      Describes the response message.
+ * @iovcnt:   Number of entries in @iov.
+ * Return:    0 means the response was sent. Otherwise -1 is returned and
+ *            errno describes the problem.
+ */
+int homa::async_socket::reply(const async_message &request,
+		const struct iovec *iov, int iovcnt)
+{
+	if (!request) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (homa_replyv(sock_fd, iov, iovcnt, request->src_addr(),
+			request->id()) < 0)
+		return -1;
+	return 0;
+}
+
+/**
+ * homa::async_socket::run() - Invoke the callback or handler for a task.
+ * @t:     The task.
+ */
+void homa::async_socket::run(task &t)
+{
+	async_message msg = t.msg ? async_message(this, t.msg)
+			: async_message();
+
+	if (t.request)
+		handler(*this, std::move(msg));
+	else
+		t.callback(std::move(msg), t.error);
+}
+
+/**
+ * homa::async_socket::serve() - Accept incoming requests on the socket,
+ * passing each of them to a handler. Must be invoked before start (or
+ * before the first call to process).
+ * @handler:   Invoked for each incoming request.
+ */
+void homa::async_socket::serve(request_handler handler)
+{
+	this->handler = std::move(handler);
+}
+
+/**
+ * homa::async_socket::start() - Start a poller thread, which receives
+ * incoming messages and dispatches them. Don't invoke process if
+ * this method has been invoked.
+ */
+void homa::async_socket::start()
+{
+	if (!poll_thread.joinable())
+		poll_thread = std::thread(&async_socket::poller, this);
+}
+
+/**
+ * homa::async_socket::stop() - Stop the poller and worker threads; no
+ * more callbacks or handlers will be invoked after this method returns
+ * (except for outstanding RPCs, whose callbacks are invoked with the
+ * error ECANCELED when this object is destroyed).
+ */
+void homa::async_socket::stop()
+{
+	uint64_t one = 1;
+
+	if (stopping.exchange(true))
+		return;
+	if (write(wake_fd, &one, sizeof(one)) < 0) {
+		/* Nothing to do: the poller will see stopping when its
+		 * current call to poll returns.
+		 */
+	}
+	if (poll_thread.joinable())
+		poll_thread.join();
+	{
+		/* Holding the lock ensures that no worker can miss the
+		 * change to stopping between testing it and waiting.
+		 */
+		std::lock_guard<std::mutex> lock(task_mutex);
+	}
+	task_cond.notify_all();
+	for (std::thread &thread : workers)
+		thread.join();
+	workers.clear();
+}
+
+/**
+ * homa::async_socket::worker() - Top-level method for worker threads:
+ * executes tasks queued by dispatch until stop is invoked and there are
+ * no tasks left.
+ */
+void homa::async_socket::worker()
+{
+	while (1) {
+		task t;
+		{
+			std::unique_lock<std::mutex> lock(task_mutex);
+			task_cond.wait(lock, [this] {
+				return !tasks.empty() || stopping.load();
+			});
+			if (tasks.empty())
+				return;
+			t = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		run(t);
+	}
+}
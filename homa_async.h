@@ -0,0 +1,352 @@
+/* Copyright (c) 2023 Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
+
+#include "homa_receiver.h"
+
+namespace homa {
+
+class async_socket;
+
+/**
+ * class homa::async_message - Owns one incoming message (request or
+ * response) received by a homa::async_socket. The message's buffer space
+ * is handed back to the socket when this object is destroyed or reset.
+ * async_messages can be moved but not copied, and they may be passed
+ * freely between threads. All async_messages must be destroyed before their
+ * homa::async_socket.
+ */
+class async_message {
+public:
+	async_message() : sock(nullptr), msg(nullptr) {}
+	async_message(const async_message &) = delete;
+	async_message &operator=(const async_message &) = delete;
+
+	/**
+	 * homa::async_message::async_message() - Move constructor.
+	 * @other:   Message to move; it will no longer refer to a message.
+	 */
+	async_message(async_message &&other)
+		: sock(other.sock)
+		, msg(other.msg)
+	{
+		other.msg = nullptr;
+	}
+
+	/**
+	 * homa::async_message::operator=() - Move assignment.
+	 * @other:   Message to move; it will no longer refer to a message.
+	 */
+	async_message &operator=(async_message &&other)
+	{
+		if (this != &other) {
+			reset();
+			sock = other.sock;
+			msg = other.msg;
+			other.msg = nullptr;
+		}
+		return *this;
+	}
+
+	~async_message()
+	{
+		reset();
+	}
+
+	/**
+	 * homa::async_message::operator->() - Access the message, using
+	 * the methods of homa::multi_receiver::message such as get,
+	 * iovecs, and length.
+	 */
+	const multi_receiver::message *operator->() const
+	{
+		return msg;
+	}
+
+	/**
+	 * homa::async_message::operator bool() - Return true if this object
+	 * currently refers to a message.
+	 */
+	explicit operator bool() const
+	{
+		return msg != nullptr;
+	}
+
+	void reset();
+
+protected:
+	friend class async_socket;
+
+	/**
+	 * homa::async_message::async_message() - Constructor used by
+	 * async_socket to hand out a message.
+	 * @sock:   Socket that received the message.
+	 * @msg:    The message.
+	 */
+	async_message(async_socket *sock, multi_receiver::message *msg)
+		: sock(sock)
+		, msg(msg)
+	{}
+
+	/** @sock: Socket that received @msg. */
+	async_socket *sock;
+
+	/** @msg: The message, or nullptr if none. */
+	multi_receiver::message *msg;
+};
+
+/**
+ * class homa::async_socket - Implements an asynchronous RPC client and/or
+ * server on top of a Homa socket. Outgoing requests are issued with call,
+ * which returns immediately; responses are matched to their requests using
+ * completion cookies and delivered through a std::future, a callback, or
+ * (when compiled as C++20) a coroutine. Incoming requests are passed to a
+ * handler registered with serve.
+ *
+ * Incoming messages are collected in batches by a single poller thread
+ * (started by start), which either sleeps in poll or, if busy polling is
+ * enabled, spins on nonblocking receives. Callbacks and request handlers
+ * run on a pool of worker threads, or on the poller thread if the pool is
+ * empty. Alternatively, an application with its own epoll loop can skip
+ * start: it adds fd() and event_fd() to its epoll set and invokes
+ * process whenever either becomes readable.
+ */
+class async_socket {
+public:
+	/**
+	 * typedef response_callback - Invoked when an RPC issued by call
+	 * completes. The first argument holds the response; if the RPC
+	 * failed it holds no message and the second argument is an errno
+	 * value (it is 0 on success).
+	 */
+	typedef std::function<void(async_message, int)> response_callback;
+
+	/**
+	 * typedef request_handler - Invoked for each incoming request. The
+	 * handler should eventually invoke reply, passing the request.
+	 */
+	typedef std::function<void(async_socket &, async_message)>
+			request_handler;
+
+	async_socket(int fd, void *buf_region, int num_workers = 0,
+			bool busy_poll = false);
+	~async_socket();
+
+	int call(const sockaddr_in_union *dest, const struct iovec *iov,
+			int iovcnt, response_callback callback);
+	std::future<async_message> call(const sockaddr_in_union *dest,
+			const struct iovec *iov, int iovcnt);
+	std::future<async_message> call(const sockaddr_in_union *dest,
+			const void *request, size_t length);
+
+	/**
+	 * homa::async_socket::event_fd() - Return a file descriptor that
+	 * becomes readable when buffer space must be returned to Homa. Only
+	 * needed by applications that invoke process from their own epoll
+	 * loop.
+	 */
+	int event_fd() const
+	{
+		return wake_fd;
+	}
+
+	/**
+	 * homa::async_socket::fd() - Return the Homa socket used by this
+	 * object.
+	 */
+	int fd() const
+	{
+		return sock_fd;
+	}
+
+	int process();
+	int reply(const async_message &request, const struct iovec *iov,
+			int iovcnt);
+	void serve(request_handler handler);
+	void start();
+	void stop();
+
+#if defined(__cpp_impl_coroutine)
+	/**
+	 * struct homa::async_socket::call_awaiter - Returned by co_call;
+	 * co_await-ing it issues the RPC and suspends the coroutine until
+	 * the response arrives. The coroutine resumes on the thread that
+	 * delivers the response.
+	 */
+	struct call_awaiter {
+		async_socket *sock;
+		const sockaddr_in_union *dest;
+		const struct iovec *iov;
+		int iovcnt;
+		async_message response;
+		int error;
+
+		bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			/* Careful: the callback may resume the coroutine
+			 * before call returns, so don't touch this
+			 * object after a successful call.
+			 */
+			if (sock->call(dest, iov, iovcnt,
+					[this, handle](async_message msg,
+					int err) {
+				response = std::move(msg);
+				error = err;
+				handle.resume();
+			}) < 0) {
+				error = errno;
+				return false;
+			}
+			return true;
+		}
+
+		async_message await_resume()
+		{
+			if (error)
+				throw std::system_error(error,
+						std::generic_category());
+			return std::move(response);
+		}
+	};
+
+	/**
+	 * homa::async_socket::co_call() - Coroutine form of call: use as
+	 * "co_await sock.co_call(...)", which returns the response or throws
+	 * std::system_error if the RPC fails.
+	 * @dest:     Address of the server.
+	 * @iov:      Describes the request message; must remain valid until
+	 *            the coroutine resumes.
+	 * @iovcnt:   Number of entries in @iov.
+	 */
+	call_awaiter co_call(const sockaddr_in_union *dest,
+			const struct iovec *iov, int iovcnt)
+	{
+		return call_awaiter{this, dest, iov, iovcnt, async_message(), 0};
+	}
+#endif
+
+protected:
+	friend class async_message;
+
+	/**
+	 * struct task - Work to be performed for an incoming message,
+	 * either on a worker thread or on the poller thread.
+	 */
+	struct task {
+		/** @callback: Response callback, if this is a response. */
+		response_callback callback;
+
+		/**
+		 * @msg: The incoming message, or nullptr if the RPC
+		 * failed.
+		 */
+		multi_receiver::message *msg;
+
+		/** @error: errno value if the RPC failed, otherwise 0. */
+		int error;
+
+		/** @request: True means @msg is an incoming request. */
+		bool request;
+	};
+
+	void dispatch(multi_receiver::message *msg);
+	void poller();
+	void release(multi_receiver::message *msg);
+	void release_pending();
+	void run(task &t);
+	void worker();
+
+	/** @sock_fd: File descriptor for an open Homa socket. */
+	int sock_fd;
+
+	/**
+	 * @wake_fd: eventfd used to wake the poller thread when messages
+	 * have been released.
+	 */
+	int wake_fd;
+
+	/** @busy_poll: True means the poller thread never sleeps. */
+	bool busy_poll;
+
+	/**
+	 * @receiver: Holds all of the incoming messages. Accessed only by
+	 * the thread running process.
+	 */
+	multi_receiver receiver;
+
+	/** @handler: Invoked for incoming requests; may be empty. */
+	request_handler handler;
+
+	/** @next_cookie: Completion cookie for the next call. */
+	std::atomic<uint64_t> next_cookie;
+
+	/** @pending_mutex: Protects @pending. */
+	std::mutex pending_mutex;
+
+	/**
+	 * @pending: Callbacks for outstanding RPCs, keyed by completion
+	 * cookie.
+	 */
+	std::unordered_map<uint64_t, response_callback> pending;
+
+	/** @release_mutex: Protects @released. */
+	std::mutex release_mutex;
+
+	/**
+	 * @released: Messages released by the application that haven't
+	 * yet been passed to @receiver.
+	 */
+	std::vector<multi_receiver::message *> released;
+
+	/** @task_mutex: Protects @tasks. */
+	std::mutex task_mutex;
+
+	/** @task_cond: Signaled when @tasks becomes nonempty. */
+	std::condition_variable task_cond;
+
+	/** @tasks: Work waiting for a worker thread. */
+	std::deque<task> tasks;
+
+	/** @stopping: True means stop has been invoked. */
+	std::atomic<bool> stopping;
+
+	/** @poll_thread: Runs poller, if start has been invoked. */
+	std::thread poll_thread;
+
+	/** @workers: Threads that execute @tasks. */
+	std::vector<std::thread> workers;
+};
+}    // namespace homa
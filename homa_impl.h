@@ -41,21 +41,26 @@
 #include <linux/audit.h>
 #include <linux/icmp.h>
 #include <linux/init.h>
+#include <linux/jhash.h>
 #include <linux/list.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/kthread.h>
+#include <linux/llist.h>
 #include <linux/completion.h>
 #include <linux/proc_fs.h>
 #include <linux/sched/signal.h>
 #include <linux/skbuff.h>
 #include <linux/version.h>
 #include <linux/socket.h>
+#include <linux/workqueue.h>
 #include <net/icmp.h>
 #include <net/ip.h>
 #include <net/protocol.h>
 #include <net/inet_common.h>
+#include <net/inet_ecn.h>
 #include <net/gro.h>
+#include <net/udp_tunnel.h>
 #pragma GCC diagnostic warning "-Wpointer-sign"
 #pragma GCC diagnostic warning "-Wunused-variable"
 
@@ -85,8 +90,41 @@ extern void mock_rcu_read_unlock(void);
 
 #define kthread_complete_and_exit(comp, code)
 
+#undef EXPORT_SYMBOL
+#define EXPORT_SYMBOL(sym) extern typeof(sym) sym
+
 #define kmalloc mock_kmalloc
 extern void *mock_kmalloc(size_t size, gfp_t flags);
+
+#define kcalloc mock_kcalloc
+extern void *mock_kcalloc(size_t n, size_t size, gfp_t flags);
+
+#define kvmalloc_array(n, size, flags) mock_kmalloc((n) * (size), flags)
+#define kvcalloc mock_kcalloc
+#define kvfree kfree
+
+#define mmap_read_lock(mm)
+#define mmap_read_unlock(mm)
+
+#undef nr_node_ids
+#define nr_node_ids mock_nr_node_ids
+extern unsigned int mock_nr_node_ids;
+
+#define numa_node_id() mock_numa_node
+extern int mock_numa_node;
+
+#undef cpu_to_node
+#define cpu_to_node(cpu) mock_numa_node
+
+#define kmap_local_page mock_kmap_local_page
+extern void *mock_kmap_local_page(struct page *page);
+
+#undef alloc_page
+#define alloc_page mock_alloc_page
+extern struct page *mock_alloc_page(gfp_t gfp);
+
+#define put_page mock_put_page
+extern void mock_put_page(struct page *page);
 #endif
 
 #include "homa.h"
@@ -96,6 +134,7 @@ extern void *mock_kmalloc(size_t size, gfp_t flags);
 struct homa_sock;
 struct homa_rpc;
 struct homa;
+struct homa_pacer;
 struct homa_peer;
 struct homa_lcache;
 
@@ -103,8 +142,9 @@ struct homa_lcache;
 extern void     homa_grantable_lock_slow(struct homa *homa);
 extern void     homa_peer_lock_slow(struct homa_peer *peer);
 extern void     homa_rpc_lock_slow(struct homa_rpc *rpc);
+extern void     homa_send_grants(struct homa *homa);
 extern void     homa_sock_lock_slow(struct homa_sock *hsk);
-extern void     homa_throttle_lock_slow(struct homa *homa);
+extern void     homa_throttle_lock_slow(struct homa_pacer *pacer);
 
 /**
  * enum homa_packet_type - Defines the possible types of Homa packets.
@@ -178,15 +218,41 @@ enum homa_packet_type {
 
 #define sizeof32(type) ((int) (sizeof(type)))
 
+/**
+ * define HOMA_TIMER_SLOTS - Number of slots in the timer wheel for each
+ * socket; must be a power of 2. homa_timer never schedules an RPC more
+ * than HOMA_TIMER_SLOTS-1 ticks in the future.
+ */
+#define HOMA_TIMER_SLOTS 64
+
+/**
+ * define HOMA_MAX_TIMER_SHARDS - Largest allowable value for
+ * homa->num_timer_shards.
+ */
+#define HOMA_MAX_TIMER_SHARDS 8
+
+/**
+ * define HOMA_STEER_SLOTS - Number of entries in homa->steer_cores;
+ * must be a power of 2.
+ */
+#define HOMA_STEER_SLOTS 4096
+
 /** define CACHE_LINE_SIZE - The number of bytes in a cache line. */
 #define CACHE_LINE_SIZE 64
 
 /**
  * define NUM_PEER_UNACKED_IDS - The number of ids for unacked RPCs that
- * can be stored in a struct homa_peer.
+ * can be carried in a single ACK packet.
  */
 #define NUM_PEER_UNACKED_IDS 5
 
+/**
+ * define HOMA_MAX_PEER_ACKS - The number of ids for unacked RPCs that
+ * can be stored in a struct homa_peer while waiting to be piggybacked
+ * on other packets. When this fills, an explicit ACK packet is sent.
+ */
+#define HOMA_MAX_PEER_ACKS 32
+
 /**
  * struct homa_cache_line - An object whose size equals that of a cache line.
  */
@@ -379,18 +445,53 @@ struct grant_header {
 	 * that no packets have been successfully received).
 	 */
 	__u8 resend_all;
+
+	/**
+	 * @ack: If the @client_id field of this is nonzero, provides info
+	 * about an RPC that the recipient can now safely free.
+	 */
+	struct homa_ack ack;
 } __attribute__((packed));
 _Static_assert(sizeof(struct grant_header) <= HOMA_MAX_HEADER,
 		"grant_header too large for HOMA_MAX_HEADER; must "
 		"adjust HOMA_MAX_HEADER");
 
+/**
+ * define HOMA_GRANT_MIN_LENGTH - Length of the shortest GRANT packet that
+ * will be accepted. Older versions of Homa send grant_headers without
+ * @ack; a piggybacked ack is used only if the packet is long enough to
+ * contain it (and older receivers ignore the extra bytes).
+ */
+#define HOMA_GRANT_MIN_LENGTH offsetof(struct grant_header, ack)
+
+/**
+ * define HOMA_MAX_RESEND_RANGES - Largest number of distinct byte ranges
+ * that can be requested in a single RESEND packet (including the one
+ * in the @offset and @length fields of struct resend_header).
+ */
+#define HOMA_MAX_RESEND_RANGES 4
+
+/**
+ * struct homa_resend_range - Describes one additional range of bytes to
+ * retransmit in a RESEND packet.
+ */
+struct homa_resend_range {
+	/** @offset: Offset within the message of the first byte in the range. */
+	__be32 offset;
+
+	/** @length: Number of bytes in the range. */
+	__be32 length;
+} __attribute__((packed));
+
 /**
  * struct resend_header - Wire format for RESEND packets.
  *
  * A RESEND is sent by the receiver when it believes that message data may
  * have been lost in transmission (or if it is concerned that the sender may
  * have crashed). The receiver should resend the specified portion of the
- * message, even if it already sent it previously.
+ * message, even if it already sent it previously. If several gaps are
+ * missing, one RESEND can request all of them: @offset and @length give
+ * the first range and @extra_ranges gives the others.
  */
 struct resend_header {
 	/** @common: Fields common to all packet types. */
@@ -418,11 +519,39 @@ struct resend_header {
 	 * priority.
 	 */
 	__u8 priority;
+
+	/**
+	 * @num_extra: Number of valid entries in @extra_ranges (at most
+	 * HOMA_MAX_RESEND_RANGES - 1).
+	 */
+	__u8 num_extra;
+
+	/**
+	 * @extra_ranges: Additional ranges to retransmit, in increasing
+	 * order of offset; only the first @num_extra entries are valid.
+	 */
+	struct homa_resend_range extra_ranges[HOMA_MAX_RESEND_RANGES - 1];
+
+	/**
+	 * @ack: If the @client_id field of this is nonzero, provides info
+	 * about an RPC that the recipient can now safely free.
+	 */
+	struct homa_ack ack;
 } __attribute__((packed));
 _Static_assert(sizeof(struct resend_header) <= HOMA_MAX_HEADER,
 		"resend_header too large for HOMA_MAX_HEADER; must "
 		"adjust HOMA_MAX_HEADER");
 
+/**
+ * define HOMA_RESEND_MIN_LENGTH - Length of the shortest RESEND packet
+ * that will be accepted. Older versions of Homa send resend_headers that
+ * end after @priority; the fields after that (including @ack) are used
+ * only if a packet is long enough to contain them (and older receivers
+ * ignore them), so the two versions interoperate, except that the extra
+ * ranges requested by newer peers are not retransmitted by older ones.
+ */
+#define HOMA_RESEND_MIN_LENGTH offsetof(struct resend_header, num_extra)
+
 /**
  * struct unknown_header - Wire format for UNKNOWN packets.
  *
@@ -449,11 +578,23 @@ _Static_assert(sizeof(struct unknown_header) <= HOMA_MAX_HEADER,
 struct busy_header {
 	/** @common: Fields common to all packet types. */
 	struct common_header common;
+
+	/**
+	 * @ack: If the @client_id field of this is nonzero, provides info
+	 * about an RPC that the recipient can now safely free.
+	 */
+	struct homa_ack ack;
 } __attribute__((packed));
 _Static_assert(sizeof(struct busy_header) <= HOMA_MAX_HEADER,
 		"busy_header too large for HOMA_MAX_HEADER; must "
 		"adjust HOMA_MAX_HEADER");
 
+/**
+ * define HOMA_BUSY_MIN_LENGTH - Length of the shortest BUSY packet that
+ * will be accepted; see HOMA_GRANT_MIN_LENGTH.
+ */
+#define HOMA_BUSY_MIN_LENGTH offsetof(struct busy_header, ack)
+
 /**
  * struct cutoffs_header - Wire format for CUTOFFS packets.
  *
@@ -532,7 +673,8 @@ _Static_assert(sizeof(struct ack_header) <= HOMA_MAX_HEADER,
 
 /**
  * struct homa_message_out - Describes a message (either request or response)
- * for which this machine is the sender.
+ * for which this machine is the sender. Fields used when transmitting
+ * each packet come first.
  */
 struct homa_message_out {
 	/**
@@ -542,31 +684,13 @@ struct homa_message_out {
 	 */
 	int length;
 
-	/** @num_skbs: Total number of buffers currently in @packets. */
-	int num_skbs;
-
-	/**
-	 * @copied_from_user: Number of bytes of the message that have
-	 * been copied from user space into skbs in @packets.
-	 */
-	int copied_from_user;
-
-	/**
-	 * @packets: Singly-linked list of all packets in message, linked
-	 * using homa_next_skb. The list is in order of offset in the message
-	 * (offset 0 first); each sk_buff can potentially contain multiple
-	 * data_segments, which will be split into separate packets by GSO.
-	 * This list grows gradually as data is copied in from user space,
-	 * so it may not be complete.
-	 */
-	struct sk_buff *packets;
-
 	/**
-	 * @next_xmit: Pointer to pointer to next packet to transmit (will
-	 * either refer to @packets or homa_next_skb(skb) for some skb
-	 * in @packets).
+	 * @granted: Total number of bytes we are currently permitted to
+	 * send, including unscheduled bytes; must wait for grants before
+	 * sending bytes at or beyond this position. Never larger than
+	 * @length.
 	 */
-	struct sk_buff **next_xmit;
+	int granted;
 
 	/**
 	 * @next_xmit_offset: All bytes in the message, up to but not
@@ -574,6 +698,12 @@ struct homa_message_out {
 	 */
 	int next_xmit_offset;
 
+	/**
+	 * @unscheduled: Initial bytes of message that we'll send
+	 * without waiting for grants.
+	 */
+	int unscheduled;
+
 	/**
 	 * @active_xmits: The number of threads that are currently
 	 * transmitting data packets for this RPC; can't reap the RPC
@@ -586,23 +716,55 @@ struct homa_message_out {
 	 */
 	int gso_pkt_data;
 
-	/**
-	 * @unscheduled: Initial bytes of message that we'll send
-	 * without waiting for grants.
-	 */
-	int unscheduled;
+	/** @num_skbs: Total number of buffers currently in @packets. */
+	int num_skbs;
 
 	/**
-	 * @granted: Total number of bytes we are currently permitted to
-	 * send, including unscheduled bytes; must wait for grants before
-	 * sending bytes at or beyond this position. Never larger than
-	 * @length.
+	 * @copied_from_user: Number of bytes of the message that have
+	 * been copied from user space into skbs in @packets.
 	 */
-	int granted;
+	int copied_from_user;
 
 	/** @priority: Priority level to use for future scheduled packets. */
 	__u8 sched_priority;
 
+	/**
+	 * @next_xmit: Pointer to pointer to next packet to transmit (will
+	 * either refer to @packets or homa_next_skb(skb) for some skb
+	 * in @packets).
+	 */
+	struct sk_buff **next_xmit;
+
+	/**
+	 * @packets: Singly-linked list of all packets in message, linked
+	 * using homa_next_skb. The list is in order of offset in the message
+	 * (offset 0 first); each sk_buff can potentially contain multiple
+	 * data_segments, which will be split into separate packets by GSO.
+	 * This list grows gradually as data is copied in from user space,
+	 * so it may not be complete.
+	 */
+	struct sk_buff *packets;
+
+	/**
+	 * @skb_index: Used by homa_resend_data to find the packet containing
+	 * a given offset without scanning @packets: entry i refers to the
+	 * sk_buff in @packets that holds byte i * @gso_pkt_data of the
+	 * message. Entries are NULL until the corresponding packet has been
+	 * created. NULL means the array couldn't be allocated, in which
+	 * case @packets must be scanned. Allocated with kvcalloc (for
+	 * HOMA_MAX_MESSAGE_LENGTH messages it is too large to rely on a
+	 * contiguous kmalloc).
+	 */
+	struct sk_buff **skb_index;
+
+	/**
+	 * @rtt_start: get_cycles time when the first data packet of this
+	 * message was transmitted, or 0 if that hasn't happened yet or
+	 * the first grant has already been used as an RTT sample (see
+	 * homa_peer_update_rtt).
+	 */
+	__u64 rtt_start;
+
 	/**
 	 * @init_cycles: Time in get_cycles units when this structure was
 	 * initialized.  Used to find the oldest outgoing message.
@@ -625,9 +787,17 @@ struct homa_gap {
 	struct list_head links;
 };
 
+/**
+ * define HOMA_MAX_MSG_BPAGES - The largest number of bpages that will be
+ * required to store an incoming message.
+ */
+#define HOMA_MAX_MSG_BPAGES ((HOMA_MAX_MESSAGE_LENGTH + HOMA_BPAGE_SIZE - 1) \
+		>> HOMA_BPAGE_SHIFT)
+
 /**
  * struct homa_message_in - Holds the state of a message received by
- * this machine; used for both requests and responses.
+ * this machine; used for both requests and responses. Fields used when
+ * receiving each packet come first.
  */
 struct homa_message_in {
 	/**
@@ -637,10 +807,10 @@ struct homa_message_in {
 	int length;
 
 	/**
-	 * @packets: DATA packets for this message that have been received but
-	 * not yet copied to user space (no particular order).
+	 * @bytes_remaining: Amount of data for this message that has
+	 * not yet been received; will determine the message's priority.
 	 */
-	struct sk_buff_head packets;
+	int bytes_remaining;
 
 	/**
 	 * @recv_end: Offset of the byte just after the highest one that
@@ -648,18 +818,6 @@ struct homa_message_in {
 	 */
 	int recv_end;
 
-	/**
-	 * @gaps: List of homa_gaps describing all of the bytes with
-	 * offsets less than @recv_end that have not yet been received.
-	 */
-	struct list_head gaps;
-
-	/**
-	 * @bytes_remaining: Amount of data for this message that has
-	 * not yet been received; will determine the message's priority.
-	 */
-	int bytes_remaining;
-
 	/**
 	 * @granted: Total # of bytes (starting from offset 0) that the sender
 	 * may transmit without additional grants, includes unscheduled bytes.
@@ -668,9 +826,22 @@ struct homa_message_in {
 	 */
         int granted;
 
+	/**
+	 * @cong_counted: Offset up to which bytes withheld from grants
+	 * because of peer congestion have already been counted in the
+	 * cong_limited_bytes metric. Protected by @homa->grantable_lock.
+	 */
+	int cong_counted;
+
 	/** @priority: Priority level to include in future GRANTS. */
 	int priority;
 
+	/**
+	 * @num_bpages: The number of entries in @bpage_offsets used for this
+	 * message (0 means buffers not allocated yet).
+	 */
+	__u32 num_bpages;
+
 	/**
 	 * @scheduled: True means some of the bytes of this message
 	 * must be scheduled with grants.
@@ -680,6 +851,35 @@ struct homa_message_in {
 	/** @resend_all: if nonzero, set resend_all in the next grant packet. */
 	__u8 resend_all;
 
+	/**
+	 * @streaming: nonzero means this message is being returned to the
+	 * application in pieces (see HOMA_RECVMSG_STREAM), or it couldn't
+	 * be returned at all. In either case the application owns only the
+	 * first @stream_bpages entries of @bpage_offsets; the others are
+	 * released when the RPC is freed.
+	 */
+	__u8 streaming;
+
+	/**
+	 * @stream_offset: Offset of the first byte of the message that
+	 * has not yet been returned to the application in streaming mode.
+	 * Always a multiple of HOMA_BPAGE_SIZE, except at the end of the
+	 * message.
+	 */
+	int stream_offset;
+
+	/**
+	 * @packets: DATA packets for this message that have been received but
+	 * not yet copied to user space (no particular order).
+	 */
+	struct sk_buff_head packets;
+
+	/**
+	 * @gaps: List of homa_gaps describing all of the bytes with
+	 * offsets less than @recv_end that have not yet been received.
+	 */
+	struct list_head gaps;
+
 	/**
 	 * @birth: get_cycles time when this RPC was added to the grantable
 	 * list. Invalid if RPC isn't in the grantable list.
@@ -687,16 +887,20 @@ struct homa_message_in {
 	__u64 birth;
 
 	/**
-	 * @num_bpages: The number of entries in @bpage_offsets used for this
-	 * message (0 means buffers not allocated yet).
-	 */
-	__u32 num_bpages;
-
-	/** @bpage_offsets: Describes buffer space allocated for this message.
+	 * @bpage_offsets: Describes buffer space allocated for this message.
 	 * Each entry is an offset from the start of the buffer region.
 	 * All but the last pointer refer to areas of size HOMA_BPAGE_SIZE.
+	 * The array itself (HOMA_MAX_MSG_BPAGES entries) lives in the RPC's
+	 * struct homa_rpc_cold, since most messages use only a few entries.
+	 */
+	__u32 *bpage_offsets;
+
+	/**
+	 * @stream_bpages: The number of leading entries in @bpage_offsets
+	 * that have already been returned to the application in streaming
+	 * mode.
 	 */
-	__u32 bpage_offsets[HOMA_MAX_BPAGES];
+	int stream_bpages;
 };
 
 /**
@@ -767,6 +971,106 @@ static void inline homa_interest_init(struct homa_interest *interest)
 	interest->response_links.next = LIST_POISON1;
 }
 
+/**
+ * define HOMA_XMIT_BATCH - Maximum number of data packets that can
+ * accumulate in a struct homa_xmit_batch before it must be flushed.
+ */
+#define HOMA_XMIT_BATCH 8
+
+/**
+ * struct homa_xmit_batch - Accumulates outgoing data packets, possibly
+ * from several RPCs, so that they can be handed to the IP layer
+ * back-to-back, without any locks held, rather than one at a time
+ * between RPC lock acquisitions. Normally allocated on the stack by
+ * the function producing the packets.
+ */
+struct homa_xmit_batch {
+	/** @num_skbs: number of valid entries in the arrays below. */
+	int num_skbs;
+
+	/**
+	 * @skbs: packets waiting to be transmitted. Each has an extra
+	 * reference, which is consumed when it is transmitted.
+	 */
+	struct sk_buff *skbs[HOMA_XMIT_BATCH];
+
+	/**
+	 * @rpcs: RPC for each entry in @skbs. The entry holds an increment
+	 * of the RPC's msgout.active_xmits, so the RPC can't be reaped
+	 * before the batch is flushed.
+	 */
+	struct homa_rpc *rpcs[HOMA_XMIT_BATCH];
+
+	/** @priorities: priority level at which to send each packet. */
+	int priorities[HOMA_XMIT_BATCH];
+};
+
+/**
+ * homa_xmit_batch_init() - Constructor for homa_xmit_batches.
+ * @batch:  The object to initialize; previous contents are discarded.
+ */
+static inline void homa_xmit_batch_init(struct homa_xmit_batch *batch)
+{
+	batch->num_skbs = 0;
+}
+
+/**
+ * struct homa_rpc_cold - Holds the parts of a homa_rpc that are rarely
+ * accessed: timer state, statistics used for debugging and metrics, and
+ * the storage for msgin.bpage_offsets. One of these is allocated along
+ * with each homa_rpc (see homa_rpc->cold).
+ */
+struct homa_rpc_cold {
+	/**
+	 * @checked_timer_ticks: Value of homa->timer_ticks the last time
+	 * homa_timer checked this RPC (or when the RPC was created).
+	 */
+	__u32 checked_timer_ticks;
+
+	/**
+	 * @resend_timer_ticks: Value of homa->timer_ticks the last time
+	 * we sent a RESEND for this RPC.
+	 */
+	__u32 resend_timer_ticks;
+
+	/**
+	 * @done_timer_ticks: The value of homa->timer_ticks the first
+	 * time we noticed that this (server) RPC is done (all response
+	 * packets have been transmitted), so we're ready for an ack.
+	 * Zero means we haven't reached that point yet.
+	 */
+	__u32 done_timer_ticks;
+
+	/**
+	 * @throttle_cycles: get_cycles time when this RPC was most recently
+	 * added to a throttled list. Invalid if RPC isn't throttled.
+	 */
+	__u64 throttle_cycles;
+
+	/**
+	 * @handoff_cycles: get_cycles time when msgin was most recently
+	 * handed off to a user thread by homa_rpc_handoff (0 means never).
+	 */
+	__u64 handoff_cycles;
+
+	/**
+	 * @copy_cycles: total time spent so far in homa_copy_to_user for
+	 * msgin.
+	 */
+	__u64 copy_cycles;
+
+	/**
+	 * @start_cycles: time (from get_cycles()) when this RPC was created.
+	 * Used (sometimes) for testing.
+	 */
+	uint64_t start_cycles;
+
+	/**
+	 * @bpage_offsets: Storage for homa_rpc->msgin.bpage_offsets.
+	 */
+	__u32 bpage_offsets[HOMA_MAX_MSG_BPAGES];
+};
+
 /**
  * struct homa_rpc - One of these structures exists for each active
  * RPC. The same structure is used to manage both outgoing RPCs on
@@ -783,16 +1087,36 @@ struct homa_rpc {
 	struct spinlock *lock;
 
 	/**
-	 * @state: The current state of this RPC:
-	 *
-	 * @RPC_OUTGOING:     The RPC is waiting for @msgout to be transmitted
-	 *                    to the peer.
-	 * @RPC_INCOMING:     The RPC is waiting for data @msgin to be received
-	 *                    from the peer; at least one packet has already
-	 *                    been received.
-	 * @RPC_IN_SERVICE:   Used only for server RPCs: the request message
-	 *                    has been read from the socket, but the response
-	 *                    message has not yet been presented to the kernel.
+	 * @peer: Information about the other machine (the server, if
+	 * this is a client RPC, or the client, if this is a server RPC).
+	 */
+	struct homa_peer *peer;
+
+	/**
+	 * @id: Unique identifier for the RPC among all those issued
+	 * from its port. The low-order bit indicates whether we are
+	 * server (1) or client (0) for this RPC.
+	 */
+	__u64 id;
+
+	/**
+	 * @hash_links: Used to link this object into a hash bucket for
+	 * either @hsk->client_rpc_buckets (for a client RPC), or
+	 * @hsk->server_rpc_buckets (for a server RPC).
+	 */
+	struct hlist_node hash_links;
+
+	/**
+	 * @state: The current state of this RPC:
+	 *
+	 * @RPC_OUTGOING:     The RPC is waiting for @msgout to be transmitted
+	 *                    to the peer.
+	 * @RPC_INCOMING:     The RPC is waiting for data @msgin to be received
+	 *                    from the peer; at least one packet has already
+	 *                    been received.
+	 * @RPC_IN_SERVICE:   Used only for server RPCs: the request message
+	 *                    has been read from the socket, but the response
+	 *                    message has not yet been presented to the kernel.
 	 * @RPC_DEAD:         RPC has been deleted and is waiting to be
 	 *                    reaped. In some cases, information in the RPC
 	 *                    structure may be accessed in this state.
@@ -845,56 +1169,60 @@ struct homa_rpc {
 	 */
 	atomic_t grants_in_progress;
 
-	/**
-	 * @peer: Information about the other machine (the server, if
-	 * this is a client RPC, or the client, if this is a server RPC).
-	 */
-	struct homa_peer *peer;
-
 	/** @dport: Port number on @peer that will handle packets. */
 	__u16 dport;
 
 	/**
-	 * @id: Unique identifier for the RPC among all those issued
-	 * from its port. The low-order bit indicates whether we are
-	 * server (1) or client (0) for this RPC.
+	 * @msgin: Information about the message we receive for this RPC
+	 * (for server RPCs this is the request, for client RPCs this is the
+	 * response).
 	 */
-	__u64 id;
+	struct homa_message_in msgin;
 
 	/**
-	 * @completion_cookie: Only used on clients. Contains identifying
-	 * information about the RPC provided by the application; returned to
-	 * the application with the RPC's result.
+	 * @msgout: Information about the message we send for this RPC
+	 * (for client RPCs this is the request, for server RPCs this is the
+	 * response).
 	 */
-	__u64 completion_cookie;
+	struct homa_message_out msgout;
 
 	/**
-	 * @error: Only used on clients. If nonzero, then the RPC has
-	 * failed and the value is a negative errno that describes the
-	 * problem.
+	 * @interest: Describes a thread that wants to be notified when
+	 * msgin is complete, or NULL if none.
 	 */
-	int error;
+	struct homa_interest *interest;
 
 	/**
-	 * @msgin: Information about the message we receive for this RPC
-	 * (for server RPCs this is the request, for client RPCs this is the
-	 * response).
+	 * @silent_ticks: Number of times homa_timer has been invoked
+	 * since the last time a packet indicating progress was received
+	 * for this RPC, so we don't need to send a resend for a while.
+	 * Only updated when homa_timer checks the RPC, which may not
+	 * happen on every tick.
 	 */
-	struct homa_message_in msgin;
+	int silent_ticks;
 
 	/**
-	 * @msgout: Information about the message we send for this RPC
-	 * (for client RPCs this is the request, for server RPCs this is the
-	 * response).
+	 * @magic: when the RPC is alive, this holds a distinct value that
+	 * is unlikely to occur naturally. The value is cleared when the
+	 * RPC is reaped, so we can detect accidental use of an RPC after
+	 * it has been reaped.
+	 */
+#define HOMA_RPC_MAGIC 0xdeadbeef
+	int magic;
+
+	/* The fields above this point are used when processing every packet
+	 * and fit in the first 4 cache lines of the struct (see the assertions
+	 * below); the ones from here on are used at most a few times per
+	 * message. Rarely used fields are in @cold.
 	 */
-	struct homa_message_out msgout;
 
 	/**
-	 * @hash_links: Used to link this object into a hash bucket for
-	 * either @hsk->client_rpc_buckets (for a client RPC), or
-	 * @hsk->server_rpc_buckets (for a server RPC).
+	 * @grantable_links: Used to link this RPC into peer->grantable_rpcs.
+	 * If this RPC isn't in peer->grantable_rpcs, this is an empty
+	 * list pointing to itself.
 	 */
-	struct hlist_node hash_links;
+	struct list_head grantable_links
+			__attribute__((aligned(CACHE_LINE_SIZE)));
 
 	/**
 	 * @ready_links: Used to link this object into
@@ -920,62 +1248,77 @@ struct homa_rpc {
 	struct list_head dead_links;
 
 	/**
-	 * @interest: Describes a thread that wants to be notified when
-	 * msgin is complete, or NULL if none.
+	 * @peer_links: Used to link this RPC into peer->rpcs while it is
+	 * live; once the RPC has been freed this is an empty list pointing
+	 * to itself.
 	 */
-	struct homa_interest *interest;
+	struct list_head peer_links;
 
 	/**
-	 * @grantable_links: Used to link this RPC into homa->grantable_rpcs.
-	 * If this RPC isn't in homa->grantable_rpcs, this is an empty
-	 * list pointing to itself.
+	 * @throttled_links: Used to link this RPC into one of the
+	 * throttled_rpcs lists in @pacer. If this RPC isn't throttled,
+	 * this is an empty list pointing to itself.
 	 */
-	struct list_head grantable_links;
+	struct list_head throttled_links;
 
 	/**
-	 * @throttled_links: Used to link this RPC into homa->throttled_rpcs.
-	 * If this RPC isn't in homa->throttled_rpcs, this is an empty
-	 * list pointing to itself.
+	 * @pacer: The pacer whose throttled queue holds this RPC. Only
+	 * valid when @throttled_links is nonempty.
 	 */
-	struct list_head throttled_links;
+	struct homa_pacer *pacer;
 
 	/**
-	 * @silent_ticks: Number of times homa_timer has been invoked
-	 * since the last time a packet indicating progress was received
-	 * for this RPC, so we don't need to send a resend for a while.
+	 * @throttle_bucket: Index of the list in @pacer->throttled_rpcs
+	 * that holds this RPC. Only valid when @throttled_links is
+	 * nonempty; modified only with both the RPC's lock and @pacer's
+	 * throttle lock held.
 	 */
-	int silent_ticks;
+	int throttle_bucket;
 
 	/**
-	 * @resend_timer_ticks: Value of homa->timer_ticks the last time
-	 * we sent a RESEND for this RPC.
+	 * @timer_links: Used to link this RPC into one of the slots in
+	 * @hsk->timer_wheel, which determines when homa_timer will next
+	 * check it. Empty if the RPC isn't in the wheel. Protected by the
+	 * socket lock.
 	 */
-	__u32 resend_timer_ticks;
+	struct list_head timer_links;
 
 	/**
-	 * @done_timer_ticks: The value of homa->timer_ticks the first
-	 * time we noticed that this (server) RPC is done (all response
-	 * packets have been transmitted), so we're ready for an ack.
-	 * Zero means we haven't reached that point yet.
+	 * @completion_cookie: Only used on clients. Contains identifying
+	 * information about the RPC provided by the application; returned to
+	 * the application with the RPC's result.
 	 */
-	__u32 done_timer_ticks;
+	__u64 completion_cookie;
 
 	/**
-	 * @magic: when the RPC is alive, this holds a distinct value that
-	 * is unlikely to occur naturally. The value is cleared when the
-	 * RPC is reaped, so we can detect accidental use of an RPC after
-	 * it has been reaped.
+	 * @error: Only used on clients. If nonzero, then the RPC has
+	 * failed and the value is a negative errno that describes the
+	 * problem.
 	 */
-#define HOMA_RPC_MAGIC 0xdeadbeef
-	int magic;
+	int error;
 
 	/**
-	 * @start_cycles: time (from get_cycles()) when this RPC was created.
-	 * Used (sometimes) for testing.
+	 * @cold: Fields of this RPC that are rarely accessed (timer state,
+	 * statistics, and storage for @msgin.bpage_offsets). Allocated
+	 * separately so they don't dilute the cache lines used on the
+	 * fast path; stays attached to the struct while it is in
+	 * @hsk->rpc_cache.
 	 */
-	uint64_t start_cycles;
+	struct homa_rpc_cold *cold;
 };
 
+_Static_assert(offsetof(struct homa_rpc, msgin)
+		== sizeof(struct homa_cache_line),
+		"homa_rpc identity fields overflowed a cache line");
+#if !IS_ENABLED(CONFIG_DEBUG_SPINLOCK) && !IS_ENABLED(CONFIG_DEBUG_LOCK_ALLOC)
+/* Debugging spinlocks make msgin.packets larger. */
+_Static_assert(offsetof(struct homa_rpc, grantable_links)
+		== 4 * sizeof(struct homa_cache_line),
+		"homa_rpc hot fields overflowed 4 cache lines");
+_Static_assert(sizeof(struct homa_rpc) <= 8 * sizeof(struct homa_cache_line),
+		"homa_rpc grew larger than 8 cache lines");
+#endif
+
 /**
  * homa_rpc_lock() - Acquire the lock for an RPC.
  * @rpc:   RPC to lock. Note: this function is only safe under
@@ -1013,12 +1356,64 @@ inline static void homa_rpc_validate(struct homa_rpc *rpc) {
 	BUG();
 }
 
+/**
+ * define HOMA_SOFTIRQ_GROUPS - Maximum number of distinct RPCs whose long
+ * packets homa_gro_receive will group together in a single batch of
+ * packets.
+ */
+#define HOMA_SOFTIRQ_GROUPS 8
+
 /**
  * define HOMA_SOCKTAB_BUCKETS - Number of hash buckets in a homa_socktab.
  * Must be a power of 2.
  */
 #define HOMA_SOCKTAB_BUCKETS 1024
 
+/**
+ * define HOMA_MAX_GROUP_SOCKS - Largest number of sockets that can be
+ * members of a single homa_port_group.
+ */
+#define HOMA_MAX_GROUP_SOCKS 64
+
+/**
+ * struct homa_port_group - Describes a server port that is shared by
+ * several sockets, each of which set SO_REUSEPORT before binding to the
+ * port. Each member socket keeps its own (client) port, which it uses as
+ * the source for outgoing packets, so packets for requests it issued
+ * (and for responses it is sending) come back to it directly; incoming
+ * requests to the shared port are spread among the members by
+ * homa_group_select.
+ */
+struct homa_port_group {
+	/** @port: Server port shared by the members of the group. */
+	__u16 port;
+
+	/** @uid: Owner of the first socket; all members must match. */
+	kuid_t uid;
+
+	/**
+	 * @links: Used to link this group into the group_buckets of a
+	 * homa_socktab.
+	 */
+	struct hlist_node links;
+
+	/**
+	 * @num_socks: Number of valid entries in @socks. Modified only
+	 * while holding the socktab's write_lock; read without locks.
+	 */
+	int num_socks;
+
+	/**
+	 * @socks: The member sockets, in no particular order. Lookups
+	 * may see a stale entry, but socket storage is RCU-protected and
+	 * a stale socket will already be marked shutdown.
+	 */
+	struct homa_sock *socks[HOMA_MAX_GROUP_SOCKS];
+
+	/** @rcu_head: Used to free the group once lookups are done. */
+	struct rcu_head rcu_head;
+};
+
 /**
  * struct homa_socktab - A hash table that maps from port numbers (either
  * client or server) to homa_sock objects.
@@ -1039,6 +1434,27 @@ struct homa_socktab {
 	 * consist of homa_socktab_link objects.
 	 */
 	struct hlist_head buckets[HOMA_SOCKTAB_BUCKETS];
+
+	/**
+	 * @group_buckets: Heads of hash chains of homa_port_groups,
+	 * indexed by homa_port_hash of the group's port.
+	 */
+	struct hlist_head group_buckets[HOMA_SOCKTAB_BUCKETS];
+
+	/**
+	 * @num_groups: Number of groups in @group_buckets; lets lookups
+	 * skip the group table entirely in the common case where there
+	 * are no groups.
+	 */
+	int num_groups;
+
+	/**
+	 * @removals: incremented (after the socket has been unlinked)
+	 * every time a socket is removed from this table. Entries in the
+	 * per-core socket caches (see homa_sock_find_cached) are valid
+	 * only if no removals have occurred since they were filled in.
+	 */
+	atomic_t removals;
 };
 
 /**
@@ -1097,10 +1513,42 @@ struct homa_rpc_bucket {
 	 */
 	struct spinlock lock;
 
-	/** @rpcs: list of RPCs that hash to this bucket. */
-	struct hlist_head rpcs;
+	/**
+	 * @rpcs: hash chains for the RPCs in this bucket; there are
+	 * 1 << @bits of them. Points to @rpc0 until the bucket has
+	 * grown, so that sockets with few RPCs don't pay for any
+	 * extra memory. Protected by @lock.
+	 */
+	struct hlist_head *rpcs;
+
+	/**
+	 * @bits: log2 of the number of chains in @rpcs. Grows and shrinks
+	 * with @num_rpcs, so that chains stay short no matter how many
+	 * RPCs a socket has outstanding.
+	 */
+	int bits;
+
+	/** @num_rpcs: number of RPCs currently linked into @rpcs. */
+	int num_rpcs;
+
+	/** @rpc0: the only chain, as long as @bits is 0. */
+	struct hlist_head rpc0;
 };
 
+/**
+ * define HOMA_RPC_BUCKET_MAX_BITS - Upper limit on the bits field of a
+ * homa_rpc_bucket: each bucket will never have more than this many
+ * hash chains.
+ */
+#define HOMA_RPC_BUCKET_MAX_BITS 12
+
+/**
+ * define HOMA_RPC_BUCKET_LOAD - A homa_rpc_bucket grows when its average
+ * chain length would exceed this value, and shrinks when the average
+ * falls below 1/4 of it.
+ */
+#define HOMA_RPC_BUCKET_LOAD 2
+
 /**
  * struct homa_bpage - Contains information about a single page in
  * a buffer pool.
@@ -1130,6 +1578,13 @@ struct homa_bpage {
 			 */
 			int owner;
 
+			/**
+			 * @next_free: if this bpage is free (@refs is zero)
+			 * then it is in one of the pool's free stacks, and
+			 * this is the index of the next bpage in that stack.
+			 */
+			__u32 next_free;
+
 			/**
 			 * @expiration: time (in get_cycles units) after
 			 * which it's OK to steal this page from its current
@@ -1170,10 +1625,12 @@ struct homa_pool_core {
 			int allocated;
 
 			/**
-			 * @next_candidate: when searching for free bpages,
-			 * check this index next.
+			 * @free_stack: free bpages reserved for allocation
+			 * by this core (see homa_pool.c for the format).
+			 * Other cores may take bpages from this stack when
+			 * the pool's free_stack is empty.
 			 */
-			int next_candidate;
+			atomic64_t free_stack;
 		};
 	};
 };
@@ -1206,6 +1663,13 @@ struct homa_pool {
 	/** @descriptors: kmalloced area containing one entry for each bpage. */
 	struct homa_bpage *descriptors;
 
+	/**
+	 * @free_stack: free bpages that haven't been handed out to the
+	 * free_stack of any core. Manipulated without locks; see
+	 * homa_pool.c for the format.
+	 */
+	atomic64_t free_stack;
+
 	/**
 	 * @free_bpages: the number of pages still available for allocation
 	 * by homa_pool_get pages. This equals the number of pages with zero
@@ -1226,6 +1690,163 @@ struct homa_pool {
 
 	/** @num_cores: number of elements in @cores. */
 	int num_cores;
+
+	/**
+	 * @num_extent_bpages: number of bpages at the end of the region
+	 * that are reserved for large messages, each of which gets a
+	 * contiguous range of bpages (an "extent"). These bpages are never
+	 * in a free stack and aren't counted in @free_bpages.
+	 */
+	int num_extent_bpages;
+
+	/** @extent_start: index of the first bpage in the extent area. */
+	int extent_start;
+
+	/**
+	 * @extent_map: kmalloced bitmap with one bit for each bpage in
+	 * the extent area (1 means in use); NULL if @num_extent_bpages is 0.
+	 */
+	unsigned long *extent_map;
+
+	/**
+	 * @extent_hint: position in @extent_map at which to begin the
+	 * next search for a free extent.
+	 */
+	int extent_hint;
+
+	/** @extent_lock: protects @extent_map and @extent_hint. */
+	spinlock_t extent_lock;
+
+	/**
+	 * @num_nodes: number of NUMA nodes among which the bpages before
+	 * @extent_start are divided (see SO_HOMA_BUF_NODES); 0 means the
+	 * region has no NUMA placement and all free bpages are kept in
+	 * @free_stack.
+	 */
+	int num_nodes;
+
+	/**
+	 * @node_bpages: number of bpages in the sub-region for each node
+	 * (the last node also gets any leftover bpages). Bpage i belongs
+	 * to node i/@node_bpages.
+	 */
+	int node_bpages;
+
+	/**
+	 * @node_stacks: kmalloced array with @num_nodes entries, each of
+	 * which holds the free bpages for one node (same format as
+	 * @free_stack, which is unused when this is non-NULL). NULL if
+	 * @num_nodes is 0.
+	 */
+	atomic64_t *node_stacks;
+
+	/**
+	 * @recv_node: NUMA node of the thread that most recently waited
+	 * for a message on the socket; new bpages are taken from this
+	 * node's sub-region if possible, since that thread will most
+	 * likely copy the message out.
+	 */
+	int recv_node;
+
+	/**
+	 * @pinned_pages: vmalloced array of the pages of the region, which
+	 * are pinned so that packet data can be copied into the region
+	 * during SoftIRQ (see SO_HOMA_SOFTIRQ_COPY). NULL means the region
+	 * isn't pinned.
+	 */
+	struct page **pinned_pages;
+
+	/** @num_pinned_pages: number of entries in @pinned_pages. */
+	int num_pinned_pages;
+
+	/**
+	 * @pinned_mm: Address space charged (in locked_vm) for
+	 * @pinned_pages; holds a reference (mmgrab) while the pages are
+	 * pinned. NULL if the region isn't pinned.
+	 */
+	struct mm_struct *pinned_mm;
+
+	/**
+	 * @alloc_failures: number of times homa_pool_allocate couldn't find
+	 * space for a message, so the RPC was added to
+	 * @hsk->waiting_for_bufs (see SO_HOMA_POOL_STATS).
+	 */
+	atomic64_t alloc_failures;
+
+	/**
+	 * @dropped_bytes: bytes of data discarded by homa_data_pkt because
+	 * their message had no buffer space.
+	 */
+	atomic64_t dropped_bytes;
+
+	/**
+	 * @grant_skips: number of times homa_choose_rpcs_to_grant skipped
+	 * an RPC on this socket because it had no buffer space.
+	 */
+	atomic64_t grant_skips;
+};
+
+/**
+ * struct homa_ring - Kernel-side state for the submission and completion
+ * rings of a socket (see SO_HOMA_SET_RINGS in homa.h).
+ */
+struct homa_ring {
+	/** @hsk: Socket that owns the rings. */
+	struct homa_sock *hsk;
+
+	/** @ctl: User-space address of the ring indexes. */
+	struct homa_ring_ctl __user *ctl;
+
+	/** @sq: User-space address of the first submission entry. */
+	struct homa_ring_sqe __user *sq;
+
+	/** @cq: User-space address of the first completion entry. */
+	struct homa_ring_cqe __user *cq;
+
+	/** @sq_mask: Number of submission entries - 1. */
+	__u32 sq_mask;
+
+	/** @cq_mask: Number of completion entries - 1. */
+	__u32 cq_mask;
+
+	/**
+	 * @recv_flags: HOMA_RECVMSG_REQUEST and/or HOMA_RECVMSG_RESPONSE;
+	 * determines which incoming messages are posted.
+	 */
+	int recv_flags;
+
+	/**
+	 * @lock: Held while servicing the rings, so that the polling
+	 * thread and HOMAIOCRING don't operate on the rings concurrently.
+	 */
+	struct mutex lock;
+
+	/**
+	 * @thread: Kernel thread that services the rings, or NULL if
+	 * there is none.
+	 */
+	struct task_struct *thread;
+
+	/**
+	 * @mm: Address space of the application; used by @thread to access
+	 * the rings and message buffers. NULL if @thread is NULL. Only the
+	 * mm_struct is pinned (mmgrab); @thread takes a reference on the
+	 * address space itself (mmget_not_zero) for each pass over the
+	 * rings, and stops servicing them once the application has exited.
+	 */
+	struct mm_struct *mm;
+
+	/**
+	 * @idle_cycles: @thread sleeps after it has found nothing to do
+	 * for this many get_cycles units.
+	 */
+	__u64 idle_cycles;
+
+	/**
+	 * @sleeping: Nonzero means @thread is sleeping (or about to sleep)
+	 * and must be woken when new work arrives.
+	 */
+	atomic_t sleeping;
 };
 
 /**
@@ -1295,6 +1916,13 @@ struct homa_sock {
 	 */
 	struct homa_socktab_links socktab_links;
 
+	/**
+	 * @group: The port group this socket belongs to, or NULL if it
+	 * hasn't joined a group. Modified only while holding the
+	 * socktab's write_lock.
+	 */
+	struct homa_port_group *group;
+
 	/**
 	 * @active_rpcs: List of all existing RPCs related to this socket,
 	 * including both client and server RPCs. This list isn't strictly
@@ -1306,6 +1934,21 @@ struct homa_sock {
 	 */
 	struct list_head active_rpcs;
 
+	/**
+	 * @timer_wheel: Each active RPC is linked into one of these lists,
+	 * based on the next timer tick at which homa_timer needs to check
+	 * it (tick t is in slot t & (HOMA_TIMER_SLOTS-1)). This allows
+	 * homa_timer to skip RPCs that can't need attention yet.
+	 * Protected by @lock.
+	 */
+	struct list_head timer_wheel[HOMA_TIMER_SLOTS];
+
+	/**
+	 * @timer_ticks: The most recent value of homa->timer_ticks for
+	 * which homa_timer has processed @timer_wheel.
+	 */
+	__u32 timer_ticks;
+
 	/**
 	 * @dead_rpcs: Contains RPCs for which homa_rpc_free has been
 	 * called, but their packet buffers haven't yet been freed.
@@ -1316,14 +1959,64 @@ struct homa_sock {
 	int dead_skbs;
 
 	/**
-	 * @waiting_for_bufs: Contains RPCs that are blocked because there
-	 * wasn't enough space in the buffer pool region for their incoming
-	 * messages. Sorted in increasing order of message length.
+	 * @reap_queued: nonzero means this socket is currently queued
+	 * for a background reap worker (see homa_reap_queue).
 	 */
-	struct list_head waiting_for_bufs;
+	atomic_t reap_queued;
 
 	/**
-	 * @ready_requests: Contains server RPCs whose request message is
+	 * @reap_node: used to link this socket into a core's
+	 * @reap_socks list when @reap_queued is set.
+	 */
+	struct llist_node reap_node;
+
+	/**
+	 * @last_arrival: time (get_cycles() units) when homa_rpc_handoff
+	 * was last invoked for a message on this socket, or 0 if never.
+	 * Used for adaptive polling; protected by the socket lock.
+	 */
+	__u64 last_arrival;
+
+	/**
+	 * @avg_interarrival: moving average of the time between successive
+	 * @last_arrival values, in get_cycles() units; 0 means no estimate
+	 * yet. Written under the socket lock, read without it.
+	 */
+	__u64 avg_interarrival;
+
+	/**
+	 * @poll_rearm: nonzero means a thread recently had to sleep waiting
+	 * for a message on this socket; the next wait should poll for the
+	 * full poll_usecs, since messages often arrive in bursts.
+	 */
+	int poll_rearm;
+
+	/**
+	 * @rpc_cache_lock: Used to synchronize access to @rpc_cache; must
+	 * never be held while acquiring any other lock.
+	 */
+	spinlock_t rpc_cache_lock;
+
+	/**
+	 * @rpc_cache: Holds homa_rpc structs that have been reaped, linked
+	 * through their dead_links. New RPCs are taken from here when
+	 * possible, rather than allocating them with kmalloc. Emptied when
+	 * the socket is shut down.
+	 */
+	struct list_head rpc_cache;
+
+	/** @rpc_cache_size: Number of entries currently in @rpc_cache. */
+	int rpc_cache_size;
+
+	/**
+	 * @waiting_for_bufs: Contains RPCs that are blocked because there
+	 * wasn't enough space in the buffer pool region for their incoming
+	 * messages. Sorted in increasing order of message length.
+	 */
+	struct list_head waiting_for_bufs;
+
+	/**
+	 * @ready_requests: Contains server RPCs whose request message is
 	 * in a state requiring attention from  a user process. The head is
 	 * oldest, i.e. next to return.
 	 */
@@ -1366,6 +2059,105 @@ struct homa_sock {
 	 * @buffer_pool: used to allocate buffer space for incoming messages.
 	 */
 	struct homa_pool buffer_pool;
+
+	/**
+	 * @ring: Submission and completion rings for this socket, or NULL
+	 * if SO_HOMA_SET_RINGS hasn't been invoked.
+	 */
+	struct homa_ring *ring;
+
+	/**
+	 * @zerocopy_min_length: outgoing messages at least this long are
+	 * transmitted without copying their data (see SO_HOMA_ZEROCOPY);
+	 * 0 means zero-copy is disabled.
+	 */
+	int zerocopy_min_length;
+
+	/**
+	 * @buf_extent_length: number of bytes at the end of the buffer
+	 * region to reserve for contiguous extents when the region is
+	 * set (see SO_HOMA_BUF_EXTENTS).
+	 */
+	__u64 buf_extent_length;
+
+	/**
+	 * @buf_num_nodes: number of NUMA nodes among which to divide the
+	 * buffer region when it is set (see SO_HOMA_BUF_NODES); 0 means
+	 * no NUMA placement.
+	 */
+	int buf_num_nodes;
+
+	/**
+	 * @softirq_copy_length: incoming messages at least this long have
+	 * their data copied to the buffer region during SoftIRQ (see
+	 * SO_HOMA_SOFTIRQ_COPY); 0 means SoftIRQ copying is disabled. Takes
+	 * effect when the buffer region is set.
+	 */
+	int softirq_copy_length;
+
+	/**
+	 * @streaming: nonzero means recvmsg has been invoked on this socket
+	 * with HOMA_RECVMSG_STREAM; partially received messages are then
+	 * handed off whenever a new piece becomes available, even if their
+	 * data is copied during SoftIRQ.
+	 */
+	int streaming;
+
+	/**
+	 * @weight: this socket's share of grants and paced transmissions
+	 * relative to other sockets, when homa->weighted_shares is set
+	 * (see SO_HOMA_WEIGHT). Modified only with homa->grantable_lock
+	 * held.
+	 */
+	int weight;
+
+	/**
+	 * @num_grantable: number of this socket's RPCs that are currently
+	 * in grantable lists. Protected by homa->grantable_lock.
+	 */
+	int num_grantable;
+
+	/**
+	 * @grant_pass: value of homa->grant_pass when @pass_rpcs was last
+	 * valid; used to reset @pass_rpcs lazily.
+	 */
+	__u32 grant_pass;
+
+	/**
+	 * @pass_rpcs: number of this socket's RPCs selected so far by the
+	 * current invocation of homa_choose_rpcs_to_grant (only valid if
+	 * @grant_pass is current).
+	 */
+	int pass_rpcs;
+
+	/**
+	 * @granted_bytes: total bytes of grants issued for this socket's
+	 * incoming messages. Protected by homa->grantable_lock.
+	 */
+	__u64 granted_bytes;
+
+	/**
+	 * @share_limited: number of times homa_choose_rpcs_to_grant
+	 * skipped one of this socket's RPCs because the socket had
+	 * already been given its share of the grants. Protected by
+	 * homa->grantable_lock.
+	 */
+	__u64 share_limited;
+
+	/**
+	 * @pacer_vtime: weighted count of the bytes transmitted by the
+	 * pacer for this socket, used for fair queueing among sockets when
+	 * homa->weighted_shares is set (see homa_throttle_choose_weighted).
+	 * Updated without synchronization (different pacers can serve the
+	 * same socket); races only cause small errors in fairness.
+	 */
+	__u64 pacer_vtime;
+
+	/**
+	 * @paced_bytes: total bytes transmitted by the pacer for this
+	 * socket's outgoing messages.
+	 */
+	atomic64_t paced_bytes;
 };
 
 /**
@@ -1389,29 +2181,53 @@ struct homa_dead_dst {
 };
 
 /**
- * define HOMA_PEERTAB_BUCKETS - Number of bits in the bucket index for a
- * homa_peertab.  Should be large enough to hold an entry for every server
- * in a datacenter without long hash chains.
+ * define HOMA_PEERTAB_MIN_BITS - Number of bits in the bucket index for a
+ * newly created homa_peertab. The table grows from here as peers are added.
+ */
+#define HOMA_PEERTAB_MIN_BITS 10
+
+/**
+ * define HOMA_PEERTAB_MAX_BITS - Upper limit on the number of bits in the
+ * bucket index for a homa_peertab; once the table reaches this size, hash
+ * chains will lengthen rather than the table growing further.
  */
-#define HOMA_PEERTAB_BUCKET_BITS 16
+#define HOMA_PEERTAB_MAX_BITS 20
+
+/**
+ * struct homa_peer_buckets - The bucket array for a homa_peertab. A new
+ * one of these is allocated each time the table is resized.
+ */
+struct homa_peer_buckets {
+	/** @bits: Number of bits in the bucket index. */
+	int bits;
+
+	/**
+	 * @link: Which element of homa_peer.peertab_links is used to
+	 * chain peers in @heads.
+	 */
+	int link;
 
-/** define HOME_PEERTAB_BUCKETS - Number of buckets in a homa_peertab. */
-#define HOMA_PEERTAB_BUCKETS (1 << HOMA_PEERTAB_BUCKET_BITS)
+	/** @heads: Heads of chains of homa_peers for each bucket. */
+	struct hlist_head heads[];
+};
 
 /**
  * struct homa_peertab - A hash table that maps from IPv6 addresses
  * to homa_peer objects. IPv4 entries are encapsulated as IPv6 addresses.
- * Entries are gradually added to this table, but they are never removed
- * except when the entire table is deleted. We can't safely delete because
- * results returned by homa_peer_find may be retained indefinitely.
+ * Entries are reference counted; homa_peertab_sweep removes entries that
+ * have been unused for a while, and the memory is freed after an RCU
+ * grace period so that concurrent lookups remain safe.
  *
  * This table is managed exclusively by homa_peertab.c, using RCU to
- * permit efficient lookups.
+ * permit efficient lookups. The bucket array doubles in size whenever
+ * the number of peers exceeds the number of buckets; the new array is
+ * built alongside the old one (each peer has two sets of links) so that
+ * lookups can proceed without locking during a resize.
  */
 struct homa_peertab {
 	/**
-	 * @write_lock: Synchronizes addition of new entries; not needed
-	 * for lookups (RCU is used instead).
+	 * @write_lock: Synchronizes addition of new entries and resizing;
+	 * not needed for lookups (RCU is used instead).
 	 */
 	struct spinlock write_lock;
 
@@ -1422,26 +2238,57 @@ struct homa_peertab {
 	struct list_head dead_dsts;
 
 	/**
-	 * @buckets: Pointer to heads of chains of homa_peers for each bucket.
-	 * Malloc-ed, and must eventually be freed. NULL means this structure
-	 * has not been initialized.
+	 * @buckets: Current bucket array. Vmalloc-ed, and must eventually
+	 * be freed. NULL means this structure has not been initialized.
+	 * Readers must use rcu_dereference.
+	 */
+	struct homa_peer_buckets __rcu *buckets;
+
+	/**
+	 * @hash_seed: Random value mixed into the hash for each address,
+	 * so that bucket assignments can't be predicted from outside.
 	 */
-	struct hlist_head *buckets;
+	__u32 hash_seed;
+
+	/**
+	 * @num_peers: Total number of peers in the table. Modified only
+	 * with @write_lock held.
+	 */
+	int num_peers;
+
+	/**
+	 * @sweep_bucket: Index of the next bucket to be examined by
+	 * homa_peertab_sweep.
+	 */
+	int sweep_bucket;
 };
 
+/**
+ * define HOMA_PEER_SWEEP_SHIFT - Each call to homa_peertab_sweep normally
+ * examines 1/(2^HOMA_PEER_SWEEP_SHIFT) of the buckets in the peer table.
+ */
+#define HOMA_PEER_SWEEP_SHIFT 8
+
+/**
+ * define HOMA_ABORT_BATCH - Number of RPCs that homa_abort_peer_rpcs
+ * collects from a peer's RPC list each time it acquires the list's lock.
+ */
+#define HOMA_ABORT_BATCH 16
+
 /**
  * struct homa_peer - One of these objects exists for each machine that we
  * have communicated with (either as client or server).
  */
 struct homa_peer {
+	/* The first cache line holds read-mostly information that is
+	 * needed for nearly every outgoing packet.
+	 */
+
 	/**
 	 * @addr: IPv6 address for the machine (IPv4 addresses are stored
 	 * as IPv4-mapped IPv6 addresses).
 	 */
-	struct in6_addr addr;
-
-	/** @flow: Addressing info needed to send packets. */
-	struct flowi flow;
+	struct in6_addr addr __attribute__((aligned(CACHE_LINE_SIZE)));
 
 	/**
 	 * @dst: Used to route packets to this peer; we own a reference
@@ -1465,33 +2312,168 @@ struct homa_peer {
 	 */
 	__be16 cutoff_version;
 
+	/** @flow: Addressing info needed to send packets. */
+	struct flowi flow;
+
+	/**
+	 * @ack_lock: used to synchronize access to @num_acks and @acks.
+	 * These fields are modified on every completed client RPC, so they
+	 * start a new cache line to keep them from invalidating the
+	 * read-mostly fields above.
+	 */
+	struct spinlock ack_lock __attribute__((aligned(CACHE_LINE_SIZE)));
+
+	/**
+	 * @num_acks: the number of (initial) entries in @acks that
+	 * currently hold valid information.
+	 */
+	int num_acks;
+
+	/**
+	 * @ack_cycles: get_cycles() time when @num_acks last became nonzero;
+	 * used by homa_peer_flush_acks to bound how long acks can wait for
+	 * a packet to piggyback on.
+	 */
+	__u64 ack_cycles;
+
+	/**
+	 * @ack_links: Used to link this peer into homa->ack_peers while
+	 * it has pending acks; protected by homa->ack_peers_lock. Empty
+	 * if the peer isn't in that list.
+	 */
+	struct list_head ack_links;
+
+	/**
+	 * @acks: info about client RPCs whose results have been completely
+	 * received.
+	 */
+	struct homa_ack acks[HOMA_MAX_PEER_ACKS];
+
+	/**
+	 * @refs: Reference count: one reference belongs to the peer table,
+	 * and one more is held by each homa_rpc (and any other code) that
+	 * is using this peer. 0 means the peer has been evicted from the
+	 * table and will be freed once an RCU grace period has elapsed.
+	 * See homa_peer_hold and homa_peer_put.
+	 */
+	atomic_t refs;
+
+	/**
+	 * @last_put: Time (in jiffies) of the most recent call to
+	 * homa_peer_put for this peer; used to decide when a peer with
+	 * no users has been idle long enough to evict.
+	 */
+	unsigned long last_put;
+
+	/**
+	 * @nic: NIC queue information for the device used by @dst, or NULL
+	 * if not yet known (see homa_get_nic). Recomputed whenever @dst
+	 * changes.
+	 */
+	struct homa_nic *nic;
+
+	/**
+	 * @handoff_core: the core of the thread that most recently received
+	 * an incoming message from this peer via homa_rpc_handoff, or -1
+	 * if none. Used by homa_choose_interest to keep a peer's messages
+	 * on the same core when possible (its state is likely to still be
+	 * in that core's cache). Accessed without synchronization.
+	 */
+	int handoff_core;
+
+	/**
+	 * @rtt_cycles: Estimated round-trip time to this peer, in
+	 * get_cycles() units: the smallest observed delay between
+	 * transmitting the first packet of a message and receiving its
+	 * first grant, over the current measurement window. 0 means no
+	 * estimate yet. Accessed without synchronization.
+	 */
+	__u64 rtt_cycles;
+
+	/**
+	 * @rtt_jiffies: Time (in jiffies) when @rtt_cycles was last
+	 * replaced; after HOMA_RTT_WINDOW jiffies, the next sample replaces
+	 * it even if larger, so the estimate tracks route changes.
+	 */
+	unsigned long rtt_jiffies;
+
+	/**
+	 * @cong_level: How congested the network path from this peer
+	 * appears to be, from 0 (not congested) to HOMA_MAX_CONG_LEVEL.
+	 * Each level halves the grant window and the number of RPCs we
+	 * will grant to concurrently for this peer. Only used if
+	 * homa->congestion_signal is nonzero; accessed without
+	 * synchronization.
+	 */
+	int cong_level;
+
+	/**
+	 * @cong_ticks: Value of homa->timer_ticks when @cong_level last
+	 * changed. Used to raise the level at most once per tick (one
+	 * congestion episode typically produces many signals) and to decay
+	 * it after a quiet period.
+	 */
+	__u32 cong_ticks;
+
+	/* Remaining fields are used only occasionally (timer, grants,
+	 * table management).
+	 */
+
 	/**
 	 * last_update_jiffies: time in jiffies when we sent the most
 	 * recent CUTOFFS packet to this peer.
 	 */
-	unsigned long last_update_jiffies;
+	unsigned long last_update_jiffies __attribute__((aligned(CACHE_LINE_SIZE)));
 
 	/**
-	 * grantable_rpcs: Contains all homa_rpcs (both requests and
-	 * responses) involving this peer whose msgins require (or required
-	 * them in the past) and have not been fully received. The list is
-	 * sorted in priority order (head has fewest bytes_remaining).
-	 * Locked with homa->grantable_lock.
+	 * @grantable_rpcs: Contains all homa_rpcs (both requests and
+	 * responses) involving this peer whose msgins have not been fully
+	 * granted. The list is sorted in priority order (head has fewest
+	 * bytes_remaining; ties go to the oldest message). Locked with
+	 * homa->grantable_lock.
 	 */
 	struct list_head grantable_rpcs;
 
 	/**
-	 * @grantable_links: Used to link this peer into homa->grantable_rpcs.
-	 * If this RPC is not linked into homa->grantable_rpcs, this is an
-	 * empty list pointing to itself.
+	 * @grantable_links: Used to link this peer into
+	 * homa->grantable_peers. If this peer is not linked into
+	 * homa->grantable_peers, this is an empty list pointing to itself.
 	 */
 	struct list_head grantable_links;
 
+	/**
+	 * @rpcs: Contains all of the live homa_rpcs (client and server, on
+	 * all sockets) whose peer is this one, so that they can be found
+	 * without scanning every socket when the peer fails or an ICMP
+	 * error arrives for it (see homa_abort_peer_rpcs). RPCs are added
+	 * when they are created and removed by homa_rpc_free. Locked with
+	 * @rpcs_lock.
+	 */
+	struct list_head rpcs;
+
+	/** @num_rpcs: Number of RPCs in @rpcs. */
+	int num_rpcs;
+
+	/**
+	 * @rpcs_lock: Protects @rpcs and @num_rpcs. This lock may be
+	 * acquired while holding RPC and socket locks, so neither of those
+	 * may be acquired while holding it.
+	 */
+	struct spinlock rpcs_lock;
+
 	/**
 	 * @peertab_links: Links this object into a bucket of its
-	 * homa_peertab.
+	 * homa_peertab. Two sets of links are needed so that a
+	 * resized bucket array can be built while lookups continue in
+	 * the old one; homa_peer_buckets.link selects the one in use.
+	 */
+	struct hlist_node peertab_links[2];
+
+	/**
+	 * @rcu_head: Used to free this peer after it has been evicted
+	 * from the peer table.
 	 */
-	struct hlist_node peertab_links;
+	struct rcu_head rcu_head;
 
 	/**
 	 * @outstanding_resends: the number of resend requests we have
@@ -1532,23 +2514,305 @@ struct homa_peer {
 	 * in the current pass, if it still needs one.
 	 */
 	struct homa_rpc *resend_rpc;
+};
+
+/**
+ * struct homa_timer_shard - Information about one of the threads that
+ * share the work of homa_timer. Sockets are divided among shards by port
+ * number; shard 0 is handled by the main timer thread.
+ */
+struct homa_timer_shard {
+	/** @homa: Overall information about the Homa transport. */
+	struct homa *homa;
+
+	/** @id: Index of this structure in homa->timer_shards. */
+	int id;
 
 	/**
-	 * @num_acks: the number of (initial) entries in @acks that
-	 * currently hold valid information.
+	 * @ticks: The most recent value of homa->timer_ticks that this
+	 * shard has been asked to process.
 	 */
-	int num_acks;
+	__u32 ticks;
 
 	/**
-	 * @acks: info about client RPCs whose results have been completely
-	 * received.
+	 * @done_ticks: The value of @ticks when this shard's thread last
+	 * started processing its sockets.
 	 */
-	struct homa_ack acks[NUM_PEER_UNACKED_IDS];
+	__u32 done_ticks;
 
 	/**
-	 * @ack_lock: used to synchronize access to @num_acks and @acks.
+	 * @kthread: Kernel thread that handles this shard, or NULL if none
+	 * (always NULL for shard 0).
+	 */
+	struct task_struct *kthread;
+
+	/** @kthread_done: Used to wait for @kthread to exit. */
+	struct completion kthread_done;
+};
+
+/**
+ * define HOMA_MAX_PACERS - Largest allowable value for homa->num_pacers.
+ * Must not exceed the number of bits in an unsigned long.
+ */
+#define HOMA_MAX_PACERS 8
+
+/**
+ * define HOMA_THROTTLE_BUCKETS - Number of lists in the throttled queue
+ * for each pacer. RPCs are bucketed by fls(bytes remaining to transmit),
+ * so this must be large enough to cover HOMA_MAX_MESSAGE_LENGTH.
+ */
+#define HOMA_THROTTLE_BUCKETS 32
+
+/**
+ * struct homa_pacer - Information about one pacer thread and the throttled
+ * RPCs that it is responsible for.
+ */
+struct homa_pacer {
+	/**
+	 * @mutex: Ensures that only one instance of homa_pacer_xmit
+	 * runs at a time for this pacer. Only used in "try" mode: never
+	 * block on this.
 	 */
-	struct spinlock ack_lock;
+	struct spinlock mutex __attribute__((aligned(CACHE_LINE_SIZE)));
+
+	/** @homa: Overall information about the Homa transport. */
+	struct homa *homa;
+
+	/** @id: Index of this structure in homa->pacers. */
+	int id;
+
+	/**
+	 * @fifo_count: When this becomes <= zero, it's time for the
+	 * pacer to allow the oldest RPC to transmit.
+	 */
+	int fifo_count;
+
+	/**
+	 * @vtime: When homa->weighted_shares is set, this is the virtual
+	 * time of the pacer: the @pacer_vtime of the socket most recently
+	 * served (before it was charged for the transmission). Sockets
+	 * that have been idle are advanced to this value, so they can't
+	 * accumulate credit.
+	 */
+	__u64 vtime;
+
+	/**
+	 * @wake_time: get_cycles() time when the pacer last woke up
+	 * (if the pacer is running) or 0 if the pacer is sleeping.
+	 */
+	__u64 wake_time;
+
+	/**
+	 * @throttle_lock: Used to synchronize access to @throttled_rpcs
+	 * and @nonempty_buckets. To insert or remove an RPC from
+	 * throttled_rpcs, must first acquire the RPC's socket lock, then
+	 * this lock.
+	 */
+	struct spinlock throttle_lock;
+
+	/**
+	 * @nonempty_buckets: Bit i is set if @throttled_rpcs[i] is
+	 * nonempty. May be read without holding @throttle_lock, but only
+	 * as a hint.
+	 */
+	__u32 nonempty_buckets;
+
+	/**
+	 * @throttled_rpcs: Contains all homa_rpcs assigned to this pacer
+	 * that have bytes ready for transmission, but which couldn't be
+	 * sent without exceeding the queue limits for transmission. An
+	 * RPC with n bytes left to transmit lives in the list at index
+	 * fls(n), and each list is sorted by bytes left, so the first
+	 * RPC in the lowest nonempty list is the highest priority one.
+	 * RPCs move to a lower list when transmissions take them below
+	 * a power of two (see homa_throttle_rebucket); order within a
+	 * list is only approximate, since it isn't updated as RPCs in
+	 * the list transmit.
+	 */
+	struct list_head throttled_rpcs[HOMA_THROTTLE_BUCKETS];
+
+	/**
+	 * @throttle_add: The get_cycles() time when the most recent RPC
+	 * was added to @throttled_rpcs.
+	 */
+	__u64 throttle_add;
+
+	/**
+	 * @kthread: Kernel thread that transmits packets from
+	 * @throttled_rpcs in a way that limits queue buildup in the
+	 * NIC, or NULL if the thread hasn't been started.
+	 */
+	struct task_struct *kthread;
+
+	/** @kthread_done: Signaled when @kthread exits. */
+	struct completion kthread_done;
+};
+
+/**
+ * define HOMA_MAX_NICS - Largest number of network devices for which Homa
+ * keeps separate NIC queue estimates; if more devices than this are used,
+ * the extras share the last entry in homa->nics.
+ */
+#define HOMA_MAX_NICS 8
+
+/**
+ * define HOMA_RTT_WINDOW - Number of jiffies over which homa_peer.rtt_cycles
+ * holds the minimum observed RTT.
+ */
+#define HOMA_RTT_WINDOW (10*HZ)
+
+/**
+ * define HOMA_PEER_RTT_RANGE - Values computed by homa_peer_rtt_bytes
+ * never differ by more than this factor from the corresponding global
+ * sysctl value; this limits the damage from a bad RTT estimate.
+ */
+#define HOMA_PEER_RTT_RANGE 4
+
+/**
+ * define HOMA_GSO_SOFTWARE - Value of gso_type for outgoing DATA packets
+ * when homa->gso_force_software is set. It claims TCP segmentation with
+ * ECN and fixed IP ids; few NICs advertise all of the corresponding
+ * features, so the kernel falls back to homa_gso_segment.
+ */
+#define HOMA_GSO_SOFTWARE (SKB_GSO_TCPV4 | SKB_GSO_TCP_ECN \
+		| SKB_GSO_TCP_FIXEDID)
+
+/**
+ * define HOMA_UDP_SPORT_BASE - When packets are encapsulated in UDP, the
+ * source port is HOMA_UDP_SPORT_BASE plus a hash of the RPC, so that RSS
+ * and ECMP spread different RPCs across queues and paths.
+ */
+#define HOMA_UDP_SPORT_BASE 0xc000
+
+/**
+ * define HOMA_UDP_SPORT_MASK - Mask applied to the RPC hash when
+ * computing UDP source ports (see HOMA_UDP_SPORT_BASE).
+ */
+#define HOMA_UDP_SPORT_MASK 0x3fff
+
+/**
+ * define HOMA_CONG_ECN - Bit in homa->congestion_signal: treat ECN
+ * congestion marks on incoming DATA packets as a sign of congestion
+ * on the path from the sender.
+ */
+#define HOMA_CONG_ECN 1
+
+/**
+ * define HOMA_CONG_RESENDS - Bit in homa->congestion_signal: treat the
+ * need to send a RESEND to a peer as a sign of congestion on the path
+ * from that peer.
+ */
+#define HOMA_CONG_RESENDS 2
+
+/**
+ * define HOMA_MAX_CONG_LEVEL - Largest allowable value for
+ * homa_peer.cong_level; each level halves the peer's grant window.
+ */
+#define HOMA_MAX_CONG_LEVEL 4
+
+/**
+ * define HOMA_NUM_SMALL_COUNTS - Number of entries in
+ * homa_metrics.small_msg_bytes (64-byte size ranges).
+ */
+#define HOMA_NUM_SMALL_COUNTS 64
+
+/**
+ * define HOMA_NUM_MEDIUM_COUNTS - Number of entries in
+ * homa_metrics.medium_msg_bytes (1-Kbyte size ranges).
+ */
+#define HOMA_NUM_MEDIUM_COUNTS 128
+
+/**
+ * define HOMA_CUTOFF_BUCKETS - Number of message-size ranges tracked by
+ * struct homa_cutoff_state: one for each entry in small_msg_bytes and
+ * medium_msg_bytes.
+ */
+#define HOMA_CUTOFF_BUCKETS (HOMA_NUM_SMALL_COUNTS + HOMA_NUM_MEDIUM_COUNTS)
+
+/**
+ * struct homa_cutoff_state - Information used by homa_auto_cutoffs to
+ * compute unsched_cutoffs from recent traffic. Accessed only by the
+ * timer thread.
+ */
+struct homa_cutoff_state {
+	/**
+	 * @prev_bytes: for each message-size range, the total bytes
+	 * received in messages in that range (summed across all cores'
+	 * small_msg_bytes and medium_msg_bytes metrics) as of the last
+	 * time cutoffs were computed.
+	 */
+	__u64 prev_bytes[HOMA_CUTOFF_BUCKETS];
+
+	/**
+	 * @prev_large_count: same as @prev_bytes, except for the
+	 * large_msg_count metric.
+	 */
+	__u64 prev_large_count;
+
+	/**
+	 * @prev_large_bytes: same as @prev_bytes, except for the
+	 * large_msg_bytes metric.
+	 */
+	__u64 prev_large_bytes;
+
+	/**
+	 * @bytes: scratch space used by homa_auto_cutoffs (too large to
+	 * allocate on the stack): bytes received in each range since
+	 * @prev_bytes was recorded, later converted to unscheduled bytes.
+	 */
+	__u64 bytes[HOMA_CUTOFF_BUCKETS];
+};
+
+/**
+ * define HOMA_NIC_CONFIG_LENGTH - Size of the homa->nic_link_mbps buffer.
+ */
+#define HOMA_NIC_CONFIG_LENGTH 200
+
+/**
+ * struct homa_nic - Holds Homa's estimate of the transmit queue length for
+ * a single network device. Each of these structures occupies its own cache
+ * lines, so that transmissions on different devices (e.g. NICs attached to
+ * different NUMA nodes) don't contend.
+ */
+struct homa_nic {
+	/**
+	 * @link_idle_time: The time, measured by get_cycles() at which we
+	 * estimate that all of the packets we have passed to Linux for
+	 * transmission on this device will have been transmitted. May be
+	 * in the past. This estimate assumes that only Homa is transmitting
+	 * data, so it could be a severe underestimate if there is competing
+	 * traffic from, say, TCP. Access only with atomic ops.
+	 */
+	atomic64_t link_idle_time __attribute__((aligned(CACHE_LINE_SIZE)));
+
+	/**
+	 * @prio_idle_time: Used only when homa->priority_queues is set.
+	 * Entry i is the time at which we estimate that all queued packets
+	 * with priority i or higher will have been transmitted (packets at
+	 * lower priorities don't delay them, since they are in different
+	 * TX queues). Entry 0 is unused: link_idle_time serves that role.
+	 * Access only with atomic ops.
+	 */
+	atomic64_t prio_idle_time[HOMA_MAX_PRIORITIES];
+
+	/** @ifindex: Interface index of the device. */
+	int ifindex;
+
+	/**
+	 * @link_mbps: Bandwidth of the device's uplink, in units of 1e06
+	 * bits per second: either from homa->nic_link_mbps or, if the device
+	 * isn't listed there, homa->link_mbps.
+	 */
+	int link_mbps;
+
+	/**
+	 * @cycles_per_kbyte: Same as homa->cycles_per_kbyte, except for
+	 * this device.
+	 */
+	__u32 cycles_per_kbyte;
+
+	/** @name: Name of the device (for sysctl matching and logging). */
+	char name[IFNAMSIZ];
 };
 
 /**
@@ -1562,6 +2826,62 @@ enum homa_freeze_type {
 	SOCKET_CLOSE           = 4,
 	PACKET_LOST            = 5,
 	NEED_ACK_MISSING_DATA  = 6,
+
+	/* The following values are used by the automatic freeze triggers
+	 * (see homa_freeze_trigger); they are not selected by freeze_type.
+	 */
+	SLOW_FOR_SIZE          = 7,
+	GRANTABLE_RPCS         = 8,
+	RESEND_RATE            = 9,
+};
+
+/**
+ * struct homa_policy_ops - Hooks that allow Homa's grant and priority
+ * policies to be replaced without modifying Homa, either by a BPF
+ * struct_ops program (registered as "homa_policy_ops") or by another
+ * kernel module (see homa_policy_register, which is exported along with
+ * the global homa). Any hook may be NULL, in
+ * which case Homa's default policy is used for that decision. Hooks are
+ * invoked with bottom halves disabled, often with the grantable lock or
+ * an RPC lock held, so they must not sleep, and they must not modify
+ * the structures passed to them.
+ */
+struct homa_policy_ops {
+	/**
+	 * @grantable_before: Determines the order of grantable messages,
+	 * both within a peer's list and across peers; returns nonzero if
+	 * @rpc1 should be granted ahead of @rpc2. This must be a strict
+	 * ordering that depends only on information that doesn't change
+	 * while an RPC is grantable, other than msgin.bytes_remaining
+	 * (which only decreases). The default is SRPT: fewer bytes remaining
+	 * first, ties broken by age.
+	 */
+	int (*grantable_before)(struct homa_rpc *rpc1, struct homa_rpc *rpc2);
+
+	/**
+	 * @unsched_priority: Returns the priority to use for unscheduled
+	 * packets of an outgoing message of @length bytes to @peer;
+	 * @priority is the level Homa would use by default. The result
+	 * is clamped to 0..num_priorities-1.
+	 */
+	int (*unsched_priority)(struct homa_peer *peer, int length,
+			int priority);
+
+	/**
+	 * @grant_priority: Returns the priority to specify in a grant for
+	 * @rpc, which is the @rank'th best grantable message (0 is best);
+	 * @priority is the level Homa would use by default. The result
+	 * is clamped to 0..max_sched_prio.
+	 */
+	int (*grant_priority)(struct homa_rpc *rpc, int rank, int priority);
+
+	/**
+	 * @fifo_key: Returns a key used to select the message for FIFO
+	 * grants (see grant_fifo_fraction): the grantable message with the
+	 * smallest key is chosen. The default key is msgin.birth, so the
+	 * oldest message is chosen.
+	 */
+	__u64 (*fifo_key)(struct homa_rpc *rpc);
 };
 
 /**
@@ -1579,31 +2899,83 @@ struct homa {
 	atomic64_t next_outgoing_id;
 
 	/**
-	 * @link_idle_time: The time, measured by get_cycles() at which we
-	 * estimate that all of the packets we have passed to Linux for
-	 * transmission will have been transmitted. May be in the past.
-	 * This estimate assumes that only Homa is transmitting data, so
-	 * it could be a severe underestimate if there is competing traffic
-	 * from, say, TCP. Access only with atomic ops.
+	 * @nics: NIC queue estimates for each of the network devices that
+	 * Homa has transmitted on. Entries are assigned by homa_nic_find
+	 * and never released.
 	 */
-	atomic64_t link_idle_time __attribute__((aligned(CACHE_LINE_SIZE)));
+	struct homa_nic nics[HOMA_MAX_NICS];
+
+	/**
+	 * @num_nics: Number of entries in @nics that have been assigned
+	 * to devices. May be read without @nic_lock.
+	 */
+	int num_nics;
+
+	/** @nic_lock: Used to synchronize the assignment of @nics entries. */
+	struct spinlock nic_lock;
 
 	/**
-	 * @grantable_lock: Used to synchronize access to @grantable_rpcs and
-	 * @num_grantable_rpcs.
+	 * @ack_peers: Peers with acks that haven't yet been sent (linked
+	 * through their ack_links fields). Used only if @ack_flush_cycles
+	 * is nonzero.
+	 */
+	struct list_head ack_peers;
+
+	/** @ack_peers_lock: Used to synchronize access to @ack_peers. */
+	struct spinlock ack_peers_lock;
+
+	/**
+	 * @grantable_lock: Used to synchronize access to @grantable_peers,
+	 * the grantable_rpcs lists of peers, and @num_grantable_rpcs.
 	 */
 	struct spinlock grantable_lock __attribute__((aligned(CACHE_LINE_SIZE)));
 
 	/**
-	 * @grantable_rpcs: Contains all RPCs that have not been fully
-	 * granted. The list is sorted in priority order (fewer ungranted
-	 * bytes -> higher priority).
+	 * @grant_recalc_count: Incremented each time homa_send_grants is
+	 * invoked. A core that computes grants compares this before and
+	 * after its computation; if it changed, another core requested
+	 * grants in the meantime (and didn't wait for grantable_lock), so
+	 * the computation must be repeated.
 	 */
-	struct list_head grantable_rpcs;
+	atomic_t grant_recalc_count;
+
+	/**
+	 * @grant_recalc_done: The value of @grant_recalc_count when the
+	 * most recent grant computation started. If @grant_recalc_count
+	 * differs from this, some request for grants hasn't been handled
+	 * yet; homa_grantable_unlock checks for this so that requests made
+	 * while other code holds grantable_lock aren't lost. Written only
+	 * with grantable_lock held.
+	 */
+	int grant_recalc_done;
+
+	/**
+	 * @grantable_peers: Contains all peers that have at least one RPC
+	 * that has not been fully granted (the RPCs themselves are in
+	 * peer->grantable_rpcs). The list is sorted by the priority of each
+	 * peer's first grantable RPC, so the highest priority RPCs can be
+	 * found without scanning every grantable RPC.
+	 */
+	struct list_head grantable_peers;
 
-	/** @num_grantable_rpcs: The number of RPCs in grantable_rpcs. */
+	/**
+	 * @num_grantable_rpcs: The total number of RPCs in the
+	 * grantable_rpcs lists of all peers.
+	 */
 	int num_grantable_rpcs;
 
+	/**
+	 * @grantable_weight: The sum of the weights of all sockets that
+	 * currently have RPCs in grantable lists.
+	 */
+	int grantable_weight;
+
+	/**
+	 * @grant_pass: Incremented by each invocation of
+	 * homa_choose_rpcs_to_grant (see homa_sock.grant_pass).
+	 */
+	__u32 grant_pass;
+
 	/** @last_grantable_change: The get_cycles time of the most recent
 	 * increment or decrement of num_grantable_rpcs; used for computing
 	 * statistics.
@@ -1623,58 +2995,49 @@ struct homa {
 	 */
 	int grant_nonfifo;
 
-	/**
-	 * @grant_nonfifo_left: Counts down bytes using the normal
-	 * priority mechanism. When this reaches zero, it's time to grant
-	 * to the old message.
-	 */
-	int grant_nonfifo_left;
-
-	/**
-	 * @pacer_mutex: Ensures that only one instance of homa_pacer_xmit
-	 * runs at a time. Only used in "try" mode: never block on this.
-	 */
-	struct spinlock pacer_mutex __attribute__((aligned(CACHE_LINE_SIZE)));
-
-	/**
-	 * @pacer_fifo_fraction: The fraction of time (in thousandths) when
-	 * the pacer should transmit next from the oldest message, rather
-	 * than the highest-priority message. Set externally via sysctl.
+	/**
+	 * @grant_nonfifo_left: Counts down bytes using the normal
+	 * priority mechanism. When this reaches zero, it's time to grant
+	 * to the old message.
 	 */
-	int pacer_fifo_fraction;
+	int grant_nonfifo_left;
 
 	/**
-	 * @pacer_fifo_count: When this becomes <= zero, it's time for the
-	 * pacer to allow the oldest RPC to transmit.
+	 * @pacers: One entry for each pacer thread. Only the first
+	 * @active_pacers entries accept new RPCs, but pacers beyond that
+	 * continue to run (if they were ever started) so that they can
+	 * drain their queues.
 	 */
-	int pacer_fifo_count;
+	struct homa_pacer pacers[HOMA_MAX_PACERS];
 
 	/**
-	 * @pacer_start: get_cycles() time when the pacer last woke up
-	 * (if the pacer is running) or 0 if the pacer is sleeping.
+	 * @num_pacers: Desired number of pacer threads among which throttled
+	 * RPCs are divided (RPCs are assigned to pacers by peer). Set
+	 * externally via sysctl; clamped to the range 1..HOMA_MAX_PACERS.
 	 */
-	__u64 pacer_wake_time;
+	int num_pacers;
 
 	/**
-	 * @throttle_lock: Used to synchronize access to @throttled_rpcs. To
-	 * insert or remove an RPC from throttled_rpcs, must first acquire
-	 * the RPC's socket lock, then this lock.
+	 * @active_pacers: Number of entries at the beginning of @pacers
+	 * whose threads have been started, and which will accept new
+	 * throttled RPCs. Only updated by homa_pacer_start.
 	 */
-	struct spinlock throttle_lock;
+	int active_pacers;
 
 	/**
-	 * @throttled_rpcs: Contains all homa_rpcs that have bytes ready
-	 * for transmission, but which couldn't be sent without exceeding
-	 * the queue limits for transmission. Manipulate only with "_rcu"
-	 * functions.
+	 * @throttled_pacers: Bit mask with one bit for each entry in
+	 * @pacers; a bit is set if that pacer has at least one throttled
+	 * RPC. Used to skip quickly over idle pacers. Modify only with
+	 * atomic bit operations.
 	 */
-	struct list_head throttled_rpcs;
+	unsigned long throttled_pacers;
 
 	/**
-	 * @throttle_add: The get_cycles() time when the most recent RPC
-	 * was added to @throttled_rpcs.
+	 * @pacer_fifo_fraction: The fraction of time (in thousandths) when
+	 * the pacer should transmit next from the oldest message, rather
+	 * than the highest-priority message. Set externally via sysctl.
 	 */
-	__u64 throttle_add;
+	int pacer_fifo_fraction;
 
 	/**
 	 * @throttle_min_bytes: If a packet has fewer bytes than this, then it
@@ -1736,12 +3099,42 @@ struct homa {
 	 */
 	int window;
 
+	/**
+	 * @peer_rtt: nonzero means that Homa measures the round-trip time
+	 * to each peer and uses it to scale @unsched_bytes and @window for
+	 * that peer (see homa_peer_rtt_bytes). Set externally via sysctl.
+	 */
+	int peer_rtt;
+
+	/**
+	 * @congestion_signal: nonzero means grants to a peer are reduced
+	 * when the path from that peer appears congested. It is a bit mask
+	 * of HOMA_CONG_ECN and HOMA_CONG_RESENDS, selecting the signals
+	 * to use. Set externally via sysctl.
+	 */
+	int congestion_signal;
+
+	/**
+	 * @congestion_decay_ticks: A peer's cong_level is reduced by one
+	 * after this many timer ticks without any congestion signal from
+	 * that peer. Set externally via sysctl.
+	 */
+	int congestion_decay_ticks;
+
 	/**
 	 * @link_bandwidth: The raw bandwidth of the network uplink, in
 	 * units of 1e06 bits per second.  Set externally via sysctl.
 	 */
 	int link_mbps;
 
+	/**
+	 * @nic_link_mbps: Link speeds for individual network devices, in
+	 * the form "eth0:100000 eth1:25000" (Mbps); devices not listed use
+	 * @link_mbps. Set externally via sysctl. Modified and parsed only
+	 * while holding @nic_lock (see homa_dostring).
+	 */
+	char nic_link_mbps[HOMA_NIC_CONFIG_LENGTH];
+
 	/**
 	 * @poll_usecs: Amount of time (in microseconds) that a thread
 	 * will spend busy-waiting for an incoming messages before
@@ -1755,6 +3148,15 @@ struct homa {
 	 */
 	int poll_cycles;
 
+	/**
+	 * @adaptive_poll: nonzero means the time that homa_wait_for_message
+	 * busy-waits is computed for each socket from the average interval
+	 * between its incoming messages (see homa_poll_budget), with
+	 * @poll_usecs as an upper limit; zero means always poll for
+	 * @poll_usecs. Set externally via sysctl.
+	 */
+	int adaptive_poll;
+
 	/**
 	 * @num_priorities: The total number of priority levels available for
 	 * Homa's use. Internally, Homa will use priorities from 0 to
@@ -1798,6 +3200,33 @@ struct homa {
 	 */
 	int cutoff_version;
 
+	/**
+	 * @auto_cutoffs: if nonzero, Homa computes @unsched_cutoffs itself
+	 * from the sizes of recently received messages (see
+	 * homa_auto_cutoffs), considering new cutoffs every @auto_cutoffs
+	 * timer ticks. Zero means @unsched_cutoffs is only set externally.
+	 * Set externally via sysctl.
+	 */
+	int auto_cutoffs;
+
+	/**
+	 * @auto_cutoffs_min_msgs: homa_auto_cutoffs won't compute new
+	 * cutoffs until at least this many messages have been received
+	 * since the last computation. Set externally via sysctl.
+	 */
+	int auto_cutoffs_min_msgs;
+
+	/**
+	 * @auto_cutoffs_drift: newly computed cutoffs are installed only if
+	 * at least one of them differs from its current value by more than
+	 * this percentage (or the number of unscheduled priorities changes).
+	 * This keeps cutoffs from flapping. Set externally via sysctl.
+	 */
+	int auto_cutoffs_drift;
+
+	/** @cutoff_state: information used by homa_auto_cutoffs. */
+	struct homa_cutoff_state cutoff_state;
+
 	/**
 	 * @fifo_grant_increment: how many additional bytes to grant in
 	 * a "pity" grant sent to the oldest outstanding message. Set
@@ -1812,6 +3241,22 @@ struct homa {
 	 */
 	int grant_fifo_fraction;
 
+	/**
+	 * @weighted_shares: Nonzero means that grants and paced
+	 * transmissions are divided among sockets according to their
+	 * weights (see SO_HOMA_WEIGHT), with SRPT used only among the
+	 * messages of each socket; zero means pure SRPT across all
+	 * sockets. Set externally via sysctl.
+	 */
+	int weighted_shares;
+
+	/**
+	 * @policy: If non-NULL, replaces some or all of Homa's grant and
+	 * priority policies (see homa_policy_register). RCU-protected;
+	 * set and cleared only with the grantable lock held.
+	 */
+	struct homa_policy_ops __rcu *policy;
+
 	/**
 	 * @max_overcommit: The maximum number of messages to which Homa will
 	 * send grants at any given point in time.  Set externally via sysctl.
@@ -1833,6 +3278,22 @@ struct homa {
 	 */
 	int max_rpcs_per_peer;
 
+	/**
+	 * @max_peer_kbytes: Limit on the total memory (in Kbytes) consumed
+	 * by homa_peer structs. When this is exceeded, homa_timer evicts
+	 * peers that are not currently in use, even if they haven't been
+	 * idle for @peer_idle_secs. Peers in use are never evicted, so this
+	 * limit can be exceeded. 0 means no limit. Set externally via sysctl.
+	 */
+	int max_peer_kbytes;
+
+	/**
+	 * @peer_idle_secs: A peer that hasn't been used by any RPC
+	 * for this many seconds will be removed from the peer table.
+	 * Set externally via sysctl.
+	 */
+	int peer_idle_secs;
+
 	/**
 	 * @resend_ticks: When an RPC's @silent_ticks reaches this value,
 	 * start sending RESEND requests.
@@ -1858,12 +3319,34 @@ struct homa {
 	 */
 	int request_ack_ticks;
 
+	/**
+	 * @ack_flush_usecs: If nonzero, acks buffered in a peer are sent
+	 * in an explicit ACK packet (by homa_timer) once the oldest has
+	 * waited this many microseconds without a packet to piggyback on.
+	 * Zero means acks wait until a peer's buffer fills or the server
+	 * sends NEED_ACK. Set externally via sysctl.
+	 */
+	int ack_flush_usecs;
+
+	/**
+	 * @ack_flush_cycles: Same as ack_flush_usecs, except in units
+	 * of get_cycles().
+	 */
+	__u64 ack_flush_cycles;
+
 	/**
 	 * @reap_limit: Maximum number of packet buffers to free in a
 	 * single call to home_rpc_reap.
 	 */
 	int reap_limit;
 
+	/**
+	 * @rpc_cache_max: Maximum number of reaped homa_rpc structs that
+	 * a socket will retain for reuse by new RPCs. 0 means reaped RPCs
+	 * are always returned to kmalloc. Set externally via sysctl.
+	 */
+	int rpc_cache_max;
+
 	/**
 	 * @dead_buffs_limit: If the number of packet buffers in dead but
 	 * not yet reaped RPCs is less than this number, then Homa reaps
@@ -1874,6 +3357,16 @@ struct homa {
 	 */
 	int dead_buffs_limit;
 
+	/**
+	 * @reap_worker_skbs: when the number of packet buffers in a
+	 * socket's dead RPCs reaches this value, the socket is handed to a
+	 * background worker on a lightly loaded core, which reaps it off
+	 * the critical path (see homa_reap_queue). 0 means reaping is done
+	 * only by application threads and homa_timer. Set externally via
+	 * sysctl.
+	 */
+	int reap_worker_skbs;
+
 	/**
 	 * @max_dead_buffs: The largest aggregate number of packet buffers
 	 * in dead (but not yet reaped) RPCs that has existed so far in a
@@ -1883,14 +3376,7 @@ struct homa {
 	int max_dead_buffs;
 
 	/**
-	 * @pacer_kthread: Kernel thread that transmits packets from
-	 * throttled_rpcs in a way that limits queue buildup in the
-	 * NIC.
-	 */
-	struct task_struct *pacer_kthread;
-
-	/**
-	 * @pacer_exit: true means that the pacer thread should exit as
+	 * @pacer_exit: true means that the pacer threads should exit as
 	 * soon as possible.
 	 */
 	bool pacer_exit;
@@ -1908,9 +3394,19 @@ struct homa {
 	 */
 	int max_nic_queue_cycles;
 
+	/**
+	 * @priority_queues: Nonzero means that each outgoing packet's
+	 * skb->priority is set to its Homa priority level, so that a
+	 * multi-queue qdisc such as mqprio can place different priorities
+	 * in different NIC TX queues, and that NIC queue estimates are kept
+	 * separately for each priority. Set externally via sysctl.
+	 */
+	int priority_queues;
+
 	/**
 	 * @cycles_per_kbyte: the number of cycles, as measured by get_cycles(),
-	 * that it takes to transmit 1000 bytes on our uplink. This is actually
+	 * that it takes to transmit 1000 bytes on an uplink running at
+	 * @link_mbps (see also homa_nic.cycles_per_kbyte). This is actually
 	 * a slight overestimate of the value, to ensure that we don't
 	 * underestimate NIC queue length and queue too many packets.
 	 */
@@ -1938,10 +3434,38 @@ struct homa {
 	/**
 	 * @gso_force_software: A non-zero value will cause Home to perform
 	 * segmentation in software using GSO; zero means ask the NIC to
-	 * perform TSO. Set externally via sysctl.
+	 * perform TSO (the kernel still segments in software, via
+	 * homa_gso_segment, if the device doesn't support TSO). Set
+	 * externally via sysctl.
 	 */
 	int gso_force_software;
 
+	/**
+	 * @group_steering: Determines how homa_group_select chooses the
+	 * member socket of a port group for incoming requests: 0 means
+	 * hash the client's address, port, and RPC id (spreads RPCs from
+	 * a single client across members); 1 means hash only the client's
+	 * address and port (all RPCs from a client go to the same member).
+	 * Set externally via sysctl.
+	 */
+	int group_steering;
+
+	/**
+	 * @udp_port: Nonzero means Homa packets are encapsulated in UDP,
+	 * with this destination port, rather than being sent as IP
+	 * protocol IPPROTO_HOMA. This allows NICs to apply RSS and
+	 * checksum offload and switches to spread packets with ECMP.
+	 * Must be the same on all hosts. Set externally via sysctl.
+	 */
+	int udp_port;
+
+	/**
+	 * @udp_sock: Kernel UDP socket bound to @udp_port, used to receive
+	 * encapsulated packets; NULL if @udp_port is 0. Managed by
+	 * homa_udp_config.
+	 */
+	struct socket *udp_sock;
+
 	/**
 	 * @gro_policy: An OR'ed together collection of bits that determine
 	 * how Homa packets should be steered for SoftIRQ handling.  A value
@@ -1970,6 +3494,15 @@ struct homa {
 	 *                            core isn't overloaded).
 	 * HOMA_GRO_GEN3              Use the "Gen3" mechanisms for load
 	 *                            balancing.
+	 * HOMA_GRO_ADAPTIVE          Send each batch to the core on the
+	 *                            same NUMA node with the lowest recent
+	 *                            SoftIRQ load (see homa_gro_adaptive);
+	 *                            takes precedence over GEN2 and GEN3.
+	 * HOMA_GRO_STEER             If a thread is waiting to receive on the
+	 *                            destination socket (or RPC), do SoftIRQ
+	 *                            on that thread's core or a core sharing
+	 *                            its cache, if one isn't busy with app
+	 *                            threads; otherwise use the other bits.
 	 */
 	#define HOMA_GRO_SAME_CORE       2
 	#define HOMA_GRO_IDLE            4
@@ -1978,6 +3511,8 @@ struct homa {
 	#define HOMA_GRO_FAST_GRANTS    32
 	#define HOMA_GRO_SHORT_BYPASS   64
 	#define HOMA_GRO_GEN3          128
+	#define HOMA_GRO_ADAPTIVE      256
+	#define HOMA_GRO_STEER         512
 	#define HOMA_GRO_NORMAL      (HOMA_GRO_SAME_CORE|HOMA_GRO_GEN2 \
 			|HOMA_GRO_SHORT_BYPASS|HOMA_GRO_FAST_GRANTS)
 
@@ -1992,6 +3527,16 @@ struct homa {
 	/** @busy_cycles: Same as busy_usecs except in get_cycles() units. */
 	int busy_cycles;
 
+	/**
+	 * @handoff_locality: nonzero means that when homa_rpc_handoff
+	 * chooses among several threads waiting on a socket, it prefers
+	 * (among threads on idle cores) the one that last received a message
+	 * from the same peer, then threads on the same NUMA node as the
+	 * core doing the handoff. Zero means just pick the first idle one.
+	 * Set externally via sysctl.
+	 */
+	int handoff_locality;
+
 	/*
 	 * @gro_busy_usecs: if the gap between the completion of
 	 * homa_gro_receive and the next call to homa_gro_receive on the same
@@ -2005,12 +3550,62 @@ struct homa {
 	/** @gro_busy_cycles: Same as busy_usecs except in get_cycles() units. */
 	int gro_busy_cycles;
 
+	/**
+	 * @softirq_load_usecs: length of the interval over which each
+	 * core's SoftIRQ load is sampled for HOMA_GRO_ADAPTIVE; each new
+	 * sample is folded into a moving average. Set externally via sysctl.
+	 */
+	int softirq_load_usecs;
+
+	/**
+	 * @softirq_load_cycles: Same as softirq_load_usecs except in
+	 * get_cycles() units.
+	 */
+	int softirq_load_cycles;
+
+	/**
+	 * @steer_cores: used for HOMA_GRO_STEER. Each entry holds the core
+	 * of the thread that most recently waited to receive on a given
+	 * (port, id) (id 0 refers to the socket as a whole), or -1 if none.
+	 * Indexed by homa_steer_slot. Entries are hints: they are written
+	 * and read without synchronization and can be clobbered by
+	 * collisions.
+	 */
+	int steer_cores[HOMA_STEER_SLOTS];
+
 	/**
 	 * @timer_ticks: number of times that homa_timer has been invoked
 	 * (may wraparound, which is safe).
 	 */
 	__u32 timer_ticks;
 
+	/**
+	 * @timer_shards: Information about the threads that divide up the
+	 * work of homa_timer. Only the first @active_timer_shards entries
+	 * are in use.
+	 */
+	struct homa_timer_shard timer_shards[HOMA_MAX_TIMER_SHARDS];
+
+	/**
+	 * @num_timer_shards: Number of threads (including the main timer
+	 * thread) that should share the work of homa_timer. Set externally
+	 * via sysctl.
+	 */
+	int num_timer_shards;
+
+	/**
+	 * @active_timer_shards: Number of entries in @timer_shards that
+	 * currently have running threads (entry 0 is always active,
+	 * since it is handled by the main timer thread).
+	 */
+	int active_timer_shards;
+
+	/**
+	 * @timer_shard_exit: true means that the timer shard threads should
+	 * exit as soon as possible.
+	 */
+	bool timer_shard_exit;
+
 	/**
 	 * @metrics_lock: Used to synchronize accesses to @metrics_active_opens
 	 * and updates to @metrics.
@@ -2052,6 +3647,49 @@ struct homa {
 	 */
 	enum homa_freeze_type freeze_type;
 
+	/**
+	 * @freeze_slow_factor: if nonzero, the timetrace will be frozen
+	 * (here and on all peers) when a client RPC takes more than this
+	 * many times its expected latency (see @freeze_slow_base_usecs).
+	 * Set externally via sysctl.
+	 */
+	int freeze_slow_factor;
+
+	/**
+	 * @freeze_slow_base_usecs: used with @freeze_slow_factor: the
+	 * expected latency of an RPC is this many microseconds plus the
+	 * time to transmit its request and response on our uplink. Set
+	 * externally via sysctl.
+	 */
+	int freeze_slow_base_usecs;
+
+	/**
+	 * @freeze_grantable_rpcs: if nonzero, the timetrace will be frozen
+	 * (here and on all peers) when @num_grantable_rpcs exceeds this
+	 * value. Set externally via sysctl.
+	 */
+	int freeze_grantable_rpcs;
+
+	/**
+	 * @freeze_resends_per_tick: if nonzero, the timetrace will be frozen
+	 * (here and on all peers) when more than this many RESENDs are
+	 * issued during a single timer tick. Set externally via sysctl.
+	 */
+	int freeze_resends_per_tick;
+
+	/**
+	 * @freeze_resends: number of RESENDs issued since the last timer
+	 * tick; only maintained when @freeze_resends_per_tick is nonzero.
+	 */
+	atomic_t freeze_resends;
+
+	/**
+	 * @freeze_peers_pending: nonzero means a freeze trigger has fired
+	 * and the next timer tick should send FREEZE packets to all peers
+	 * (this can't be done safely in the context where triggers fire).
+	 */
+	int freeze_peers_pending;
+
 	/**
 	 * @sync_freeze: nonzero means that on completion of the next
 	 * client RPC we should freeze our timetrace and also the peer's.
@@ -2059,6 +3697,13 @@ struct homa {
 	 */
 	int sync_freeze;
 
+	/**
+	 * @tt_categories: bit mask selecting which categories of timetrace
+	 * records are enabled (bit i corresponds to enum tt_category value
+	 * i). Set externally via sysctl.
+	 */
+	int tt_categories;
+
 	/**
 	 * @bpage_lease_usecs: how long a core can own a bpage (microseconds)
 	 * before its ownership can be revoked to reclaim the page.
@@ -2086,6 +3731,47 @@ struct homa {
 	int temp[4];
 };
 
+/**
+ * enum homa_lat_phase - Phases of message processing for which Homa
+ * keeps latency histograms (see @latency in struct homa_metrics).
+ */
+enum homa_lat_phase {
+	/** @HOMA_LAT_GRANTABLE: Time an incoming message has spent in the
+	 * grantable list, from when it was added until it was fully granted
+	 * or destroyed.
+	 */
+	HOMA_LAT_GRANTABLE     = 0,
+
+	/** @HOMA_LAT_THROTTLED: Time an outgoing message spent waiting
+	 * in a throttled list (each visit is recorded separately).
+	 */
+	HOMA_LAT_THROTTLED     = 1,
+
+	/** @HOMA_LAT_HANDOFF: Time from the last homa_rpc_handoff of a
+	 * complete incoming message until a user thread picked it up.
+	 */
+	HOMA_LAT_HANDOFF       = 2,
+
+	/** @HOMA_LAT_COPY_OUT: Total time spent copying an incoming
+	 * message to user space.
+	 */
+	HOMA_LAT_COPY_OUT      = 3,
+	HOMA_LAT_PHASES        = 4,
+};
+
+/**
+ * define HOMA_LAT_SIZE_CLASSES - Number of message size classes in each
+ * latency histogram; see homa_lat_size_class.
+ */
+#define HOMA_LAT_SIZE_CLASSES 4
+
+/**
+ * define HOMA_LAT_BUCKETS - Number of buckets in each latency histogram.
+ * Bucket i counts intervals of between 2^i and 2^(i+1)-1 cycles (bucket 0
+ * also counts intervals of 0); the last bucket counts everything larger.
+ */
+#define HOMA_LAT_BUCKETS 32
+
 /**
  * struct homa_metrics - various performance counters kept by Homa.
  *
@@ -2098,8 +3784,6 @@ struct homa {
  *
  * All counters are free-running: they never reset.
  */
-#define HOMA_NUM_SMALL_COUNTS 64
-#define HOMA_NUM_MEDIUM_COUNTS 128
 struct homa_metrics {
 	/**
 	 * @small_msg_bytes: entry i holds the total number of bytes
@@ -2199,12 +3883,33 @@ struct homa_metrics {
 	 */
 	__u64 handoffs_alt_thread;
 
+	/**
+	 * @handoffs_sticky: total number of times that homa_choose_interest
+	 * chose a thread because it had received the previous message from
+	 * the same peer.
+	 */
+	__u64 handoffs_sticky;
+
+	/**
+	 * @handoffs_cross_node: total number of times that an incoming
+	 * message was handed off to a thread on a different NUMA node than
+	 * the core that completed the message.
+	 */
+	__u64 handoffs_cross_node;
+
 	/**
 	 * @poll_cycles: total time spent in the polling loop in
 	 * homa_wait_for_message, as measured with get_cycles().
 	 */
 	__u64 poll_cycles;
 
+	/**
+	 * @poll_skips: total number of times homa_wait_for_message went to
+	 * sleep without polling because adaptive polling predicted that
+	 * no message would arrive within poll_usecs.
+	 */
+	__u64 poll_skips;
+
 	/**
 	 * @softirq_calls: total number of calls to homa_softirq (i.e.,
 	 * total number of GRO packets processed, each of which could contain
@@ -2248,6 +3953,50 @@ struct homa_metrics {
 	 * for requests. */
 	__u64 send_calls;
 
+	/**
+	 * @send_batch_calls: total number of invocations of the
+	 * HOMAIOCSEND ioctl (batched sends).
+	 */
+	__u64 send_batch_calls;
+
+	/**
+	 * @send_batch_msgs: total number of messages successfully sent
+	 * with HOMAIOCSEND; these are also counted in send_calls or
+	 * reply_calls.
+	 */
+	__u64 send_batch_msgs;
+
+	/**
+	 * @mcast_calls: total number of invocations of the HOMAIOCMCAST
+	 * ioctl (shared-payload multicast sends).
+	 */
+	__u64 mcast_calls;
+
+	/**
+	 * @mcast_rpcs: total number of RPCs successfully created by
+	 * HOMAIOCMCAST; these are also counted in send_calls.
+	 */
+	__u64 mcast_rpcs;
+
+	/**
+	 * @mcast_shared_bytes: total bytes of message data in outgoing
+	 * packets that referred to pages shared by the RPCs of a
+	 * HOMAIOCMCAST call instead of private copies.
+	 */
+	__u64 mcast_shared_bytes;
+
+	/**
+	 * @zerocopy_msgs: total number of outgoing messages transmitted
+	 * without copying their data from user space.
+	 */
+	__u64 zerocopy_msgs;
+
+	/**
+	 * @zerocopy_bytes: total bytes of message data in outgoing packets
+	 * that referred to user pages instead of copies.
+	 */
+	__u64 zerocopy_bytes;
+
 	/**
 	 * @recv_cycles: total time spent executing homa_recvmsg (including
 	 * time when the thread is blocked), as measured with get_cycles().
@@ -2257,6 +4006,47 @@ struct homa_metrics {
 	/** @recv_calls: total number of invocations of homa_recvmsg. */
 	__u64 recv_calls;
 
+	/**
+	 * @recv_batch_calls: total number of invocations of homa_recvmsg
+	 * that used struct homa_recvmmsg_args (also included in recv_calls).
+	 */
+	__u64 recv_batch_calls;
+
+	/**
+	 * @recv_batch_msgs: total number of messages returned by batched
+	 * invocations of homa_recvmsg.
+	 */
+	__u64 recv_batch_msgs;
+
+	/**
+	 * @ring_enter_calls: total number of invocations of the
+	 * HOMAIOCRING ioctl.
+	 */
+	__u64 ring_enter_calls;
+
+	/**
+	 * @ring_sqes: total number of submission ring entries consumed.
+	 */
+	__u64 ring_sqes;
+
+	/**
+	 * @ring_cqes: total number of incoming messages posted to
+	 * completion rings.
+	 */
+	__u64 ring_cqes;
+
+	/**
+	 * @ring_sleeps: total number of times that a ring polling thread
+	 * went to sleep because it was idle.
+	 */
+	__u64 ring_sleeps;
+
+	/**
+	 * @ring_wakeups: total number of times that a sleeping ring
+	 * polling thread was woken up.
+	 */
+	__u64 ring_wakeups;
+
 	/**
 	 * @blocked_cycles: total time threads spend in blocked state
 	 * while executing the homa_recvmsg kernel call handler.
@@ -2299,12 +4089,39 @@ struct homa_metrics {
 	 */
 	__u64 so_set_buf_calls;
 
+	/**
+	 * @so_set_buf_hugepages: total number of SO_HOMA_SET_BUF calls
+	 * whose region was backed by huge pages.
+	 */
+	__u64 so_set_buf_hugepages;
+
 	/**
 	 * @grant_cycles: total time spent in homa_send_grants, as measured
 	 * with get_cycles().
 	 */
 	__u64 grant_cycles;
 
+	/**
+	 * @grant_recalc_skips: total number of times that homa_send_grants
+	 * found another core computing grants, so it left its work for
+	 * that core rather than waiting for grantable_lock.
+	 */
+	__u64 grant_recalc_skips;
+
+	/**
+	 * @grant_recalc_retries: total number of times that homa_send_grants
+	 * recomputed grants because another core requested grants during
+	 * the previous computation.
+	 */
+	__u64 grant_recalc_retries;
+
+	/**
+	 * @grant_recalc_limits: total number of times that homa_send_grants
+	 * stopped repeating its computation for other cores after
+	 * MAX_GRANT_RECALCS passes, leaving the rest of the work pending.
+	 */
+	__u64 grant_recalc_limits;
+
 	/**
 	 * @timer_cycles: total time spent in homa_timer, as measured with
 	 * get_cycles().
@@ -2318,6 +4135,13 @@ struct homa_metrics {
 	 */
 	__u64 timer_reap_cycles;
 
+	/**
+	 * @timer_rpc_checks: total number of times that homa_timer
+	 * checked an RPC (RPCs are only checked when they might need
+	 * attention, not on every tick).
+	 */
+	__u64 timer_rpc_checks;
+
 	/**
 	 * @data_pkt_reap_cycles: total time spent by homa_data_pkt to reap
 	 * dead RPCs, as measured with get_cycles().
@@ -2339,7 +4163,7 @@ struct homa_metrics {
 
 	/**
 	 * @pacer_bytes: total number of bytes transmitted when
-	 * @homa->throttled_rpcs is nonempty.
+	 * at least one pacer has throttled RPCs.
 	 */
 	__u64 pacer_bytes;
 
@@ -2349,6 +4173,12 @@ struct homa_metrics {
 	 */
 	__u64 pacer_skipped_rpcs;
 
+	/**
+	 * @pacer_share_checks: total number of throttled RPCs examined by
+	 * homa_throttle_choose_weighted.
+	 */
+	__u64 pacer_share_checks;
+
 	/**
 	 * @pacer_needed_help: total number of times that homa_check_pacer
 	 * found that the pacer was running behind, so it actually invoked
@@ -2357,8 +4187,9 @@ struct homa_metrics {
 	__u64 pacer_needed_help;
 
 	/**
-	 * @throttled_cycles: total amount of time that @homa->throttled_rpcs
-	 * is nonempty, as measured with get_cycles().
+	 * @throttled_cycles: total amount of time that pacers' throttled
+	 * queues are nonempty, as measured with get_cycles() and summed
+	 * over all pacers.
 	 */
 	__u64 throttled_cycles;
 
@@ -2368,6 +4199,37 @@ struct homa_metrics {
 	 */
 	__u64 resent_packets;
 
+	/**
+	 * @resent_clones: total number of times that homa_resend_data
+	 * retransmitted an entire packet by sending a clone of it, rather
+	 * than copying its segments into new packets.
+	 */
+	__u64 resent_clones;
+
+	/**
+	 * @tso_skbs: total number of multi-segment DATA sk_buffs handed
+	 * to a device that advertises hardware segmentation for them.
+	 */
+	__u64 tso_skbs;
+
+	/**
+	 * @gso_software_skbs: total number of multi-segment DATA sk_buffs
+	 * that were segmented in software by homa_gso_segment.
+	 */
+	__u64 gso_software_skbs;
+
+	/**
+	 * @udp_packets_sent: total number of packets (all types) sent
+	 * encapsulated in UDP.
+	 */
+	__u64 udp_packets_sent;
+
+	/**
+	 * @udp_packets_received: total number of UDP-encapsulated Homa
+	 * packets received.
+	 */
+	__u64 udp_packets_received;
+
 	/**
 	 * @peer_hash_links: total # of link traversals in homa_peer_find.
 	 */
@@ -2380,6 +4242,18 @@ struct homa_metrics {
 	 */
 	__u64 peer_new_entries;
 
+	/**
+	 * @peertab_resizes: total # of times that the bucket array in
+	 * Homa's peer table was replaced with a larger one.
+	 */
+	__u64 peertab_resizes;
+
+	/**
+	 * @peer_evictions: total # of homa_peers removed from Homa's
+	 * peer table because they were idle or the table was too large.
+	 */
+	__u64 peer_evictions;
+
 	/**
 	 * @peer_kmalloc errors: total number of times homa_peer_find
 	 * returned an error because it couldn't allocate memory for a new
@@ -2405,6 +4279,13 @@ struct homa_metrics {
 	 */
 	__u64 data_xmit_errors;
 
+	/**
+	 * @xmit_batches: total number of times that homa_xmit_batch_flush
+	 * handed a nonempty batch of data packets to the IP layer (the
+	 * average batch size is packets_sent[0] divided by this).
+	 */
+	__u64 xmit_batches;
+
 	/**
 	 * @unknown_rpc: total number of times an incoming packet was
 	 * discarded because it referred to a nonexistent RPC. Doesn't
@@ -2448,13 +4329,25 @@ struct homa_metrics {
 	 * actually incorporated into the message at the target (i.e. it
 	 * wasn't redundant).
 	 */
-	__u64 resent_packets_used;
+	__u64 resent_packets_used;
+
+	/**
+	 * @peer_timeouts: total number of times a peer (either client or
+	 * server) was found to be nonresponsive, resulting in RPC aborts.
+	 */
+	__u64 peer_timeouts;
+
+	/**
+	 * @freeze_triggers: total number of times one of the automatic
+	 * freeze triggers fired (see homa_freeze_trigger).
+	 */
+	__u64 freeze_triggers;
 
 	/**
-	 * @peer_timeouts: total number of times a peer (either client or
-	 * server) was found to be nonresponsive, resulting in RPC aborts.
+	 * @auto_cutoff_updates: total number of times homa_auto_cutoffs
+	 * installed new values for unsched_cutoffs.
 	 */
-	__u64 peer_timeouts;
+	__u64 auto_cutoff_updates;
 
 	/**
 	 * @server_rpc_discards: total number of times an RPC was aborted on
@@ -2492,12 +4385,32 @@ struct homa_metrics {
 	 */
 	__u64 server_lock_miss_cycles;
 
+	/**
+	 * @rpc_bucket_resizes: total # of times that the chain array in
+	 * a client or server RPC bucket was replaced with a larger or
+	 * smaller one.
+	 */
+	__u64 rpc_bucket_resizes;
+
 	/**
 	 * @socket_lock_miss_cycles: total time spent waiting for socket
 	 * lock misses, measured by get_cycles().
 	 */
 	__u64 socket_lock_miss_cycles;
 
+	/**
+	 * @socket_cache_hits: total number of socket lookups in SoftIRQ
+	 * that were satisfied by the per-core cache in homa_sock_find_cached,
+	 * without searching the socket table.
+	 */
+	__u64 socket_cache_hits;
+
+	/**
+	 * @group_lookups: total number of incoming packets (and acks) whose
+	 * socket was chosen from a port group by homa_group_select.
+	 */
+	__u64 group_lookups;
+
 	/**
 	 * @socket_lock_misses: total number of times that Homa had to wait
 	 * to acquire a socket lock.
@@ -2570,6 +4483,31 @@ struct homa_metrics {
 	 */
 	__u64 forced_reaps;
 
+	/**
+	 * @reap_worker_queues: total number of times a socket was handed
+	 * to a background reap worker.
+	 */
+	__u64 reap_worker_queues;
+
+	/**
+	 * @reap_worker_cycles: total time spent by background reap workers,
+	 * measured with get_cycles().
+	 */
+	__u64 reap_worker_cycles;
+
+	/**
+	 * @rpc_cache_hits: total number of RPCs whose homa_rpc struct
+	 * was taken from a socket's rpc_cache rather than kmalloc.
+	 */
+	__u64 rpc_cache_hits;
+
+	/**
+	 * @rpc_cache_misses: total number of RPCs whose homa_rpc struct had
+	 * to be allocated with kmalloc because the socket's rpc_cache
+	 * was empty.
+	 */
+	__u64 rpc_cache_misses;
+
 	/**
 	 * @throttle_list_adds: total number of calls to homa_add_to_throttled.
 	 */
@@ -2601,6 +4539,108 @@ struct homa_metrics {
 	 */
 	__u64 fifo_grants_no_incoming;
 
+	/**
+	 * @cong_ecn_marks: total number of incoming DATA packets that
+	 * carried an ECN congestion mark (counted only if HOMA_CONG_ECN
+	 * is enabled).
+	 */
+	__u64 cong_ecn_marks;
+
+	/**
+	 * @cong_resend_signals: total number of RESENDs that were counted
+	 * as congestion signals for their peer.
+	 */
+	__u64 cong_resend_signals;
+
+	/**
+	 * @cong_level_increases: total number of times a peer's cong_level
+	 * was raised.
+	 */
+	__u64 cong_level_increases;
+
+	/**
+	 * @cong_level_decreases: total number of times a peer's cong_level
+	 * was lowered after a quiet period.
+	 */
+	__u64 cong_level_decreases;
+
+	/**
+	 * @cong_limited_bytes: total number of bytes of grants that would
+	 * have been issued and weren't, because of peer congestion. Each
+	 * byte of a message is counted at most once, no matter how many
+	 * grant decisions withheld it.
+	 */
+	__u64 cong_limited_bytes;
+
+	/**
+	 * @cong_limited_rpcs: total number of times homa_choose_rpcs_to_grant
+	 * skipped an RPC because its peer's congestion level reduced the
+	 * number of RPCs that could be granted to.
+	 */
+	__u64 cong_limited_rpcs;
+
+	/**
+	 * @grant_no_bufs_skips: total number of times homa_choose_rpcs_to_grant
+	 * skipped an RPC because no buffer space had been committed to
+	 * its message.
+	 */
+	__u64 grant_no_bufs_skips;
+
+	/**
+	 * @share_limited_rpcs: total number of times homa_choose_rpcs_to_grant
+	 * skipped an RPC because its socket had already been given its
+	 * weighted share of the grants.
+	 */
+	__u64 share_limited_rpcs;
+
+	/**
+	 * @policy_order_calls: total number of times the grantable_before hook
+	 * of a registered homa_policy_ops was invoked.
+	 */
+	__u64 policy_order_calls;
+
+	/**
+	 * @policy_order_cycles: total time spent in the grantable_before hook,
+	 * as measured with get_cycles().
+	 */
+	__u64 policy_order_cycles;
+
+	/**
+	 * @policy_unsched_calls: total number of times the unsched_priority hook
+	 * of a registered homa_policy_ops was invoked.
+	 */
+	__u64 policy_unsched_calls;
+
+	/**
+	 * @policy_unsched_cycles: total time spent in the unsched_priority hook,
+	 * as measured with get_cycles().
+	 */
+	__u64 policy_unsched_cycles;
+
+	/**
+	 * @policy_grant_calls: total number of times the grant_priority hook
+	 * of a registered homa_policy_ops was invoked.
+	 */
+	__u64 policy_grant_calls;
+
+	/**
+	 * @policy_grant_cycles: total time spent in the grant_priority hook,
+	 * as measured with get_cycles().
+	 */
+	__u64 policy_grant_cycles;
+
+	/**
+	 * @policy_fifo_calls: total number of times the fifo_key hook
+	 * of a registered homa_policy_ops was invoked.
+	 */
+	__u64 policy_fifo_calls;
+
+	/**
+	 * @policy_fifo_cycles: total time spent in the fifo_key hook,
+	 * as measured with get_cycles().
+	 */
+	__u64 policy_fifo_cycles;
+
 	/**
 	 * @unacked_overflows: total number of times that homa_peer_add_ack
 	 * found insufficient space for the new id and hence had to send an
@@ -2608,6 +4648,18 @@ struct homa_metrics {
 	 */
 	__u64 ack_overflows;
 
+	/**
+	 * @acks_piggybacked: total number of acks carried in control
+	 * packets (GRANT, RESEND, or BUSY) rather than DATA or ACK packets.
+	 */
+	__u64 acks_piggybacked;
+
+	/**
+	 * @ack_flushes: total number of ACK packets sent by
+	 * homa_peer_flush_acks because acks had waited too long.
+	 */
+	__u64 ack_flushes;
+
 	/**
 	 * @ignored_need_acks: total number of times that a NEED_ACK packet
 	 * was ignored because the RPC's result hadn't been fully received.
@@ -2621,6 +4673,34 @@ struct homa_metrics {
 	 */
 	__u64 bpage_reuses;
 
+	/**
+	 * @bpage_steals: total number of times that homa_pool_get_pages
+	 * took a free bpage from the free stack of a different core,
+	 * because both its own stack and the pool's stack were empty.
+	 */
+	__u64 bpage_steals;
+
+	/**
+	 * @bpage_remote_refills: total number of times that a core refilled
+	 * its free stack from a NUMA node other than the one where the
+	 * socket's receiving thread last ran, because that node had no
+	 * free bpages.
+	 */
+	__u64 bpage_remote_refills;
+
+	/**
+	 * @extent_allocs: total number of incoming messages that were
+	 * allocated a contiguous extent of bpages.
+	 */
+	__u64 extent_allocs;
+
+	/**
+	 * @softirq_copy_bytes: total number of bytes of incoming message
+	 * data copied to buffer regions during SoftIRQ (see
+	 * SO_HOMA_SOFTIRQ_COPY) rather than by homa_copy_to_user.
+	 */
+	__u64 softirq_copy_bytes;
+
 	/**
 	 * @buffer_alloc_failures: total number of times that
 	 * homa_pool_allocate was unable to allocate buffer space for
@@ -2653,6 +4733,13 @@ struct homa_metrics {
 	 */
 	__u64 gen3_alt_handoffs;
 
+	/**
+	 * @gro_steered: total number of times that GRO steered SoftIRQ
+	 * processing for a packet or batch toward the core of the thread
+	 * waiting to receive it (HOMA_GRO_STEER).
+	 */
+	__u64 gro_steered;
+
 	/**
 	 * @gro_grant_bypasses: total number of GRANT packets passed directly
 	 * to homa_softirq by homa_gro_receive, bypassing the normal SoftIRQ
@@ -2660,6 +4747,13 @@ struct homa_metrics {
 	 */
 	__u64 gro_grant_bypasses;
 
+	/**
+	 * @gro_grant_merges: total number of GRANT packets that were
+	 * discarded by homa_gro_receive because they could be merged into
+	 * an earlier grant for the same RPC in the same GRO batch.
+	 */
+	__u64 gro_grant_merges;
+
 	/**
 	 * @gro_data_bypasses: total number of DATA packets passed directly
 	 * to homa_softirq by homa_gro_receive, bypassing the normal SoftIRQ
@@ -2667,6 +4761,14 @@ struct homa_metrics {
 	 */
 	__u64 gro_data_bypasses;
 
+	/**
+	 * @latency: log-bucketed latency histograms: entry [p][c][b] counts
+	 * the intervals for phase p (enum homa_lat_phase) in messages of
+	 * size class c (see homa_lat_size_class) that fell in bucket b (see
+	 * HOMA_LAT_BUCKETS).
+	 */
+	__u64 latency[HOMA_LAT_PHASES][HOMA_LAT_SIZE_CLASSES][HOMA_LAT_BUCKETS];
+
 	/** @temp: For temporary use during testing. */
 #define NUM_TEMP_METRICS 10
 	__u64 temp[NUM_TEMP_METRICS];
@@ -2723,6 +4825,35 @@ struct homa_core {
 	 */
 	__u64 last_app_active;
 
+	/**
+	 * @numa_node: the NUMA node that this core belongs to. Used by
+	 * HOMA_GRO_ADAPTIVE to keep SoftIRQ processing on the node where
+	 * the packets were received, and by homa_choose_interest to keep
+	 * message handoffs within a node.
+	 */
+	int numa_node;
+
+	/**
+	 * @softirq_load: moving average of the fraction of time this core
+	 * has spent in homa_softirq, in thousandths (1000 means the core
+	 * was busy with SoftIRQ the entire time). Only updated when
+	 * homa_softirq runs, so it goes stale on idle cores; use
+	 * homa_softirq_load to read it.
+	 */
+	int softirq_load;
+
+	/**
+	 * @softirq_load_start: time (get_cycles() units) when the current
+	 * sampling interval for @softirq_load began.
+	 */
+	__u64 softirq_load_start;
+
+	/**
+	 * @softirq_busy: cycles spent in homa_softirq since
+	 * @softirq_load_start.
+	 */
+	__u64 softirq_busy;
+
         /**
          * held_skb: last packet buffer known to be available for
          * merging other packets into on this core (note: may not still
@@ -2737,6 +4868,66 @@ struct homa_core {
 	 */
 	int held_bucket;
 
+	/**
+	 * @gro_batch: the held_skb described by @gro_short_tail,
+	 * @gro_tails, and @gro_groups, or NULL if none. If this doesn't
+	 * match @held_skb then the other fields are stale and must be
+	 * reinitialized before merging into @held_skb.
+	 */
+	struct sk_buff *gro_batch;
+
+	/**
+	 * @gro_short_tail: the last packet in the short section at the
+	 * front of @gro_batch's frag_list, or NULL if the short section
+	 * is empty. The short section holds control packets and
+	 * single-packet DATA messages, grouped by destination port;
+	 * the rest of frag_list holds longer DATA packets, grouped by RPC.
+	 */
+	struct sk_buff *gro_short_tail;
+
+	/**
+	 * @gro_tails: the last packet (so far) for each of the first
+	 * @gro_groups RPCs with long packets in @gro_batch. An entry
+	 * referring to @gro_batch itself means that RPC's group starts right
+	 * after the short section.
+	 */
+	struct sk_buff *gro_tails[HOMA_SOFTIRQ_GROUPS];
+
+	/** @gro_groups: number of valid entries in @gro_tails. */
+	int gro_groups;
+
+	/**
+	 * @cached_sock: the socket most recently looked up by
+	 * homa_sock_find_cached on this core, or NULL if none. Only
+	 * accessed on this core, from SoftIRQ.
+	 */
+	struct homa_sock *cached_sock;
+
+	/**
+	 * @cached_socktab: the table in which @cached_sock was found.
+	 */
+	struct homa_socktab *cached_socktab;
+
+	/**
+	 * @cached_removals: value of @cached_socktab->removals when
+	 * @cached_sock was looked up; if the table's value has changed
+	 * since then, @cached_sock may have been deleted and must not be
+	 * used.
+	 */
+	int cached_removals;
+
+	/**
+	 * @reap_socks: sockets waiting for this core's background reap
+	 * worker. Lock-free: sockets are added from any core.
+	 */
+	struct llist_head reap_socks;
+
+	/**
+	 * @reap_work: runs homa_reap_work on this core to reap the
+	 * sockets in @reap_socks.
+	 */
+	struct work_struct reap_work;
+
 	/**
 	 * @thread: the most recent thread to invoke a Homa system call
 	 * on this core, or NULL if none.
@@ -2778,6 +4969,12 @@ struct homa_skb_info {
 	 * segments in this packet.
 	 */
 	int data_bytes;
+
+	/**
+	 * @offset: offset within the message of the first byte of data in
+	 * this packet.
+	 */
+	int offset;
 };
 
 /**
@@ -2843,6 +5040,43 @@ static inline struct homa_rpc_bucket *homa_client_rpc_bucket(
 			& (HOMA_CLIENT_RPC_BUCKETS - 1)];
 }
 
+/**
+ * homa_steer_slot() - Return the index in homa->steer_cores to use for
+ * a given socket and RPC.
+ * @port:     Port number of the local socket.
+ * @id:       Local id of the RPC, or 0 for the socket as a whole.
+ *
+ * Return:    Index into homa->steer_cores.
+ */
+static inline int homa_steer_slot(__u16 port, __u64 id)
+{
+	return jhash_2words((__u32) id, port, 0) & (HOMA_STEER_SLOTS - 1);
+}
+
+/**
+ * homa_steer_publish() - Record the core of a thread that is about to
+ * wait for incoming messages, so that GRO can steer SoftIRQ processing
+ * for those messages near it (see HOMA_GRO_STEER).
+ * @homa:     Overall data about the Homa protocol implementation.
+ * @port:     Port number of the socket on which the thread will wait.
+ * @id:       Id of the specific RPC the thread is waiting for, or 0.
+ * @core:     Core on which the thread is running.
+ */
+static inline void homa_steer_publish(struct homa *homa, __u16 port,
+		__u64 id, int core)
+{
+	int *entry = &homa->steer_cores[homa_steer_slot(port, 0)];
+
+	/* Avoid dirtying shared cache lines when nothing has changed. */
+	if (READ_ONCE(*entry) != core)
+		WRITE_ONCE(*entry, core);
+	if (id != 0) {
+		entry = &homa->steer_cores[homa_steer_slot(port, id)];
+		if (READ_ONCE(*entry) != core)
+			WRITE_ONCE(*entry, core);
+	}
+}
+
 /**
  * homa_next_skb() - Compute address of Homa's private link field in @skb.
  * @skb:     Socket buffer containing private link field.
@@ -2893,6 +5127,56 @@ static inline struct homa_rpc_bucket *homa_server_rpc_bucket(
 			& (HOMA_SERVER_RPC_BUCKETS - 1)];
 }
 
+/**
+ * homa_client_rpc_hash() - Select a hash chain for a client RPC within
+ * its homa_rpc_bucket.
+ * @id:       Id of the RPC.
+ *
+ * Return:    A hash value; only the low-order bucket->bits bits are used.
+ */
+static inline __u32 homa_client_rpc_hash(__u64 id)
+{
+	/* The low-order bits of the id were already used to select the
+	 * bucket; since ids are sequential, the next bits spread RPCs
+	 * evenly across the chains of the bucket.
+	 */
+	return (id >> 1) / HOMA_CLIENT_RPC_BUCKETS;
+}
+
+/**
+ * homa_server_rpc_hash() - Select a hash chain for a server RPC within
+ * its homa_rpc_bucket.
+ * @saddr:    Address of the RPC's client.
+ * @sport:    Port on the client used by the RPC.
+ * @id:       Id of the RPC.
+ *
+ * Return:    A hash value; only the low-order bucket->bits bits are used.
+ */
+static inline __u32 homa_server_rpc_hash(const struct in6_addr *saddr,
+		__u16 sport, __u64 id)
+{
+	/* Different clients allocate ids from the same ranges, so the
+	 * client's address and port must be mixed in.
+	 */
+	return ((id >> 1) / HOMA_SERVER_RPC_BUCKETS)
+			+ jhash_3words(saddr->s6_addr32[2],
+			saddr->s6_addr32[3], sport, 0);
+}
+
+/**
+ * homa_rpc_chain() - Return the hash chain in a homa_rpc_bucket that
+ * corresponds to a given hash value. The caller must hold the bucket's lock.
+ * @bucket:   Bucket containing the chain.
+ * @hash:     Value returned by homa_client_rpc_hash or homa_server_rpc_hash.
+ *
+ * Return:    The chain on which an RPC with this hash will appear.
+ */
+static inline struct hlist_head *homa_rpc_chain(struct homa_rpc_bucket *bucket,
+		__u32 hash)
+{
+	return &bucket->rpcs[hash & ((1 << bucket->bits) - 1)];
+}
+
 /**
  * homa_set_doff() - Fills in the doff TCP header field for a Homa packet.
  * @h:   Packet header whose doff field is to be set.
@@ -2953,6 +5237,60 @@ static inline void homa_peer_unlock(struct homa_peer *peer)
 	spin_unlock_bh(&peer->ack_lock);
 }
 
+/**
+ * homa_peer_hold() - Take an additional reference on a peer, so that it
+ * will not be evicted from the peer table.
+ * @peer:   Peer to reference; the caller must already hold a reference.
+ */
+static inline void homa_peer_hold(struct homa_peer *peer)
+{
+	atomic_inc(&peer->refs);
+}
+
+/**
+ * homa_peer_put() - Release a reference on a peer (such as the one
+ * returned by homa_peer_find). The peer must not be used after this
+ * unless the caller holds another reference.
+ * @peer:   Peer to release.
+ */
+static inline void homa_peer_put(struct homa_peer *peer)
+{
+	WRITE_ONCE(peer->last_put, jiffies);
+	atomic_dec(&peer->refs);
+}
+
+/**
+ * homa_peer_add_rpc() - Add a newly created RPC to its peer's list of
+ * live RPCs.
+ * @rpc:    RPC to add; its peer must be set.
+ */
+static inline void homa_peer_add_rpc(struct homa_rpc *rpc)
+{
+	struct homa_peer *peer = rpc->peer;
+
+	spin_lock_bh(&peer->rpcs_lock);
+	list_add_tail(&rpc->peer_links, &peer->rpcs);
+	peer->num_rpcs++;
+	spin_unlock_bh(&peer->rpcs_lock);
+}
+
+/**
+ * homa_peer_remove_rpc() - Remove an RPC from its peer's list of live
+ * RPCs, if it is there.
+ * @rpc:    RPC to remove.
+ */
+static inline void homa_peer_remove_rpc(struct homa_rpc *rpc)
+{
+	struct homa_peer *peer = rpc->peer;
+
+	spin_lock_bh(&peer->rpcs_lock);
+	if (!list_empty(&rpc->peer_links)) {
+		list_del_init(&rpc->peer_links);
+		peer->num_rpcs--;
+	}
+	spin_unlock_bh(&peer->rpcs_lock);
+}
+
 /**
  * homa_protect_rpcs() - Ensures that no RPCs will be reaped for a given
  * socket until until homa_sock_unprotect is called. Typically
@@ -2999,33 +5337,54 @@ static inline void homa_grantable_lock(struct homa *homa)
 }
 
 /**
- * homa_grantable_unlock() - Release the grantable lock.
+ * homa_grants_pending() - Returns true if some core asked for grants
+ * to be computed but gave up because grantable_lock was busy, and no
+ * grant computation has started since then.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+static inline bool homa_grants_pending(struct homa *homa)
+{
+	return atomic_read(&homa->grant_recalc_count)
+			!= READ_ONCE(homa->grant_recalc_done);
+}
+
+/**
+ * homa_grantable_unlock() - Release the grantable lock. If a core asked
+ * for grants while the lock was held, compute them now on its behalf
+ * (see homa_send_grants).
  * @homa:    Overall data about the Homa protocol implementation.
  */
 static inline void homa_grantable_unlock(struct homa *homa)
 {
 	spin_unlock_bh(&homa->grantable_lock);
+
+	/* Pairs with the barrier in homa_send_grants between incrementing
+	 * grant_recalc_count and trying for the lock.
+	 */
+	smp_mb();
+	if (unlikely(homa_grants_pending(homa)))
+		homa_send_grants(homa);
 }
 
 /**
- * homa_throttle_lock() - Acquire the throttle lock. If the lock
+ * homa_throttle_lock() - Acquire the throttle lock for a pacer. If the lock
  * isn't immediately available, record stats on the waiting time.
- * @homa:    Overall data about the Homa protocol implementation.
+ * @pacer:   Pacer whose throttle lock is desired.
  */
-static inline void homa_throttle_lock(struct homa *homa)
+static inline void homa_throttle_lock(struct homa_pacer *pacer)
 {
-	if (!spin_trylock_bh(&homa->throttle_lock)) {
-		homa_throttle_lock_slow(homa);
+	if (!spin_trylock_bh(&pacer->throttle_lock)) {
+		homa_throttle_lock_slow(pacer);
 	}
 }
 
 /**
- * homa_throttle_unlock() - Release the throttle lock.
- * @homa:    Overall data about the Homa protocol implementation.
+ * homa_throttle_unlock() - Release the throttle lock for a pacer.
+ * @pacer:   Pacer whose throttle lock is held.
  */
-static inline void homa_throttle_unlock(struct homa *homa)
+static inline void homa_throttle_unlock(struct homa_pacer *pacer)
 {
-	spin_unlock_bh(&homa->throttle_lock);
+	spin_unlock_bh(&pacer->throttle_lock);
 }
 
 /** skb_is_ipv6() - Return true if the packet is encapsulated with IPv6,
@@ -3090,6 +5449,29 @@ static inline struct in6_addr skb_canonical_ipv6_saddr(struct sk_buff *skb)
 			ip_hdr(skb)->saddr);
 }
 
+/**
+ * homa_short_packet() - Returns true if an incoming packet (whose header
+ * has not necessarily been pulled) should be processed ahead of longer
+ * packets in its GRO batch: this is the case for control packets and for
+ * DATA packets containing an entire message. Returns false if the header
+ * isn't available in the linear part of the packet.
+ * @skb:   The packet to check.
+ */
+static inline bool homa_short_packet(struct sk_buff *skb)
+{
+	struct data_header *h = (struct data_header *)
+			skb_transport_header(skb);
+	int length = skb_tail_pointer(skb) - skb_transport_header(skb);
+
+	if (length < sizeof(struct common_header))
+		return false;
+	if (h->common.type != DATA)
+		return true;
+	if (length < sizeof(struct data_header))
+		return false;
+	return h->seg.segment_length == h->message_length;
+}
+
 /**
  * is_mapped_ipv4() - Return true if an IPv6 address is actually an
  * IPv4-mapped address, false otherwise.
@@ -3119,6 +5501,41 @@ static inline __be32 tt_addr(const struct in6_addr x)
 
 extern struct homa_core *homa_cores[];
 
+/**
+ * homa_lat_size_class() - Returns the size class to use in latency
+ * histograms for a message of a given length.
+ * @length:   Number of bytes in the message.
+ */
+static inline int homa_lat_size_class(int length)
+{
+	if (length <= 1500)
+		return 0;
+	if (length <= 15000)
+		return 1;
+	if (length <= 150000)
+		return 2;
+	return 3;
+}
+
+/**
+ * homa_record_latency() - Records an interval in the current core's
+ * latency histograms. No locking is needed since the histograms are
+ * per-core.
+ * @phase:    The phase being measured (enum homa_lat_phase).
+ * @length:   Length of the message the interval applies to.
+ * @cycles:   Length of the interval, in get_cycles units.
+ */
+static inline void homa_record_latency(int phase, int length, __u64 cycles)
+{
+	int bucket = cycles ? fls64(cycles) - 1 : 0;
+
+	if (bucket >= HOMA_LAT_BUCKETS)
+		bucket = HOMA_LAT_BUCKETS - 1;
+	INC_METRIC(latency[phase][homa_lat_size_class(length)][bucket], 1);
+}
+extern const struct homa_metrics_field homa_metrics_schema[];
+extern const int homa_metrics_schema_length;
+
 #ifdef __UNIT_TEST__
 extern void unit_log_printf(const char *separator, const char* format, ...)
 		__attribute__((format(printf, 2, 3)));
@@ -3132,27 +5549,35 @@ extern void unit_hook(char *id);
 
 extern void     homa_abort_rpcs(struct homa *homa, const struct in6_addr *addr,
 		    int port, int error);
+extern void     homa_abort_peer_rpcs(struct homa_peer *peer, int port,
+		    int error);
 extern void     homa_abort_sock_rpcs(struct homa_sock *hsk, int error);
 extern void     homa_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 		    struct homa_rpc *rpc, struct homa_lcache *lcache);
 extern void     homa_add_packet(struct homa_rpc *rpc, struct sk_buff *skb);
 extern void     homa_add_to_throttled(struct homa_rpc *rpc);
 extern void     homa_append_metric(struct homa *homa, const char* format, ...);
+extern void     homa_auto_cutoffs(struct homa *homa);
 extern int      homa_backlog_rcv(struct sock *sk, struct sk_buff *skb);
 extern int      homa_bind(struct socket *sk, struct sockaddr *addr,
                     int addr_len);
+extern void     homa_bucket_add(struct homa_rpc_bucket *bucket,
+		    struct homa_rpc *rpc);
+extern void     homa_bucket_remove(struct homa_rpc *rpc);
+extern int      homa_bucket_resize(struct homa_rpc_bucket *bucket, int bits);
 extern void     homa_check_grantable(struct homa_rpc *rpc);
 extern int      homa_check_rpc(struct homa_rpc *rpc);
-extern int      homa_check_nic_queue(struct homa *homa, struct sk_buff *skb,
-                    bool force);
+extern int      homa_check_nic_queue(struct homa *homa, struct homa_nic *nic,
+		    struct sk_buff *skb, int priority, bool force);
 extern struct homa_rpc
 	       *homa_choose_fifo_grant(struct homa *homa);
 extern struct homa_interest
                *homa_choose_interest(struct homa *homa, struct list_head *head,
-	            int offset);
+	            int offset, struct homa_peer *peer);
 extern int      homa_choose_rpcs_to_grant(struct homa *homa,
 		    struct homa_rpc **rpcs, int max_rpcs);
 extern void     homa_close(struct sock *sock, long timeout);
+extern int      homa_copy_to_pinned(struct homa_rpc *rpc);
 extern int      homa_copy_to_user(struct homa_rpc *rpc);
 extern int      homa_create_grants(struct homa *homa, struct homa_rpc **rpcs,
 		    int num_rpcs, struct grant_header *grants, int available);
@@ -3166,6 +5591,8 @@ extern int      homa_diag_destroy(struct sock *sk, int err);
 extern int      homa_disconnect(struct sock *sk, int flags);
 extern int      homa_dointvec(struct ctl_table *table, int write,
                     void __user *buffer, size_t *lenp, loff_t *ppos);
+extern int      homa_dostring(struct ctl_table *table, int write,
+                    void __user *buffer, size_t *lenp, loff_t *ppos);
 extern void     homa_dst_refresh(struct homa_peertab *peertab,
                     struct homa_peer *peer, struct homa_sock *hsk);
 extern int      homa_err_handler_v4(struct sk_buff *skb, u32 info);
@@ -3179,7 +5606,11 @@ extern struct homa_rpc
 extern void     homa_free_skbs(struct sk_buff *skb);
 extern void     homa_freeze(struct homa_rpc *rpc, enum homa_freeze_type type,
 		    char *format);
+extern void     homa_freeze_check_slow(struct homa_rpc *rpc);
 extern void     homa_freeze_peers(struct homa *homa);
+extern void     homa_freeze_trigger(struct homa *homa,
+		    enum homa_freeze_type type, char *format, int arg0,
+		    int arg1);
 extern void     homa_gap_new(struct list_head *next, int start, int end);
 extern int      homa_get_port(struct sock *sk, unsigned short snum);
 extern void     homa_get_resend_range(struct homa_message_in *msgin,
@@ -3187,12 +5618,21 @@ extern void     homa_get_resend_range(struct homa_message_in *msgin,
 extern int      homa_getsockopt(struct sock *sk, int level, int optname,
                     char __user *optval, int __user *option);
 extern void     homa_grant_pkt(struct sk_buff *skb, struct homa_rpc *rpc);
+extern void     homa_grantable_resort(struct homa *homa);
 extern int      homa_gro_complete(struct sk_buff *skb, int thoff);
+extern void     homa_gro_adaptive(struct sk_buff *skb);
 extern void     homa_gro_gen2(struct sk_buff *skb);
 extern void     homa_gro_gen3(struct sk_buff *skb);
+extern int      homa_gro_steer(struct common_header *h);
 extern struct sk_buff
                *homa_gro_receive(struct list_head *gro_list,
                     struct sk_buff *skb);
+extern void     homa_group_leave(struct homa_socktab *socktab,
+		    struct homa_sock *hsk);
+extern struct homa_sock
+               *homa_group_select(struct homa *homa, __u16 port,
+		    const struct in6_addr *saddr, __u16 sport, __u64 id,
+		    int first);
 extern struct sk_buff
                *homa_gso_segment(struct sk_buff *skb,
 		    netdev_features_t features);
@@ -3202,13 +5642,20 @@ extern enum hrtimer_restart
 extern int      homa_init(struct homa *homa);
 extern void     homa_incoming_sysctl_changed(struct homa *homa);
 extern int      homa_ioc_abort(struct sock *sk, unsigned long arg);
+extern int      homa_ioc_mcast(struct sock *sk, unsigned long arg);
+extern int      homa_ioc_ring(struct sock *sk, unsigned long arg);
+extern int      homa_ioc_send(struct sock *sk, unsigned long arg);
 extern int      homa_ioctl(struct sock *sk, int cmd, unsigned long arg);
 extern void     homa_log_grantable_list(struct homa *homa);
 extern void     homa_log_throttled(struct homa *homa);
 extern int      homa_message_in_init(struct homa_rpc *rpc, int length,
 		    int unsched);
 extern int      homa_message_out_init(struct homa_rpc *rpc,
-		    struct iov_iter *iter, int xmit);
+		    struct iov_iter *iter, int xmit, int shared);
+extern loff_t   homa_metrics_bin_lseek(struct file *file, loff_t offset,
+		    int whence);
+extern ssize_t  homa_metrics_bin_read(struct file *file, char __user *buffer,
+		    size_t length, loff_t *offset);
 extern loff_t   homa_metrics_lseek(struct file *file, loff_t offset,
 		    int whence);
 extern int      homa_metrics_open(struct inode *inode, struct file *file);
@@ -3217,54 +5664,105 @@ extern ssize_t  homa_metrics_read(struct file *file, char __user *buffer,
 extern int      homa_metrics_release(struct inode *inode, struct file *file);
 extern void     homa_need_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 		    struct homa_rpc *rpc);
+extern struct homa_nic
+               *homa_nic_find(struct homa *homa, struct net_device *dev);
+extern __u64    homa_nic_min_idle(struct homa *homa);
 extern int      homa_offload_end(void);
 extern int      homa_offload_init(void);
 extern void     homa_outgoing_sysctl_changed(struct homa *homa);
-extern int      homa_pacer_main(void *transportInfo);
+extern int      homa_pacer_main(void *arg);
+extern int      homa_pacer_start(struct homa *homa);
 extern void     homa_pacer_stop(struct homa *homa);
-extern void     homa_pacer_xmit(struct homa *homa);
+extern void     homa_pacer_xmit(struct homa_pacer *pacer);
+extern void     homa_peertab_check_resize(struct homa_peertab *peertab);
 extern void     homa_peertab_destroy(struct homa_peertab *peertab);
 extern struct homa_peer **
 		    homa_peertab_get_peers(struct homa_peertab *peertab,
 		    int *num_peers);
 extern int      homa_peertab_init(struct homa_peertab *peertab);
+extern int      homa_peertab_resize(struct homa_peertab *peertab, int bits);
 extern void     homa_peer_add_ack(struct homa_rpc *rpc);
+extern int      homa_peer_cong_level(struct homa *homa,
+		    struct homa_peer *peer);
+extern void     homa_peer_congested(struct homa *homa,
+		    struct homa_peer *peer);
 extern struct homa_peer
                *homa_peer_find(struct homa_peertab *peertab,
 		    const struct in6_addr *addr, struct inet_sock *inet);
+extern void     homa_peer_flush_acks(struct homa *homa);
+extern struct homa_peer
+	       *homa_peer_lookup(struct homa_peertab *peertab,
+		    const struct in6_addr *addr);
 extern int      homa_peer_get_acks(struct homa_peer *peer, int count,
 		    struct homa_ack *dst);
 extern struct dst_entry
                *homa_peer_get_dst(struct homa_peer *peer,
 		    struct inet_sock *inet);
+extern struct homa_sock
+               *homa_peer_rpc_sock(struct homa *homa,
+		    const struct in6_addr *saddr, __u16 server_port,
+		    __u16 client_port, __u64 id);
+extern int      homa_peer_rtt_bytes(struct homa *homa,
+		    struct homa_peer *peer, int base);
 extern void     homa_peer_set_cutoffs(struct homa_peer *peer, int c0, int c1,
                     int c2, int c3, int c4, int c5, int c6, int c7);
 extern void     homa_peertab_gc_dsts(struct homa_peertab *peertab, __u64 now);
+extern void     homa_peertab_sweep(struct homa_peertab *peertab,
+		    unsigned long idle_jiffies, int max_peers);
+extern void     homa_peer_update_rtt(struct homa_peer *peer, __u64 rtt);
 extern void     homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk,
 		    struct homa_lcache *lcache, int *delta);
 extern __poll_t homa_poll(struct file *file, struct socket *sock,
                     struct poll_table_struct *wait);
+extern int      homa_policy_bpf_init(void);
+extern __u64    homa_policy_fifo_key(struct homa *homa, struct homa_rpc *rpc);
+extern int      homa_policy_grant_priority(struct homa *homa,
+		    struct homa_rpc *rpc, int rank, int priority);
+extern int      homa_policy_grantable_before(struct homa_rpc *rpc1,
+		    struct homa_rpc *rpc2);
+extern int      homa_policy_register(struct homa *homa,
+		    struct homa_policy_ops *ops);
+extern void     homa_policy_unregister(struct homa *homa,
+		    struct homa_policy_ops *ops);
+extern int      homa_policy_unsched_priority(struct homa *homa,
+		    struct homa_peer *peer, int length, int priority);
 extern int      homa_pool_allocate(struct homa_rpc *rpc);
 extern void     homa_pool_destroy(struct homa_pool *pool);
 extern void    *homa_pool_get_buffer(struct homa_rpc *rpc, int offset,
 		    int *available);
+extern int      homa_pool_get_extent(struct homa_pool *pool, int num_pages,
+		    __u32 *pages);
 extern int      homa_pool_get_pages(struct homa_pool *pool, int num_pages,
 		    __u32 *pages, int leave_locked);
+extern void     homa_pool_get_stats(struct homa_sock *hsk,
+		    struct homa_pool_stats *stats);
 extern int      homa_pool_init(struct homa_sock *hsk, void *buf_region,
-		    __u64 region_size);
+		    __u64 region_size, __u64 extent_size, int num_nodes);
+extern unsigned long
+                homa_pool_page_size(void *region);
+extern int      homa_pool_pin(struct homa_pool *pool);
 extern void     homa_pool_release_buffers(struct homa_pool *pool,
 		    int num_buffers, __u32 *buffers);
+extern void     homa_pool_unpin(struct homa_pool *pool);
 extern char    *homa_print_ipv4_addr(__be32 addr);
 extern char    *homa_print_ipv6_addr(const struct in6_addr *addr);
 extern char    *homa_print_metrics(struct homa *homa);
 extern char    *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len);
 extern char    *homa_print_packet_short(struct sk_buff *skb, char *buffer,
                     int buf_len);
+extern __u64    homa_poll_budget(struct homa_sock *hsk);
+extern void     homa_poll_record_arrival(struct homa_sock *hsk, __u64 now);
 extern void     homa_prios_changed(struct homa *homa);
 extern int      homa_proc_read_metrics(char *buffer, char **start, off_t offset,
                     int count, int *eof, void *data);
+extern int      homa_reap_choose_core(struct homa *homa);
+extern void     homa_reap_queue(struct homa_sock *hsk);
+extern void     homa_reap_work(struct work_struct *work);
+extern int      homa_recvmmsg(struct homa_sock *hsk, struct msghdr *msg);
 extern int      homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len,
                     int flags, int *addr_len);
+extern void     homa_recvmsg_fill(struct homa_rpc *rpc,
+                    struct homa_recvmmsg_msg *entry);
 extern int      homa_register_interests(struct homa_interest *interest,
                     struct homa_sock *hsk, int flags, __u64 id);
 extern void     homa_rehash(struct sock *sk);
@@ -3277,9 +5775,18 @@ extern void     homa_resend_data(struct homa_rpc *rpc, int start, int end,
                     int priority);
 extern void     homa_resend_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
                     struct homa_sock *hsk);
+extern void     homa_ring_destroy(struct homa_sock *hsk);
+extern void     homa_ring_free(struct homa_ring *ring);
+extern int      homa_ring_init(struct homa_sock *hsk,
+                    struct homa_set_rings_args *args);
+extern int      homa_ring_process(struct homa_ring *ring, int min_complete);
+extern int      homa_ring_thread_main(void *arg);
+extern int      homa_ring_thread_pass(struct homa_ring *ring);
+extern void     homa_ring_wake(struct homa_ring *ring);
 extern void     homa_rpc_abort(struct homa_rpc *crpc, int error);
 extern void     homa_rpc_acked(struct homa_sock *hsk,
 		    const struct in6_addr *saddr, struct homa_ack *ack);
+extern void     homa_rpc_cache_drain(struct homa_sock *hsk);
 extern void     homa_rpc_free(struct homa_rpc *rpc);
 extern void     homa_rpc_free_rcu(struct rcu_head *rcu_head);
 extern void     homa_rpc_handoff(struct homa_rpc *rpc);
@@ -3295,8 +5802,14 @@ extern struct homa_rpc
 		    const struct in6_addr *source, struct data_header *h,
 		    int *created);
 extern int      homa_rpc_reap(struct homa_sock *hsk, int count);
-extern void     homa_send_grants(struct homa *homa);
 extern int      homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t len);
+extern int      __homa_sendmsg(struct homa_sock *hsk,
+                    struct homa_sendmsg_args *args, sockaddr_in_union *addr,
+                    struct iov_iter *iter, int shared);
+extern void     homa_send_entry(struct homa_sock *hsk,
+                    struct homa_sendmmsg_msg *entry);
+extern void     homa_skb_get_bits(struct sk_buff *skb, int offset,
+                    void *dest, int length);
 extern int      homa_sendpage(struct sock *sk, struct page *page, int offset,
                     size_t size, int flags);
 extern int      homa_setsockopt(struct sock *sk, int level, int optname,
@@ -3310,6 +5823,9 @@ extern int      homa_sock_bind(struct homa_socktab *socktab,
 extern void     homa_sock_destroy(struct homa_sock *hsk);
 extern struct homa_sock *
                     homa_sock_find(struct homa_socktab *socktab, __u16 port);
+extern struct homa_sock
+               *homa_sock_find_cached(struct homa_socktab *socktab,
+		    __u16 port);
 extern void     homa_sock_init(struct homa_sock *hsk, struct homa *homa);
 extern void     homa_sock_shutdown(struct homa_sock *hsk);
 extern int      homa_socket(struct sock *sk);
@@ -3321,15 +5837,29 @@ extern struct homa_sock
                *homa_socktab_start_scan(struct homa_socktab *socktab,
                     struct homa_socktab_scan *scan);
 extern int      homa_softirq(struct sk_buff *skb);
+extern int      homa_softirq_load(struct homa_core *core, __u64 now);
+extern void     homa_softirq_load_update(struct homa_core *core,
+		    __u64 start, __u64 now);
 extern void     homa_spin(int usecs);
+extern int      homa_stream_end(struct homa_rpc *rpc);
 extern char    *homa_symbol_for_state(struct homa_rpc *rpc);
 extern char    *homa_symbol_for_type(uint8_t type);
 extern int      homa_sysctl_softirq_cores(struct ctl_table *table, int write,
                     void __user *buffer, size_t *lenp, loff_t *ppos);
+extern struct homa_rpc
+	       *homa_throttle_choose_weighted(struct homa_pacer *pacer);
 extern void     homa_timer(struct homa *homa);
+extern int      homa_timer_delay(struct homa_rpc *rpc);
 extern int      homa_timer_main(void *transportInfo);
+extern void     homa_timer_scan(struct homa *homa, int shard,
+		    int num_shards);
+extern int      homa_timer_shard_main(void *arg);
+extern int      homa_timer_shards_start(struct homa *homa);
+extern void     homa_timer_shards_stop(struct homa *homa);
 extern void     homa_unhash(struct sock *sk);
 extern void     homa_unknown_pkt(struct sk_buff *skb, struct homa_rpc *rpc);
+extern int      homa_udp_config(struct homa *homa);
+extern int      homa_udp_encap_rcv(struct sock *sk, struct sk_buff *skb);
 extern int      homa_unsched_priority(struct homa *homa,
                     struct homa_peer *peer, int length);
 extern int      homa_v4_early_demux(struct sk_buff *skb);
@@ -3342,7 +5872,10 @@ extern int      homa_xmit_control(enum homa_packet_type type, void *contents,
                     size_t length, struct homa_rpc *rpc);
 extern int      __homa_xmit_control(void *contents, size_t length,
                     struct homa_peer *peer, struct homa_sock *hsk);
+extern void     homa_xmit_batch_flush(struct homa_xmit_batch *batch);
 extern void     homa_xmit_data(struct homa_rpc *rpc, bool force);
+extern void     homa_xmit_data_batch(struct homa_rpc *rpc, bool force,
+		    struct homa_xmit_batch *batch);
 extern void     __homa_xmit_data(struct sk_buff *skb, struct homa_rpc *rpc,
                     int priority);
 extern void     homa_xmit_unknown(struct sk_buff *skb, struct homa_sock *hsk);
@@ -3359,7 +5892,10 @@ extern void     homa_xmit_unknown(struct sk_buff *skb, struct homa_sock *hsk);
  */
 static inline void homa_check_pacer(struct homa *homa, int softirq)
 {
-	if (list_empty(&homa->throttled_rpcs))
+	unsigned long throttled = READ_ONCE(homa->throttled_pacers);
+	int i;
+
+	if (throttled == 0)
 		return;
 
 	/* The "/2" in the line below gives homa_pacer_main the first chance
@@ -3367,10 +5903,11 @@ static inline void homa_check_pacer(struct homa *homa, int softirq)
 	 * empty, then we will help out here.
 	 */
 	if ((get_cycles() + homa->max_nic_queue_cycles/2) <
-			atomic64_read(&homa->link_idle_time))
+			homa_nic_min_idle(homa))
 		return;
 	tt_record("homa_check_pacer calling homa_pacer_xmit");
-	homa_pacer_xmit(homa);
+	for_each_set_bit(i, &throttled, HOMA_MAX_PACERS)
+		homa_pacer_xmit(&homa->pacers[i]);
 	INC_METRIC(pacer_needed_help, 1);
 }
 
@@ -3389,5 +5926,79 @@ static inline struct dst_entry *homa_get_dst(struct homa_peer *peer,
 	return peer->dst;
 }
 
-extern struct completion homa_pacer_kthread_done;
+/**
+ * homa_pkt_ack() - Return the location in a packet where an ack can be
+ * piggybacked.
+ * @h:       Header of the packet (in its final wire format). The type
+ *           field must be filled in.
+ *
+ * Return:   The ack for the packet, or NULL if packets of this type don't
+ *           carry an ack. For DATA packets, this is the ack in the first
+ *           segment.
+ */
+static inline struct homa_ack *homa_pkt_ack(struct common_header *h)
+{
+	switch (h->type) {
+	case DATA:
+		return &((struct data_header *) h)->seg.ack;
+	case GRANT:
+		return &((struct grant_header *) h)->ack;
+	case RESEND:
+		return &((struct resend_header *) h)->ack;
+	case BUSY:
+		return &((struct busy_header *) h)->ack;
+	default:
+		return NULL;
+	}
+}
+
+/**
+ * homa_resend_num_extra() - Returns the number of valid entries in the
+ * extra_ranges array of an incoming RESEND packet.
+ * @skb:     The packet; skb->data refers to its resend_header.
+ *
+ * Return:   The packet's num_extra field, or 0 if the packet came from a
+ *           peer that doesn't send extra ranges (its header is too short
+ *           to contain them) or if num_extra is invalid.
+ */
+static inline int homa_resend_num_extra(struct sk_buff *skb)
+{
+	struct resend_header *h = (struct resend_header *) skb->data;
+
+	if (skb->len < offsetof(struct resend_header, extra_ranges))
+		return 0;
+	if (h->num_extra >= HOMA_MAX_RESEND_RANGES)
+		return 0;
+	if (skb->len < (offsetof(struct resend_header, extra_ranges)
+			+ h->num_extra * sizeof(struct homa_resend_range)))
+		return 0;
+	return h->num_extra;
+}
+
+/**
+ * homa_get_nic() - Returns the NIC queue information for the network
+ * device used to reach a peer.
+ * @peer:   Peer to which packets will be transmitted.
+ * @hsk:    Homa socket that will transmit the packets.
+ * Return   The entry in homa->nics for the device in @peer's dst.
+ */
+static inline struct homa_nic *homa_get_nic(struct homa_peer *peer,
+	struct homa_sock *hsk)
+{
+	struct homa_nic *nic = READ_ONCE(peer->nic);
+
+	if (unlikely(nic == NULL)) {
+		struct homa_nic *old;
+
+		/* Don't overwrite an entry installed by homa_dst_refresh
+		 * while we were looking: ours may be for the old dst.
+		 */
+		nic = homa_nic_find(hsk->homa, homa_get_dst(peer, hsk)->dev);
+		old = cmpxchg(&peer->nic, NULL, nic);
+		if (old != NULL)
+			nic = old;
+	}
+	return nic;
+}
+
 #endif /* _HOMA_IMPL_H */
@@ -25,6 +25,12 @@
  */
 #define MAX_GRANTS 10
 
+/* Maximum number of times homa_send_grants will repeat its computation
+ * on behalf of other cores before giving up (the remaining work is then
+ * left for the next core that releases grantable_lock, or for homa_timer).
+ */
+#define MAX_GRANT_RECALCS 4
+
 /**
  * homa_message_in_init() - Constructor for homa_message_in.
  * @rpc:          RPC whose msgin structure should be initialized.
@@ -44,10 +50,16 @@ int homa_message_in_init(struct homa_rpc *rpc, int length, int unsched)
 	INIT_LIST_HEAD(&rpc->msgin.gaps);
 	rpc->msgin.bytes_remaining = length;
 	rpc->msgin.granted = (unsched > length) ? length : unsched;
+	rpc->msgin.cong_counted = 0;
 	rpc->msgin.priority = 0;
 	rpc->msgin.scheduled = length > unsched;
 	rpc->msgin.resend_all = 0;
+	rpc->cold->handoff_cycles = 0;
+	rpc->cold->copy_cycles = 0;
 	rpc->msgin.num_bpages = 0;
+	rpc->msgin.streaming = 0;
+	rpc->msgin.stream_offset = 0;
+	rpc->msgin.stream_bpages = 0;
 	err = homa_pool_allocate(rpc);
 	if (err != 0)
 		return err;
@@ -231,7 +243,7 @@ int homa_copy_to_user(struct homa_rpc *rpc)
 		atomic_or(RPC_COPYING_TO_USER, &rpc->flags);
 		homa_rpc_unlock(rpc);
 
-		tt_record1("starting copy to user space for id %d",
+		tt_record_cat1(TT_COPY, "starting copy to user space for id %d",
 				rpc->id);
 
 		/* Each iteration of this loop copies out one skb. */
@@ -276,7 +288,8 @@ int homa_copy_to_user(struct homa_rpc *rpc)
 			if (end_offset == 0) {
 				start_offset = offset;
 			} else if (end_offset != offset) {
-				tt_record3("copied out bytes %d-%d for id %d",
+				tt_record_cat3(TT_COPY,
+						"copied out bytes %d-%d for id %d",
 						start_offset, end_offset,
 						rpc->id);
 				start_offset = offset;
@@ -286,13 +299,14 @@ int homa_copy_to_user(struct homa_rpc *rpc)
 
 		free_skbs:
 		if (end_offset != 0) {
-			tt_record3("copied out bytes %d-%d for id %d",
+			tt_record_cat3(TT_COPY,
+					"copied out bytes %d-%d for id %d",
 					start_offset, end_offset, rpc->id);
 			end_offset = 0;
 		}
 		for (i = 0; i < n; i++)
 			kfree_skb(skbs[i]);
-		tt_record2("finished freeing %d skbs for id %d",
+		tt_record_cat2(TT_COPY, "finished freeing %d skbs for id %d",
 				n, rpc->id);
 		n = 0;
 		homa_rpc_lock(rpc);
@@ -306,18 +320,129 @@ int homa_copy_to_user(struct homa_rpc *rpc)
 	return error;
 }
 
+/**
+ * homa_stream_end() - Determine how much of an incoming message can be
+ * returned next to a receiver in streaming mode (HOMA_RECVMSG_STREAM).
+ * The next piece starts at msgin.stream_offset and must be contiguous
+ * data that has already been copied to the message's buffers. It ends at
+ * a bpage boundary (so that all of its bpages are full) unless it extends
+ * to the end of the message, and it never covers more than HOMA_MAX_BPAGES
+ * bpages.
+ * @rpc:     RPC whose incoming message is of interest. Must be locked by
+ *           caller.
+ * Return:   Offset just after the last byte of the next piece; if this
+ *           equals msgin.stream_offset, nothing can be returned yet.
+ */
+int homa_stream_end(struct homa_rpc *rpc)
+{
+	struct homa_gap *gap;
+	int end, limit;
+
+	if ((rpc->msgin.length < 0) || (rpc->msgin.num_bpages == 0)
+			|| (skb_queue_len(&rpc->msgin.packets)))
+		return rpc->msgin.stream_offset;
+	gap = list_first_entry_or_null(&rpc->msgin.gaps, struct homa_gap,
+			links);
+	end = gap ? gap->start : rpc->msgin.recv_end;
+	limit = rpc->msgin.stream_offset + (HOMA_MAX_BPAGES
+			<< HOMA_BPAGE_SHIFT);
+	if ((end == rpc->msgin.length) && (end <= limit))
+		return end;
+	if (end > limit)
+		end = limit;
+	end &= ~(HOMA_BPAGE_SIZE - 1);
+	if (end < rpc->msgin.stream_offset)
+		return rpc->msgin.stream_offset;
+	return end;
+}
+
+/**
+ * homa_copy_to_pinned() - Copy the data from all of the packets queued for
+ * an incoming message directly into the message's buffer space, using the
+ * pinned pages of the socket's buffer region, then free the packets. Unlike
+ * homa_copy_to_user, this function doesn't need to run in the context of the
+ * receiving process, so it can be invoked in SoftIRQ as packets arrive.
+ * @rpc:     RPC whose packets should be copied. Must be locked by caller,
+ *           and its socket's buffer region must be pinned (see
+ *           homa_pool_pin).
+ * Return:   The number of packets whose data was copied.
+ */
+int homa_copy_to_pinned(struct homa_rpc *rpc)
+{
+	struct homa_pool *pool = &rpc->hsk->buffer_pool;
+	struct page **pages = smp_load_acquire(&pool->pinned_pages);
+	struct sk_buff *skb;
+	int count = 0;
+
+	/* The region may have been unpinned since the caller checked; if
+	 * so, leave the packets for homa_copy_to_user.
+	 */
+	if (unlikely(!pages))
+		return 0;
+	while ((skb = __skb_dequeue(&rpc->msgin.packets)) != NULL) {
+		struct data_header *h = (struct data_header *) skb->data;
+		int offset = ntohl(h->seg.offset);
+		int pkt_length = ntohl(h->seg.segment_length);
+		int copied = 0;
+
+		/* Each iteration of this loop copies to one page of the
+		 * region (pages that are adjacent in the region needn't be
+		 * adjacent in kernel memory).
+		 */
+		while (copied < pkt_length) {
+			int buf_bytes, chunk_size, region_offset, page_offset;
+			char *vaddr;
+
+			region_offset = (char *) homa_pool_get_buffer(rpc,
+					offset + copied, &buf_bytes)
+					- pool->region;
+			if (buf_bytes == 0) {
+				/* skb has data beyond message end? */
+				break;
+			}
+			page_offset = region_offset & ~PAGE_MASK;
+			chunk_size = pkt_length - copied;
+			if (chunk_size > buf_bytes)
+				chunk_size = buf_bytes;
+			if (chunk_size > (PAGE_SIZE - page_offset))
+				chunk_size = PAGE_SIZE - page_offset;
+			vaddr = kmap_local_page(pages[region_offset
+					>> PAGE_SHIFT]);
+			if (skb_copy_bits(skb, sizeof(*h) + copied,
+					vaddr + page_offset, chunk_size) != 0) {
+				kunmap_local(vaddr);
+				tt_record2("homa_copy_to_pinned found short "
+						"packet for id %d, offset %d",
+						rpc->id, offset);
+				break;
+			}
+			kunmap_local(vaddr);
+			copied += chunk_size;
+		}
+		INC_METRIC(softirq_copy_bytes, copied);
+		kfree_skb(skb);
+		count++;
+	}
+	return count;
+}
+
 /**
  * homa_get_resend_range() - Given a message for which some input data
- * is missing, find the first range of missing data.
+ * is missing, find the ranges of missing data.
  * @msgin:     Message for which not all granted data has been received.
  * @resend:    The @offset and @length fields of this structure will be
  *             filled in with information about the first missing range
- *             in @msgin.
+ *             in @msgin; if there are additional gaps, up to
+ *             HOMA_MAX_RESEND_RANGES - 1 of them are stored in
+ *             @extra_ranges.
  */
 void homa_get_resend_range(struct homa_message_in *msgin,
 		struct resend_header *resend)
 {
+	struct homa_gap *gap;
 
+	resend->num_extra = 0;
+	memset(resend->extra_ranges, 0, sizeof(resend->extra_ranges));
 	if (msgin->length < 0) {
 		/* Haven't received any data for this message; request
 		 * retransmission of just the first packet (the sender
@@ -330,10 +455,19 @@ void homa_get_resend_range(struct homa_message_in *msgin,
 	}
 
 	if (!list_empty(&msgin->gaps)) {
-		struct homa_gap *gap = list_first_entry(&msgin->gaps,
-				struct homa_gap, links);
+		gap = list_first_entry(&msgin->gaps, struct homa_gap, links);
 		resend->offset = htonl(gap->start);
 		resend->length = htonl(gap->end - gap->start);
+		list_for_each_entry_continue(gap, &msgin->gaps, links) {
+			struct homa_resend_range *range;
+
+			if (resend->num_extra >= (HOMA_MAX_RESEND_RANGES - 1))
+				break;
+			range = &resend->extra_ranges[resend->num_extra];
+			range->offset = htonl(gap->start);
+			range->length = htonl(gap->end - gap->start);
+			resend->num_extra++;
+		}
 	} else {
 		resend->offset = htonl(msgin->recv_end);
 		if (msgin->granted >= msgin->recv_end)
@@ -364,21 +498,26 @@ void homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk,
 	struct common_header *h = (struct common_header *) skb->data;
 	const struct in6_addr saddr = skb_canonical_ipv6_saddr(skb);
 	struct homa_rpc *rpc;
+	struct homa_ack *ack;
 	__u64 id = homa_local_id(h->sender_id);
 
 	/* If there is an ack in the packet, handle it. Must do this
 	 * before locking the packet's RPC, since we may need to acquire
 	 * (other) RPC locks to handle the acks.
 	 */
-	if (h->type == DATA) {
-		struct data_header *dh = (struct data_header *) h;
-		if (dh->seg.ack.client_id != 0) {
-			/* homa_rpc_acked may attempt to lock the RPC, so
-			 * make sure we don't have an RPC locked.
-			 */
-			homa_lcache_release(lcache);
-			homa_rpc_acked(hsk, &saddr, &dh->seg.ack);
-		}
+	ack = homa_pkt_ack(h);
+	if (ack && ((char *) (ack + 1) > ((char *) h + skb->len))) {
+		/* Older peers send GRANT, RESEND, and BUSY packets
+		 * without acks.
+		 */
+		ack = NULL;
+	}
+	if (ack && (ack->client_id != 0)) {
+		/* homa_rpc_acked may attempt to lock the RPC, so
+		 * make sure we don't have an RPC locked.
+		 */
+		homa_lcache_release(lcache);
+		homa_rpc_acked(hsk, &saddr, ack);
 	}
 
 	/* Find and lock the RPC for this packet. */
@@ -529,19 +668,32 @@ void homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
 {
 	struct homa *homa = rpc->hsk->homa;
 	struct data_header *h = (struct data_header *) skb->data;
-	int old_remaining;
+	int old_remaining, copied = 0;
 
-	tt_record4("incoming data packet, id %d, peer 0x%x, offset %d/%d",
+	tt_record_cat4(TT_SOFTIRQ,
+			"incoming data packet, id %d, peer 0x%x, offset %d/%d",
 			homa_local_id(h->common.sender_id),
 			tt_addr(rpc->peer->addr), ntohl(h->seg.offset),
 			ntohl(h->message_length));
 
+	if (homa->congestion_signal & HOMA_CONG_ECN) {
+		__u8 dsfield = skb_is_ipv6(skb)
+				? ipv6_get_dsfield(ipv6_hdr(skb))
+				: ip_hdr(skb)->tos;
+
+		if (INET_ECN_is_ce(dsfield)) {
+			INC_METRIC(cong_ecn_marks, 1);
+			homa_peer_congested(homa, rpc->peer);
+		}
+	}
+
 	if ((rpc->state != RPC_INCOMING) && homa_is_client(rpc->id)) {
 		if (unlikely(rpc->state != RPC_OUTGOING))
 			goto discard;
 		INC_METRIC(responses_received, 1);
 		rpc->state = RPC_INCOMING;
-		tt_record2("Incoming message for id %d has %d unscheduled bytes",
+		tt_record_cat2(TT_SOFTIRQ,
+				"Incoming message for id %d has %d unscheduled bytes",
 				rpc->id, ntohl(h->incoming));
 		if (homa_message_in_init(rpc, ntohl(h->message_length),
 				ntohl(h->incoming)) != 0)
@@ -567,6 +719,8 @@ void homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
 				ntohl(h->seg.segment_length),
 				rpc->msgin.granted);
 		INC_METRIC(dropped_data_no_bufs, ntohl(h->seg.segment_length));
+		atomic64_add(ntohl(h->seg.segment_length),
+				&rpc->hsk->buffer_pool.dropped_bytes);
 		goto discard;
 	}
 
@@ -574,7 +728,20 @@ void homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
 	homa_add_packet(rpc, skb);
 	*delta -= old_remaining - rpc->msgin.bytes_remaining;
 
-	if ((skb_queue_len(&rpc->msgin.packets) != 0)
+	/* For large messages, copy the data to user space now if possible,
+	 * so the receiving thread doesn't have to copy the whole message
+	 * serially. In this case the receiving thread needn't be woken up
+	 * until the message is complete.
+	 */
+	if (rpc->hsk->softirq_copy_length
+			&& (rpc->msgin.length >= rpc->hsk->softirq_copy_length)
+			&& READ_ONCE(rpc->hsk->buffer_pool.pinned_pages))
+		copied = homa_copy_to_pinned(rpc);
+
+	if (((skb_queue_len(&rpc->msgin.packets) != 0)
+			|| (copied && ((rpc->msgin.bytes_remaining == 0)
+			|| (rpc->hsk->streaming && (homa_stream_end(rpc)
+			> rpc->msgin.stream_offset)))))
 			&& !(atomic_read(&rpc->flags) & RPC_PKTS_READY)) {
 		atomic_or(RPC_PKTS_READY, &rpc->flags);
 		homa_sock_lock(rpc->hsk, "homa_data_pkt");
@@ -628,12 +795,22 @@ void homa_grant_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 {
 	struct grant_header *h = (struct grant_header *) skb->data;
 
-	tt_record3("processing grant for id %llu, offset %d, priority %d",
+	tt_record_cat3(TT_GRANT,
+			"processing grant for id %llu, offset %d, priority %d",
 			homa_local_id(h->common.sender_id), ntohl(h->offset),
 			h->priority);
 	if (rpc->state == RPC_OUTGOING) {
 		int new_offset = ntohl(h->offset);
 
+		/* The first grant for a message arrives about one round
+		 * trip after its first packet was sent.
+		 */
+		if (rpc->msgout.rtt_start != 0) {
+			homa_peer_update_rtt(rpc->peer,
+					get_cycles() - rpc->msgout.rtt_start);
+			rpc->msgout.rtt_start = 0;
+		}
+
 		if (h->resend_all)
 			homa_resend_data(rpc, 0, rpc->msgout.next_xmit_offset,
 					h->priority);
@@ -664,6 +841,7 @@ void homa_resend_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
 	struct resend_header *h = (struct resend_header *) skb->data;
 	const struct in6_addr saddr = skb_canonical_ipv6_saddr(skb);
 	struct busy_header busy;
+	int num_extra, i;
 
 	if (rpc == NULL) {
 		tt_record4("resend request for unknown id %d, peer 0x%x:%d, "
@@ -707,6 +885,14 @@ void homa_resend_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
 		homa_resend_data(rpc, ntohl(h->offset),
 				ntohl(h->offset) + ntohl(h->length),
 				h->priority);
+		num_extra = homa_resend_num_extra(skb);
+		for (i = 0; i < num_extra; i++) {
+			int offset = ntohl(h->extra_ranges[i].offset);
+
+			homa_resend_data(rpc, offset, offset
+					+ ntohl(h->extra_ranges[i].length),
+					h->priority);
+		}
 	}
 
     done:
@@ -782,6 +968,7 @@ void homa_cutoffs_pkt(struct sk_buff *skb, struct homa_sock *hsk)
 		for (i = 1; i <HOMA_MAX_PRIORITIES; i++)
 			peer->unsched_cutoffs[i] = ntohl(h->unsched_cutoffs[i]);
 		peer->cutoff_version = h->cutoff_version;
+		homa_peer_put(peer);
 	}
 	kfree_skb(skb);
 }
@@ -836,6 +1023,7 @@ void homa_need_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 	__homa_xmit_control(&ack, sizeof(ack), peer, hsk);
 	tt_record3("Responded to NEED_ACK for id %d, peer %0x%x with %d "
 			"other acks", id, tt_addr(saddr), ntohs(ack.num_acks));
+	homa_peer_put(peer);
 
     done:
 	kfree_skb(skb);
@@ -872,10 +1060,147 @@ void homa_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 	kfree_skb(skb);
 }
 
+/**
+ * homa_grantable_before() - Compare the grant priorities of two RPCs.
+ * @rpc1:    First RPC to compare.
+ * @rpc2:    Second RPC to compare.
+ * Return:   Nonzero means @rpc1 should be granted ahead of @rpc2 (by
+ *           default, it has fewer bytes remaining, or the same number
+ *           and it is older; a homa_policy_ops may override this).
+ */
+static inline int homa_grantable_before(struct homa_rpc *rpc1,
+		struct homa_rpc *rpc2)
+{
+	if (unlikely(rcu_access_pointer(rpc1->hsk->homa->policy))) {
+		int result = homa_policy_grantable_before(rpc1, rpc2);
+
+		if (result >= 0)
+			return result;
+	}
+	if (rpc1->msgin.bytes_remaining != rpc2->msgin.bytes_remaining)
+		return rpc1->msgin.bytes_remaining
+				< rpc2->msgin.bytes_remaining;
+	return rpc1->msgin.birth < rpc2->msgin.birth;
+}
+
+/**
+ * homa_peer_first_grantable() - Returns the highest priority grantable
+ * RPC for a peer. The caller must hold the grantable lock.
+ * @peer:    Peer of interest; must have at least one grantable RPC.
+ * Return:   The first RPC in @peer->grantable_rpcs.
+ */
+static inline struct homa_rpc *homa_peer_first_grantable(
+		struct homa_peer *peer)
+{
+	return list_first_entry(&peer->grantable_rpcs, struct homa_rpc,
+			grantable_links);
+}
+
+/**
+ * homa_adjust_grantable_peer() - Make sure that a peer is in the right
+ * place in homa->grantable_peers (or not there at all, if it has no
+ * grantable RPCs). Invoked after the first RPC in @peer->grantable_rpcs
+ * may have changed. The caller must hold the grantable lock.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @peer:    Peer whose position may need to change.
+ */
+static void homa_adjust_grantable_peer(struct homa *homa,
+		struct homa_peer *peer)
+{
+	struct homa_peer *candidate;
+	struct homa_rpc *first;
+
+	if (list_empty(&peer->grantable_rpcs)) {
+		list_del_init(&peer->grantable_links);
+		return;
+	}
+	first = homa_peer_first_grantable(peer);
+	if (list_empty(&peer->grantable_links)) {
+		/* Search from the tail: new messages usually have more
+		 * bytes remaining than existing ones, so this is typically
+		 * a short search even with many grantable peers.
+		 */
+		list_for_each_entry_reverse(candidate, &homa->grantable_peers,
+				grantable_links) {
+			if (!homa_grantable_before(first,
+					homa_peer_first_grantable(candidate))) {
+				list_add(&peer->grantable_links,
+						&candidate->grantable_links);
+				return;
+			}
+		}
+		list_add(&peer->grantable_links, &homa->grantable_peers);
+		return;
+	}
+
+	/* Move the peer up, if its priority has increased. */
+	while (peer != list_first_entry(&homa->grantable_peers,
+			struct homa_peer, grantable_links)) {
+		candidate = list_prev_entry(peer, grantable_links);
+		if (!homa_grantable_before(first,
+				homa_peer_first_grantable(candidate)))
+			break;
+		__list_del_entry(&candidate->grantable_links);
+		list_add(&candidate->grantable_links, &peer->grantable_links);
+	}
+
+	/* Move the peer down, if its priority has decreased. */
+	while (!list_is_last(&peer->grantable_links, &homa->grantable_peers)) {
+		candidate = list_next_entry(peer, grantable_links);
+		if (!homa_grantable_before(homa_peer_first_grantable(candidate),
+				first))
+			break;
+		__list_del_entry(&peer->grantable_links);
+		list_add(&peer->grantable_links, &candidate->grantable_links);
+	}
+}
+
+/**
+ * homa_grantable_resort() - Rebuild all of the grantable lists from
+ * scratch, using the current homa_grantable_before ordering. Invoked when
+ * a homa_policy_ops is installed or removed, since the existing lists may
+ * not be sorted according to the new ordering (the incremental updates in
+ * homa_check_grantable assume the lists are already sorted). The caller
+ * must hold the grantable lock.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_grantable_resort(struct homa *homa)
+{
+	struct homa_peer *peer, *next_peer;
+	struct homa_rpc *rpc, *next_rpc, *candidate;
+	LIST_HEAD(peers);
+	LIST_HEAD(rpcs);
+
+	list_splice_init(&homa->grantable_peers, &peers);
+	list_for_each_entry_safe(peer, next_peer, &peers, grantable_links) {
+		list_del_init(&peer->grantable_links);
+		list_splice_init(&peer->grantable_rpcs, &rpcs);
+		list_for_each_entry_safe(rpc, next_rpc, &rpcs,
+				grantable_links) {
+			list_del(&rpc->grantable_links);
+			list_for_each_entry_reverse(candidate,
+					&peer->grantable_rpcs, grantable_links) {
+				if (!homa_grantable_before(rpc, candidate))
+					break;
+			}
+
+			/* If the loop completed, candidate refers to the
+			 * list head, so this adds rpc at the front.
+			 */
+			list_add(&rpc->grantable_links,
+					&candidate->grantable_links);
+		}
+		homa_adjust_grantable_peer(homa, peer);
+	}
+}
+
 /**
  * homa_check_grantable() - This function ensures that an RPC is on the
  * grantable list if appropriate. It also adjusts the position of the RPC
- * upward on the list, if needed.
+ * upward on the list, if needed. Grantable RPCs are kept in per-peer lists
+ * sorted by priority, and peers are kept in homa->grantable_peers, sorted
+ * by the priority of their first RPC, so only one peer's RPCs need to be
+ * examined here.
  * @rpc:     RPC to check; typically the status of this RPC has changed
  *           in a way that may affect its grantability (e.g. a packet
  *           just arrived for it). Must be locked.
@@ -883,7 +1208,7 @@ void homa_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 void homa_check_grantable(struct homa_rpc *rpc)
 {
 	struct homa_rpc *candidate;
-	struct homa_message_in *msgin = &rpc->msgin;
+	struct homa_peer *peer = rpc->peer;
 	struct homa *homa = rpc->hsk->homa;
 
 	UNIT_LOG("; ", "homa_check_grantable invoked");
@@ -900,8 +1225,8 @@ void homa_check_grantable(struct homa_rpc *rpc)
 		return;
 	}
 
-	/* Make sure this message is in the right place in the grantable_rpcs
-	 * list.
+	/* Make sure this message is in the right place in the peer's
+	 * grantable_rpcs list.
 	 */
 	if (list_empty(&rpc->grantable_links)) {
 		/* Message not yet tracked; add it in priority order. */
@@ -910,42 +1235,44 @@ void homa_check_grantable(struct homa_rpc *rpc)
 				* (time - homa->last_grantable_change));
 		homa->last_grantable_change = time;
 		homa->num_grantable_rpcs++;
-		tt_record2("Incremented num_grantable_rpcs to %d, id %d",
+		if (rpc->hsk->num_grantable++ == 0)
+			homa->grantable_weight += rpc->hsk->weight;
+		tt_record_cat2(TT_GRANT,
+				"Incremented num_grantable_rpcs to %d, id %d",
 				homa->num_grantable_rpcs, rpc->id);
 		if (homa->num_grantable_rpcs > homa->max_grantable_rpcs)
 			homa->max_grantable_rpcs = homa->num_grantable_rpcs;
+		if (homa->freeze_grantable_rpcs && (homa->num_grantable_rpcs
+				> homa->freeze_grantable_rpcs))
+			homa_freeze_trigger(homa, GRANTABLE_RPCS,
+					"Freezing because num_grantable_rpcs "
+					"reached %d, id %d",
+					homa->num_grantable_rpcs, rpc->id);
 		rpc->msgin.birth = get_cycles();
-		list_for_each_entry(candidate, &homa->grantable_rpcs,
+		list_for_each_entry_reverse(candidate, &peer->grantable_rpcs,
 				grantable_links) {
-			if (candidate->msgin.bytes_remaining
-					> msgin->bytes_remaining) {
-				list_add_tail(&rpc->grantable_links,
+			if (!homa_grantable_before(rpc, candidate)) {
+				list_add(&rpc->grantable_links,
 						&candidate->grantable_links);
 				goto done;
 			}
 		}
-		list_add_tail(&rpc->grantable_links, &homa->grantable_rpcs);
-	} else while (rpc != list_first_entry(&homa->grantable_rpcs,
-			struct homa_rpc, grantable_links)) {
+		list_add(&rpc->grantable_links, &peer->grantable_rpcs);
+	} else while (rpc != homa_peer_first_grantable(peer)) {
 		/* Message is on the list, but its priority may have
 		 * increased because of a recent packet arrival. If so,
 		 * adjust its position in the list.
 		 */
 		candidate = list_prev_entry(rpc, grantable_links);
-		/* Fewer remaining bytes wins: */
-		if (candidate->msgin.bytes_remaining < msgin->bytes_remaining)
+		if (!homa_grantable_before(rpc, candidate))
 			goto done;
-		/* Tie-breaker: oldest wins */
-		if (candidate->msgin.bytes_remaining == msgin->bytes_remaining) {
-			if (candidate->msgin.birth <= msgin->birth) {
-				goto done;
-			}
-		}
 		__list_del_entry(&candidate->grantable_links);
 		list_add(&candidate->grantable_links, &rpc->grantable_links);
 	}
 
     done:
+	if (rpc == homa_peer_first_grantable(peer))
+		homa_adjust_grantable_peer(homa, peer);
 	homa_grantable_unlock(homa);
 }
 
@@ -967,10 +1294,18 @@ void homa_send_grants(struct homa *homa)
 	 * - If there are fewer messages than priority levels, then we use
 	 *   the lowest available levels (new higher-priority messages can
 	 *   use the higher levels to achieve instantaneous preemption).
+	 * - This function is invoked on every core that processes incoming
+	 *   packets, so cores must not wait for each other here. If some
+	 *   other core holds grantable_lock, we just bump
+	 *   homa->grant_recalc_count and leave; when that core releases the
+	 *   lock (here or in homa_grantable_unlock) it will notice the
+	 *   change and compute grants again, taking our changes into
+	 *   account. Grant decisions thus remain global (exact SRPT),
+	 *   but no core ever waits on grantable_lock in this function.
 	 */
-	int i, num_grants;
+	int i, num_grants, recalc_count, passes;
 	__u64 start;
-	struct homa_rpc *fifo_rpc = NULL;
+	struct homa_rpc *fifo_rpc;
 	int fifo_grant;
 
 	/* RPCs that are candidates for grants; if we eventually decide
@@ -990,71 +1325,238 @@ void homa_send_grants(struct homa *homa)
 	/* How many more bytes we can grant before hitting the limit. */
 	int available = homa->max_incoming - atomic_read(&homa->total_incoming);
 
-	if (list_empty(&homa->grantable_rpcs))
+	if (list_empty(&homa->grantable_peers))
 		return;
 
 	if (available <= 0) {
-		tt_record1("homa_send_grants can't grant: total_incoming %d",
+		tt_record_cat1(TT_GRANT,
+				"homa_send_grants can't grant: total_incoming %d",
 				atomic_read(&homa->total_incoming));
 		return;
 	}
 
 	start = get_cycles();
-	homa_grantable_lock(homa);
+	atomic_inc(&homa->grant_recalc_count);
+	smp_mb__after_atomic();
+	for (passes = 1; ; passes++) {
+		if (!spin_trylock_bh(&homa->grantable_lock)) {
+			INC_METRIC(grant_recalc_skips, 1);
+			break;
+		}
+		recalc_count = atomic_read(&homa->grant_recalc_count);
+		WRITE_ONCE(homa->grant_recalc_done, recalc_count);
+		available = homa->max_incoming
+				- atomic_read(&homa->total_incoming);
+		fifo_rpc = NULL;
 
-	num_rpcs = homa_choose_rpcs_to_grant(homa, rpcs, homa->max_overcommit);
+		num_rpcs = homa_choose_rpcs_to_grant(homa, rpcs,
+				homa->max_overcommit);
 
-	/* Compute grants but don't actually send them; we want to release
-	 * grantable_lock before sending.
-	 */
-	num_grants = homa_create_grants(homa, rpcs, num_rpcs, grants,
-			available);
-
-	if (homa->grant_nonfifo_left <= 0) {
-		homa->grant_nonfifo_left += homa->grant_nonfifo;
-		if (homa->grant_fifo_fraction) {
-			fifo_rpc = homa_choose_fifo_grant(homa);
-			if (fifo_rpc != NULL)
-				fifo_grant = fifo_rpc->msgin.granted;
+		/* Compute grants but don't actually send them; we want to
+		 * release grantable_lock before sending.
+		 */
+		num_grants = homa_create_grants(homa, rpcs, num_rpcs, grants,
+				available);
+
+		if (homa->grant_nonfifo_left <= 0) {
+			homa->grant_nonfifo_left += homa->grant_nonfifo;
+			if (homa->grant_fifo_fraction) {
+				fifo_rpc = homa_choose_fifo_grant(homa);
+				if (fifo_rpc != NULL)
+					fifo_grant = fifo_rpc->msgin.granted;
+			}
 		}
-	}
-	homa_grantable_unlock(homa);
 
-	/* By sending grants without holding grantable_lock here, we reduce
-	 * contention on that lock significantly. This only works because
-	 * rpc->grants_in_progress keeps RPCs from being deleted out from
-	 * under us.
-	 */
-	for (i = 0; i < num_grants; i++) {
-		/* Send any accumulated grants (ignore errors). */
-		BUG_ON(rpcs[i]->magic != HOMA_RPC_MAGIC);
-		homa_xmit_control(GRANT, &grants[i], sizeof(grants[i]),
-			rpcs[i]);
-		atomic_dec(&rpcs[i]->grants_in_progress);
+		/* Can't use homa_grantable_unlock: the check below does its
+		 * work.
+		 */
+		spin_unlock_bh(&homa->grantable_lock);
+
+		/* By sending grants without holding grantable_lock here, we
+		 * reduce contention on that lock significantly. This only
+		 * works because rpc->grants_in_progress keeps RPCs from being
+		 * deleted out from under us.
+		 */
+		for (i = 0; i < num_grants; i++) {
+			/* Send any accumulated grants (ignore errors). */
+			BUG_ON(rpcs[i]->magic != HOMA_RPC_MAGIC);
+			homa_xmit_control(GRANT, &grants[i], sizeof(grants[i]),
+				rpcs[i]);
+			atomic_dec(&rpcs[i]->grants_in_progress);
+		}
+
+		/* The second check below is avoids duplicate grants in
+		 * situations where multiple cores decide to send fifo grants
+		 * for the same RPC before any of them gets here.
+		 */
+		if ((fifo_rpc != NULL) && (fifo_grant
+				== fifo_rpc->msgin.granted)) {
+			struct grant_header grant;
+			grant.offset = htonl(fifo_grant);
+			grant.priority = homa->max_sched_prio;
+			grant.resend_all = 0;
+			tt_record_cat3(TT_GRANT,
+					"sending fifo grant for id %llu, offset %d, "
+					"priority %d",
+					fifo_rpc->id, fifo_rpc->msgin.granted,
+					homa->max_sched_prio);
+			homa_xmit_control(GRANT, &grant, sizeof(grant),
+					fifo_rpc);
+		}
+
+		/* If another core asked for grants while we were working,
+		 * it left the work to us.
+		 */
+		smp_mb();
+		if (atomic_read(&homa->grant_recalc_count) == recalc_count)
+			break;
+		if (passes >= MAX_GRANT_RECALCS) {
+			INC_METRIC(grant_recalc_limits, 1);
+			break;
+		}
+		INC_METRIC(grant_recalc_retries, 1);
 	}
+	INC_METRIC(grant_cycles, get_cycles() - start);
+}
+
+/**
+ * homa_share_slots() - Returns how many RPCs from a given socket
+ * homa_choose_rpcs_to_grant may select when weighted shares are in use.
+ * @homa:      Overall data about the Homa protocol implementation.
+ * @hsk:       Socket of interest; must have at least one grantable RPC.
+ * @max_rpcs:  Total number of RPCs that can be selected.
+ * Return:     @hsk's share of @max_rpcs, in proportion to its weight (at
+ *             least 1).
+ */
+static inline int homa_share_slots(struct homa *homa, struct homa_sock *hsk,
+		int max_rpcs)
+{
+	int slots = max_rpcs * hsk->weight / homa->grantable_weight;
+
+	return (slots < 1) ? 1 : slots;
+}
+
+/**
+ * homa_choose_pass() - Does most of the work of homa_choose_rpcs_to_grant:
+ * makes one scan over the grantable RPCs and merges candidates into @rpcs.
+ * @homa:      Overall data about the Homa protocol implementation.
+ * @rpcs:      Candidates selected so far, in decreasing priority order.
+ * @num_rpcs:  Number of valid entries in @rpcs when this function is
+ *             invoked.
+ * @max_rpcs:  Maximum number of RPCs that may be stored in @rpcs.
+ * @limited:   If non-NULL, each socket may contribute no more than its
+ *             weighted share of @max_rpcs (see homa_share_slots), and
+ *             *@limited is set to 1 if any RPC was skipped because of this.
+ * @fill:      Nonzero means this pass fills slots left over by an earlier
+ *             (limited) pass: entries already in @rpcs stay there and the
+ *             scan stops once @rpcs is full.
+ * Return:     The new number of valid entries in @rpcs.
+ */
+static int homa_choose_pass(struct homa *homa, struct homa_rpc **rpcs,
+		int num_rpcs, int max_rpcs, int *limited, int fill)
+{
+	struct homa_peer *peer;
+	struct homa_rpc *rpc;
 
-	/* The second check below is avoids duplicate grants in situations
-	 * where multiple cores decide to send fifo grants for the same
-	 * RPC before any of them gets here.
+	/* Peers are sorted by their best RPC, so once @rpcs is full and
+	 * a peer's best RPC can't displace anything, no later peer can
+	 * either. Each peer contributes at most max_rpcs_per_peer RPCs,
+	 * which are merged into @rpcs in priority order.
 	 */
-	if ((fifo_rpc != NULL) && (fifo_grant == fifo_rpc->msgin.granted)) {
-		struct grant_header grant;
-		grant.offset = htonl(fifo_grant);
-		grant.priority = homa->max_sched_prio;
-		grant.resend_all = 0;
-		tt_record3("sending fifo grant for id %llu, offset %d, "
-				"priority %d",
-				fifo_rpc->id, fifo_rpc->msgin.granted,
-				homa->max_sched_prio);
-		homa_xmit_control(GRANT, &grant, sizeof(grant), fifo_rpc);
+	list_for_each_entry(peer, &homa->grantable_peers, grantable_links) {
+		int peer_rpcs = 0;
+		int max_peer_rpcs = homa->max_rpcs_per_peer
+				>> homa_peer_cong_level(homa, peer);
+
+		if (max_peer_rpcs < 1)
+			max_peer_rpcs = 1;
+
+		if ((num_rpcs >= max_rpcs) && (fill || !homa_grantable_before(
+				homa_peer_first_grantable(peer),
+				rpcs[num_rpcs - 1])))
+			break;
+		list_for_each_entry(rpc, &peer->grantable_rpcs,
+				grantable_links) {
+			struct homa_sock *hsk = rpc->hsk;
+			int i;
+
+			if (unlikely(rpc->msgin.num_bpages == 0)) {
+				/* No buffer space has been committed to this
+				 * message, so any data we granted would be
+				 * dropped by homa_data_pkt. It will get grants
+				 * once homa_pool_release_buffers finds space
+				 * for it.
+				 */
+				if (!fill) {
+					INC_METRIC(grant_no_bufs_skips, 1);
+					atomic64_inc(&hsk->buffer_pool
+							.grant_skips);
+				}
+				continue;
+			}
+			if (peer_rpcs >= max_peer_rpcs) {
+				if (!fill && (peer_rpcs
+						< homa->max_rpcs_per_peer))
+					INC_METRIC(cong_limited_rpcs, 1);
+				break;
+			}
+			if (fill) {
+				/* RPCs chosen by the earlier pass still count
+				 * against the peer's limit.
+				 */
+				for (i = 0; i < num_rpcs; i++) {
+					if (rpcs[i] == rpc)
+						break;
+				}
+				if (i < num_rpcs) {
+					peer_rpcs++;
+					continue;
+				}
+				if (num_rpcs >= max_rpcs)
+					return num_rpcs;
+			} else if (limited) {
+				if (hsk->grant_pass != homa->grant_pass) {
+					hsk->grant_pass = homa->grant_pass;
+					hsk->pass_rpcs = 0;
+				}
+				if (hsk->pass_rpcs >= homa_share_slots(homa,
+						hsk, max_rpcs)) {
+					*limited = 1;
+					hsk->share_limited++;
+					INC_METRIC(share_limited_rpcs, 1);
+					continue;
+				}
+			}
+			peer_rpcs++;
+
+			/* Find the position of rpc in rpcs; if rpcs is full,
+			 * the last RPC is dropped to make room.
+			 */
+			for (i = num_rpcs; i > 0; i--) {
+				if (!homa_grantable_before(rpc, rpcs[i-1]))
+					break;
+			}
+			if (i >= max_rpcs)
+				break;
+			if (num_rpcs < max_rpcs)
+				num_rpcs++;
+			else if (limited)
+				rpcs[num_rpcs - 1]->hsk->pass_rpcs--;
+			memmove(&rpcs[i+1], &rpcs[i],
+					(num_rpcs - 1 - i) * sizeof(*rpcs));
+			rpcs[i] = rpc;
+			if (limited)
+				hsk->pass_rpcs++;
+		}
 	}
-	INC_METRIC(grant_cycles, get_cycles() - start);
+	return num_rpcs;
 }
 
 /**
- * homa_choose_rpcs_to_grant() - Scans homa->grantable_rpcs and picks
- * a set that are candidates for granting, considering factors such
- * as homa->max_peers_per_rpc. The caller must hold homa->grantable_lock.
+ * homa_choose_rpcs_to_grant() - Scans homa->grantable_peers and picks
+ * a set of RPCs that are candidates for granting, considering factors such
+ * as homa->max_rpcs_per_peer and (if homa->weighted_shares is set) the
+ * weights of the RPCs' sockets. The caller must hold homa->grantable_lock.
  * @homa:      Overall data about the Homa protocol implementation.
  * @rpcs:      The selected RPCs will be stored in this array, in
  *             decreasing priority order.
@@ -1065,45 +1567,24 @@ void homa_send_grants(struct homa *homa)
 int homa_choose_rpcs_to_grant(struct homa *homa, struct homa_rpc **rpcs,
 		int max_rpcs)
 {
-	struct homa_rpc *rpc, *temp;
-	int num_rpcs = 0;
-
-	/* The variables below allow us to limit how many messages we
-	 * will grant for a single peer. Peers contains one entry for
-	 * each of the num_peers distinct peers we have encountered so
-	 * far in grantable_rpcs and rpc_count indicates how many
-	 * different RPCs are destined for that peer.
+	int num_rpcs, limited = 0;
+
+	if (!homa->weighted_shares)
+		return homa_choose_pass(homa, rpcs, 0, max_rpcs, NULL, 0);
+
+	/* With weighted shares, each socket gets a number of the
+	 * RPC slots proportional to its weight (and hence a proportional
+	 * share of the incoming bandwidth, since each granted RPC gets
+	 * about the same window), chosen SRPT among that socket's RPCs.
+	 * If some sockets can't use all of their slots, the leftovers are
+	 * filled SRPT from the RPCs that were skipped, so no bandwidth is
+	 * wasted.
 	 */
-	struct homa_peer *peers[MAX_GRANTS];
-	int rpc_count[MAX_GRANTS];
-	int num_peers = 0;
-
-	list_for_each_entry_safe(rpc, temp, &homa->grantable_rpcs,
-			grantable_links) {
-		/* Keep track of how many RPCs we have seen from each
-		 * distinct peer.
-		 */
-		int i;
-		for (i = 0; i < num_peers; i++) {
-			if (peers[i] == rpc->peer) {
-				rpc_count[i]++;
-				if (rpc_count[i] > homa->max_rpcs_per_peer)
-					goto next_rpc;
-				goto peer_count_done;
-			}
-		}
-		peers[num_peers] = rpc->peer;
-		rpc_count[num_peers] = 1;
-		num_peers++;
-
-    peer_count_done:
-		rpcs[num_rpcs] = rpc;
-		num_rpcs++;
-		if (num_rpcs >= max_rpcs)
-			break;
-    next_rpc:
-		continue;
-	}
+	homa->grant_pass++;
+	num_rpcs = homa_choose_pass(homa, rpcs, 0, max_rpcs, &limited, 0);
+	if (limited && (num_rpcs < max_rpcs))
+		num_rpcs = homa_choose_pass(homa, rpcs, num_rpcs, max_rpcs,
+				NULL, 1);
 	return num_rpcs;
 }
 
@@ -1145,8 +1626,8 @@ int homa_create_grants(struct homa *homa, struct homa_rpc **rpcs,
 	    window = homa->max_incoming/(num_rpcs+1);
 
 	for (rank = 0; rank < num_rpcs; rank++) {
-		int extra_levels, priority;
-		int received, new_grant, increment;
+		int extra_levels, priority, cong_level;
+		int received, new_grant, increment, rpc_window;
 		struct grant_header *grant;
 		struct homa_rpc *rpc = rpcs[rank];
 
@@ -1164,9 +1645,27 @@ int homa_create_grants(struct homa *homa, struct homa_rpc **rpcs,
 		/* Compute how many bytes of additional grants (increment)
 		 * to give this RPC.
 		 */
-		new_grant = received + window;
+		rpc_window = homa_peer_rtt_bytes(homa, rpc->peer, window);
+		cong_level = homa_peer_cong_level(homa, rpc->peer);
+		new_grant = received + (rpc_window >> cong_level);
 		if (new_grant > rpc->msgin.length)
 			new_grant = rpc->msgin.length;
+		if (cong_level) {
+			int full_grant = received + rpc_window;
+			int counted = max3(new_grant, rpc->msgin.granted,
+					rpc->msgin.cong_counted);
+
+			/* Count only bytes that earlier calls haven't
+			 * already counted as withheld.
+			 */
+			if (full_grant > rpc->msgin.length)
+				full_grant = rpc->msgin.length;
+			if (full_grant > counted) {
+				INC_METRIC(cong_limited_bytes,
+						full_grant - counted);
+				rpc->msgin.cong_counted = full_grant;
+			}
+		}
 		increment = new_grant - rpc->msgin.granted;
 		if (increment <= 0)
 			continue;
@@ -1187,6 +1686,7 @@ int homa_create_grants(struct homa *homa, struct homa_rpc **rpcs,
 
 		/* Create a grant for this message. */
 		rpc->msgin.granted = new_grant;
+		rpc->hsk->granted_bytes += increment;
 		granted_bytes += increment;
 		available -= increment;
 		atomic_inc(&rpc->grants_in_progress);
@@ -1205,8 +1705,12 @@ int homa_create_grants(struct homa *homa, struct homa_rpc **rpcs,
 			priority -= extra_levels;
 		if (priority < 0)
 			priority = 0;
+		if (unlikely(rcu_access_pointer(homa->policy)))
+			priority = homa_policy_grant_priority(homa, rpc, rank,
+					priority);
 		grant->priority = priority;
-		tt_record4("sending grant for id %llu, offset %d, priority %d, "
+		tt_record_cat4(TT_GRANT,
+				"sending grant for id %llu, offset %d, priority %d, "
 				"increment %d",
 				rpc->id, new_grant, priority, increment);
 		if (new_grant == rpc->msgin.length)
@@ -1233,32 +1737,39 @@ int homa_create_grants(struct homa *homa, struct homa_rpc **rpcs,
 struct homa_rpc *homa_choose_fifo_grant(struct homa *homa)
 {
 	struct homa_rpc *rpc, *oldest;
-	__u64 oldest_birth;
-	int granted;
+	struct homa_peer *peer;
+	__u64 oldest_key, key;
+	int custom, granted;
 
 	oldest = NULL;
-	oldest_birth = ~0;
+	oldest_key = ~0;
+	custom = rcu_access_pointer(homa->policy) != NULL;
 
 	/* Find the oldest message that doesn't currently have an
 	 * outstanding "pity grant".
 	 */
-	list_for_each_entry(rpc, &homa->grantable_rpcs, grantable_links) {
-		int received, on_the_way;
+	list_for_each_entry(peer, &homa->grantable_peers, grantable_links) {
+		list_for_each_entry(rpc, &peer->grantable_rpcs,
+				grantable_links) {
+			int received, on_the_way;
 
-		if (rpc->msgin.birth >= oldest_birth)
-			continue;
+			key = unlikely(custom) ? homa_policy_fifo_key(homa, rpc)
+					: rpc->msgin.birth;
+			if (key >= oldest_key)
+				continue;
 
-		received = (rpc->msgin.length
-				- rpc->msgin.bytes_remaining);
-		on_the_way = rpc->msgin.granted - received;
-		if (on_the_way > homa->unsched_bytes) {
-			/* The last "pity" grant hasn't been used
-			 * up yet.
-			 */
-			continue;
+			received = (rpc->msgin.length
+					- rpc->msgin.bytes_remaining);
+			on_the_way = rpc->msgin.granted - received;
+			if (on_the_way > homa->unsched_bytes) {
+				/* The last "pity" grant hasn't been used
+				 * up yet.
+				 */
+				continue;
+			}
+			oldest = rpc;
+			oldest_key = key;
 		}
-		oldest = rpc;
-		oldest_birth = rpc->msgin.birth;
 	}
 	if (oldest == NULL)
 		return NULL;
@@ -1275,6 +1786,7 @@ struct homa_rpc *homa_choose_fifo_grant(struct homa *homa)
 		oldest->msgin.granted = oldest->msgin.length;
 		homa_remove_grantable_locked(homa, oldest);
 	}
+	oldest->hsk->granted_bytes += granted;
 	atomic_add(granted, &homa->total_incoming);
 
 	if (oldest->msgin.granted < (oldest->msgin.length
@@ -1296,24 +1808,33 @@ struct homa_rpc *homa_choose_fifo_grant(struct homa *homa)
  * hold the lock.
  * @homa:    Overall data about the Homa protocol implementation.
  * @rpc:     RPC that is no longer grantable. Must be locked, and must
- *           currently be linked into homa->grantable_rpcs.
+ *           currently be linked into its peer's grantable_rpcs.
  */
 void homa_remove_grantable_locked(struct homa *homa, struct homa_rpc *rpc)
 {
+	struct homa_peer *peer = rpc->peer;
+	int was_first = (rpc == homa_peer_first_grantable(peer));
 	__u64 time = get_cycles();
+
 	INC_METRIC(grantable_rpcs_integral, homa->num_grantable_rpcs
 			* (time - homa->last_grantable_change));
 	homa->last_grantable_change = time;
+	homa_record_latency(HOMA_LAT_GRANTABLE, rpc->msgin.length,
+			time - rpc->msgin.birth);
 	list_del_init(&rpc->grantable_links);
+	if (was_first)
+		homa_adjust_grantable_peer(homa, peer);
 	homa->num_grantable_rpcs--;
-	tt_record1("decremented num_grantable_rpcs to %d",
+	if (--rpc->hsk->num_grantable == 0)
+		homa->grantable_weight -= rpc->hsk->weight;
+	tt_record_cat1(TT_GRANT, "decremented num_grantable_rpcs to %d",
 			homa->num_grantable_rpcs);
 }
 
 /**
  * homa_remove_from_grantable() - This method ensures that an RPC
  * is no longer linked into peer->grantable_rpcs (i.e. it won't be
- * visible to homa_manage_grants).
+ * visible to homa_send_grants).
  * @homa:    Overall data about the Homa protocol implementation.
  * @rpc:     RPC that is being destroyed. Must be locked.
  */
@@ -1321,7 +1842,7 @@ void homa_remove_from_grantable(struct homa *homa, struct homa_rpc *rpc)
 {
 	UNIT_LOG("; ", "homa_remove_from_grantable invoked");
 	/* In order to determine for sure whether an RPC is in the
-	 * grantable_rpcs we would need to acquire homa_grantable_lock,
+	 * grantable list we would need to acquire homa_grantable_lock,
 	 * which is expensive because it's global. Howevever, we can
 	 * check whether the RPC is queued without acquiring the lock,
 	 * and if it's not, then we don't need to acquire the lock (the
@@ -1350,18 +1871,22 @@ void homa_remove_from_grantable(struct homa *homa, struct homa_rpc *rpc)
 void homa_log_grantable_list(struct homa *homa)
 {
 	int count;
-	struct homa_rpc *rpc, *temp;
+	struct homa_peer *peer;
+	struct homa_rpc *rpc;
 
 	printk(KERN_NOTICE "Logging Homa grantable_rpcs list\n");
 	homa_grantable_lock(homa);
 	count = 0;
-	list_for_each_entry_safe(rpc, temp, &homa->grantable_rpcs,
-			grantable_links) {
-		homa_rpc_log(rpc);
-		count++;
-		if (count > 100)
-			break;
+	list_for_each_entry(peer, &homa->grantable_peers, grantable_links) {
+		list_for_each_entry(rpc, &peer->grantable_rpcs,
+				grantable_links) {
+			homa_rpc_log(rpc);
+			count++;
+			if (count > 100)
+				goto done;
+		}
 	}
+    done:
 	homa_grantable_unlock(homa);
 	printk(KERN_NOTICE "Finished logging Homa grantable_rpcs list\n");
 }
@@ -1394,27 +1919,76 @@ void homa_rpc_abort(struct homa_rpc *crpc, int error)
 void homa_abort_rpcs(struct homa *homa, const struct in6_addr *addr,
 		int port, int error)
 {
-	struct homa_socktab_scan scan;
-	struct homa_sock *hsk;
-	struct homa_rpc *rpc, *tmp;
+	struct homa_peer *peer;
+
+	/* If there is no peer for @addr then there are no RPCs for it. */
+	peer = homa_peer_lookup(&homa->peers, addr);
+	if (!peer)
+		return;
+	homa_abort_peer_rpcs(peer, port, error);
+	homa_peer_put(peer);
+}
 
+/**
+ * homa_abort_peer_rpcs() - Abort all of the RPCs to/from a particular peer,
+ * using @peer->rpcs so that only that peer's RPCs are examined.
+ * @peer:    Peer whose RPCs are to be aborted; the caller must hold a
+ *           reference to it.
+ * @port:    If nonzero, then RPCs will only be aborted if they were
+ *	     targeted at this server port.
+ * @error:   Negative errno value indicating the reason for the abort.
+ */
+void homa_abort_peer_rpcs(struct homa_peer *peer, int port, int error)
+{
+	/* RPCs can't be locked while holding peer->rpcs_lock, so RPCs are
+	 * identified in batches under that lock, then looked up again
+	 * (which locks them) once it has been released.
+	 */
+	struct {
+		struct homa_sock *hsk;
+		__u64 id;
+		__u16 dport;
+	} batch[HOMA_ABORT_BATCH];
+	struct homa_rpc *rpc;
+	int remaining, num, i;
+
+	/* Each RPC that has been examined is moved to the end of
+	 * peer->rpcs, so the scan ends after num_rpcs entries, even though
+	 * aborted client RPCs stay in the list (and new RPCs may be added).
+	 */
 	rcu_read_lock();
-	for (hsk = homa_socktab_start_scan(&homa->port_map, &scan);
-			hsk !=  NULL; hsk = homa_socktab_next(&scan)) {
-		/* Skip the (expensive) lock acquisition if there's no
-		 * work to do.
-		 */
-		if (list_empty(&hsk->active_rpcs))
-			continue;
-		if (!homa_protect_rpcs(hsk))
-			continue;
-		list_for_each_entry_safe(rpc, tmp, &hsk->active_rpcs,
-				active_links) {
-			if (!ipv6_addr_equal(&rpc->peer->addr, addr))
-				continue;
+	remaining = READ_ONCE(peer->num_rpcs);
+	while (remaining > 0) {
+		num = 0;
+		spin_lock_bh(&peer->rpcs_lock);
+		while ((remaining > 0) && (num < HOMA_ABORT_BATCH)) {
+			if (list_empty(&peer->rpcs)) {
+				remaining = 0;
+				break;
+			}
+			rpc = list_first_entry(&peer->rpcs, struct homa_rpc,
+					peer_links);
+			list_move_tail(&rpc->peer_links, &peer->rpcs);
+			remaining--;
 			if ((port != 0) && (rpc->dport != port))
 				continue;
-			homa_rpc_lock(rpc);
+			batch[num].hsk = rpc->hsk;
+			batch[num].id = rpc->id;
+			batch[num].dport = rpc->dport;
+			num++;
+		}
+		spin_unlock_bh(&peer->rpcs_lock);
+
+		for (i = 0; i < num; i++) {
+			if (homa_is_client(batch[i].id))
+				rpc = homa_find_client_rpc(batch[i].hsk,
+						batch[i].id);
+			else
+				rpc = homa_find_server_rpc(batch[i].hsk,
+						&peer->addr, batch[i].dport,
+						batch[i].id);
+			if (!rpc)
+				continue;
 			if (homa_is_client(rpc->id)) {
 				tt_record3("aborting client RPC: peer 0x%x, "
 						"id %u, error %d",
@@ -1431,7 +2005,6 @@ void homa_abort_rpcs(struct homa *homa, const struct in6_addr *addr,
 			}
 			homa_rpc_unlock(rpc);
 		}
-		homa_unprotect_rpcs(hsk);
 	}
 	rcu_read_unlock();
 }
@@ -1512,6 +2085,8 @@ int homa_register_interests(struct homa_interest *interest,
 			return -EINVAL;
 		}
 	}
+	if (hsk->homa->gro_policy & HOMA_GRO_STEER)
+		homa_steer_publish(hsk->homa, hsk->port, id, interest->core);
 
 	/* Need both the RPC lock (acquired above) and the socket lock to
 	 * avoid races.
@@ -1606,9 +2181,17 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 	struct homa_rpc *result = NULL;
 	struct homa_interest interest;
 	struct homa_rpc *rpc = NULL;
-	uint64_t poll_start, now;
+	uint64_t poll_start, poll_budget, now;
 	int error, blocked = 0, polled = 0;
 
+	/* Remember where this thread runs, so that buffer space for future
+	 * messages can be allocated on its NUMA node (the thread will copy
+	 * the data out).
+	 */
+	if (hsk->buffer_pool.num_nodes && (READ_ONCE(
+			hsk->buffer_pool.recv_node) != numa_node_id()))
+		WRITE_ONCE(hsk->buffer_pool.recv_node, numa_node_id());
+
 	/* Each iteration of this loop finds an RPC, but it might not be
 	 * in a state where we can return it (e.g., there might be packets
 	 * ready to transfer to user space, but the incoming message isn't yet
@@ -1659,6 +2242,7 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 		 * context-switching overhead to wake up.
 		 */
 		poll_start = now = get_cycles();
+		poll_budget = homa_poll_budget(hsk);
 		while (1) {
 			__u64 blocked;
 			rpc = (struct homa_rpc *) atomic_long_read(
@@ -1671,7 +2255,7 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 				INC_METRIC(poll_cycles, now - poll_start);
 				goto found_rpc;
 			}
-			if (now >= (poll_start + hsk->homa->poll_cycles))
+			if (now >= (poll_start + poll_budget))
 				break;
 			blocked = get_cycles();
 			schedule();
@@ -1701,6 +2285,8 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 			schedule();
 			end = get_cycles();
 			blocked = 1;
+			if (hsk->homa->adaptive_poll)
+				WRITE_ONCE(hsk->poll_rearm, 1);
 			INC_METRIC(blocked_cycles, end - start);
 		}
 		__set_current_state(TASK_RUNNING);
@@ -1747,13 +2333,32 @@ found_rpc:
 				homa_rpc_unlock(rpc);
 				continue;
 			}
-			if (!rpc->error)
+			now = get_cycles();
+			if (!rpc->error) {
 				rpc->error = homa_copy_to_user(rpc);
+				rpc->cold->copy_cycles += get_cycles() - now;
+			}
 			if (rpc->error)
 				goto done;
 			atomic_andnot(RPC_PKTS_READY, &rpc->flags);
 			if ((rpc->msgin.bytes_remaining == 0)
-					&& (!skb_queue_len(&rpc->msgin.packets)))
+					&& (!skb_queue_len(&rpc->msgin.packets))) {
+				/* handoff_cycles is 0 if homa_rpc_handoff
+				 * was never invoked for this RPC.
+				 */
+				if (rpc->cold->handoff_cycles)
+					homa_record_latency(HOMA_LAT_HANDOFF,
+							rpc->msgin.length, now
+							- rpc->cold
+							->handoff_cycles);
+				homa_record_latency(HOMA_LAT_COPY_OUT,
+						rpc->msgin.length,
+						rpc->cold->copy_cycles);
+				goto done;
+			}
+			if ((flags & HOMA_RECVMSG_STREAM)
+					&& (homa_stream_end(rpc)
+					> rpc->msgin.stream_offset))
 				goto done;
 			homa_rpc_unlock(rpc);
 		}
@@ -1784,32 +2389,110 @@ done:
  *		 hsk->request_interests or hsk->response_interests.
  * @offset:      Offset of "next" pointers in the list elements (either
  *               offsetof(request_links) or offsetof(response_links).
+ * @peer:        Peer that sent the incoming message, or NULL if not known.
  * Return:       An interest to use for the incoming message, or NULL if none
  *               is available. If possible, this function tries to pick an
  *               interest whose thread is running on a core that isn't
- *               currently busy doing Homa transport work.
+ *               currently busy doing Homa transport work. If
+ *               homa->handoff_locality is set, it also prefers (in order)
+ *               the thread that received @peer's previous message and
+ *               threads on the current core's NUMA node.
  */
 struct homa_interest *homa_choose_interest(struct homa *homa,
-		struct list_head *head, int offset)
+		struct list_head *head, int offset, struct homa_peer *peer)
 {
-	struct homa_interest *backup = NULL;
+	struct homa_interest *first = NULL;
+	struct homa_interest *idle = NULL;
+	struct homa_interest *local = NULL;
 	struct list_head *pos;
-	struct homa_interest *interest;
+	struct homa_interest *interest, *result;
 	__u64 busy_time = get_cycles() - homa->busy_cycles;
+	int node = homa_cores[raw_smp_processor_id()]->numa_node;
+	int sticky_core = -1;
+
+	if (homa->handoff_locality && peer)
+		sticky_core = READ_ONCE(peer->handoff_core);
 
 	list_for_each(pos, head) {
 		interest = (struct homa_interest *) (((char *) pos) - offset);
-		if (homa_cores[interest->core]->last_active < busy_time) {
-			if (backup != NULL)
-				INC_METRIC(handoffs_alt_thread, 1);
-			return interest;
+		if (first == NULL)
+			first = interest;
+		if (homa_cores[interest->core]->last_active >= busy_time)
+			continue;
+		if (!homa->handoff_locality) {
+			idle = interest;
+			break;
 		}
-		if (backup == NULL)
-			backup = interest;
+		if (interest->core == sticky_core) {
+			INC_METRIC(handoffs_sticky, 1);
+			local = interest;
+			break;
+		}
+		if ((local == NULL)
+				&& (homa_cores[interest->core]->numa_node == node))
+			local = interest;
+		if (idle == NULL)
+			idle = interest;
 	}
 
-	/* All interested threads are on busy cores; return the first. */
-	return backup;
+	/* If all interested threads are on busy cores, return the first. */
+	result = local ? local : (idle ? idle : first);
+	if (result != first)
+		INC_METRIC(handoffs_alt_thread, 1);
+	return result;
+}
+
+/**
+ * homa_poll_record_arrival() - Update a socket's estimate of the interval
+ * between incoming messages, which is used for adaptive polling.
+ * @hsk:    Socket on which a message has just become ready; must be locked
+ *          by the caller.
+ * @now:    Current time, in get_cycles() units.
+ */
+void homa_poll_record_arrival(struct homa_sock *hsk, __u64 now)
+{
+	if (hsk->last_arrival != 0) {
+		__u64 gap = now - hsk->last_arrival;
+		__u64 avg = hsk->avg_interarrival;
+
+		/* New samples get a weight of 1/8. */
+		if (avg == 0)
+			avg = gap;
+		else
+			avg = avg - (avg >> 3) + (gap >> 3);
+		WRITE_ONCE(hsk->avg_interarrival, avg);
+	}
+	hsk->last_arrival = now;
+}
+
+/**
+ * homa_poll_budget() - Compute how long homa_wait_for_message should
+ * busy-wait for a message on a given socket before going to sleep.
+ * @hsk:    Socket on which a thread is about to wait.
+ *
+ * Return:  Polling time, in get_cycles() units.
+ */
+__u64 homa_poll_budget(struct homa_sock *hsk)
+{
+	struct homa *homa = hsk->homa;
+	__u64 avg;
+
+	if (!homa->adaptive_poll)
+		return homa->poll_cycles;
+	if (READ_ONCE(hsk->poll_rearm)) {
+		WRITE_ONCE(hsk->poll_rearm, 0);
+		return homa->poll_cycles;
+	}
+	avg = READ_ONCE(hsk->avg_interarrival);
+	if (avg == 0)
+		return homa->poll_cycles;
+	if (avg > homa->poll_cycles) {
+		INC_METRIC(poll_skips, 1);
+		return 0;
+	}
+	if (2*avg < homa->poll_cycles)
+		return 2*avg;
+	return homa->poll_cycles;
 }
 
 /**
@@ -1827,6 +2510,8 @@ void homa_rpc_handoff(struct homa_rpc *rpc)
 	if ((atomic_read(&rpc->flags) & RPC_HANDING_OFF)
 			|| !list_empty(&rpc->ready_links))
 		return;
+	rpc->cold->handoff_cycles = get_cycles();
+	homa_poll_record_arrival(hsk, rpc->cold->handoff_cycles);
 
 	/* First, see if someone is interested in this RPC specifically.
 	 */
@@ -1839,7 +2524,8 @@ void homa_rpc_handoff(struct homa_rpc *rpc)
 	if (homa_is_client(rpc->id)) {
 		interest = homa_choose_interest(hsk->homa,
 				&hsk->response_interests,
-				offsetof(struct homa_interest, response_links));
+				offsetof(struct homa_interest, response_links),
+				rpc->peer);
 		if (interest)
 			goto thread_waiting;
 		list_add_tail(&rpc->ready_links, &hsk->ready_responses);
@@ -1847,7 +2533,8 @@ void homa_rpc_handoff(struct homa_rpc *rpc)
 	} else {
 		interest = homa_choose_interest(hsk->homa,
 				&hsk->request_interests,
-				offsetof(struct homa_interest, request_links));
+				offsetof(struct homa_interest, request_links),
+				rpc->peer);
 		if (interest)
 			goto thread_waiting;
 		list_add_tail(&rpc->ready_links, &hsk->ready_requests);
@@ -1860,6 +2547,8 @@ void homa_rpc_handoff(struct homa_rpc *rpc)
 
 	/* Notify the poll mechanism. */
 	hsk->sock.sk_data_ready(&hsk->sock);
+	if (hsk->ring)
+		homa_ring_wake(hsk->ring);
 	tt_record2("homa_rpc_handoff finished queuing id %d for port %d",
 			rpc->id, hsk->port);
 	return;
@@ -1882,6 +2571,11 @@ thread_waiting:
 	 * will try to avoid doing any work there.
 	 */
 	homa_cores[interest->core]->last_app_active = get_cycles();
+	if (homa_cores[interest->core]->numa_node
+			!= homa_cores[raw_smp_processor_id()]->numa_node)
+		INC_METRIC(handoffs_cross_node, 1);
+	if (hsk->homa->handoff_locality)
+		WRITE_ONCE(rpc->peer->handoff_core, interest->core);
 
 	/* Clear the interest. This serves two purposes. First, it saves
 	 * the waking thread from acquiring the socket lock again, which
@@ -1919,6 +2613,13 @@ void homa_incoming_sysctl_changed(struct homa *homa)
 	if (homa->max_overcommit > MAX_GRANTS)
 		homa->max_overcommit = MAX_GRANTS;
 
+	if (homa->num_timer_shards < 1)
+		homa->num_timer_shards = 1;
+	if (homa->num_timer_shards > HOMA_MAX_TIMER_SHARDS)
+		homa->num_timer_shards = HOMA_MAX_TIMER_SHARDS;
+	if (homa->num_timer_shards != homa->active_timer_shards)
+		homa_timer_shards_start(homa);
+
 	/* Code below is written carefully to avoid integer underflow or
 	 * overflow under expected usage patterns. Be careful when changing!
 	 */
@@ -1934,7 +2635,15 @@ void homa_incoming_sysctl_changed(struct homa *homa)
 	tmp = (tmp*cpu_khz)/1000;
 	homa->gro_busy_cycles = tmp;
 
+	tmp = homa->softirq_load_usecs;
+	tmp = (tmp*cpu_khz)/1000;
+	homa->softirq_load_cycles = tmp;
+
 	tmp = homa->bpage_lease_usecs;
 	tmp = (tmp*cpu_khz)/1000;
 	homa->bpage_lease_cycles = tmp;
+
+	tmp = homa->ack_flush_usecs;
+	tmp = (tmp*cpu_khz)/1000;
+	homa->ack_flush_cycles = tmp;
 }
@@ -21,6 +21,14 @@
 
 #define CORES_TO_CHECK 4
 
+/* Used by homa_gro_adaptive to bias core selection, in the same units as
+ * homa_core->softirq_load: each batch already queued on a core counts
+ * as this much extra load, and so does a recently active application
+ * thread.
+ */
+#define ADAPTIVE_BACKLOG_LOAD 250
+#define ADAPTIVE_APP_LOAD 500
+
 static const struct net_offload homa_offload = {
 	.callbacks = {
 		.gso_segment	=	homa_gso_segment,
@@ -95,6 +103,7 @@ struct sk_buff *homa_gso_segment(struct sk_buff *skb,
 	struct sk_buff *segs;
 	tt_record2("homa_gso_segment invoked, frags %d, headlen %d",
 			skb_shinfo(skb)->nr_frags, skb_headlen(skb));
+	INC_METRIC(gso_software_skbs, 1);
 
 	/* This is needed to separate header info (which is replicated
 	 * in each segment) from data, which is divided among the segments.
@@ -119,6 +128,243 @@ struct sk_buff *homa_gso_segment(struct sk_buff *skb,
 	return segs;
 }
 
+/**
+ * homa_same_rpc() - Returns true if two incoming packets (whose headers
+ * have not yet been pulled) appear to belong to the same RPC; false if
+ * they don't, or if we can't tell without pulling.
+ * @skb1:    First packet.
+ * @skb2:    Second packet.
+ */
+static inline bool homa_same_rpc(struct sk_buff *skb1, struct sk_buff *skb2)
+{
+	struct common_header *h1, *h2;
+
+	if ((skb_tail_pointer(skb1) - skb_transport_header(skb1))
+			< sizeof(struct common_header))
+		return false;
+	if ((skb_tail_pointer(skb2) - skb_transport_header(skb2))
+			< sizeof(struct common_header))
+		return false;
+	h1 = (struct common_header *) skb_transport_header(skb1);
+	h2 = (struct common_header *) skb_transport_header(skb2);
+	if ((h1->sender_id != h2->sender_id) || (h1->sport != h2->sport))
+		return false;
+	if (skb_is_ipv6(skb1) != skb_is_ipv6(skb2))
+		return false;
+	if (skb_is_ipv6(skb1))
+		return ipv6_addr_equal(&ipv6_hdr(skb1)->saddr,
+				&ipv6_hdr(skb2)->saddr);
+	return ip_hdr(skb1)->saddr == ip_hdr(skb2)->saddr;
+}
+
+/**
+ * homa_gro_batch_init() - Reset the per-core information that describes
+ * the layout of a GRO batch.
+ * @core:       Core whose information should be reset.
+ * @held_skb:   First packet in the batch; its frag_list must be empty.
+ */
+static void homa_gro_batch_init(struct homa_core *core,
+		struct sk_buff *held_skb)
+{
+	core->gro_batch = held_skb;
+	core->gro_short_tail = NULL;
+	core->gro_groups = 0;
+	if (!homa_short_packet(held_skb))
+		core->gro_tails[core->gro_groups++] = held_skb;
+}
+
+/**
+ * homa_gro_insert() - Link a packet into the frag_list of a GRO batch.
+ * @held_skb:   First packet in the batch.
+ * @prev:       @skb will be inserted just after this packet in frag_list;
+ *              NULL means insert at the front of frag_list.
+ * @skb:        Packet to insert.
+ */
+static inline void homa_gro_insert(struct sk_buff *held_skb,
+		struct sk_buff *prev, struct sk_buff *skb)
+{
+	if (prev) {
+		skb->next = prev->next;
+		prev->next = skb;
+	} else {
+		skb->next = skb_shinfo(held_skb)->frag_list;
+		skb_shinfo(held_skb)->frag_list = skb;
+	}
+	if (!skb->next)
+		NAPI_GRO_CB(held_skb)->last = skb;
+}
+
+/**
+ * homa_gro_next_short() - Iterate over the short section of a GRO batch.
+ * @core:       Core whose information describes the batch's layout.
+ * @held_skb:   First packet in the batch.
+ * @pkt:        Either @held_skb or a packet in the short section of
+ *              @held_skb's frag_list.
+ *
+ * Return:      The packet after @pkt in the short section, or NULL if
+ *              @pkt is the last one.
+ */
+static inline struct sk_buff *homa_gro_next_short(struct homa_core *core,
+		struct sk_buff *held_skb, struct sk_buff *pkt)
+{
+	if (pkt == held_skb)
+		return core->gro_short_tail ? skb_shinfo(held_skb)->frag_list
+				: NULL;
+	return (pkt == core->gro_short_tail) ? NULL : pkt->next;
+}
+
+/**
+ * homa_gro_grant_ack() - Locate the ack piggybacked on a GRANT packet.
+ * @skb:     A GRANT packet.
+ *
+ * Return:   The packet's ack, or NULL if the packet is too short to hold
+ *           one (see HOMA_GRANT_MIN_LENGTH).
+ */
+static inline struct homa_ack *homa_gro_grant_ack(struct sk_buff *skb)
+{
+	if ((skb_tail_pointer(skb) - skb_transport_header(skb))
+			< sizeof(struct grant_header))
+		return NULL;
+	return &((struct grant_header *) skb_transport_header(skb))->ack;
+}
+
+/**
+ * homa_gro_merge_short() - Add a short packet (a control packet or a
+ * single-packet DATA message) to a GRO batch. Short packets are kept at
+ * the front of frag_list, so homa_softirq will process them before long
+ * ones; within this section they are grouped by destination port, so that
+ * homa_softirq can handle consecutive packets for a socket with a single
+ * socket lookup. GRANTs are coalesced with earlier grants for the same RPC,
+ * as long as that doesn't lose an ack.
+ * @core:       Core whose information describes the batch's layout.
+ * @held_skb:   First packet in the batch.
+ * @skb:        New packet. If this function returns true, it has
+ *              been freed: otherwise it has been linked into the batch,
+ *              but the caller must update the batch count.
+ *
+ * Return:      Nonzero means @skb was merged into an existing grant.
+ */
+static int homa_gro_merge_short(struct homa_core *core,
+		struct sk_buff *held_skb, struct sk_buff *skb)
+{
+	struct grant_header *h_new = (struct grant_header *)
+			skb_transport_header(skb);
+	struct in6_addr saddr;
+	struct sk_buff *pkt, *prev = NULL;
+	struct homa_ack *new_ack = NULL;
+
+	if (h_new->common.type == GRANT) {
+		new_ack = homa_gro_grant_ack(skb);
+		if (new_ack && !new_ack->client_id)
+			new_ack = NULL;
+	}
+
+	/* Only the short section of the batch (plus held_skb) needs to
+	 * be scanned: long packets never need to be examined here.
+	 */
+	for (pkt = held_skb; pkt != NULL;
+			pkt = homa_gro_next_short(core, held_skb, pkt)) {
+		struct grant_header *h = (struct grant_header *)
+				skb_transport_header(pkt);
+		struct in6_addr pkt_saddr;
+
+		if (h->common.dport != h_new->common.dport)
+			continue;
+		prev = pkt;
+		if ((h_new->common.type != GRANT) || (h->common.type != GRANT)
+				|| (h->common.sender_id
+				!= h_new->common.sender_id)
+				|| (h->common.sport != h_new->common.sport))
+			continue;
+		saddr = skb_canonical_ipv6_saddr(skb);
+		pkt_saddr = skb_canonical_ipv6_saddr(pkt);
+		if (!ipv6_addr_equal(&pkt_saddr, &saddr))
+			continue;
+
+		/* The sender has already removed the new grant's ack from
+		 * its list of acks to send, so the ack must survive the
+		 * merge: move it into the earlier grant if that has room,
+		 * otherwise don't merge.
+		 */
+		if (new_ack) {
+			struct homa_ack *ack = homa_gro_grant_ack(pkt);
+
+			if (!ack || ack->client_id)
+				continue;
+			*ack = *new_ack;
+		}
+
+		/* Grants are cumulative, so the earlier grant can simply
+		 * be updated to reflect the newer one.
+		 */
+		if (ntohl(h_new->offset) > ntohl(h->offset))
+			h->offset = h_new->offset;
+		h->priority = h_new->priority;
+		h->resend_all |= h_new->resend_all;
+		tt_record_cat3(TT_GRO,
+				"homa_gro_receive merged grant for id %llu, "
+				"offset %d, priority %d",
+				homa_local_id(h->common.sender_id),
+				ntohl(h->offset), h->priority);
+		kfree_skb(skb);
+		return 1;
+	}
+
+	/* Placing skb after the last packet for the same port preserves
+	 * the order of packets for each RPC. If there is no such packet,
+	 * skb goes at the end of the short section.
+	 */
+	if (prev == NULL)
+		prev = core->gro_short_tail;
+	else if (prev == held_skb)
+		prev = NULL;
+	homa_gro_insert(held_skb, prev, skb);
+	if (prev == core->gro_short_tail)
+		core->gro_short_tail = skb;
+	return 0;
+}
+
+/**
+ * homa_gro_merge_long() - Add a DATA packet that is not a complete
+ * message to a GRO batch. The packet is placed after the last packet
+ * for the same RPC (if any), so homa_softirq can process all of an RPC's
+ * packets under a single acquisition of its lock. Only the first
+ * HOMA_SOFTIRQ_GROUPS RPCs in a batch are grouped; packets for other
+ * RPCs are simply appended.
+ * @core:       Core whose information describes the batch's layout.
+ * @held_skb:   First packet in the batch.
+ * @skb:        New packet; it will be linked into the batch, but the
+ *              caller must update the batch count.
+ */
+static void homa_gro_merge_long(struct homa_core *core,
+		struct sk_buff *held_skb, struct sk_buff *skb)
+{
+	struct sk_buff *prev;
+	int i;
+
+	for (i = 0; i < core->gro_groups; i++) {
+		if (homa_same_rpc(core->gro_tails[i], skb))
+			break;
+	}
+	if (i < core->gro_groups) {
+		prev = core->gro_tails[i];
+		core->gro_tails[i] = skb;
+
+		/* homa_softirq processes held_skb just after the short
+		 * section, so its RPC's group starts there.
+		 */
+		if (prev == held_skb)
+			prev = core->gro_short_tail;
+	} else {
+		prev = NAPI_GRO_CB(held_skb)->last;
+		if (prev == held_skb)
+			prev = NULL;
+		if (core->gro_groups < HOMA_SOFTIRQ_GROUPS)
+			core->gro_tails[core->gro_groups++] = skb;
+	}
+	homa_gro_insert(held_skb, prev, skb);
+}
+
 /**
  * homa_gro_receive() - Invoked for each input packet at a very low
  * level in the stack to perform GRO. However, this code does GRO in an
@@ -174,7 +420,7 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 //		tt_record("homa_gro_receive can't pull enough data "
 //				"from packet for trace");
 	if (h_new->common.type == DATA) {
-		tt_record4("homa_gro_receive got packet from 0x%x "
+		tt_record_cat4(TT_GRO, "homa_gro_receive got packet from 0x%x "
 				"id %llu, offset %d, priority %d",
 				saddr, homa_local_id(h_new->common.sender_id),
 				ntohl(h_new->seg.offset), priority);
@@ -185,7 +431,7 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 			goto bypass;
 		}
 	} else if (h_new->common.type == GRANT) {
-		tt_record4("homa_gro_receive got grant from 0x%x "
+		tt_record_cat4(TT_GRO, "homa_gro_receive got grant from 0x%x "
 				"id %llu, offset %d, priority %d",
 				saddr, homa_local_id(h_new->common.sender_id),
 				ntohl(((struct grant_header *) h_new)->offset),
@@ -200,11 +446,12 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 			INC_METRIC(gro_grant_bypasses, 1);
 			goto bypass;
 		}
-	} else
+	} else if (tt_enabled(TT_GRO)) {
 		tt_record4("homa_gro_receive got packet from 0x%x "
 				"id %llu, type 0x%x, priority %d",
 				saddr, homa_local_id(h_new->common.sender_id),
 				h_new->common.type, priority);
+	}
 
 	/* The GRO mechanism tries to separate packets onto different
 	 * gro_lists by hash. This is bad for us, because we want to batch
@@ -230,14 +477,20 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 
 			/* Aggregate skb into held_skb. We don't update the
 			 * length of held_skb because we'll eventually split
-			 * it up and process each skb independently.
+			 * it up and process each skb independently. The
+			 * packets are sorted as they are merged, so that
+			 * homa_softirq can process them in a single pass.
 			 */
-			if (NAPI_GRO_CB(held_skb)->last == held_skb)
-				skb_shinfo(held_skb)->frag_list = skb;
-			else
-				NAPI_GRO_CB(held_skb)->last->next = skb;
-			NAPI_GRO_CB(held_skb)->last = skb;
-			skb->next = NULL;
+			if (core->gro_batch != held_skb)
+				homa_gro_batch_init(core, held_skb);
+			if (homa_short_packet(skb)) {
+				if (homa_gro_merge_short(core, held_skb, skb)) {
+					INC_METRIC(gro_grant_merges, 1);
+					result = ERR_PTR(-EINPROGRESS);
+					goto done;
+				}
+			} else
+				homa_gro_merge_long(core, held_skb, skb);
 			NAPI_GRO_CB(skb)->same_flow = 1;
 			NAPI_GRO_CB(held_skb)->count++;
 			if (NAPI_GRO_CB(held_skb)->count >= homa->max_gro_skbs) {
@@ -273,6 +526,14 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 	 */
 	core->held_skb = skb;
 	core->held_bucket = hash;
+	core->gro_batch = NULL;
+	if (homa->gro_policy & HOMA_GRO_STEER) {
+		int steer_core = homa_gro_steer(&h_new->common);
+		if (steer_core >= 0) {
+			homa_set_softirq_cpu(skb, steer_core);
+			goto done;
+		}
+	}
 	if (likely(homa->gro_policy & HOMA_GRO_SAME_CORE))
 		homa_set_softirq_cpu(skb, raw_smp_processor_id());
 
@@ -328,7 +589,7 @@ void homa_gro_gen2(struct sk_buff *skb)
 			continue;
 		if ((core->last_gro + homa->busy_cycles) > now)
 			continue;
-		tt_record3("homa_gro_gen2 chose core %d for id %d "
+		tt_record_cat3(TT_GRO, "homa_gro_gen2 chose core %d for id %d "
 				"offset %d",
 				candidate, homa_local_id(h->common.sender_id),
 				ntohl(h->seg.offset));
@@ -347,7 +608,7 @@ void homa_gro_gen2(struct sk_buff *skb)
 		while (candidate >= nr_cpu_ids) {
 			candidate -= nr_cpu_ids;
 		}
-		tt_record3("homa_gro_gen2 chose core %d for id %d "
+		tt_record_cat3(TT_GRO, "homa_gro_gen2 chose core %d for id %d "
 				"offset %d (all cores busy)",
 				candidate, homa_local_id(h->common.sender_id),
 				ntohl(h->seg.offset));
@@ -390,7 +651,8 @@ void homa_gro_gen3(struct sk_buff *skb)
 	}
 	homa_set_softirq_cpu(skb, core);
 	homa_cores[core]->last_active = now;
-	tt_record4("homa_gro_gen3 chose core %d for id %d, offset %d, delta %d",
+	tt_record_cat4(TT_GRO,
+			"homa_gro_gen3 chose core %d for id %d, offset %d, delta %d",
 			core, homa_local_id(h->common.sender_id),
 			ntohl(h->seg.offset),
 			now - homa_cores[core]->last_app_active);
@@ -399,6 +661,164 @@ void homa_gro_gen3(struct sk_buff *skb)
 		INC_METRIC(gen3_alt_handoffs, 1);
 }
 
+/**
+ * homa_gro_steer() - When HOMA_GRO_STEER is set, this function is invoked
+ * to see whether SoftIRQ processing for a packet should be steered toward
+ * the thread that will receive it, so that the packet's data stays in
+ * caches close to that thread.
+ * @h:       Header of the packet (or the first packet in a batch).
+ *
+ * Return:   The core on which SoftIRQ processing should occur, or -1 if
+ *           there is no good choice (the caller should then fall back on
+ *           its usual policy).
+ */
+int homa_gro_steer(struct common_header *h)
+{
+	__u16 port = ntohs(h->dport);
+	__u64 busy_time = get_cycles() - homa->busy_cycles;
+	int *candidates;
+	int i, core;
+
+	core = READ_ONCE(homa->steer_cores[homa_steer_slot(port,
+			homa_local_id(h->sender_id))]);
+	if (core < 0)
+		core = READ_ONCE(homa->steer_cores[homa_steer_slot(port, 0)]);
+	if ((core < 0) || (core >= nr_cpu_ids))
+		return -1;
+
+	/* The receiving thread's core is the best choice, unless an
+	 * application is using it; if so, try the cores that share its
+	 * cache (the same cores Gen3 would use for it, which are
+	 * hyperthread siblings by default).
+	 */
+	if (homa_cores[core]->last_app_active < busy_time)
+		goto chosen;
+	candidates = homa_cores[core]->gen3_softirq_cores;
+	for (i = 0; i < NUM_GEN3_SOFTIRQ_CORES; i++) {
+		int candidate = candidates[i];
+		if ((candidate < 0) || (candidate >= nr_cpu_ids))
+			break;
+		if (homa_cores[candidate]->last_app_active < busy_time) {
+			core = candidate;
+			goto chosen;
+		}
+	}
+	return -1;
+
+    chosen:
+	tt_record_cat3(TT_GRO,
+			"homa_gro_steer chose core %d for id %d, port %d",
+			core, homa_local_id(h->sender_id), port);
+	INC_METRIC(gro_steered, 1);
+	return core;
+}
+
+/**
+ * homa_gro_adaptive() - When the adaptive load balancer is being used this
+ * function is invoked by homa_gro_complete to choose a core to handle
+ * SoftIRQ for a batch of packets.
+ * @skb:     First in a group of packets that are ready to be passed to SoftIRQ.
+ *           Information will be updated in the packet so that Linux will
+ *           direct it to the chosen core.
+ */
+void homa_gro_adaptive(struct sk_buff *skb)
+{
+	/* Consider the next CORES_TO_CHECK cores on this core's NUMA node,
+	 * and choose the one with the lowest load. Load combines the
+	 * moving average of SoftIRQ time with penalties for queued batches
+	 * and for application activity, so that cores consumed by
+	 * application threads (or by a busy RSS queue) are avoided even
+	 * when Homa's own SoftIRQ work on them is light.
+	 */
+	struct data_header *h = (struct data_header *) skb_transport_header(skb);
+	int this_core = raw_smp_processor_id();
+	int node = homa_cores[this_core]->numa_node;
+	__u64 now = get_cycles();
+	int candidate = this_core;
+	int best = this_core;
+	int best_load = INT_MAX;
+	int checked = 0;
+	int i;
+
+	for (i = 1; (i < nr_cpu_ids) && (checked < CORES_TO_CHECK); i++) {
+		struct homa_core *core;
+		int load;
+
+		candidate++;
+		if (unlikely(candidate >= nr_cpu_ids))
+			candidate = 0;
+		core = homa_cores[candidate];
+		if (core->numa_node != node)
+			continue;
+		checked++;
+		load = homa_softirq_load(core, now) + ADAPTIVE_BACKLOG_LOAD
+				* atomic_read(&core->softirq_backlog);
+		if ((core->last_app_active + homa->busy_cycles) > now)
+			load += ADAPTIVE_APP_LOAD;
+		if (load < best_load) {
+			best_load = load;
+			best = candidate;
+		}
+	}
+	tt_record_cat4(TT_GRO,
+			"homa_gro_adaptive chose core %d for id %d, offset %d, "
+			"load %d", best, homa_local_id(h->common.sender_id),
+			ntohl(h->seg.offset), best_load);
+	atomic_inc(&homa_cores[best]->softirq_backlog);
+	homa_set_softirq_cpu(skb, best);
+}
+
+/**
+ * homa_softirq_load() - Return the recent SoftIRQ load on a core.
+ * @core:    Core whose load is desired.
+ * @now:     Current time, in get_cycles() units.
+ *
+ * Return:   The fraction of time that @core has recently spent in
+ *           homa_softirq, in thousandths.
+ */
+int homa_softirq_load(struct homa_core *core, __u64 now)
+{
+	__u64 elapsed = now - core->softirq_load_start;
+	__u64 load;
+
+	/* The moving average is only updated when homa_softirq runs on
+	 * the core, so if the core has gone quiet for a while the
+	 * average is stale; use the (low) load in the partial interval
+	 * instead.
+	 */
+	if ((elapsed == 0) || (elapsed < 2*(__u64) homa->softirq_load_cycles))
+		return core->softirq_load;
+	load = (1000*core->softirq_busy)/elapsed;
+	if (load < core->softirq_load)
+		return load;
+	return core->softirq_load;
+}
+
+/**
+ * homa_softirq_load_update() - Invoked at the end of homa_softirq to
+ * record the time it spent, and fold it into the core's moving average
+ * of SoftIRQ load once the current sampling interval has ended.
+ * @core:    Core on which homa_softirq ran.
+ * @start:   Time when homa_softirq started, in get_cycles() units.
+ * @now:     Current time, in get_cycles() units.
+ */
+void homa_softirq_load_update(struct homa_core *core, __u64 start,
+		__u64 now)
+{
+	__u64 elapsed, sample;
+
+	core->softirq_busy += now - start;
+	elapsed = now - core->softirq_load_start;
+	if ((elapsed == 0) || (elapsed < homa->softirq_load_cycles))
+		return;
+	sample = (1000*core->softirq_busy)/elapsed;
+	if (sample > 1000)
+		sample = 1000;
+	core->softirq_load = (3*core->softirq_load + (int) sample)/4;
+	core->softirq_load_start = now;
+	core->softirq_busy = 0;
+}
+
 /**
  * homa_gro_complete() - This function is invoked just before a packet that
  * was held for GRO processing is passed up the network stack, in case the
@@ -416,7 +836,17 @@ int homa_gro_complete(struct sk_buff *skb, int hoffset)
 //			h->type, homa_local_id(h->sender_id), ntohl(d->seg.offset),
 //			NAPI_GRO_CB(skb)->count);
 
-	if (homa->gro_policy & HOMA_GRO_GEN3) {
+	if (homa->gro_policy & HOMA_GRO_STEER) {
+		int core = homa_gro_steer(&h->common);
+		if (core >= 0) {
+			atomic_inc(&homa_cores[core]->softirq_backlog);
+			homa_set_softirq_cpu(skb, core);
+			return 0;
+		}
+	}
+	if (homa->gro_policy & HOMA_GRO_ADAPTIVE) {
+		homa_gro_adaptive(skb);
+	} else if (homa->gro_policy & HOMA_GRO_GEN3) {
 		homa_gro_gen3(skb);
 	} else if (homa->gro_policy & HOMA_GRO_GEN2) {
 		homa_gro_gen2(skb);
@@ -444,7 +874,8 @@ int homa_gro_complete(struct sk_buff *skb, int hoffset)
 			}
 		}
 		homa_set_softirq_cpu(skb, best);
-		tt_record3("homa_gro_complete chose core %d for id %d "
+		tt_record_cat3(TT_GRO,
+				"homa_gro_complete chose core %d for id %d "
 				"offset %d with IDLE policy",
 				best, homa_local_id(h->common.sender_id),
 				ntohl(h->seg.offset));
@@ -456,7 +887,8 @@ int homa_gro_complete(struct sk_buff *skb, int hoffset)
 		if (unlikely(target >= nr_cpu_ids))
 			target = 0;
 		homa_set_softirq_cpu(skb, target);
-		tt_record3("homa_gro_complete chose core %d for id %d "
+		tt_record_cat3(TT_GRO,
+				"homa_gro_complete chose core %d for id %d "
 				"offset %d with NEXT policy",
 				target, homa_local_id(h->common.sender_id),
 				ntohl(h->seg.offset));
@@ -39,21 +39,129 @@ inline static void set_priority(struct sk_buff *skb, struct homa_sock *hsk,
 	hsk->inet.tos = hsk->homa->priority_map[priority]<<5;
 }
 
+/**
+ * homa_zc_pages() - Returns the number of distinct user pages that hold
+ * the next @length bytes of @iter (i.e., the number of skb frags needed
+ * to transmit those bytes without copying).
+ * @iter:     Describes message data in user space; not modified.
+ * @length:   Number of bytes of interest at the front of @iter.
+ */
+static int homa_zc_pages(struct iov_iter *iter, int length)
+{
+	struct iov_iter tmp = *iter;
+
+	iov_iter_truncate(&tmp, length);
+	return iov_iter_npages(&tmp, MAX_SKB_FRAGS + 1);
+}
+
+/**
+ * homa_zc_append() - Pin the pages holding the next @length bytes
+ * of @iter and append them to @skb as frags (instead of copying them).
+ * The caller must have checked (with homa_zc_pages) that @skb has room
+ * for the frags.
+ * @skb:      Packet to which the data should be added.
+ * @iter:     Describes message data in user space (or in shared kernel
+ *            pages); advanced past the bytes that were added.
+ * @length:   Number of bytes to add.
+ *
+ * Return:    0 for success, or a negative errno for failure.
+ */
+static int homa_zc_append(struct sk_buff *skb, struct iov_iter *iter,
+		int length)
+{
+	while (length > 0) {
+		struct page *page;
+		ssize_t bytes;
+		size_t start;
+
+		bytes = iov_iter_get_pages2(iter, &page, length, 1, &start);
+		if (unlikely(bytes <= 0))
+			return -EFAULT;
+		skb_fill_page_desc(skb, skb_shinfo(skb)->nr_frags, page, start,
+				bytes);
+		skb->len += bytes;
+		skb->data_len += bytes;
+		skb->truesize += bytes;
+		length -= bytes;
+	}
+	return 0;
+}
+
+/**
+ * homa_zc_add_seg() - Allocate space for a data_segment header at the
+ * end of a zero-copy packet that already has frags (so the header must
+ * also be stored in a frag).
+ * @skb:      Packet to which the header should be added.
+ * @pfrag:    Page space for headers; shared by all of the packets of a
+ *            message.
+ *
+ * Return:    The location for the header, or NULL if memory couldn't be
+ *            allocated.
+ */
+static struct data_segment *homa_zc_add_seg(struct sk_buff *skb,
+		struct page_frag *pfrag)
+{
+	struct data_segment *seg;
+
+	if (!skb_page_frag_refill(sizeof(*seg), pfrag, GFP_KERNEL))
+		return NULL;
+	seg = (struct data_segment *) (page_address(pfrag->page)
+			+ pfrag->offset);
+	get_page(pfrag->page);
+	skb_fill_page_desc(skb, skb_shinfo(skb)->nr_frags, pfrag->page,
+			pfrag->offset, sizeof(*seg));
+	pfrag->offset += sizeof(*seg);
+	skb->len += sizeof(*seg);
+	skb->data_len += sizeof(*seg);
+	skb->truesize += sizeof(*seg);
+	return seg;
+}
+
+/**
+ * homa_zc_done() - Release the zero-copy state used while creating the
+ * packets for a message. The completion notification for the message
+ * will be generated once all of the packets have also been freed.
+ * @uarg:     Zero-copy notification info for the message, or NULL if the
+ *            message isn't zero-copy.
+ * @pfrag:    Page space used for data_segment headers.
+ */
+static void homa_zc_done(struct ubuf_info *uarg, struct page_frag *pfrag)
+{
+	if (pfrag->page)
+		put_page(pfrag->page);
+	if (uarg)
+		net_zcopy_put(uarg);
+}
+
 /**
  * homa_message_out_init() - Initializes information for sending a message
  * for an RPC (either request or response); copies the message data from
- * user space and (possibly) begins transmitting the message.
+ * user space and (possibly) begins transmitting the message. If zero-copy
+ * has been enabled for the socket (SO_HOMA_ZEROCOPY) and the message is
+ * long enough, the user pages are attached to the packets instead of
+ * copying them; a notification will be queued on the socket's error queue
+ * once the last of the packets has been freed (which can't happen until
+ * the RPC has been freed, so retransmissions are covered). If @shared
+ * is set, @iter refers to kernel pages (as for HOMAIOCMCAST) and the
+ * pages are attached the same way, but without a notification: the
+ * packets of several RPCs can share the same message data.
  * @rpc:     RPC for which to send message; this function must not
  *           previously have been called for the RPC. Must be locked. The RPC
  *           will be unlocked while copying data, but will be locked again
  *           before returning.
- * @iter:    Describes location(s) of message data in user space.
+ * @iter:    Describes location(s) of message data in user space, or
+ *           shared kernel pages holding the data.
  * @xmit:    Nonzero means this method should start transmitting packets;
  *           zero means the caller will initiate transmission.
+ * @shared:  Nonzero means @iter is an ITER_BVEC whose pages hold a copy
+ *           of the message made by the caller; the pages are attached
+ *           to packets rather than copied. Zero means @iter refers to
+ *           user memory.
  *
  * Return:   0 for success, or a negative errno for failure.
  */
-int homa_message_out_init(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
+int homa_message_out_init(struct homa_rpc *rpc, struct iov_iter *iter,
+		int xmit, int shared)
 {
 	/* Geometry information for packets:
 	 * mtu:              largest size for an on-the-wire packet (including
@@ -75,18 +183,35 @@ int homa_message_out_init(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 	int overlap_xmit, repl_length, pkts_per_gso;
 	unsigned int gso_type;
 
+	/* Zero-copy state: uarg is non-NULL if the message's user pages
+	 * are being attached to packets rather than copied; pfrag holds
+	 * data_segment headers that can't be stored in the linear part of
+	 * a zero-copy packet.
+	 */
+	struct page_frag pfrag = {.page = NULL, .offset = 0, .size = 0};
+	struct ubuf_info *uarg = NULL;
+	bool zerocopy;
+
+	/* Allocated without the RPC lock, then installed in rpc->msgout
+	 * once the lock has been reacquired.
+	 */
+	struct sk_buff **skb_index = NULL;
+
 	rpc->msgout.length = iter->count;
 	rpc->msgout.num_skbs = 0;
 	rpc->msgout.copied_from_user = 0;
 	rpc->msgout.packets = NULL;
+	rpc->msgout.skb_index = NULL;
 	rpc->msgout.next_xmit = &rpc->msgout.packets;
 	rpc->msgout.next_xmit_offset = 0;
 	atomic_set(&rpc->msgout.active_xmits, 0);
-	rpc->msgout.unscheduled = rpc->hsk->homa->unsched_bytes;
+	rpc->msgout.unscheduled = homa_peer_rtt_bytes(rpc->hsk->homa,
+			rpc->peer, rpc->hsk->homa->unsched_bytes);
 	if (rpc->msgout.unscheduled > rpc->msgout.length)
 		rpc->msgout.unscheduled = rpc->msgout.length;
 	rpc->msgout.sched_priority = 0;
 	rpc->msgout.init_cycles = get_cycles();
+	rpc->msgout.rtt_start = 0;
 
 	if (unlikely((rpc->msgout.length > HOMA_MAX_MESSAGE_LENGTH)
 			|| (rpc->msgout.length == 0))) {
@@ -101,6 +226,8 @@ int homa_message_out_init(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 	mtu = dst_mtu(dst);
 	max_pkt_data = mtu - rpc->hsk->ip_header_length
 			- sizeof(struct data_header);
+	if (rpc->hsk->homa->udp_port)
+		max_pkt_data -= sizeof(struct udphdr);
 	gso_size = dst->dev->gso_max_size;
 	if (gso_size > rpc->hsk->homa->max_gso_size)
 		gso_size = rpc->hsk->homa->max_gso_size;
@@ -110,17 +237,44 @@ int homa_message_out_init(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 			+ sizeof32(struct data_header)
 			- sizeof32(struct data_segment);
 	pkts_per_gso = (gso_size - repl_length)/(mtu - repl_length);
-	if (pkts_per_gso == 0)
+	if (pkts_per_gso > dst->dev->gso_max_segs)
+		pkts_per_gso = dst->dev->gso_max_segs;
+	zerocopy = (rpc->hsk->zerocopy_min_length > 0)
+			&& (rpc->msgout.length >= rpc->hsk->zerocopy_min_length)
+			&& user_backed_iter(iter);
+	if (zerocopy || shared) {
+		/* Each segment after the first needs a frag for its header,
+		 * plus frags for data (which may straddle a page boundary).
+		 */
+		int zc_pkts = MAX_SKB_FRAGS/(2 + (max_pkt_data - 1)/PAGE_SIZE
+				+ 1);
+		if (pkts_per_gso > zc_pkts)
+			pkts_per_gso = zc_pkts;
+	}
+	if ((pkts_per_gso == 0) || rpc->hsk->homa->udp_port) {
+		/* NICs can't segment UDP-encapsulated Homa packets. */
 		pkts_per_gso = 1;
+	}
 	rpc->msgout.gso_pkt_data = pkts_per_gso * max_pkt_data;
 	gso_size = repl_length + (pkts_per_gso * (mtu - repl_length));
 	UNIT_LOG("; ", "mtu %d, max_pkt_data %d, gso_size %d, gso_pkt_data %d",
 			mtu, max_pkt_data, gso_size, rpc->msgout.gso_pkt_data);
 
-	/* It's unclear what gso_type should be to force software GSO; the
-	 * value below seems to work...
+	/* For hardware segmentation, Homa packets masquerade as TCP: the
+	 * NIC replicates the part of the transport header covered by doff
+	 * (everything in struct data_header before the data_segment) in
+	 * each segment and splits the rest, which already contains a
+	 * data_segment header for each segment, every gso_size bytes. The
+	 * NIC may also overwrite unused fields of the common header (such
+	 * as the TCP sequence number and flags). If the device can't handle
+	 * the gso_type, the kernel falls back to homa_gso_segment.
 	 */
-	gso_type = (rpc->hsk->homa->gso_force_software) ? 0xd : SKB_GSO_TCPV6;
+	if (rpc->hsk->homa->gso_force_software)
+		gso_type = HOMA_GSO_SOFTWARE;
+	else if (rpc->hsk->inet.sk.sk_family == AF_INET6)
+		gso_type = SKB_GSO_TCPV6;
+	else
+		gso_type = SKB_GSO_TCPV4;
 
 	overlap_xmit = rpc->msgout.length > 2*rpc->msgout.gso_pkt_data;
 	rpc->msgout.granted = rpc->msgout.unscheduled;
@@ -130,7 +284,8 @@ int homa_message_out_init(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 	 * iteration of the outer loop creates one sk_buff, which may
 	 * contain info for multiple packets on the wire (via TSO or GSO).
 	 */
-	tt_record3("starting copy from user space for id %d, length %d, "
+	tt_record_cat3(TT_COPY,
+			"starting copy from user space for id %d, length %d, "
 			"unscheduled %d",
 			rpc->id, rpc->msgout.length, rpc->msgout.unscheduled);
 	last_link = &rpc->msgout.packets;
@@ -143,6 +298,32 @@ int homa_message_out_init(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 
 		homa_rpc_unlock(rpc);
 
+		if (zerocopy && (bytes_left == rpc->msgout.length)) {
+			/* Can't allocate this while holding the RPC lock.
+			 * Fail (rather than copying) if allocation fails, so
+			 * the application's notification sequence numbers
+			 * stay in sync (same behavior as TCP).
+			 */
+			uarg = msg_zerocopy_realloc(&rpc->hsk->inet.sk,
+					rpc->msgout.length, NULL);
+			if (unlikely(!uarg)) {
+				err = -ENOBUFS;
+				homa_rpc_lock(rpc);
+				goto error;
+			}
+			INC_METRIC(zerocopy_msgs, 1);
+		}
+		if (bytes_left == rpc->msgout.length) {
+			/* Not fatal if this fails: homa_resend_data will
+			 * scan the packet list instead.
+			 */
+			int entries = (rpc->msgout.length
+					+ rpc->msgout.gso_pkt_data - 1)
+					/ rpc->msgout.gso_pkt_data;
+			skb_index = kvcalloc(entries, sizeof(struct sk_buff *),
+					GFP_KERNEL);
+		}
+
 		/* Figure out how much data will go in this skb. */
 		skb_bytes_left = rpc->msgout.gso_pkt_data;
 		offset = rpc->msgout.length - bytes_left;
@@ -191,23 +372,65 @@ int homa_message_out_init(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 		h->retransmit = 0;
 		homa_info->wire_bytes = 0;
 		homa_info->data_bytes = 0;
+		homa_info->offset = offset;
 
 		/* Each iteration of the following loop adds one segment
 		 * (which will become a separate packet after GSO) to the buffer.
 		 */
 		do {
-			int seg_size;
-			seg = (struct data_segment *) skb_put(skb, sizeof(*seg));
-			seg->offset = htonl(rpc->msgout.length - bytes_left);
+			int seg_size, frags, zc_frags = 0;
 			if (skb_bytes_left <= max_pkt_data)
 				seg_size = skb_bytes_left;
 			else
 				seg_size = max_pkt_data;
+
+			/* Once a packet has frags, everything after must also
+			 * be in frags; if they won't fit, end the packet
+			 * early. If a segment needs too many frags to send
+			 * zero-copy even in an empty packet, copy it instead.
+			 */
+			frags = skb_shinfo(skb)->nr_frags;
+			if (uarg || shared) {
+				zc_frags = homa_zc_pages(iter, seg_size)
+						+ (frags ? 1 : 0);
+				if ((frags + zc_frags) > MAX_SKB_FRAGS) {
+					if (frags)
+						break;
+					zc_frags = 0;
+				}
+			}
+
+			if (frags) {
+				seg = homa_zc_add_seg(skb, &pfrag);
+				if (unlikely(!seg)) {
+					err = -ENOMEM;
+					kfree_skb(skb);
+					homa_rpc_lock(rpc);
+					goto error;
+				}
+			} else {
+				seg = (struct data_segment *) skb_put(skb,
+						sizeof(*seg));
+			}
+			seg->offset = htonl(rpc->msgout.length - bytes_left);
 			seg->segment_length = htonl(seg_size);
 			seg->ack.client_id = 0;
 			homa_peer_get_acks(rpc->peer, 1, &seg->ack);
-			if (copy_from_iter(skb_put(skb, seg_size), seg_size,
-					iter) != seg_size) {
+			if (zc_frags) {
+				if (uarg && !skb_zcopy(skb))
+					skb_zcopy_set(skb, uarg, NULL);
+				err = homa_zc_append(skb, iter, seg_size);
+				if (unlikely(err)) {
+					kfree_skb(skb);
+					homa_rpc_lock(rpc);
+					goto error;
+				}
+				if (uarg)
+					INC_METRIC(zerocopy_bytes, seg_size);
+				else
+					INC_METRIC(mcast_shared_bytes, seg_size);
+			} else if (copy_from_iter(skb_put(skb, seg_size),
+					seg_size, iter) != seg_size) {
 				err = -EFAULT;
 				kfree_skb(skb);
 				homa_rpc_lock(rpc);
@@ -223,9 +446,20 @@ int homa_message_out_init(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 		} while (skb_bytes_left > 0);
 
 		homa_rpc_lock(rpc);
+		if (skb_index) {
+			rpc->msgout.skb_index = skb_index;
+			skb_index = NULL;
+		}
 		*last_link = skb;
 		last_link = &(homa_get_skb_info(skb)->next_skb);
 		*last_link = NULL;
+		if (rpc->msgout.skb_index) {
+			int i = (offset + rpc->msgout.gso_pkt_data - 1)
+					/ rpc->msgout.gso_pkt_data;
+			for ( ; (i * rpc->msgout.gso_pkt_data)
+					< (offset + homa_info->data_bytes); i++)
+				rpc->msgout.skb_index[i] = skb;
+		}
 		rpc->msgout.num_skbs++;
 		rpc->msgout.copied_from_user = rpc->msgout.length - bytes_left;
 		if (overlap_xmit && list_empty(&rpc->throttled_links) && xmit
@@ -234,9 +468,11 @@ int homa_message_out_init(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 			homa_add_to_throttled(rpc);
 		}
 	}
-	tt_record2("finished copy from user space for id %d, length %d",
+	tt_record_cat2(TT_COPY,
+			"finished copy from user space for id %d, length %d",
 			rpc->id, rpc->msgout.length);
 	atomic_andnot(RPC_COPYING_FROM_USER, &rpc->flags);
+	homa_zc_done(uarg, &pfrag);
 	INC_METRIC(sent_msg_bytes, rpc->msgout.length);
 	if (!overlap_xmit && xmit)
 		homa_xmit_data(rpc, false);
@@ -244,6 +480,8 @@ int homa_message_out_init(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 
     error:
 	atomic_andnot(RPC_COPYING_FROM_USER, &rpc->flags);
+	homa_zc_done(uarg, &pfrag);
+	kvfree(skb_index);
 	return err;
 }
 
@@ -265,13 +503,85 @@ int homa_xmit_control(enum homa_packet_type type, void *contents,
 	size_t length, struct homa_rpc *rpc)
 {
 	struct common_header *h = (struct common_header *) contents;
+	struct homa_ack *ack;
+
 	h->type = type;
 	h->sport = htons(rpc->hsk->port);
 	h->dport = htons(rpc->dport);
 	h->sender_id = cpu_to_be64(rpc->id);
+
+	/* Piggyback a pending ack for the peer, if there's room for one. */
+	ack = homa_pkt_ack(h);
+	if (ack && ((char *) (ack + 1) <= ((char *) contents + length))) {
+		ack->client_id = 0;
+		if (homa_peer_get_acks(rpc->peer, 1, ack))
+			INC_METRIC(acks_piggybacked, 1);
+	}
 	return __homa_xmit_control(contents, length, rpc->peer, rpc->hsk);
 }
 
+/**
+ * homa_udp_xmit() - Transmit a packet encapsulated in UDP (used when
+ * homa->udp_port is nonzero).
+ * @skb:      Packet to transmit, with its dst already set; its transport
+ *            header refers to the Homa header. Always consumed.
+ * @hsk:      Socket from which the packet is being sent.
+ * @peer:     Destination for the packet.
+ * @dsfield:  Value for the IPv6 traffic class or IPv4 TOS field.
+ *
+ * Return:    Either zero (for success), or a negative errno value if the
+ *            packet couldn't be sent.
+ */
+static int homa_udp_xmit(struct sk_buff *skb, struct homa_sock *hsk,
+		struct homa_peer *peer, __u8 dsfield)
+{
+	struct common_header *h = (struct common_header *)
+			skb_transport_header(skb);
+	struct dst_entry *dst = skb_dst(skb);
+	__be16 sport;
+
+	/* Derive the source port from the RPC (ignoring the bit that
+	 * distinguishes client from server), so that RSS and ECMP keep
+	 * each RPC's packets in order but spread different RPCs.
+	 */
+	sport = htons(HOMA_UDP_SPORT_BASE | (jhash_2words(
+			(__u32) (be64_to_cpu(h->sender_id) >> 1),
+			ntohs(h->sport) ^ ntohs(h->dport), 0)
+			& HOMA_UDP_SPORT_MASK));
+
+	/* The tunnel functions push the UDP and IP headers without checking
+	 * for room, and they don't report errors; so this is the only
+	 * failure we can detect.
+	 */
+	if (unlikely(skb_cow_head(skb, LL_RESERVED_SPACE(dst->dev)
+			+ hsk->ip_header_length + sizeof(struct udphdr)))) {
+		kfree_skb(skb);
+		return -ENOMEM;
+	}
+
+	/* Let the UDP code compute (or offload) the UDP checksum. The
+	 * tunnel functions consume a dst reference and don't drop the one
+	 * already in skb.
+	 */
+	skb->ip_summed = CHECKSUM_NONE;
+	dst_hold(dst);
+	skb_dst_drop(skb);
+	INC_METRIC(udp_packets_sent, 1);
+	if (hsk->inet.sk.sk_family == AF_INET6)
+		udp_tunnel6_xmit_skb(dst, &hsk->inet.sk, skb, dst->dev,
+				&peer->flow.u.ip6.saddr,
+				&peer->flow.u.ip6.daddr, dsfield,
+				ip6_dst_hoplimit(dst), 0, sport,
+				htons(hsk->homa->udp_port), false);
+	else
+		udp_tunnel_xmit_skb((struct rtable *) dst, &hsk->inet.sk, skb,
+				peer->flow.u.ip4.saddr,
+				peer->flow.u.ip4.daddr, dsfield,
+				ip4_dst_hoplimit(dst), 0, sport,
+				htons(hsk->homa->udp_port), false, false);
+	return 0;
+}
+
 /**
  * __homa_xmit_control() - Lower-level version of homa_xmit_control: sends
  * a control packet.
@@ -317,13 +627,27 @@ int __homa_xmit_control(void *contents, size_t length, struct homa_peer *peer,
 	}
 	priority = hsk->homa->num_priorities-1;
 	skb->ooo_okay = 1;
+	skb->priority = hsk->homa->priority_queues ? priority : 0;
 	skb_get(skb);
-	if (hsk->inet.sk.sk_family == AF_INET6) {
+	if (hsk->homa->udp_port) {
+		result = homa_udp_xmit(skb, hsk, peer,
+				(hsk->inet.sk.sk_family == AF_INET6)
+				? hsk->homa->priority_map[priority] << 4
+				: hsk->homa->priority_map[priority] << 5);
+	} else if (hsk->inet.sk.sk_family == AF_INET6) {
 		result = ip6_xmit(&hsk->inet.sk, skb, &peer->flow.u.ip6, 0,
-				NULL, hsk->homa->priority_map[priority] << 4, 0);
+				NULL, hsk->homa->priority_map[priority] << 4,
+				skb->priority);
 	} else {
 		/* This will find its way to the DSCP field in the IPv4 hdr. */
 		hsk->inet.tos = hsk->homa->priority_map[priority]<<5;
+
+		/* ip_queue_xmit takes skb->priority from the socket; don't
+		 * override the application's SO_PRIORITY unless Homa is
+		 * choosing TX queues.
+		 */
+		if (hsk->homa->priority_queues)
+			hsk->inet.sk.sk_priority = skb->priority;
 		result = ip_queue_xmit(&hsk->inet.sk, skb, &peer->flow);
 	}
 	if (unlikely(result != 0)) {
@@ -382,8 +706,10 @@ void homa_xmit_unknown(struct sk_buff *skb, struct homa_sock *hsk)
 	unknown.common.sender_id = cpu_to_be64(homa_local_id(h->sender_id));
 	unknown.common.type = UNKNOWN;
 	peer = homa_peer_find(&hsk->homa->peers, &saddr, &hsk->inet);
-	if (!IS_ERR(peer))
+	if (!IS_ERR(peer)) {
 		 __homa_xmit_control(&unknown, sizeof(unknown), peer, hsk);
+		 homa_peer_put(peer);
+	}
 }
 
 /**
@@ -400,6 +726,32 @@ void homa_xmit_unknown(struct sk_buff *skb, struct homa_sock *hsk)
  *             the NIC queue is sufficiently long.
  */
 void homa_xmit_data(struct homa_rpc *rpc, bool force)
+{
+	struct homa_xmit_batch batch;
+
+	homa_xmit_batch_init(&batch);
+	homa_xmit_data_batch(rpc, force, &batch);
+	if (batch.num_skbs > 0) {
+		homa_rpc_unlock(rpc);
+		homa_xmit_batch_flush(&batch);
+		homa_rpc_lock(rpc);
+	}
+}
+
+/**
+ * homa_xmit_data_batch() - Same as homa_xmit_data, except that packets
+ * are added to a batch rather than transmitted immediately, so that
+ * packets from several RPCs can be transmitted together.
+ * @rpc:       RPC to check for transmittable packets. Must be locked by
+ *             caller. If the batch fills up, this function will release
+ *             the RPC lock while flushing it, then reacquire it.
+ * @force:     Same as for homa_xmit_data.
+ * @batch:     Packets to transmit are added here. The caller must
+ *             eventually invoke homa_xmit_batch_flush, without holding
+ *             any RPC locks.
+ */
+void homa_xmit_data_batch(struct homa_rpc *rpc, bool force,
+		struct homa_xmit_batch *batch)
 {
 	struct homa *homa = rpc->hsk->homa;
 
@@ -410,29 +762,44 @@ void homa_xmit_data(struct homa_rpc *rpc, bool force)
 		struct sk_buff *next_skb;
 
 		if (rpc->msgout.next_xmit_offset >= rpc->msgout.granted) {
-			tt_record3("homa_xmit_data stopping at offset %d "
+			tt_record_cat3(TT_PACER,
+					"homa_xmit_data stopping at offset %d "
 					"for id %u: granted is %d",
 					rpc->msgout.next_xmit_offset, rpc->id,
 					rpc->msgout.granted);
 			break;
 		}
 
+		if (rpc->msgout.next_xmit_offset < rpc->msgout.unscheduled) {
+			priority = homa_unsched_priority(homa, rpc->peer,
+					rpc->msgout.length);
+		} else {
+			priority = rpc->msgout.sched_priority;
+		}
 		if ((rpc->msgout.length - rpc->msgout.next_xmit_offset)
 				>= homa->throttle_min_bytes) {
-			if (!homa_check_nic_queue(homa, skb, force)) {
-				tt_record1("homa_xmit_data adding id %u to "
+			if (!homa_check_nic_queue(homa,
+					homa_get_nic(rpc->peer, rpc->hsk),
+					skb, priority, force)) {
+				tt_record_cat1(TT_PACER,
+						"homa_xmit_data adding id %u to "
 						"throttle queue", rpc->id);
+
+				/* Get the packets that fit in the NIC queue
+				 * moving before waking the pacer.
+				 */
+				if (batch->num_skbs > 0) {
+					homa_rpc_unlock(rpc);
+					homa_xmit_batch_flush(batch);
+					homa_rpc_lock(rpc);
+				}
 				homa_add_to_throttled(rpc);
 				break;
 			}
 		}
 
-		if (rpc->msgout.next_xmit_offset < rpc->msgout.unscheduled) {
-			priority = homa_unsched_priority(homa, rpc->peer,
-					rpc->msgout.length);
-		} else {
-			priority = rpc->msgout.sched_priority;
-		}
+		if (rpc->msgout.next_xmit_offset == 0)
+			rpc->msgout.rtt_start = get_cycles();
 		rpc->msgout.next_xmit = &(homa_get_skb_info(skb)->next_skb);
 		next_skb = *rpc->msgout.next_xmit;
 		if (next_skb == NULL) {
@@ -444,15 +811,46 @@ void homa_xmit_data(struct homa_rpc *rpc, bool force)
 			rpc->msgout.next_xmit_offset = ntohl(h->seg.offset);
 		}
 
-		homa_rpc_unlock(rpc);
 		skb_get(skb);
-		__homa_xmit_data(skb, rpc, priority);
+		atomic_inc(&rpc->msgout.active_xmits);
+		batch->skbs[batch->num_skbs] = skb;
+		batch->rpcs[batch->num_skbs] = rpc;
+		batch->priorities[batch->num_skbs] = priority;
+		batch->num_skbs++;
 		force = false;
-		homa_rpc_lock(rpc);
+		if (batch->num_skbs >= HOMA_XMIT_BATCH) {
+			homa_rpc_unlock(rpc);
+			homa_xmit_batch_flush(batch);
+			homa_rpc_lock(rpc);
+		}
 	}
 	atomic_dec(&rpc->msgout.active_xmits);
 }
 
+/**
+ * homa_xmit_batch_flush() - Transmit all of the packets in a batch and
+ * release the RPCs they belong to. This is where Homa's data packets are
+ * actually handed to the IP layer; sending them back-to-back in one pass
+ * gives the qdisc layer the best chance to dequeue them in bulk, in which
+ * case the driver sees xmit_more and only rings the NIC's doorbell once.
+ * @batch:   Packets to send; will be empty on return. The caller must not
+ *           hold the lock for any RPC in the batch.
+ */
+void homa_xmit_batch_flush(struct homa_xmit_batch *batch)
+{
+	int i;
+
+	if (batch->num_skbs == 0)
+		return;
+	for (i = 0; i < batch->num_skbs; i++) {
+		__homa_xmit_data(batch->skbs[i], batch->rpcs[i],
+				batch->priorities[i]);
+		atomic_dec(&batch->rpcs[i]->msgout.active_xmits);
+	}
+	INC_METRIC(xmit_batches, 1);
+	batch->num_skbs = 0;
+}
+
 /**
  * __homa_xmit_data() - Handles packet transmission stuff that is common
  * to homa_xmit_data and homa_resend_data.
@@ -463,7 +861,7 @@ void homa_xmit_data(struct homa_rpc *rpc, bool force)
  */
 void __homa_xmit_data(struct sk_buff *skb, struct homa_rpc *rpc, int priority)
 {
-	int err;
+	int err, ect;
 	struct data_header *h = (struct data_header *)
 			skb_transport_header(skb);
 	struct dst_entry *dst;
@@ -476,31 +874,61 @@ void __homa_xmit_data(struct sk_buff *skb, struct homa_rpc *rpc, int priority)
 	dst = homa_get_dst(rpc->peer, rpc->hsk);
 	dst_hold(dst);
 	skb_dst_set(skb, dst);
+	if (skb_is_gso(skb) && skb_gso_ok(skb, dst->dev->features))
+		INC_METRIC(tso_skbs, 1);
 
 	skb->ooo_okay = 1;
 	skb->ip_summed = CHECKSUM_PARTIAL;
 	skb->csum_start = skb_transport_header(skb) - skb->head;
 	skb->csum_offset = offsetof(struct common_header, checksum);
-	if (rpc->hsk->inet.sk.sk_family == AF_INET6) {
-		tt_record4("calling ip6_xmit: wire_bytes %d, peer 0x%x, id %d, "
+
+	/* Mark data packets ECN-capable so that congested switches can
+	 * signal the receiver (see homa_data_pkt).
+	 */
+	ect = (rpc->hsk->homa->congestion_signal & HOMA_CONG_ECN)
+			? INET_ECN_ECT_0 : 0;
+
+	/* With priority_queues, a qdisc such as mqprio maps skb->priority
+	 * to a TX queue, so each Homa priority level gets its own queue.
+	 */
+	skb->priority = rpc->hsk->homa->priority_queues ? priority : 0;
+	if (rpc->hsk->homa->udp_port && !skb_is_gso(skb)) {
+		/* GSO packets formed before UDP was enabled must still be
+		 * sent raw: encapsulated packets can't be segmented.
+		 */
+		err = homa_udp_xmit(skb, rpc->hsk, rpc->peer,
+				(rpc->hsk->inet.sk.sk_family == AF_INET6)
+				? (rpc->hsk->homa->priority_map[priority] << 4)
+				| ect
+				: (rpc->hsk->homa->priority_map[priority] << 5)
+				| ect);
+	} else if (rpc->hsk->inet.sk.sk_family == AF_INET6) {
+		tt_record_cat4(TT_PACER,
+				"calling ip6_xmit: wire_bytes %d, peer 0x%x, id %d, "
 				"offset %d",
 				homa_get_skb_info(skb)->wire_bytes,
 				tt_addr(rpc->peer->addr), rpc->id,
 				ntohl(h->seg.offset));
 		err = ip6_xmit(&rpc->hsk->inet.sk, skb, &rpc->peer->flow.u.ip6,
 				0, NULL,
-				rpc->hsk->homa->priority_map[priority] << 4, 0);
+				(rpc->hsk->homa->priority_map[priority] << 4)
+				| ect, skb->priority);
 	} else {
-		tt_record4("calling ip_queue_xmit: wire_bytes %d, peer 0x%x, "
+		tt_record_cat4(TT_PACER,
+				"calling ip_queue_xmit: wire_bytes %d, peer 0x%x, "
 				"id %d, offset %d",
 				homa_get_skb_info(skb)->wire_bytes,
 				tt_addr(rpc->peer->addr), rpc->id,
 				htonl(h->seg.offset));
 
-		rpc->hsk->inet.tos = rpc->hsk->homa->priority_map[priority]<<5;
+		rpc->hsk->inet.tos = (rpc->hsk->homa->priority_map[priority]<<5)
+				| ect;
+		if (rpc->hsk->homa->priority_queues)
+			rpc->hsk->inet.sk.sk_priority = skb->priority;
 		err = ip_queue_xmit(&rpc->hsk->inet.sk, skb, &rpc->peer->flow);
 	}
-	tt_record4("Finished queueing packet: rpc id %llu, offset %d, len %d, "
+	tt_record_cat4(TT_PACER,
+			"Finished queueing packet: rpc id %llu, offset %d, len %d, "
 			"granted %d",
 			rpc->id, ntohl(h->seg.offset),
 			homa_get_skb_info(skb)->data_bytes,
@@ -513,6 +941,132 @@ void __homa_xmit_data(struct sk_buff *skb, struct homa_rpc *rpc, int priority)
 	INC_METRIC(priority_packets[priority], 1);
 }
 
+/**
+ * homa_skb_get_bits() - Copy bytes out of an outgoing data packet, which
+ * may store some of its data in frags (for zero-copy messages). Offsets
+ * are measured from skb->head rather than skb->data, since skb->data
+ * changes as the packet passes through the transmit path (which could
+ * be happening concurrently).
+ * @skb:      Packet from which to copy.
+ * @offset:   Offset from skb->head of the first byte to copy.
+ * @dest:     Where to copy the bytes.
+ * @length:   Number of bytes to copy.
+ */
+void homa_skb_get_bits(struct sk_buff *skb, int offset, void *dest,
+		int length)
+{
+	int linear = skb_tail_pointer(skb) - skb->head;
+	char *dst = (char *) dest;
+	int i, chunk;
+
+	if (offset < linear) {
+		chunk = min(length, linear - offset);
+		memcpy(dst, skb->head + offset, chunk);
+		dst += chunk;
+		offset += chunk;
+		length -= chunk;
+	}
+	offset -= linear;
+
+	/* Note: Homa never creates frags that cross page boundaries. */
+	for (i = 0; (length > 0) && (i < skb_shinfo(skb)->nr_frags); i++) {
+		skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+		int size = skb_frag_size(frag);
+		char *vaddr;
+
+		if (offset >= size) {
+			offset -= size;
+			continue;
+		}
+		chunk = min(length, size - offset);
+		vaddr = kmap_local_page(skb_frag_page(frag));
+		memcpy(dst, vaddr + skb_frag_off(frag) + offset, chunk);
+		kunmap_local(vaddr);
+		dst += chunk;
+		length -= chunk;
+		offset = 0;
+	}
+}
+
+/**
+ * homa_resend_incoming() - Compute the value for the @incoming field of
+ * a retransmitted data packet.
+ * @rpc:      RPC whose data is being retransmitted.
+ * @end:      Offset just after the last byte of data in the packet.
+ *
+ * Return:    The value to store (in host byte order).
+ */
+static inline int homa_resend_incoming(struct homa_rpc *rpc, int end)
+{
+	if (end <= rpc->msgout.granted)
+		return rpc->msgout.granted;
+	if (end > rpc->msgout.length)
+		return rpc->msgout.length;
+	return end;
+}
+
+/**
+ * homa_resend_clone() - Retransmit all of the data in an output packet
+ * by sending a clone of the packet, which avoids copying its data.
+ * @rpc:      RPC that @skb belongs to; must be locked by caller.
+ * @skb:      Packet from @rpc->msgout.packets.
+ * @priority: Priority level to use for the retransmitted packet.
+ *
+ * Return:    True means the packet was retransmitted; false means it
+ *            can't safely be cloned right now, so the caller must copy
+ *            its data instead.
+ */
+static bool homa_resend_clone(struct homa_rpc *rpc, struct sk_buff *skb,
+		int priority)
+{
+	struct homa_skb_info *homa_info = homa_get_skb_info(skb);
+	int end = homa_info->offset + homa_info->data_bytes;
+	struct sk_buff *clone;
+	struct data_header *h;
+
+	/* A clone shares its linear data (including the Homa header) with
+	 * the original until skb_cow_head gives it a private copy, below.
+	 * Even so, only clone if nothing else can be transmitting the same
+	 * buffer: the original must already have passed through the stack
+	 * (and won't be sent again by homa_xmit_data), and no earlier clone
+	 * can still be in flight.
+	 */
+	if ((end > rpc->msgout.next_xmit_offset)
+			|| (atomic_read(&rpc->msgout.active_xmits) != 0)
+			|| (refcount_read(&skb->users) != 1)
+			|| skb_cloned(skb))
+		return false;
+	clone = skb_clone(skb, GFP_ATOMIC);
+	if (unlikely(!clone))
+		return false;
+
+	/* The original's data pointer and dst reflect its previous trip
+	 * through the stack; reset them.
+	 */
+	skb_dst_drop(clone);
+	skb_pull(clone, skb_transport_offset(clone));
+
+	/* The header is modified below, and that mustn't affect the
+	 * original.
+	 */
+	if (unlikely(skb_cow_head(clone, 0))) {
+		kfree_skb(clone);
+		return false;
+	}
+	h = (struct data_header *) skb_transport_header(clone);
+	h->retransmit = 1;
+	h->incoming = htonl(homa_resend_incoming(rpc, end));
+	tt_record4("retransmitting clone, offset %d, length %d, id %d, "
+			"segs %d", homa_info->offset, homa_info->data_bytes,
+			rpc->id, skb_shinfo(skb)->gso_segs);
+	homa_check_nic_queue(rpc->hsk->homa, homa_get_nic(rpc->peer, rpc->hsk),
+			clone, priority, true);
+	__homa_xmit_data(clone, rpc, priority);
+	INC_METRIC(resent_packets, skb_shinfo(skb)->gso_segs);
+	INC_METRIC(resent_clones, 1);
+	return true;
+}
+
 /**
  * homa_resend_data() - This function is invoked as part of handling RESEND
  * requests. It retransmits the packets containing a given range of bytes
@@ -531,12 +1085,19 @@ void homa_resend_data(struct homa_rpc *rpc, int start, int end,
 	if (end <= start)
 		return;
 
+	/* Find the first packet that could overlap the range: the index
+	 * gets us to within a packet or two of it.
+	 */
+	skb = rpc->msgout.packets;
+	if (rpc->msgout.skb_index && (start < rpc->msgout.length))
+		skb = rpc->msgout.skb_index[start/rpc->msgout.gso_pkt_data];
+
 	/* The nested loop below scans each data_segment in each
 	 * packet, looking for those that overlap the range of
 	 * interest.
 	 */
-	for (skb = rpc->msgout.packets; skb !=  NULL;
-			skb = homa_get_skb_info(skb)->next_skb) {
+	for ( ; skb !=  NULL; skb = homa_get_skb_info(skb)->next_skb) {
+		struct homa_skb_info *skb_info = homa_get_skb_info(skb);
 		int seg_offset = (skb_transport_header(skb) - skb->head)
 				+ sizeof32(struct data_header)
 				- sizeof32(struct data_segment);
@@ -544,6 +1105,15 @@ void homa_resend_data(struct homa_rpc *rpc, int start, int end,
 		struct data_segment *seg;
 		struct data_header *h;
 
+		if (end <= skb_info->offset)
+			break;
+		if ((skb_info->offset + skb_info->data_bytes) <= start)
+			continue;
+		if ((start <= skb_info->offset) && ((skb_info->offset
+				+ skb_info->data_bytes) <= end)
+				&& homa_resend_clone(rpc, skb, priority))
+			continue;
+
 		count = skb_shinfo(skb)->gso_segs;
 		if (count < 1)
 			count = 1;
@@ -551,8 +1121,12 @@ void homa_resend_data(struct homa_rpc *rpc, int start, int end,
 				seg_offset += sizeof32(*seg) + length) {
 			struct sk_buff *new_skb;
 			struct homa_skb_info *homa_info;
+			struct data_segment seg_copy;
 
-			seg = (struct data_segment *) (skb->head + seg_offset);
+			/* The segment header may be in a frag (zero-copy). */
+			homa_skb_get_bits(skb, seg_offset, &seg_copy,
+					sizeof(seg_copy));
+			seg = &seg_copy;
 			offset = ntohl(seg->offset);
 			length = ntohl(seg->segment_length);
 
@@ -561,8 +1135,9 @@ void homa_resend_data(struct homa_rpc *rpc, int start, int end,
 			if ((offset + length) <= start)
 				continue;
 
-			/* This segment must be retransmitted. Sending packets
-			 * isn't idempotent (packet state gets updated during
+			/* This segment must be retransmitted, and the packet
+			 * couldn't be cloned. Sending packets isn't
+			 * idempotent (packet state gets updated during
 			 * sends) so copy the packet data into a clean sk_buff.
 			 */
 			new_skb = alloc_skb(length + sizeof(struct data_header)
@@ -580,16 +1155,13 @@ void homa_resend_data(struct homa_rpc *rpc, int start, int end,
 			__skb_put_data(new_skb, skb_transport_header(skb),
 					sizeof32(struct data_header)
 					- sizeof32(struct data_segment));
-			__skb_put_data(new_skb, seg, sizeof32(*seg) + length);
+			homa_skb_get_bits(skb, seg_offset, skb_put(new_skb,
+					sizeof32(*seg) + length),
+					sizeof32(*seg) + length);
 			h = ((struct data_header *) skb_transport_header(new_skb));
 			h->retransmit = 1;
-			if ((offset + length) <= rpc->msgout.granted)
-				h->incoming = htonl(rpc->msgout.granted);
-			else if ((offset + length) > rpc->msgout.length)
-				h->incoming = htonl(rpc->msgout.length);
-			else
-				h->incoming = htonl(offset + length);
-
+			h->incoming = htonl(homa_resend_incoming(rpc,
+					offset + length));
 
 			homa_info = homa_get_skb_info(new_skb);
 			homa_info->wire_bytes = length
@@ -597,9 +1169,12 @@ void homa_resend_data(struct homa_rpc *rpc, int start, int end,
 					+ rpc->hsk->ip_header_length
 					+ HOMA_ETH_OVERHEAD;
 			homa_info->data_bytes = length;
+			homa_info->offset = offset;
 			tt_record3("retransmitting offset %d, length %d, id %d",
 					offset, length, rpc->id);
-			homa_check_nic_queue(rpc->hsk->homa, new_skb, true);
+			homa_check_nic_queue(rpc->hsk->homa,
+					homa_get_nic(rpc->peer, rpc->hsk),
+					new_skb, priority, true);
 			__homa_xmit_data(new_skb, rpc, priority);
 			INC_METRIC(resent_packets, 1);
 		}
@@ -631,6 +1206,117 @@ resend_done:
 	}
 }
 
+/**
+ * homa_nic_set_speed() - Set the link speed for a NIC entry, based on
+ * homa->nic_link_mbps and homa->link_mbps.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @nic:     Entry whose @name has been set; its @link_mbps and
+ *           @cycles_per_kbyte will be updated.
+ */
+static void homa_nic_set_speed(struct homa *homa, struct homa_nic *nic)
+{
+	const char *p = homa->nic_link_mbps;
+	int length = strlen(nic->name);
+	int mbps = homa->link_mbps;
+	__u64 cycles_per_kbyte;
+
+	/* nic_link_mbps contains entries of the form "name:mbps",
+	 * separated by spaces or commas.
+	 */
+	while (*p != 0) {
+		if ((strncmp(p, nic->name, length) == 0) && (p[length] == ':')) {
+			int value = 0;
+
+			for (p += length + 1; (*p >= '0') && (*p <= '9'); p++)
+				value = 10*value + (*p - '0');
+			if (value > 0)
+				mbps = value;
+			break;
+		}
+		while ((*p != 0) && (*p != ' ') && (*p != ',') && (*p != '\n'))
+			p++;
+		while ((*p == ' ') || (*p == ',') || (*p == '\n'))
+			p++;
+	}
+	/* Compute in a local: nic->cycles_per_kbyte is read without
+	 * holding nic_lock, so it must never hold a partial result.
+	 */
+	cycles_per_kbyte = (8*(__u64) cpu_khz)/mbps;
+	cycles_per_kbyte = (101*cycles_per_kbyte)/100;
+	WRITE_ONCE(nic->link_mbps, mbps);
+	WRITE_ONCE(nic->cycles_per_kbyte, cycles_per_kbyte);
+}
+
+/**
+ * homa_nic_find() - Returns the NIC queue information for a network
+ * device, creating a new entry if this is the first time the device
+ * has been seen.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @dev:     Device on which packets will be transmitted.
+ * Return:   The entry in homa->nics for @dev. If all of the entries are
+ *           already in use, the last one is returned (it will be shared
+ *           by all of the devices that didn't get their own entries).
+ */
+struct homa_nic *homa_nic_find(struct homa *homa, struct net_device *dev)
+{
+	struct homa_nic *nic;
+	int i, num_nics;
+
+	num_nics = smp_load_acquire(&homa->num_nics);
+	for (i = 0; i < num_nics; i++) {
+		if (homa->nics[i].ifindex == dev->ifindex)
+			return &homa->nics[i];
+	}
+
+	/* No existing entry; create one (unless someone else created it
+	 * since we checked above).
+	 */
+	spin_lock_bh(&homa->nic_lock);
+	for (i = num_nics; i < homa->num_nics; i++) {
+		nic = &homa->nics[i];
+		if (nic->ifindex == dev->ifindex)
+			goto done;
+	}
+	if (homa->num_nics >= HOMA_MAX_NICS) {
+		nic = &homa->nics[HOMA_MAX_NICS-1];
+		goto done;
+	}
+	nic = &homa->nics[homa->num_nics];
+	nic->ifindex = dev->ifindex;
+	memcpy(nic->name, dev->name, IFNAMSIZ);
+	nic->name[IFNAMSIZ-1] = 0;
+	homa_nic_set_speed(homa, nic);
+	smp_store_release(&homa->num_nics, homa->num_nics + 1);
+	if (homa->verbose)
+		printk(KERN_NOTICE "Homa using device %s at %d Mbps\n",
+				nic->name, nic->link_mbps);
+
+done:
+	spin_unlock_bh(&homa->nic_lock);
+	return nic;
+}
+
+/**
+ * homa_nic_min_idle() - Returns the earliest time at which any of the
+ * network devices used by Homa is expected to finish transmitting its
+ * queued packets (i.e. the device with the shortest NIC queue).
+ * @homa:    Overall data about the Homa protocol implementation.
+ * Return:   A get_cycles() time, which may be in the past.
+ */
+__u64 homa_nic_min_idle(struct homa *homa)
+{
+	int i, num_nics = smp_load_acquire(&homa->num_nics);
+	__u64 result = atomic64_read(&homa->nics[0].link_idle_time);
+
+	for (i = 1; i < num_nics; i++) {
+		__u64 idle = atomic64_read(&homa->nics[i].link_idle_time);
+
+		if (idle < result)
+			result = idle;
+	}
+	return result;
+}
+
 /**
  * homa_outgoing_sysctl_changed() - Invoked whenever a sysctl value is changed;
  * any output-related parameters that depend on sysctl-settable values.
@@ -639,6 +1325,7 @@ resend_done:
 void homa_outgoing_sysctl_changed(struct homa *homa)
 {
 	__u64 tmp;
+	int i;
 
 	/* Code below is written carefully to avoid integer underflow or
 	 * overflow under expected usage patterns. Be careful when changing!
@@ -648,6 +1335,38 @@ void homa_outgoing_sysctl_changed(struct homa *homa)
 	tmp = homa->max_nic_queue_ns;
 	tmp = (tmp*cpu_khz)/1000000;
 	homa->max_nic_queue_cycles = tmp;
+
+	spin_lock_bh(&homa->nic_lock);
+	for (i = 0; i < homa->num_nics; i++)
+		homa_nic_set_speed(homa, &homa->nics[i]);
+	spin_unlock_bh(&homa->nic_lock);
+
+	if (homa->num_pacers < 1)
+		homa->num_pacers = 1;
+	if (homa->num_pacers > HOMA_MAX_PACERS)
+		homa->num_pacers = HOMA_MAX_PACERS;
+	if (homa->num_pacers != homa->active_pacers)
+		homa_pacer_start(homa);
+}
+
+/**
+ * homa_pacer_wake_time() - Returns the earliest time at which any
+ * currently-running pacer thread woke up.
+ * @homa:     Overall data about the Homa protocol implementation.
+ * Return:    A get_cycles() time, or 0 if all of the pacers are asleep.
+ */
+static __u64 homa_pacer_wake_time(struct homa *homa)
+{
+	__u64 result = 0;
+	int i;
+
+	for (i = 0; i < HOMA_MAX_PACERS; i++) {
+		__u64 wake_time = READ_ONCE(homa->pacers[i].wake_time);
+
+		if (wake_time && ((result == 0) || (wake_time < result)))
+			result = wake_time;
+	}
+	return result;
 }
 
 /**
@@ -657,7 +1376,12 @@ void homa_outgoing_sysctl_changed(struct homa *homa)
  * whether the NIC queue is so full that no new packets should be queued
  * (Homa's SRPT depends on keeping the NIC queue short).
  * @homa:     Overall data about the Homa protocol implementation.
+ * @nic:      Queue information for the device that will transmit @skb
+ *            (see homa_get_nic).
  * @skb:      Packet that is about to be transmitted.
+ * @priority: Priority level at which @skb will be transmitted. Only used
+ *            if homa->priority_queues is set, in which case only the
+ *            backlog at this priority and above is considered.
  * @force:    True means this packet is going to be transmitted
  *            regardless of the queue length.
  * Return:    Nonzero is returned if either the NIC queue length is
@@ -666,35 +1390,61 @@ void homa_outgoing_sysctl_changed(struct homa *homa)
  *            the transmission of @skb. If nonzero is returned, then the
  *            queue estimate is updated to reflect the transmission of @skb.
  */
-int homa_check_nic_queue(struct homa *homa, struct sk_buff *skb, bool force)
+int homa_check_nic_queue(struct homa *homa, struct homa_nic *nic,
+		struct sk_buff *skb, int priority, bool force)
 {
 	__u64 idle, new_idle, clock;
 	int cycles_for_packet, bytes;
+	bool check = !force && !(homa->flags & HOMA_FLAG_DONT_THROTTLE);
 
 	bytes = homa_get_skb_info(skb)->wire_bytes;
-	cycles_for_packet = (bytes * homa->cycles_per_kbyte)/1000;
+	cycles_for_packet = (bytes * nic->cycles_per_kbyte)/1000;
+	if (homa->priority_queues && (priority > 0)) {
+		int i;
+
+		/* The NIC serves higher-priority queues first, so this packet
+		 * waits only for packets at its priority or higher, but it
+		 * delays everything at its priority or lower.
+		 */
+		if (check && ((get_cycles() + homa->max_nic_queue_cycles)
+				< atomic64_read(&nic->prio_idle_time[priority])))
+			return 0;
+		for (i = priority; i > 0; i--) {
+			do {
+				clock = get_cycles();
+				idle = atomic64_read(&nic->prio_idle_time[i]);
+				new_idle = ((idle < clock) ? clock : idle)
+						+ cycles_for_packet;
+			} while (atomic64_cmpxchg_relaxed(
+					&nic->prio_idle_time[i], idle, new_idle)
+					!= idle);
+		}
+		check = false;
+	}
 	while (1) {
 		clock = get_cycles();
-		idle = atomic64_read(&homa->link_idle_time);
-		if (((clock + homa->max_nic_queue_cycles) < idle) && !force
-				&& !(homa->flags & HOMA_FLAG_DONT_THROTTLE))
+		idle = atomic64_read(&nic->link_idle_time);
+		if (((clock + homa->max_nic_queue_cycles) < idle) && check)
 			return 0;
-		if (!list_empty(&homa->throttled_rpcs))
+		if (READ_ONCE(homa->throttled_pacers))
 			INC_METRIC(pacer_bytes, bytes);
 		if (idle < clock) {
-			if (homa->pacer_wake_time) {
-				__u64 lost = (homa->pacer_wake_time > idle)
-						? clock - homa->pacer_wake_time
+			__u64 wake_time = homa_pacer_wake_time(homa);
+
+			if (wake_time) {
+				__u64 lost = (wake_time > idle)
+						? clock - wake_time
 						: clock - idle;
 				INC_METRIC(pacer_lost_cycles, lost);
-				tt_record1("pacer lost %d cycles", lost);
+				tt_record_cat1(TT_PACER,
+						"pacer lost %d cycles", lost);
 			}
 			new_idle = clock + cycles_for_packet;
 		} else
 			new_idle = idle + cycles_for_packet;
 
 		/* This method must be thread-safe. */
-		if (atomic64_cmpxchg_relaxed(&homa->link_idle_time, idle,
+		if (atomic64_cmpxchg_relaxed(&nic->link_idle_time, idle,
 				new_idle) == idle)
 			break;
 	}
@@ -702,68 +1452,306 @@ int homa_check_nic_queue(struct homa *homa, struct sk_buff *skb, bool force)
 }
 
 /**
- * homa_pacer_main() - Top-level function for the pacer thread.
- * @transportInfo:  Pointer to struct homa.
+ * homa_throttle_bucket() - Returns the index of the list in a pacer's
+ * throttled_rpcs where an RPC belongs.
+ * @rpc:     RPC of interest.
+ * Return:   Index in the throttled_rpcs array.
+ */
+static inline int homa_throttle_bucket(struct homa_rpc *rpc)
+{
+	int index = fls(rpc->msgout.length - rpc->msgout.next_xmit_offset);
+
+	return (index < HOMA_THROTTLE_BUCKETS) ? index
+			: HOMA_THROTTLE_BUCKETS - 1;
+}
+
+/**
+ * homa_throttle_insert() - Add an RPC to the appropriate list of a pacer's
+ * throttled queue, in order of bytes left to transmit. The caller must
+ * hold the RPC's lock and the pacer's throttle lock, and the RPC must not
+ * currently be in the queue.
+ * @pacer:   Pacer whose queue should hold @rpc.
+ * @rpc:     RPC to add.
+ * Return:   The number of RPCs examined to find the insertion point.
+ */
+static int homa_throttle_insert(struct homa_pacer *pacer,
+		struct homa_rpc *rpc)
+{
+	int bytes_left = rpc->msgout.length - rpc->msgout.next_xmit_offset;
+	int bucket = homa_throttle_bucket(rpc);
+	struct list_head *head = &pacer->throttled_rpcs[bucket];
+	struct homa_rpc *candidate;
+	int checks = 0;
+
+	rpc->throttle_bucket = bucket;
+	pacer->nonempty_buckets |= 1U << bucket;
+
+	/* Only the RPCs in this bucket need to be examined in order to
+	 * find the correct position.
+	 */
+	list_for_each_entry(candidate, head, throttled_links) {
+		int bytes_left_cand;
+		checks++;
+
+		/* Watch out: the pacer might have just transmitted the last
+		 * packet from candidate.
+		 */
+		bytes_left_cand = candidate->msgout.length -
+				candidate->msgout.next_xmit_offset;
+		if (bytes_left_cand > bytes_left) {
+			list_add_tail(&rpc->throttled_links,
+					&candidate->throttled_links);
+			return checks;
+		}
+	}
+	list_add_tail(&rpc->throttled_links, head);
+	return checks;
+}
+
+/**
+ * homa_throttle_rebucket() - Invoked after an RPC in a throttled queue has
+ * transmitted data; if it now has few enough bytes left to belong in a
+ * lower list of the queue, move it there. The caller must hold the RPC's
+ * lock, but not its pacer's throttle lock.
+ * @rpc:     RPC of interest.
+ */
+static void homa_throttle_rebucket(struct homa_rpc *rpc)
+{
+	struct homa_pacer *pacer = rpc->pacer;
+	int old = rpc->throttle_bucket;
+
+	/* The bucket can only change when the RPC's lock is held, so
+	 * there's no need for the throttle lock to check it.
+	 */
+	if (homa_throttle_bucket(rpc) == old)
+		return;
+	homa_throttle_lock(pacer);
+	if (!list_empty(&rpc->throttled_links)) {
+		list_del(&rpc->throttled_links);
+		if (list_empty(&pacer->throttled_rpcs[old]))
+			pacer->nonempty_buckets &= ~(1U << old);
+		INC_METRIC(throttle_list_checks,
+				homa_throttle_insert(pacer, rpc));
+	}
+	homa_throttle_unlock(pacer);
+}
+
+/**
+ * homa_throttle_first() - Returns the highest priority RPC in a pacer's
+ * throttled queue. The caller must hold the pacer's throttle lock.
+ * @pacer:   Pacer of interest.
+ * Return:   The RPC with the fewest bytes left to transmit (approximately),
+ *           or NULL if the queue is empty.
+ */
+static inline struct homa_rpc *homa_throttle_first(struct homa_pacer *pacer)
+{
+	if (pacer->nonempty_buckets == 0)
+		return NULL;
+	return list_first_entry(
+			&pacer->throttled_rpcs[__ffs(pacer->nonempty_buckets)],
+			struct homa_rpc, throttled_links);
+}
+
+/**
+ * homa_throttle_choose_weighted() - Selects the throttled RPC that the
+ * pacer should transmit next when homa->weighted_shares is set: this is
+ * the RPC with the fewest bytes left among those whose socket has the
+ * smallest virtual time (see homa_sock.pacer_vtime). The caller must hold
+ * @pacer's throttle lock.
+ * @pacer:   Pacer whose throttled RPCs should be considered.
+ * Return:   The chosen RPC, or NULL if the queue is empty.
+ */
+struct homa_rpc *homa_throttle_choose_weighted(struct homa_pacer *pacer)
+{
+	struct homa_rpc *cur, *best = NULL;
+	__u64 best_vtime = ~0;
+	int bucket, checks = 0;
+
+	for (bucket = 0; bucket < HOMA_THROTTLE_BUCKETS; bucket++) {
+		list_for_each_entry(cur, &pacer->throttled_rpcs[bucket],
+				throttled_links) {
+			__u64 vtime = READ_ONCE(cur->hsk->pacer_vtime);
+
+			checks++;
+			if (vtime < pacer->vtime)
+				vtime = pacer->vtime;
+			if (vtime >= best_vtime)
+				continue;
+			best = cur;
+			best_vtime = vtime;
+
+			/* No socket can have a virtual time less than the
+			 * pacer's, so nothing later can beat this RPC.
+			 */
+			if (vtime == pacer->vtime)
+				goto done;
+		}
+	}
+    done:
+	INC_METRIC(pacer_share_checks, checks);
+	return best;
+}
+
+/**
+ * homa_pacer_charge() - Invoked after the pacer transmits data for an RPC,
+ * to account for the transmission in the RPC's socket.
+ * @pacer:   Pacer that transmitted the data.
+ * @rpc:     RPC whose data was transmitted.
+ * @bytes:   Number of bytes of message data transmitted.
+ */
+static void homa_pacer_charge(struct homa_pacer *pacer, struct homa_rpc *rpc,
+		int bytes)
+{
+	struct homa_sock *hsk = rpc->hsk;
+	__u64 start;
+
+	if (bytes <= 0)
+		return;
+	atomic64_add(bytes, &hsk->paced_bytes);
+
+	/* Sockets that have been idle start from the pacer's current
+	 * virtual time, so they can't save up credit while idle.
+	 */
+	start = READ_ONCE(hsk->pacer_vtime);
+	if (start < pacer->vtime)
+		start = pacer->vtime;
+	pacer->vtime = start;
+	WRITE_ONCE(hsk->pacer_vtime, start + (__u64) bytes * HOMA_MAX_WEIGHT
+			/ READ_ONCE(hsk->weight));
+}
+
+/**
+ * homa_throttle_del() - Remove an RPC from its pacer's throttled queue.
+ * The caller must hold the pacer's throttle lock, and the RPC must be
+ * in the queue.
+ * @rpc:     RPC to remove.
+ */
+static void homa_throttle_del(struct homa_rpc *rpc)
+{
+	struct homa_pacer *pacer = rpc->pacer;
+	struct list_head *head = rpc->throttled_links.next;
+
+	homa_record_latency(HOMA_LAT_THROTTLED, rpc->msgout.length,
+			get_cycles() - rpc->cold->throttle_cycles);
+	list_del_init(&rpc->throttled_links);
+
+	/* If the RPC was the only element in its list, then its successor
+	 * was the list head, which is now empty.
+	 */
+	if (list_empty(head)) {
+		pacer->nonempty_buckets &= ~(1U << (head - pacer->throttled_rpcs));
+		if (pacer->nonempty_buckets == 0) {
+			clear_bit(pacer->id, &pacer->homa->throttled_pacers);
+			INC_METRIC(throttled_cycles, get_cycles()
+					- pacer->throttle_add);
+		}
+	}
+}
+
+/**
+ * homa_pacer_main() - Top-level function for a pacer thread.
+ * @arg:      Pointer to the struct homa_pacer for this thread.
  *
  * Return:         Always 0.
  */
-int homa_pacer_main(void *transportInfo)
+int homa_pacer_main(void *arg)
 {
-	struct homa *homa = (struct homa *) transportInfo;
+	struct homa_pacer *pacer = (struct homa_pacer *) arg;
+	struct homa *homa = pacer->homa;
 
-	homa->pacer_wake_time = get_cycles();
+	pacer->wake_time = get_cycles();
 	while (1) {
 		if (homa->pacer_exit) {
-			homa->pacer_wake_time = 0;
+			pacer->wake_time = 0;
 			break;
 		}
-		homa_pacer_xmit(homa);
+		homa_pacer_xmit(pacer);
 
-		/* Sleep this thread if the throttled list is empty. Even
-		 * if the throttled list isn't empty, call the scheduler
+		/* Sleep this thread if the throttled queue is empty. Even
+		 * if the throttled queue isn't empty, call the scheduler
 		 * to give other processes a chance to run (if we don't,
 		 * softirq handlers can get locked out, which prevents
 		 * incoming packets from being handled).
 		 */
 		set_current_state(TASK_INTERRUPTIBLE);
-		if (list_first_or_null_rcu(&homa->throttled_rpcs,
-				struct homa_rpc, throttled_links) == NULL)
-			tt_record("pacer sleeping");
+		if (READ_ONCE(pacer->nonempty_buckets) == 0)
+			tt_record1("pacer %d sleeping", pacer->id);
 		else
 			__set_current_state(TASK_RUNNING);
-		INC_METRIC(pacer_cycles, get_cycles() - homa->pacer_wake_time);
-		homa->pacer_wake_time = 0;
+		INC_METRIC(pacer_cycles, get_cycles() - pacer->wake_time);
+		pacer->wake_time = 0;
 		schedule();
-		homa->pacer_wake_time = get_cycles();
+		pacer->wake_time = get_cycles();
 		__set_current_state(TASK_RUNNING);
 	}
-	kthread_complete_and_exit(&homa_pacer_kthread_done, 0);
+	kthread_complete_and_exit(&pacer->kthread_done, 0);
 	return 0;
 }
 
 /**
- * homa_pacer_xmit() - Transmit packets from  the throttled list. Note:
- * this function may be invoked from either process context or softirq (BH)
- * level. This function is invoked from multiple places, not just in the
- * pacer thread. The reason for this is that (as of 10/2019) Linux's scheduling
- * of the pacer thread is unpredictable: the thread may block for long periods
- * of time (e.g., because it is assigned to the same CPU as a busy interrupt
- * handler). This can result in poor utilization of the network link. So,
- * this method gets invoked from other places as well, to increase the
- * likelihood that we keep the link busy. Those other invocations are not
- * guaranteed to happen, so the pacer thread provides a backstop.
+ * homa_pacer_start() - Make sure that there is a running pacer thread for
+ * each of the first homa->num_pacers entries in homa->pacers, then update
+ * homa->active_pacers to match. Must be invoked in process context.
  * @homa:    Overall data about the Homa protocol implementation.
+ *
+ * Return:   0 for success, or a negative errno if a thread couldn't
+ *           be created.
+ */
+int homa_pacer_start(struct homa *homa)
+{
+	struct homa_pacer *pacer;
+	int i, err = 0;
+
+	for (i = 0; i < homa->num_pacers; i++) {
+		pacer = &homa->pacers[i];
+		if (pacer->kthread)
+			continue;
+		pacer->kthread = kthread_run(homa_pacer_main, pacer,
+				"homa_pacer%d", i);
+		if (IS_ERR(pacer->kthread)) {
+			err = PTR_ERR(pacer->kthread);
+			pacer->kthread = NULL;
+			printk(KERN_ERR "couldn't create homa pacer thread %d: "
+					"error %d\n", i, err);
+			break;
+		}
+	}
+
+	/* Don't let homa_add_to_throttled use a pacer until its thread
+	 * is running.
+	 */
+	if (i > 0)
+		WRITE_ONCE(homa->active_pacers, i);
+	return err;
+}
+
+/**
+ * homa_pacer_xmit() - Transmit packets from a pacer's throttled queue.
+ * Note: this function may be invoked from either process context or
+ * softirq (BH) level. This function is invoked from multiple places, not
+ * just in the pacer thread. The reason for this is that (as of 10/2019)
+ * Linux's scheduling of the pacer thread is unpredictable: the thread may
+ * block for long periods of time (e.g., because it is assigned to the same
+ * CPU as a busy interrupt handler). This can result in poor utilization of
+ * the network link. So, this method gets invoked from other places as well,
+ * to increase the likelihood that we keep the link busy. Those other
+ * invocations are not guaranteed to happen, so the pacer thread provides
+ * a backstop.
+ * @pacer:   Pacer whose throttled RPCs should be transmitted.
  */
-void homa_pacer_xmit(struct homa *homa)
+void homa_pacer_xmit(struct homa_pacer *pacer)
 {
+	struct homa *homa = pacer->homa;
+	struct homa_xmit_batch batch;
 	struct homa_rpc *rpc;
-        int i;
+	int i, offset;
 
 	/* Make sure only one instance of this function executes at a
-	 * time.
+	 * time for this pacer.
 	 */
-	if (!spin_trylock_bh(&homa->pacer_mutex))
+	if (!spin_trylock_bh(&pacer->mutex))
 		return;
+	homa_xmit_batch_init(&batch);
 
 	/* Each iteration through the following loop sends one packet. We
 	 * limit the number of passes through this loop in order to cap the
@@ -771,25 +1759,8 @@ void homa_pacer_xmit(struct homa *homa)
 	 * homa_pacer_main about interfering with softirq handlers).
 	 */
 	for (i = 0; i < 5; i++) {
-		__u64 idle_time, now;
-
-		/* If the NIC queue is too long, wait until it gets shorter. */
-		now = get_cycles();
-		idle_time = atomic64_read(&homa->link_idle_time);
-		while ((now + homa->max_nic_queue_cycles) < idle_time) {
-			/* If we've xmitted at least one packet then
-			 * return (this helps with testing and also
-			 * allows homa_pacer_main to yield the core).
-			 */
-			if (i != 0)
-				goto done;
-			now = get_cycles();
-		}
-		/* Note: when we get here, it's possible that the NIC queue is
-		 * still too long because other threads have queued packets,
-		 * but we transmit anyway so we don't starve (see perf.text
-		 * for more info).
-		 */
+		struct homa_nic *nic;
+		__u64 now;
 
 		/* Lock the first throttled RPC. This may not be possible
 		 * because we have to hold throttle_lock while locking
@@ -799,182 +1770,223 @@ void homa_pacer_xmit(struct homa *homa)
 		 * throttle lock while locking the RPC is important because
 		 * it keeps the RPC from being deleted before it can be locked.
 		 */
-		homa_throttle_lock(homa);
-		homa->pacer_fifo_count -= homa->pacer_fifo_fraction;
-		if (homa->pacer_fifo_count <= 0) {
+		homa_throttle_lock(pacer);
+		pacer->fifo_count -= homa->pacer_fifo_fraction;
+		if (pacer->fifo_count <= 0) {
 			__u64 oldest = ~0;
 			struct homa_rpc *cur;
+			int bucket;
 
-			homa->pacer_fifo_count += 1000;
+			pacer->fifo_count += 1000;
 			rpc = NULL;
-			list_for_each_entry_rcu(cur, &homa->throttled_rpcs,
-					throttled_links) {
-				if (cur->msgout.init_cycles < oldest) {
-					rpc = cur;
-					oldest = cur->msgout.init_cycles;
+			for (bucket = 0; bucket < HOMA_THROTTLE_BUCKETS;
+					bucket++) {
+				list_for_each_entry(cur,
+						&pacer->throttled_rpcs[bucket],
+						throttled_links) {
+					if (cur->msgout.init_cycles < oldest) {
+						rpc = cur;
+						oldest = cur->msgout.init_cycles;
+					}
 				}
 			}
-		} else
-			rpc = list_first_or_null_rcu(&homa->throttled_rpcs,
-					struct homa_rpc, throttled_links);
+		} else if (homa->weighted_shares)
+			rpc = homa_throttle_choose_weighted(pacer);
+		else
+			rpc = homa_throttle_first(pacer);
 		if (rpc == NULL) {
-			homa_throttle_unlock(homa);
+			homa_throttle_unlock(pacer);
 			break;
 		}
 		if (!(spin_trylock_bh(rpc->lock))) {
-			homa_throttle_unlock(homa);
+			homa_throttle_unlock(pacer);
 			INC_METRIC(pacer_skipped_rpcs, 1);
 			break;
 		}
-		homa_throttle_unlock(homa);
+		homa_throttle_unlock(pacer);
 
-		tt_record4("pacer calling homa_xmit_data for rpc id %llu, "
+		/* If the queue for the NIC that this RPC's packets will use
+		 * is too long, wait until it gets shorter.
+		 */
+		nic = homa_get_nic(rpc->peer, rpc->hsk);
+		now = get_cycles();
+		if ((now + homa->max_nic_queue_cycles)
+				< atomic64_read(&nic->link_idle_time)) {
+			/* If we've xmitted at least one packet then
+			 * return (this helps with testing and also
+			 * allows homa_pacer_main to yield the core).
+			 * Otherwise, don't hold the RPC lock while waiting.
+			 */
+			homa_rpc_unlock(rpc);
+			if (i != 0)
+				goto done;
+			while ((now + homa->max_nic_queue_cycles)
+					< atomic64_read(&nic->link_idle_time))
+				now = get_cycles();
+			continue;
+		}
+		/* Note: when we get here, it's possible that the NIC queue is
+		 * still too long because other threads have queued packets,
+		 * but we transmit anyway so we don't starve (see perf.text
+		 * for more info).
+		 */
+
+		tt_record_cat4(TT_PACER,
+				"pacer calling homa_xmit_data for rpc id %llu, "
 				"port %d, offset %d, bytes_left %d",
 				rpc->id, rpc->hsk->port,
 				rpc->msgout.next_xmit_offset,
 				rpc->msgout.length - rpc->msgout.next_xmit_offset);
-		homa_xmit_data(rpc, true);
+		offset = rpc->msgout.next_xmit_offset;
+		homa_xmit_data_batch(rpc, true, &batch);
+		homa_pacer_charge(pacer, rpc,
+				rpc->msgout.next_xmit_offset - offset);
 		if (!*rpc->msgout.next_xmit || (rpc->msgout.next_xmit_offset
 				>= rpc->msgout.granted)) {
 			/* Nothing more to transmit from this message (right now),
-			 * so remove it from the throttled list.
+			 * so remove it from the throttled queue.
 			 */
-			homa_throttle_lock(homa);
+			homa_throttle_lock(pacer);
 			if (!list_empty(&rpc->throttled_links)) {
-				tt_record2("pacer removing id %d from "
+				tt_record_cat2(TT_PACER,
+						"pacer removing id %d from "
 						"throttled list, offset %d",
 						rpc->id,
 						rpc->msgout.next_xmit_offset);
-				list_del_rcu(&rpc->throttled_links);
-				if (list_empty(&homa->throttled_rpcs))
-					INC_METRIC(throttled_cycles, get_cycles()
-							- homa->throttle_add);
-
-				/* Note: this reinitialization is only safe
-				 * because the pacer only looks at the first
-				 * element of the list, rather than traversing
-				 * it (and besides, we know the pacer isn't
-				 * active concurrently, since this code *is*
-				 * the pacer). It would not be safe under more
-				 * general usage patterns.
-				 */
-				INIT_LIST_HEAD_RCU(&rpc->throttled_links);
+				homa_throttle_del(rpc);
 			}
-			homa_throttle_unlock(homa);
+			homa_throttle_unlock(pacer);
+		} else {
+			homa_throttle_rebucket(rpc);
 		}
 		homa_rpc_unlock(rpc);
 	}
     done:
-	spin_unlock_bh(&homa->pacer_mutex);
+	/* Packets from all of the RPCs serviced above go out together. */
+	homa_xmit_batch_flush(&batch);
+	spin_unlock_bh(&pacer->mutex);
 }
 
 /**
- * homa_pacer_stop() - Will cause the pacer thread to exit (waking it up
- * if necessary); doesn't return until after the pacer thread has exited.
+ * homa_pacer_stop() - Will cause all of the pacer threads to exit (waking
+ * them up if necessary); doesn't return until after the threads have exited.
  * @homa:    Overall data about the Homa protocol implementation.
  */
 void homa_pacer_stop(struct homa *homa)
 {
+	struct homa_pacer *pacer;
+	int i;
+
 	homa->pacer_exit = true;
-	wake_up_process(homa->pacer_kthread);
-	kthread_stop(homa->pacer_kthread);
-	homa->pacer_kthread = NULL;
+	for (i = 0; i < HOMA_MAX_PACERS; i++) {
+		pacer = &homa->pacers[i];
+		if (!pacer->kthread)
+			continue;
+		wake_up_process(pacer->kthread);
+		kthread_stop(pacer->kthread);
+		wait_for_completion(&pacer->kthread_done);
+		pacer->kthread = NULL;
+	}
 }
 
 /**
- * homa_add_to_throttled() - Make sure that an RPC is on the throttled list
- * and wake up the pacer thread if necessary.
+ * homa_add_to_throttled() - Make sure that an RPC is on a throttled queue
+ * and wake up the pacer thread if necessary. RPCs are divided among pacers
+ * by peer, so all of the RPCs for a given peer are transmitted in SRPT
+ * order by a single pacer.
  * @rpc:     RPC with outbound packets that have been granted but can't be
  *           sent because of NIC queue restrictions.
  */
 void homa_add_to_throttled(struct homa_rpc *rpc)
 {
 	struct homa *homa = rpc->hsk->homa;
-	struct homa_rpc *candidate;
-	int bytes_left;
-	int checks = 0;
+	struct homa_pacer *pacer;
+	int num_pacers;
+	int checks;
 	__u64 now;
 
 	if (!list_empty(&rpc->throttled_links)) {
+		/* The RPC may have transmitted since it was queued. */
+		homa_throttle_rebucket(rpc);
 		return;
 	}
+	num_pacers = READ_ONCE(homa->active_pacers);
+	if (num_pacers <= 1)
+		pacer = &homa->pacers[0];
+	else
+		pacer = &homa->pacers[hash_32(
+				rpc->peer->addr.in6_u.u6_addr32[3], 16)
+				% num_pacers];
+	homa_throttle_lock(pacer);
 	now = get_cycles();
-	if (!list_empty(&homa->throttled_rpcs))
-		INC_METRIC(throttled_cycles, now - homa->throttle_add);
-	homa->throttle_add = now;
-	bytes_left = rpc->msgout.length - rpc->msgout.next_xmit_offset;
-	homa_throttle_lock(homa);
-	list_for_each_entry_rcu(candidate, &homa->throttled_rpcs,
-			throttled_links) {
-		int bytes_left_cand;
-		checks++;
-
-		/* Watch out: the pacer might have just transmitted the last
-		 * packet from candidate.
-		 */
-		bytes_left_cand = candidate->msgout.length -
-				candidate->msgout.next_xmit_offset;
-		if (bytes_left_cand > bytes_left) {
-			list_add_tail_rcu(&rpc->throttled_links,
-					&candidate->throttled_links);
-			goto done;
-		}
-	}
-	list_add_tail_rcu(&rpc->throttled_links, &homa->throttled_rpcs);
-done:
-	homa_throttle_unlock(homa);
-	wake_up_process(homa->pacer_kthread);
+	if (pacer->nonempty_buckets != 0)
+		INC_METRIC(throttled_cycles, now - pacer->throttle_add);
+	else
+		set_bit(pacer->id, &homa->throttled_pacers);
+	pacer->throttle_add = now;
+	rpc->pacer = pacer;
+	rpc->cold->throttle_cycles = now;
+	checks = homa_throttle_insert(pacer, rpc);
+	homa_throttle_unlock(pacer);
+	wake_up_process(pacer->kthread);
 	INC_METRIC(throttle_list_adds, 1);
 	INC_METRIC(throttle_list_checks, checks);
 //	tt_record("woke up pacer thread");
 }
 
 /**
- * homa_remove_from_throttled() - Make sure that an RPC is not on the
- * throttled list.
+ * homa_remove_from_throttled() - Make sure that an RPC is not on a
+ * throttled queue.
  * @rpc:     RPC of interest.
  */
 void homa_remove_from_throttled(struct homa_rpc *rpc)
 {
 	if (unlikely(!list_empty(&rpc->throttled_links))) {
+		struct homa_pacer *pacer = rpc->pacer;
+
 		UNIT_LOG("; ", "removing id %llu from throttled list", rpc->id);
-		homa_throttle_lock(rpc->hsk->homa);
-		list_del(&rpc->throttled_links);
-		if (list_empty(&rpc->hsk->homa->throttled_rpcs))
-			INC_METRIC(throttled_cycles, get_cycles()
-					- rpc->hsk->homa->throttle_add);
-		homa_throttle_unlock(rpc->hsk->homa);
-		INIT_LIST_HEAD(&rpc->throttled_links);
+		homa_throttle_lock(pacer);
+		homa_throttle_del(rpc);
+		homa_throttle_unlock(pacer);
 	}
 }
 
 /**
  * homa_log_throttled() - Print information to the system log about the
- * RPCs on the throttled list.
+ * RPCs on the throttled queues.
  * @homa:   Overall information about the Homa transport.
  */
 void homa_log_throttled(struct homa *homa)
 {
+	struct homa_pacer *pacer;
 	struct homa_rpc *rpc;
 	int rpcs = 0;
 	int64_t bytes = 0;
+	int i, bucket;
 
 	printk(KERN_NOTICE "Printing throttled list\n");
-	homa_throttle_lock(homa);
-	list_for_each_entry_rcu(rpc, &homa->throttled_rpcs, throttled_links) {
-		rpcs++;
-		if (!(spin_trylock_bh(rpc->lock))) {
-			printk(KERN_NOTICE "Skipping throttled RPC: locked\n");
-			continue;
+	for (i = 0; i < HOMA_MAX_PACERS; i++) {
+		pacer = &homa->pacers[i];
+		homa_throttle_lock(pacer);
+		for (bucket = 0; bucket < HOMA_THROTTLE_BUCKETS; bucket++) {
+			list_for_each_entry(rpc, &pacer->throttled_rpcs[bucket],
+					throttled_links) {
+				rpcs++;
+				if (!(spin_trylock_bh(rpc->lock))) {
+					printk(KERN_NOTICE "Skipping throttled "
+							"RPC: locked\n");
+					continue;
+				}
+				if (*rpc->msgout.next_xmit != NULL)
+					bytes += rpc->msgout.length
+						- rpc->msgout.next_xmit_offset;
+				if (rpcs <= 20)
+					homa_rpc_log(rpc);
+				homa_rpc_unlock(rpc);
+			}
 		}
-		if (*rpc->msgout.next_xmit != NULL)
-			bytes += rpc->msgout.length
-					- rpc->msgout.next_xmit_offset;
-		if (rpcs <= 20)
-			homa_rpc_log(rpc);
-		homa_rpc_unlock(rpc);
+		homa_throttle_unlock(pacer);
 	}
-	homa_throttle_unlock(homa);
 	printk(KERN_NOTICE "Finished printing throttle list: %d rpcs, "
 			"%lld bytes\n", rpcs, bytes);
 }
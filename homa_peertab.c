@@ -19,6 +19,62 @@
 
 #include "homa_impl.h"
 
+/**
+ * homa_peer_buckets_alloc() - Allocate and initialize a bucket array
+ * for a homa_peertab.
+ * @bits:     Number of bits in the bucket index for the new array.
+ * @link:     Which of the peertab_links in each homa_peer will be used
+ *            for chaining in the new array.
+ *
+ * Return:    The new array, or NULL if memory couldn't be allocated.
+ */
+static struct homa_peer_buckets *homa_peer_buckets_alloc(int bits, int link)
+{
+	struct homa_peer_buckets *buckets;
+	int i;
+
+	buckets = (struct homa_peer_buckets *) vmalloc(sizeof(*buckets)
+			+ (sizeof(struct hlist_head) << bits));
+	if (!buckets)
+		return NULL;
+	buckets->bits = bits;
+	buckets->link = link;
+	for (i = 0; i < (1 << bits); i++)
+		INIT_HLIST_HEAD(&buckets->heads[i]);
+	return buckets;
+}
+
+/**
+ * homa_peer_bucket() - Compute the bucket index for an address.
+ * @peertab:  Table containing the bucket array.
+ * @buckets:  Bucket array in which @addr will be looked up.
+ * @addr:     Address of the desired host.
+ *
+ * Return:    Index into @buckets->heads.
+ */
+static inline __u32 homa_peer_bucket(struct homa_peertab *peertab,
+		struct homa_peer_buckets *buckets, const struct in6_addr *addr)
+{
+	return jhash2(addr->in6_u.u6_addr32, 4, peertab->hash_seed)
+			& ((1 << buckets->bits) - 1);
+}
+
+/**
+ * homa_peer_entry() - Given one of the links in a bucket chain, return
+ * the homa_peer containing it.
+ * @node:     Link in a chain for a homa_peer_buckets; may be NULL.
+ * @link:     Which element of peertab_links @node refers to.
+ *
+ * Return:    The homa_peer containing @node, or NULL if @node is NULL.
+ */
+static inline struct homa_peer *homa_peer_entry(struct hlist_node *node,
+		int link)
+{
+	if (!node)
+		return NULL;
+	return container_of(node - link, struct homa_peer, peertab_links[0]);
+}
+
 /**
  * homa_peertab_init() - Constructor for homa_peertabs.
  * @peertab:  The object to initialize; previous contents are discarded.
@@ -31,16 +87,17 @@ int homa_peertab_init(struct homa_peertab *peertab)
 	 * safe to call homa_peertab_destroy, even if this function returns
 	 * an error.
 	 */
-	int i;
+	struct homa_peer_buckets *buckets;
+
 	spin_lock_init(&peertab->write_lock);
 	INIT_LIST_HEAD(&peertab->dead_dsts);
-	peertab->buckets = (struct hlist_head *) vmalloc(
-			HOMA_PEERTAB_BUCKETS * sizeof(*peertab->buckets));
-	if (!peertab->buckets)
+	get_random_bytes(&peertab->hash_seed, sizeof(peertab->hash_seed));
+	peertab->num_peers = 0;
+	peertab->sweep_bucket = 0;
+	buckets = homa_peer_buckets_alloc(HOMA_PEERTAB_MIN_BITS, 0);
+	RCU_INIT_POINTER(peertab->buckets, buckets);
+	if (!buckets)
 		return -ENOMEM;
-	for (i = 0; i < HOMA_PEERTAB_BUCKETS; i++) {
-		INIT_HLIST_HEAD(&peertab->buckets[i]);
-	}
 	return 0;
 }
 
@@ -53,20 +110,27 @@ int homa_peertab_init(struct homa_peertab *peertab)
  */
 void homa_peertab_destroy(struct homa_peertab *peertab)
 {
-	int i;
+	struct homa_peer_buckets *buckets;
+	struct hlist_node *node, *next;
 	struct homa_peer *peer;
-	struct hlist_node *next;
-	if (!peertab->buckets)
+	int i;
+
+	buckets = rcu_dereference_protected(peertab->buckets, 1);
+	if (!buckets)
 		return;
 
-	for (i = 0; i < HOMA_PEERTAB_BUCKETS; i++) {
-		hlist_for_each_entry_safe(peer, next, &peertab->buckets[i],
-				peertab_links) {
+	/* Wait for any evicted peers to be freed. */
+	rcu_barrier();
+	for (i = 0; i < (1 << buckets->bits); i++) {
+		for (node = buckets->heads[i].first; node; node = next) {
+			next = node->next;
+			peer = homa_peer_entry(node, buckets->link);
 			dst_release(peer->dst);
 			kfree(peer);
 		}
 	}
-	vfree(peertab->buckets);
+	RCU_INIT_POINTER(peertab->buckets, NULL);
+	vfree(buckets);
 	homa_peertab_gc_dsts(peertab, ~0);
 }
 
@@ -76,44 +140,52 @@ void homa_peertab_destroy(struct homa_peertab *peertab)
  * @peertab:    The table to search for peers.
  * @num_peers:  Modified to hold the number of peers returned.
  * Return:      kmalloced array holding pointers to all known peers. The
- *		caller must free this. If there is an error, or if there
+ *		caller must free this, and must call homa_peer_put for
+ *		each of the peers. If there is an error, or if there
  *	        are no peers, NULL is returned.
  */
 struct homa_peer ** homa_peertab_get_peers(struct homa_peertab *peertab,
 		int *num_peers)
 {
-	int i, count;
-	struct homa_peer *peer;
-	struct hlist_node *next;
+	struct homa_peer_buckets *buckets;
 	struct homa_peer **result;
+	struct hlist_node *node;
+	int i, count;
 
 	*num_peers = 0;
-	if (!peertab->buckets)
+	if (!rcu_access_pointer(peertab->buckets))
 		return NULL;
 
-	/* Figure out how many peers there are. */
-	count = 0;
-	for (i = 0; i < HOMA_PEERTAB_BUCKETS; i++) {
-		hlist_for_each_entry_safe(peer, next, &peertab->buckets[i],
-				peertab_links)
-			count++;
-	}
-
+	/* The table may grow between here and the scan below (peers are
+	 * never removed), so return at most the number counted now.
+	 */
+	count = READ_ONCE(peertab->num_peers);
 	if (count == 0)
 		return NULL;
 
-	result = (struct homa_peer **) kmalloc(count*sizeof(peer), GFP_KERNEL);
+	result = (struct homa_peer **) kmalloc(count*sizeof(*result),
+			GFP_KERNEL);
 	if (result == NULL)
 		return NULL;
-	*num_peers = count;
-	count = 0;
-	for (i = 0; i < HOMA_PEERTAB_BUCKETS; i++) {
-		hlist_for_each_entry_safe(peer, next, &peertab->buckets[i],
-				peertab_links) {
-			result[count] = peer;
-			count++;
+	rcu_read_lock();
+	buckets = rcu_dereference(peertab->buckets);
+	for (i = 0; (i < (1 << buckets->bits)) && (*num_peers < count); i++) {
+		for (node = rcu_dereference(hlist_first_rcu(
+				&buckets->heads[i])); node != NULL;
+				node = rcu_dereference(hlist_next_rcu(node))) {
+			struct homa_peer *peer = homa_peer_entry(node,
+					buckets->link);
+
+			/* Skip peers that are in the midst of eviction. */
+			if (!atomic_inc_not_zero(&peer->refs))
+				continue;
+			result[*num_peers] = peer;
+			(*num_peers)++;
+			if (*num_peers >= count)
+				break;
 		}
 	}
+	rcu_read_unlock();
 	return result;
 }
 
@@ -139,6 +211,204 @@ void homa_peertab_gc_dsts(struct homa_peertab *peertab, __u64 now)
 	}
 }
 
+/**
+ * homa_peer_free_rcu() - RCU callback that frees a homa_peer once it
+ * can no longer be referenced by lookups in progress.
+ * @head:     The rcu_head in the homa_peer to free.
+ */
+static void homa_peer_free_rcu(struct rcu_head *head)
+{
+	struct homa_peer *peer = container_of(head, struct homa_peer,
+			rcu_head);
+
+	dst_release(peer->dst);
+	kfree(peer);
+}
+
+/**
+ * homa_peertab_sweep() - Invoked periodically in process context (by
+ * homa_timer) to evict peers that are no longer in use. Each call
+ * examines a fraction of the table (a clock sweep); peers with no
+ * references other than the table's are evicted if they have been idle
+ * for @idle_jiffies or if the table holds more than @max_peers peers.
+ * @peertab:       Table to sweep.
+ * @idle_jiffies:  A peer must have been idle this long to be evicted
+ *                 (unless the table is over its limit).
+ * @max_peers:     If there are more than this many peers in the table, peers
+ *                 not in use are evicted regardless of idle time (and the
+ *                 sweep continues until the table is back under the limit
+ *                 or every bucket has been examined).
+ */
+void homa_peertab_sweep(struct homa_peertab *peertab,
+		unsigned long idle_jiffies, int max_peers)
+{
+	struct homa_peer_buckets *buckets;
+	struct hlist_node *node, *next;
+	struct homa_peer *peer;
+	int num_buckets, chunk, i;
+
+	/* The bucket array is only replaced by the timer thread, which
+	 * is also the only caller of this function.
+	 */
+	buckets = rcu_dereference_protected(peertab->buckets, 1);
+	if (!buckets)
+		return;
+	num_buckets = 1 << buckets->bits;
+	chunk = num_buckets >> HOMA_PEER_SWEEP_SHIFT;
+	if (chunk == 0)
+		chunk = 1;
+	if (peertab->sweep_bucket >= num_buckets)
+		peertab->sweep_bucket = 0;
+	spin_lock_bh(&peertab->write_lock);
+	for (i = 0; i < num_buckets; i++) {
+		int over = peertab->num_peers > max_peers;
+
+		if ((i >= chunk) && !over)
+			break;
+		for (node = buckets->heads[peertab->sweep_bucket].first;
+				node; node = next) {
+			next = node->next;
+			peer = homa_peer_entry(node, buckets->link);
+
+			/* A peer with pending acks is not evicted: only
+			 * RPC holders add acks, so num_acks can't change
+			 * while the table holds the only reference. Nor is
+			 * one still linked into homa->ack_peers (it is
+			 * only unlinked by homa_peer_flush_acks, which runs
+			 * in the same thread as this function).
+			 */
+			if ((atomic_read(&peer->refs) != 1) || peer->num_acks
+					|| !list_empty(&peer->ack_links))
+				continue;
+			if (!over && time_before(jiffies,
+					READ_ONCE(peer->last_put)
+					+ idle_jiffies))
+				continue;
+			if (atomic_cmpxchg(&peer->refs, 1, 0) != 1)
+				continue;
+			hlist_del_rcu(&peer->peertab_links[buckets->link]);
+			peertab->num_peers--;
+			INC_METRIC(peer_evictions, 1);
+			call_rcu(&peer->rcu_head, homa_peer_free_rcu);
+			over = peertab->num_peers > max_peers;
+		}
+		peertab->sweep_bucket++;
+		if (peertab->sweep_bucket >= num_buckets)
+			peertab->sweep_bucket = 0;
+	}
+	spin_unlock_bh(&peertab->write_lock);
+}
+
+/**
+ * homa_peertab_resize() - Replace the bucket array for a peer table with
+ * one of a different size. Lookups may proceed concurrently in the old
+ * array, but this function must not be invoked concurrently with itself;
+ * it may block, so it must be invoked in process context.
+ * @peertab:    Table to resize.
+ * @bits:       Number of bits in the bucket index of the new array.
+ *
+ * Return:      0 for success, or a negative errno if memory couldn't
+ *              be allocated (the table is unchanged in this case).
+ */
+int homa_peertab_resize(struct homa_peertab *peertab, int bits)
+{
+	struct homa_peer_buckets *old, *new;
+	struct hlist_node *node;
+	struct homa_peer *peer;
+	int i;
+
+	old = rcu_dereference_protected(peertab->buckets, 1);
+	new = homa_peer_buckets_alloc(bits, old->link ^ 1);
+	if (!new)
+		return -ENOMEM;
+
+	/* Each peer is linked into the new array using its other set of
+	 * links, so concurrent lookups can keep walking the old array.
+	 * The write lock keeps new peers from being added while we do this.
+	 */
+	spin_lock_bh(&peertab->write_lock);
+	for (i = 0; i < (1 << old->bits); i++) {
+		for (node = old->heads[i].first; node; node = node->next) {
+			peer = homa_peer_entry(node, old->link);
+			hlist_add_head(&peer->peertab_links[new->link],
+					&new->heads[homa_peer_bucket(peertab,
+					new, &peer->addr)]);
+		}
+	}
+	rcu_assign_pointer(peertab->buckets, new);
+	spin_unlock_bh(&peertab->write_lock);
+
+	/* Once all readers of the old array are gone, its links can be
+	 * reused in the next resize.
+	 */
+	synchronize_rcu();
+	vfree(old);
+	INC_METRIC(peertab_resizes, 1);
+	return 0;
+}
+
+/**
+ * homa_peertab_check_resize() - Invoked periodically in process context
+ * (by homa_timer) to grow a peer table if it has become too crowded.
+ * @peertab:    Table to check.
+ */
+void homa_peertab_check_resize(struct homa_peertab *peertab)
+{
+	/* The bucket array is only replaced by this function (which is
+	 * invoked from a single thread), so no RCU protection is needed.
+	 */
+	struct homa_peer_buckets *buckets = rcu_dereference_protected(
+			peertab->buckets, 1);
+	int bits;
+
+	if (!buckets)
+		return;
+	bits = buckets->bits;
+	while ((READ_ONCE(peertab->num_peers) > (1 << bits))
+			&& (bits < HOMA_PEERTAB_MAX_BITS))
+		bits++;
+	if (bits != buckets->bits)
+		homa_peertab_resize(peertab, bits);
+}
+
+/**
+ * homa_peer_lookup() - Returns the peer associated with a given host,
+ * if there is one; unlike homa_peer_find, this never creates a peer.
+ * @peertab:    Peer table in which to perform lookup.
+ * @addr:       Address of the desired host: IPv4 addresses are represented
+ *              as IPv4-mapped IPv6 addresses.
+ *
+ * Return:      The peer associated with @addr, or NULL if there is none.
+ *              The peer is returned with a reference held on behalf of the
+ *              caller, which must eventually call homa_peer_put.
+ */
+struct homa_peer *homa_peer_lookup(struct homa_peertab *peertab,
+		const struct in6_addr *addr)
+{
+	struct homa_peer_buckets *buckets;
+	struct homa_peer *result = NULL;
+	struct hlist_node *node;
+	struct homa_peer *peer;
+	__u32 bucket;
+
+	rcu_read_lock();
+	buckets = rcu_dereference(peertab->buckets);
+	bucket = homa_peer_bucket(peertab, buckets, addr);
+	for (node = rcu_dereference(hlist_first_rcu(&buckets->heads[bucket]));
+			node != NULL;
+			node = rcu_dereference(hlist_next_rcu(node))) {
+		peer = homa_peer_entry(node, buckets->link);
+		if (ipv6_addr_equal(&peer->addr, addr)) {
+			/* A peer that is being evicted has no RPCs. */
+			if (atomic_inc_not_zero(&peer->refs))
+				result = peer;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	return result;
+}
+
 /**
  * homa_peer_find() - Returns the peer associated with a given host; creates
  * a new homa_peer if one doesn't already exist.
@@ -148,42 +418,60 @@ void homa_peertab_gc_dsts(struct homa_peertab *peertab, __u64 now)
  * @inet:       Socket that will be used for sending packets.
  *
  * Return:      The peer associated with @addr, or a negative errno if an
- *              error occurred. The caller can retain this pointer
- *              indefinitely: peer entries are never deleted except in
- *              homa_peertab_destroy.
+ *              error occurred. The peer is returned with a reference
+ *              held on behalf of the caller, which must eventually call
+ *              homa_peer_put; until then, the peer will not be evicted.
  */
 struct homa_peer *homa_peer_find(struct homa_peertab *peertab,
 		const struct in6_addr *addr, struct inet_sock *inet)
 {
 	/* Note: this function uses RCU operators to ensure safety even
-	 * if a concurrent call is adding a new entry.
+	 * if a concurrent call is adding a new entry or resizing the
+	 * table.
 	 */
+	struct homa_peer_buckets *buckets;
+	struct hlist_node *node;
 	struct homa_peer *peer;
 	struct dst_entry *dst;
-	// Should use siphash or jhash here:
-	__u32 bucket = hash_32(addr->in6_u.u6_addr32[0], HOMA_PEERTAB_BUCKET_BITS);
-	bucket ^= hash_32(addr->in6_u.u6_addr32[1], HOMA_PEERTAB_BUCKET_BITS);
-	bucket ^= hash_32(addr->in6_u.u6_addr32[2], HOMA_PEERTAB_BUCKET_BITS);
-	bucket ^= hash_32(addr->in6_u.u6_addr32[3], HOMA_PEERTAB_BUCKET_BITS);
-	hlist_for_each_entry_rcu(peer, &peertab->buckets[bucket],
-			peertab_links) {
+	__u32 bucket;
+
+	rcu_read_lock();
+	buckets = rcu_dereference(peertab->buckets);
+	bucket = homa_peer_bucket(peertab, buckets, addr);
+	for (node = rcu_dereference(hlist_first_rcu(&buckets->heads[bucket]));
+			node != NULL;
+			node = rcu_dereference(hlist_next_rcu(node))) {
+		peer = homa_peer_entry(node, buckets->link);
 		if (ipv6_addr_equal(&peer->addr, addr)) {
+			/* If the peer is being evicted, fall through to
+			 * the slow path below, which will create a new one.
+			 */
+			if (!atomic_inc_not_zero(&peer->refs))
+				break;
+			rcu_read_unlock();
 			return peer;
 		}
 		INC_METRIC(peer_hash_links, 1);
 	}
+	rcu_read_unlock();
 
 	/* No existing entry; create a new one.
 	 *
 	 * Note: after we acquire the lock, we have to check again to
 	 * make sure the entry still doesn't exist (it might have been
-	 * created by a concurrent invocation of this function).
+	 * created by a concurrent invocation of this function). The table
+	 * may also have been resized, so the bucket must be recomputed.
 	 */
 	spin_lock_bh(&peertab->write_lock);
-	hlist_for_each_entry_rcu(peer, &peertab->buckets[bucket],
-			peertab_links) {
-		if (ipv6_addr_equal(&peer->addr, addr))
+	buckets = rcu_dereference_protected(peertab->buckets,
+			lockdep_is_held(&peertab->write_lock));
+	bucket = homa_peer_bucket(peertab, buckets, addr);
+	for (node = buckets->heads[bucket].first; node; node = node->next) {
+		peer = homa_peer_entry(node, buckets->link);
+		if (ipv6_addr_equal(&peer->addr, addr)) {
+			homa_peer_hold(peer);
 			goto done;
+		}
 	}
 	peer = kmalloc(sizeof(*peer), GFP_ATOMIC);
 	if (!peer) {
@@ -206,7 +494,9 @@ struct homa_peer *homa_peer_find(struct homa_peertab *peertab,
 	peer->last_update_jiffies = 0;
 	INIT_LIST_HEAD(&peer->grantable_rpcs);
 	INIT_LIST_HEAD(&peer->grantable_links);
-	hlist_add_head_rcu(&peer->peertab_links, &peertab->buckets[bucket]);
+	INIT_LIST_HEAD(&peer->rpcs);
+	peer->num_rpcs = 0;
+	spin_lock_init(&peer->rpcs_lock);
 	peer->outstanding_resends = 0;
 	peer->most_recent_resend = 0;
 	peer->least_recent_rpc = NULL;
@@ -214,7 +504,20 @@ struct homa_peer *homa_peer_find(struct homa_peertab *peertab,
 	peer->current_ticks = -1;
 	peer->resend_rpc = NULL;
 	peer->num_acks = 0;
+	peer->ack_cycles = 0;
+	INIT_LIST_HEAD(&peer->ack_links);
 	spin_lock_init(&peer->ack_lock);
+	atomic_set(&peer->refs, 2);
+	peer->last_put = jiffies;
+	peer->handoff_core = -1;
+	peer->nic = NULL;
+	peer->rtt_cycles = 0;
+	peer->rtt_jiffies = 0;
+	peer->cong_level = 0;
+	peer->cong_ticks = 0;
+	hlist_add_head_rcu(&peer->peertab_links[buckets->link],
+			&buckets->heads[bucket]);
+	peertab->num_peers++;
 	INC_METRIC(peer_new_entries, 1);
 
     done:
@@ -260,6 +563,7 @@ void homa_dst_refresh(struct homa_peertab *peertab, struct homa_peer *peer,
 			homa_peertab_gc_dsts(peertab, now);
 		}
 		peer->dst = dst;
+		WRITE_ONCE(peer->nic, homa_nic_find(hsk->homa, dst->dev));
 	}
 	spin_unlock_bh(&peertab->write_lock);
 }
@@ -279,9 +583,11 @@ int homa_unsched_priority(struct homa *homa, struct homa_peer *peer,
 	int i;
 	for (i = homa->num_priorities-1; ; i--) {
 		if (peer->unsched_cutoffs[i] >= length)
-			return i;
+			break;
 	}
-	/* Can't ever get here */
+	if (unlikely(rcu_access_pointer(homa->policy)))
+		return homa_policy_unsched_priority(homa, peer, length, i);
+	return i;
 }
 
 /**
@@ -358,6 +664,117 @@ void homa_peer_set_cutoffs(struct homa_peer *peer, int c0, int c1, int c2,
 	peer->unsched_cutoffs[7] = c7;
 }
 
+/**
+ * homa_peer_update_rtt() - Incorporate a new round-trip time measurement
+ * into a peer's RTT estimate.
+ * @peer:    Peer to which the RTT was measured.
+ * @rtt:     The measurement, in get_cycles() units.
+ */
+void homa_peer_update_rtt(struct homa_peer *peer, __u64 rtt)
+{
+	/* Keep the minimum sample: larger values are usually inflated by
+	 * queueing or by the receiver deferring grants.
+	 */
+	if ((peer->rtt_cycles == 0) || (rtt < peer->rtt_cycles)
+			|| time_after(jiffies, peer->rtt_jiffies
+			+ HOMA_RTT_WINDOW)) {
+		WRITE_ONCE(peer->rtt_cycles, rtt);
+		peer->rtt_jiffies = jiffies;
+	}
+}
+
+/**
+ * homa_peer_rtt_bytes() - Scale a byte count (such as unsched_bytes or
+ * window) that is supposed to cover one round trip, based on the
+ * measured RTT to a particular peer.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @peer:    Peer with which data will be exchanged.
+ * @base:    Global value for the byte count.
+ * Return:   The number of bytes that can be transmitted in @peer's RTT
+ *           on the uplink of the NIC used to reach @peer, limited to within
+ *           a factor of HOMA_PEER_RTT_RANGE of @base. If homa->peer_rtt is
+ *           zero or there is no RTT estimate for @peer, @base is returned.
+ */
+int homa_peer_rtt_bytes(struct homa *homa, struct homa_peer *peer, int base)
+{
+	__u64 rtt = READ_ONCE(peer->rtt_cycles);
+	struct homa_nic *nic;
+	__u32 cycles_per_kbyte;
+	__u64 bytes;
+
+	if (!homa->peer_rtt || (rtt == 0))
+		return base;
+
+	/* Don't use homa_get_nic here: it may refresh the dst, which
+	 * can't be done from all of our callers. An obsolete dst still
+	 * names the right device, and peer->nic will be recomputed if the
+	 * dst is replaced.
+	 */
+	nic = READ_ONCE(peer->nic);
+	if (nic == NULL)
+		nic = homa_nic_find(homa, READ_ONCE(peer->dst)->dev);
+	cycles_per_kbyte = READ_ONCE(nic->cycles_per_kbyte);
+	if (cycles_per_kbyte == 0)
+		return base;
+	bytes = (rtt*1000)/cycles_per_kbyte;
+	if (bytes < base/HOMA_PEER_RTT_RANGE)
+		return base/HOMA_PEER_RTT_RANGE;
+	if (bytes > (__u64) base*HOMA_PEER_RTT_RANGE)
+		return base*HOMA_PEER_RTT_RANGE;
+	return bytes;
+}
+
+/**
+ * homa_peer_congested() - Invoked when there is a sign (such as an ECN
+ * mark or a lost packet) that the network path from a peer is congested;
+ * raises the peer's congestion level.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @peer:    Peer whose packets ran into congestion.
+ */
+void homa_peer_congested(struct homa *homa, struct homa_peer *peer)
+{
+	__u32 now = homa->timer_ticks;
+
+	/* A single congestion episode usually produces many signals, so
+	 * raise the level at most once per timer tick.
+	 */
+	if ((peer->cong_level > 0) && (READ_ONCE(peer->cong_ticks) == now))
+		return;
+	WRITE_ONCE(peer->cong_ticks, now);
+	if (peer->cong_level >= HOMA_MAX_CONG_LEVEL)
+		return;
+	WRITE_ONCE(peer->cong_level, peer->cong_level + 1);
+	INC_METRIC(cong_level_increases, 1);
+	tt_record2("congestion level for peer 0x%x raised to %d",
+			tt_addr(peer->addr), peer->cong_level);
+}
+
+/**
+ * homa_peer_cong_level() - Return the current congestion level for a peer,
+ * first lowering it if there have been no congestion signals from the
+ * peer for a while.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @peer:    Peer of interest.
+ * Return:   The number of times the peer's grant window should be halved
+ *           (0 means no reduction). Always 0 if homa->congestion_signal
+ *           is zero.
+ */
+int homa_peer_cong_level(struct homa *homa, struct homa_peer *peer)
+{
+	int level = READ_ONCE(peer->cong_level);
+
+	if (!homa->congestion_signal || (level == 0))
+		return 0;
+	if ((homa->timer_ticks - READ_ONCE(peer->cong_ticks))
+			>= homa->congestion_decay_ticks) {
+		level--;
+		WRITE_ONCE(peer->cong_level, level);
+		WRITE_ONCE(peer->cong_ticks, homa->timer_ticks);
+		INC_METRIC(cong_level_decreases, 1);
+	}
+	return level;
+}
+
 /**
  * homa_peer_lock_slow() - This function implements the slow path for
  * acquiring a peer's @unacked_lock. It is invoked when the lock isn't
@@ -375,6 +792,22 @@ void homa_peer_lock_slow(struct homa_peer *peer)
 	INC_METRIC(peer_ack_lock_miss_cycles, get_cycles() - start);
 }
 
+/**
+ * homa_peer_take_acks() - Remove the oldest acks from a peer. The caller
+ * must hold the peer's ack lock.
+ * @peer:    Peer from which to remove acks.
+ * @count:   Number of acks to remove; must not exceed peer->num_acks.
+ * @dst:     The acks are copied to this location.
+ */
+static void homa_peer_take_acks(struct homa_peer *peer, int count,
+		struct homa_ack *dst)
+{
+	memcpy(dst, peer->acks, count * sizeof(peer->acks[0]));
+	peer->num_acks -= count;
+	memmove(peer->acks, &peer->acks[count],
+			peer->num_acks * sizeof(peer->acks[0]));
+}
+
 /**
  * homa_peer_add_ack() - Add a given RPC to the list of unacked
  * RPCs for its server. Once this method has been invoked, it's safe
@@ -384,32 +817,126 @@ void homa_peer_lock_slow(struct homa_peer *peer)
 void homa_peer_add_ack(struct homa_rpc *rpc)
 {
 	struct homa_peer *peer = rpc->peer;
+	struct homa *homa = rpc->hsk->homa;
 	struct ack_header ack;
+	int first;
 
 	homa_peer_lock(peer);
-	if (peer->num_acks < NUM_PEER_UNACKED_IDS) {
+	if (peer->num_acks < HOMA_MAX_PEER_ACKS) {
+		first = (peer->num_acks == 0);
+		if (first)
+			peer->ack_cycles = get_cycles();
 		peer->acks[peer->num_acks].client_id = cpu_to_be64(rpc->id);
 		peer->acks[peer->num_acks].client_port = htons(rpc->hsk->port);
 		peer->acks[peer->num_acks].server_port = htons(rpc->dport);
 		peer->num_acks++;
 		homa_peer_unlock(peer);
+		if (first && homa->ack_flush_cycles) {
+			spin_lock_bh(&homa->ack_peers_lock);
+			if (list_empty(&peer->ack_links))
+				list_add_tail(&peer->ack_links,
+						&homa->ack_peers);
+			spin_unlock_bh(&homa->ack_peers_lock);
+		}
 		return;
 	}
 
-	/* The peer has filled up; send an ACK message to empty it. The
-	 * RPC in the message header will also be considered ACKed.
+	/* The peer has filled up; send an ACK message to drain some of
+	 * it. The RPC in the message header will also be considered ACKed.
 	 */
 	INC_METRIC(ack_overflows, 1);
-	memcpy(ack.acks, peer->acks, sizeof(peer->acks));
-	ack.num_acks = htons(peer->num_acks);
-	peer->num_acks = 0;
+	homa_peer_take_acks(peer, NUM_PEER_UNACKED_IDS, ack.acks);
+	ack.num_acks = htons(NUM_PEER_UNACKED_IDS);
 	homa_peer_unlock(peer);
 	homa_xmit_control(ACK, &ack, sizeof(ack), rpc);
 }
 
+/**
+ * homa_peer_flush_acks() - Send explicit ACK packets for any peers whose
+ * acks have waited longer than homa->ack_flush_cycles for another packet
+ * to piggyback on. Invoked by homa_timer. If ack flushing has been
+ * disabled, peers are simply removed from homa->ack_peers (their acks
+ * wait for a packet to piggyback on, as usual).
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_peer_flush_acks(struct homa *homa)
+{
+	struct homa_peer *peer, *tmp;
+	struct ack_header ack;
+	__u64 now = get_cycles();
+	struct homa_sock *hsk;
+	LIST_HEAD(ready);
+
+	if (list_empty(&homa->ack_peers))
+		return;
+
+	/* Collect the peers to flush, then send without holding
+	 * ack_peers_lock. Peers stay non-evictable while on @ready,
+	 * since their ack_links aren't empty.
+	 */
+	spin_lock_bh(&homa->ack_peers_lock);
+	list_for_each_entry_safe(peer, tmp, &homa->ack_peers, ack_links) {
+		if ((peer->num_acks == 0) || (homa->ack_flush_cycles == 0)) {
+			list_del_init(&peer->ack_links);
+			continue;
+		}
+		if ((now - peer->ack_cycles) < homa->ack_flush_cycles)
+			continue;
+		list_move_tail(&peer->ack_links, &ready);
+	}
+	spin_unlock_bh(&homa->ack_peers_lock);
+
+	list_for_each_entry_safe(peer, tmp, &ready, ack_links) {
+		while (1) {
+			int count = homa_peer_get_acks(peer,
+					NUM_PEER_UNACKED_IDS, ack.acks);
+
+			if (count == 0)
+				break;
+
+			/* The header must name an RPC; use the first ack,
+			 * and send from its client socket (if that socket
+			 * has been closed, the server will eventually
+			 * request these acks with NEED_ACK).
+			 */
+			ack.common.type = ACK;
+			ack.common.sport = ack.acks[0].client_port;
+			ack.common.dport = ack.acks[0].server_port;
+			ack.common.sender_id = ack.acks[0].client_id;
+			ack.num_acks = htons(count);
+
+			/* Hold a reference to the socket, rather than
+			 * rcu_read_lock, while sending (the packet buffer
+			 * is allocated with GFP_KERNEL).
+			 */
+			rcu_read_lock();
+			hsk = homa_sock_find(&homa->port_map,
+					ntohs(ack.acks[0].client_port));
+			if (hsk)
+				sock_hold(&hsk->inet.sk);
+			rcu_read_unlock();
+			if (hsk) {
+				__homa_xmit_control(&ack, sizeof(ack), peer,
+						hsk);
+				INC_METRIC(ack_flushes, 1);
+				sock_put(&hsk->inet.sk);
+			}
+		}
+		/* More acks may have arrived while we were sending; if so,
+		 * they need to be flushed later.
+		 */
+		spin_lock_bh(&homa->ack_peers_lock);
+		if (peer->num_acks)
+			list_move_tail(&peer->ack_links, &homa->ack_peers);
+		else
+			list_del_init(&peer->ack_links);
+		spin_unlock_bh(&homa->ack_peers_lock);
+	}
+}
+
 /**
  * homa_peer_get_acks() - Copy acks out of a peer, and remove them from the
- * peer.
+ * peer. The oldest acks are returned first.
  * @peer:    Peer to check for possible unacked RPCs.
  * @count:   Maximum number of acks to return.
  * @dst:     The acks are copied to this location.
@@ -426,9 +953,7 @@ int homa_peer_get_acks(struct homa_peer *peer, int count, struct homa_ack *dst)
 
 	if (count > peer->num_acks)
 		count = peer->num_acks;
-	memcpy(dst, &peer->acks[peer->num_acks - count],
-			count * sizeof(peer->acks[0]));
-	peer->num_acks -= count;
+	homa_peer_take_acks(peer, count, dst);
 
 	homa_peer_unlock(peer);
 	return count;
@@ -37,6 +37,7 @@ int sysctl_homa_wmem_min __read_mostly;
  */
 struct homa homa_data;
 struct homa *homa = &homa_data;
+EXPORT_SYMBOL(homa);
 
 /* True means that the Homa module is in the process of unloading itself,
  * so everyone should clean up.
@@ -51,6 +52,11 @@ static struct task_struct *timer_kthread;
  */
 static int action;
 
+/* Lower bound for sysctl values that are used as divisors (referenced
+ * through the extra1 field of homa_ctl_table entries).
+ */
+static int sysctl_min_one = 1;
+
 /* This structure defines functions that handle various operations on
  * Homa sockets. These functions are relatively generic: they are called
  * to implement top-level system calls. Many of these operations can
@@ -205,11 +211,27 @@ static const struct proc_ops homa_metrics_pops = {
 	.proc_release      = homa_metrics_release,
 };
 
+/* Describes file operations implemented for /proc/net/homa_metrics_bin. */
+static const struct proc_ops homa_metrics_bin_pops = {
+	.proc_read         = homa_metrics_bin_read,
+	.proc_lseek        = homa_metrics_bin_lseek,
+};
+
 /* Used to remove /proc/net/homa_metrics when the module is unloaded. */
 static struct proc_dir_entry *metrics_dir_entry = NULL;
 
+/* Used to remove /proc/net/homa_metrics_bin when the module is unloaded. */
+static struct proc_dir_entry *metrics_bin_dir_entry = NULL;
+
 /* Used to configure sysctl access to Homa configuration parameters.*/
 static struct ctl_table homa_ctl_table[] = {
+	{
+		.procname	= "ack_flush_usecs",
+		.data		= &homa_data.ack_flush_usecs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "action",
 		.data		= &action,
@@ -217,6 +239,34 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "adaptive_poll",
+		.data		= &homa_data.adaptive_poll,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "auto_cutoffs",
+		.data		= &homa_data.auto_cutoffs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "auto_cutoffs_drift",
+		.data		= &homa_data.auto_cutoffs_drift,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "auto_cutoffs_min_msgs",
+		.data		= &homa_data.auto_cutoffs_min_msgs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "bpage_lease_usecs",
 		.data		= &homa_data.bpage_lease_usecs,
@@ -231,6 +281,20 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "congestion_decay_ticks",
+		.data		= &homa_data.congestion_decay_ticks,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "congestion_signal",
+		.data		= &homa_data.congestion_signal,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "cutoff_version",
 		.data		= &homa_data.cutoff_version,
@@ -259,6 +323,34 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "freeze_grantable_rpcs",
+		.data		= &homa_data.freeze_grantable_rpcs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "freeze_resends_per_tick",
+		.data		= &homa_data.freeze_resends_per_tick,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "freeze_slow_base_usecs",
+		.data		= &homa_data.freeze_slow_base_usecs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "freeze_slow_factor",
+		.data		= &homa_data.freeze_slow_factor,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "freeze_type",
 		.data		= &homa_data.freeze_type,
@@ -294,6 +386,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "group_steering",
+		.data		= &homa_data.group_steering,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "gso_force_software",
 		.data		= &homa_data.gso_force_software,
@@ -301,6 +400,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "handoff_locality",
+		.data		= &homa_data.handoff_locality,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "link_mbps",
 		.data		= &homa_data.link_mbps,
@@ -357,6 +463,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "max_peer_kbytes",
+		.data		= &homa_data.max_peer_kbytes,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "max_rpcs_per_peer",
 		.data		= &homa_data.max_rpcs_per_peer,
@@ -378,6 +491,20 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "nic_link_mbps",
+		.data		= &homa_data.nic_link_mbps,
+		.maxlen		= HOMA_NIC_CONFIG_LENGTH,
+		.mode		= 0644,
+		.proc_handler	= homa_dostring
+	},
+	{
+		.procname	= "num_pacers",
+		.data		= &homa_data.num_pacers,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "num_priorities",
 		.data		= &homa_data.num_priorities,
@@ -392,6 +519,20 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "peer_idle_secs",
+		.data		= &homa_data.peer_idle_secs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
+	{
+		.procname	= "peer_rtt",
+		.data		= &homa_data.peer_rtt,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "poll_usecs",
 		.data		= &homa_data.poll_usecs,
@@ -406,6 +547,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "priority_queues",
+		.data		= &homa_data.priority_queues,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "reap_limit",
 		.data		= &homa_data.reap_limit,
@@ -413,6 +561,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "reap_worker_skbs",
+		.data		= &homa_data.reap_worker_skbs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "request_ack_ticks",
 		.data		= &homa_data.request_ack_ticks,
@@ -434,6 +589,21 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "rpc_cache_max",
+		.data		= &homa_data.rpc_cache_max,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "softirq_load_usecs",
+		.data		= &homa_data.softirq_load_usecs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec,
+		.extra1		= &sysctl_min_one
+	},
 	{
 		.procname	= "sync_freeze",
 		.data		= &homa_data.sync_freeze,
@@ -462,6 +632,27 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "timer_shards",
+		.data		= &homa_data.num_timer_shards,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
+	{
+		.procname	= "tt_categories",
+		.data		= &homa_data.tt_categories,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
+	{
+		.procname	= "udp_port",
+		.data		= &homa_data.udp_port,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "unsched_bytes",
 		.data		= &homa_data.unsched_bytes,
@@ -483,6 +674,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "weighted_shares",
+		.data		= &homa_data.weighted_shares,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "window",
 		.data		= &homa_data.window,
@@ -496,10 +694,10 @@ static struct ctl_table homa_ctl_table[] = {
 /* Sizes of the headers for each Homa packet type, in bytes. */
 static __u16 header_lengths[] = {
 	sizeof32(struct data_header),
-	sizeof32(struct grant_header),
-	sizeof32(struct resend_header),
+	HOMA_GRANT_MIN_LENGTH,
+	HOMA_RESEND_MIN_LENGTH,
 	sizeof32(struct unknown_header),
-	sizeof32(struct busy_header),
+	HOMA_BUSY_MIN_LENGTH,
 	sizeof32(struct cutoffs_header),
 	sizeof32(struct freeze_header),
 	sizeof32(struct need_ack_header),
@@ -581,6 +779,13 @@ static int __init homa_load(void) {
 		status = -ENOMEM;
 		goto out_cleanup;
 	}
+	metrics_bin_dir_entry = proc_create("homa_metrics_bin", S_IRUGO,
+			init_net.proc_net, &homa_metrics_bin_pops);
+	if (!metrics_bin_dir_entry) {
+		printk(KERN_ERR "couldn't create /proc/net/homa_metrics_bin\n");
+		status = -ENOMEM;
+		goto out_cleanup;
+	}
 
 	homa_ctl_header = register_net_sysctl(&init_net, "net/homa",
 			homa_ctl_table);
@@ -596,6 +801,12 @@ static int __init homa_load(void) {
 		goto out_cleanup;
 	}
 
+	/* BPF policies are optional, so failure here isn't fatal. */
+	status = homa_policy_bpf_init();
+	if (status != 0)
+		printk(KERN_WARNING "Homa couldn't register BPF policy "
+				"hooks: error %d\n", status);
+
 	timer_kthread = kthread_run(homa_timer_main, homa, "homa_timer");
 	if (IS_ERR(timer_kthread)) {
 		status = PTR_ERR(timer_kthread);
@@ -606,6 +817,7 @@ static int __init homa_load(void) {
 	}
 
 	tt_init("timetrace", homa->temp);
+	tt_set_categories(homa->tt_categories);
 
 	return 0;
 
@@ -613,6 +825,7 @@ out_cleanup:
 	homa_offload_end();
 	unregister_net_sysctl_table(homa_ctl_header);
 	proc_remove(metrics_dir_entry);
+	proc_remove(metrics_bin_dir_entry);
 	homa_destroy(homa);
 	inet_del_protocol(&homa_protocol, IPPROTO_HOMA);
 	inet_unregister_protosw(&homa_protosw);
@@ -640,6 +853,7 @@ static void __exit homa_unload(void) {
 	wait_for_completion(&timer_thread_done);
 	unregister_net_sysctl_table(homa_ctl_header);
 	proc_remove(metrics_dir_entry);
+	proc_remove(metrics_bin_dir_entry);
 	homa_destroy(homa);
 	inet_del_protocol(&homa_protocol, IPPROTO_HOMA);
 	inet_unregister_protosw(&homa_protosw);
@@ -764,6 +978,224 @@ int homa_ioc_abort(struct sock *sk, unsigned long arg) {
 	return ret;
 }
 
+/**
+ * homa_send_entry() - Send the message described by one element of
+ * a homa_sendmmsg batch (also used for SQEs in a socket's rings).
+ * @hsk:      Socket on which to send the message.
+ * @entry:    (in/out) Describes the message. On return, entry->error
+ *            holds the outcome and, for a new request, entry->id holds
+ *            the id of the new RPC.
+ */
+void homa_send_entry(struct homa_sock *hsk, struct homa_sendmmsg_msg *entry)
+{
+	struct iovec fast_iov[UIO_FASTIOV], *iov = fast_iov;
+	struct homa_sendmsg_args send_args;
+	struct iov_iter iter;
+	ssize_t err;
+
+	if (entry->dest_addr.in6.sin6_family != hsk->inet.sk.sk_family) {
+		entry->error = -EAFNOSUPPORT;
+		return;
+	}
+	err = import_iovec(WRITE, entry->iov, entry->iovcnt, UIO_FASTIOV,
+			&iov, &iter);
+	if (err < 0) {
+		entry->error = err;
+		return;
+	}
+	send_args.id = entry->id;
+	send_args.completion_cookie = entry->completion_cookie;
+	entry->error = __homa_sendmsg(hsk, &send_args, &entry->dest_addr,
+			&iter, 0);
+	kfree(iov);
+	entry->id = send_args.id;
+}
+
+/**
+ * homa_ioc_send() - The top-level function for the ioctl that implements
+ * the homa_sendmmsg user-level API: sends several request and/or response
+ * messages with a single kernel call.
+ * @sk:       Socket for this request.
+ * @arg:      Used to pass information from user space: refers to a
+ *            struct homa_sendmmsg_args.
+ *
+ * Return: The number of messages that were sent successfully (the error
+ *         field of each struct homa_sendmmsg_msg indicates the outcome
+ *         for that message), or a negative errno if the arguments
+ *         couldn't be processed.
+ */
+int homa_ioc_send(struct sock *sk, unsigned long arg) {
+	struct homa_sock *hsk = homa_sk(sk);
+	struct homa_sendmmsg_args args;
+	struct homa_sendmmsg_msg entry;
+	struct homa_rpc *rpc;
+	int i, sent = 0;
+
+	homa_cores[raw_smp_processor_id()]->last_app_active = get_cycles();
+	if (unlikely(copy_from_user(&args, (void *) arg, sizeof(args))))
+		return -EFAULT;
+	if (args._pad[0] || (args.num_msgs > HOMA_MAX_SEND_BATCH))
+		return -EINVAL;
+	INC_METRIC(send_batch_calls, 1);
+
+	for (i = 0; i < args.num_msgs; i++) {
+		if (unlikely(copy_from_user(&entry, &args.msgs[i],
+				sizeof(entry))))
+			return sent ? sent : -EFAULT;
+		homa_send_entry(hsk, &entry);
+		if (unlikely(copy_to_user(&args.msgs[i], &entry,
+				sizeof(entry)))) {
+			/* The application won't learn the id of a new
+			 * request, so abandon it.
+			 */
+			if ((entry.error == 0) && homa_is_client(entry.id)) {
+				rpc = homa_find_client_rpc(hsk, entry.id);
+				if (rpc) {
+					homa_rpc_free(rpc);
+					homa_rpc_unlock(rpc);
+				}
+			}
+			return sent ? sent : -EFAULT;
+		}
+		if (entry.error == 0)
+			sent++;
+	}
+	INC_METRIC(send_batch_msgs, sent);
+	tt_record2("homa_ioc_send sent %d of %d messages", sent,
+			args.num_msgs);
+	return sent;
+}
+
+/**
+ * homa_ioc_mcast() - The top-level function for the ioctl that implements
+ * the homa_sendmcast user-level API: sends the same request message to
+ * several destinations. The message data is copied from user space once,
+ * into kernel pages that are attached (without copying) to the packets of
+ * all of the RPCs; each RPC has its own headers and its own packet list,
+ * so grants and retransmissions are handled separately for each
+ * destination.
+ * @sk:       Socket for this request.
+ * @arg:      Used to pass information from user space: refers to a
+ *            struct homa_mcast_args.
+ *
+ * Return: The number of destinations to which the request was sent (the
+ *         error field of each struct homa_mcast_dest indicates the outcome
+ *         for that destination), or a negative errno if the arguments
+ *         couldn't be processed.
+ */
+int homa_ioc_mcast(struct sock *sk, unsigned long arg) {
+	struct iovec fast_iov[UIO_FASTIOV], *iov = fast_iov;
+	struct homa_sock *hsk = homa_sk(sk);
+	struct homa_sendmsg_args send_args;
+	struct homa_mcast_args args;
+	struct homa_mcast_dest dest;
+	struct bio_vec *bvecs = NULL;
+	struct iov_iter iter, shared;
+	int i, length, npages = 0;
+	struct homa_rpc *rpc;
+	int result, sent = 0;
+	ssize_t err;
+
+	homa_cores[raw_smp_processor_id()]->last_app_active = get_cycles();
+	if (unlikely(copy_from_user(&args, (void *) arg, sizeof(args))))
+		return -EFAULT;
+	if ((args.num_dests == 0) || (args.num_dests > HOMA_MAX_MCAST_DESTS))
+		return -EINVAL;
+	INC_METRIC(mcast_calls, 1);
+	err = import_iovec(WRITE, args.iov, args.iovcnt, UIO_FASTIOV,
+			&iov, &iter);
+	if (err < 0) {
+		kfree(iov);
+		return err;
+	}
+	length = iov_iter_count(&iter);
+	if ((length == 0) || (length > HOMA_MAX_MESSAGE_LENGTH)) {
+		result = -EINVAL;
+		goto done;
+	}
+
+	/* Copy the message data into pages that will be shared by all of
+	 * the RPCs (each packet holds its own references to the pages).
+	 */
+	bvecs = kvmalloc_array(DIV_ROUND_UP(length, PAGE_SIZE),
+			sizeof(*bvecs), GFP_KERNEL);
+	if (unlikely(!bvecs)) {
+		result = -ENOMEM;
+		goto done;
+	}
+	while (iov_iter_count(&iter) > 0) {
+		size_t chunk = min_t(size_t, iov_iter_count(&iter), PAGE_SIZE);
+		struct page *page;
+		size_t copied;
+		char *vaddr;
+
+		page = alloc_page(GFP_KERNEL);
+		if (unlikely(!page)) {
+			result = -ENOMEM;
+			goto done;
+		}
+		bvecs[npages].bv_page = page;
+		bvecs[npages].bv_offset = 0;
+		bvecs[npages].bv_len = chunk;
+		npages++;
+		vaddr = kmap_local_page(page);
+		copied = copy_from_iter(vaddr, chunk, &iter);
+		kunmap_local(vaddr);
+		if (unlikely(copied != chunk)) {
+			result = -EFAULT;
+			goto done;
+		}
+	}
+
+	for (i = 0; i < args.num_dests; i++) {
+		if (unlikely(copy_from_user(&dest, &args.dests[i],
+				sizeof(dest)))) {
+			result = sent ? sent : -EFAULT;
+			goto done;
+		}
+		dest.id = 0;
+		if (dest.dest_addr.in6.sin6_family != hsk->inet.sk.sk_family) {
+			dest.error = -EAFNOSUPPORT;
+		} else {
+			iov_iter_bvec(&shared, WRITE, bvecs, npages, length);
+			send_args.id = 0;
+			send_args.completion_cookie = dest.completion_cookie;
+			dest.error = __homa_sendmsg(hsk, &send_args,
+					&dest.dest_addr, &shared, 1);
+			if (dest.error == 0)
+				dest.id = send_args.id;
+		}
+		if (unlikely(copy_to_user(&args.dests[i], &dest,
+				sizeof(dest)))) {
+			/* The application won't learn the id of the new
+			 * RPC, so abandon it.
+			 */
+			if (dest.error == 0) {
+				rpc = homa_find_client_rpc(hsk, dest.id);
+				if (rpc) {
+					homa_rpc_free(rpc);
+					homa_rpc_unlock(rpc);
+				}
+			}
+			result = sent ? sent : -EFAULT;
+			goto done;
+		}
+		if (dest.error == 0)
+			sent++;
+	}
+	tt_record3("homa_ioc_mcast sent %d bytes to %d of %d destinations",
+			length, sent, args.num_dests);
+	result = sent;
+
+done:
+	INC_METRIC(mcast_rpcs, sent);
+	for (i = 0; i < npages; i++)
+		put_page(bvecs[i].bv_page);
+	kvfree(bvecs);
+	kfree(iov);
+	return result;
+}
+
 /**
  * homa_ioctl() - Implements the ioctl system call for Homa sockets.
  * @sk:    Socket on which the system call was invoked.
@@ -783,6 +1215,15 @@ int homa_ioctl(struct sock *sk, int cmd, unsigned long arg) {
 		INC_METRIC(abort_calls, 1);
 		INC_METRIC(abort_cycles, get_cycles() - start);
 		break;
+	case HOMAIOCSEND:
+		result = homa_ioc_send(sk, arg);
+		break;
+	case HOMAIOCRING:
+		result = homa_ioc_ring(sk, arg);
+		break;
+	case HOMAIOCMCAST:
+		result = homa_ioc_mcast(sk, arg);
+		break;
 	case HOMAIOCFREEZE:
 		tt_record1("Freezing timetrace because of HOMAIOCFREEZE ioctl, "
 				"pid %d", current->pid);
@@ -829,6 +1270,94 @@ int homa_setsockopt(struct sock *sk, int level, int optname, sockptr_t optval,
 	__u64 start = get_cycles();
 	int ret;
 
+	if ((level == IPPROTO_HOMA) && (optname == SO_HOMA_ZEROCOPY)) {
+		int min_length;
+
+		if (optlen != sizeof(int))
+			return -EINVAL;
+		if (copy_from_sockptr(&min_length, optval, optlen))
+			return -EFAULT;
+		if (min_length < 0)
+			return -EINVAL;
+		hsk->zerocopy_min_length = min_length;
+		return 0;
+	}
+
+	if ((level == IPPROTO_HOMA) && (optname == SO_HOMA_BUF_EXTENTS)) {
+		__u64 length;
+
+		if (optlen != sizeof(__u64))
+			return -EINVAL;
+		if (copy_from_sockptr(&length, optval, optlen))
+			return -EFAULT;
+
+		/* The extent area is carved out when the region is set. */
+		if (hsk->buffer_pool.region)
+			return -EINVAL;
+		hsk->buf_extent_length = length;
+		return 0;
+	}
+
+	if ((level == IPPROTO_HOMA) && (optname == SO_HOMA_BUF_NODES)) {
+		int num_nodes;
+
+		if (optlen != sizeof(int))
+			return -EINVAL;
+		if (copy_from_sockptr(&num_nodes, optval, optlen))
+			return -EFAULT;
+		if ((num_nodes < 0) || (num_nodes > nr_node_ids)
+				|| hsk->buffer_pool.region)
+			return -EINVAL;
+		hsk->buf_num_nodes = num_nodes;
+		return 0;
+	}
+
+	if ((level == IPPROTO_HOMA) && (optname == SO_HOMA_SOFTIRQ_COPY)) {
+		int min_length;
+
+		if (optlen != sizeof(int))
+			return -EINVAL;
+		if (copy_from_sockptr(&min_length, optval, optlen))
+			return -EFAULT;
+
+		/* The region is pinned when it is set. */
+		if ((min_length < 0) || hsk->buffer_pool.region)
+			return -EINVAL;
+		hsk->softirq_copy_length = min_length;
+		return 0;
+	}
+
+	if ((level == IPPROTO_HOMA) && (optname == SO_HOMA_WEIGHT)) {
+		int weight;
+
+		if (optlen != sizeof(int))
+			return -EINVAL;
+		if (copy_from_sockptr(&weight, optval, optlen))
+			return -EFAULT;
+		if ((weight < 1) || (weight > HOMA_MAX_WEIGHT))
+			return -EINVAL;
+
+		/* The weights of sockets with grantable RPCs are summed in
+		 * homa->grantable_weight.
+		 */
+		homa_grantable_lock(hsk->homa);
+		if (hsk->num_grantable)
+			hsk->homa->grantable_weight += weight - hsk->weight;
+		hsk->weight = weight;
+		homa_grantable_unlock(hsk->homa);
+		return 0;
+	}
+
+	if ((level == IPPROTO_HOMA) && (optname == SO_HOMA_SET_RINGS)) {
+		struct homa_set_rings_args ring_args;
+
+		if (optlen != sizeof(struct homa_set_rings_args))
+			return -EINVAL;
+		if (copy_from_sockptr(&ring_args, optval, optlen))
+			return -EFAULT;
+		return homa_ring_init(hsk, &ring_args);
+	}
+
 	if ((level != IPPROTO_HOMA) || (optname != SO_HOMA_SET_BUF)
 			|| (optlen != sizeof(struct homa_set_buf_args)))
 		return -EINVAL;
@@ -842,9 +1371,22 @@ int homa_setsockopt(struct sock *sk, int level, int optname, sockptr_t optval,
 	if (copy_to_user(args.start, &args, sizeof(args)))
 		return -EFAULT;
 
+	/* Huge pages avoid most of the TLB misses during copy-out, but
+	 * they're up to the application; all we can do is notice them.
+	 */
+	if (homa_pool_page_size(args.start) > PAGE_SIZE)
+		INC_METRIC(so_set_buf_hugepages, 1);
+
+	/* A previous region may still be pinned; homa_pool_init would
+	 * otherwise lose track of its pages.
+	 */
+	homa_pool_unpin(&hsk->buffer_pool);
 	homa_sock_lock(hsk, "homa_setsockopt SO_HOMA_SET_BUF");
-	ret = homa_pool_init(hsk, args.start, args.length);
+	ret = homa_pool_init(hsk, args.start, args.length,
+			hsk->buf_extent_length, hsk->buf_num_nodes);
 	homa_sock_unlock(hsk);
+	if ((ret == 0) && hsk->softirq_copy_length)
+		ret = homa_pool_pin(&hsk->buffer_pool);
 	INC_METRIC(so_set_buf_calls, 1);
 	INC_METRIC(so_set_buf_cycles, get_cycles() - start);
 	return ret;
@@ -854,59 +1396,81 @@ int homa_setsockopt(struct sock *sk, int level, int optname, sockptr_t optval,
 /**
  * homa_getsockopt() - Implements the getsockopt system call for Homa sockets.
  * @sk:      Socket on which the system call was invoked.
- * @level:   ??
- * @optname: Identifies a particular setsockopt operation.
+ * @level:   Level at which the operation should be handled; only
+ *           IPPROTO_HOMA is supported.
+ * @optname: Identifies a particular getsockopt operation; currently
+ *           SO_HOMA_POOL_STATS and SO_HOMA_SHARE_STATS are supported.
  * @optval:  Address in user space where the option's value should be stored.
- * @option:  ??.
+ * @option:  Address in user space of the length of the space at @optval;
+ *           will be overwritten with the number of bytes stored there.
  * Return:   0 on success, otherwise a negative errno.
  */
 int homa_getsockopt(struct sock *sk, int level, int optname,
     char __user *optval, int __user *option) {
-	printk(KERN_WARNING "unimplemented getsockopt invoked on Homa socket:"
-			" level %d, optname %d\n", level, optname);
-	return -EINVAL;
-
+	struct homa_sock *hsk = homa_sk(sk);
+	union {
+		struct homa_pool_stats pool;
+		struct homa_share_stats share;
+	} value;
+	int length, size;
+
+	if ((level == IPPROTO_HOMA) && (optname == SO_HOMA_POOL_STATS))
+		size = sizeof(value.pool);
+	else if ((level == IPPROTO_HOMA) && (optname == SO_HOMA_SHARE_STATS))
+		size = sizeof(value.share);
+	else {
+		printk(KERN_WARNING "unimplemented getsockopt invoked on "
+				"Homa socket: level %d, optname %d\n", level,
+				optname);
+		return -EINVAL;
+	}
+	if (copy_from_user(&length, option, sizeof(length)))
+		return -EFAULT;
+	if (length < size)
+		return -EINVAL;
+	if (optname == SO_HOMA_POOL_STATS)
+		homa_pool_get_stats(hsk, &value.pool);
+	else {
+		memset(&value.share, 0, sizeof(value.share));
+		homa_grantable_lock(hsk->homa);
+		value.share.weight = hsk->weight;
+		value.share.granted_bytes = hsk->granted_bytes;
+		value.share.share_limited = hsk->share_limited;
+		homa_grantable_unlock(hsk->homa);
+		value.share.paced_bytes = atomic64_read(&hsk->paced_bytes);
+	}
+	if (copy_to_user(optval, &value, size))
+		return -EFAULT;
+	length = size;
+	if (copy_to_user(option, &length, sizeof(length)))
+		return -EFAULT;
+	return 0;
 }
 
 /**
- * homa_sendmsg() - Send a request or response message on a Homa socket.
- * @sk:    Socket on which the system call was invoked.
- * @msg:   Structure describing the message to send; the msg_control
- *         field points to additional information.
- * @len:   Number of bytes of the message.
- * Return: 0 on success, otherwise a negative errno.
+ * __homa_sendmsg() - Does most of the work of sending a single request or
+ * response message; shared by homa_sendmsg and homa_ioc_send.
+ * @hsk:   Socket on which to send the message.
+ * @args:  (in/out) Identifies the message to send (same meaning as for
+ *         sendmsg). If the message is a request, args->id is set to the
+ *         id of the new RPC.
+ * @addr:  Address of the destination; must already have been validated.
+ * @iter:  Describes the message data in user space.
+ * @shared: Nonzero means @iter refers to kernel pages holding a copy of
+ *         the message that may be shared with other RPCs (see
+ *         homa_message_out_init), rather than to user space.
+ * Return: 0 on success, otherwise a negative errno. If the message was a
+ *         request and this function succeeded, the new RPC exists but is
+ *         not locked.
  */
-int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length) {
-	struct homa_sock *hsk = homa_sk(sk);
-	struct homa_sendmsg_args args;
+int __homa_sendmsg(struct homa_sock *hsk, struct homa_sendmsg_args *args,
+		sockaddr_in_union *addr, struct iov_iter *iter, int shared)
+{
 	__u64 start = get_cycles();
-	__u64 finish;
-	int result = 0;
 	struct homa_rpc *rpc = NULL;
-	sockaddr_in_union *addr = (sockaddr_in_union *) msg->msg_name;
-
-	homa_cores[raw_smp_processor_id()]->last_app_active = start;
-	if (unlikely(!msg->msg_control_is_user)) {
-		result = -EINVAL;
-		goto error;
-	}
-	if (unlikely(copy_from_user(&args, msg->msg_control,
-			sizeof(args)))) {
-		result = -EFAULT;
-		goto error;
-	}
-	if (addr->in6.sin6_family != sk->sk_family) {
-		result = -EAFNOSUPPORT;
-		goto error;
-	}
-	if ((msg->msg_namelen < sizeof(struct sockaddr_in))
-			|| ((msg->msg_namelen < sizeof(struct sockaddr_in6))
-			&& (addr->in6.sin6_family == AF_INET6))) {
-		result = -EINVAL;
-		goto error;
-	}
+	int result = 0;
 
-	if (!args.id) {
+	if (!args->id) {
 		/* This is a request message. */
 		INC_METRIC(send_calls, 1);
 		tt_record4("homa_sendmsg request, target 0x%x:%d, id %u, length %d",
@@ -915,7 +1479,7 @@ int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length) {
 				: tt_addr(addr->in6.sin6_addr),
 				ntohs(addr->in6.sin6_port),
 				atomic64_read(&hsk->homa->next_outgoing_id),
-				length);
+				iter->count);
 
 		rpc = homa_rpc_new_client(hsk, addr);
 		if (IS_ERR(rpc)) {
@@ -923,37 +1487,28 @@ int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length) {
 			rpc = NULL;
 			goto error;
 		}
-		rpc->completion_cookie = args.completion_cookie;
-		result = homa_message_out_init(rpc, &msg->msg_iter, 1);
+		rpc->completion_cookie = args->completion_cookie;
+		result = homa_message_out_init(rpc, iter, 1, shared);
 		if (result)
 			goto error;
-		args.id = rpc->id;
+		args->id = rpc->id;
 		homa_rpc_unlock(rpc);
-		rpc = NULL;
-
-		if (unlikely(copy_to_user(msg->msg_control, &args,
-				sizeof(args)))) {
-			rpc = homa_find_client_rpc(hsk, args.id);
-			result = -EFAULT;
-			goto error;
-		}
-		finish = get_cycles();
-		INC_METRIC(send_cycles, finish - start);
+		INC_METRIC(send_cycles, get_cycles() - start);
 	} else {
 		/* This is a response message. */
 		struct in6_addr canonical_dest;
 
 		INC_METRIC(reply_calls, 1);
 		tt_record4("homa_sendmsg response, id %llu, port %d, pid %d, length %d",
-				args.id, hsk->port, current->pid, length);
-		if (args.completion_cookie != 0) {
+				args->id, hsk->port, current->pid, iter->count);
+		if (args->completion_cookie != 0) {
 			result = -EINVAL;
 			goto error;
 		}
 		canonical_dest = canonical_ipv6_addr(addr);
 
 		rpc = homa_find_server_rpc(hsk, &canonical_dest,
-				ntohs(addr->in6.sin6_port), args.id);
+				ntohs(addr->in6.sin6_port), args->id);
 		if (!rpc) {
 			result = -EINVAL;
 			goto error;
@@ -970,14 +1525,12 @@ int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length) {
 		}
 		rpc->state = RPC_OUTGOING;
 
-		result = homa_message_out_init(rpc, &msg->msg_iter, 1);
+		result = homa_message_out_init(rpc, iter, 1, shared);
 		if (result)
 			goto error;
 		homa_rpc_unlock(rpc);
-		finish = get_cycles();
-		INC_METRIC(reply_cycles, finish - start);
+		INC_METRIC(reply_cycles, get_cycles() - start);
 	}
-	tt_record1("homa_sendmsg finished, id %d", args.id);
 	return 0;
 
 error:
@@ -985,12 +1538,281 @@ error:
 		homa_rpc_free(rpc);
 		homa_rpc_unlock(rpc);
 	}
+	return result;
+}
+
+/**
+ * homa_sendmsg() - Send a request or response message on a Homa socket.
+ * @sk:    Socket on which the system call was invoked.
+ * @msg:   Structure describing the message to send; the msg_control
+ *         field points to additional information.
+ * @len:   Number of bytes of the message.
+ * Return: 0 on success, otherwise a negative errno.
+ */
+int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length) {
+	struct homa_sock *hsk = homa_sk(sk);
+	struct homa_sendmsg_args args;
+	int result = 0;
+	struct homa_rpc *rpc;
+	int request;
+	sockaddr_in_union *addr = (sockaddr_in_union *) msg->msg_name;
+
+	homa_cores[raw_smp_processor_id()]->last_app_active = get_cycles();
+	args.id = 0;
+	if (unlikely(!msg->msg_control_is_user)) {
+		result = -EINVAL;
+		goto error;
+	}
+	if (unlikely(copy_from_user(&args, msg->msg_control,
+			sizeof(args)))) {
+		result = -EFAULT;
+		goto error;
+	}
+	if (addr->in6.sin6_family != sk->sk_family) {
+		result = -EAFNOSUPPORT;
+		goto error;
+	}
+	if ((msg->msg_namelen < sizeof(struct sockaddr_in))
+			|| ((msg->msg_namelen < sizeof(struct sockaddr_in6))
+			&& (addr->in6.sin6_family == AF_INET6))) {
+		result = -EINVAL;
+		goto error;
+	}
+
+	request = (args.id == 0);
+	result = __homa_sendmsg(hsk, &args, addr, &msg->msg_iter, 0);
+	if (result)
+		goto error;
+	if (request && unlikely(copy_to_user(msg->msg_control, &args,
+			sizeof(args)))) {
+		rpc = homa_find_client_rpc(hsk, args.id);
+		if (rpc) {
+			homa_rpc_free(rpc);
+			homa_rpc_unlock(rpc);
+		}
+		result = -EFAULT;
+		goto error;
+	}
+	tt_record1("homa_sendmsg finished, id %d", args.id);
+	return 0;
+
+error:
 	tt_record2("homa_sendmsg returning error %d for id %d",
 			result, args.id);
 	tt_freeze();
 	return result;
 }
 
+/**
+ * homa_recvmsg_done() - Invoked once information about an RPC's incoming
+ * message has been collected for return to the application; transfers
+ * ownership of the message's buffers to the application and cleans up
+ * or updates RPC state as appropriate.
+ * @rpc:      RPC whose message is being returned. Must be locked by the
+ *            caller; this function unlocks it (and the RPC may be freed).
+ * @result:   The value being returned for the message: either its length
+ *            or a negative errno.
+ */
+static void homa_recvmsg_done(struct homa_rpc *rpc, int result)
+{
+	/* This indicates that the application now owns the buffers, so
+	 * we won't free them in homa_rpc_free (for streamed messages,
+	 * msgin.stream_bpages already says which buffers the application
+	 * owns).
+	 */
+	if (!rpc->msgin.streaming)
+		rpc->msgin.num_bpages = 0;
+
+	if (homa_is_client(rpc->id)) {
+		homa_peer_add_ack(rpc);
+		homa_rpc_free(rpc);
+	} else {
+		if (result < 0)
+			homa_rpc_free(rpc);
+		else
+			rpc->state = RPC_IN_SERVICE;
+	}
+	homa_rpc_unlock(rpc);
+}
+
+/**
+ * homa_recvmsg_unstreamable() - Check whether an RPC's incoming message
+ * can't be returned by a recvmsg call that isn't in streaming mode; if
+ * so, the RPC is marked with an EMSGSIZE error.
+ * @rpc:      RPC whose message is about to be returned. Must be locked by
+ *            the caller.
+ */
+static void homa_recvmsg_unstreamable(struct homa_rpc *rpc)
+{
+	if (likely(((rpc->msgin.length <= HOMA_MAX_UNSTREAMED_LENGTH)
+			&& !rpc->msgin.streaming) || rpc->error))
+		return;
+
+	/* Either the message is too long to describe with HOMA_MAX_BPAGES
+	 * bpages, or part of it has already been returned in streaming
+	 * mode. Marking it as streaming means that homa_rpc_free will
+	 * release all the buffers that the application doesn't own.
+	 */
+	tt_record2("recvmsg can't return message of length %d for id %d "
+			"without streaming", rpc->msgin.length, rpc->id);
+	rpc->msgin.streaming = 1;
+	rpc->error = -EMSGSIZE;
+}
+
+/**
+ * homa_recvmsg_stream() - Collect information about the next piece of
+ * an incoming message, for return by a recvmsg call in streaming mode.
+ * @rpc:      RPC whose message is being returned. Must be locked by the
+ *            caller.
+ * @control:  The bpages for the piece are stored here.
+ * Return:    The number of bytes in the piece.
+ */
+static int homa_recvmsg_stream(struct homa_rpc *rpc,
+		struct homa_recvmsg_args *control)
+{
+	int end = homa_stream_end(rpc);
+	int result = end - rpc->msgin.stream_offset;
+	int first = rpc->msgin.stream_bpages;
+
+	control->num_bpages = ((end + HOMA_BPAGE_SIZE - 1)
+			>> HOMA_BPAGE_SHIFT) - first;
+	memcpy(control->bpage_offsets, &rpc->msgin.bpage_offsets[first],
+			control->num_bpages * sizeof(__u32));
+	rpc->msgin.stream_offset = end;
+	rpc->msgin.stream_bpages += control->num_bpages;
+	tt_record4("recvmsg streaming bytes %d-%d of id %d in %d bpages",
+			end - result, end, rpc->id, control->num_bpages);
+	return result;
+}
+
+/**
+ * homa_recvmsg_fill() - Fill in the description of an RPC's incoming
+ * message for return to the application in batched form, then release
+ * the RPC as in homa_recvmsg_done.
+ * @rpc:      RPC whose message is being returned. Must be locked by the
+ *            caller; this function unlocks it (and the RPC may be freed).
+ * @entry:    Information about the message is stored here.
+ */
+void homa_recvmsg_fill(struct homa_rpc *rpc, struct homa_recvmmsg_msg *entry)
+{
+	homa_recvmsg_unstreamable(rpc);
+	memset(entry, 0, sizeof(*entry));
+	entry->id = rpc->id;
+	entry->completion_cookie = rpc->completion_cookie;
+	entry->length = rpc->error ? rpc->error : rpc->msgin.length;
+	if (likely((rpc->msgin.length >= 0) && !rpc->msgin.streaming)) {
+		entry->num_bpages = rpc->msgin.num_bpages;
+		memcpy(entry->bpage_offsets, rpc->msgin.bpage_offsets,
+				sizeof(entry->bpage_offsets));
+	}
+	if (rpc->hsk->inet.sk.sk_family == AF_INET6) {
+		entry->peer_addr.in6.sin6_family = AF_INET6;
+		entry->peer_addr.in6.sin6_port = htons(rpc->dport);
+		entry->peer_addr.in6.sin6_addr = rpc->peer->addr;
+	} else {
+		entry->peer_addr.in4.sin_family = AF_INET;
+		entry->peer_addr.in4.sin_port = htons(rpc->dport);
+		entry->peer_addr.in4.sin_addr.s_addr = ipv6_to_ipv4(
+				rpc->peer->addr);
+	}
+	homa_recvmsg_done(rpc, entry->length);
+}
+
+/**
+ * homa_recvmmsg() - Implements the batched form of recvmsg, which returns
+ * information about several messages in a single call. Invoked by
+ * homa_recvmsg when msg->msg_control refers to a struct homa_recvmmsg_args.
+ * @hsk:         Socket on which the system call was invoked.
+ * @msg:         Controlling information for the receive.
+ * Return:       The number of messages returned (always > 0) on success,
+ *               otherwise a negative errno.
+ */
+int homa_recvmmsg(struct homa_sock *hsk, struct msghdr *msg)
+{
+	struct homa_recvmmsg_args args;
+	struct homa_recvmmsg_msg entry;
+	struct homa_rpc *rpc;
+	int result = 0;
+	int flags, i;
+
+	INC_METRIC(recv_batch_calls, 1);
+	if (unlikely(copy_from_user(&args, msg->msg_control, sizeof(args))))
+		return -EFAULT;
+	tt_record3("homa_recvmmsg starting, port %d, flags %d, max_msgs %d",
+			hsk->port, args.flags, args.max_msgs);
+	if (args._pad[0] || (args.flags & ~HOMA_RECVMSG_VALID_FLAGS)
+			|| (args.flags & HOMA_RECVMSG_STREAM)
+			|| (args.max_msgs == 0)
+			|| (args.max_msgs > HOMA_MAX_RECV_BATCH)
+			|| (args.num_msgs > args.max_msgs)) {
+		result = -EINVAL;
+		args.num_msgs = 0;
+		goto done;
+	}
+
+	/* Return buffers from the previous batch. Buffers passed in are
+	 * considered to have been returned even if this call fails.
+	 */
+	for (i = 0; i < args.num_msgs; i++) {
+		if (unlikely(copy_from_user(&entry, &args.msgs[i],
+				sizeof(entry)))) {
+			result = -EFAULT;
+			break;
+		}
+		if (entry.num_bpages > HOMA_MAX_BPAGES) {
+			result = -EINVAL;
+			break;
+		}
+		homa_pool_release_buffers(&hsk->buffer_pool, entry.num_bpages,
+				entry.bpage_offsets);
+	}
+	args.num_msgs = 0;
+	if (result)
+		goto done;
+
+	/* Only the first message is waited for; after that, collect as
+	 * many additional ready messages as possible without blocking.
+	 */
+	flags = args.flags;
+	while (args.num_msgs < args.max_msgs) {
+		rpc = homa_wait_for_message(hsk, flags, 0);
+		if (IS_ERR(rpc)) {
+			if (args.num_msgs == 0)
+				result = PTR_ERR(rpc);
+			break;
+		}
+		flags |= HOMA_RECVMSG_NONBLOCKING;
+		homa_recvmsg_fill(rpc, &entry);
+
+		if (unlikely(copy_to_user(&args.msgs[args.num_msgs], &entry,
+				sizeof(entry)))) {
+			/* Note: in this case the message's buffers will
+			 * be leaked.
+			 */
+			printk(KERN_NOTICE "homa_recvmmsg couldn't copy back "
+					"message info\n");
+			result = -EFAULT;
+			break;
+		}
+		args.num_msgs++;
+	}
+	if (args.num_msgs > 0)
+		result = args.num_msgs;
+	INC_METRIC(recv_batch_msgs, args.num_msgs);
+
+done:
+	if (unlikely(copy_to_user(msg->msg_control, &args, sizeof(args)))) {
+		printk(KERN_NOTICE "homa_recvmmsg couldn't copy back args\n");
+		result = -EFAULT;
+	}
+
+	/* See comment in homa_recvmsg. */
+	msg->msg_control = ((char *) msg->msg_control)
+			+ sizeof(struct homa_recvmmsg_args);
+	tt_record2("homa_recvmmsg returning %d, port %d", result, hsk->port);
+	return result;
+}
+
 /**
  * homa_recvmsg() - Receive a message from a Homa socket.
  * @sk:          Socket on which the system call was invoked.
@@ -1011,6 +1833,14 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 	__u64 finish;
 	int result;
 
+	if (unlikely(flags & MSG_ERRQUEUE)) {
+		/* Zero-copy completion notifications. */
+		if (sk->sk_family == AF_INET6)
+			return sock_recv_errqueue(sk, msg, len, SOL_IPV6,
+					IPV6_RECVERR);
+		return sock_recv_errqueue(sk, msg, len, SOL_IP, IP_RECVERR);
+	}
+
 	INC_METRIC(recv_calls, 1);
 	homa_cores[raw_smp_processor_id()]->last_app_active = start;
 	if (unlikely(!msg->msg_control)) {
@@ -1019,6 +1849,11 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 		 */
 		return -EINVAL;
 	}
+	if (msg->msg_controllen == sizeof(struct homa_recvmmsg_args)) {
+		result = homa_recvmmsg(hsk, msg);
+		INC_METRIC(recv_cycles, get_cycles() - start);
+		return result;
+	}
 	if (msg->msg_controllen != sizeof(control)) {
 		result = -EINVAL;
 		goto done;
@@ -1044,6 +1879,8 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 	homa_pool_release_buffers(&hsk->buffer_pool, control.num_bpages,
 			control.bpage_offsets);
 	control.num_bpages = 0;
+	if ((control.flags & HOMA_RECVMSG_STREAM) && !hsk->streaming)
+		WRITE_ONCE(hsk->streaming, 1);
 
 	rpc = homa_wait_for_message(hsk, control.flags, control.id);
 	if (IS_ERR(rpc)) {
@@ -1054,13 +1891,16 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 		result = PTR_ERR(rpc);
 		goto done;
 	}
+	if (!(control.flags & HOMA_RECVMSG_STREAM))
+		homa_recvmsg_unstreamable(rpc);
 	result = rpc->error ? rpc->error : rpc->msgin.length;
 
 	/* Generate time traces on both ends for long elapsed times (used
 	 * for performance debugging).
 	 */
 	if (rpc->hsk->homa->freeze_type == SLOW_RPC) {
-		uint64_t elapsed = (get_cycles() - rpc->start_cycles)>>10;
+		uint64_t elapsed = (get_cycles()
+				- rpc->cold->start_cycles)>>10;
 		if ((elapsed <= hsk->homa->temp[1])
 				&& (elapsed >= hsk->homa->temp[0])
 				&& homa_is_client(rpc->id)
@@ -1075,11 +1915,23 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 					"elapsed time for RPC id %d, peer 0x%x");
 		}
 	}
+	if (hsk->homa->freeze_slow_factor && homa_is_client(rpc->id)
+			&& (rpc->msgin.length >= 0))
+		homa_freeze_check_slow(rpc);
 
 	/* Collect result information. */
 	control.id = rpc->id;
 	control.completion_cookie = rpc->completion_cookie;
-	if (likely(rpc->msgin.length >= 0)) {
+	if (unlikely(rpc->msgin.length < 0)) {
+		/* No incoming message. */
+	} else if (control.flags & HOMA_RECVMSG_STREAM) {
+		/* If there is an error, none of the remaining buffers are
+		 * returned; they will be freed along with the RPC.
+		 */
+		rpc->msgin.streaming = 1;
+		if (!rpc->error)
+			result = homa_recvmsg_stream(rpc, &control);
+	} else if (likely(!rpc->msgin.streaming)) {
 		control.num_bpages = rpc->msgin.num_bpages;
 		memcpy(control.bpage_offsets, rpc->msgin.bpage_offsets,
 				sizeof(control.bpage_offsets));
@@ -1099,24 +1951,28 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 		*addr_len = sizeof(*in4);
 	}
 	memcpy(&control.peer_addr, msg->msg_name, *addr_len);
-	/* This indicates that the application now owns the buffers, so
-	 * we won't free them in homa_rpc_free.
-	 */
-	rpc->msgin.num_bpages = 0;
 
 	/* Must release the RPC lock (and potentially free the RPC) before
 	 * copying the results back to user space.
 	 */
-	if (homa_is_client(rpc->id)) {
-		homa_peer_add_ack(rpc);
-		homa_rpc_free(rpc);
+	if ((control.flags & HOMA_RECVMSG_STREAM) && !rpc->error
+			&& (rpc->msgin.stream_offset < rpc->msgin.length)) {
+		/* More of the message is still to come. If some of it is
+		 * already available, make the RPC ready again right away;
+		 * otherwise, future packets will do that.
+		 */
+		if (homa_stream_end(rpc) > rpc->msgin.stream_offset) {
+			atomic_or(RPC_PKTS_READY, &rpc->flags);
+			homa_sock_lock(hsk, "homa_recvmsg");
+			homa_rpc_handoff(rpc);
+			homa_sock_unlock(hsk);
+		}
+		homa_rpc_unlock(rpc);
 	} else {
-		if (result < 0)
-			homa_rpc_free(rpc);
-		else
-			rpc->state = RPC_IN_SERVICE;
+		if (control.flags & HOMA_RECVMSG_STREAM)
+			msg->msg_flags |= MSG_EOR;
+		homa_recvmsg_done(rpc, result);
 	}
-	homa_rpc_unlock(rpc);
 
 done:
 	if (unlikely(copy_to_user(msg->msg_control, &control, sizeof(control)))) {
@@ -1229,6 +2085,41 @@ int homa_v4_early_demux_handler(struct sk_buff *skb) {
 	return 0;
 }
 
+/**
+ * homa_udp_encap_rcv() - Invoked by the UDP code for each packet arriving
+ * on homa->udp_sock (i.e. a Homa packet encapsulated in UDP).
+ * @sk:    The UDP socket.
+ * @skb:   The incoming packet; skb->data refers to the UDP header.
+ * Return: The negative of the protocol to which the packet should be
+ *         passed (the IP layer will then hand it to homa_softirq, as if
+ *         it had arrived unencapsulated), or 0 if the packet was discarded.
+ */
+int homa_udp_encap_rcv(struct sock *sk, struct sk_buff *skb)
+{
+	if (unlikely(!pskb_may_pull(skb, sizeof(struct udphdr)
+			+ sizeof(struct common_header)))) {
+		INC_METRIC(short_packets, 1);
+		kfree_skb(skb);
+		return 0;
+	}
+
+	/* Strip the UDP header as FOU does, so that the IP length and the
+	 * packet checksum describe what homa_softirq will see.
+	 */
+	if (ip_hdr(skb)->version == 4)
+		ip_hdr(skb)->tot_len = htons(ntohs(ip_hdr(skb)->tot_len)
+				- sizeof(struct udphdr));
+	else
+		ipv6_hdr(skb)->payload_len = htons(
+				ntohs(ipv6_hdr(skb)->payload_len)
+				- sizeof(struct udphdr));
+	__skb_pull(skb, sizeof(struct udphdr));
+	skb_postpull_rcsum(skb, udp_hdr(skb), sizeof(struct udphdr));
+	skb_reset_transport_header(skb);
+	INC_METRIC(udp_packets_received, 1);
+	return -IPPROTO_HOMA;
+}
+
 /**
  * homa_softirq() - This function is invoked at SoftIRQ level to handle
  * incoming packets.
@@ -1237,14 +2128,14 @@ int homa_v4_early_demux_handler(struct sk_buff *skb) {
  */
 int homa_softirq(struct sk_buff *skb) {
 	struct common_header *h;
-	struct sk_buff *packets, *short_packets, *next;
-	struct sk_buff **prev_link, **short_link;
+	struct sk_buff *packets, *short_tail, *next;
+	struct in6_addr saddr;
 	__u16 dport;
 	static __u64 last = 0;
-	__u64 start;
+	__u64 start, end;
 	int header_offset;
 	int first_packet = 1;
-	struct homa_sock *hsk;
+	struct homa_sock *hsk = NULL;
 	int num_packets = 0;
 	int pull_length;
 	struct homa_lcache lcache;
@@ -1273,31 +2164,26 @@ int homa_softirq(struct sk_buff *skb) {
 	last = start;
 
 	/* skb may actually contain many distinct packets, linked through
-	 * skb_shinfo(skb)->frag_list by the Homa GRO mechanism. First, pull
-	 * out all the short packets into a separate list, then splice this
-	 * list into the front of the packet list, so that all the short
-	 * packets will get served first.
+	 * skb_shinfo(skb)->frag_list by the Homa GRO mechanism, which has
+	 * already sorted them: short packets come first (grouped by
+	 * destination port), followed by longer DATA packets grouped by
+	 * RPC. If skb itself is long, it belongs just after the short
+	 * packets, at the head of its RPC's group.
 	 */
-
-	skb->next = skb_shinfo(skb)->frag_list;
-	skb_shinfo(skb)->frag_list = NULL;
 	packets = skb;
-	prev_link = &packets;
-	short_packets = NULL;
-	short_link = &short_packets;
-	for (skb = packets; skb != NULL; skb = skb->next) {
-		if (skb->len < 1400) {
-			*prev_link = skb->next;
-			*short_link = skb;
-			short_link = &skb->next;
-		} else
-			prev_link = &skb->next;
-	}
-	*short_link = packets;
-	packets = short_packets;
+	short_tail = skb_shinfo(skb)->frag_list;
+	skb_shinfo(skb)->frag_list = NULL;
+	skb->next = short_tail;
+	if (short_tail && homa_short_packet(short_tail)
+			&& !homa_short_packet(skb)) {
+		while (short_tail->next && homa_short_packet(short_tail->next))
+			short_tail = short_tail->next;
+		packets = skb->next;
+		skb->next = short_tail->next;
+		short_tail->next = skb;
+	}
 
 	for (skb = packets; skb != NULL; skb = next) {
-		const struct in6_addr saddr = skb_canonical_ipv6_saddr(skb);
 		next = skb->next;
 		num_packets++;
 
@@ -1327,6 +2213,7 @@ int homa_softirq(struct sk_buff *skb) {
 				|| (h->type < DATA)
 				|| (h->type >= BOGUS)
 				|| (skb->len < header_lengths[h->type-DATA]))) {
+			saddr = skb_canonical_ipv6_saddr(skb);
 			if (homa->verbose)
 				printk(KERN_WARNING
 						"Homa %s packet from %s too "
@@ -1339,7 +2226,9 @@ int homa_softirq(struct sk_buff *skb) {
 		}
 
 		if (first_packet) {
-			tt_record4("homa_softirq: first packet from 0x%x:%d, "
+			saddr = skb_canonical_ipv6_saddr(skb);
+			tt_record_cat4(TT_SOFTIRQ,
+					"homa_softirq: first packet from 0x%x:%d, "
 					"id %llu, type %d",
 					tt_addr(saddr), ntohs(h->sport),
 					homa_local_id(h->sender_id), h->type);
@@ -1351,6 +2240,7 @@ int homa_softirq(struct sk_buff *skb) {
 			 * unknown.
 			 */
 			if (!tt_frozen) {
+				saddr = skb_canonical_ipv6_saddr(skb);
 				homa_rpc_log_active_tt(homa, 0);
 				tt_record4("Freezing because of request on "
 						"port %d from 0x%x:%d, id %d",
@@ -1362,8 +2252,29 @@ int homa_softirq(struct sk_buff *skb) {
 			goto discard;
 		}
 
+		/* GRO groups control packets by destination port, so
+		 * consecutive packets often go to the same socket; don't
+		 * repeat the lookup in that case.
+		 */
 		dport = ntohs(h->dport);
-		hsk = homa_sock_find(&homa->port_map, dport);
+		if (!hsk || (hsk->port != dport) || hsk->shutdown) {
+			hsk = homa_sock_find_cached(&homa->port_map, dport);
+			if (!hsk) {
+				/* Try a port group; the member depends on
+				 * the RPC, so this can't be cached.
+				 */
+				struct data_header *dh =
+						(struct data_header *) h;
+				int first = (h->type == DATA)
+						&& (dh->seg.offset == 0);
+
+				saddr = skb_canonical_ipv6_saddr(skb);
+				hsk = homa_group_select(homa, dport, &saddr,
+						ntohs(h->sport),
+						homa_local_id(h->sender_id),
+						first);
+			}
+		}
 		if (!hsk) {
 			if (skb_is_ipv6(skb))
 				icmp6_send(skb, ICMPV6_DEST_UNREACH,
@@ -1389,7 +2300,10 @@ discard:
 	atomic_add(incoming_delta, &homa->total_incoming);
 	homa_send_grants(homa);
 	atomic_dec(&homa_cores[raw_smp_processor_id()]->softirq_backlog);
-	INC_METRIC(softirq_cycles, get_cycles() - start);
+	end = get_cycles();
+	homa_softirq_load_update(homa_cores[raw_smp_processor_id()], start,
+			end);
+	INC_METRIC(softirq_cycles, end - start);
 	return 0;
 }
 
@@ -1513,6 +2427,8 @@ __poll_t homa_poll(struct file *file, struct socket *sock,
 	if (!list_empty(&homa_sk(sk)->ready_requests) ||
 			!list_empty(&homa_sk(sk)->ready_responses))
 		mask |= POLLIN | POLLRDNORM;
+	if (!skb_queue_empty_lockless(&sk->sk_error_queue))
+		mask |= POLLERR;
 	return mask;
 }
 
@@ -1584,6 +2500,99 @@ loff_t homa_metrics_lseek(struct file *file, loff_t offset, int whence)
 	return 0;
 }
 
+/**
+ * homa_metrics_bin_read() - This function is invoked to handle read kernel
+ * calls on /proc/net/homa_metrics_bin. Unlike /proc/net/homa_metrics,
+ * nothing is formatted and no locks are acquired: counters are copied
+ * directly from each core's struct homa_metrics, so collectors can poll
+ * frequently (and concurrently) at low cost. See struct homa_metrics_header
+ * for the layout of the file.
+ * @file:    Information about the file being read.
+ * @buffer:  Address in user space of the buffer in which data from the file
+ *           should be returned.
+ * @length:  Number of bytes available at @buffer.
+ * @offset:  Current read offset within the file.
+ *
+ * Return: the number of bytes returned at @buffer. 0 means the end of the
+ * file was reached, and a negative number indicates an error (-errno).
+ */
+ssize_t homa_metrics_bin_read(struct file *file, char __user *buffer,
+		size_t length, loff_t *offset)
+{
+	size_t schema_bytes = homa_metrics_schema_length
+			* sizeof(struct homa_metrics_field);
+	struct homa_metrics_header header;
+	size_t copied = 0;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = HOMA_METRICS_MAGIC;
+	header.version = HOMA_METRICS_VERSION;
+	header.header_bytes = sizeof(header);
+	header.num_fields = homa_metrics_schema_length;
+	header.num_cores = nr_cpu_ids;
+	header.core_bytes = sizeof(struct homa_metrics);
+	header.cores_offset = sizeof(header) + schema_bytes;
+	header.cpu_khz = cpu_khz;
+
+	/* Each iteration of this loop copies data from one region of the
+	 * file: the header, the schema, or the record for one core.
+	 */
+	while (copied < length) {
+		loff_t pos = *offset;
+		const char *src;
+		size_t avail;
+
+		if (pos < sizeof(header)) {
+			src = ((const char *) &header) + pos;
+			avail = sizeof(header) - pos;
+		} else if (pos < header.cores_offset) {
+			src = ((const char *) homa_metrics_schema)
+					+ (pos - sizeof(header));
+			avail = header.cores_offset - pos;
+		} else {
+			int core = (pos - header.cores_offset)
+					/ header.core_bytes;
+			size_t core_offset = (pos - header.cores_offset)
+					% header.core_bytes;
+
+			if (core >= nr_cpu_ids)
+				break;
+			src = ((const char *) &homa_cores[core]->metrics)
+					+ core_offset;
+			avail = header.core_bytes - core_offset;
+		}
+		if (avail > (length - copied))
+			avail = length - copied;
+		if (copy_to_user(buffer + copied, src, avail))
+			return -EFAULT;
+		copied += avail;
+		*offset += avail;
+	}
+	return copied;
+}
+
+/**
+ * homa_metrics_bin_lseek() - This function is invoked to handle seeks on
+ * /proc/net/homa_metrics_bin.
+ * @file:    Information about the file being read.
+ * @offset:  Distance to seek, in bytes
+ * @whence:  Starting point from which to measure the distance to seek;
+ *           only SEEK_SET and SEEK_CUR are supported.
+ *
+ * Return: the new file position, or a negative errno.
+ */
+loff_t homa_metrics_bin_lseek(struct file *file, loff_t offset, int whence)
+{
+	if (whence == SEEK_CUR)
+		offset += file->f_pos;
+	else if (whence != SEEK_SET)
+		return -EINVAL;
+	if (offset < 0)
+		return -EINVAL;
+	file->f_pos = offset;
+	return offset;
+}
+
 /**
  * homa_metrics_release() - This function is invoked when the last reference to
  * an open /proc/net/homa_metrics is closed.  It performs cleanup.
@@ -1601,9 +2610,10 @@ int homa_metrics_release(struct inode *inode, struct file *file)
 }
 
 /**
- * homa_dointvec() - This function is a wrapper around proc_dointvec. It is
- * invoked to read and write sysctl values and also update other values
- * that depend on the modified value.
+ * homa_dointvec() - This function is a wrapper around proc_dointvec_minmax
+ * (entries without extra1 or extra2 have no limits). It is invoked to read
+ * and write sysctl values and also update other values that depend on the
+ * modified value.
  * @table:    sysctl table describing value to be read or written.
  * @write:    Nonzero means value is being written, 0 means read.
  * @buffer:   Address in user space of the input/output data.
@@ -1616,7 +2626,7 @@ int homa_dointvec(struct ctl_table *table, int write,
 		void __user *buffer, size_t *lenp, loff_t *ppos)
 {
 	int result;
-	result = proc_dointvec(table, write, buffer, lenp, ppos);
+	result = proc_dointvec_minmax(table, write, buffer, lenp, ppos);
 	if (write) {
 		/* Don't worry which particular value changed; update
 		 * all info that is dependent on any sysctl value.
@@ -1633,6 +2643,16 @@ int homa_dointvec(struct ctl_table *table, int write,
 			homa_prios_changed(homa);
 		}
 
+		if (table->data == &homa_data.tt_categories)
+			tt_set_categories(homa->tt_categories);
+
+		if (table->data == &homa_data.udp_port) {
+			int err = homa_udp_config(homa);
+
+			if (err != 0)
+				result = err;
+		}
+
 		if (homa->next_id != 0) {
 			atomic64_set(&homa->next_outgoing_id, homa->next_id);
 			homa->next_id = 0;
@@ -1673,6 +2693,105 @@ int homa_dointvec(struct ctl_table *table, int write,
 	return result;
 }
 
+/* Serializes calls to homa_udp_config. */
+static DEFINE_MUTEX(homa_udp_mutex);
+
+/**
+ * homa_udp_config() - Open or close the kernel UDP socket used to receive
+ * encapsulated Homa packets, so that it matches homa->udp_port. Invoked
+ * whenever the udp_port sysctl is written.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * Return:   0 for success, otherwise a negative errno (in which case
+ *           homa->udp_port is reset to 0).
+ */
+int homa_udp_config(struct homa *homa)
+{
+	struct udp_tunnel_sock_cfg tunnel_cfg;
+	struct udp_port_cfg port_cfg;
+	struct socket *sock = NULL;
+	int err = 0;
+
+	mutex_lock(&homa_udp_mutex);
+	if (homa->udp_sock) {
+		udp_tunnel_sock_release(homa->udp_sock);
+		homa->udp_sock = NULL;
+	}
+	if ((homa->udp_port <= 0) || (homa->udp_port > 0xffff)) {
+		homa->udp_port = 0;
+		goto done;
+	}
+
+	/* An IPv6 socket that isn't v6only receives IPv4 packets too. */
+	memset(&port_cfg, 0, sizeof(port_cfg));
+	port_cfg.family = AF_INET6;
+	port_cfg.local_ip6 = in6addr_any;
+	port_cfg.ipv6_v6only = 0;
+	port_cfg.local_udp_port = htons(homa->udp_port);
+	err = udp_sock_create(&init_net, &port_cfg, &sock);
+	if (err) {
+		port_cfg.family = AF_INET;
+		port_cfg.local_ip.s_addr = htonl(INADDR_ANY);
+		err = udp_sock_create(&init_net, &port_cfg, &sock);
+	}
+	if (err) {
+		printk(KERN_ERR "Homa couldn't open UDP port %d: error %d\n",
+				homa->udp_port, -err);
+		homa->udp_port = 0;
+		goto done;
+	}
+	memset(&tunnel_cfg, 0, sizeof(tunnel_cfg));
+	tunnel_cfg.encap_type = 1;
+	tunnel_cfg.encap_rcv = homa_udp_encap_rcv;
+	setup_udp_tunnel_sock(&init_net, sock, &tunnel_cfg);
+	homa->udp_sock = sock;
+
+done:
+	mutex_unlock(&homa_udp_mutex);
+	return err;
+}
+
+/**
+ * homa_dostring() - This function is a wrapper around proc_dostring. It is
+ * invoked to read and write string-valued sysctls and also update other
+ * values that depend on the modified value. The string is parsed by
+ * homa_nic_set_speed while holding homa->nic_lock, so proc_dostring
+ * operates on a copy, which is exchanged with the real value under
+ * that lock.
+ * @table:    sysctl table describing value to be read or written.
+ * @write:    Nonzero means value is being written, 0 means read.
+ * @buffer:   Address in user space of the input/output data.
+ * @lenp:     Not exactly sure.
+ * @ppos:     Not exactly sure.
+ *
+ * Return: 0 for success, nonzero for error.
+ */
+int homa_dostring(struct ctl_table *table, int write,
+		void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+	struct ctl_table table_copy;
+	char *value;
+	int result;
+
+	value = kmalloc(table->maxlen, GFP_KERNEL);
+	if (value == NULL)
+		return -ENOMEM;
+	spin_lock_bh(&homa->nic_lock);
+	memcpy(value, table->data, table->maxlen);
+	spin_unlock_bh(&homa->nic_lock);
+
+	table_copy = *table;
+	table_copy.data = value;
+	result = proc_dostring(&table_copy, write, buffer, lenp, ppos);
+	if (write && (result == 0)) {
+		spin_lock_bh(&homa->nic_lock);
+		memcpy(table->data, value, table->maxlen);
+		spin_unlock_bh(&homa->nic_lock);
+		homa_outgoing_sysctl_changed(homa);
+	}
+	kfree(value);
+	return result;
+}
+
 /**
  * homa_sysctl_softirq_cores() - This function is invoked to handle sysctl
  * requests for the "gen3_softirq_cores" target, which requires special
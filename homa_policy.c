@@ -0,0 +1,310 @@
+/* Copyright (c) 2023 Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* This file implements pluggable grant and priority policies (see struct
+ * homa_policy_ops). Homa's fast paths check homa->policy with
+ * rcu_access_pointer and call the functions here only when a policy has
+ * been installed; these functions invoke the hooks, clamp their results
+ * to legal values, and record the time spent in each hook in Homa's
+ * metrics. When the kernel supports it, homa_policy_ops is also
+ * registered as a BPF struct_ops type, so policies can be written as BPF
+ * programs.
+ */
+
+#include "homa_impl.h"
+
+#if IS_ENABLED(CONFIG_BPF_SYSCALL) && IS_ENABLED(CONFIG_BPF_JIT) \
+		&& IS_ENABLED(CONFIG_DEBUG_INFO_BTF_MODULES) \
+		&& (LINUX_VERSION_CODE >= KERNEL_VERSION(6,11,0)) \
+		&& !defined(__UNIT_TEST__)
+#define HOMA_BPF_POLICY 1
+#include <linux/bpf.h>
+#include <linux/btf.h>
+
+extern struct homa *homa;
+#endif
+
+/**
+ * homa_policy_register() - Install a set of policy hooks. Only one
+ * homa_policy_ops may be installed at a time. Exported so that policies
+ * can be implemented in other kernel modules.
+ * @homa:    Overall data about the Homa protocol implementation (other
+ *           modules should pass the exported global homa).
+ * @ops:     Hooks to install; must remain valid until passed to
+ *           homa_policy_unregister.
+ * Return:   Either zero (for success) or a negative errno (-EBUSY means
+ *           that another policy is already installed).
+ */
+int homa_policy_register(struct homa *homa, struct homa_policy_ops *ops)
+{
+	homa_grantable_lock(homa);
+	if (rcu_access_pointer(homa->policy)) {
+		homa_grantable_unlock(homa);
+		return -EBUSY;
+	}
+	rcu_assign_pointer(homa->policy, ops);
+	homa_grantable_resort(homa);
+	homa_grantable_unlock(homa);
+	printk(KERN_NOTICE "Homa grant/priority policy installed\n");
+	return 0;
+}
+EXPORT_SYMBOL(homa_policy_register);
+
+/**
+ * homa_policy_unregister() - Remove a set of policy hooks, reverting to
+ * Homa's default policies. When this function returns, none of the hooks
+ * in @ops is executing or will be invoked again. May block.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @ops:     Hooks previously passed to homa_policy_register. If these
+ *           aren't the currently installed hooks then nothing happens.
+ */
+void homa_policy_unregister(struct homa *homa, struct homa_policy_ops *ops)
+{
+	homa_grantable_lock(homa);
+	if (rcu_access_pointer(homa->policy) != ops) {
+		homa_grantable_unlock(homa);
+		return;
+	}
+	RCU_INIT_POINTER(homa->policy, NULL);
+	homa_grantable_resort(homa);
+	homa_grantable_unlock(homa);
+	synchronize_rcu();
+	printk(KERN_NOTICE "Homa grant/priority policy removed\n");
+}
+EXPORT_SYMBOL(homa_policy_unregister);
+
+/**
+ * homa_policy_grantable_before() - Invoke the grantable_before hook of
+ * the installed policy, if there is one.
+ * @rpc1:    First RPC to compare.
+ * @rpc2:    Second RPC to compare.
+ * Return:   1 means @rpc1 should be granted ahead of @rpc2, 0 means it
+ *           shouldn't, and -1 means there is no hook, so the caller should
+ *           use the default ordering.
+ */
+int homa_policy_grantable_before(struct homa_rpc *rpc1,
+		struct homa_rpc *rpc2)
+{
+	struct homa_policy_ops *ops;
+	int result = -1;
+	__u64 start;
+
+	rcu_read_lock();
+	ops = rcu_dereference(rpc1->hsk->homa->policy);
+	if (ops && ops->grantable_before) {
+		start = get_cycles();
+		result = ops->grantable_before(rpc1, rpc2) ? 1 : 0;
+		INC_METRIC(policy_order_calls, 1);
+		INC_METRIC(policy_order_cycles, get_cycles() - start);
+	}
+	rcu_read_unlock();
+	return result;
+}
+
+/**
+ * homa_policy_unsched_priority() - Invoke the unsched_priority hook of the
+ * installed policy, if there is one.
+ * @homa:      Overall data about the Homa protocol implementation.
+ * @peer:      The destination of the message.
+ * @length:    Number of bytes in the message.
+ * @priority:  The priority Homa would use by default.
+ * Return:     The priority to use for the message's unscheduled packets.
+ */
+int homa_policy_unsched_priority(struct homa *homa, struct homa_peer *peer,
+		int length, int priority)
+{
+	struct homa_policy_ops *ops;
+	__u64 start;
+
+	rcu_read_lock();
+	ops = rcu_dereference(homa->policy);
+	if (ops && ops->unsched_priority) {
+		start = get_cycles();
+		priority = ops->unsched_priority(peer, length, priority);
+		INC_METRIC(policy_unsched_calls, 1);
+		INC_METRIC(policy_unsched_cycles, get_cycles() - start);
+		if (priority < 0)
+			priority = 0;
+		if (priority >= homa->num_priorities)
+			priority = homa->num_priorities - 1;
+	}
+	rcu_read_unlock();
+	return priority;
+}
+
+/**
+ * homa_policy_grant_priority() - Invoke the grant_priority hook of the
+ * installed policy, if there is one.
+ * @homa:      Overall data about the Homa protocol implementation.
+ * @rpc:       RPC that is about to receive a grant.
+ * @rank:      Position of @rpc among the RPCs being granted (0 is the
+ *             highest priority).
+ * @priority:  The priority Homa would use by default.
+ * Return:     The priority to specify in the grant.
+ */
+int homa_policy_grant_priority(struct homa *homa, struct homa_rpc *rpc,
+		int rank, int priority)
+{
+	struct homa_policy_ops *ops;
+	__u64 start;
+
+	rcu_read_lock();
+	ops = rcu_dereference(homa->policy);
+	if (ops && ops->grant_priority) {
+		start = get_cycles();
+		priority = ops->grant_priority(rpc, rank, priority);
+		INC_METRIC(policy_grant_calls, 1);
+		INC_METRIC(policy_grant_cycles, get_cycles() - start);
+		if (priority < 0)
+			priority = 0;
+		if (priority > homa->max_sched_prio)
+			priority = homa->max_sched_prio;
+	}
+	rcu_read_unlock();
+	return priority;
+}
+
+/**
+ * homa_policy_fifo_key() - Invoke the fifo_key hook of the installed
+ * policy, if there is one.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @rpc:     A grantable RPC that is a candidate for a FIFO grant.
+ * Return:   The key for @rpc; the RPC with the smallest key gets the
+ *           FIFO grant.
+ */
+__u64 homa_policy_fifo_key(struct homa *homa, struct homa_rpc *rpc)
+{
+	struct homa_policy_ops *ops;
+	__u64 key = rpc->msgin.birth;
+	__u64 start;
+
+	rcu_read_lock();
+	ops = rcu_dereference(homa->policy);
+	if (ops && ops->fifo_key) {
+		start = get_cycles();
+		key = ops->fifo_key(rpc);
+		INC_METRIC(policy_fifo_calls, 1);
+		INC_METRIC(policy_fifo_cycles, get_cycles() - start);
+	}
+	rcu_read_unlock();
+	return key;
+}
+
+#ifdef HOMA_BPF_POLICY
+/* The code below registers struct homa_policy_ops as a BPF struct_ops
+ * type, so that a policy can be installed by attaching a BPF struct_ops
+ * map of type "homa_policy_ops". Hook programs may read the RPCs and
+ * peers passed to them, but may not write them.
+ */
+
+static const struct bpf_func_proto *homa_bpf_get_func_proto(
+		enum bpf_func_id func_id, const struct bpf_prog *prog)
+{
+	return bpf_base_func_proto(func_id, prog);
+}
+
+static bool homa_bpf_is_valid_access(int off, int size,
+		enum bpf_access_type type, const struct bpf_prog *prog,
+		struct bpf_insn_access_aux *info)
+{
+	return bpf_tracing_btf_ctx_access(off, size, type, prog, info);
+}
+
+static const struct bpf_verifier_ops homa_bpf_verifier_ops = {
+	.get_func_proto =   homa_bpf_get_func_proto,
+	.is_valid_access =  homa_bpf_is_valid_access,
+};
+
+static int homa_bpf_init(struct btf *btf)
+{
+	return 0;
+}
+
+static int homa_bpf_init_member(const struct btf_type *t,
+		const struct btf_member *member, void *kdata,
+		const void *udata)
+{
+	return 0;
+}
+
+static int homa_bpf_reg(void *kdata, struct bpf_link *link)
+{
+	return homa_policy_register(homa, kdata);
+}
+
+static void homa_bpf_unreg(void *kdata, struct bpf_link *link)
+{
+	homa_policy_unregister(homa, kdata);
+}
+
+/* Stubs required by the BPF framework for control-flow integrity. */
+static int homa_bpf_grantable_before(struct homa_rpc *rpc1,
+		struct homa_rpc *rpc2)
+{
+	return 0;
+}
+
+static int homa_bpf_unsched_priority(struct homa_peer *peer, int length,
+		int priority)
+{
+	return 0;
+}
+
+static int homa_bpf_grant_priority(struct homa_rpc *rpc, int rank,
+		int priority)
+{
+	return 0;
+}
+
+static __u64 homa_bpf_fifo_key(struct homa_rpc *rpc)
+{
+	return 0;
+}
+
+static struct homa_policy_ops homa_bpf_cfi_stubs = {
+	.grantable_before =  homa_bpf_grantable_before,
+	.unsched_priority =  homa_bpf_unsched_priority,
+	.grant_priority =    homa_bpf_grant_priority,
+	.fifo_key =          homa_bpf_fifo_key,
+};
+
+static struct bpf_struct_ops homa_bpf_policy_ops = {
+	.verifier_ops =  &homa_bpf_verifier_ops,
+	.init =          homa_bpf_init,
+	.init_member =   homa_bpf_init_member,
+	.reg =           homa_bpf_reg,
+	.unreg =         homa_bpf_unreg,
+	.cfi_stubs =     &homa_bpf_cfi_stubs,
+	.name =          "homa_policy_ops",
+	.owner =         THIS_MODULE,
+};
+#endif /* HOMA_BPF_POLICY */
+
+/**
+ * homa_policy_bpf_init() - Invoked when Homa is loaded to make
+ * homa_policy_ops available as a BPF struct_ops type, if the kernel
+ * supports that. The registration is undone automatically when the
+ * module is unloaded.
+ * Return:   Either zero (for success) or a negative errno. Zero is also
+ *           returned if this kernel doesn't support BPF policies.
+ */
+int homa_policy_bpf_init(void)
+{
+#ifdef HOMA_BPF_POLICY
+	return register_bpf_struct_ops(&homa_bpf_policy_ops, homa_policy_ops);
+#else
+	return 0;
+#endif
+}
@@ -20,8 +20,13 @@
  */
 #define MIN_POOL_SIZE 2
 
-/* Used when determining how many bpages to consider for allocation. */
-#define MIN_EXTRA 4
+/* Number of bpages that a core moves from the pool's free stack to its
+ * own free stack when its own stack runs dry.
+ */
+#define REFILL_BATCH 8
+
+/* Index used to mark the end of a free stack. */
+#define NO_BPAGE 0xffffffff
 
 /* When running unit tests, allow HOMA_BPAGE_SIZE and HOMA_BPAGE_SHIFT
  * to be overriden.
@@ -46,6 +51,331 @@ static void inline set_bpages_needed(struct homa_pool *pool) {
 			>> HOMA_BPAGE_SHIFT;
 }
 
+/* Free bpages are kept in lock-free stacks: there is one for the pool
+ * as a whole (or one for each NUMA node, if the region has been divided
+ * among nodes), plus one for each core. The head of a stack is an atomic64_t
+ * whose low-order 32 bits hold the index of the top bpage (or NO_BPAGE
+ * if the stack is empty); the bpages in a stack are linked through
+ * their next_free fields. The high-order 32 bits of the head are a
+ * generation count that changes with every update; this prevents ABA
+ * problems when a bpage is popped, reused, and pushed again while
+ * another core is in the middle of popping it.
+ */
+
+/**
+ * new_head() - Compute the new head value for a free stack.
+ * @old:     Current value of the stack head.
+ * @index:   Index of the bpage that will be at the top of the stack.
+ * Return:   Head value referring to @index, with a new generation count.
+ */
+static inline __s64 new_head(__s64 old, __u32 index)
+{
+	return (__s64) ((((__u64) old) + (1ULL << 32)) & ~0xffffffffULL)
+			| index;
+}
+
+/**
+ * homa_pool_push() - Push a chain of bpages onto a free stack. Safe to
+ * invoke concurrently with other pushes and pops on the same stack.
+ * @pool:     Pool containing the bpages.
+ * @stack:    Head of the stack.
+ * @first:    Index of the first bpage in the chain. The chain is linked
+ *            through the next_free fields of the bpages.
+ * @last:     Index of the last bpage in the chain; its next_free field
+ *            will be overwritten.
+ */
+static void homa_pool_push(struct homa_pool *pool, atomic64_t *stack,
+		__u32 first, __u32 last)
+{
+	__s64 old = atomic64_read(stack);
+
+	do {
+		pool->descriptors[last].next_free = (__u32) old;
+	} while (!atomic64_try_cmpxchg(stack, &old, new_head(old, first)));
+}
+
+/**
+ * homa_pool_pop() - Remove the top bpage from a free stack. Safe to
+ * invoke concurrently with other pushes and pops on the same stack.
+ * @pool:     Pool containing the bpages.
+ * @stack:    Head of the stack.
+ * Return:    Index of the bpage that was removed, or -1 if the stack
+ *            was empty.
+ */
+static int homa_pool_pop(struct homa_pool *pool, atomic64_t *stack)
+{
+	__s64 old = atomic64_read(stack);
+	__u32 index;
+
+	do {
+		index = (__u32) old;
+		if (index == NO_BPAGE)
+			return -1;
+	} while (!atomic64_try_cmpxchg(stack, &old, new_head(old,
+			READ_ONCE(pool->descriptors[index].next_free))));
+	return index;
+}
+
+/**
+ * homa_pool_home_stack() - Return the stack to which a bpage should be
+ * returned when it becomes free.
+ * @pool:     Pool containing the bpage.
+ * @index:    Index of the bpage (must not be in the extent area).
+ * Return:    The pool's free stack, or the stack for the NUMA node whose
+ *            sub-region contains @index.
+ */
+static inline atomic64_t *homa_pool_home_stack(struct homa_pool *pool,
+		__u32 index)
+{
+	int node;
+
+	if (!pool->node_stacks)
+		return &pool->free_stack;
+	node = index / pool->node_bpages;
+	if (node >= pool->num_nodes)
+		node = pool->num_nodes - 1;
+	return &pool->node_stacks[node];
+}
+
+/**
+ * homa_pool_refill() - Take a batch of bpages from a shared free stack,
+ * and save all but the first of them in a core's free stack.
+ * @pool:     Pool containing the stacks.
+ * @core:     Core whose free stack is to be refilled.
+ * @stack:    Shared stack from which to take bpages.
+ * Return:    Index of the first bpage taken (the caller now owns it), or
+ *            -1 if @stack was empty.
+ */
+static int homa_pool_refill(struct homa_pool *pool,
+		struct homa_pool_core *core, atomic64_t *stack)
+{
+	int index, first, last, next, i;
+
+	index = homa_pool_pop(pool, stack);
+	if (index < 0)
+		return -1;
+	first = last = -1;
+	for (i = 1; i < REFILL_BATCH; i++) {
+		next = homa_pool_pop(pool, stack);
+		if (next < 0)
+			break;
+		if (last < 0)
+			first = next;
+		else
+			pool->descriptors[last].next_free = next;
+		last = next;
+	}
+	if (last >= 0)
+		homa_pool_push(pool, &core->free_stack, first, last);
+	return index;
+}
+
+/**
+ * homa_pool_get_free() - Find a free bpage (one whose reference count
+ * is zero) and remove it from its free stack.
+ * @pool:     Pool from which to allocate.
+ * @core_num: Core on whose behalf the allocation is made.
+ * Return:    Index of the bpage, or -1 if no free bpage could be found.
+ */
+static int homa_pool_get_free(struct homa_pool *pool, int core_num)
+{
+	struct homa_pool_core *core = &pool->cores[core_num];
+	int index, next, node, i;
+
+	index = homa_pool_pop(pool, &core->free_stack);
+	if (index >= 0)
+		return index;
+
+	/* This core's stack is empty: grab a batch of bpages from the
+	 * pool's stack, use the first one, and save the rest for later.
+	 * If the region is divided among NUMA nodes, prefer the node
+	 * where the receiving thread runs, since that thread will copy
+	 * the data out.
+	 */
+	if (!pool->node_stacks) {
+		index = homa_pool_refill(pool, core, &pool->free_stack);
+		if (index >= 0)
+			return index;
+	} else {
+		node = READ_ONCE(pool->recv_node) % pool->num_nodes;
+		for (i = 0; i < pool->num_nodes; i++) {
+			index = homa_pool_refill(pool, core,
+					&pool->node_stacks[node]);
+			if (index >= 0) {
+				if (i != 0)
+					INC_METRIC(bpage_remote_refills, 1);
+				return index;
+			}
+			node++;
+			if (node >= pool->num_nodes)
+				node = 0;
+		}
+	}
+
+	/* The pool's stack is empty too, so the remaining free bpages
+	 * (if any) must be cached by other cores.
+	 */
+	for (i = 1; i < pool->num_cores; i++) {
+		next = core_num + i;
+		if (next >= pool->num_cores)
+			next -= pool->num_cores;
+		index = homa_pool_pop(pool, &pool->cores[next].free_stack);
+		if (index >= 0) {
+			INC_METRIC(bpage_steals, 1);
+			return index;
+		}
+	}
+	return -1;
+}
+
+/**
+ * homa_pool_steal_owned() - Find a bpage that is owned by a core but
+ * not in use by any message, and whose lease has expired.
+ * @pool:     Pool from which to allocate.
+ * @now:      Current time, in get_cycles units.
+ * Return:    Index of the bpage, or -1 if there is no such page. If the
+ *            return value is >= 0, the bpage is locked.
+ */
+static int homa_pool_steal_owned(struct homa_pool *pool, __u64 now)
+{
+	struct homa_bpage *bpage;
+	int i, index;
+
+	/* A core can own at most one bpage at a time, which is the one
+	 * given by its page_hint.
+	 */
+	for (i = 0; i < pool->num_cores; i++) {
+		index = READ_ONCE(pool->cores[i].page_hint);
+		bpage = &pool->descriptors[index];
+		if ((atomic_read(&bpage->refs) != 1) || (bpage->owner < 0)
+				|| (bpage->expiration > now))
+			continue;
+		if (!spin_trylock_bh(&bpage->lock))
+			continue;
+
+		/* Must check again in case someone else snuck in and
+		 * grabbed the page.
+		 */
+		if ((atomic_read(&bpage->refs) != 1) || (bpage->owner < 0)
+				|| (bpage->expiration > now)) {
+			spin_unlock_bh(&bpage->lock);
+			continue;
+		}
+		return index;
+	}
+	return -1;
+}
+
+/**
+ * homa_pool_page_size() - Find out what size of pages backs a buffer
+ * region in the current process.
+ * @region:   Address (in the current process's virtual memory) of the
+ *            region.
+ * Return:    The size of the pages that back @region: the huge page size
+ *            if the region was mapped from hugetlbfs (MAP_HUGETLB) or
+ *            is eligible for transparent huge pages (MADV_HUGEPAGE),
+ *            otherwise PAGE_SIZE. Must not be invoked in atomic context.
+ */
+unsigned long homa_pool_page_size(void *region)
+{
+	unsigned long addr = (unsigned long) region;
+	unsigned long result = PAGE_SIZE;
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma;
+
+	if (!mm)
+		return result;
+	mmap_read_lock(mm);
+	vma = find_vma(mm, addr);
+	if (vma && (vma->vm_start <= addr)) {
+		if (is_vm_hugetlb_page(vma))
+			result = vma_kernel_pagesize(vma);
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+		else if (vma->vm_flags & VM_HUGEPAGE)
+			result = HPAGE_PMD_SIZE;
+#endif
+	}
+	mmap_read_unlock(mm);
+	return result;
+}
+
+/**
+ * homa_pool_pin() - Pin all of the pages of a pool's region in memory,
+ * so that homa_copy_to_pinned can copy packet data into the region
+ * without being in the context of the process that owns the region.
+ * @pool:     Pool whose region should be pinned; must have been
+ *            initialized by the process that owns the region. Must not
+ *            be invoked in atomic context.
+ * Return:    Either zero (for success) or a negative errno for failure;
+ *            if an error occurs, the pool remains usable but its region
+ *            is not pinned.
+ */
+int homa_pool_pin(struct homa_pool *pool)
+{
+	int num_pages = (((__u64) pool->num_bpages) << HOMA_BPAGE_SHIFT)
+			>> PAGE_SHIFT;
+	struct mm_struct *mm = current->mm;
+	struct page **pages;
+	int pinned, err;
+
+	/* Long-term pins are charged against RLIMIT_MEMLOCK, as for
+	 * other long-term users of pin_user_pages.
+	 */
+	err = account_locked_vm(mm, num_pages, true);
+	if (err)
+		return err;
+	pages = (struct page **) vmalloc(num_pages * sizeof(struct page *));
+	if (!pages) {
+		account_locked_vm(mm, num_pages, false);
+		return -ENOMEM;
+	}
+	pinned = pin_user_pages_fast((unsigned long) pool->region, num_pages,
+			FOLL_WRITE | FOLL_LONGTERM, pages);
+	if (pinned != num_pages) {
+		if (pinned > 0)
+			unpin_user_pages(pages, pinned);
+		vfree(pages);
+		account_locked_vm(mm, num_pages, false);
+		return (pinned < 0) ? pinned : -EFAULT;
+	}
+	pool->num_pinned_pages = num_pages;
+	mmgrab(mm);
+	pool->pinned_mm = mm;
+
+	/* Softirq handlers may start using the pages as soon as this
+	 * pointer is visible.
+	 */
+	smp_store_release(&pool->pinned_pages, pages);
+	return 0;
+}
+
+/**
+ * homa_pool_unpin() - Release the pinned pages of a pool's region (if
+ * they are pinned) and remove the charge for them from the address
+ * space that pinned them.
+ * @pool:     Pool whose region should be unpinned. Must not be invoked
+ *            in atomic context.
+ */
+void homa_pool_unpin(struct homa_pool *pool)
+{
+	struct page **pages = pool->pinned_pages;
+
+	if (!pages)
+		return;
+
+	/* SoftIRQ handlers may be copying into the pages: wait for them
+	 * to finish before unpinning.
+	 */
+	smp_store_release(&pool->pinned_pages, NULL);
+	synchronize_rcu();
+	unpin_user_pages(pages, pool->num_pinned_pages);
+	vfree(pages);
+	account_locked_vm(pool->pinned_mm, pool->num_pinned_pages, false);
+	mmdrop(pool->pinned_mm);
+	pool->pinned_mm = NULL;
+	pool->num_pinned_pages = 0;
+}
+
 /**
  * homa_pool_init() - Initialize a homa_pool; any previous contents of the
  * objects are overwritten.
@@ -53,11 +383,19 @@ static void inline set_bpages_needed(struct homa_pool *pool) {
  * @region:       First byte of the memory region for the pool, allocated
  *                by the application; must be page-aligned.
  * @region_size   Total number of bytes available at @buf_region.
+ * @extent_size:  Number of bytes at the end of the region to reserve
+ *                for contiguous extents (see homa_pool_get_extent);
+ *                0 means no extents.
+ * @num_nodes:    If nonzero, the bpages before the extent area are divided
+ *                into this many equal sub-regions, where sub-region i
+ *                is expected to reside on NUMA node i (see
+ *                SO_HOMA_BUF_NODES); 0 means no NUMA placement.
  * Return: Either zero (for success) or a negative errno for failure.
  */
-int homa_pool_init(struct homa_sock *hsk, void *region, __u64 region_size)
+int homa_pool_init(struct homa_sock *hsk, void *region, __u64 region_size,
+		__u64 extent_size, int num_nodes)
 {
-	int i, result;
+	int i, node, result;
 	struct homa_pool *pool = &hsk->buffer_pool;
 
 	if (((__u64) region) & ~PAGE_MASK)
@@ -67,10 +405,29 @@ int homa_pool_init(struct homa_sock *hsk, void *region, __u64 region_size)
 	pool->num_bpages = region_size >> HOMA_BPAGE_SHIFT;
 	pool->descriptors = NULL;
 	pool->cores = NULL;
-	if (pool->num_bpages < MIN_POOL_SIZE) {
+	pool->extent_map = NULL;
+	pool->node_stacks = NULL;
+	pool->pinned_pages = NULL;
+	pool->num_pinned_pages = 0;
+	pool->pinned_mm = NULL;
+	if ((pool->num_bpages < MIN_POOL_SIZE) || ((extent_size
+			>> HOMA_BPAGE_SHIFT) > (pool->num_bpages
+			- MIN_POOL_SIZE))) {
+		result = -EINVAL;
+		goto error;
+	}
+	pool->num_extent_bpages = extent_size >> HOMA_BPAGE_SHIFT;
+	pool->extent_start = pool->num_bpages - pool->num_extent_bpages;
+	pool->extent_hint = 0;
+	spin_lock_init(&pool->extent_lock);
+	if ((num_nodes < 0) || (num_nodes > nr_node_ids)
+			|| (num_nodes > pool->extent_start)) {
 		result = -EINVAL;
 		goto error;
 	}
+	pool->num_nodes = num_nodes;
+	pool->node_bpages = num_nodes ? pool->extent_start / num_nodes : 0;
+	pool->recv_node = 0;
 	pool->descriptors = (struct homa_bpage *) kmalloc(
 			pool->num_bpages * sizeof(struct homa_bpage),
 			GFP_ATOMIC);
@@ -83,9 +440,12 @@ int homa_pool_init(struct homa_sock *hsk, void *region, __u64 region_size)
 		spin_lock_init(&bp->lock);
 		atomic_set(&bp->refs, 0);
 		bp->owner = -1;
+		bp->next_free = i + 1;
 		bp->expiration = 0;
 	}
-	atomic_set(&pool->free_bpages, pool->num_bpages);
+	pool->descriptors[pool->extent_start - 1].next_free = NO_BPAGE;
+	atomic64_set(&pool->free_stack, pool->num_nodes ? NO_BPAGE : 0);
+	atomic_set(&pool->free_bpages, pool->extent_start);
 	pool->bpages_needed = INT_MAX;
 
 	/* Allocate and initialize core-specific data. */
@@ -99,7 +459,39 @@ int homa_pool_init(struct homa_sock *hsk, void *region, __u64 region_size)
 	for (i = 0; i < pool->num_cores; i++) {
 		pool->cores[i].page_hint = 0;
 		pool->cores[i].allocated = 0;
-		pool->cores[i].next_candidate = 0;
+		atomic64_set(&pool->cores[i].free_stack, NO_BPAGE);
+	}
+
+	if (pool->num_extent_bpages) {
+		int bytes = BITS_TO_LONGS(pool->num_extent_bpages)
+				* sizeof(unsigned long);
+		pool->extent_map = (unsigned long *) kmalloc(bytes,
+				GFP_ATOMIC);
+		if (!pool->extent_map) {
+			result = -ENOMEM;
+			goto error;
+		}
+		memset(pool->extent_map, 0, bytes);
+	}
+
+	/* If the region is divided among NUMA nodes, split the chain of
+	 * free bpages at the sub-region boundaries, so that each node's
+	 * bpages form a separate stack.
+	 */
+	if (pool->num_nodes) {
+		pool->node_stacks = (atomic64_t *) kmalloc(pool->num_nodes
+				* sizeof(atomic64_t), GFP_ATOMIC);
+		if (!pool->node_stacks) {
+			result = -ENOMEM;
+			goto error;
+		}
+		for (node = 0; node < pool->num_nodes; node++) {
+			atomic64_set(&pool->node_stacks[node],
+					node * pool->node_bpages);
+			if (node > 0)
+				pool->descriptors[node * pool->node_bpages - 1]
+						.next_free = NO_BPAGE;
+		}
 	}
 
 	return 0;
@@ -109,6 +501,8 @@ int homa_pool_init(struct homa_sock *hsk, void *region, __u64 region_size)
 		kfree(pool->descriptors);
 	if (pool->cores)
 		kfree(pool->cores);
+	if (pool->extent_map)
+		kfree(pool->extent_map);
 	pool->region = NULL;
 	return result;
 }
@@ -124,6 +518,9 @@ void homa_pool_destroy(struct homa_pool *pool)
 		return;
 	kfree(pool->descriptors);
 	kfree(pool->cores);
+	kfree(pool->extent_map);
+	kfree(pool->node_stacks);
+	homa_pool_unpin(pool);
 	pool->region = NULL;
 }
 
@@ -145,9 +542,7 @@ int homa_pool_get_pages(struct homa_pool *pool, int num_pages, __u32 *pages,
 {
 	int alloced = 0;
 	__u64 now = get_cycles();
-	int limit = 0;
 	int core_num = raw_smp_processor_id();
-	struct homa_pool_core *core = &pool->cores[core_num];
 
 	if (atomic_sub_return(num_pages, &pool->free_bpages) < 0) {
 		atomic_add(num_pages, &pool->free_bpages);
@@ -159,61 +554,27 @@ int homa_pool_get_pages(struct homa_pool *pool, int num_pages, __u32 *pages,
 	 */
 	while (alloced != num_pages) {
 		struct homa_bpage *bpage;
-		int cur, ref_count;
-
-		/* If we don't need to use all of the bpages in the pool,
-		 * then try to use only the ones with low indexes. This
-		 * will reduce the cache footprint for the pool by reusing
-		 * a few bpages over and over. Specifically this code will
-		 * not consider any candidate page whose index is >= limit.
-		 * Limit is chosen to make sure there are a reasonable
-		 * number of free pages in the range, so we won't have to
-		 * check a huge number of pages.
-		 */
-		if (limit == 0) {
-			int extra;
-			limit = pool->num_bpages
-					- atomic_read(&pool->free_bpages);
-			extra = limit>>2;
-			limit += (extra < MIN_EXTRA) ? MIN_EXTRA : extra;
-			if (limit > pool->num_bpages)
-				limit = pool->num_bpages;
-		}
-
-		cur = core->next_candidate;
-		core->next_candidate++;
-		if (cur >= limit) {
-			core->next_candidate = 0;
+		int cur;
 
-			/* Must recompute the limit for each new loop through
-			 * the bpage array: we may need to consider a larger
-			 * range of pages because of concurrent allocations.
+		cur = homa_pool_get_free(pool, core_num);
+		if (cur >= 0) {
+			bpage = &pool->descriptors[cur];
+			spin_lock_bh(&bpage->lock);
+		} else {
+			cur = homa_pool_steal_owned(pool, now);
+			if (cur < 0) {
+				/* The free pages we reserved above must be
+				 * in transit between stacks; try again.
+				 */
+				continue;
+			}
+			bpage = &pool->descriptors[cur];
+
+			/* Owned pages aren't counted in free_bpages, so
+			 * we don't need the reservation made above.
 			 */
-			limit = 0;
-			continue;
-		}
-		bpage = &pool->descriptors[cur];
-
-		/* Figure out whether this candidate is free (or can be
-		 * stolen). Do a quick check without locking the page, and
-		 * if the page looks promising, then lock it and check again
-		 * (must check again in case someone else snuck in and
-		 * grabbed the page).
-		 */
-		ref_count = atomic_read(&bpage->refs);
-		if ((ref_count >= 2) || ((ref_count == 1) && ((bpage->owner < 0)
-				|| (bpage->expiration > now))))
-			continue;
-		if (!spin_trylock_bh(&bpage->lock))
-			continue;
-		ref_count = atomic_read(&bpage->refs);
-		if ((ref_count >= 2) || ((ref_count == 1) && ((bpage->owner < 0)
-				|| (bpage->expiration > now)))) {
-			spin_unlock_bh(&bpage->lock);
-			continue;
-		}
-		if (bpage->owner >= 0)
 			atomic_inc(&pool->free_bpages);
+		}
 		if (set_owner) {
 			atomic_set(&bpage->refs, 2);
 			bpage->owner = core_num;
@@ -230,6 +591,47 @@ int homa_pool_get_pages(struct homa_pool *pool, int num_pages, __u32 *pages,
 	return 0;
 }
 
+/**
+ * homa_pool_get_extent() - Allocate a contiguous range of bpages from the
+ * extent area of a pool.
+ * @pool:         Pool from which to allocate.
+ * @num_pages:    Number of bpages needed.
+ * @pages:        The indices of the allocated pages are stored here, in
+ *                increasing order; caller must ensure this array is big
+ *                enough. Reference counts are set to 1.
+ * Return: 0 for success, -1 if there wasn't a large enough range of
+ * free bpages in the extent area.
+ */
+int homa_pool_get_extent(struct homa_pool *pool, int num_pages, __u32 *pages)
+{
+	unsigned long start;
+	int i;
+
+	if (num_pages > pool->num_extent_bpages)
+		return -1;
+	spin_lock_bh(&pool->extent_lock);
+	start = bitmap_find_next_zero_area(pool->extent_map,
+			pool->num_extent_bpages, pool->extent_hint,
+			num_pages, 0);
+	if (start >= pool->num_extent_bpages)
+		start = bitmap_find_next_zero_area(pool->extent_map,
+				pool->num_extent_bpages, 0, num_pages, 0);
+	if (start >= pool->num_extent_bpages) {
+		spin_unlock_bh(&pool->extent_lock);
+		return -1;
+	}
+	for (i = 0; i < num_pages; i++)
+		__set_bit(start + i, pool->extent_map);
+	pool->extent_hint = start + num_pages;
+	spin_unlock_bh(&pool->extent_lock);
+
+	for (i = 0; i < num_pages; i++) {
+		pages[i] = pool->extent_start + start + i;
+		atomic_set(&pool->descriptors[pages[i]].refs, 1);
+	}
+	return 0;
+}
+
 /**
  * homa_pool_allocate() - Allocate buffer space for an RPC.
  * @rpc:  RPC that needs space allocated for its incoming message (space must
@@ -243,8 +645,8 @@ int homa_pool_get_pages(struct homa_pool *pool, int num_pages, __u32 *pages,
 int homa_pool_allocate(struct homa_rpc *rpc)
 {
 	struct homa_pool *pool = &rpc->hsk->buffer_pool;
+	__u32 *pages = rpc->msgin.bpage_offsets;
 	int full_pages, partial, i, core_id;
-	__u32 pages[HOMA_MAX_BPAGES];
 	struct homa_pool_core *core;
 	struct homa_bpage *bpage;
 	__u64 now = get_cycles();
@@ -253,13 +655,32 @@ int homa_pool_allocate(struct homa_rpc *rpc)
 	if (!pool->region)
 		return -ENOMEM;
 
+	/* Note: bpage indexes are collected directly in bpage_offsets, then
+	 * converted to offsets.
+	 *
+	 * If possible, give a large message a single contiguous extent
+	 * (including the final partial bpage), so that the application
+	 * sees it as one contiguous range of the region.
+	 */
+	if (pool->num_extent_bpages && (rpc->msgin.length > HOMA_BPAGE_SIZE)) {
+		int num_pages = (rpc->msgin.length + HOMA_BPAGE_SIZE - 1)
+				>> HOMA_BPAGE_SHIFT;
+		if (homa_pool_get_extent(pool, num_pages, pages) == 0) {
+			for (i = 0; i < num_pages; i++)
+				pages[i] <<= HOMA_BPAGE_SHIFT;
+			rpc->msgin.num_bpages = num_pages;
+			INC_METRIC(extent_allocs, 1);
+			goto success;
+		}
+	}
+
 	/* First allocate any full bpages that are needed. */
 	full_pages = rpc->msgin.length >> HOMA_BPAGE_SHIFT;
 	if (unlikely(full_pages)) {
 		if (homa_pool_get_pages(pool, full_pages, pages, 0) != 0)
 			goto out_of_space;
 		for (i = 0; i < full_pages; i++)
-			rpc->msgin.bpage_offsets[i] = pages[i] << HOMA_BPAGE_SHIFT;
+			pages[i] <<= HOMA_BPAGE_SHIFT;
 	}
 	rpc->msgin.num_bpages = full_pages;
 
@@ -289,11 +710,17 @@ int homa_pool_allocate(struct homa_rpc *rpc)
 		} else {
 			bpage->owner = -1;
 
-			/* We know the reference count can't reach zero here
-			 * because of check above, so we won't have to decrement
-			 * pool->free_bpages.
+			/* The reference count could reach zero here if
+			 * the last message using the page was released
+			 * concurrently (homa_pool_release_buffers doesn't
+			 * lock bpages).
 			 */
-			atomic_dec_return(&bpage->refs);
+			if (atomic_dec_return(&bpage->refs) == 0) {
+				homa_pool_push(pool, homa_pool_home_stack(pool,
+						core->page_hint),
+						core->page_hint, core->page_hint);
+				atomic_inc(&pool->free_bpages);
+			}
 			spin_unlock_bh(&bpage->lock);
 			goto new_page;
 		}
@@ -305,13 +732,13 @@ int homa_pool_allocate(struct homa_rpc *rpc)
 
 	/* Can't use the current page; get another one. */
 	new_page:
-	if (homa_pool_get_pages(pool, 1, pages, 1) != 0) {
+	if (homa_pool_get_pages(pool, 1, &pages[full_pages], 1) != 0) {
 		homa_pool_release_buffers(pool, rpc->msgin.num_bpages,
 				rpc->msgin.bpage_offsets);
 		rpc->msgin.num_bpages = 0;
 		goto out_of_space;
 	}
-	core->page_hint = pages[0];
+	core->page_hint = pages[full_pages];
 	core->allocated = 0;
 
 	allocate_partial:
@@ -332,6 +759,7 @@ int homa_pool_allocate(struct homa_rpc *rpc)
 	 */
 	out_of_space:
 	INC_METRIC(buffer_alloc_failures, 1);
+	atomic64_inc(&pool->alloc_failures);
 	tt_record4("Buffer allocation failed, port %d, id %d, length %d, "
 			"free_bpages %d", pool->hsk->port, rpc->id,
 			rpc->msgin.length,
@@ -377,6 +805,34 @@ void *homa_pool_get_buffer(struct homa_rpc *rpc, int offset, int *available)
 			+ bpage_offset;
 }
 
+/**
+ * homa_pool_get_stats() - Collect information about the state of a
+ * socket's buffer pool (for SO_HOMA_POOL_STATS).
+ * @hsk:     Socket whose pool is of interest. Must not be locked by the
+ *           caller.
+ * @stats:   Filled in with information about @hsk's pool.
+ */
+void homa_pool_get_stats(struct homa_sock *hsk, struct homa_pool_stats *stats)
+{
+	struct homa_pool *pool = &hsk->buffer_pool;
+	struct homa_rpc *rpc;
+
+	memset(stats, 0, sizeof(*stats));
+	homa_sock_lock(hsk, "homa_pool_get_stats");
+	if (pool->region) {
+		stats->num_bpages = pool->num_bpages;
+		stats->free_bpages = atomic_read(&pool->free_bpages);
+	}
+	list_for_each_entry(rpc, &hsk->waiting_for_bufs, buf_links)
+		stats->waiting_rpcs++;
+	if (stats->waiting_rpcs)
+		stats->bpages_needed = pool->bpages_needed;
+	homa_sock_unlock(hsk);
+	stats->alloc_failures = atomic64_read(&pool->alloc_failures);
+	stats->dropped_bytes = atomic64_read(&pool->dropped_bytes);
+	stats->grant_skips = atomic64_read(&pool->grant_skips);
+}
+
 /**
  * homa_pool_release_buffers() - Release buffer space so that it can be
  * reused. The caller must not hold either an RPC lock or the socket lock
@@ -391,6 +847,9 @@ void homa_pool_release_buffers(struct homa_pool *pool, int num_buffers,
 {
 	int i;
 	int send_grants = 0;
+	int num_freed = 0;
+	int extents_freed = 0;
+	__u32 first = NO_BPAGE, last = NO_BPAGE;
 
 	if (!pool->region)
 		return;
@@ -398,16 +857,58 @@ void homa_pool_release_buffers(struct homa_pool *pool, int num_buffers,
 		__u32 bpage_index = buffers[i] >> HOMA_BPAGE_SHIFT;
 		struct homa_bpage *bpage= &pool->descriptors[bpage_index];
 		if (bpage_index < pool->num_bpages) {
-			 if (atomic_dec_return(&bpage->refs) == 0)
-				 atomic_inc(&pool->free_bpages);
+			if (atomic_dec_return(&bpage->refs) != 0)
+				continue;
+			if (bpage_index >= pool->extent_start) {
+				if (!extents_freed)
+					spin_lock_bh(&pool->extent_lock);
+				__clear_bit(bpage_index - pool->extent_start,
+						pool->extent_map);
+				extents_freed = 1;
+				continue;
+			}
+
+			/* Collect freed pages into a chain so they can
+			 * be pushed on the free stack all at once. If the
+			 * region is divided among nodes, each page must
+			 * go back to its own node's stack.
+			 */
+			if (pool->node_stacks) {
+				homa_pool_push(pool, homa_pool_home_stack(pool,
+						bpage_index), bpage_index,
+						bpage_index);
+				num_freed++;
+				continue;
+			}
+			if (num_freed == 0)
+				last = bpage_index;
+			else
+				bpage->next_free = first;
+			first = bpage_index;
+			num_freed++;
 		}
 	}
+	if (extents_freed)
+		spin_unlock_bh(&pool->extent_lock);
+	if (num_freed) {
+		/* Pages must be on the stack before they are counted in
+		 * free_bpages; otherwise homa_pool_get_pages might not
+		 * be able to find them.
+		 */
+		if (first != NO_BPAGE)
+			homa_pool_push(pool, &pool->free_stack, first, last);
+		atomic_add(num_freed, &pool->free_bpages);
+	}
 	tt_record3("Released %d bpages, free_bpages for port %d now %d",
 			num_buffers, pool->hsk->port,
 			atomic_read(&pool->free_bpages));
 
-	/* Allocate buffers for waiting RPCS if possible. */
-	while (atomic_read(&pool->free_bpages) >= pool->bpages_needed) {
+	/* Allocate buffers for waiting RPCS if possible. Extent space
+	 * isn't counted in free_bpages, so if any was freed, make one
+	 * attempt for the first waiting RPC regardless.
+	 */
+	while ((atomic_read(&pool->free_bpages) >= pool->bpages_needed)
+			|| extents_freed) {
 		struct homa_rpc *rpc;
 		homa_sock_lock(pool->hsk, "buffer pool");
 		if (list_empty(&pool->hsk->waiting_for_bufs)) {
@@ -428,6 +929,7 @@ void homa_pool_release_buffers(struct homa_pool *pool, int num_buffers,
 			continue;
 		}
 		list_del_init(&rpc->buf_links);
+		extents_freed = 0;
 		if (list_empty(&pool->hsk->waiting_for_bufs))
 			pool->bpages_needed = INT_MAX;
 		else
@@ -13,6 +13,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <errno.h>
 #include <string.h>
 
 #include "homa_receiver.h"
@@ -54,28 +55,105 @@ homa::receiver::~receiver()
 }
 
 /**
- * homa::receiver::copy_out() - Copy data out of the current message.
+ * copy_out_helper() - Implements copy_out for both homa::receiver and
+ * homa::multi_receiver::message, which describe their buffers the same way.
+ * @msg:      Message from which to copy; must provide length, contiguous,
+ *            and get.
  * @dest:     Data will be copied here.
  * @offset:   Offset within the message of the first byte to copy.
  * @count:    Number of bytes to copy; if the message doesn't contain
  *            this many bytes starting at offset, then only the
  *            available number of bytes will be copied.
  */
-void homa::receiver::copy_out(void *dest, size_t offset, size_t count) const
+template<typename M>
+static void copy_out_helper(const M *msg, void *dest, size_t offset,
+		size_t count)
 {
 	ssize_t limit = offset + count;
 	char *cdest = static_cast<char *>(dest);
 
-	if (limit > msg_length)
-		limit = msg_length;
+	if (limit > msg->length())
+		limit = msg->length();
 	while (static_cast<ssize_t>(offset) < limit) {
-		size_t chunk_size = contiguous(offset);
-		memcpy(cdest, get<char>(offset), chunk_size);
+		size_t chunk_size = msg->contiguous(offset);
+		if (chunk_size > static_cast<size_t>(limit - offset))
+			chunk_size = limit - offset;
+		memcpy(cdest, msg->template get<char>(offset), chunk_size);
 		offset += chunk_size;
 		cdest += chunk_size;
 	}
 }
 
+/**
+ * iovecs_helper() - Implements iovecs for both homa::receiver and
+ * homa::multi_receiver::message. Arguments and result are the same as
+ * for homa::receiver::iovecs, except for:
+ * @msg:      Message to describe; must provide length, contiguous,
+ *            and get.
+ */
+template<typename M>
+static size_t iovecs_helper(const M *msg, struct iovec *iov, size_t max_iovs,
+		size_t offset, size_t count)
+{
+	ssize_t limit;
+	size_t num_iovs = 0;
+
+	if (static_cast<ssize_t>(offset) >= msg->length())
+		return 0;
+	limit = msg->length();
+	if (count < static_cast<size_t>(limit) - offset)
+		limit = offset + count;
+	while ((static_cast<ssize_t>(offset) < limit)
+			&& (num_iovs < max_iovs)) {
+		size_t chunk_size = msg->contiguous(offset);
+		if (chunk_size > static_cast<size_t>(limit - offset))
+			chunk_size = limit - offset;
+		iov[num_iovs].iov_base = msg->template get<char>(offset);
+		iov[num_iovs].iov_len = chunk_size;
+		offset += chunk_size;
+		num_iovs++;
+	}
+	return num_iovs;
+}
+
+/**
+ * homa::receiver::copy_out() - Copy data out of the current message.
+ * @dest:     Data will be copied here.
+ * @offset:   Offset within the message of the first byte to copy.
+ * @count:    Number of bytes to copy; if the message doesn't contain
+ *            this many bytes starting at offset, then only the
+ *            available number of bytes will be copied.
+ */
+void homa::receiver::copy_out(void *dest, size_t offset, size_t count) const
+{
+	copy_out_helper(this, dest, offset, count);
+}
+
+/**
+ * homa::receiver::iovecs() - Describe part of the current message as a
+ * list of contiguous ranges in the buffer region, without copying any
+ * data. Consecutive bpages are merged into a single range. The ranges
+ * remain valid until the next call to receive or release.
+ * @iov:      Information about the ranges is stored here, in order of
+ *            their offsets in the message. The result can be passed
+ *            directly to system calls such as writev or sendmsg.
+ * @max_iovs: Number of entries available at @iov. HOMA_MAX_BPAGES
+ *            entries is always enough for an entire message.
+ * @offset:   Offset within the message of the first byte to describe.
+ * @count:    Number of bytes to describe; if the message doesn't contain
+ *            this many bytes starting at offset, then only the available
+ *            bytes are described.
+ * Return:    The number of entries filled in at @iov. If this equals
+ *            @max_iovs, there may be more data left in the range; the
+ *            caller can sum the lengths and call again with a larger
+ *            offset.
+ */
+size_t homa::receiver::iovecs(struct iovec *iov, size_t max_iovs,
+		size_t offset, size_t count) const
+{
+	return iovecs_helper(this, iov, max_iovs, offset, count);
+}
+
 /**
  * homa::receiver::receive() - Release resources for the current message, if
  * any, and receive a new incoming message.
@@ -120,4 +198,190 @@ void homa::receiver::release()
 	recvmsg(fd, &hdr, 0);
 	control.num_bpages = 0;
 	msg_length = -1;
-}
\ No newline at end of file
+}
+
+/**
+ * homa::multi_receiver::multi_receiver() - Constructor for multi_receivers.
+ * @fd:         Homa socket from which this object will receive incoming
+ *              messages. The caller is responsible for setting up buffering
+ *              on the socket using setsockopt with the SO_HOMA_SET_BUF option.
+ *              The file descriptor must be valid for the lifetime of this
+ *              object.
+ * @buf_region: Location of the buffer region that was allocated for
+ *              this socket.
+ * @max_msgs:   Largest number of messages that may be held at once; values
+ *              larger than HOMA_MAX_RECV_BATCH are reduced to that.
+ */
+homa::multi_receiver::multi_receiver(int fd, void *buf_region,
+		uint32_t max_msgs)
+	: fd(fd)
+	, buf_region(reinterpret_cast<char *>(buf_region))
+	, max_msgs(max_msgs)
+	, msgs()
+	, free_msgs()
+	, free_count(0)
+	, batch()
+	, pending()
+	, num_pending(0)
+{
+	if ((this->max_msgs == 0) || (this->max_msgs > HOMA_MAX_RECV_BATCH))
+		this->max_msgs = HOMA_MAX_RECV_BATCH;
+	for (uint32_t i = 0; i < this->max_msgs; i++) {
+		msgs[i].buf_region = this->buf_region;
+		msgs[i].in_use = false;
+		free_msgs[free_count++] = this->max_msgs - 1 - i;
+	}
+}
+
+/**
+ * homa::multi_receiver::~multi_receiver() - Destructor for multi_receivers.
+ * Any messages still held are released and all of their buffers are
+ * returned to Homa.
+ */
+homa::multi_receiver::~multi_receiver()
+{
+	for (uint32_t i = 0; i < max_msgs; i++)
+		release(&msgs[i]);
+	flush();
+}
+
+/**
+ * homa::multi_receiver::flush() - Return the buffers of all released
+ * messages to Homa immediately, without receiving any new messages.
+ */
+void homa::multi_receiver::flush()
+{
+	if (num_pending == 0)
+		return;
+
+	/* With neither HOMA_RECVMSG_REQUEST nor HOMA_RECVMSG_RESPONSE
+	 * specified, this call does nothing except return buffer space.
+	 */
+	invoke(HOMA_RECVMSG_NONBLOCKING, 1);
+}
+
+/**
+ * homa::multi_receiver::invoke() - Make a batched recvmsg call on the
+ * socket, returning all pending bpages to Homa.
+ * @flags:    Value for the flags field of struct homa_recvmmsg_args.
+ * @max:      Largest number of new messages to accept.
+ * Return:    The number of new messages (stored in @batch), or -1 if an
+ *            error occurred, in which case errno describes it. The pending
+ *            bpages are returned to Homa even if there is an error.
+ */
+int homa::multi_receiver::invoke(int flags, uint32_t max)
+{
+	struct homa_recvmmsg_args args;
+	struct msghdr hdr;
+	uint32_t i;
+
+	/* Pack the pending bpages densely into the leading entries;
+	 * Homa doesn't care which message each bpage came from.
+	 */
+	memset(&args, 0, sizeof(args));
+	for (i = 0; i < num_pending; i += HOMA_MAX_BPAGES) {
+		struct homa_recvmmsg_msg *entry = &batch[args.num_msgs];
+
+		entry->num_bpages = num_pending - i;
+		if (entry->num_bpages > HOMA_MAX_BPAGES)
+			entry->num_bpages = HOMA_MAX_BPAGES;
+		memcpy(entry->bpage_offsets, &pending[i],
+				entry->num_bpages * sizeof(pending[0]));
+		args.num_msgs++;
+	}
+	num_pending = 0;
+	args.flags = flags;
+	args.max_msgs = (max > args.num_msgs) ? max : args.num_msgs;
+	args.msgs = batch;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_control = &args;
+	hdr.msg_controllen = sizeof(args);
+	if (recvmsg(fd, &hdr, 0) < 0)
+		return -1;
+	return args.num_msgs;
+}
+
+/**
+ * homa::multi_receiver::receive() - Receive one or more new messages,
+ * returning the buffers of any released messages to Homa in the same
+ * kernel call.
+ * @flags:    Various OR'ed bits such as HOMA_RECVMSG_REQUEST and
+ *            HOMA_RECVMSG_NONBLOCKING. See the Homa documentation
+ *            for the flags field of recvmsg for details. Only the first
+ *            message is waited for; additional messages are returned
+ *            only if they are already available.
+ * @msgs:     Pointers to the new messages are stored here; must have
+ *            room for at least num_free() entries.
+ * Return:    The number of new messages, or -1 if an error occurred, in
+ *            which case errno describes it. The error is ENOSPC if the
+ *            maximum number of messages are already held.
+ */
+int homa::multi_receiver::receive(int flags, message **msgs)
+{
+	int count, i;
+
+	if (free_count == 0) {
+		errno = ENOSPC;
+		return -1;
+	}
+	count = invoke(flags, free_count);
+	for (i = 0; i < count; i++) {
+		message *msg = &this->msgs[free_msgs[--free_count]];
+
+		msg->info = batch[i];
+		msg->in_use = true;
+		msgs[i] = msg;
+	}
+	return count;
+}
+
+/**
+ * homa::multi_receiver::release() - Indicate that a message is no longer
+ * needed, so its buffer space can be returned to Homa; the message must
+ * not be accessed again. The space is actually returned during the next
+ * call to receive or flush.
+ * @msg:      A message previously returned by receive. Releasing a message
+ *            that isn't currently held has no effect.
+ */
+void homa::multi_receiver::release(message *msg)
+{
+	if (!msg->in_use)
+		return;
+	memcpy(&pending[num_pending], msg->info.bpage_offsets,
+			msg->info.num_bpages * sizeof(pending[0]));
+	num_pending += msg->info.num_bpages;
+	msg->info.num_bpages = 0;
+	msg->in_use = false;
+	free_msgs[free_count++] = msg - msgs;
+}
+
+/**
+ * homa::multi_receiver::message::copy_out() - Copy data out of a message.
+ * @dest:     Data will be copied here.
+ * @offset:   Offset within the message of the first byte to copy.
+ * @count:    Number of bytes to copy; if the message doesn't contain
+ *            this many bytes starting at offset, then only the
+ *            available number of bytes will be copied.
+ */
+void homa::multi_receiver::message::copy_out(void *dest, size_t offset,
+		size_t count) const
+{
+	copy_out_helper(this, dest, offset, count);
+}
+
+/**
+ * homa::multi_receiver::message::iovecs() - Describe part of a message as
+ * a list of contiguous ranges in the buffer region, without copying any
+ * data; same as homa::receiver::iovecs.
+ * @iov:      Information about the ranges is stored here.
+ * @max_iovs: Number of entries available at @iov.
+ * @offset:   Offset within the message of the first byte to describe.
+ * @count:    Number of bytes to describe.
+ * Return:    The number of entries filled in at @iov.
+ */
+size_t homa::multi_receiver::message::iovecs(struct iovec *iov,
+		size_t max_iovs, size_t offset, size_t count) const
+{
+	return iovecs_helper(this, iov, max_iovs, offset, count);
+}
@@ -15,8 +15,10 @@
 
 #pragma once
 
+#include <stdint.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "homa.h"
 
@@ -33,7 +35,11 @@ namespace homa {
  * Typical usage:
  * - Call receive, which will invoke Homa to receive an incoming message.
  * - Access the message using methods such as get and copy_out (note: if
- *   the message is shorter than HOMA_BPAGE_SIZE then it will be contiguous).
+ *   the message is shorter than HOMA_BPAGE_SIZE then it will be contiguous;
+ *   longer messages are also contiguous if they were allocated an extent,
+ *   see SO_HOMA_BUF_EXTENTS). Use iovecs to access a message (or part of
+ *   one) in place as a list of contiguous ranges, e.g. to parse it without
+ *   copying or to forward it with writev, sendmsg, or homa_sendv.
  * - Call receive to get the next message. This releases all of the resources
  *   associated with the previous message, so you can no longer access that.
  * - Access the new message ...
@@ -41,7 +47,8 @@ namespace homa {
  * A single homa::receiver allows only a single active incoming message
  * at a time. However, you can create multiple homa::receivers for the
  * same Homa socket, each of which can have one active message. An
- * individual homa::receiver is not thread-safe.
+ * individual homa::receiver is not thread-safe. Applications that need to
+ * hold many messages at once can use homa::multi_receiver instead.
  */
 class receiver {
 public:
@@ -57,11 +64,22 @@ public:
 	 */
 	inline size_t contiguous(size_t offset) const
 	{
+		uint32_t i;
+
 		if (static_cast<ssize_t>(offset) >= msg_length)
 			return 0;
-		if ((offset >> HOMA_BPAGE_SHIFT) == (control.num_bpages-1))
+
+		/* Consecutive bpages are treated as a single range. */
+		for (i = offset >> HOMA_BPAGE_SHIFT;
+				i < (control.num_bpages-1); i++) {
+			if (control.bpage_offsets[i+1]
+					!= (control.bpage_offsets[i]
+					+ HOMA_BPAGE_SIZE))
+				break;
+		}
+		if (i == (control.num_bpages-1))
 			return msg_length - offset;
-		return HOMA_BPAGE_SIZE - (offset & (HOMA_BPAGE_SIZE-1));
+		return (static_cast<size_t>(i+1) << HOMA_BPAGE_SHIFT) - offset;
 	}
 
 	/**
@@ -105,6 +123,9 @@ public:
 		return storage;
 	}
 
+	size_t iovecs(struct iovec *iov, size_t max_iovs, size_t offset = 0,
+			size_t count = SIZE_MAX) const;
+
 	/**
 	 * id() - Return the Homa RPC identifier for the current message,
 	 * or 0 if there is no current message.
@@ -171,4 +192,210 @@ protected:
 	/** @buf_region: First byte of buffer space for this message. */
 	char *buf_region;
 };
+
+/**
+ * class homa::multi_receiver - Helper class for applications that hold
+ * several incoming messages at once, such as pipelined servers. Messages
+ * are received in batches with a single recvmsg call (see struct
+ * homa_recvmmsg_args) and can be released in any order. Releasing a
+ * message doesn't invoke the kernel: its bpages are saved and returned
+ * to Homa as part of the next kernel call (or by flush), coalesced with
+ * the bpages of any other released messages.
+ *
+ * Typical usage:
+ * - Call receive, which returns one or more new messages.
+ * - Access each message using its methods such as get and iovecs.
+ * - Call release for each message once it is no longer needed.
+ * - Call receive again whenever there is room for more messages. Call
+ *   flush if no more messages will be received for a while, so that
+ *   released buffer space doesn't sit idle.
+ *
+ * A homa::multi_receiver is not thread-safe.
+ */
+class multi_receiver {
+public:
+	/**
+	 * class homa::multi_receiver::message - One of the messages
+	 * currently held by a homa::multi_receiver. Valid from the time
+	 * it is returned by receive until it is passed to release.
+	 */
+	class message {
+	public:
+		/**
+		 * contiguous() - Return a count of the number of contiguous
+		 * bytes that are available in the message at a given offset.
+		 * Zero is returned if the offset is beyond the end of the
+		 * message.
+		 * @offset:  An offset from the beginning of the message.
+		 */
+		inline size_t contiguous(size_t offset) const
+		{
+			uint32_t i;
+
+			if (static_cast<ssize_t>(offset) >= length())
+				return 0;
+
+			/* Consecutive bpages are treated as a single range. */
+			for (i = offset >> HOMA_BPAGE_SHIFT;
+					i < (info.num_bpages-1); i++) {
+				if (info.bpage_offsets[i+1]
+						!= (info.bpage_offsets[i]
+						+ HOMA_BPAGE_SIZE))
+					break;
+			}
+			if (i == (info.num_bpages-1))
+				return length() - offset;
+			return (static_cast<size_t>(i+1) << HOMA_BPAGE_SHIFT)
+					- offset;
+		}
+
+		/**
+		 * completion_cookie() - Return the completion cookie
+		 * associated with the message.
+		 */
+		uint64_t completion_cookie() const
+		{
+			return info.completion_cookie;
+		}
+
+		void copy_out(void *dest, size_t offset, size_t count) const;
+
+		/**
+		 * get() - Make part of the message accessible; same as
+		 * homa::receiver::get.
+		 * @offset:   Offset within the message of the first byte of
+		 *            an object of type T
+		 * @storage:  If non-null and the object isn't contiguous in
+		 *            the message, it is copied here.
+		 * Return:    A pointer to the desired object (either in the
+		 *            message or at *storage), or nullptr if the object
+		 *            could not be returned.
+		 */
+		template<typename T>
+		inline T* get(size_t offset, T* storage = nullptr) const {
+			int buf_num = offset >> HOMA_BPAGE_SHIFT;
+			if (static_cast<ssize_t>(offset + sizeof(T)) > length())
+				return nullptr;
+			if (contiguous(offset) >= sizeof(T))
+				return reinterpret_cast<T*>(buf_region
+						+ info.bpage_offsets[buf_num]
+						+ (offset & (HOMA_BPAGE_SIZE - 1)));
+			if (storage)
+				copy_out(storage, offset, sizeof(T));
+			return storage;
+		}
+
+		/** id() - Return the Homa RPC identifier for the message. */
+		inline uint64_t id() const
+		{
+			return info.id;
+		}
+
+		size_t iovecs(struct iovec *iov, size_t max_iovs,
+				size_t offset = 0,
+				size_t count = SIZE_MAX) const;
+
+		/**
+		 * is_request() - Return true if the message is a request,
+		 * false if it is a response.
+		 */
+		bool is_request() const
+		{
+			return info.id & 1;
+		}
+
+		/**
+		 * length() - Return the total number of bytes in the
+		 * message, or a negative errno value if the RPC failed (in
+		 * which case the message has no data, but it must still be
+		 * released).
+		 */
+		ssize_t length() const
+		{
+			return info.length;
+		}
+
+		/**
+		 * src_addr() - Return a pointer to the address of the
+		 * sender of the message.
+		 */
+		const sockaddr_in_union *src_addr() const
+		{
+			return &info.peer_addr;
+		}
+
+	protected:
+		friend class multi_receiver;
+
+		/**
+		 * @info: Information returned by the kernel about the
+		 * message; num_bpages is zero if the message isn't in use.
+		 */
+		struct homa_recvmmsg_msg info;
+
+		/** @buf_region: First byte of buffer space for the socket. */
+		char *buf_region;
+
+		/** @in_use: True means the message hasn't been released. */
+		bool in_use;
+	};
+
+	multi_receiver(int fd, void *buf_region,
+			uint32_t max_msgs = HOMA_MAX_RECV_BATCH);
+	~multi_receiver();
+	void flush();
+	int receive(int flags, message **msgs);
+	void release(message *msg);
+
+	/**
+	 * homa::multi_receiver::num_free() - Return the number of new
+	 * messages that could be returned by the next call to receive.
+	 */
+	uint32_t num_free() const
+	{
+		return free_count;
+	}
+
+protected:
+	int invoke(int flags, uint32_t max);
+
+	/** @fd: File descriptor for an open Homa socket. */
+	int fd;
+
+	/** @buf_region: First byte of buffer space for the socket. */
+	char *buf_region;
+
+	/**
+	 * @max_msgs: Maximum number of messages that may be held at once
+	 * (no more than HOMA_MAX_RECV_BATCH).
+	 */
+	uint32_t max_msgs;
+
+	/** @msgs: Storage for the messages currently held. */
+	message msgs[HOMA_MAX_RECV_BATCH];
+
+	/**
+	 * @free_msgs: Indexes in @msgs of the entries that aren't in use;
+	 * the first @free_count entries are valid.
+	 */
+	uint32_t free_msgs[HOMA_MAX_RECV_BATCH];
+
+	/** @free_count: Number of valid entries in @free_msgs. */
+	uint32_t free_count;
+
+	/**
+	 * @batch: Passed to the kernel in recvmsg to return bpages and
+	 * receive new messages.
+	 */
+	struct homa_recvmmsg_msg batch[HOMA_MAX_RECV_BATCH];
+
+	/**
+	 * @pending: Offsets of bpages from released messages that haven't
+	 * yet been returned to Homa.
+	 */
+	uint32_t pending[HOMA_MAX_RECV_BATCH * HOMA_MAX_BPAGES];
+
+	/** @num_pending: Number of valid entries in @pending. */
+	uint32_t num_pending;
+};
 }    // namespace homa
\ No newline at end of file
@@ -0,0 +1,406 @@
+/* Copyright (c) 2023 Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* This file implements the submission and completion rings that an
+ * application can attach to a socket with SO_HOMA_SET_RINGS. The rings
+ * live in memory allocated by the application. The application adds
+ * HOMA_SQE_SEND and HOMA_SQE_RELEASE entries to the submission ring;
+ * Homa posts outgoing RPC ids and incoming messages to the completion
+ * ring. The rings are serviced either by a per-socket kernel thread
+ * (so the application needn't make any system calls while the thread is
+ * active) or during HOMAIOCRING calls.
+ */
+
+#include <linux/sched/mm.h>
+
+#include "homa_impl.h"
+
+/**
+ * homa_ring_init() - Create the rings for a socket; invoked for
+ * SO_HOMA_SET_RINGS.
+ * @hsk:     Socket for which to create rings. Must not be locked by the
+ *           caller.
+ * @args:    Describes the ring memory and options (already copied in
+ *           from user space).
+ * Return:   Either zero (for success) or a negative errno for failure.
+ */
+int homa_ring_init(struct homa_sock *hsk, struct homa_set_rings_args *args)
+{
+	struct homa_ring *ring;
+	__u64 needed;
+
+	if ((args->sq_entries == 0) || (args->cq_entries == 0)
+			|| (args->sq_entries & (args->sq_entries - 1))
+			|| (args->cq_entries & (args->cq_entries - 1))
+			|| (args->recv_flags & ~(HOMA_RECVMSG_REQUEST
+			| HOMA_RECVMSG_RESPONSE))
+			|| (args->poll_usecs < 0))
+		return -EINVAL;
+	needed = sizeof(struct homa_ring_ctl)
+			+ (__u64) args->sq_entries * sizeof(struct homa_ring_sqe)
+			+ (__u64) args->cq_entries * sizeof(struct homa_ring_cqe);
+	if (args->length < needed)
+		return -EINVAL;
+	if (hsk->ring)
+		return -EALREADY;
+
+	ring = kmalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+	ring->hsk = hsk;
+	ring->ctl = (struct homa_ring_ctl __user *) args->start;
+	ring->sq = (struct homa_ring_sqe __user *) (ring->ctl + 1);
+	ring->cq = (struct homa_ring_cqe __user *)
+			(ring->sq + args->sq_entries);
+	ring->sq_mask = args->sq_entries - 1;
+	ring->cq_mask = args->cq_entries - 1;
+	ring->recv_flags = args->recv_flags;
+	mutex_init(&ring->lock);
+	ring->thread = NULL;
+	ring->mm = NULL;
+	ring->idle_cycles = ((__u64) args->poll_usecs * cpu_khz) / 1000;
+	atomic_set(&ring->sleeping, 0);
+
+	if (args->poll_usecs > 0) {
+		struct task_struct *thread;
+
+		ring->mm = current->mm;
+		mmgrab(ring->mm);
+		thread = kthread_run(homa_ring_thread_main, ring,
+				"homa_ring_%d", hsk->port);
+		if (IS_ERR(thread)) {
+			int err = PTR_ERR(thread);
+
+			printk(KERN_ERR "couldn't create homa ring thread: "
+					"error %d\n", err);
+			mmdrop(ring->mm);
+			kfree(ring);
+			return err;
+		}
+		ring->thread = thread;
+	}
+
+	homa_sock_lock(hsk, "homa_ring_init");
+	if (hsk->ring) {
+		homa_sock_unlock(hsk);
+		homa_ring_free(ring);
+		return -EALREADY;
+	}
+	hsk->ring = ring;
+	homa_sock_unlock(hsk);
+	return 0;
+}
+
+/**
+ * homa_ring_free() - Stop the polling thread for a ring (if any) and
+ * free the ring's kernel state.
+ * @ring:    Ring to free; must no longer be reachable from its socket.
+ */
+void homa_ring_free(struct homa_ring *ring)
+{
+	if (ring->thread)
+		kthread_stop(ring->thread);
+	if (ring->mm)
+		mmdrop(ring->mm);
+	kfree(ring);
+}
+
+/**
+ * homa_ring_destroy() - Release the rings for a socket, if it has any.
+ * Invoked during socket shutdown, after all RPCs have been freed.
+ * @hsk:     Socket whose rings should be released.
+ */
+void homa_ring_destroy(struct homa_sock *hsk)
+{
+	struct homa_ring *ring;
+
+	homa_sock_lock(hsk, "homa_ring_destroy");
+	ring = hsk->ring;
+	hsk->ring = NULL;
+	homa_sock_unlock(hsk);
+	if (ring)
+		homa_ring_free(ring);
+}
+
+/**
+ * homa_ring_process() - Consume all available entries in the submission
+ * ring, then post as many incoming messages to the completion ring as
+ * possible. The caller must hold @ring->lock.
+ * @ring:          Rings to service.
+ * @min_complete:  Block (if necessary) until at least this many incoming
+ *                 messages have been posted (or the completion ring fills).
+ * Return:         The number of entries consumed or posted (i.e., a measure
+ *                 of the work that was done), or a negative errno.
+ */
+int homa_ring_process(struct homa_ring *ring, int min_complete)
+{
+	struct homa_sock *hsk = ring->hsk;
+	__u32 sq_head, sq_tail, cq_head, cq_tail;
+	struct homa_ring_sqe sqe;
+	struct homa_ring_cqe cqe;
+	struct homa_rpc *rpc;
+	int posted = 0, work = 0;
+	int result = 0;
+	int flags;
+
+	if (unlikely(copy_from_user(&sq_head, &ring->ctl->sq_head,
+			sizeof(sq_head))
+			|| copy_from_user(&sq_tail, &ring->ctl->sq_tail,
+			sizeof(sq_tail))
+			|| copy_from_user(&cq_head, &ring->ctl->cq_head,
+			sizeof(cq_head))
+			|| copy_from_user(&cq_tail, &ring->ctl->cq_tail,
+			sizeof(cq_tail))))
+		return -EFAULT;
+
+	/* Don't read entries until we've seen the application's tail. */
+	smp_rmb();
+
+	/* Submissions. A HOMA_SQE_SEND needs a completion slot, so stop
+	 * consuming if the completion ring is full.
+	 */
+	while (sq_head != sq_tail) {
+		if (unlikely(copy_from_user(&sqe, &ring->sq[sq_head
+				& ring->sq_mask], sizeof(sqe)))) {
+			result = -EFAULT;
+			break;
+		}
+		if (sqe.opcode == HOMA_SQE_RELEASE) {
+			if (sqe.release.num_bpages <= HOMA_MAX_BPAGES)
+				homa_pool_release_buffers(&hsk->buffer_pool,
+						sqe.release.num_bpages,
+						sqe.release.bpage_offsets);
+		} else {
+			if ((cq_tail - cq_head) > ring->cq_mask)
+				break;
+			memset(&cqe, 0, sizeof(cqe));
+			cqe.type = HOMA_CQE_SEND;
+			cqe.user_data = sqe.user_data;
+			if (sqe.opcode == HOMA_SQE_SEND) {
+				homa_send_entry(hsk, &sqe.send);
+				cqe.msg.id = sqe.send.id;
+				cqe.msg.length = sqe.send.error;
+			} else {
+				cqe.msg.length = -EINVAL;
+			}
+			if (unlikely(copy_to_user(&ring->cq[cq_tail
+					& ring->cq_mask], &cqe, sizeof(cqe)))) {
+				result = -EFAULT;
+				break;
+			}
+			cq_tail++;
+		}
+		sq_head++;
+		work++;
+		INC_METRIC(ring_sqes, 1);
+	}
+	if (unlikely(copy_to_user(&ring->ctl->sq_head, &sq_head,
+			sizeof(sq_head))))
+		result = -EFAULT;
+	if (result)
+		goto done;
+
+	/* Completions: incoming messages. */
+	flags = ring->recv_flags;
+	while (flags && ((cq_tail - cq_head) <= ring->cq_mask)) {
+		if (posted >= min_complete)
+			flags |= HOMA_RECVMSG_NONBLOCKING;
+		rpc = homa_wait_for_message(hsk, flags, 0);
+		if (IS_ERR(rpc)) {
+			if ((PTR_ERR(rpc) != -EAGAIN) && (posted < min_complete))
+				result = PTR_ERR(rpc);
+			break;
+		}
+		memset(&cqe, 0, sizeof(cqe));
+		cqe.type = HOMA_CQE_MESSAGE;
+		homa_recvmsg_fill(rpc, &cqe.msg);
+		if (unlikely(copy_to_user(&ring->cq[cq_tail & ring->cq_mask],
+				&cqe, sizeof(cqe)))) {
+			/* The message's buffers will be leaked. */
+			result = -EFAULT;
+			break;
+		}
+		cq_tail++;
+		posted++;
+		work++;
+		INC_METRIC(ring_cqes, 1);
+	}
+
+done:
+	/* Entries must be visible before the application sees the tail. */
+	smp_wmb();
+	if (unlikely(copy_to_user(&ring->ctl->cq_tail, &cq_tail,
+			sizeof(cq_tail))))
+		result = -EFAULT;
+	return result ? result : work;
+}
+
+/**
+ * homa_ring_set_flags() - Store a new value for the flags word in the
+ * control area of a ring. Invoked only by the ring's polling thread.
+ * @ring:    Ring whose flags should be set.
+ * @flags:   New value for the flags.
+ */
+static void homa_ring_set_flags(struct homa_ring *ring, __u32 flags)
+{
+	if (!mmget_not_zero(ring->mm))
+		return;
+	kthread_use_mm(ring->mm);
+	if (unlikely(copy_to_user(&ring->ctl->flags, &flags, sizeof(flags))))
+		printk(KERN_NOTICE "homa_ring couldn't update ring flags\n");
+	kthread_unuse_mm(ring->mm);
+	mmput(ring->mm);
+}
+
+/**
+ * homa_ring_thread_pass() - Service a ring once from its polling thread.
+ * The application's address space is only referenced for the duration of
+ * the pass, so the thread doesn't keep it alive after the application
+ * has exited.
+ * @ring:    Ring to service; must have a polling thread.
+ * Return:   The result from homa_ring_process, or -ESRCH if the address
+ *           space of the application has gone away.
+ */
+int homa_ring_thread_pass(struct homa_ring *ring)
+{
+	int result;
+
+	if (!mmget_not_zero(ring->mm))
+		return -ESRCH;
+	kthread_use_mm(ring->mm);
+	mutex_lock(&ring->lock);
+	result = homa_ring_process(ring, 0);
+	mutex_unlock(&ring->lock);
+	kthread_unuse_mm(ring->mm);
+	mmput(ring->mm);
+	return result;
+}
+
+/**
+ * homa_ring_thread_main() - Top-level function for the kernel thread
+ * that services a socket's rings when SO_HOMA_SET_RINGS specified a
+ * nonzero poll_usecs.
+ * @arg:     Pointer to the socket's struct homa_ring.
+ * Return:   Always 0.
+ */
+int homa_ring_thread_main(void *arg)
+{
+	struct homa_ring *ring = (struct homa_ring *) arg;
+	__u64 idle_start = get_cycles();
+	int work;
+
+	while (!kthread_should_stop()) {
+		work = homa_ring_thread_pass(ring);
+		if (work == -ESRCH)
+			break;
+
+		/* Errors (such as a ring that is no longer mapped) count
+		 * as idle, so they can't keep the thread spinning.
+		 */
+		if (work > 0) {
+			idle_start = get_cycles();
+			continue;
+		}
+		if ((get_cycles() - idle_start) < ring->idle_cycles) {
+			/* Give NAPI and SoftIRQ tasks a chance to run. */
+			schedule();
+			continue;
+		}
+
+		/* Time to sleep. Announce that first (so new work will
+		 * wake us up), then check one last time for work that
+		 * arrived before the announcement.
+		 */
+		atomic_set(&ring->sleeping, 1);
+		homa_ring_set_flags(ring, HOMA_RING_NEED_WAKEUP);
+		smp_mb();
+		work = homa_ring_thread_pass(ring);
+		if (work == -ESRCH)
+			break;
+		set_current_state(TASK_INTERRUPTIBLE);
+		if ((work <= 0) && atomic_read(&ring->sleeping)
+				&& !kthread_should_stop()) {
+			INC_METRIC(ring_sleeps, 1);
+			schedule();
+		}
+		__set_current_state(TASK_RUNNING);
+		atomic_set(&ring->sleeping, 0);
+		homa_ring_set_flags(ring, 0);
+		idle_start = get_cycles();
+	}
+
+	/* The application has exited: there is nothing more to do, but
+	 * the thread mustn't exit until homa_ring_free stops it.
+	 */
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+	return 0;
+}
+
+/**
+ * homa_ring_wake() - Wake up a ring's polling thread, if it is sleeping.
+ * Invoked when there is new work for the thread, such as a newly-arrived
+ * message. May be invoked in softirq context.
+ * @ring:    Ring whose thread should be woken.
+ */
+void homa_ring_wake(struct homa_ring *ring)
+{
+	if (ring->thread && atomic_xchg(&ring->sleeping, 0)) {
+		INC_METRIC(ring_wakeups, 1);
+		wake_up_process(ring->thread);
+	}
+}
+
+/**
+ * homa_ioc_ring() - The top-level function for the HOMAIOCRING ioctl.
+ * If the socket's rings have a polling thread, wakes up the thread;
+ * otherwise services the rings directly.
+ * @sk:       Socket for this request.
+ * @arg:      Used to pass information from user space: refers to a
+ *            struct homa_ring_enter_args.
+ *
+ * Return: Zero or a positive count of completed work on success,
+ *         otherwise a negative errno.
+ */
+int homa_ioc_ring(struct sock *sk, unsigned long arg)
+{
+	struct homa_sock *hsk = homa_sk(sk);
+	struct homa_ring_enter_args args;
+	struct homa_ring *ring = hsk->ring;
+	int result;
+
+	homa_cores[raw_smp_processor_id()]->last_app_active = get_cycles();
+	if (unlikely(copy_from_user(&args, (void *) arg, sizeof(args))))
+		return -EFAULT;
+	if (args._pad[0] || args._pad[1] || args._pad[2]
+			|| (args.min_complete > INT_MAX))
+		return -EINVAL;
+	if (!ring)
+		return -EINVAL;
+	INC_METRIC(ring_enter_calls, 1);
+	if (ring->thread) {
+		homa_ring_wake(ring);
+		return 0;
+	}
+
+	mutex_lock(&ring->lock);
+	result = homa_ring_process(ring, args.min_complete);
+	mutex_unlock(&ring->lock);
+	return result;
+}
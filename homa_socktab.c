@@ -29,7 +29,10 @@ void homa_socktab_init(struct homa_socktab *socktab)
 	spin_lock_init(&socktab->write_lock);
 	for (i = 0; i < HOMA_SOCKTAB_BUCKETS; i++) {
 		INIT_HLIST_HEAD(&socktab->buckets[i]);
+		INIT_HLIST_HEAD(&socktab->group_buckets[i]);
 	}
+	socktab->num_groups = 0;
+	atomic_set(&socktab->removals, 0);
 }
 
 /**
@@ -40,11 +43,24 @@ void homa_socktab_destroy(struct homa_socktab *socktab)
 {
 	struct homa_socktab_scan scan;
 	struct homa_sock *hsk;
+	int i;
 
 	for (hsk = homa_socktab_start_scan(socktab, &scan); hsk !=  NULL;
 			hsk = homa_socktab_next(&scan)) {
 		homa_sock_destroy(hsk);
 	}
+
+	/* Make sure no per-core cache refers to this table anymore (its
+	 * memory may be reused for a different table).
+	 */
+	for (i = 0; i < nr_cpu_ids; i++) {
+		struct homa_core *core = homa_cores[i];
+
+		if (core && (core->cached_socktab == socktab)) {
+			core->cached_sock = NULL;
+			core->cached_socktab = NULL;
+		}
+	}
 }
 
 /**
@@ -142,11 +158,22 @@ void homa_sock_init(struct homa_sock *hsk, struct homa *homa)
 	hsk->inet.inet_sport = htons(hsk->port);
 	homa->next_client_port++;
 	hsk->socktab_links.sock = hsk;
+	hsk->group = NULL;
 	hlist_add_head_rcu(&hsk->socktab_links.hash_links,
 			&socktab->buckets[homa_port_hash(hsk->port)]);
 	INIT_LIST_HEAD(&hsk->active_rpcs);
+	for (i = 0; i < HOMA_TIMER_SLOTS; i++)
+		INIT_LIST_HEAD(&hsk->timer_wheel[i]);
+	hsk->timer_ticks = homa->timer_ticks;
 	INIT_LIST_HEAD(&hsk->dead_rpcs);
 	hsk->dead_skbs = 0;
+	atomic_set(&hsk->reap_queued, 0);
+	hsk->last_arrival = 0;
+	hsk->avg_interarrival = 0;
+	hsk->poll_rearm = 0;
+	spin_lock_init(&hsk->rpc_cache_lock);
+	INIT_LIST_HEAD(&hsk->rpc_cache);
+	hsk->rpc_cache_size = 0;
 	INIT_LIST_HEAD(&hsk->waiting_for_bufs);
 	INIT_LIST_HEAD(&hsk->ready_requests);
 	INIT_LIST_HEAD(&hsk->ready_responses);
@@ -155,14 +182,34 @@ void homa_sock_init(struct homa_sock *hsk, struct homa *homa)
 	for (i = 0; i < HOMA_CLIENT_RPC_BUCKETS; i++) {
 		struct homa_rpc_bucket *bucket = &hsk->client_rpc_buckets[i];
 		spin_lock_init(&bucket->lock);
-		INIT_HLIST_HEAD(&bucket->rpcs);
+		INIT_HLIST_HEAD(&bucket->rpc0);
+		bucket->rpcs = &bucket->rpc0;
+		bucket->bits = 0;
+		bucket->num_rpcs = 0;
 	}
 	for (i = 0; i < HOMA_SERVER_RPC_BUCKETS; i++) {
 		struct homa_rpc_bucket *bucket = &hsk->server_rpc_buckets[i];
 		spin_lock_init(&bucket->lock);
-		INIT_HLIST_HEAD(&bucket->rpcs);
+		INIT_HLIST_HEAD(&bucket->rpc0);
+		bucket->rpcs = &bucket->rpc0;
+		bucket->bits = 0;
+		bucket->num_rpcs = 0;
 	}
 	memset(&hsk->buffer_pool, 0, sizeof(hsk->buffer_pool));
+	hsk->ring = NULL;
+	hsk->zerocopy_min_length = 0;
+	hsk->buf_extent_length = 0;
+	hsk->buf_num_nodes = 0;
+	hsk->softirq_copy_length = 0;
+	hsk->streaming = 0;
+	hsk->weight = 1;
+	hsk->num_grantable = 0;
+	hsk->grant_pass = 0;
+	hsk->pass_rpcs = 0;
+	hsk->granted_bytes = 0;
+	hsk->share_limited = 0;
+	hsk->pacer_vtime = 0;
+	atomic64_set(&hsk->paced_bytes, 0);
 	spin_unlock_bh(&socktab->write_lock);
 }
 
@@ -199,6 +246,14 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 	hsk->shutdown = true;
 	spin_lock_bh(&hsk->homa->port_map.write_lock);
 	hlist_del_rcu(&hsk->socktab_links.hash_links);
+	if (hsk->group)
+		homa_group_leave(&hsk->homa->port_map, hsk);
+
+	/* Invalidates cached pointers to this socket; the barrier ensures
+	 * that anyone who sees the new count will not find the socket.
+	 */
+	smp_wmb();
+	atomic_inc(&hsk->homa->port_map.removals);
 	spin_unlock_bh(&hsk->homa->port_map.write_lock);
 	homa_sock_unlock(hsk);
 
@@ -215,6 +270,7 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 		wake_up_process(interest->thread);
 	homa_sock_unlock(hsk);
 
+	homa_ring_destroy(hsk);
 	homa_pool_destroy(&hsk->buffer_pool);
 
 	i = 0;
@@ -226,6 +282,16 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 			tt_freeze();
 		}
 	}
+	homa_rpc_cache_drain(hsk);
+
+	/* All of the RPCs are gone, so buckets should have shrunk back
+	 * to their initial size, but an allocation failure during shrinking
+	 * could have left some chain arrays behind.
+	 */
+	for (i = 0; i < HOMA_CLIENT_RPC_BUCKETS; i++)
+		homa_bucket_resize(&hsk->client_rpc_buckets[i], 0);
+	for (i = 0; i < HOMA_SERVER_RPC_BUCKETS; i++)
+		homa_bucket_resize(&hsk->server_rpc_buckets[i], 0);
 }
 
 /**
@@ -239,9 +305,167 @@ void homa_sock_destroy(struct homa_sock *hsk)
 	sock_set_flag(&hsk->inet.sk, SOCK_RCU_FREE);
 }
 
+/**
+ * homa_group_find() - Returns the port group for a given port.
+ * @socktab:    Hash table in which to perform lookup.
+ * @port:       The port of interest.
+ * Return:      The group for @port, or NULL if none. As with
+ *              homa_sock_find, the caller must hold an RCU read lock
+ *              (or the socktab's write_lock) while using the result.
+ */
+static struct homa_port_group *homa_group_find(struct homa_socktab *socktab,
+		__u16 port)
+{
+	struct homa_port_group *group;
+
+	hlist_for_each_entry_rcu(group,
+			&socktab->group_buckets[homa_port_hash(port)], links) {
+		if (group->port == port)
+			return group;
+	}
+	return NULL;
+}
+
+/**
+ * homa_group_free_rcu() - RCU callback that frees a homa_port_group once
+ * it can no longer be referenced by lookups in progress.
+ * @head:     The rcu_head in the group to free.
+ */
+static void homa_group_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct homa_port_group, rcu_head));
+}
+
+/**
+ * homa_group_join() - Add a socket to the group for a port, creating the
+ * group if it doesn't already exist. The caller must hold the socktab's
+ * write_lock.
+ * @socktab:   Hash table in which the group is recorded.
+ * @hsk:       Socket to add; must have SO_REUSEPORT set and must not be
+ *             bound to a server port (it keeps its client port).
+ * @group:     Existing group for @port, or NULL if none.
+ * @port:      Server port to share.
+ * @uid:       Owner of @hsk.
+ *
+ * Return:  0 for success, otherwise a negative errno.
+ */
+static int homa_group_join(struct homa_socktab *socktab, struct homa_sock *hsk,
+		struct homa_port_group *group, __u16 port, kuid_t uid)
+{
+	if (!hsk->inet.sk.sk_reuseport)
+		return -EADDRINUSE;
+	if (hsk->port < HOMA_MIN_DEFAULT_PORT)
+		return -EINVAL;
+	if (!group) {
+		group = kmalloc(sizeof(*group), GFP_ATOMIC);
+		if (!group)
+			return -ENOMEM;
+		group->port = port;
+		group->uid = uid;
+		group->socks[0] = hsk;
+		group->num_socks = 1;
+		hlist_add_head_rcu(&group->links,
+				&socktab->group_buckets[homa_port_hash(port)]);
+		WRITE_ONCE(socktab->num_groups, socktab->num_groups + 1);
+	} else {
+		if (!uid_eq(uid, group->uid)
+				|| (group->num_socks >= HOMA_MAX_GROUP_SOCKS))
+			return -EADDRINUSE;
+		group->socks[group->num_socks] = hsk;
+
+		/* The new entry must be visible before the count. */
+		smp_store_release(&group->num_socks, group->num_socks + 1);
+	}
+	hsk->group = group;
+
+	/* getsockname should report the shared port. */
+	hsk->inet.inet_num = port;
+	hsk->inet.inet_sport = htons(port);
+	return 0;
+}
+
+/**
+ * homa_group_leave() - Remove a socket from its port group, deleting the
+ * group if it becomes empty. The caller must hold the socktab's write_lock.
+ * @socktab:   Hash table in which the group is recorded.
+ * @hsk:       Socket to remove; hsk->group must not be NULL.
+ */
+void homa_group_leave(struct homa_socktab *socktab, struct homa_sock *hsk)
+{
+	struct homa_port_group *group = hsk->group;
+	int i, last = group->num_socks - 1;
+
+	for (i = 0; i < last; i++) {
+		if (group->socks[i] == hsk) {
+			group->socks[i] = group->socks[last];
+			break;
+		}
+	}
+	WRITE_ONCE(group->num_socks, last);
+	hsk->group = NULL;
+	if (last == 0) {
+		hlist_del_rcu(&group->links);
+		WRITE_ONCE(socktab->num_groups, socktab->num_groups - 1);
+		call_rcu(&group->rcu_head, homa_group_free_rcu);
+	}
+}
+
+/**
+ * homa_group_select() - Choose the member socket of a port group that
+ * should handle an incoming packet. New RPCs are assigned to members by
+ * hashing; packets (and acks) for an existing RPC go to the member that
+ * owns it, even if the group's membership has changed since the RPC was
+ * created.
+ * @homa:      Overall data about the Homa protocol implementation.
+ * @port:      Destination port of the packet.
+ * @saddr:     Address of the packet's sender.
+ * @sport:     Port at @saddr from which the packet was sent.
+ * @id:        Local id of the packet's RPC.
+ * @first:     Nonzero means the packet may be the first one for a new RPC
+ *             (a DATA packet for offset 0); in this case there's no
+ *             point searching for an existing RPC.
+ *
+ * Return:     The member socket, or NULL if @port has no group. The caller
+ *             must hold an RCU read lock while using the result (which
+ *             could be a socket that has just been shut down).
+ */
+struct homa_sock *homa_group_select(struct homa *homa, __u16 port,
+		const struct in6_addr *saddr, __u16 sport, __u64 id,
+		int first)
+{
+	struct homa_port_group *group;
+	struct homa_sock *owner;
+	int num_socks;
+	__u32 hash;
+
+	if (READ_ONCE(homa->port_map.num_groups) == 0)
+		return NULL;
+	group = homa_group_find(&homa->port_map, port);
+	if (!group)
+		return NULL;
+	num_socks = smp_load_acquire(&group->num_socks);
+	if (num_socks == 0)
+		return NULL;
+	INC_METRIC(group_lookups, 1);
+	if (!first && (num_socks > 1)) {
+		/* Hashing may pick a different member than the one that
+		 * created the RPC, if members have joined or left since.
+		 */
+		owner = homa_peer_rpc_sock(homa, saddr, port, sport, id);
+		if (owner)
+			return owner;
+	}
+	hash = jhash_3words(saddr->s6_addr32[2], saddr->s6_addr32[3], sport,
+			homa->group_steering ? 0 : (__u32) id);
+	return READ_ONCE(group->socks[reciprocal_scale(hash, num_socks)]);
+}
+
 /**
  * homa_sock_bind() - Associates a server port with a socket; if there
  * was a previous server port assignment for @hsk, it is abandoned.
+ * If @hsk has SO_REUSEPORT set, it joins the group of sockets sharing
+ * @port instead (see struct homa_port_group); once it has joined a group
+ * it can't be bound to a different port.
  * @socktab:   Hash table in which the binding will be recorded.
  * @hsk:       Homa socket.
  * @port:      Desired server port for @hsk. If 0, then this call
@@ -254,13 +478,16 @@ int homa_sock_bind(struct homa_socktab *socktab, struct homa_sock *hsk,
 		__u16 port)
 {
 	int result = 0;
+	struct homa_port_group *group;
 	struct homa_sock *owner;
+	kuid_t uid;
 
 	if (port == 0)
 		return result;
 	if (port >= HOMA_MIN_DEFAULT_PORT) {
 		return -EINVAL;
 	}
+	uid = sock_i_uid(&hsk->inet.sk);
 	homa_sock_lock(hsk, "homa_sock_bind");
 	spin_lock_bh(&socktab->write_lock);
 	if (hsk->shutdown) {
@@ -274,6 +501,16 @@ int homa_sock_bind(struct homa_socktab *socktab, struct homa_sock *hsk,
 			result = -EADDRINUSE;
 		goto done;
 	}
+	if (hsk->group) {
+		if (hsk->group->port != port)
+			result = -EINVAL;
+		goto done;
+	}
+	group = homa_group_find(socktab, port);
+	if (group || hsk->inet.sk.sk_reuseport) {
+		result = homa_group_join(socktab, hsk, group, port, uid);
+		goto done;
+	}
 	hlist_del_rcu(&hsk->socktab_links.hash_links);
 	hsk->port = port;
 	hsk->inet.inet_num = port;
@@ -311,6 +548,46 @@ struct homa_sock *homa_sock_find(struct homa_socktab *socktab,  __u16 port)
 	return result;
 }
 
+/**
+ * homa_sock_find_cached() - Same as homa_sock_find, except that it first
+ * checks a one-entry per-core cache holding the result of the most recent
+ * lookup on this core; this avoids the hash walk when consecutive packets
+ * go to the same socket (e.g. a server with one busy port). Must be
+ * invoked in SoftIRQ context (the cache isn't synchronized across cores).
+ * @socktab:    Hash table in which to perform lookup.
+ * @port:       The port of interest.
+ * Return:      The socket that owns @port, or NULL if none.
+ *
+ * As with homa_sock_find, the caller must hold an RCU read lock (or
+ * otherwise prevent grace periods) while using the result.
+ */
+struct homa_sock *homa_sock_find_cached(struct homa_socktab *socktab,
+		__u16 port)
+{
+	struct homa_core *core = homa_cores[raw_smp_processor_id()];
+	int removals = atomic_read(&socktab->removals);
+	struct homa_sock *hsk;
+
+	/* Must read @removals before the cache entry and the hash chains;
+	 * pairs with smp_wmb in homa_sock_shutdown.
+	 */
+	smp_rmb();
+	hsk = core->cached_sock;
+	if (hsk && (core->cached_socktab == socktab)
+			&& (core->cached_removals == removals)
+			&& (READ_ONCE(hsk->port) == port)) {
+		INC_METRIC(socket_cache_hits, 1);
+		return hsk;
+	}
+	hsk = homa_sock_find(socktab, port);
+	if (hsk) {
+		core->cached_sock = hsk;
+		core->cached_socktab = socktab;
+		core->cached_removals = removals;
+	}
+	return hsk;
+}
+
 /**
  * homa_sock_lock_slow() - This function implements the slow path for
  * acquiring a socketC lock. It is invoked when a socket lock isn't immediately
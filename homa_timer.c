@@ -38,12 +38,13 @@ int homa_check_rpc(struct homa_rpc *rpc)
 	/* See if we need to request an ack for this RPC. */
 	if (!homa_is_client(rpc->id) && (rpc->state == RPC_OUTGOING)
 			&& (rpc->msgout.next_xmit_offset >= rpc->msgout.length)) {
-		if (rpc->done_timer_ticks == 0)
-			rpc->done_timer_ticks = homa->timer_ticks;
+		if (rpc->cold->done_timer_ticks == 0)
+			rpc->cold->done_timer_ticks = homa->timer_ticks;
 		else {
 			/* >= comparison that handles tick wrap-around. */
-			if ((rpc->done_timer_ticks + homa->request_ack_ticks
-					- 1 - homa->timer_ticks) & 1<<31) {
+			if ((rpc->cold->done_timer_ticks
+					+ homa->request_ack_ticks - 1
+					- homa->timer_ticks) & 1<<31) {
 				struct need_ack_header h;
 				homa_xmit_control(NEED_ACK, &h, sizeof(h), rpc);
 				tt_record4("Sent NEED_ACK for RPC id %d to "
@@ -51,7 +52,7 @@ int homa_check_rpc(struct homa_rpc *rpc)
 						rpc->id,
 						tt_addr(rpc->peer->addr),
 						rpc->dport, homa->timer_ticks
-						- rpc->done_timer_ticks);
+						- rpc->cold->done_timer_ticks);
 			}
 		}
 	}
@@ -151,21 +152,32 @@ int homa_check_rpc(struct homa_rpc *rpc)
 		 * optimizations is tricky; don't change the comparison below
 		 * unless you're sure you know what you are doing.
 		 */
-	        if (!((peer->least_recent_ticks - rpc->resend_timer_ticks)
-				& (1U<<31))) {
+	        if (!((peer->least_recent_ticks
+				- rpc->cold->resend_timer_ticks) & (1U<<31))) {
 		        peer->least_recent_rpc = rpc;
-		        peer->least_recent_ticks = rpc->resend_timer_ticks;
+		        peer->least_recent_ticks =
+					rpc->cold->resend_timer_ticks;
 	        }
 	        return 0;
 	}
 
 	/* Issue a resend for this RPC. */
-	rpc->resend_timer_ticks = homa->timer_ticks;
+	rpc->cold->resend_timer_ticks = homa->timer_ticks;
 	rpc->peer->most_recent_resend = homa->timer_ticks;
 	rpc->peer->outstanding_resends++;
 	homa_get_resend_range(&rpc->msgin, &resend);
 	resend.priority = homa->num_priorities-1;
+	if ((homa->congestion_signal & HOMA_CONG_RESENDS)
+			&& (rpc->msgin.length >= 0) && (resend.length != 0)) {
+		/* Granted data has gone missing: probably lost to
+		 * congestion on the way here.
+		 */
+		INC_METRIC(cong_resend_signals, 1);
+		homa_peer_congested(homa, rpc->peer);
+	}
 	homa_xmit_control(RESEND, &resend, sizeof(resend), rpc);
+	if (homa->freeze_resends_per_tick)
+		atomic_inc(&homa->freeze_resends);
 	if (homa_is_client(rpc->id)) {
 		us = "client";
 		them = "server";
@@ -191,31 +203,161 @@ int homa_check_rpc(struct homa_rpc *rpc)
 }
 
 /**
- * homa_timer() - This function is invoked at regular intervals ("ticks")
- * to implement retries and aborts for Homa.
- * @homa:    Overall data about the Homa protocol implementation.
+ * homa_timer_delay() - Compute how long homa_timer can wait before it
+ * checks an RPC again.
+ * @rpc:     RPC that has just been checked by homa_check_rpc; must be
+ *           locked by the caller.
+ *
+ * Return:   Number of ticks until the RPC should be checked again (at
+ *           least 1 and less than HOMA_TIMER_SLOTS).
  */
-void homa_timer(struct homa *homa)
+int homa_timer_delay(struct homa_rpc *rpc)
+{
+	struct homa *homa = rpc->hsk->homa;
+	int delay;
+
+	/* Nothing can happen to the RPC until its silent_ticks reaches
+	 * resend_ticks-1 (that's when homa_check_rpc starts to consider it
+	 * for resends). If packets arrive in the meantime, silent_ticks
+	 * will be reset and we'll just reschedule it when it is checked.
+	 */
+	delay = homa->resend_ticks - 1 - rpc->silent_ticks;
+
+	/* A server RPC that is waiting for an ack must be checked when
+	 * it is time to request one.
+	 */
+	if (!homa_is_client(rpc->id) && (rpc->state == RPC_OUTGOING)
+			&& (rpc->msgout.next_xmit_offset >= rpc->msgout.length)
+			&& (rpc->cold->done_timer_ticks != 0)) {
+		int ack_delay = rpc->cold->done_timer_ticks
+				+ homa->request_ack_ticks - homa->timer_ticks;
+		if (ack_delay < delay)
+			delay = ack_delay;
+	}
+
+	if (delay < 1)
+		delay = 1;
+	if (delay >= HOMA_TIMER_SLOTS)
+		delay = HOMA_TIMER_SLOTS - 1;
+	return delay;
+}
+
+/**
+ * homa_timer_sock() - Check all of the RPCs in a socket whose timer
+ * wheel slots have come due.
+ * @hsk:        Socket to check. The caller must have invoked
+ *              homa_protect_rpcs for this socket and must hold an RCU
+ *              read lock (which may be released temporarily here).
+ * @now:        Current value of homa->timer_ticks.
+ * @dead_peer:  If an RPC's peer has timed out and this is NULL, it is
+ *              set to the peer (with a reference that the caller must
+ *              release).
+ */
+static void homa_timer_sock(struct homa_sock *hsk, __u32 now,
+		struct homa_peer **dead_peer)
 {
-	struct homa_socktab_scan scan;
-	struct homa_sock *hsk;
 	struct homa_rpc *rpc;
-	cycles_t start, end;
-	struct homa_peer *dead_peer = NULL;
+	LIST_HEAD(due);
 	int rpc_count = 0;
-	int total_rpcs = 0;
-	int total_incoming_rpcs = 0;
-	int total_incoming_bytes = 0;
+	__u32 first, t;
 
-	start = get_cycles();
-	homa->timer_ticks++;
+	/* Collect the RPCs from all of the slots that have come due since
+	 * the last pass over this socket (normally there is just one).
+	 * RPCs on @due are still protected by the socket lock, so
+	 * homa_rpc_free can unlink them safely.
+	 */
+	first = hsk->timer_ticks + 1;
+	if ((now - hsk->timer_ticks) > HOMA_TIMER_SLOTS)
+		first = now - HOMA_TIMER_SLOTS + 1;
+	homa_sock_lock(hsk, "homa_timer_sock");
+	for (t = first; t != now + 1; t++)
+		list_splice_tail_init(&hsk->timer_wheel[t
+				& (HOMA_TIMER_SLOTS - 1)], &due);
+	hsk->timer_ticks = now;
+	homa_sock_unlock(hsk);
 
-	/* Scan all existing RPCs in all sockets.  The rcu_read_lock
-	 * below prevents sockets from being deleted during the scan.
+	while (1) {
+		homa_sock_lock(hsk, "homa_timer_sock");
+		rpc = list_first_entry_or_null(&due, struct homa_rpc,
+				timer_links);
+		if (rpc)
+			list_del_init(&rpc->timer_links);
+		homa_sock_unlock(hsk);
+		if (!rpc)
+			break;
+
+		homa_rpc_lock(rpc);
+		if (rpc->state == RPC_DEAD) {
+			/* Already unlinked by homa_rpc_free. */
+			homa_rpc_unlock(rpc);
+			continue;
+		}
+		INC_METRIC(timer_rpc_checks, 1);
+		if (rpc->state == RPC_IN_SERVICE) {
+			rpc->silent_ticks = 0;
+		} else {
+			/* If silent_ticks was reset since the last check,
+			 * we don't know when, so assume it happened just
+			 * before this tick.
+			 */
+			if (rpc->silent_ticks > 0)
+				rpc->silent_ticks += now
+					- rpc->cold->checked_timer_ticks;
+			else
+				rpc->silent_ticks = 1;
+			if (homa_check_rpc(rpc) && !*dead_peer) {
+				/* Hold a reference so the peer can't be
+				 * evicted before its RPCs are aborted.
+				 */
+				*dead_peer = rpc->peer;
+				homa_peer_hold(*dead_peer);
+			}
+		}
+		rpc->cold->checked_timer_ticks = now;
+		homa_sock_lock(hsk, "homa_timer_sock");
+		list_add_tail(&rpc->timer_links, &hsk->timer_wheel[
+				(now + homa_timer_delay(rpc))
+				& (HOMA_TIMER_SLOTS - 1)]);
+		homa_sock_unlock(hsk);
+		homa_rpc_unlock(rpc);
+
+		rpc_count++;
+		if (rpc_count >= 10) {
+			/* Give other kernel threads a chance to run
+			 * on this core. Must release the RCU read lock
+			 * while doing this.
+			 */
+			rcu_read_unlock();
+			schedule();
+			rcu_read_lock();
+			rpc_count = 0;
+		}
+	}
+}
+
+/**
+ * homa_timer_scan() - Perform one tick's worth of timer processing for
+ * the sockets in one shard.
+ * @homa:        Overall data about the Homa protocol implementation.
+ * @shard:       Index of the shard to process: only sockets whose port
+ *               number mod @num_shards equals this value are processed.
+ * @num_shards:  Total number of shards.
+ */
+void homa_timer_scan(struct homa *homa, int shard, int num_shards)
+{
+	struct homa_socktab_scan scan;
+	struct homa_sock *hsk;
+	struct homa_peer *dead_peer = NULL;
+	__u32 now = READ_ONCE(homa->timer_ticks);
+
+	/* The rcu_read_lock below prevents sockets from being deleted
+	 * during the scan.
 	 */
 	rcu_read_lock();
 	for (hsk = homa_socktab_start_scan(&homa->port_map, &scan);
 			hsk !=  NULL; hsk = homa_socktab_next(&scan)) {
+		if ((hsk->port % num_shards) != shard)
+			continue;
 		while (hsk->dead_skbs >= homa->dead_buffs_limit) {
 			/* If we get here, it means that homa_wait_for_message
 			 * isn't keeping up with RPC reaping, so we'll help
@@ -232,33 +374,7 @@ void homa_timer(struct homa *homa)
 
 		if (!homa_protect_rpcs(hsk))
 			continue;
-		list_for_each_entry_rcu(rpc, &hsk->active_rpcs, active_links) {
-			total_rpcs++;
-			homa_rpc_lock(rpc);
-			if (rpc->state == RPC_IN_SERVICE) {
-				rpc->silent_ticks = 0;
-				homa_rpc_unlock(rpc);
-				continue;
-			} else if (rpc->state == RPC_INCOMING) {
-				total_incoming_rpcs++;
-				total_incoming_bytes += rpc->msgin.length;
-			}
-			rpc->silent_ticks++;
-			if (homa_check_rpc(rpc))
-				dead_peer = rpc->peer;
-			homa_rpc_unlock(rpc);
-			rpc_count++;
-			if (rpc_count >= 10) {
-				/* Give other kernel threads a chance to run
-				 * on this core. Must release the RCU read lock
-				 * while doing this.
-				 */
-				rcu_read_unlock();
-				schedule();
-				rcu_read_lock();
-				rpc_count = 0;
-			}
-		}
+		homa_timer_sock(hsk, now, &dead_peer);
 		homa_unprotect_rpcs(hsk);
 	}
 	rcu_read_unlock();
@@ -270,12 +386,157 @@ void homa_timer(struct homa *homa)
 		 * complexity). If there's more than one dead peer, we'll
 		 * timeout another one in the next call.
 		 */
-		homa_abort_rpcs(homa, &dead_peer->addr, 0, -ETIMEDOUT);
+		homa_abort_peer_rpcs(dead_peer, 0, -ETIMEDOUT);
+		homa_peer_put(dead_peer);
 	}
+}
+
+/**
+ * homa_timer() - This function is invoked at regular intervals ("ticks")
+ * to implement retries and aborts for Homa.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_timer(struct homa *homa)
+{
+	cycles_t start, end;
+	int i, num_shards;
+
+	start = get_cycles();
+	homa->timer_ticks++;
 
-//	if (total_rpcs > 0)
-//		tt_record1("homa_timer finished scanning %d RPCs", total_rpcs);
+	if (homa->auto_cutoffs && ((homa->timer_ticks % homa->auto_cutoffs)
+			== 0))
+		homa_auto_cutoffs(homa);
+
+	/* Check the automatic freeze triggers that are evaluated once per
+	 * tick; the resend count covers the previous tick's scan.
+	 */
+	if (homa->freeze_resends_per_tick) {
+		int resends = atomic_xchg(&homa->freeze_resends, 0);
+
+		if (resends > homa->freeze_resends_per_tick)
+			homa_freeze_trigger(homa, RESEND_RATE,
+					"Freezing because of %d resends in "
+					"timer tick %d", resends,
+					homa->timer_ticks);
+	}
+	homa_peer_flush_acks(homa);
+	if (homa_grants_pending(homa))
+		homa_send_grants(homa);
+	if (homa->freeze_peers_pending) {
+		homa->freeze_peers_pending = 0;
+		homa_freeze_peers(homa);
+	}
+
+	/* Hand off sockets to the other shard threads (if there are any),
+	 * then process shard 0 here.
+	 */
+	num_shards = READ_ONCE(homa->active_timer_shards);
+	for (i = 1; i < num_shards; i++) {
+		WRITE_ONCE(homa->timer_shards[i].ticks, homa->timer_ticks);
+		wake_up_process(homa->timer_shards[i].kthread);
+	}
+	homa_timer_scan(homa, 0, num_shards);
+
+	/* Grow the peer table if it has gotten crowded (this may block,
+	 * which is OK here but not in homa_peer_find), then evict peers
+	 * that are no longer in use.
+	 */
+	homa_peertab_check_resize(&homa->peers);
+	homa_peertab_sweep(&homa->peers, homa->peer_idle_secs * HZ,
+			homa->max_peer_kbytes
+			? (int) (((__u64) homa->max_peer_kbytes * 1024)
+			/ sizeof(struct homa_peer)) : INT_MAX);
 
 	end = get_cycles();
 	INC_METRIC(timer_cycles, end-start);
 }
+
+/**
+ * homa_timer_shard_main() - Top-level function for the threads that
+ * handle timer shards other than shard 0.
+ * @arg:     Pointer to the homa_timer_shard for this thread.
+ *
+ * Return:   Always 0.
+ */
+int homa_timer_shard_main(void *arg)
+{
+	struct homa_timer_shard *shard = (struct homa_timer_shard *) arg;
+	struct homa *homa = shard->homa;
+
+	while (1) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!homa->timer_shard_exit
+				&& (shard->done_ticks == READ_ONCE(shard->ticks)))
+			schedule();
+		__set_current_state(TASK_RUNNING);
+		if (homa->timer_shard_exit)
+			break;
+		shard->done_ticks = READ_ONCE(shard->ticks);
+		homa_timer_scan(homa, shard->id,
+				READ_ONCE(homa->active_timer_shards));
+	}
+	kthread_complete_and_exit(&shard->kthread_done, 0);
+	return 0;
+}
+
+/**
+ * homa_timer_shards_start() - Make sure that there is a running thread for
+ * each of the first homa->num_timer_shards entries in homa->timer_shards
+ * (other than entry 0), then update homa->active_timer_shards to match.
+ * Must be invoked in process context.
+ * @homa:    Overall data about the Homa protocol implementation.
+ *
+ * Return:   0 for success, or a negative errno if a thread couldn't
+ *           be created.
+ */
+int homa_timer_shards_start(struct homa *homa)
+{
+	struct homa_timer_shard *shard;
+	int i, err = 0;
+
+	for (i = 1; i < homa->num_timer_shards; i++) {
+		shard = &homa->timer_shards[i];
+		if (shard->kthread)
+			continue;
+		shard->done_ticks = shard->ticks;
+		shard->kthread = kthread_run(homa_timer_shard_main, shard,
+				"homa_timer%d", i);
+		if (IS_ERR_OR_NULL(shard->kthread)) {
+			err = shard->kthread ? PTR_ERR(shard->kthread)
+					: -ENOMEM;
+			shard->kthread = NULL;
+			printk(KERN_ERR "couldn't create homa timer thread %d: "
+					"error %d\n", i, err);
+			break;
+		}
+	}
+
+	/* Sockets are only assigned to a shard once its thread is running. */
+	WRITE_ONCE(homa->active_timer_shards, i);
+	return err;
+}
+
+/**
+ * homa_timer_shards_stop() - Will cause all of the timer shard threads to
+ * exit (waking them up if necessary); doesn't return until after the
+ * threads have exited.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_timer_shards_stop(struct homa *homa)
+{
+	struct homa_timer_shard *shard;
+	int i;
+
+	homa->timer_shard_exit = true;
+	WRITE_ONCE(homa->active_timer_shards, 1);
+	for (i = 1; i < HOMA_MAX_TIMER_SHARDS; i++) {
+		shard = &homa->timer_shards[i];
+		if (!shard->kthread)
+			continue;
+		wake_up_process(shard->kthread);
+		kthread_stop(shard->kthread);
+		wait_for_completion(&shard->kthread_done);
+		shard->kthread = NULL;
+	}
+}
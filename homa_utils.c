@@ -25,8 +25,6 @@ struct homa_core *homa_cores[NR_CPUS];
 /* Points to block of memory holding all homa_cores; used to free it. */
 char *core_memory;
 
-struct completion homa_pacer_kthread_done;
-
 /**
  * homa_init() - Constructor for homa objects.
  * @homa:   Object to initialize.
@@ -69,30 +67,64 @@ int homa_init(struct homa *homa)
 			for (j = 1; j < NUM_GEN3_SOFTIRQ_CORES; j++)
 				core->gen3_softirq_cores[j] = -1;
 			core->last_app_active = 0;
+			core->numa_node = cpu_to_node(i);
+			core->softirq_load = 0;
+			core->softirq_load_start = 0;
+			core->softirq_busy = 0;
 			core->held_skb = NULL;
 			core->held_bucket = 0;
+			core->gro_batch = NULL;
+			core->cached_sock = NULL;
+			core->cached_socktab = NULL;
+			core->cached_removals = 0;
+			init_llist_head(&core->reap_socks);
+			INIT_WORK(&core->reap_work, homa_reap_work);
 			memset(&core->metrics, 0, sizeof(core->metrics));
 		}
 	}
 
-	homa->pacer_kthread = NULL;
-	init_completion(&homa_pacer_kthread_done);
 	atomic64_set(&homa->next_outgoing_id, 2);
-	atomic64_set(&homa->link_idle_time, get_cycles());
+	for (i = 0; i < HOMA_MAX_NICS; i++) {
+		memset(&homa->nics[i], 0, sizeof(homa->nics[i]));
+		atomic64_set(&homa->nics[i].link_idle_time, get_cycles());
+	}
+	homa->num_nics = 0;
+	spin_lock_init(&homa->nic_lock);
+	INIT_LIST_HEAD(&homa->ack_peers);
+	spin_lock_init(&homa->ack_peers_lock);
 	spin_lock_init(&homa->grantable_lock);
-	INIT_LIST_HEAD(&homa->grantable_rpcs);
+	atomic_set(&homa->grant_recalc_count, 0);
+	homa->grant_recalc_done = 0;
+	INIT_LIST_HEAD(&homa->grantable_peers);
 	homa->num_grantable_rpcs = 0;
+	homa->grantable_weight = 0;
+	homa->grant_pass = 0;
 	homa->last_grantable_change = get_cycles();
 	homa->max_grantable_rpcs = 0;
 	homa->grant_nonfifo = 0;
 	homa->grant_nonfifo_left = 0;
-	spin_lock_init(&homa->pacer_mutex);
+	for (i = 0; i < HOMA_MAX_PACERS; i++) {
+		struct homa_pacer *pacer = &homa->pacers[i];
+		int j;
+
+		spin_lock_init(&pacer->mutex);
+		pacer->homa = homa;
+		pacer->id = i;
+		pacer->fifo_count = 1;
+		pacer->vtime = 0;
+		pacer->wake_time = 0;
+		spin_lock_init(&pacer->throttle_lock);
+		pacer->nonempty_buckets = 0;
+		for (j = 0; j < HOMA_THROTTLE_BUCKETS; j++)
+			INIT_LIST_HEAD(&pacer->throttled_rpcs[j]);
+		pacer->throttle_add = 0;
+		pacer->kthread = NULL;
+		init_completion(&pacer->kthread_done);
+	}
+	homa->num_pacers = 1;
+	homa->active_pacers = 0;
+	homa->throttled_pacers = 0;
 	homa->pacer_fifo_fraction = 50;
-	homa->pacer_fifo_count = 1;
-	homa->pacer_wake_time = 0;
-	spin_lock_init(&homa->throttle_lock);
-	INIT_LIST_HEAD_RCU(&homa->throttled_rpcs);
-	homa->throttle_add = 0;
 	homa->throttle_min_bytes = 200;
 	atomic_set(&homa->total_incoming, 0);
 	homa->next_client_port = HOMA_MIN_DEFAULT_PORT;
@@ -107,8 +139,13 @@ int homa_init(struct homa *homa)
 	/* Wild guesses to initialize configuration values... */
 	homa->unsched_bytes = 10000;
 	homa->window = 10000;
+	homa->peer_rtt = 0;
+	homa->congestion_signal = 0;
+	homa->congestion_decay_ticks = 5;
 	homa->link_mbps = 25000;
+	homa->nic_link_mbps[0] = 0;
 	homa->poll_usecs = 50;
+	homa->adaptive_poll = 0;
 	homa->num_priorities = HOMA_MAX_PRIORITIES;
 	for (i = 0; i < HOMA_MAX_PRIORITIES; i++)
 		homa->priority_map[i] = i;
@@ -125,38 +162,64 @@ int homa_init(struct homa *homa)
 #else
 	homa->cutoff_version = 1;
 #endif
+	homa->auto_cutoffs = 0;
+	homa->auto_cutoffs_min_msgs = 10000;
+	homa->auto_cutoffs_drift = 20;
+	memset(&homa->cutoff_state, 0, sizeof(homa->cutoff_state));
 	homa->fifo_grant_increment = 10000;
 	homa->grant_fifo_fraction = 50;
+	homa->weighted_shares = 0;
+	RCU_INIT_POINTER(homa->policy, NULL);
 	homa->max_overcommit = 8;
 	homa->max_incoming = 400000;
 	homa->max_rpcs_per_peer = 1;
+	homa->max_peer_kbytes = 0;
+	homa->peer_idle_secs = 120;
 	homa->resend_ticks = 15;
 	homa->resend_interval = 10;
 	homa->timeout_resends = 5;
 	homa->request_ack_ticks = 2;
+	homa->ack_flush_usecs = 0;
 	homa->reap_limit = 10;
+	homa->rpc_cache_max = 1000;
 	homa->dead_buffs_limit = 5000;
+	homa->reap_worker_skbs = 1000;
 	homa->max_dead_buffs = 0;
-	homa->pacer_kthread = kthread_run(homa_pacer_main, homa,
-			"homa_pacer");
-	if (IS_ERR(homa->pacer_kthread)) {
-		err = PTR_ERR(homa->pacer_kthread);
-		homa->pacer_kthread = NULL;
-		printk(KERN_ERR "couldn't create homa pacer thread: error %d\n",
-			err);
-		return err;
-	}
 	homa->pacer_exit = false;
+	err = homa_pacer_start(homa);
+	if (err)
+		return err;
 	homa->max_nic_queue_ns = 2000;
+	homa->priority_queues = 0;
 	homa->cycles_per_kbyte = 0;
 	homa->verbose = 0;
 	homa->max_gso_size = 10000;
 	homa->max_gro_skbs = 20;
 	homa->gso_force_software = 0;
+	homa->group_steering = 0;
+	homa->udp_port = 0;
+	homa->udp_sock = NULL;
 	homa->gro_policy = HOMA_GRO_NORMAL;
 	homa->busy_usecs = 100;
+	homa->handoff_locality = 1;
 	homa->gro_busy_usecs = 5;
+	homa->softirq_load_usecs = 1000;
+	for (i = 0; i < HOMA_STEER_SLOTS; i++)
+		homa->steer_cores[i] = -1;
 	homa->timer_ticks = 0;
+	for (i = 0; i < HOMA_MAX_TIMER_SHARDS; i++) {
+		struct homa_timer_shard *shard = &homa->timer_shards[i];
+
+		shard->homa = homa;
+		shard->id = i;
+		shard->ticks = 0;
+		shard->done_ticks = 0;
+		shard->kthread = NULL;
+		init_completion(&shard->kthread_done);
+	}
+	homa->num_timer_shards = 1;
+	homa->active_timer_shards = 1;
+	homa->timer_shard_exit = false;
 	spin_lock_init(&homa->metrics_lock);
 	homa->metrics = NULL;
 	homa->metrics_capacity = 0;
@@ -164,7 +227,14 @@ int homa_init(struct homa *homa)
 	homa->metrics_active_opens = 0;
 	homa->flags = 0;
 	homa->freeze_type = 0;
+	homa->freeze_slow_factor = 0;
+	homa->freeze_slow_base_usecs = 20;
+	homa->freeze_grantable_rpcs = 0;
+	homa->freeze_resends_per_tick = 0;
+	atomic_set(&homa->freeze_resends, 0);
+	homa->freeze_peers_pending = 0;
 	homa->sync_freeze = 0;
+	homa->tt_categories = TT_ALL_CATEGORIES;
 	homa->bpage_lease_usecs = 10000;
 	homa->next_id = 0;
 	homa_outgoing_sysctl_changed(homa);
@@ -179,15 +249,22 @@ int homa_init(struct homa *homa)
 void homa_destroy(struct homa *homa)
 {
 	int i;
-	if (homa->pacer_kthread) {
-		homa_pacer_stop(homa);
-		wait_for_completion(&homa_pacer_kthread_done);
-	}
+	homa_pacer_stop(homa);
+	homa_timer_shards_stop(homa);
 
 	/* The order of the following 2 statements matters! */
 	homa_socktab_destroy(&homa->port_map);
 	homa_peertab_destroy(&homa->peers);
+	if (homa->udp_sock) {
+		udp_tunnel_sock_release(homa->udp_sock);
+		homa->udp_sock = NULL;
+	}
 	if (core_memory) {
+		/* Sockets are all shut down now, so the reap workers will
+		 * just release their socket references.
+		 */
+		for (i = 0; i < nr_cpu_ids; i++)
+			flush_work(&homa_cores[i]->reap_work);
 		vfree(core_memory);
 		core_memory = NULL;
 		for (i = 0; i < nr_cpu_ids; i++) {
@@ -198,6 +275,100 @@ void homa_destroy(struct homa *homa)
 		kfree(homa->metrics);
 }
 
+/**
+ * homa_rpc_alloc() - Obtain memory for a new homa_rpc (and its
+ * homa_rpc_cold), reusing a reaped struct from the socket's cache if one
+ * is available.
+ * @hsk:      Socket for which the RPC will be created.
+ *
+ * Return:    The new struct, or NULL if memory couldn't be allocated.
+ *            Only @cold and @msgin.bpage_offsets are initialized.
+ */
+static struct homa_rpc *homa_rpc_alloc(struct homa_sock *hsk)
+{
+	struct homa_rpc *rpc = NULL;
+
+	spin_lock_bh(&hsk->rpc_cache_lock);
+	if (!list_empty(&hsk->rpc_cache)) {
+		rpc = list_first_entry(&hsk->rpc_cache, struct homa_rpc,
+				dead_links);
+		list_del(&rpc->dead_links);
+		hsk->rpc_cache_size--;
+	}
+	spin_unlock_bh(&hsk->rpc_cache_lock);
+	if (rpc) {
+		INC_METRIC(rpc_cache_hits, 1);
+		return rpc;
+	}
+	INC_METRIC(rpc_cache_misses, 1);
+	rpc = (struct homa_rpc *) kmalloc(sizeof(*rpc), GFP_KERNEL);
+	if (unlikely(!rpc))
+		return NULL;
+	rpc->cold = (struct homa_rpc_cold *) kmalloc(sizeof(*rpc->cold),
+			GFP_KERNEL);
+	if (unlikely(!rpc->cold)) {
+		kfree(rpc);
+		return NULL;
+	}
+	rpc->msgin.bpage_offsets = rpc->cold->bpage_offsets;
+	return rpc;
+}
+
+/**
+ * homa_rpc_kfree() - Return the memory for a homa_rpc (obtained from
+ * homa_rpc_alloc) to kmalloc.
+ * @rpc:      RPC to free.
+ */
+static void homa_rpc_kfree(struct homa_rpc *rpc)
+{
+	kfree(rpc->cold);
+	kfree(rpc);
+}
+
+/**
+ * homa_rpc_recycle() - Release the memory for a homa_rpc: it is kept
+ * in the socket's cache for reuse if there is room, otherwise it is
+ * returned to kmalloc.
+ * @hsk:      Socket that owned the RPC.
+ * @rpc:      RPC to release; must have been completely reaped.
+ */
+static void homa_rpc_recycle(struct homa_sock *hsk, struct homa_rpc *rpc)
+{
+	spin_lock_bh(&hsk->rpc_cache_lock);
+
+	/* Checking shutdown under the cache lock guarantees that
+	 * homa_rpc_cache_drain can't miss this RPC.
+	 */
+	if (!hsk->shutdown
+			&& (hsk->rpc_cache_size < hsk->homa->rpc_cache_max)) {
+		list_add(&rpc->dead_links, &hsk->rpc_cache);
+		hsk->rpc_cache_size++;
+		rpc = NULL;
+	}
+	spin_unlock_bh(&hsk->rpc_cache_lock);
+	if (rpc)
+		homa_rpc_kfree(rpc);
+}
+
+/**
+ * homa_rpc_cache_drain() - Free all of the homa_rpc structs in a socket's
+ * rpc_cache. Invoked during socket shutdown, after @hsk->shutdown has
+ * been set.
+ * @hsk:      Socket whose cache should be emptied.
+ */
+void homa_rpc_cache_drain(struct homa_sock *hsk)
+{
+	struct homa_rpc *rpc, *next;
+	LIST_HEAD(rpcs);
+
+	spin_lock_bh(&hsk->rpc_cache_lock);
+	list_splice_init(&hsk->rpc_cache, &rpcs);
+	hsk->rpc_cache_size = 0;
+	spin_unlock_bh(&hsk->rpc_cache_lock);
+	list_for_each_entry_safe(rpc, next, &rpcs, dead_links)
+		homa_rpc_kfree(rpc);
+}
+
 /**
  * homa_rpc_new_client() - Allocate and construct a client RPC (one that is used
  * to issue an outgoing request). Doesn't send any packets. Invoked with no
@@ -217,7 +388,7 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	struct homa_rpc_bucket *bucket;
 	struct in6_addr dest_addr_as_ipv6 = canonical_ipv6_addr(dest);
 
-	crpc = (struct homa_rpc *) kmalloc(sizeof(*crpc), GFP_KERNEL);
+	crpc = homa_rpc_alloc(hsk);
 	if (unlikely(!crpc))
 		return ERR_PTR(-ENOMEM);
 
@@ -241,6 +412,9 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	crpc->error = 0;
 	crpc->msgin.length = -1;
 	crpc->msgin.num_bpages = 0;
+	crpc->msgin.streaming = 0;
+	crpc->msgin.stream_offset = 0;
+	crpc->msgin.stream_bpages = 0;
 	memset(&crpc->msgout, 0, sizeof(crpc->msgout));
 	crpc->msgout.length = -1;
 	INIT_LIST_HEAD(&crpc->ready_links);
@@ -248,12 +422,15 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	INIT_LIST_HEAD(&crpc->dead_links);
 	crpc->interest = NULL;
 	INIT_LIST_HEAD(&crpc->grantable_links);
+	INIT_LIST_HEAD(&crpc->peer_links);
 	INIT_LIST_HEAD(&crpc->throttled_links);
+	INIT_LIST_HEAD(&crpc->timer_links);
+	crpc->cold->checked_timer_ticks = hsk->homa->timer_ticks;
 	crpc->silent_ticks = 0;
-	crpc->resend_timer_ticks = hsk->homa->timer_ticks;
-	crpc->done_timer_ticks = 0;
+	crpc->cold->resend_timer_ticks = hsk->homa->timer_ticks;
+	crpc->cold->done_timer_ticks = 0;
 	crpc->magic = HOMA_RPC_MAGIC;
-	crpc->start_cycles = get_cycles();
+	crpc->cold->start_cycles = get_cycles();
 
 	/* Initialize fields that require locking. This allows the most
 	 * expensive work, such as copying in the message from user space,
@@ -268,14 +445,19 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 		err = -ESHUTDOWN;
 		goto error;
 	}
-	hlist_add_head(&crpc->hash_links, &bucket->rpcs);
+	homa_bucket_add(bucket, crpc);
 	list_add_tail_rcu(&crpc->active_links, &hsk->active_rpcs);
+	homa_peer_add_rpc(crpc);
+	list_add_tail(&crpc->timer_links, &hsk->timer_wheel[
+			(hsk->homa->timer_ticks + 1) & (HOMA_TIMER_SLOTS - 1)]);
 	homa_sock_unlock(hsk);
 
 	return crpc;
 
 error:
-	kfree(crpc);
+	if (!IS_ERR(crpc->peer))
+		homa_peer_put(crpc->peer);
+	homa_rpc_kfree(crpc);
 	return ERR_PTR(err);
 }
 
@@ -308,7 +490,9 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	 * the desired RPC.
 	 */
 	homa_bucket_lock(bucket, server);
-	hlist_for_each_entry_rcu(srpc, &bucket->rpcs, hash_links) {
+	hlist_for_each_entry_rcu(srpc, homa_rpc_chain(bucket,
+			homa_server_rpc_hash(source, ntohs(h->common.sport), id)),
+			hash_links) {
 		if ((srpc->id == id) &&
 				(srpc->dport == ntohs(h->common.sport)) &&
 				ipv6_addr_equal(&srpc->peer->addr, source)) {
@@ -321,7 +505,7 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	}
 
 	/* Initialize fields that don't require the socket lock. */
-	srpc = (struct homa_rpc *) kmalloc(sizeof(*srpc), GFP_KERNEL);
+	srpc = homa_rpc_alloc(hsk);
 	if (!srpc) {
 		err = -ENOMEM;
 		goto error;
@@ -342,6 +526,9 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	srpc->error = 0;
 	srpc->msgin.length = -1;
 	srpc->msgin.num_bpages = 0;
+	srpc->msgin.streaming = 0;
+	srpc->msgin.stream_offset = 0;
+	srpc->msgin.stream_bpages = 0;
 	memset(&srpc->msgout, 0, sizeof(srpc->msgout));
 	srpc->msgout.length = -1;
 	INIT_LIST_HEAD(&srpc->ready_links);
@@ -349,12 +536,15 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	INIT_LIST_HEAD(&srpc->dead_links);
 	srpc->interest = NULL;
 	INIT_LIST_HEAD(&srpc->grantable_links);
+	INIT_LIST_HEAD(&srpc->peer_links);
 	INIT_LIST_HEAD(&srpc->throttled_links);
+	INIT_LIST_HEAD(&srpc->timer_links);
+	srpc->cold->checked_timer_ticks = hsk->homa->timer_ticks;
 	srpc->silent_ticks = 0;
-	srpc->resend_timer_ticks = hsk->homa->timer_ticks;
-	srpc->done_timer_ticks = 0;
+	srpc->cold->resend_timer_ticks = hsk->homa->timer_ticks;
+	srpc->cold->done_timer_ticks = 0;
 	srpc->magic = HOMA_RPC_MAGIC;
-	srpc->start_cycles = get_cycles();
+	srpc->cold->start_cycles = get_cycles();
 	tt_record2("Incoming message for id %d has %d unscheduled bytes",
 			srpc->id, ntohl(h->incoming));
 	err = homa_message_in_init(srpc, ntohl(h->message_length),
@@ -369,8 +559,11 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 		err = -ESHUTDOWN;
 		goto error;
 	}
-	hlist_add_head(&srpc->hash_links, &bucket->rpcs);
+	homa_bucket_add(bucket, srpc);
 	list_add_tail_rcu(&srpc->active_links, &hsk->active_rpcs);
+	homa_peer_add_rpc(srpc);
+	list_add_tail(&srpc->timer_links, &hsk->timer_wheel[
+			(hsk->homa->timer_ticks + 1) & (HOMA_TIMER_SLOTS - 1)]);
 	if ((ntohl(h->seg.offset) == 0) && (srpc->msgin.num_bpages > 0)) {
 		atomic_or(RPC_PKTS_READY, &srpc->flags);
 		homa_rpc_handoff(srpc);
@@ -382,11 +575,109 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 
 error:
 	spin_unlock_bh(&bucket->lock);
-	if (srpc)
-		kfree(srpc);
+	if (srpc) {
+		if (!IS_ERR(srpc->peer))
+			homa_peer_put(srpc->peer);
+		homa_rpc_kfree(srpc);
+	}
 	return ERR_PTR(err);
 }
 
+/**
+ * homa_rpc_hash() - Compute the value used to select @rpc's hash chain
+ * within its homa_rpc_bucket.
+ * @rpc:    RPC whose hash is desired; its id, peer, and dport must be set.
+ *
+ * Return:  See homa_client_rpc_hash and homa_server_rpc_hash.
+ */
+static inline __u32 homa_rpc_hash(struct homa_rpc *rpc)
+{
+	if (homa_is_client(rpc->id))
+		return homa_client_rpc_hash(rpc->id);
+	return homa_server_rpc_hash(&rpc->peer->addr, rpc->dport, rpc->id);
+}
+
+/**
+ * homa_bucket_add() - Link an RPC into the appropriate hash chain of its
+ * bucket, growing the bucket if its chains have become too long.
+ * @bucket:   Bucket in which to add the RPC; must be locked, and must be
+ *            the bucket that @rpc->lock refers to.
+ * @rpc:      RPC to add; its id, peer, and dport must already be set.
+ */
+void homa_bucket_add(struct homa_rpc_bucket *bucket, struct homa_rpc *rpc)
+{
+	hlist_add_head(&rpc->hash_links, homa_rpc_chain(bucket,
+			homa_rpc_hash(rpc)));
+	bucket->num_rpcs++;
+	if (unlikely(bucket->num_rpcs > (HOMA_RPC_BUCKET_LOAD << bucket->bits))
+			&& (bucket->bits < HOMA_RPC_BUCKET_MAX_BITS))
+		homa_bucket_resize(bucket, bucket->bits + 1);
+}
+
+/**
+ * homa_bucket_remove() - Unlink an RPC from the hash chains of its
+ * bucket, shrinking the bucket if it has become mostly empty.
+ * @rpc:      RPC to remove; must be locked (which also locks its bucket).
+ */
+void homa_bucket_remove(struct homa_rpc *rpc)
+{
+	struct homa_rpc_bucket *bucket = container_of(rpc->lock,
+			struct homa_rpc_bucket, lock);
+
+	__hlist_del(&rpc->hash_links);
+	bucket->num_rpcs--;
+	if (unlikely(bucket->bits > 0) && ((4*bucket->num_rpcs)
+			< (HOMA_RPC_BUCKET_LOAD << bucket->bits)))
+		homa_bucket_resize(bucket, bucket->bits - 1);
+}
+
+/**
+ * homa_bucket_resize() - Replace the hash chains of a homa_rpc_bucket
+ * with a different number of chains, and rehash all of its RPCs.
+ * @bucket:   Bucket to resize; must be locked, unless no-one else can
+ *            access the socket anymore.
+ * @bits:     log2 of the desired number of chains.
+ *
+ * Return:    0 for success, otherwise a negative errno. If the new chains
+ *            couldn't be allocated the bucket is left unchanged; it is
+ *            still fully functional, just slower.
+ */
+int homa_bucket_resize(struct homa_rpc_bucket *bucket, int bits)
+{
+	struct hlist_head *old_rpcs = bucket->rpcs;
+	int old_chains = 1 << bucket->bits;
+	struct hlist_head *rpcs;
+	struct hlist_node *next;
+	struct homa_rpc *rpc;
+	int i;
+
+	if (bits == bucket->bits)
+		return 0;
+	if (bits == 0) {
+		rpcs = &bucket->rpc0;
+	} else {
+		/* We're holding a spinlock, so the allocation can't block. */
+		rpcs = kmalloc(sizeof(*rpcs) << bits, GFP_ATOMIC);
+		if (!rpcs)
+			return -ENOMEM;
+	}
+	for (i = 0; i < (1 << bits); i++)
+		INIT_HLIST_HEAD(&rpcs[i]);
+	bucket->rpcs = rpcs;
+	bucket->bits = bits;
+	for (i = 0; i < old_chains; i++) {
+		hlist_for_each_entry_safe(rpc, next, &old_rpcs[i], hash_links)
+			hlist_add_head(&rpc->hash_links, homa_rpc_chain(bucket,
+					homa_rpc_hash(rpc)));
+	}
+	if (old_rpcs == &bucket->rpc0)
+		INIT_HLIST_HEAD(&bucket->rpc0);
+	else
+		kfree(old_rpcs);
+	INC_METRIC(rpc_bucket_resizes, 1);
+	return 0;
+}
+
 /**
  * homa_rpc_lock_slow() - This function implements the slow path for
  * acquiring an RPC lock. It is invoked when an RPC lock isn't immediately
@@ -409,6 +700,51 @@ void homa_rpc_lock_slow(struct homa_rpc *rpc)
 	}
 }
 
+/**
+ * homa_peer_rpc_sock() - Find the port group member that owns a server
+ * RPC by searching the RPCs of its peer; this works even if group
+ * membership has changed since the RPC was created.
+ * @homa:         Overall data about the Homa protocol implementation.
+ * @saddr:        Address of the RPC's client.
+ * @server_port:  Port to which the RPC's request was sent.
+ * @client_port:  Port at @saddr from which the request was sent.
+ * @id:           Local id of the RPC.
+ *
+ * Return:   The socket that owns the RPC, or NULL if no such RPC could be
+ *           found. The caller must hold an RCU read lock while using the
+ *           result.
+ */
+struct homa_sock *homa_peer_rpc_sock(struct homa *homa,
+		const struct in6_addr *saddr, __u16 server_port,
+		__u16 client_port, __u64 id)
+{
+	struct homa_sock *result = NULL;
+	struct homa_port_group *group;
+	struct homa_peer *peer;
+	struct homa_rpc *rpc;
+
+	peer = homa_peer_lookup(&homa->peers, saddr);
+	if (!peer)
+		return NULL;
+	spin_lock_bh(&peer->rpcs_lock);
+	list_for_each_entry(rpc, &peer->rpcs, peer_links) {
+		if ((rpc->id != id) || (rpc->dport != client_port))
+			continue;
+
+		/* Group members keep their own (client) port in hsk->port;
+		 * the shared server port is only in the group.
+		 */
+		group = READ_ONCE(rpc->hsk->group);
+		if (group && (group->port == server_port)) {
+			result = rpc->hsk;
+			break;
+		}
+	}
+	spin_unlock_bh(&peer->rpcs_lock);
+	homa_peer_put(peer);
+	return result;
+}
+
 /**
  * homa_rpc_acked() - This function is invoked when an ack is received
  * for an RPC; if the RPC still exists, is freed.
@@ -433,6 +769,9 @@ void homa_rpc_acked(struct homa_sock *hsk, const struct in6_addr *saddr,
 		 */
 		rcu_read_lock();
 		hsk2 = homa_sock_find(&hsk->homa->port_map, server_port);
+		if (!hsk2)
+			hsk2 = homa_group_select(hsk->homa, server_port, saddr,
+					client_port, id, 0);
 		if (!hsk2)
 			goto done;
 	}
@@ -468,9 +807,11 @@ void homa_rpc_free(struct homa_rpc *rpc)
 
 	/* Unlink from all lists, so no-one will ever find this RPC again. */
 	homa_sock_lock(rpc->hsk, "homa_rpc_free");
-	__hlist_del(&rpc->hash_links);
+	homa_bucket_remove(rpc);
 	list_del_rcu(&rpc->active_links);
+	homa_peer_remove_rpc(rpc);
 	list_add_tail_rcu(&rpc->dead_links, &rpc->hsk->dead_rpcs);
+	list_del_init(&rpc->timer_links);
 	__list_del_entry(&rpc->ready_links);
 	__list_del_entry(&rpc->buf_links);
 	if (rpc->interest != NULL) {
@@ -504,6 +845,9 @@ void homa_rpc_free(struct homa_rpc *rpc)
 		 * missed.
 		 */
 		rpc->hsk->homa->max_dead_buffs = rpc->hsk->dead_skbs;
+	if (rpc->hsk->homa->reap_worker_skbs && (rpc->hsk->dead_skbs
+			>= rpc->hsk->homa->reap_worker_skbs))
+		homa_reap_queue(rpc->hsk);
 
 	homa_sock_unlock(rpc->hsk);
 	homa_remove_from_throttled(rpc);
@@ -635,13 +979,18 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 			 * because homa_pool_release_buffers must be called
 			 * without holding any locks.
 			 */
-			if (unlikely(rpc->msgin.num_bpages))
+			if (unlikely(rpc->msgin.num_bpages
+					> rpc->msgin.stream_bpages))
 				homa_pool_release_buffers(
 						&rpc->hsk->buffer_pool,
-						rpc->msgin.num_bpages,
-						rpc->msgin.bpage_offsets);
+						rpc->msgin.num_bpages
+						- rpc->msgin.stream_bpages,
+						rpc->msgin.bpage_offsets
+						+ rpc->msgin.stream_bpages);
+			homa_peer_put(rpc->peer);
+			kvfree(rpc->msgout.skb_index);
 			rpcs[i]->state = 0;
-			kfree(rpcs[i]);
+			homa_rpc_recycle(hsk, rpcs[i]);
 		}
 		tt_record4("reaped %d skbs, %d rpcs; %d skbs remain for port %d",
 				num_skbs, num_rpcs, hsk->dead_skbs, hsk->port);
@@ -651,6 +1000,97 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 	return result;
 }
 
+/**
+ * homa_reap_choose_core() - Pick a core on which to run background
+ * reaping: the core on our NUMA node (other than the current core) that
+ * has gone the longest without Homa activity from either SoftIRQ or
+ * applications. Offline cores are never chosen, since work queued on
+ * them would run on a different core anyway.
+ * @homa:    Overall data about the Homa protocol implementation.
+ *
+ * Return:   The chosen core (the current core if there is no other core
+ *           on its node).
+ */
+int homa_reap_choose_core(struct homa *homa)
+{
+	int this_core = raw_smp_processor_id();
+	int node = homa_cores[this_core]->numa_node;
+	__u64 oldest = ~0ULL;
+	int i, result = this_core;
+
+	for_each_online_cpu(i) {
+		struct homa_core *core = homa_cores[i];
+		__u64 busy;
+
+		if ((i == this_core) || (core->numa_node != node))
+			continue;
+		busy = core->last_active;
+		if (core->last_app_active > busy)
+			busy = core->last_app_active;
+		if (busy < oldest) {
+			oldest = busy;
+			result = i;
+		}
+	}
+	return result;
+}
+
+/**
+ * homa_reap_queue() - Arrange for a background worker to reap the dead
+ * RPCs of a socket, so that application threads and SoftIRQ don't have
+ * to. Does nothing if the socket is already queued. Can be invoked in
+ * any context.
+ * @hsk:    Socket with dead RPCs; the caller must ensure that it
+ *          won't be deleted during this call (e.g. by holding its lock).
+ */
+void homa_reap_queue(struct homa_sock *hsk)
+{
+	struct homa_core *core;
+	int cpu;
+
+	if (hsk->shutdown || atomic_xchg(&hsk->reap_queued, 1))
+		return;
+
+	/* The worker will release this reference. */
+	sock_hold(&hsk->inet.sk);
+	cpu = homa_reap_choose_core(hsk->homa);
+	core = homa_cores[cpu];
+	llist_add(&hsk->reap_node, &core->reap_socks);
+	queue_work_on(cpu, system_wq, &core->reap_work);
+	INC_METRIC(reap_worker_queues, 1);
+	tt_record2("homa_reap_queue queued port %d on core %d", hsk->port,
+			cpu);
+}
+
+/**
+ * homa_reap_work() - Top-level function for background reap workers:
+ * reaps all of the dead RPCs in each socket queued for this core.
+ * @work:    The reap_work field of a struct homa_core.
+ */
+void homa_reap_work(struct work_struct *work)
+{
+	struct homa_core *core = container_of(work, struct homa_core,
+			reap_work);
+	struct llist_node *sockets;
+	struct homa_sock *hsk, *next;
+	__u64 start = get_cycles();
+
+	sockets = llist_del_all(&core->reap_socks);
+	llist_for_each_entry_safe(hsk, next, sockets, reap_node) {
+		/* Clear the flag before reaping, so that RPCs freed from
+		 * now on will queue the socket again.
+		 */
+		atomic_set(&hsk->reap_queued, 0);
+		while (!hsk->shutdown) {
+			if (homa_rpc_reap(hsk, hsk->homa->reap_limit) == 0)
+				break;
+			cond_resched();
+		}
+		sock_put(&hsk->inet.sk);
+	}
+	INC_METRIC(reap_worker_cycles, get_cycles() - start);
+}
+
 /**
  * homa_find_client_rpc() - Locate client-side information about the RPC that
  * a packet belongs to, if there is any. Thread-safe without socket lock.
@@ -666,7 +1106,8 @@ struct homa_rpc *homa_find_client_rpc(struct homa_sock *hsk, __u64 id)
 	struct homa_rpc *crpc;
 	struct homa_rpc_bucket *bucket = homa_client_rpc_bucket(hsk, id);
 	homa_bucket_lock(bucket, client);
-	hlist_for_each_entry_rcu(crpc, &bucket->rpcs, hash_links) {
+	hlist_for_each_entry_rcu(crpc, homa_rpc_chain(bucket,
+			homa_client_rpc_hash(id)), hash_links) {
 		if (crpc->id == id) {
 			return crpc;
 		}
@@ -693,7 +1134,8 @@ struct homa_rpc *homa_find_server_rpc(struct homa_sock *hsk,
 	struct homa_rpc *srpc;
 	struct homa_rpc_bucket *bucket = homa_server_rpc_bucket(hsk, id);
 	homa_bucket_lock(bucket, server);
-	hlist_for_each_entry_rcu(srpc, &bucket->rpcs, hash_links) {
+	hlist_for_each_entry_rcu(srpc, homa_rpc_chain(bucket,
+			homa_server_rpc_hash(saddr, sport, id)), hash_links) {
 		if ((srpc->id == id) && (srpc->dport == sport) &&
 				ipv6_addr_equal(&srpc->peer->addr, saddr)) {
 			return srpc;
@@ -729,7 +1171,7 @@ void homa_rpc_log(struct homa_rpc *rpc)
 				rpc->msgout.length - rpc->msgout.next_xmit_offset,
 				rpc->msgout.granted,
 				rpc->msgin.bytes_remaining,
-				rpc->resend_timer_ticks,
+				rpc->cold->resend_timer_ticks,
 				rpc->silent_ticks);
 	} else {
 		printk(KERN_NOTICE "%s RPC %s, id %llu, peer %s:%d, "
@@ -1025,7 +1467,7 @@ char *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len)
 		if (h->retransmit)
 			used = homa_snprintf(buffer, buf_len, used,
 					", RETRANSMIT");
-		if (skb_shinfo(skb)->gso_type == 0xd)
+		if (skb_shinfo(skb)->gso_type == HOMA_GSO_SOFTWARE)
 			used = homa_snprintf(buffer, buf_len, used,
 					", TSO disabled");
 		bytes_left = skb->len - sizeof32(*h) - seg_length;
@@ -1053,10 +1495,18 @@ char *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len)
 	}
 	case RESEND: {
 		struct resend_header *h = (struct resend_header *) skb->data;
+		int i, num_extra = homa_resend_num_extra(skb);
 		used = homa_snprintf(buffer, buf_len, used,
 				", offset %d, length %d, resend_prio %u",
 				ntohl(h->offset), ntohl(h->length),
 				h->priority);
+		if (num_extra == 0)
+			break;
+		used = homa_snprintf(buffer, buf_len, used, ", extra ranges");
+		for (i = 0; i < num_extra; i++)
+			used = homa_snprintf(buffer, buf_len, used, " %d@%d",
+					ntohl(h->extra_ranges[i].length),
+					ntohl(h->extra_ranges[i].offset));
 		break;
 	}
 	case UNKNOWN:
@@ -1151,9 +1601,19 @@ char *homa_print_packet_short(struct sk_buff *skb, char *buffer, int buf_len)
 	}
 	case RESEND: {
 		struct resend_header *h = (struct resend_header *) common;
-		snprintf(buffer, buf_len, "RESEND %d-%d@%d", ntohl(h->offset),
+		int used, i;
+		used = homa_snprintf(buffer, buf_len, 0, "RESEND %d-%d@%d",
+				ntohl(h->offset),
 				ntohl(h->offset) + ntohl(h->length) - 1,
 				h->priority);
+		if (h->num_extra >= HOMA_MAX_RESEND_RANGES)
+			break;
+		for (i = 0; i < h->num_extra; i++) {
+			int offset = ntohl(h->extra_ranges[i].offset);
+			used = homa_snprintf(buffer, buf_len, used, " %d-%d",
+					offset, offset
+					+ ntohl(h->extra_ranges[i].length) - 1);
+		}
 		break;
 	}
 	case UNKNOWN:
@@ -1218,6 +1678,7 @@ void homa_freeze_peers(struct homa *homa)
 			printk(KERN_NOTICE "homa_freeze_peers got error %d "
 					"in xmit to %s\n", err,
 					homa_print_ipv6_addr(&peers[i]->addr));
+		homa_peer_put(peers[i]);
 	}
 	kfree(peers);
 }
@@ -1382,6 +1843,46 @@ void homa_append_metric(struct homa *homa, const char* format, ...)
 	homa->metrics_length += new_chars;
 }
 
+/**
+ * homa_print_latency() - Append the nonzero buckets of one core's latency
+ * histograms to homa->metrics (there are too many buckets to print them
+ * all).
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @m:       Metrics for the core whose histograms should be printed.
+ */
+static void homa_print_latency(struct homa *homa, struct homa_metrics *m)
+{
+	static const char *names[HOMA_LAT_PHASES] = {"grantable",
+			"throttled", "handoff", "copy"};
+	static const char *descriptions[HOMA_LAT_PHASES] = {
+			"in grantable list", "in throttled list",
+			"from handoff to user thread", "copying to user space"};
+	static const char *classes[HOMA_LAT_SIZE_CLASSES] = {"<= 1500",
+			"<= 15000", "<= 150000", "> 150000"};
+	char name[30];
+	int p, c, b;
+
+	for (p = 0; p < HOMA_LAT_PHASES; p++) {
+		for (c = 0; c < HOMA_LAT_SIZE_CLASSES; c++) {
+			for (b = 0; b < HOMA_LAT_BUCKETS; b++) {
+				if (m->latency[p][c][b] == 0)
+					continue;
+				snprintf(name, sizeof(name), "lat_%s_%d_%d",
+						names[p], c, b);
+				homa_append_metric(homa,
+						"%-25s %15llu  "
+						"Intervals %s of %llu-%llu cycles, "
+						"messages %s bytes\n",
+						name, m->latency[p][c][b],
+						descriptions[p],
+						b ? 1ULL << b : 0ULL,
+						(b == HOMA_LAT_BUCKETS - 1) ? ~0ULL
+						: (2ULL << b) - 1, classes[c]);
+			}
+		}
+	}
+}
+
 /**
  * homa_print_metrics() - Sample all of the Homa performance metrics and
  * generate a human-readable string describing all of them.
@@ -1503,10 +2004,25 @@ char *homa_print_metrics(struct homa *homa)
 				"RPC handoffs not to first on list (avoid busy "
 				"core)\n",
 				m->handoffs_alt_thread);
+		homa_append_metric(homa,
+				"handoffs_sticky           %15llu  "
+				"Handoffs to the thread that received the "
+				"peer's previous message\n",
+				m->handoffs_sticky);
+		homa_append_metric(homa,
+				"handoffs_cross_node       %15llu  "
+				"Handoffs to a thread on a different NUMA "
+				"node\n",
+				m->handoffs_cross_node);
 		homa_append_metric(homa,
 				"poll_cycles               %15llu  "
 				"Time spent polling for incoming messages\n",
 				m->poll_cycles);
+		homa_append_metric(homa,
+				"poll_skips                %15llu  "
+				"Waits that slept without polling (adaptive "
+				"polling)\n",
+				m->poll_skips);
 		homa_append_metric(homa,
 				"softirq_calls             %15llu  "
 				"Calls to homa_softirq (i.e. # GRO pkts "
@@ -1538,6 +2054,35 @@ char *homa_print_metrics(struct homa *homa)
 				"Total invocations of homa_sendmsg for "
 				"requests\n",
 				m->send_calls);
+		homa_append_metric(homa,
+				"send_batch_calls          %15llu  "
+				"Invocations of HOMAIOCSEND (batched sends)\n",
+				m->send_batch_calls);
+		homa_append_metric(homa,
+				"send_batch_msgs           %15llu  "
+				"Messages sent with HOMAIOCSEND\n",
+				m->send_batch_msgs);
+		homa_append_metric(homa,
+				"mcast_calls               %15llu  "
+				"Invocations of HOMAIOCMCAST (multicast sends)\n",
+				m->mcast_calls);
+		homa_append_metric(homa,
+				"mcast_rpcs                %15llu  "
+				"RPCs created by HOMAIOCMCAST\n",
+				m->mcast_rpcs);
+		homa_append_metric(homa,
+				"mcast_shared_bytes        %15llu  "
+				"Message bytes sent from pages shared by "
+				"multicast RPCs\n",
+				m->mcast_shared_bytes);
+		homa_append_metric(homa,
+				"zerocopy_msgs             %15llu  "
+				"Messages sent without copying from user space\n",
+				m->zerocopy_msgs);
+		homa_append_metric(homa,
+				"zerocopy_bytes            %15llu  "
+				"Message bytes sent from pinned user pages\n",
+				m->zerocopy_bytes);
 		// It is possible for us to get here at a time when a
 		// thread has been blocked for a long time and has
 		// recorded blocked_cycles, but hasn't finished the
@@ -1555,6 +2100,34 @@ char *homa_print_metrics(struct homa *homa)
 				"recv_calls                %15llu  "
 				"Total invocations of recvmsg kernel call\n",
 				m->recv_calls);
+		homa_append_metric(homa,
+				"recv_batch_calls          %15llu  "
+				"Invocations of recvmsg that used batching\n",
+				m->recv_batch_calls);
+		homa_append_metric(homa,
+				"recv_batch_msgs           %15llu  "
+				"Messages returned by batched recvmsg calls\n",
+				m->recv_batch_msgs);
+		homa_append_metric(homa,
+				"ring_enter_calls          %15llu  "
+				"Invocations of HOMAIOCRING\n",
+				m->ring_enter_calls);
+		homa_append_metric(homa,
+				"ring_sqes                 %15llu  "
+				"Submission ring entries consumed\n",
+				m->ring_sqes);
+		homa_append_metric(homa,
+				"ring_cqes                 %15llu  "
+				"Incoming messages posted to completion rings\n",
+				m->ring_cqes);
+		homa_append_metric(homa,
+				"ring_sleeps               %15llu  "
+				"Times a ring polling thread went to sleep\n",
+				m->ring_sleeps);
+		homa_append_metric(homa,
+				"ring_wakeups              %15llu  "
+				"Times a sleeping ring polling thread was woken\n",
+				m->ring_wakeups);
 		homa_append_metric(homa,
 				"blocked_cycles            %15llu  "
 				"Time spent blocked in homa_recvmsg\n",
@@ -1584,10 +2157,27 @@ char *homa_print_metrics(struct homa *homa)
 				"so_set_buf_calls          %15llu  "
 				"Total invocations of setsockopt SO_HOMA_SET_BUF\n",
 				m->so_set_buf_calls);
+		homa_append_metric(homa,
+				"so_set_buf_hugepages      %15llu  "
+				"SO_HOMA_SET_BUF regions backed by huge pages\n",
+				m->so_set_buf_hugepages);
 		homa_append_metric(homa,
 				"grant_cycles              %15llu  "
 				"Time spent sending grants\n",
 				m->grant_cycles);
+		homa_append_metric(homa,
+				"grant_recalc_skips        %15llu  "
+				"Grant computations left to another core\n",
+				m->grant_recalc_skips);
+		homa_append_metric(homa,
+				"grant_recalc_retries      %15llu  "
+				"Grant computations repeated for other cores\n",
+				m->grant_recalc_retries);
+		homa_append_metric(homa,
+				"grant_recalc_limits       %15llu  "
+				"Grant computations left pending after "
+				"too many repeats\n",
+				m->grant_recalc_limits);
 		homa_append_metric(homa,
 				"timer_cycles              %15llu  "
 				"Time spent in homa_timer\n",
@@ -1596,6 +2186,10 @@ char *homa_print_metrics(struct homa *homa)
 				"timer_reap_cycles         %15llu  "
 				"Time in homa_timer spent reaping RPCs\n",
 				m->timer_reap_cycles);
+		homa_append_metric(homa,
+				"timer_rpc_checks          %15llu  "
+				"RPCs checked by homa_timer\n",
+				m->timer_rpc_checks);
 		homa_append_metric(homa,
 				"data_pkt_reap_cycles      %15llu  "
 				"Time in homa_data_pkt spent reaping RPCs\n",
@@ -1624,6 +2218,11 @@ char *homa_print_metrics(struct homa *homa)
 				"pacer_skipped_rpcs        %15llu  "
 				"Pacer aborts because of locked RPCs\n",
 				m->pacer_skipped_rpcs);
+		homa_append_metric(homa,
+				"pacer_share_checks        %15llu  "
+				"Throttled RPCs examined for weighted "
+				"pacing\n",
+				m->pacer_share_checks);
 		homa_append_metric(homa,
 				"pacer_needed_help         %15llu  "
 				"homa_pacer_xmit invocations from "
@@ -1637,6 +2236,29 @@ char *homa_print_metrics(struct homa *homa)
 				"resent_packets            %15llu  "
 				"DATA packets sent in response to RESENDs\n",
 				m->resent_packets);
+		homa_append_metric(homa,
+				"resent_clones             %15llu  "
+				"Whole packets resent as clones rather than "
+				"copies\n",
+				m->resent_clones);
+		homa_append_metric(homa,
+				"tso_skbs                  %15llu  "
+				"Multi-segment DATA skbs segmented by "
+				"the NIC\n",
+				m->tso_skbs);
+		homa_append_metric(homa,
+				"gso_software_skbs         %15llu  "
+				"Multi-segment DATA skbs segmented in "
+				"software\n",
+				m->gso_software_skbs);
+		homa_append_metric(homa,
+				"udp_packets_sent          %15llu  "
+				"Packets sent encapsulated in UDP\n",
+				m->udp_packets_sent);
+		homa_append_metric(homa,
+				"udp_packets_received      %15llu  "
+				"UDP-encapsulated packets received\n",
+				m->udp_packets_received);
 		homa_append_metric(homa,
 				"peer_hash_links           %15llu  "
 				"Hash chain link traversals in peer table\n",
@@ -1645,6 +2267,14 @@ char *homa_print_metrics(struct homa *homa)
 				"peer_new_entries          %15llu  "
 				"New entries created in peer table\n",
 				m->peer_new_entries);
+		homa_append_metric(homa,
+				"peertab_resizes           %15llu  "
+				"Peer table bucket arrays replaced by larger ones\n",
+				m->peertab_resizes);
+		homa_append_metric(homa,
+				"peer_evictions            %15llu  "
+				"Idle peers removed from peer table\n",
+				m->peer_evictions);
 		homa_append_metric(homa,
 				"peer_kmalloc_errors       %15llu  "
 				"kmalloc failures creating peer table "
@@ -1663,6 +2293,10 @@ char *homa_print_metrics(struct homa *homa)
 				"data_xmit_errors          %15llu  "
 				"Errors sending data packets\n",
 				m->data_xmit_errors);
+		homa_append_metric(homa,
+				"xmit_batches              %15llu  "
+				"Batches of data packets passed to IP layer\n",
+				m->xmit_batches);
 		homa_append_metric(homa,
 				"unknown_rpcs              %15llu  "
 				"Non-grant packets discarded because RPC unknown\n",
@@ -1699,6 +2333,15 @@ char *homa_print_metrics(struct homa *homa)
 				"peer_timeouts             %15llu  "
 				"Peers found to be nonresponsive\n",
 				m->peer_timeouts);
+		homa_append_metric(homa,
+				"freeze_triggers           %15llu  "
+				"Timetrace freezes from automatic triggers\n",
+				m->freeze_triggers);
+		homa_append_metric(homa,
+				"auto_cutoff_updates       %15llu  "
+				"Times unsched_cutoffs were recomputed "
+				"automatically\n",
+				m->auto_cutoff_updates);
 		homa_append_metric(homa,
 				"server_rpc_discards       %15llu  "
 				"RPCs aborted by server because of timeouts\n",
@@ -1724,6 +2367,10 @@ char *homa_print_metrics(struct homa *homa)
 				"server_lock_miss_cycles   %15llu  "
 				"Time lost waiting for server bucket locks\n",
 				m->server_lock_miss_cycles);
+		homa_append_metric(homa,
+				"rpc_bucket_resizes        %15llu  "
+				"RPC bucket chain arrays grown or shrunk\n",
+				m->rpc_bucket_resizes);
 		homa_append_metric(homa,
 				"socket_lock_misses        %15llu  "
 				"Socket lock misses\n",
@@ -1732,6 +2379,14 @@ char *homa_print_metrics(struct homa *homa)
 				"socket_lock_miss_cycles   %15llu  "
 				"Time lost waiting for socket locks\n",
 				m->socket_lock_miss_cycles);
+		homa_append_metric(homa,
+				"socket_cache_hits         %15llu  "
+				"Socket lookups satisfied by per-core cache\n",
+				m->socket_cache_hits);
+		homa_append_metric(homa,
+				"group_lookups             %15llu  "
+				"Sockets chosen from port groups\n",
+				m->group_lookups);
 		homa_append_metric(homa,
 				"throttle_lock_misses      %15llu  "
 				"Throttle lock misses\n",
@@ -1777,6 +2432,22 @@ char *homa_print_metrics(struct homa *homa)
 				"forced_reaps              %15llu  "
 				"Reaps forced by accumulation of dead RPCs\n",
 				m->forced_reaps);
+		homa_append_metric(homa,
+				"reap_worker_queues        %15llu  "
+				"Sockets handed to background reap workers\n",
+				m->reap_worker_queues);
+		homa_append_metric(homa,
+				"reap_worker_cycles        %15llu  "
+				"Time spent in background reap workers\n",
+				m->reap_worker_cycles);
+		homa_append_metric(homa,
+				"rpc_cache_hits            %15llu  "
+				"RPC structs reused from a socket's cache\n",
+				m->rpc_cache_hits);
+		homa_append_metric(homa,
+				"rpc_cache_misses          %15llu  "
+				"RPC structs allocated with kmalloc\n",
+				m->rpc_cache_misses);
 		homa_append_metric(homa,
 				"throttle_list_adds        %15llu  "
 				"Calls to homa_add_to_throttled\n",
@@ -1799,11 +2470,99 @@ char *homa_print_metrics(struct homa *homa)
 				"FIFO grants to messages with no "
 				"outstanding grants\n",
 				m->fifo_grants_no_incoming);
+		homa_append_metric(homa,
+				"cong_ecn_marks            %15llu  "
+				"Incoming data packets with ECN CE marks\n",
+				m->cong_ecn_marks);
+		homa_append_metric(homa,
+				"cong_resend_signals       %15llu  "
+				"RESENDs for missing data treated as "
+				"congestion signals\n",
+				m->cong_resend_signals);
+		homa_append_metric(homa,
+				"cong_level_increases      %15llu  "
+				"Times a peer's congestion level was "
+				"raised\n",
+				m->cong_level_increases);
+		homa_append_metric(homa,
+				"cong_level_decreases      %15llu  "
+				"Times a peer's congestion level decayed\n",
+				m->cong_level_decreases);
+		homa_append_metric(homa,
+				"cong_limited_bytes        %15llu  "
+				"Grant bytes withheld because of peer "
+				"congestion\n",
+				m->cong_limited_bytes);
+		homa_append_metric(homa,
+				"cong_limited_rpcs         %15llu  "
+				"Times fewer RPCs were granted to a peer "
+				"because of congestion\n",
+				m->cong_limited_rpcs);
+		homa_append_metric(homa,
+				"grant_no_bufs_skips       %15llu  "
+				"RPCs not granted because they had no "
+				"buffer space\n",
+				m->grant_no_bufs_skips);
+		homa_append_metric(homa,
+				"share_limited_rpcs        %15llu  "
+				"RPCs not granted because their socket had "
+				"its weighted share\n",
+				m->share_limited_rpcs);
+		homa_append_metric(homa,
+				"policy_order_calls        %15llu  "
+				"Invocations of the grantable_before "
+				"policy hook\n",
+				m->policy_order_calls);
+		homa_append_metric(homa,
+				"policy_order_cycles       %15llu  "
+				"Time spent in the grantable_before "
+				"policy hook\n",
+				m->policy_order_cycles);
+		homa_append_metric(homa,
+				"policy_unsched_calls      %15llu  "
+				"Invocations of the unsched_priority "
+				"policy hook\n",
+				m->policy_unsched_calls);
+		homa_append_metric(homa,
+				"policy_unsched_cycles     %15llu  "
+				"Time spent in the unsched_priority "
+				"policy hook\n",
+				m->policy_unsched_cycles);
+		homa_append_metric(homa,
+				"policy_grant_calls        %15llu  "
+				"Invocations of the grant_priority "
+				"policy hook\n",
+				m->policy_grant_calls);
+		homa_append_metric(homa,
+				"policy_grant_cycles       %15llu  "
+				"Time spent in the grant_priority "
+				"policy hook\n",
+				m->policy_grant_cycles);
+		homa_append_metric(homa,
+				"policy_fifo_calls         %15llu  "
+				"Invocations of the fifo_key "
+				"policy hook\n",
+				m->policy_fifo_calls);
+		homa_append_metric(homa,
+				"policy_fifo_cycles        %15llu  "
+				"Time spent in the fifo_key "
+				"policy hook\n",
+				m->policy_fifo_cycles);
 		homa_append_metric(homa,
 				"ack_overflows             %15llu  "
 				"Explicit ACKs sent because peer->acks was "
 				"full\n",
 				m->ack_overflows);
+		homa_append_metric(homa,
+				"acks_piggybacked          %15llu  "
+				"Acks carried in GRANT, RESEND, and BUSY "
+				"packets\n",
+				m->acks_piggybacked);
+		homa_append_metric(homa,
+				"ack_flushes               %15llu  "
+				"ACK packets sent because acks waited too "
+				"long\n",
+				m->ack_flushes);
 		homa_append_metric(homa,
 				"ignored_need_acks         %15llu  "
 				"NEED_ACKs ignored because RPC result not "
@@ -1814,6 +2573,26 @@ char *homa_print_metrics(struct homa *homa)
 				"Buffer page could be reused because ref "
 				"count was zero\n",
 				m->bpage_reuses);
+		homa_append_metric(homa,
+				"bpage_steals              %15llu  "
+				"Free buffer pages taken from another core's "
+				"free stack\n",
+				m->bpage_steals);
+		homa_append_metric(homa,
+				"bpage_remote_refills      %15llu  "
+				"Core free stacks refilled from a remote NUMA "
+				"node\n",
+				m->bpage_remote_refills);
+		homa_append_metric(homa,
+				"extent_allocs             %15llu  "
+				"Incoming messages given a contiguous extent of "
+				"buffer pages\n",
+				m->extent_allocs);
+		homa_append_metric(homa,
+				"softirq_copy_bytes        %15llu  "
+				"Incoming message bytes copied to user space "
+				"during SoftIRQ\n",
+				m->softirq_copy_bytes);
 		homa_append_metric(homa,
 				"buffer_alloc_failures     %15llu  "
 				"homa_pool_allocate didn't find enough buffer "
@@ -1837,16 +2616,27 @@ char *homa_print_metrics(struct homa *homa)
 				"Gen3 handoffs to secondary core (primary was "
 				"busy)\n",
 				m->gen3_alt_handoffs);
+		homa_append_metric(homa,
+				"gro_steered              %15llu  "
+				"GRO->SoftIRQ handoffs steered toward the "
+				"receiving thread\n",
+				m->gro_steered);
 		homa_append_metric(homa,
 				"gro_grant_bypasses       %15llu  "
 				"Grant packets passed directly to homa_softirq "
 				"by homa_gro_receive\n",
 				m->gro_grant_bypasses);
+		homa_append_metric(homa,
+				"gro_grant_merges         %15llu  "
+				"Grant packets merged into earlier grants "
+				"by homa_gro_receive\n",
+				m->gro_grant_merges);
 		homa_append_metric(homa,
 				"gro_data_bypasses        %15llu  "
 				"Data packets passed directly to homa_softirq "
 				"by homa_gro_receive\n",
 				m->gro_data_bypasses);
+		homa_print_latency(homa, m);
 		for (i = 0; i < NUM_TEMP_METRICS;  i++)
 			homa_append_metric(homa,
 					"temp%-2d                  %15llu  "
@@ -1857,6 +2647,182 @@ char *homa_print_metrics(struct homa *homa)
 	return homa->metrics;
 }
 
+/* Describes one field of struct homa_metrics for the schema in
+ * /proc/net/homa_metrics_bin.
+ */
+#define HOMA_METRIC(field) {#field, offsetof(struct homa_metrics, field), \
+	sizeof(((struct homa_metrics *) 0)->field)/sizeof(__u64)}
+
+/**
+ * homa_metrics_schema - Describes the layout of struct homa_metrics, in
+ * order of increasing offset, for readers of /proc/net/homa_metrics_bin.
+ * Every field of struct homa_metrics must appear here.
+ */
+const struct homa_metrics_field homa_metrics_schema[] = {
+	HOMA_METRIC(small_msg_bytes),
+	HOMA_METRIC(medium_msg_bytes),
+	HOMA_METRIC(large_msg_count),
+	HOMA_METRIC(large_msg_bytes),
+	HOMA_METRIC(sent_msg_bytes),
+	HOMA_METRIC(packets_sent),
+	HOMA_METRIC(packets_received),
+	HOMA_METRIC(priority_bytes),
+	HOMA_METRIC(priority_packets),
+	HOMA_METRIC(requests_received),
+	HOMA_METRIC(requests_queued),
+	HOMA_METRIC(responses_received),
+	HOMA_METRIC(responses_queued),
+	HOMA_METRIC(fast_wakeups),
+	HOMA_METRIC(slow_wakeups),
+	HOMA_METRIC(handoffs_thread_waiting),
+	HOMA_METRIC(handoffs_alt_thread),
+	HOMA_METRIC(handoffs_sticky),
+	HOMA_METRIC(handoffs_cross_node),
+	HOMA_METRIC(poll_cycles),
+	HOMA_METRIC(poll_skips),
+	HOMA_METRIC(softirq_calls),
+	HOMA_METRIC(softirq_cycles),
+	HOMA_METRIC(bypass_softirq_cycles),
+	HOMA_METRIC(linux_softirq_cycles),
+	HOMA_METRIC(napi_cycles),
+	HOMA_METRIC(send_cycles),
+	HOMA_METRIC(send_calls),
+	HOMA_METRIC(send_batch_calls),
+	HOMA_METRIC(send_batch_msgs),
+	HOMA_METRIC(mcast_calls),
+	HOMA_METRIC(mcast_rpcs),
+	HOMA_METRIC(mcast_shared_bytes),
+	HOMA_METRIC(zerocopy_msgs),
+	HOMA_METRIC(zerocopy_bytes),
+	HOMA_METRIC(recv_cycles),
+	HOMA_METRIC(recv_calls),
+	HOMA_METRIC(recv_batch_calls),
+	HOMA_METRIC(recv_batch_msgs),
+	HOMA_METRIC(ring_enter_calls),
+	HOMA_METRIC(ring_sqes),
+	HOMA_METRIC(ring_cqes),
+	HOMA_METRIC(ring_sleeps),
+	HOMA_METRIC(ring_wakeups),
+	HOMA_METRIC(blocked_cycles),
+	HOMA_METRIC(reply_cycles),
+	HOMA_METRIC(reply_calls),
+	HOMA_METRIC(abort_cycles),
+	HOMA_METRIC(abort_calls),
+	HOMA_METRIC(so_set_buf_cycles),
+	HOMA_METRIC(so_set_buf_calls),
+	HOMA_METRIC(so_set_buf_hugepages),
+	HOMA_METRIC(grant_cycles),
+	HOMA_METRIC(grant_recalc_skips),
+	HOMA_METRIC(grant_recalc_retries),
+	HOMA_METRIC(grant_recalc_limits),
+	HOMA_METRIC(timer_cycles),
+	HOMA_METRIC(timer_reap_cycles),
+	HOMA_METRIC(timer_rpc_checks),
+	HOMA_METRIC(data_pkt_reap_cycles),
+	HOMA_METRIC(pacer_cycles),
+	HOMA_METRIC(pacer_lost_cycles),
+	HOMA_METRIC(pacer_bytes),
+	HOMA_METRIC(pacer_skipped_rpcs),
+	HOMA_METRIC(pacer_share_checks),
+	HOMA_METRIC(pacer_needed_help),
+	HOMA_METRIC(throttled_cycles),
+	HOMA_METRIC(resent_packets),
+	HOMA_METRIC(resent_clones),
+	HOMA_METRIC(tso_skbs),
+	HOMA_METRIC(gso_software_skbs),
+	HOMA_METRIC(udp_packets_sent),
+	HOMA_METRIC(udp_packets_received),
+	HOMA_METRIC(peer_hash_links),
+	HOMA_METRIC(peer_new_entries),
+	HOMA_METRIC(peertab_resizes),
+	HOMA_METRIC(peer_evictions),
+	HOMA_METRIC(peer_kmalloc_errors),
+	HOMA_METRIC(peer_route_errors),
+	HOMA_METRIC(control_xmit_errors),
+	HOMA_METRIC(data_xmit_errors),
+	HOMA_METRIC(xmit_batches),
+	HOMA_METRIC(unknown_rpcs),
+	HOMA_METRIC(server_cant_create_rpcs),
+	HOMA_METRIC(unknown_packet_types),
+	HOMA_METRIC(short_packets),
+	HOMA_METRIC(packet_discards),
+	HOMA_METRIC(resent_discards),
+	HOMA_METRIC(resent_packets_used),
+	HOMA_METRIC(peer_timeouts),
+	HOMA_METRIC(freeze_triggers),
+	HOMA_METRIC(auto_cutoff_updates),
+	HOMA_METRIC(server_rpc_discards),
+	HOMA_METRIC(server_rpcs_unknown),
+	HOMA_METRIC(client_lock_misses),
+	HOMA_METRIC(client_lock_miss_cycles),
+	HOMA_METRIC(server_lock_misses),
+	HOMA_METRIC(server_lock_miss_cycles),
+	HOMA_METRIC(rpc_bucket_resizes),
+	HOMA_METRIC(socket_lock_miss_cycles),
+	HOMA_METRIC(socket_cache_hits),
+	HOMA_METRIC(group_lookups),
+	HOMA_METRIC(socket_lock_misses),
+	HOMA_METRIC(throttle_lock_miss_cycles),
+	HOMA_METRIC(throttle_lock_misses),
+	HOMA_METRIC(grantable_lock_miss_cycles),
+	HOMA_METRIC(grantable_lock_misses),
+	HOMA_METRIC(peer_ack_lock_miss_cycles),
+	HOMA_METRIC(peer_ack_lock_misses),
+	HOMA_METRIC(disabled_reaps),
+	HOMA_METRIC(disabled_rpc_reaps),
+	HOMA_METRIC(reaper_calls),
+	HOMA_METRIC(reaper_dead_skbs),
+	HOMA_METRIC(forced_reaps),
+	HOMA_METRIC(reap_worker_queues),
+	HOMA_METRIC(reap_worker_cycles),
+	HOMA_METRIC(rpc_cache_hits),
+	HOMA_METRIC(rpc_cache_misses),
+	HOMA_METRIC(throttle_list_adds),
+	HOMA_METRIC(throttle_list_checks),
+	HOMA_METRIC(grantable_rpcs_integral),
+	HOMA_METRIC(fifo_grants),
+	HOMA_METRIC(fifo_grants_no_incoming),
+	HOMA_METRIC(cong_ecn_marks),
+	HOMA_METRIC(cong_resend_signals),
+	HOMA_METRIC(cong_level_increases),
+	HOMA_METRIC(cong_level_decreases),
+	HOMA_METRIC(cong_limited_bytes),
+	HOMA_METRIC(cong_limited_rpcs),
+	HOMA_METRIC(grant_no_bufs_skips),
+	HOMA_METRIC(share_limited_rpcs),
+	HOMA_METRIC(policy_order_calls),
+	HOMA_METRIC(policy_order_cycles),
+	HOMA_METRIC(policy_unsched_calls),
+	HOMA_METRIC(policy_unsched_cycles),
+	HOMA_METRIC(policy_grant_calls),
+	HOMA_METRIC(policy_grant_cycles),
+	HOMA_METRIC(policy_fifo_calls),
+	HOMA_METRIC(policy_fifo_cycles),
+	HOMA_METRIC(ack_overflows),
+	HOMA_METRIC(acks_piggybacked),
+	HOMA_METRIC(ack_flushes),
+	HOMA_METRIC(ignored_need_acks),
+	HOMA_METRIC(bpage_reuses),
+	HOMA_METRIC(bpage_steals),
+	HOMA_METRIC(bpage_remote_refills),
+	HOMA_METRIC(extent_allocs),
+	HOMA_METRIC(softirq_copy_bytes),
+	HOMA_METRIC(buffer_alloc_failures),
+	HOMA_METRIC(linux_pkt_alloc_bytes),
+	HOMA_METRIC(dropped_data_no_bufs),
+	HOMA_METRIC(gen3_handoffs),
+	HOMA_METRIC(gen3_alt_handoffs),
+	HOMA_METRIC(gro_steered),
+	HOMA_METRIC(gro_grant_bypasses),
+	HOMA_METRIC(gro_grant_merges),
+	HOMA_METRIC(gro_data_bypasses),
+	HOMA_METRIC(latency),
+	HOMA_METRIC(temp),
+};
+
+/** @homa_metrics_schema_length: Number of entries in homa_metrics_schema. */
+const int homa_metrics_schema_length = ARRAY_SIZE(homa_metrics_schema);
+
 /**
  * homa_prios_changed() - This function is called whenever configuration
  * information related to priorities, such as @homa->unsched_cutoffs or
@@ -1895,6 +2861,184 @@ void homa_prios_changed(struct homa *homa)
 	homa->cutoff_version++;
 }
 
+/**
+ * homa_cutoff_bucket_size() - Returns the largest message size counted
+ * in a given entry of homa_cutoff_state.bytes.
+ * @bucket:  Index of the entry: values less than HOMA_NUM_SMALL_COUNTS
+ *           refer to small_msg_bytes, larger values to medium_msg_bytes.
+ * Return:   See above.
+ */
+static inline int homa_cutoff_bucket_size(int bucket)
+{
+	if (bucket < HOMA_NUM_SMALL_COUNTS)
+		return 64*(bucket + 1);
+	return 1024*(bucket - HOMA_NUM_SMALL_COUNTS + 1);
+}
+
+/**
+ * homa_auto_cutoffs() - Invoked periodically by homa_timer when
+ * homa->auto_cutoffs is nonzero. It examines the sizes of the messages
+ * received since the last computation (using the per-core message-size
+ * histograms that homa_message_in_init records in homa_metrics) and
+ * chooses unsched_cutoffs so that unscheduled bytes are divided evenly
+ * among the unscheduled priority levels; this is the same algorithm as
+ * util/homa_prio. New cutoffs are installed only if they differ enough
+ * from the current ones (see homa->auto_cutoffs_drift); peers learn about
+ * them through the normal CUTOFFS mechanism.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_auto_cutoffs(struct homa *homa)
+{
+	struct homa_cutoff_state *state = &homa->cutoff_state;
+	__u64 total_bytes, total_unsched, total_msgs, large_count, large_bytes;
+	__u64 bytes_per_prio, next_cutoff_bytes, cum_unsched;
+	int cutoffs[HOMA_MAX_PRIORITIES];
+	int num_prios = homa->num_priorities;
+	int i, core, unsched_prios, next_cutoff, prev_size, changed;
+
+	if (num_prios < 2)
+		return;
+
+	/* Collect the traffic since the last computation. */
+	total_bytes = 0;
+	total_msgs = 0;
+	prev_size = 0;
+	for (i = 0; i < HOMA_CUTOFF_BUCKETS; i++) {
+		__u64 sum = 0;
+		int size;
+
+		for (core = 0; core < nr_cpu_ids; core++) {
+			struct homa_metrics *m = &homa_cores[core]->metrics;
+
+			if (i < HOMA_NUM_SMALL_COUNTS)
+				sum += m->small_msg_bytes[i];
+			else
+				sum += m->medium_msg_bytes[i
+						- HOMA_NUM_SMALL_COUNTS];
+		}
+		state->bytes[i] = sum - state->prev_bytes[i];
+		size = homa_cutoff_bucket_size(i);
+		if (size <= prev_size)
+			continue;
+		total_bytes += state->bytes[i];
+		total_msgs += (2*state->bytes[i])/(size + prev_size);
+		prev_size = size;
+	}
+	large_count = 0;
+	large_bytes = 0;
+	for (core = 0; core < nr_cpu_ids; core++) {
+		large_count += homa_cores[core]->metrics.large_msg_count;
+		large_bytes += homa_cores[core]->metrics.large_msg_bytes;
+	}
+	large_count -= state->prev_large_count;
+	large_bytes -= state->prev_large_bytes;
+	total_msgs += large_count;
+	total_bytes += large_bytes;
+	if ((total_msgs < homa->auto_cutoffs_min_msgs) || (total_bytes == 0))
+		return;
+	for (i = 0; i < HOMA_CUTOFF_BUCKETS; i++)
+		state->prev_bytes[i] += state->bytes[i];
+	state->prev_large_count += large_count;
+	state->prev_large_bytes += large_bytes;
+
+	/* Convert the byte counts to unscheduled bytes. */
+	total_unsched = 0;
+	prev_size = 0;
+	for (i = 0; i < HOMA_CUTOFF_BUCKETS; i++) {
+		int size = homa_cutoff_bucket_size(i);
+
+		if (size <= prev_size) {
+			state->bytes[i] = 0;
+			continue;
+		}
+		if (size > homa->unsched_bytes) {
+			__u64 unsched = ((2*state->bytes[i])/(size + prev_size))
+					* homa->unsched_bytes;
+
+			if (unsched < state->bytes[i])
+				state->bytes[i] = unsched;
+		}
+		total_unsched += state->bytes[i];
+		prev_size = size;
+	}
+	total_unsched += large_count * homa->unsched_bytes;
+	if (total_unsched > total_bytes)
+		total_unsched = total_bytes;
+
+	/* Divide the priorities between scheduled and unscheduled packets
+	 * in proportion to the bytes of each.
+	 */
+	unsched_prios = (num_prios*total_unsched + total_bytes/2)/total_bytes;
+	if (unsched_prios < 1)
+		unsched_prios = 1;
+	if (unsched_prios > num_prios)
+		unsched_prios = num_prios;
+
+	/* Choose cutoffs that give each unscheduled priority an equal
+	 * share of unscheduled bytes.
+	 */
+	if (unsched_prios < num_prios)
+		bytes_per_prio = 1 + total_unsched/unsched_prios;
+	else
+		bytes_per_prio = 1 + total_bytes/num_prios;
+	next_cutoff_bytes = bytes_per_prio;
+	next_cutoff = num_prios - 1;
+	cum_unsched = 0;
+	for (i = 0; i < HOMA_CUTOFF_BUCKETS; i++) {
+		if (state->bytes[i] == 0)
+			continue;
+		cum_unsched += state->bytes[i];
+		if (cum_unsched >= total_unsched)
+			break;
+		if (cum_unsched >= next_cutoff_bytes) {
+			cutoffs[next_cutoff] = homa_cutoff_bucket_size(i);
+			next_cutoff--;
+			next_cutoff_bytes = cum_unsched + bytes_per_prio;
+			if ((next_cutoff_bytes >= total_unsched)
+					|| (next_cutoff == 0))
+				break;
+		}
+	}
+	for ( ; next_cutoff >= 0; next_cutoff--)
+		cutoffs[next_cutoff] = HOMA_MAX_MESSAGE_LENGTH;
+	for (i = num_prios; i < HOMA_MAX_PRIORITIES; i++)
+		cutoffs[i] = 0;
+
+	/* Install the new cutoffs only if they are significantly
+	 * different from the current ones.
+	 */
+	changed = 0;
+	for (i = 1; i < num_prios; i++) {
+		int old_cutoff = homa->unsched_cutoffs[i];
+		int new_cutoff = cutoffs[i];
+
+		if ((old_cutoff >= HOMA_MAX_MESSAGE_LENGTH)
+				!= (new_cutoff >= HOMA_MAX_MESSAGE_LENGTH)) {
+			changed = 1;
+			break;
+		}
+		if (new_cutoff >= HOMA_MAX_MESSAGE_LENGTH)
+			continue;
+		if ((100*(__u64) abs(new_cutoff - old_cutoff))
+				> ((__u64) homa->auto_cutoffs_drift
+				* old_cutoff)) {
+			changed = 1;
+			break;
+		}
+	}
+	if (!changed)
+		return;
+	for (i = 0; i < HOMA_MAX_PRIORITIES; i++)
+		homa->unsched_cutoffs[i] = cutoffs[i];
+	homa_prios_changed(homa);
+	INC_METRIC(auto_cutoff_updates, 1);
+	if (homa->verbose)
+		printk(KERN_NOTICE "Homa installed new unsched_cutoffs: "
+				"%d %d %d %d %d %d %d %d\n",
+				cutoffs[0], cutoffs[1], cutoffs[2], cutoffs[3],
+				cutoffs[4], cutoffs[5], cutoffs[6], cutoffs[7]);
+}
+
 /**
  * homa_spin() - Delay (without sleeping) for a given time interval.
  * @usecs:   How long to delay (in microseconds)
@@ -1943,13 +3087,13 @@ void homa_grantable_lock_slow(struct homa *homa)
  * acquiring the throttle lock. It is invoked when the lock isn't immediately
  * available. It waits for the lock, but also records statistics about
  * the waiting time.
- * @homa:    Overall data about the Homa protocol implementation.
+ * @pacer:   Pacer whose throttle lock is desired.
  */
-void homa_throttle_lock_slow(struct homa *homa)
+void homa_throttle_lock_slow(struct homa_pacer *pacer)
 {
 	__u64 start = get_cycles();
 	tt_record("beginning wait for throttle lock");
-	spin_lock_bh(&homa->throttle_lock);
+	spin_lock_bh(&pacer->throttle_lock);
 	tt_record("ending wait for throttle lock");
 	INC_METRIC(throttle_lock_misses, 1);
 	INC_METRIC(throttle_lock_miss_cycles, get_cycles() - start);
@@ -1983,3 +3127,50 @@ void homa_freeze(struct homa_rpc *rpc, enum homa_freeze_type type, char *format)
 		homa_freeze_peers(rpc->hsk->homa);
 	}
 }
+
+/**
+ * homa_freeze_trigger() - Invoked when one of the automatic freeze
+ * conditions (configured with the freeze_* sysctls) has occurred: freezes
+ * the local timetrace immediately and arranges for all peers to be frozen
+ * at the next timer tick. Does nothing if the timetrace is already frozen.
+ * Safe to call in any context, including with spinlocks held.
+ * @homa:     Overall data about the Homa protocol implementation.
+ * @type:     Condition that caused the freeze (for logging).
+ * @format:   Format string for a time trace record describing the
+ *            reason for the freeze; must be a string literal with at
+ *            most 2 arguments.
+ * @arg0:     First argument for @format.
+ * @arg1:     Second argument for @format.
+ */
+void homa_freeze_trigger(struct homa *homa, enum homa_freeze_type type,
+		char *format, int arg0, int arg1)
+{
+	if (tt_frozen)
+		return;
+	tt_record2(format, arg0, arg1);
+	tt_freeze();
+	INC_METRIC(freeze_triggers, 1);
+	homa->freeze_peers_pending = 1;
+	printk(KERN_NOTICE "Homa freeze trigger %d fired\n", type);
+}
+
+/**
+ * homa_freeze_check_slow() - Invoked when a client RPC completes; freezes
+ * timetraces if the RPC took much longer than expected for its size
+ * (see @freeze_slow_factor in struct homa).
+ * @rpc:      RPC that just completed; its response must have been received.
+ */
+void homa_freeze_check_slow(struct homa_rpc *rpc)
+{
+	struct homa *homa = rpc->hsk->homa;
+	__u64 elapsed, expected;
+
+	elapsed = get_cycles() - rpc->cold->start_cycles;
+	expected = ((__u64) homa->freeze_slow_base_usecs * cpu_khz)/1000
+			+ (((__u64) rpc->msgout.length + rpc->msgin.length)
+			* homa->cycles_per_kbyte)/1000;
+	if (elapsed <= expected * homa->freeze_slow_factor)
+		return;
+	homa_freeze_trigger(homa, SLOW_FOR_SIZE, "Freezing because RPC id %d "
+			"took %d usecs", rpc->id, (elapsed * 1000)/cpu_khz);
+}
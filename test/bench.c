@@ -0,0 +1,528 @@
+/* Copyright (c) 2023 Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Main program for Homa microbenchmarks. These drive individual hot-path
+ * functions directly with synthetic populations of RPCs and packets,
+ * using the same mock layer as the unit tests, and report the time per
+ * operation. Absolute numbers include the overheads of the mock layer
+ * (e.g. locks become function calls), so they are mostly useful for
+ * comparing one version of Homa against another on the same machine.
+ */
+
+#include "homa_impl.h"
+#define KSELFTEST_NOT_MAIN 1
+#include "kselftest_harness.h"
+#include "ccutils.h"
+#include "mock.h"
+#include "utils.h"
+
+/* It isn't safe to include system header files such as time.h or
+ * unistd.h (they conflict with kernel headers), so declare the few
+ * C library functions that are needed here.
+ */
+struct bench_timespec {
+	long tv_sec;
+	long tv_nsec;
+};
+extern int       atoi(const char *s);
+extern int       clock_gettime(int clock_id, struct bench_timespec *tp);
+extern int       close(int fd);
+extern int       fork(void);
+extern int       pipe(int fds[2]);
+extern ssize_t   read(int fd, void *buf, size_t count);
+extern int       waitpid(int pid, int *status, int options);
+extern ssize_t   write(int fd, const void *buf, size_t count);
+extern void      _exit(int status);
+
+extern struct homa *homa;
+
+/* Storage normally provided by main.c (kselftest_harness.h); the mock
+ * layer reports errors by marking __current_test as failed.
+ */
+struct __test_metadata *__test_list;
+struct __test_metadata *__current_test;
+unsigned int __test_count;
+unsigned int __fixture_count;
+int __constructor_order;
+
+static struct __test_metadata bench_metadata = {.name = "bench"};
+
+/**
+ * struct benchmark - Describes one microbenchmark.
+ */
+struct benchmark {
+	/** @name: Used to select the benchmark on the command line. */
+	const char *name;
+
+	/**
+	 * @param_name: Describes the meaning of the values in @params
+	 * (used when printing results).
+	 */
+	const char *param_name;
+
+	/**
+	 * @run: Function that runs the benchmark; its arguments are a value
+	 * from @params and the number of operations to time, and it returns
+	 * the average time per operation in nanoseconds.
+	 */
+	double (*run)(int param, int iterations);
+
+	/**
+	 * @params: Population sizes (or similar) to measure; terminated
+	 * by a negative value.
+	 */
+	int params[5];
+};
+
+static struct homa bench_homa;
+static struct homa_sock bench_hsk;
+
+/**
+ * bench_ns() - Return the current time in nanoseconds.
+ */
+static __u64 bench_ns(void)
+{
+	struct bench_timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * bench_addr() - Return a distinct IPv4-mapped client address.
+ * @i:    Index of the client; different values give different addresses.
+ */
+static struct in6_addr bench_addr(int i)
+{
+	struct in6_addr addr;
+
+	ipv6_addr_set(&addr, 0, 0, htonl(0xffff), htonl(0xc4a80001 + i));
+	return addr;
+}
+
+/**
+ * bench_setup() - Create a fresh Homa instance and socket for a benchmark.
+ * @bpages:  Number of bpages to allocate in the socket's buffer pool.
+ */
+static void bench_setup(int bpages)
+{
+	homa_init(&bench_homa);
+	homa = &bench_homa;
+	mock_sock_init(&bench_hsk, &bench_homa, 99);
+	homa_pool_destroy(&bench_hsk.buffer_pool);
+	homa_pool_init(&bench_hsk, (void *) 0x1000000,
+			(__u64) bpages * HOMA_BPAGE_SIZE, 0, 0);
+	unit_log_clear();
+}
+
+/**
+ * bench_teardown() - Clean up after bench_setup.
+ */
+static void bench_teardown(void)
+{
+	homa_destroy(&bench_homa);
+	homa = NULL;
+	unit_teardown();
+}
+
+/**
+ * bench_server_rpc() - Create a server RPC as if its first DATA packet
+ * had just arrived.
+ * @client:   Address of the client.
+ * @id:       Id for the RPC (from the server's point of view).
+ * @length:   Length of the request message.
+ *
+ * Return:    The new RPC (unlocked).
+ */
+static struct homa_rpc *bench_server_rpc(struct in6_addr *client, __u64 id,
+		int length)
+{
+	struct data_header h = {
+		.common = {
+			.sport = htons(40000),
+			.dport = htons(bench_hsk.port),
+			.type = DATA,
+			.sender_id = cpu_to_be64(id ^ 1)
+		},
+		.message_length = htonl(length),
+		.incoming = htonl(length < 10000 ? length : 10000),
+	};
+	struct homa_rpc *rpc;
+	int created;
+
+	rpc = homa_rpc_new_server(&bench_hsk, client, &h, &created);
+	if (IS_ERR(rpc)) {
+		printf("homa_rpc_new_server failed: errno %ld\n",
+				-PTR_ERR(rpc));
+		_exit(1);
+	}
+	homa_rpc_unlock(rpc);
+	return rpc;
+}
+
+/**
+ * bench_pool() - Measure homa_pool_allocate (plus the matching call to
+ * homa_pool_release_buffers) for a 2.5-bpage message.
+ * @fill:        Percentage of the pool's bpages to allocate to other
+ *               messages before measuring.
+ * @iterations:  Number of allocate/release pairs to time.
+ */
+static double bench_pool(int fill, int iterations)
+{
+	struct homa_pool *pool = &bench_hsk.buffer_pool;
+	struct in6_addr client = bench_addr(0);
+	struct homa_rpc *rpc;
+	__u64 id = 1001;
+	__u64 start, elapsed;
+	int i, target;
+
+	bench_setup(1000);
+	target = pool->num_bpages - (pool->num_bpages * fill) / 100;
+	if (target < 4)
+		target = 4;
+	while (atomic_read(&pool->free_bpages) > target) {
+		bench_server_rpc(&client, id, HOMA_BPAGE_SIZE);
+		id += 2;
+	}
+	rpc = bench_server_rpc(&client, id, 5*HOMA_BPAGE_SIZE/2);
+	homa_pool_release_buffers(pool, rpc->msgin.num_bpages,
+			rpc->msgin.bpage_offsets);
+	rpc->msgin.num_bpages = 0;
+
+	start = bench_ns();
+	for (i = 0; i < iterations; i++) {
+		homa_rpc_lock(rpc);
+		homa_pool_allocate(rpc);
+		homa_rpc_unlock(rpc);
+		homa_pool_release_buffers(pool, rpc->msgin.num_bpages,
+				rpc->msgin.bpage_offsets);
+		rpc->msgin.num_bpages = 0;
+	}
+	elapsed = bench_ns() - start;
+	bench_teardown();
+	return ((double) elapsed)/iterations;
+}
+
+/**
+ * bench_grant() - Measure homa_check_grantable for an RPC that isn't yet
+ * on the grantable lists (plus homa_remove_grantable_locked, to take it
+ * off again), with a given number of grantable RPCs spread across 16 peers.
+ * @num_rpcs:    Number of grantable RPCs.
+ * @iterations:  Number of remove/check pairs to time.
+ */
+static double bench_grant(int num_rpcs, int iterations)
+{
+	struct homa_rpc **rpcs;
+	struct in6_addr client;
+	__u64 start, elapsed;
+	int i;
+
+	bench_setup(4*num_rpcs + 100);
+	rpcs = (struct homa_rpc **) kmalloc(num_rpcs * sizeof(*rpcs),
+			GFP_KERNEL);
+	for (i = 0; i < num_rpcs; i++) {
+		client = bench_addr(i % 16);
+
+		/* Lengths are scrambled so that insertions land at
+		 * different places in the grantable lists.
+		 */
+		rpcs[i] = bench_server_rpc(&client, 1001 + 2*i,
+				20000 + ((i * 7919) % 1000) * 100);
+		homa_check_grantable(rpcs[i]);
+	}
+	unit_log_clear();
+
+	start = bench_ns();
+	for (i = 0; i < iterations; i++) {
+		struct homa_rpc *rpc = rpcs[i % num_rpcs];
+
+		homa_grantable_lock(&bench_homa);
+		homa_remove_grantable_locked(&bench_homa, rpc);
+		homa_grantable_unlock(&bench_homa);
+		homa_check_grantable(rpc);
+		if ((i & 0x3ff) == 0)
+			unit_log_clear();
+	}
+	elapsed = bench_ns() - start;
+	kfree(rpcs);
+	bench_teardown();
+	return ((double) elapsed)/iterations;
+}
+
+/**
+ * bench_lookup() - Measure homa_find_server_rpc when a socket has a given
+ * number of active server RPCs (each hash chain holds about
+ * @num_rpcs/HOMA_SERVER_RPC_BUCKETS RPCs).
+ * @num_rpcs:    Number of server RPCs.
+ * @iterations:  Number of lookups to time.
+ */
+static double bench_lookup(int num_rpcs, int iterations)
+{
+	struct in6_addr client = bench_addr(0);
+	struct homa_rpc *rpc;
+	__u64 start, elapsed;
+	__u32 index = 1;
+	int i;
+
+	bench_setup(1000);
+	for (i = 0; i < num_rpcs; i++)
+		bench_server_rpc(&client, 1001 + 2*i, 100);
+
+	start = bench_ns();
+	for (i = 0; i < iterations; i++) {
+		/* Pseudo-random sequence of RPCs, so that lookups don't
+		 * always hit the same chains.
+		 */
+		index = index * 1103515245 + 12345;
+		rpc = homa_find_server_rpc(&bench_hsk, &client, 40000,
+				1001 + 2*((index >> 8) % num_rpcs));
+		if (rpc == NULL) {
+			printf("homa_find_server_rpc couldn't find RPC\n");
+			_exit(1);
+		}
+		homa_rpc_unlock(rpc);
+	}
+	elapsed = bench_ns() - start;
+	bench_teardown();
+	return ((double) elapsed)/iterations;
+}
+
+/**
+ * bench_gro() - Measure homa_gro_receive, feeding it batches of DATA
+ * packets for different RPCs, one quarter of which are single-packet
+ * messages (which get sorted to the front of each batch).
+ * @batch:       Number of packets in each GRO batch.
+ * @iterations:  Total number of packets to time.
+ */
+static double bench_gro(int batch, int iterations)
+{
+	struct in6_addr client = bench_addr(0);
+	struct napi_struct *napi;
+	struct sk_buff **skbs;
+	__u64 elapsed = 0;
+	int i, j, rounds;
+
+	bench_setup(1000);
+	bench_homa.gro_policy = 0;
+	bench_homa.max_gro_skbs = batch + 1;
+	napi = (struct napi_struct *) kmalloc(sizeof(*napi), GFP_KERNEL);
+	memset(napi, 0, sizeof(*napi));
+	for (i = 0; i < GRO_HASH_BUCKETS; i++)
+		INIT_LIST_HEAD(&napi->gro_hash[i].list);
+	skbs = (struct sk_buff **) kmalloc(batch * sizeof(*skbs), GFP_KERNEL);
+
+	rounds = (iterations + batch - 1)/batch;
+	for (i = 0; i < rounds; i++) {
+		struct homa_core *core = homa_cores[cpu_number];
+		__u64 start;
+
+		for (j = 0; j < batch; j++) {
+			int length = ((j % 4) == 3) ? 500 : 100000;
+			struct data_header h = {
+				.common = {
+					.sport = htons(40000),
+					.dport = htons(99),
+					.type = DATA,
+					.sender_id = cpu_to_be64(2000 + 2*j)
+				},
+				.message_length = htonl(length),
+				.incoming = htonl(length),
+				.seg = {.offset = htonl(1400*i % 90000),
+					.segment_length = htonl(length < 1400
+						? length : 1400)},
+			};
+			skbs[j] = mock_skb_new(&client, &h.common,
+					length < 1400 ? length : 1400, 0);
+			NAPI_GRO_CB(skbs[j])->same_flow = 0;
+			NAPI_GRO_CB(skbs[j])->last = skbs[j];
+			NAPI_GRO_CB(skbs[j])->count = 1;
+		}
+
+		start = bench_ns();
+		for (j = 0; j < batch; j++) {
+			struct sk_buff *skb = skbs[j];
+			__u32 hash = skb_get_hash_raw(skb)
+					& (GRO_HASH_BUCKETS - 1);
+
+			homa_gro_receive(&napi->gro_hash[hash].list, skb);
+			if (!NAPI_GRO_CB(skb)->same_flow
+					&& (core->held_skb == skb)) {
+				/* Normally done by dev_gro_receive. */
+				list_add_tail(&skb->list,
+						&napi->gro_hash[hash].list);
+				napi->gro_hash[hash].count++;
+			}
+		}
+		elapsed += bench_ns() - start;
+
+		/* Discard the batch (this also frees the merged packets). */
+		if (core->held_skb) {
+			list_del(&core->held_skb->list);
+			kfree_skb(core->held_skb);
+			core->held_skb = NULL;
+			core->gro_batch = NULL;
+		}
+		for (j = 0; j < GRO_HASH_BUCKETS; j++) {
+			INIT_LIST_HEAD(&napi->gro_hash[j].list);
+			napi->gro_hash[j].count = 0;
+		}
+		unit_log_clear();
+	}
+	kfree(skbs);
+	kfree(napi);
+	bench_teardown();
+	return ((double) elapsed)/(rounds*batch);
+}
+
+static struct benchmark benchmarks[] = {
+	{"pool", "% full", bench_pool, {0, 90, 99, -1}},
+	{"grant", "grantable RPCs", bench_grant, {10, 100, 1000, 5000, -1}},
+	{"lookup", "server RPCs", bench_lookup, {1000, 10000, 100000, -1}},
+	{"gro", "packets/batch", bench_gro, {8, 64, 256, -1}},
+};
+
+/**
+ * run_procs() - Run a benchmark in one or more processes concurrently.
+ * @b:           The benchmark.
+ * @param:       Parameter value to pass to the benchmark.
+ * @iterations:  Number of operations to time in each process.
+ * @procs:       Number of processes.
+ *
+ * Return:       Average time per operation across all of the processes
+ *               (nanoseconds), or a negative value if a process failed.
+ */
+static double run_procs(struct benchmark *b, int param, int iterations,
+		int procs)
+{
+	double total = 0.0, ns;
+	int fds[2], i, status;
+
+	if (procs == 1)
+		return b->run(param, iterations);
+	if (pipe(fds) != 0) {
+		printf("Couldn't create pipe\n");
+		return -1.0;
+	}
+	fflush(stdout);
+	for (i = 0; i < procs; i++) {
+		if (fork() == 0) {
+			close(fds[0]);
+			ns = b->run(param, iterations);
+			if (write(fds[1], &ns, sizeof(ns)) != sizeof(ns))
+				_exit(1);
+			_exit(0);
+		}
+	}
+	close(fds[1]);
+	for (i = 0; i < procs; i++) {
+		if (read(fds[0], &ns, sizeof(ns)) != sizeof(ns)) {
+			total = -1.0;
+			break;
+		}
+		total += ns;
+	}
+	close(fds[0]);
+	for (i = 0; i < procs; i++)
+		waitpid(-1, &status, 0);
+	return (total < 0) ? total : total/procs;
+}
+
+static char * helpMessage =
+	"This program runs microbenchmarks for Homa's hot paths, using the\n"
+	"unit test mock layer.\n"
+	"    Usage: %s options benchmark benchmark ...\n"
+	"The following options are supported:\n"
+	"    --help or -h      Print this message\n"
+	"    --iterations N    Number of operations to time for each\n"
+	"                      measurement (default: 200000)\n"
+	"    --procs N         Run each measurement in N processes at once\n"
+	"                      (each with its own copy of Homa), to see how\n"
+	"                      performance scales as more cores compete for\n"
+	"                      caches and memory (default: 1)\n"
+	"If one or more benchmark names are provided (pool, grant, lookup,\n"
+	"or gro), then only those benchmarks are run; otherwise all are run.\n";
+
+int main(int argc, char **argv) {
+	int iterations = 200000;
+	int procs = 1;
+	int i, j, k;
+
+	mock_ipv6_default = true;
+	mock_ipv6 = true;
+	__current_test = &bench_metadata;
+	bench_metadata.passed = 1;
+	for (i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "-h") == 0) ||
+			(strcmp(argv[i], "--help") == 0)) {
+			printf(helpMessage, argv[0]);
+			return 0;
+		} else if ((strcmp(argv[i], "--iterations") == 0)
+				&& (i + 1 < argc)) {
+			iterations = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "--procs") == 0)
+				&& (i + 1 < argc)) {
+			procs = atoi(argv[++i]);
+		} else if (argv[i][0] == '-') {
+			printf("Unknown option %s; type '%s --help' for help\n",
+				argv[i], argv[0]);
+			return 1;
+		} else {
+			break;
+		}
+	}
+	if ((iterations < 1) || (procs < 1)) {
+		printf("--iterations and --procs must be positive\n");
+		return 1;
+	}
+
+	printf("%-8s %-16s %8s   %s\n", "Name", "Parameter", "ns/op",
+			(procs > 1) ? "Mops/sec (all procs)" : "");
+	for (j = 0; j < ARRAY_SIZE(benchmarks); j++) {
+		struct benchmark *b = &benchmarks[j];
+
+		if (i < argc) {
+			for (k = i; k < argc; k++) {
+				if (strcmp(argv[k], b->name) == 0)
+					break;
+			}
+			if (k >= argc)
+				continue;
+		}
+		for (k = 0; b->params[k] >= 0; k++) {
+			char param[50];
+			double ns;
+
+			ns = run_procs(b, b->params[k], iterations, procs);
+			snprintf(param, sizeof(param), "%d %s", b->params[k],
+					b->param_name);
+			if (ns < 0) {
+				printf("%-8s %-16s   failed\n", b->name, param);
+				continue;
+			}
+			if (procs > 1)
+				printf("%-8s %-16s %8.1f   %.2f\n", b->name,
+						param, ns, procs*1e03/ns);
+			else
+				printf("%-8s %-16s %8.1f\n", b->name, param,
+						ns);
+		}
+	}
+	if (!bench_metadata.passed) {
+		printf("The mock layer reported errors during the "
+				"benchmarks\n");
+		return 1;
+	}
+	return 0;
+}
@@ -40,6 +40,7 @@ extern void      *memcpy(void *dest, const void *src, size_t n);
  * the next call to the function will fail; bit 1 corresponds to the next
  * call after that, and so on.
  */
+int mock_alloc_page_errors = 0;
 int mock_alloc_skb_errors = 0;
 int mock_copy_data_errors = 0;
 int mock_copy_to_iter_errors = 0;
@@ -53,13 +54,19 @@ int mock_kmalloc_errors = 0;
 int mock_route_errors = 0;
 int mock_spin_lock_held = 0;
 int mock_trylock_errors = 0;
+int mock_udp_sock_errors = 0;
 int mock_vmalloc_errors = 0;
+int mock_pin_user_pages_errors = 0;
+int mock_locked_vm_errors = 0;
 
 /* The return value from calls to signal_pending(). */
 int mock_signal_pending = 0;
 
+/* Used as the address space of the current task during tests. */
+struct mm_struct mock_mm;
+
 /* Used as current task during tests. */
-struct task_struct mock_task;
+struct task_struct mock_task = {.mm = &mock_mm};
 
 /* If a test sets this variable to nonzero, ip_queue_xmit will log
  * outgoing packets using the long format rather than short.
@@ -89,6 +96,18 @@ int mock_bpage_size = 0x10000;
 /* HOMA_BPAGE_SHIFT will evaluate to this. */
 int mock_bpage_shift = 16;
 
+/* nr_node_ids will evaluate to this. */
+unsigned int mock_nr_node_ids = 2;
+
+/* numa_node_id() will evaluate to this. */
+int mock_numa_node = 0;
+
+/* sock_i_uid() will return this uid. */
+int mock_uid = 0;
+
+/* The return value from calls to find_vma. */
+struct vm_area_struct *mock_vma = NULL;
+
 /* Keeps track of all sk_buffs that are alive in the current test.
  * Reset for each test.
  */
@@ -129,6 +148,29 @@ static int mock_active_rcu_locks = 0;
  */
 cycles_t mock_cycles = 0;
 
+/* If nonzero, functions such as _copy_from_iter and skb_copy_datagram_iter
+ * actually copy message data (without logging) instead of just logging
+ * what they would have copied. Used when Homa runs over a userspace
+ * packet I/O backend (see bypass/homa_bypass.c).
+ */
+int mock_copy_data = 0;
+
+/* If nonzero, Homa is running in the libhoma_bypass prototype rather than
+ * in a unit test: memory allocations aren't tracked for leak checking,
+ * and mocks such as _copy_to_user and wake_up_process don't log. Otherwise
+ * the tracking tables and the log would grow with every packet.
+ */
+int mock_bypass = 0;
+
+/* If non-NULL, ip_queue_xmit and ip6_xmit pass outgoing packets to this
+ * function (which takes ownership of the packet) instead of logging them.
+ * The arguments are the packet, whose data starts with the Homa header,
+ * the destination address (IPv4 addresses are mapped to IPv6), and the
+ * TOS/traffic class byte for the IP header.
+ */
+int (*mock_xmit_hook)(struct sk_buff *skb, const struct in6_addr *daddr,
+		int tos) = NULL;
+
 /* Indicates whether we should be simulation IPv6 or IPv4 in the
  * current test. Can be overridden by a test.
  */
@@ -163,15 +205,31 @@ unsigned long ex_handler_refcount = 0;
 struct net init_net;
 unsigned long volatile jiffies = 1100;
 unsigned int nr_cpu_ids = 8;
+
+/* Cores 0 through nr_cpu_ids-1 are online. */
+struct cpumask __cpu_online_mask = {{0xff}};
 unsigned long page_offset_base = 0;
 unsigned long phys_base = 0;
 unsigned long vmemmap_base = 0;
+struct workqueue_struct *system_wq;
 int __preempt_count = 0;
 char sock_flow_table[RPS_SOCK_FLOW_TABLE_SIZE(1024)];
 struct rps_sock_flow_table *rps_sock_flow_table
 		= (struct rps_sock_flow_table *) sock_flow_table;
 __u32 rps_cpu_mask = 0x1f;
 
+int account_locked_vm(struct mm_struct *mm, unsigned long pages, bool inc)
+{
+	if (!inc) {
+		mm->locked_vm -= pages;
+		return 0;
+	}
+	if (mock_check_error(&mock_locked_vm_errors))
+		return -ENOMEM;
+	mm->locked_vm += pages;
+	return 0;
+}
+
 extern void add_wait_queue(struct wait_queue_head *wq_head,
 		struct wait_queue_entry *wq_entry) {}
 
@@ -185,9 +243,11 @@ struct sk_buff *__alloc_skb(unsigned int size, gfp_t priority, int flags,
 	if (skb == NULL)
 		FAIL("skb malloc failed in __alloc_skb");
 	memset(skb, 0, sizeof(*skb));
-	if (!buffs_in_use)
-		buffs_in_use = unit_hash_new();
-	unit_hash_set(buffs_in_use, skb, "used");
+	if (!mock_bypass) {
+		if (!buffs_in_use)
+			buffs_in_use = unit_hash_new();
+		unit_hash_set(buffs_in_use, skb, "used");
+	}
 	size = SKB_DATA_ALIGN(size);
 	shinfo_size = SKB_DATA_ALIGN(sizeof(struct skb_shared_info));
 	skb->head = malloc(size + shinfo_size);
@@ -208,6 +268,29 @@ struct sk_buff *__alloc_skb(unsigned int size, gfp_t priority, int flags,
 	return skb;
 }
 
+unsigned long bitmap_find_next_zero_area_off(unsigned long *map,
+		unsigned long size, unsigned long start, unsigned int nr,
+		unsigned long align_mask, unsigned long align_offset)
+{
+	unsigned long i;
+
+	for ( ; (start + nr) <= size; start++) {
+		for (i = 0; i < nr; i++) {
+			if (test_bit(start + i, map))
+				break;
+		}
+		if (i == nr)
+			return start;
+		start += i;
+	}
+	return size + 1;
+}
+
+void call_rcu(struct rcu_head *head, rcu_callback_t func)
+{
+	func(head);
+}
+
 void call_rcu_sched(struct rcu_head *head, rcu_callback_t func)
 {
 	if (mock_log_rcu_sched)
@@ -233,8 +316,12 @@ size_t _copy_from_iter(void *addr, size_t bytes, struct iov_iter *iter)
 		size_t chunk_bytes = iov->iov_len;
 		if (chunk_bytes > bytes_left)
 			chunk_bytes = bytes_left;
-		unit_log_printf("; ", "_copy_from_iter %lu bytes at %llu",
-				chunk_bytes, int_base);
+		if (mock_copy_data)
+			memcpy(addr + bytes - bytes_left, iov->iov_base,
+					chunk_bytes);
+		else
+			unit_log_printf("; ", "_copy_from_iter %lu bytes at %llu",
+					chunk_bytes, int_base);
 		bytes_left -= chunk_bytes;
 		iter->count -= chunk_bytes;
 		iov->iov_base = (void *) (int_base + chunk_bytes);
@@ -247,6 +334,8 @@ size_t _copy_from_iter(void *addr, size_t bytes, struct iov_iter *iter)
 
 bool _copy_from_iter_full(void *addr, size_t bytes, struct iov_iter *i)
 {
+	if (mock_copy_data)
+		return _copy_from_iter(addr, bytes, i) == bytes;
 	if (mock_check_error(&mock_copy_data_errors))
 		return false;
 	unit_log_printf("; ", "_copy_from_iter_full copied %lu bytes", bytes);
@@ -255,6 +344,8 @@ bool _copy_from_iter_full(void *addr, size_t bytes, struct iov_iter *i)
 
 bool _copy_from_iter_full_nocache(void *addr, size_t bytes, struct iov_iter *i)
 {
+	if (mock_copy_data)
+		return _copy_from_iter(addr, bytes, i) == bytes;
 	if (mock_check_error(&mock_copy_data_errors))
 		return false;
 	unit_log_printf("; ", "_copy_from_iter_full_nocache copid %lu bytes",
@@ -266,6 +357,28 @@ size_t _copy_to_iter(const void *addr, size_t bytes, struct iov_iter *i)
 {
 	if (mock_check_error(&mock_copy_to_iter_errors))
 		return 0;
+	if (mock_copy_data) {
+		size_t bytes_left = bytes;
+
+		if (bytes > i->count)
+			bytes = bytes_left = i->count;
+		while (bytes_left > 0) {
+			struct iovec *iov = (struct iovec *) i->iov;
+			size_t chunk_bytes = iov->iov_len;
+
+			if (chunk_bytes > bytes_left)
+				chunk_bytes = bytes_left;
+			memcpy(iov->iov_base, addr + bytes - bytes_left,
+					chunk_bytes);
+			bytes_left -= chunk_bytes;
+			i->count -= chunk_bytes;
+			iov->iov_base += chunk_bytes;
+			iov->iov_len -= chunk_bytes;
+			if (iov->iov_len == 0)
+				i->iov++;
+		}
+		return bytes;
+	}
 	unit_log_printf("; ", "_copy_to_iter: %.*s", (int) bytes,
 			(char *) addr);
 	return bytes;
@@ -277,7 +390,9 @@ unsigned long _copy_to_user(void __user *to, const void *from, unsigned long n)
 		return -1;
 	if (!mock_check_error(&mock_copy_to_user_dont_copy))
 		memcpy(to, from, n);
-	unit_log_printf("; ", "_copy_to_user copied %lu bytes to %p", n, to);
+	if (!mock_bypass)
+		unit_log_printf("; ", "_copy_to_user copied %lu bytes to %p",
+				n, to);
 	return 0;
 }
 
@@ -287,6 +402,10 @@ unsigned long _copy_from_user(void *to, const void __user *from,
 	__u64 int_from = (__u64) from;
 	if (mock_check_error(&mock_copy_data_errors))
 		return 1;
+	if (mock_copy_data) {
+		memcpy(to, from, n);
+		return 0;
+	}
 	if (int_from > 200000)
 		memcpy(to, from, n);
 	unit_log_printf("; ", "_copy_from_user %lu bytes at %llu", n, int_from);
@@ -298,6 +417,21 @@ void __copy_overflow(int size, unsigned long count)
 	abort();
 }
 
+__wsum csum_partial(const void *buff, int len, __wsum sum)
+{
+	return sum;
+}
+
+int __cond_resched(void)
+{
+	UNIT_HOOK("cond_resched");
+	return 0;
+}
+
+#if defined(CONFIG_PREEMPT_DYNAMIC) && defined(CONFIG_HAVE_PREEMPT_DYNAMIC_CALL)
+DEFINE_STATIC_CALL(cond_resched, __cond_resched);
+#endif
+
 void do_exit(long error_code)
 {
 	while(1) {}
@@ -318,9 +452,42 @@ void dst_release(struct dst_entry *dst)
 	free(dst);
 }
 
+struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr)
+{
+	return mock_vma;
+}
+
 void finish_wait(struct wait_queue_head *wq_head,
 		struct wait_queue_entry *wq_entry) {}
 
+bool flush_work(struct work_struct *work)
+{
+	return false;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,1,0)
+unsigned long _find_next_bit(const unsigned long *addr, unsigned long nbits,
+		unsigned long start)
+{
+	for ( ; start < nbits; start++) {
+		if (test_bit(start, addr))
+			break;
+	}
+	return start;
+}
+#else
+unsigned int cpumask_next(int n, const struct cpumask *srcp)
+{
+	for (n++; n < nr_cpu_ids; n++) {
+		if (cpumask_test_cpu(n, srcp))
+			break;
+	}
+	return n;
+}
+#endif
+
+void __folio_put(struct folio *folio) {}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,18,0)
 void get_random_bytes(void *buf, int nbytes)
 #else
@@ -515,6 +682,72 @@ void iov_iter_init(struct iov_iter *i, unsigned int direction,
 	i->nr_segs = nr_segs;
 	i->iov_offset = 0;
 	i->count = count;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+	i->user_backed = true;
+#endif
+}
+
+void iov_iter_bvec(struct iov_iter *i, unsigned int direction,
+		const struct bio_vec *bvec, unsigned long nr_segs,
+		size_t count)
+{
+	*i = (struct iov_iter) {
+		.iter_type = ITER_BVEC,
+		.data_source = direction,
+		.bvec = bvec,
+		.nr_segs = nr_segs,
+		.iov_offset = 0,
+		.count = count
+	};
+}
+
+ssize_t iov_iter_get_pages2(struct iov_iter *i, struct page **pages,
+		size_t maxsize, unsigned maxpages, size_t *start)
+{
+	const struct bio_vec *bvec;
+	size_t bytes;
+
+	/* Only pages from bvec iterators (see mock_alloc_page) are
+	 * supported.
+	 */
+	if (!iov_iter_is_bvec(i) || (i->count == 0))
+		return -EFAULT;
+	bvec = i->bvec;
+	bytes = bvec->bv_len - i->iov_offset;
+	if (bytes > maxsize)
+		bytes = maxsize;
+	if (bytes > i->count)
+		bytes = i->count;
+	*pages = bvec->bv_page;
+	*start = bvec->bv_offset + i->iov_offset;
+	i->iov_offset += bytes;
+	i->count -= bytes;
+	if (i->iov_offset == bvec->bv_len) {
+		i->bvec++;
+		i->nr_segs--;
+		i->iov_offset = 0;
+	}
+	return bytes;
+}
+
+int iov_iter_npages(const struct iov_iter *i, int maxpages)
+{
+	const struct bio_vec *bvec;
+	size_t offset, left;
+	int npages = 0;
+
+	if (!iov_iter_is_bvec(i))
+		return 1;
+	bvec = i->bvec;
+	offset = i->iov_offset;
+	for (left = i->count; (left > 0) && (npages < maxpages); bvec++) {
+		size_t chunk = bvec->bv_len - offset;
+
+		left -= (chunk < left) ? chunk : left;
+		offset = 0;
+		npages++;
+	}
+	return npages;
 }
 
 void iov_iter_revert(struct iov_iter *i, size_t bytes)
@@ -558,6 +791,11 @@ unsigned int ip6_mtu(const struct dst_entry *dst)
 	return mock_mtu;
 }
 
+int ip6_dst_hoplimit(struct dst_entry *dst)
+{
+	return 64;
+}
+
 int ip6_xmit(const struct sock *sk, struct sk_buff *skb, struct flowi6 *fl6,
 	     __u32 mark, struct ipv6_txoptions *opt, int tclass, u32 priority)
 {
@@ -567,6 +805,8 @@ int ip6_xmit(const struct sock *sk, struct sk_buff *skb, struct flowi6 *fl6,
 		kfree_skb(skb);
 		return -ENETDOWN;
 	}
+	if (mock_xmit_hook)
+		return mock_xmit_hook(skb, &fl6->daddr, tclass);
 	if (mock_xmit_prios_offset == 0)
 		prefix = "";
 	mock_xmit_prios_offset += snprintf(
@@ -599,6 +839,12 @@ int ip_queue_xmit(struct sock *sk, struct sk_buff *skb, struct flowi *fl)
 		kfree_skb(skb);
 		return -ENETDOWN;
 	}
+	if (mock_xmit_hook) {
+		struct in6_addr daddr = ipv4_to_ipv6(fl->u.ip4.daddr);
+
+		return mock_xmit_hook(skb, &daddr,
+				((struct inet_sock *) sk)->tos);
+	}
 	if (mock_xmit_prios_offset == 0)
 		prefix = "";
 	mock_xmit_prios_offset += snprintf(
@@ -658,6 +904,10 @@ void kfree(const void *block)
 {
 	if (block == NULL)
 		return;
+	if (mock_bypass) {
+		free((void *) block);
+		return;
+	}
 	if (!kmallocs_in_use || unit_hash_get(kmallocs_in_use, block) == NULL) {
 		FAIL("kfree on unknown block");
 		return;
@@ -672,11 +922,14 @@ void kfree_skb_reason(struct sk_buff *skb, enum skb_drop_reason reason)
 	if (skb->users.refs.counter > 0)
 		return;
 	skb_dst_drop(skb);
-	if (!buffs_in_use || unit_hash_get(buffs_in_use, skb) == NULL) {
-		FAIL("kfree_skb on unknown sk_buff");
-		return;
+	if (!mock_bypass) {
+		if (!buffs_in_use
+				|| unit_hash_get(buffs_in_use, skb) == NULL) {
+			FAIL("kfree_skb on unknown sk_buff");
+			return;
+		}
+		unit_hash_erase(buffs_in_use, skb);
 	}
-	unit_hash_erase(buffs_in_use, skb);
 	while (skb_shinfo(skb)->frag_list) {
 		struct sk_buff *next = skb_shinfo(skb)->frag_list->next;
 		kfree_skb(skb_shinfo(skb)->frag_list);
@@ -695,12 +948,22 @@ void *mock_kmalloc(size_t size, gfp_t flags)
 		FAIL("malloc failed");
 		return NULL;
 	}
+	if (mock_bypass)
+		return block;
 	if (!kmallocs_in_use)
 		kmallocs_in_use = unit_hash_new();
 	unit_hash_set(kmallocs_in_use, block, "used");
 	return block;
 }
 
+void *mock_kcalloc(size_t n, size_t size, gfp_t flags)
+{
+	void *block = mock_kmalloc(n * size, flags);
+	if (block)
+		memset(block, 0, n * size);
+	return block;
+}
+
 struct task_struct *kthread_create_on_node(int (*threadfn)(void *data),
 					   void *data, int node,
 					   const char namefmt[],
@@ -714,6 +977,22 @@ int kthread_stop(struct task_struct *k)
 	return 0;
 }
 
+bool kthread_should_stop(void)
+{
+	return true;
+}
+
+void kthread_use_mm(struct mm_struct *mm) {}
+
+void kthread_unuse_mm(struct mm_struct *mm) {}
+
+void __mmdrop(struct mm_struct *mm) {}
+
+void mmput(struct mm_struct *mm)
+{
+	atomic_dec(&mm->mm_users);
+}
+
 #ifdef CONFIG_DEBUG_LIST
 bool __list_add_valid(struct list_head *new,
 		struct list_head *prev,
@@ -759,6 +1038,13 @@ void mutex_unlock(struct mutex *lock)
 	mock_active_locks--;
 }
 
+struct ubuf_info *msg_zerocopy_realloc(struct sock *sk, size_t size,
+		struct ubuf_info *uarg)
+{
+	unit_log_printf("; ", "msg_zerocopy_realloc");
+	return NULL;
+}
+
 int netif_receive_skb(struct sk_buff *skb)
 {
 	struct data_header *h = (struct data_header *)
@@ -768,6 +1054,22 @@ int netif_receive_skb(struct sk_buff *skb)
 	return 0;
 }
 
+int pin_user_pages_fast(unsigned long start, int nr_pages,
+		unsigned int gup_flags, struct page **pages)
+{
+	int i;
+
+	if (mock_check_error(&mock_pin_user_pages_errors))
+		return -EFAULT;
+
+	/* Each "page" is just the user address of the page, so that
+	 * mock_kmap_local_page can map it back.
+	 */
+	for (i = 0; i < nr_pages; i++)
+		pages[i] = (struct page *) (start + i*PAGE_SIZE);
+	return nr_pages;
+}
+
 long prepare_to_wait_event(struct wait_queue_head *wq_head,
 		struct wait_queue_entry *wq_entry, int state)
 {
@@ -800,6 +1102,18 @@ int proc_dointvec(struct ctl_table *table, int write,
 	return 0;
 }
 
+int proc_dointvec_minmax(struct ctl_table *table, int write,
+		     void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+	return 0;
+}
+
+int proc_dostring(struct ctl_table *table, int write,
+		     void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+	return 0;
+}
+
 void proc_remove(struct proc_dir_entry *de)
 {
 	if (!proc_files_in_use
@@ -819,6 +1133,26 @@ int proto_register(struct proto *prot, int alloc_slab)
 
 void proto_unregister(struct proto *prot) {}
 
+bool queue_work_on(int cpu, struct workqueue_struct *wq,
+		struct work_struct *work)
+{
+	if (!mock_bypass)
+		unit_log_printf("; ", "queue_work_on core %d", cpu);
+	return true;
+}
+
+int pskb_expand_head(struct sk_buff *skb, int nhead, int ntail,
+		gfp_t gfp_mask)
+{
+	/* The mock can't grow sk_buffs, so fail unless no extra space is
+	 * needed (clones made by the mock already have private data).
+	 */
+	if ((nhead != 0) || (ntail != 0))
+		return -ENOMEM;
+	skb->cloned = 0;
+	return 0;
+}
+
 void *__pskb_pull_tail(struct sk_buff *skb, int delta)
 {
 	return NULL;
@@ -887,11 +1221,53 @@ void __show_free_areas(unsigned int filter, nodemask_t *nodemask,
 
 void sk_common_release(struct sock *sk) {}
 
+void sk_free(struct sock *sk)
+{
+	unit_log_printf("; ", "sk_free");
+}
+
 int sk_set_peek_off(struct sock *sk, int val)
 {
 	return 0;
 }
 
+struct sk_buff *skb_clone(struct sk_buff *skb, gfp_t gfp_mask)
+{
+	/* A real clone shares data with the original; here the data is
+	 * copied, but the original is still marked as cloned.
+	 */
+	int size = skb_end_offset(skb);
+	struct sk_buff *clone = __alloc_skb(size, gfp_mask, 0, -1);
+	if (clone == NULL)
+		return NULL;
+	memcpy(clone->head, skb->head, size
+			+ SKB_DATA_ALIGN(sizeof(struct skb_shared_info)));
+	skb_shinfo(clone)->frag_list = NULL;
+	clone->data = clone->head + (skb->data - skb->head);
+	clone->tail = skb->tail;
+	clone->len = skb->len;
+	clone->data_len = skb->data_len;
+	clone->network_header = skb->network_header;
+	clone->transport_header = skb->transport_header;
+	clone->cloned = 1;
+	skb->cloned = 1;
+	return clone;
+}
+
+int skb_copy_bits(const struct sk_buff *skb, int offset, void *to, int len)
+{
+	if (mock_check_error(&mock_copy_data_errors))
+		return -EFAULT;
+	if (mock_copy_data) {
+		memcpy(to, skb->data + offset, len);
+		return 0;
+	}
+	unit_log_printf("; ", "skb_copy_bits: %d bytes to 0x%llx: ",
+			len, (__u64) to);
+	unit_log_data(NULL, skb->data + offset, len);
+	return 0;
+}
+
 int skb_copy_datagram_iter(const struct sk_buff *from, int offset,
 		struct iov_iter *iter, int size)
 {
@@ -911,11 +1287,16 @@ int skb_copy_datagram_iter(const struct sk_buff *from, int offset,
 		size_t chunk_bytes = iov->iov_len;
 		if (chunk_bytes > bytes_left)
 			chunk_bytes = bytes_left;
-		unit_log_printf("; ",
-				"skb_copy_datagram_iter: %lu bytes to 0x%llx: ",
-				chunk_bytes, int_base);
-		unit_log_data(NULL, from->data + offset + size - bytes_left,
-				chunk_bytes);
+		if (mock_copy_data) {
+			memcpy(iov->iov_base, from->data + offset + size
+					- bytes_left, chunk_bytes);
+		} else {
+			unit_log_printf("; ",
+					"skb_copy_datagram_iter: %lu bytes to "
+					"0x%llx: ", chunk_bytes, int_base);
+			unit_log_data(NULL, from->data + offset + size
+					- bytes_left, chunk_bytes);
+		}
 		bytes_left -= chunk_bytes;
 		iter->count -= chunk_bytes;
 		iov->iov_base = (void *) (int_base + chunk_bytes);
@@ -931,6 +1312,11 @@ struct sk_buff *skb_dequeue(struct sk_buff_head *list)
 	return __skb_dequeue(list);
 }
 
+bool skb_page_frag_refill(unsigned int sz, struct page_frag *pfrag, gfp_t gfp)
+{
+	return false;
+}
+
 void *skb_pull(struct sk_buff *skb, unsigned int len)
 {
 	if ((skb_tail_pointer(skb) - skb->data) < len)
@@ -982,6 +1368,19 @@ int sock_common_setsockopt(struct socket *sock, int level, int optname,
 	return 0;
 }
 
+kuid_t sock_i_uid(struct sock *sk)
+{
+	return KUIDT_INIT(mock_uid);
+}
+
+int sock_recv_errqueue(struct sock *sk, struct msghdr *msg, int len,
+		int level, int type)
+{
+	unit_log_printf("; ", "sock_recv_errqueue level %d, type %d",
+			level, type);
+	return -EAGAIN;
+}
+
 int sock_no_accept(struct socket *sock, struct socket *newsock, int flags,
 		bool kern)
 {
@@ -1015,6 +1414,10 @@ int sock_no_socketpair(struct socket *sock1, struct socket *sock2)
 	return 0;
 }
 
+void rcu_barrier(void) {}
+
+void synchronize_rcu(void) {}
+
 void synchronize_sched(void) {}
 
 void __tasklet_hi_schedule(struct tasklet_struct *t) {}
@@ -1024,10 +1427,85 @@ void tasklet_init(struct tasklet_struct *t,
 
 void tasklet_kill(struct tasklet_struct *t) {}
 
+void unpin_user_pages(struct page **pages, unsigned long npages) {}
+
 void unregister_net_sysctl_table(struct ctl_table_header *header) {}
 
+void setup_udp_tunnel_sock(struct net *net, struct socket *sock,
+		struct udp_tunnel_sock_cfg *cfg)
+{
+	UNIT_LOG("; ", "setup_udp_tunnel_sock encap_type %d",
+			cfg->encap_type);
+}
+
+static int mock_udp_sock_create(struct udp_port_cfg *cfg,
+		struct socket **sockp)
+{
+	if (mock_check_error(&mock_udp_sock_errors))
+		return -EADDRINUSE;
+	*sockp = malloc(sizeof(struct socket));
+	memset(*sockp, 0, sizeof(struct socket));
+	UNIT_LOG("; ", "udp_sock_create family %d, port %d", cfg->family,
+			ntohs(cfg->local_udp_port));
+	return 0;
+}
+
+int udp_sock_create4(struct net *net, struct udp_port_cfg *cfg,
+		struct socket **sockp)
+{
+	return mock_udp_sock_create(cfg, sockp);
+}
+
+int udp_sock_create6(struct net *net, struct udp_port_cfg *cfg,
+		struct socket **sockp)
+{
+	return mock_udp_sock_create(cfg, sockp);
+}
+
+void udp_tunnel_sock_release(struct socket *sock)
+{
+	UNIT_LOG("; ", "udp_tunnel_sock_release");
+	free(sock);
+}
+
+static void mock_udp_xmit(struct sk_buff *skb, struct dst_entry *dst,
+		__be16 src_port, __be16 dst_port)
+{
+	char buffer[200];
+
+	if (mock_xmit_log_verbose)
+		homa_print_packet(skb, buffer, sizeof(buffer));
+	else
+		homa_print_packet_short(skb, buffer, sizeof(buffer));
+	unit_log_printf("; ", "xmit UDP %d->%d %s", ntohs(src_port),
+			ntohs(dst_port), buffer);
+	kfree_skb(skb);
+	dst_release(dst);
+}
+
+void udp_tunnel_xmit_skb(struct rtable *rt, struct sock *sk,
+		struct sk_buff *skb, __be32 src, __be32 dst, __u8 tos,
+		__u8 ttl, __be16 df, __be16 src_port, __be16 dst_port,
+		bool xnet, bool nocheck)
+{
+	mock_udp_xmit(skb, &rt->dst, src_port, dst_port);
+}
+
+void udp_tunnel6_xmit_skb(struct dst_entry *dst, struct sock *sk,
+		struct sk_buff *skb, struct net_device *dev,
+		const struct in6_addr *saddr, const struct in6_addr *daddr,
+		__u8 prio, __u8 ttl, __be32 label, __be16 src_port,
+		__be16 dst_port, bool nocheck)
+{
+	mock_udp_xmit(skb, dst, src_port, dst_port);
+}
+
 void vfree(const void *block)
 {
+	if (mock_bypass) {
+		free((void *) block);
+		return;
+	}
 	if (!vmallocs_in_use || unit_hash_get(vmallocs_in_use, block) == NULL) {
 		FAIL("vfree on unknown block");
 		return;
@@ -1036,6 +1514,13 @@ void vfree(const void *block)
 	free((void *) block);
 }
 
+#ifdef CONFIG_HUGETLB_PAGE
+unsigned long vma_kernel_pagesize(struct vm_area_struct *vma)
+{
+	return 0x200000;
+}
+#endif
+
 void *vmalloc(size_t size)
 {
 	if (mock_check_error(&mock_vmalloc_errors))
@@ -1045,6 +1530,8 @@ void *vmalloc(size_t size)
 		FAIL("malloc failed");
 		return NULL;
 	}
+	if (mock_bypass)
+		return block;
 	if (!vmallocs_in_use)
 		vmallocs_in_use = unit_hash_new();
 	unit_hash_set(vmallocs_in_use, block, "used");
@@ -1067,7 +1554,9 @@ int __wake_up(struct wait_queue_head *wq_head, unsigned int mode,
 
 int wake_up_process(struct task_struct *tsk)
 {
-	unit_log_printf("; ", "wake_up_process pid %d", tsk ? tsk->pid : -1);
+	if (!mock_bypass)
+		unit_log_printf("; ", "wake_up_process pid %d",
+				tsk ? tsk->pid : -1);
 	return 0;
 }
 
@@ -1112,7 +1601,8 @@ void mock_clear_xmit_prios()
  */
 void mock_data_ready(struct sock *sk)
 {
-	unit_log_printf("; ", "sk->sk_data_ready invoked");
+	if (!mock_bypass)
+		unit_log_printf("; ", "sk->sk_data_ready invoked");
 }
 
 /**
@@ -1139,6 +1629,57 @@ unsigned int mock_get_mtu(const struct dst_entry *dst)
 	return mock_mtu;
 }
 
+/**
+ * mock_kmap_local_page() - Called instead of kmap_local_page when Homa is
+ * compiled for unit testing.
+ * @page:   Page to map; pages from pin_user_pages_fast hold the user
+ *          address of the page.
+ * Return:  The address of the page's data.
+ */
+void *mock_kmap_local_page(struct page *page)
+{
+	return (void *) page;
+}
+
+/**
+ * mock_alloc_page() - Called instead of alloc_page when Homa is compiled
+ * for unit testing.
+ * @gfp:    Ignored.
+ * Return:  A "page", which is actually PAGE_SIZE bytes of zeroed memory (so
+ *          that mock_kmap_local_page can map it, and so that kernel code
+ *          that peeks at struct page fields sees nothing unusual), or
+ *          NULL if an error is being simulated.
+ */
+struct page *mock_alloc_page(gfp_t gfp)
+{
+	void *block;
+
+	if (mock_check_error(&mock_alloc_page_errors))
+		return NULL;
+	block = calloc(1, PAGE_SIZE);
+	if (!block) {
+		FAIL("malloc failed");
+		return NULL;
+	}
+	if (mock_bypass)
+		return (struct page *) block;
+	if (!kmallocs_in_use)
+		kmallocs_in_use = unit_hash_new();
+	unit_hash_set(kmallocs_in_use, block, "used");
+	return (struct page *) block;
+}
+
+/**
+ * mock_put_page() - Called instead of put_page when Homa is compiled
+ * for unit testing. References to pages aren't counted: the page is
+ * freed immediately.
+ * @page:   Page returned by mock_alloc_page.
+ */
+void mock_put_page(struct page *page)
+{
+	kfree(page);
+}
+
 /**
  * mock_rcu_read_lock() - Called instead of rcu_read_lock when Homa is compiled
  * for unit testing.
@@ -1271,6 +1812,7 @@ void mock_sock_init(struct homa_sock *hsk, struct homa *homa, int port)
 	memset(hsk, 0, sizeof(*hsk));
 	sk->sk_data_ready = mock_data_ready;
 	sk->sk_family = mock_ipv6 ? AF_INET6 : AF_INET;
+	refcount_set(&sk->sk_refcnt, 1);
 	if ((port != 0) && (port >= HOMA_MIN_DEFAULT_PORT))
 		homa->next_client_port = port;
 	homa_sock_init(hsk, homa);
@@ -1282,7 +1824,8 @@ void mock_sock_init(struct homa_sock *hsk, struct homa *homa, int port)
 	mock_mtu = UNIT_TEST_DATA_PER_PACKET + hsk->ip_header_length
 		+ sizeof(struct data_header);
 	mock_net_device.gso_max_size = mock_mtu;
-	homa_pool_init(hsk, (void *) 0x1000000, 100*HOMA_BPAGE_SIZE);
+	write_pnet(&mock_net_device.nd_net, &init_net);
+	homa_pool_init(hsk, (void *) 0x1000000, 100*HOMA_BPAGE_SIZE, 0, 0);
 }
 
 /**
@@ -1304,9 +1847,16 @@ void mock_spin_unlock(spinlock_t *lock)
  */
 void mock_teardown(void)
 {
+	int i;
+
 	cpu_number = 1;
+	cpumask_clear(&__cpu_online_mask);
+	for (i = 0; i < nr_cpu_ids; i++)
+		cpumask_set_cpu(i, &__cpu_online_mask);
 	cpu_khz = 1000000;
 	mock_alloc_skb_errors = 0;
+	mock_bypass = 0;
+	mock_copy_data = 0;
 	mock_copy_data_errors = 0;
 	mock_copy_to_iter_errors = 0;
 	mock_copy_to_user_errors = 0;
@@ -1315,24 +1865,38 @@ void mock_teardown(void)
 	mock_ipv6 = mock_ipv6_default;
 	mock_import_single_range_errors = 0;
 	mock_import_iovec_errors = 0;
+	mock_alloc_page_errors = 0;
 	mock_ip6_xmit_errors = 0;
 	mock_ip_queue_xmit_errors = 0;
 	mock_kmalloc_errors = 0;
 	mock_copy_to_user_dont_copy = 0;
 	mock_bpage_size = 0x10000;
 	mock_bpage_shift = 16;
+	mock_nr_node_ids = 2;
+	mock_numa_node = 0;
+	mock_uid = 0;
+	mock_vma = NULL;
 	mock_xmit_prios_offset = 0;
 	mock_xmit_prios[0] = 0;
 	mock_log_rcu_sched = 0;
 	mock_route_errors = 0;
 	mock_trylock_errors = 0;
+	mock_udp_sock_errors = 0;
 	mock_vmalloc_errors = 0;
+	mock_pin_user_pages_errors = 0;
+	mock_locked_vm_errors = 0;
+	tt_frozen = false;
+	atomic_set(&tt_freeze_count, 0);
+	memset(&mock_mm, 0, sizeof(mock_mm));
 	memset(&mock_task, 0, sizeof(mock_task));
+	mock_task.mm = &mock_mm;
 	mock_signal_pending = 0;
+	mock_xmit_hook = NULL;
 	mock_xmit_log_verbose = 0;
 	mock_xmit_log_homa_info = 0;
 	mock_mtu = 0;
 	mock_net_device.gso_max_size = 0;
+	mock_net_device.needed_headroom = 0;
 
 	int count = unit_hash_size(buffs_in_use);
 	if (count > 0)
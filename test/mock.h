@@ -16,9 +16,12 @@
 /* Functions for mocking that are exported to test code. */
 
 extern int         cpu_number;
+extern int         mock_alloc_page_errors;
 extern int         mock_alloc_skb_errors;
 extern             int mock_bpage_size;
 extern             int mock_bpage_shift;
+extern int         mock_bypass;
+extern int         mock_copy_data;
 extern int         mock_copy_data_errors;
 extern int         mock_copy_to_user_dont_copy;
 extern int         mock_copy_to_user_errors;
@@ -31,18 +34,31 @@ extern int         mock_ip_queue_xmit_errors;
 extern bool        mock_ipv6;
 extern bool        mock_ipv6_default;
 extern int         mock_kmalloc_errors;
+extern int         mock_locked_vm_errors;
 extern char        mock_xmit_prios[];
 extern int         mock_log_rcu_sched;
 extern int         mock_max_grants;
 extern int         mock_mtu;
+extern int         mock_pin_user_pages_errors;
 extern struct net_device
 		   mock_net_device;
+extern unsigned int
+		   mock_nr_node_ids;
+extern int         mock_numa_node;
+extern struct mm_struct
+		   mock_mm;
 extern int         mock_route_errors;
 extern int         mock_spin_lock_held;
 extern struct task_struct
 		   mock_task;
 extern int         mock_trylock_errors;
+extern int         mock_uid;
+extern int         mock_udp_sock_errors;
+extern struct vm_area_struct
+		  *mock_vma;
 extern int         mock_vmalloc_errors;
+extern int         (*mock_xmit_hook)(struct sk_buff *skb,
+			const struct in6_addr *daddr, int tos);
 extern int         mock_xmit_log_verbose;
 extern int         mock_xmit_log_homa_info;
 
@@ -117,6 +117,21 @@ void unlock_hook(char *id)
 	hook_rpc->msgin.granted = hook_granted;
 }
 
+/* The following hook function simulates another core requesting grants
+ * (after receiving more data) while grants are being computed.
+ */
+int recalc_count = 0;
+void recalc_hook(char *id)
+{
+	if (strcmp(id, "unlock") != 0)
+		return;
+	if (recalc_count <= 0)
+		return;
+	recalc_count--;
+	atomic_sub(1000, &hook_rpc->hsk->homa->total_incoming);
+	atomic_inc(&hook_rpc->hsk->homa->grant_recalc_count);
+}
+
 FIXTURE(homa_incoming) {
 	struct in6_addr client_ip[5];
 	int client_port;
@@ -756,6 +771,124 @@ TEST_F(homa_incoming, homa_copy_to_user__timetrace_info)
 	tt_destroy();
 }
 
+TEST_F(homa_incoming, homa_stream_end__no_incoming_message)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id, 1000, 200000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(0, homa_stream_end(crpc));
+}
+TEST_F(homa_incoming, homa_stream_end__packets_not_copied_yet)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id, 1000, 2000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(0, homa_stream_end(crpc));
+	mock_copy_to_user_dont_copy = -1;
+	EXPECT_EQ(0, -homa_copy_to_user(crpc));
+	EXPECT_EQ(2000, homa_stream_end(crpc));
+}
+TEST_F(homa_incoming, homa_stream_end__round_down_to_bpage)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id, 1000, 200000);
+	ASSERT_NE(NULL, crpc);
+	self->data.message_length = htonl(200000);
+	self->data.seg.offset = htonl(1400);
+	self->data.seg.segment_length = htonl(140000);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			140000, 1400), crpc, NULL, &self->incoming_delta);
+	mock_copy_to_user_dont_copy = -1;
+	EXPECT_EQ(0, -homa_copy_to_user(crpc));
+	EXPECT_EQ(2*HOMA_BPAGE_SIZE, homa_stream_end(crpc));
+
+	crpc->msgin.stream_offset = 2*HOMA_BPAGE_SIZE;
+	EXPECT_EQ(2*HOMA_BPAGE_SIZE, homa_stream_end(crpc));
+}
+TEST_F(homa_incoming, homa_stream_end__stop_at_gap)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id, 1000, 200000);
+	ASSERT_NE(NULL, crpc);
+	self->data.message_length = htonl(200000);
+	self->data.seg.offset = htonl(70000);
+	self->data.seg.segment_length = htonl(100000);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			100000, 70000), crpc, NULL, &self->incoming_delta);
+	mock_copy_to_user_dont_copy = -1;
+	EXPECT_EQ(0, -homa_copy_to_user(crpc));
+	EXPECT_EQ(0, homa_stream_end(crpc));
+
+	self->data.seg.offset = htonl(1400);
+	self->data.seg.segment_length = htonl(68600);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			68600, 1400), crpc, NULL, &self->incoming_delta);
+	EXPECT_EQ(0, -homa_copy_to_user(crpc));
+	EXPECT_EQ(2*HOMA_BPAGE_SIZE, homa_stream_end(crpc));
+}
+TEST_F(homa_incoming, homa_stream_end__limit_on_bpages)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id, 1000, 2000000);
+	ASSERT_NE(NULL, crpc);
+	self->data.message_length = htonl(2000000);
+	self->data.seg.offset = htonl(1400);
+	self->data.seg.segment_length = htonl(1998600);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1998600, 1400), crpc, NULL, &self->incoming_delta);
+	mock_copy_to_user_dont_copy = -1;
+	EXPECT_EQ(0, -homa_copy_to_user(crpc));
+	EXPECT_EQ(HOMA_MAX_BPAGES*HOMA_BPAGE_SIZE, homa_stream_end(crpc));
+
+	crpc->msgin.stream_offset = HOMA_MAX_BPAGES*HOMA_BPAGE_SIZE;
+	EXPECT_EQ(2000000, homa_stream_end(crpc));
+}
+TEST_F(homa_incoming, homa_copy_to_pinned__basics)
+{
+	struct homa_rpc *crpc;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 10000);
+	ASSERT_NE(NULL, crpc);
+	self->data.message_length = htonl(10000);
+	self->data.seg.offset = htonl(2800);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 2800), crpc, NULL, &self->incoming_delta);
+	EXPECT_EQ(2, skb_queue_len(&crpc->msgin.packets));
+	ASSERT_EQ(0, -homa_pool_pin(&self->hsk.buffer_pool));
+
+	unit_log_clear();
+	EXPECT_EQ(2, homa_copy_to_pinned(crpc));
+	EXPECT_SUBSTR("skb_copy_bits: 1400 bytes to 0x1000000", unit_log_get());
+	EXPECT_SUBSTR("skb_copy_bits: 1296 bytes to 0x1000af0", unit_log_get());
+	EXPECT_SUBSTR("skb_copy_bits: 104 bytes to 0x1001000", unit_log_get());
+	EXPECT_EQ(0, skb_queue_len(&crpc->msgin.packets));
+	EXPECT_EQ(2800, homa_cores[cpu_number]->metrics.softirq_copy_bytes);
+}
+TEST_F(homa_incoming, homa_copy_to_pinned__error_in_skb_copy_bits)
+{
+	struct homa_rpc *crpc;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 4000);
+	ASSERT_NE(NULL, crpc);
+	ASSERT_EQ(0, -homa_pool_pin(&self->hsk.buffer_pool));
+
+	unit_log_clear();
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(1, homa_copy_to_pinned(crpc));
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(0, skb_queue_len(&crpc->msgin.packets));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.softirq_copy_bytes);
+}
+
 TEST_F(homa_incoming, homa_get_resend_range__uninitialized_rpc)
 {
 	struct homa_message_in msgin;
@@ -786,6 +919,37 @@ TEST_F(homa_incoming, homa_get_resend_range__first_gap)
 	homa_get_resend_range(&crpc->msgin, &resend);
 	EXPECT_EQ(1400, ntohl(resend.offset));
 	EXPECT_EQ(2800, ntohl(resend.length));
+	EXPECT_EQ(0, resend.num_extra);
+}
+TEST_F(homa_incoming, homa_get_resend_range__multiple_gaps)
+{
+	struct resend_header resend;
+	int i;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, 99, 1000, 1000);
+	homa_message_in_init(crpc, 20000, 0);
+	unit_log_clear();
+
+	/* Every other packet arrives, leaving 5 gaps. */
+	for (i = 0; i < 6; i++) {
+		self->data.seg.offset = htonl(2800*i);
+		homa_add_packet(crpc, mock_skb_new(self->client_ip,
+				&self->data.common, 1400, 2800*i));
+	}
+	EXPECT_STREQ("start 1400, end 2800; start 4200, end 5600; "
+			"start 7000, end 8400; start 9800, end 11200; "
+			"start 12600, end 14000", unit_print_gaps(crpc));
+
+	/* Only the first 4 gaps fit in the RESEND. */
+	homa_get_resend_range(&crpc->msgin, &resend);
+	EXPECT_EQ(1400, ntohl(resend.offset));
+	EXPECT_EQ(1400, ntohl(resend.length));
+	EXPECT_EQ(3, resend.num_extra);
+	EXPECT_EQ(4200, ntohl(resend.extra_ranges[0].offset));
+	EXPECT_EQ(7000, ntohl(resend.extra_ranges[1].offset));
+	EXPECT_EQ(9800, ntohl(resend.extra_ranges[2].offset));
+	EXPECT_EQ(1400, ntohl(resend.extra_ranges[2].length));
 }
 TEST_F(homa_incoming, homa_get_resend_range__no_gaps)
 {
@@ -830,6 +994,55 @@ TEST_F(homa_incoming, homa_pkt_dispatch__handle_ack)
 	EXPECT_STREQ("DEAD", homa_symbol_for_state(srpc));
 	homa_sock_shutdown(&hsk);
 }
+TEST_F(homa_incoming, homa_pkt_dispatch__ack_in_grant)
+{
+	struct homa_sock hsk;
+	mock_sock_init(&hsk, &self->homa, self->server_port);
+	struct homa_rpc *srpc = unit_server_rpc(&hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 3000);
+	struct grant_header h = {{.sport = htons(self->client_port),
+	                .dport = htons(self->server_port),
+			.sender_id = cpu_to_be64(self->client_id+10),
+			.type = GRANT},
+			.offset = htonl(1000),
+			.priority = 3,
+			.ack = {.client_port = htons(self->client_port),
+			.server_port = htons(self->server_port),
+			.client_id = cpu_to_be64(self->client_id)}};
+	ASSERT_NE(NULL, srpc);
+	homa_pkt_dispatch(mock_skb_new(self->client_ip, &h.common, 0, 0),
+			&self->hsk, &self->lcache, &self->incoming_delta);
+	EXPECT_STREQ("DEAD", homa_symbol_for_state(srpc));
+	homa_sock_shutdown(&hsk);
+}
+TEST_F(homa_incoming, homa_pkt_dispatch__grant_too_short_for_ack)
+{
+	struct homa_sock hsk;
+	mock_sock_init(&hsk, &self->homa, self->server_port);
+	struct homa_rpc *srpc = unit_server_rpc(&hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 3000);
+	struct grant_header h = {{.sport = htons(self->client_port),
+	                .dport = htons(self->server_port),
+			.sender_id = cpu_to_be64(self->client_id+10),
+			.type = GRANT},
+			.offset = htonl(1000),
+			.priority = 3,
+			.ack = {.client_port = htons(self->client_port),
+			.server_port = htons(self->server_port),
+			.client_id = cpu_to_be64(self->client_id)}};
+	struct sk_buff *skb;
+	ASSERT_NE(NULL, srpc);
+
+	/* Packet from an older peer: the ack isn't part of it. */
+	skb = mock_skb_new(self->client_ip, &h.common, 0, 0);
+	skb->len = HOMA_GRANT_MIN_LENGTH;
+	homa_pkt_dispatch(skb, &self->hsk, &self->lcache,
+			&self->incoming_delta);
+	EXPECT_STREQ("OUTGOING", homa_symbol_for_state(srpc));
+	homa_sock_shutdown(&hsk);
+}
 TEST_F(homa_incoming, homa_pkt_dispatch__new_server_rpc)
 {
 	homa_pkt_dispatch(mock_skb_new(self->client_ip, &self->data.common,
@@ -1083,6 +1296,44 @@ TEST_F(homa_incoming, homa_data_pkt__basics)
 	EXPECT_EQ(1600, crpc->msgin.granted);
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.responses_received);
 }
+TEST_F(homa_incoming, homa_data_pkt__ecn_mark)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 5000);
+	struct sk_buff *skb;
+	ASSERT_NE(NULL, crpc);
+	crpc->msgout.next_xmit_offset = crpc->msgout.length;
+	self->data.message_length = htonl(5000);
+
+	/* First packet: mark ignored because ECN isn't enabled. */
+	skb = mock_skb_new(self->server_ip, &self->data.common, 1400, 0);
+	if (skb_is_ipv6(skb))
+		ipv6_change_dsfield(ipv6_hdr(skb), 0, INET_ECN_CE);
+	else
+		ip_hdr(skb)->tos = INET_ECN_CE;
+	homa_data_pkt(skb, crpc, NULL, &self->incoming_delta);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.cong_ecn_marks);
+	EXPECT_EQ(0, crpc->peer->cong_level);
+
+	/* Second packet: mark counted. */
+	self->homa.congestion_signal = HOMA_CONG_ECN;
+	self->data.seg.offset = htonl(1400);
+	skb = mock_skb_new(self->server_ip, &self->data.common, 1400, 1400);
+	if (skb_is_ipv6(skb))
+		ipv6_change_dsfield(ipv6_hdr(skb), 0, INET_ECN_CE);
+	else
+		ip_hdr(skb)->tos = INET_ECN_CE;
+	homa_data_pkt(skb, crpc, NULL, &self->incoming_delta);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.cong_ecn_marks);
+	EXPECT_EQ(1, crpc->peer->cong_level);
+
+	/* Third packet: no mark. */
+	self->data.seg.offset = htonl(2800);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 2800), crpc, NULL, &self->incoming_delta);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.cong_ecn_marks);
+}
 TEST_F(homa_incoming, homa_data_pkt__wrong_client_rpc_state)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -1149,6 +1400,7 @@ TEST_F(homa_incoming, homa_data_pkt__no_buffers)
 	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
 			1400, 0), crpc, NULL, &self->incoming_delta);
 	EXPECT_EQ(1400, homa_cores[cpu_number]->metrics.dropped_data_no_bufs);
+	EXPECT_EQ(1400, atomic64_read(&self->hsk.buffer_pool.dropped_bytes));
 	EXPECT_EQ(0, skb_queue_len(&crpc->msgin.packets));
 }
 TEST_F(homa_incoming, homa_data_pkt__update_delta)
@@ -1209,6 +1461,82 @@ TEST_F(homa_incoming, homa_data_pkt__handoff)
 			1400, 0), crpc, NULL, &self->incoming_delta);
 	EXPECT_STREQ("", unit_log_get());
 }
+TEST_F(homa_incoming, homa_data_pkt__softirq_copy)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 3000);
+	ASSERT_NE(NULL, crpc);
+	crpc->msgout.next_xmit_offset = crpc->msgout.length;
+	self->hsk.softirq_copy_length = 3000;
+	ASSERT_EQ(0, -homa_pool_pin(&self->hsk.buffer_pool));
+
+	/* First packet is copied, but no handoff yet. */
+	unit_log_clear();
+	self->data.message_length = htonl(3000);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 0), crpc, NULL, &self->incoming_delta);
+	EXPECT_SUBSTR("skb_copy_bits: 1400 bytes", unit_log_get());
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_responses));
+	EXPECT_EQ(1600, crpc->msgin.bytes_remaining);
+	EXPECT_EQ(0, skb_queue_len(&crpc->msgin.packets));
+
+	/* Last packet completes the message and triggers handoff. */
+	self->data.seg.offset = htonl(1400);
+	self->data.seg.segment_length = htonl(1600);
+	unit_log_clear();
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1600, 1400), crpc, NULL, &self->incoming_delta);
+	EXPECT_SUBSTR("skb_copy_bits: 1600 bytes", unit_log_get());
+	EXPECT_SUBSTR("sk->sk_data_ready invoked", unit_log_get());
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_responses));
+	EXPECT_EQ(0, crpc->msgin.bytes_remaining);
+	EXPECT_EQ(0, skb_queue_len(&crpc->msgin.packets));
+}
+TEST_F(homa_incoming, homa_data_pkt__softirq_copy_message_too_short)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 3000);
+	ASSERT_NE(NULL, crpc);
+	crpc->msgout.next_xmit_offset = crpc->msgout.length;
+	self->hsk.softirq_copy_length = 3001;
+	ASSERT_EQ(0, -homa_pool_pin(&self->hsk.buffer_pool));
+
+	unit_log_clear();
+	self->data.message_length = htonl(3000);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 0), crpc, NULL, &self->incoming_delta);
+	EXPECT_STREQ("sk->sk_data_ready invoked", unit_log_get());
+	EXPECT_EQ(1, skb_queue_len(&crpc->msgin.packets));
+}
+TEST_F(homa_incoming, homa_data_pkt__softirq_copy_streaming)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 200000);
+	ASSERT_NE(NULL, crpc);
+	crpc->msgout.next_xmit_offset = crpc->msgout.length;
+	self->hsk.softirq_copy_length = 3000;
+	self->hsk.streaming = 1;
+	ASSERT_EQ(0, -homa_pool_pin(&self->hsk.buffer_pool));
+
+	/* First packet doesn't fill a bpage: no handoff. */
+	self->data.message_length = htonl(200000);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 0), crpc, NULL, &self->incoming_delta);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_responses));
+
+	/* Second packet completes the first bpage. */
+	self->data.seg.offset = htonl(1400);
+	self->data.seg.segment_length = htonl(70000);
+	unit_log_clear();
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			70000, 1400), crpc, NULL, &self->incoming_delta);
+	EXPECT_SUBSTR("sk->sk_data_ready invoked", unit_log_get());
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_responses));
+	EXPECT_EQ(0, skb_queue_len(&crpc->msgin.packets));
+}
 TEST_F(homa_incoming, homa_data_pkt__not_scheduled_so_no_grantable_check)
 {
 	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
@@ -1331,6 +1659,37 @@ TEST_F(homa_incoming, homa_grant_pkt__basics)
 	/* Must restore old state to avoid potential crashes. */
 	srpc->state = RPC_OUTGOING;
 }
+TEST_F(homa_incoming, homa_grant_pkt__rtt_sample)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 20000);
+	ASSERT_NE(NULL, srpc);
+	mock_cycles = 1000;
+	homa_xmit_data(srpc, false);
+	EXPECT_EQ(1000, srpc->msgout.rtt_start);
+	unit_log_clear();
+
+	struct grant_header h = {{.sport = htons(srpc->dport),
+	                .dport = htons(self->hsk.port),
+			.sender_id = cpu_to_be64(self->client_id),
+			.type = GRANT},
+		        .offset = htonl(11000),
+			.priority = 3,
+			.resend_all = 0};
+	mock_cycles = 3500;
+	homa_pkt_dispatch(mock_skb_new(self->client_ip, &h.common, 0, 0),
+			&self->hsk, &self->lcache, &self->incoming_delta);
+	EXPECT_EQ(2500, srpc->peer->rtt_cycles);
+	EXPECT_EQ(0, srpc->msgout.rtt_start);
+
+	/* Later grants aren't used as samples. */
+	h.offset = htonl(12000);
+	mock_cycles = 10000;
+	homa_pkt_dispatch(mock_skb_new(self->client_ip, &h.common, 0, 0),
+			&self->hsk, &self->lcache, &self->incoming_delta);
+	EXPECT_EQ(2500, srpc->peer->rtt_cycles);
+}
 TEST_F(homa_incoming, homa_grant_pkt__reset)
 {
 	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_OUTGOING,
@@ -1477,6 +1836,58 @@ TEST_F(homa_incoming, homa_resend_pkt__client_send_data)
 	EXPECT_STREQ("xmit DATA retrans 1400@0", unit_log_get());
 	EXPECT_STREQ("3", mock_xmit_prios);
 }
+TEST_F(homa_incoming, homa_resend_pkt__extra_ranges)
+{
+	struct resend_header h = {{.sport = htons(self->server_port),
+	                .dport = htons(self->client_port),
+			.sender_id = cpu_to_be64(self->server_id),
+			.type = RESEND},
+		        .offset = htonl(100),
+			.length = htonl(200),
+			.priority = 3,
+			.num_extra = 2,
+			.extra_ranges = {{htonl(2900), htonl(100)},
+			{htonl(5600), htonl(1400)}}};
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 10000, 100);
+	ASSERT_NE(NULL, crpc);
+	homa_xmit_data(crpc, false);
+	unit_log_clear();
+
+	homa_pkt_dispatch(mock_skb_new(self->server_ip, &h.common, 0, 0),
+			&self->hsk, &self->lcache, &self->incoming_delta);
+	EXPECT_STREQ("xmit DATA retrans 1400@0; "
+			"xmit DATA retrans 1400@2800; "
+			"xmit DATA retrans 1400@5600", unit_log_get());
+}
+TEST_F(homa_incoming, homa_resend_pkt__extra_ranges_missing_from_packet)
+{
+	struct resend_header h = {{.sport = htons(self->server_port),
+	                .dport = htons(self->client_port),
+			.sender_id = cpu_to_be64(self->server_id),
+			.type = RESEND},
+		        .offset = htonl(100),
+			.length = htonl(200),
+			.priority = 3,
+			.num_extra = 2,
+			.extra_ranges = {{htonl(2900), htonl(100)},
+			{htonl(5600), htonl(1400)}}};
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 10000, 100);
+	struct sk_buff *skb;
+	ASSERT_NE(NULL, crpc);
+	homa_xmit_data(crpc, false);
+	unit_log_clear();
+
+	/* Packet from an older peer: header ends after priority. */
+	skb = mock_skb_new(self->server_ip, &h.common, 0, 0);
+	skb->len = HOMA_RESEND_MIN_LENGTH;
+	homa_pkt_dispatch(skb, &self->hsk, &self->lcache,
+			&self->incoming_delta);
+	EXPECT_STREQ("xmit DATA retrans 1400@0", unit_log_get());
+}
 TEST_F(homa_incoming, homa_resend_pkt__server_send_data)
 {
 	struct resend_header h = {{.sport = htons(self->client_port),
@@ -1781,6 +2192,38 @@ TEST_F(homa_incoming, homa_check_grantable__update_statistics)
 	EXPECT_EQ(4, self->homa.max_grantable_rpcs);
 	EXPECT_EQ(5000, self->homa.last_grantable_change);
 }
+TEST_F(homa_incoming, homa_check_grantable__socket_weight)
+{
+	struct homa_rpc *srpc1, *srpc2;
+
+	self->hsk.weight = 3;
+	srpc1 = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 1, 100000, 100);
+	srpc2 = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 3, 50000, 100);
+	EXPECT_EQ(2, self->hsk.num_grantable);
+	EXPECT_EQ(3, self->homa.grantable_weight);
+
+	homa_remove_from_grantable(&self->homa, srpc1);
+	EXPECT_EQ(1, self->hsk.num_grantable);
+	EXPECT_EQ(3, self->homa.grantable_weight);
+	homa_remove_from_grantable(&self->homa, srpc2);
+	EXPECT_EQ(0, self->hsk.num_grantable);
+	EXPECT_EQ(0, self->homa.grantable_weight);
+}
+TEST_F(homa_incoming, homa_check_grantable__freeze_trigger)
+{
+	self->homa.freeze_grantable_rpcs = 2;
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 1, 100000, 100);
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 3, 50000, 100);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.freeze_triggers);
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 5, 120000, 100);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.freeze_triggers);
+	EXPECT_TRUE(tt_frozen);
+}
 TEST_F(homa_incoming, homa_check_grantable__insert_in_grantable_rpcs)
 {
 	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
@@ -1889,18 +2332,78 @@ TEST_F(homa_incoming, homa_check_grantable__age_tiebreaker_in_grantable_rpcs)
 			"request from 196.168.0.1, id 5, remaining 28600",
 			unit_log_get());
 }
-
-TEST_F(homa_incoming, homa_send_grants__basics)
+TEST_F(homa_incoming, homa_check_grantable__multiple_peers)
 {
-	struct homa_rpc *srpc1;
+	struct homa_rpc *srpc1, *srpc3;
 	srpc1 = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
-			self->server_ip, self->client_port, 1, 20000, 100);
+			self->server_ip, self->client_port, 1, 40000, 100);
 	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip+1,
 			self->server_ip, self->client_port, 3, 30000, 100);
-	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip+2,
-			self->server_ip, self->client_port, 5, 40000, 100);
-
-	/* Can grant only the first message and part of the second. */
+	srpc3 = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			self->client_ip+1, self->server_ip, self->client_port,
+			5, 20000, 100);
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 7, 50000, 100);
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("request from 197.168.0.1, id 5, remaining 18600; "
+			"request from 197.168.0.1, id 3, remaining 28600; "
+			"request from 196.168.0.1, id 1, remaining 38600; "
+			"request from 196.168.0.1, id 7, remaining 48600",
+			unit_log_get());
+	EXPECT_EQ(2, unit_list_length(&self->homa.grantable_peers));
+
+	/* Peer moves to the front when its first RPC improves. */
+	srpc1->msgin.bytes_remaining = 10000;
+	homa_check_grantable(srpc1);
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("request from 196.168.0.1, id 1, remaining 10000; "
+			"request from 196.168.0.1, id 7, remaining 48600; "
+			"request from 197.168.0.1, id 5, remaining 18600; "
+			"request from 197.168.0.1, id 3, remaining 28600",
+			unit_log_get());
+
+	/* Peer moves back when its first RPC is removed. */
+	homa_grantable_lock(&self->homa);
+	homa_remove_grantable_locked(&self->homa, srpc1);
+	homa_grantable_unlock(&self->homa);
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("request from 197.168.0.1, id 5, remaining 18600; "
+			"request from 197.168.0.1, id 3, remaining 28600; "
+			"request from 196.168.0.1, id 7, remaining 48600",
+			unit_log_get());
+
+	/* Peer disappears when its last RPC is removed. */
+	homa_grantable_lock(&self->homa);
+	homa_remove_grantable_locked(&self->homa, srpc3);
+	homa_grantable_unlock(&self->homa);
+	srpc3 = homa_find_server_rpc(&self->hsk, self->client_ip+1,
+			self->client_port, 3);
+	ASSERT_NE(NULL, srpc3);
+	homa_rpc_unlock(srpc3);
+	homa_grantable_lock(&self->homa);
+	homa_remove_grantable_locked(&self->homa, srpc3);
+	homa_grantable_unlock(&self->homa);
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("request from 196.168.0.1, id 7, remaining 48600",
+			unit_log_get());
+	EXPECT_EQ(1, unit_list_length(&self->homa.grantable_peers));
+}
+
+TEST_F(homa_incoming, homa_send_grants__basics)
+{
+	struct homa_rpc *srpc1;
+	srpc1 = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 1, 20000, 100);
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip+1,
+			self->server_ip, self->client_port, 3, 30000, 100);
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip+2,
+			self->server_ip, self->client_port, 5, 40000, 100);
+
+	/* Can grant only the first message and part of the second. */
 	atomic_set(&self->homa.total_incoming, 10000);
 	self->homa.max_incoming = 11600;
 	unit_log_clear();
@@ -2003,6 +2506,71 @@ TEST_F(homa_incoming, homa_send_grants__grant_fifo_but_granted_changed)
 	homa_send_grants(&self->homa);
 	EXPECT_STREQ("xmit GRANT 11400@0", unit_log_get());
 }
+TEST_F(homa_incoming, homa_send_grants__lock_busy)
+{
+	struct homa_rpc *srpc;
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 1, 20000, 100);
+	ASSERT_NE(NULL, srpc);
+	unit_log_clear();
+	mock_trylock_errors = 1;
+	homa_send_grants(&self->homa);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(10000, srpc->msgin.granted);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.grant_recalc_skips);
+}
+TEST_F(homa_incoming, homa_send_grants__recalc_for_other_core)
+{
+	struct homa_rpc *srpc;
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 1, 20000, 100);
+	ASSERT_NE(NULL, srpc);
+	atomic_set(&self->homa.total_incoming, 10000);
+	self->homa.max_incoming = 10600;
+	unit_log_clear();
+	hook_rpc = srpc;
+	recalc_count = 1;
+	unit_hook_register(recalc_hook);
+	homa_send_grants(&self->homa);
+	EXPECT_STREQ("xmit GRANT 10600@0; xmit GRANT 11400@0", unit_log_get());
+	EXPECT_EQ(11400, srpc->msgin.granted);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.grant_recalc_retries);
+}
+TEST_F(homa_incoming, homa_send_grants__recalc_limit)
+{
+	struct homa_rpc *srpc;
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 1, 20000, 100);
+	ASSERT_NE(NULL, srpc);
+	atomic_set(&self->homa.total_incoming, 10000);
+	self->homa.max_incoming = 10600;
+	hook_rpc = srpc;
+	recalc_count = 10;
+	unit_hook_register(recalc_hook);
+	homa_send_grants(&self->homa);
+	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.grant_recalc_retries);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.grant_recalc_limits);
+	EXPECT_TRUE(homa_grants_pending(&self->homa));
+}
+TEST_F(homa_incoming, homa_grantable_unlock__computes_pending_grants)
+{
+	struct homa_rpc *srpc;
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 1, 20000, 100);
+	ASSERT_NE(NULL, srpc);
+	atomic_set(&self->homa.total_incoming, 10000);
+	self->homa.max_incoming = 11600;
+	homa_grantable_lock(&self->homa);
+
+	/* Simulate another core giving up on grantable_lock. */
+	mock_trylock_errors = 1;
+	homa_send_grants(&self->homa);
+	EXPECT_TRUE(homa_grants_pending(&self->homa));
+	unit_log_clear();
+	homa_grantable_unlock(&self->homa);
+	EXPECT_STREQ("xmit GRANT 11400@0", unit_log_get());
+	EXPECT_FALSE(homa_grants_pending(&self->homa));
+}
 
 TEST_F(homa_incoming, homa_choose_rpcs_to_grant)
 {
@@ -2035,6 +2603,102 @@ TEST_F(homa_incoming, homa_choose_rpcs_to_grant)
 	EXPECT_EQ(11, rpcs[4]->id);
 }
 
+TEST_F(homa_incoming, homa_choose_rpcs_to_grant__no_buffer_space)
+{
+	struct homa_rpc *srpc1 = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->client_port,
+			1, 20000, 100);
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip+1,
+			self->server_ip, self->client_port, 3, 30000, 100);
+	int num_bpages = srpc1->msgin.num_bpages;
+
+	srpc1->msgin.num_bpages = 0;
+	struct homa_rpc *rpcs[10];
+	int count = homa_choose_rpcs_to_grant(&self->homa, rpcs, 10);
+	ASSERT_EQ(1, count);
+	EXPECT_EQ(3, rpcs[0]->id);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.grant_no_bufs_skips);
+	EXPECT_EQ(1, atomic64_read(&self->hsk.buffer_pool.grant_skips));
+	srpc1->msgin.num_bpages = num_bpages;
+}
+
+TEST_F(homa_incoming, homa_choose_rpcs_to_grant__weighted_shares)
+{
+	struct homa_sock hsk2;
+	struct homa_rpc *rpcs[10];
+	int count;
+
+	mock_sock_init(&hsk2, &self->homa, self->server_port+1);
+	hsk2.weight = 3;
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 1, 20000, 100);
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip+1,
+			self->server_ip, self->client_port, 3, 30000, 100);
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip+2,
+			self->server_ip, self->client_port, 5, 40000, 100);
+	unit_server_rpc(&hsk2, UNIT_RCVD_ONE_PKT, self->client_ip+3,
+			self->server_ip, self->client_port, 7, 50000, 100);
+	unit_server_rpc(&hsk2, UNIT_RCVD_ONE_PKT, self->client_ip+4,
+			self->server_ip, self->client_port, 9, 60000, 100);
+	unit_server_rpc(&hsk2, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 11, 70000, 100);
+	self->homa.max_rpcs_per_peer = 2;
+	EXPECT_EQ(4, self->homa.grantable_weight);
+
+	/* Without weights: pure SRPT. */
+	count = homa_choose_rpcs_to_grant(&self->homa, rpcs, 4);
+	ASSERT_EQ(4, count);
+	EXPECT_EQ(1, rpcs[0]->id);
+	EXPECT_EQ(3, rpcs[1]->id);
+	EXPECT_EQ(5, rpcs[2]->id);
+	EXPECT_EQ(7, rpcs[3]->id);
+
+	/* With weights: hsk gets 1 slot, hsk2 gets 3. */
+	self->homa.weighted_shares = 1;
+	count = homa_choose_rpcs_to_grant(&self->homa, rpcs, 4);
+	ASSERT_EQ(4, count);
+	EXPECT_EQ(1, rpcs[0]->id);
+	EXPECT_EQ(7, rpcs[1]->id);
+	EXPECT_EQ(9, rpcs[2]->id);
+	EXPECT_EQ(11, rpcs[3]->id);
+	EXPECT_EQ(2, self->hsk.share_limited);
+	EXPECT_EQ(0, hsk2.share_limited);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.share_limited_rpcs);
+	homa_sock_shutdown(&hsk2);
+}
+TEST_F(homa_incoming, homa_choose_rpcs_to_grant__fill_unused_shares)
+{
+	struct homa_sock hsk2;
+	struct homa_rpc *rpcs[10];
+	int count;
+
+	mock_sock_init(&hsk2, &self->homa, self->server_port+1);
+	hsk2.weight = 3;
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 1, 20000, 100);
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip+1,
+			self->server_ip, self->client_port, 3, 30000, 100);
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip+2,
+			self->server_ip, self->client_port, 5, 60000, 100);
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip+2,
+			self->server_ip, self->client_port, 7, 70000, 100);
+	unit_server_rpc(&hsk2, UNIT_RCVD_ONE_PKT, self->client_ip+3,
+			self->server_ip, self->client_port, 9, 50000, 100);
+	self->homa.max_rpcs_per_peer = 1;
+	self->homa.weighted_shares = 1;
+
+	/* hsk2 can only use 1 of its 3 slots; the others go to hsk, but
+	 * the per-peer limit still applies.
+	 */
+	count = homa_choose_rpcs_to_grant(&self->homa, rpcs, 5);
+	ASSERT_EQ(4, count);
+	EXPECT_EQ(1, rpcs[0]->id);
+	EXPECT_EQ(3, rpcs[1]->id);
+	EXPECT_EQ(9, rpcs[2]->id);
+	EXPECT_EQ(5, rpcs[3]->id);
+	homa_sock_shutdown(&hsk2);
+}
+
 TEST_F(homa_incoming, homa_create_grants__basics)
 {
 	struct homa_rpc *rpcs[3];
@@ -2062,6 +2726,7 @@ TEST_F(homa_incoming, homa_create_grants__basics)
 
 	EXPECT_EQ(11600, atomic_read(&self->homa.total_incoming));
 	EXPECT_EQ(8400, self->homa.grant_nonfifo_left);
+	EXPECT_EQ(1600, self->hsk.granted_bytes);
 
 	for (int i = 0; i < num_grants; i++)
 		atomic_set(&rpcs[i]->grants_in_progress, 0);
@@ -2085,6 +2750,57 @@ TEST_F(homa_incoming, homa_create_grants__dynamic_windows)
 
 	atomic_set(&rpcs[0]->grants_in_progress, 0);
 }
+TEST_F(homa_incoming, homa_create_grants__peer_rtt)
+{
+	struct homa_rpc *rpcs[1];
+	struct grant_header grants[1];
+	int num_grants;
+	rpcs[0] = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->client_port,
+			1, 100000, 100);
+	self->homa.peer_rtt = 1;
+	homa_nic_find(&self->homa, rpcs[0]->peer->dst->dev)->cycles_per_kbyte
+			= 1000;
+	rpcs[0]->peer->rtt_cycles = 20000;
+	num_grants = homa_create_grants(&self->homa, rpcs, 1, grants, 100000);
+	EXPECT_EQ(1, num_grants);
+	EXPECT_EQ(21400, ntohl(grants[0].offset));
+
+	atomic_set(&rpcs[0]->grants_in_progress, 0);
+}
+TEST_F(homa_incoming, homa_create_grants__peer_congested)
+{
+	struct homa_rpc *rpcs[1];
+	struct grant_header grants[1];
+	int num_grants;
+	rpcs[0] = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->client_port,
+			1, 100000, 100);
+	self->homa.window = 40000;
+	self->homa.congestion_signal = HOMA_CONG_RESENDS;
+	self->homa.timer_ticks = 100;
+	rpcs[0]->peer->cong_level = 1;
+	rpcs[0]->peer->cong_ticks = 100;
+	num_grants = homa_create_grants(&self->homa, rpcs, 1, grants, 100000);
+	EXPECT_EQ(1, num_grants);
+	EXPECT_EQ(21400, ntohl(grants[0].offset));
+	EXPECT_EQ(20000, homa_cores[cpu_number]->metrics.cong_limited_bytes);
+
+	/* The same withheld bytes aren't counted again. */
+	atomic_set(&rpcs[0]->grants_in_progress, 0);
+	num_grants = homa_create_grants(&self->homa, rpcs, 1, grants, 100000);
+	EXPECT_EQ(0, num_grants);
+	EXPECT_EQ(20000, homa_cores[cpu_number]->metrics.cong_limited_bytes);
+
+	/* More data arrives; only the newly withheld bytes are counted. */
+	rpcs[0]->msgin.bytes_remaining -= 5000;
+	num_grants = homa_create_grants(&self->homa, rpcs, 1, grants, 100000);
+	EXPECT_EQ(1, num_grants);
+	EXPECT_EQ(26400, ntohl(grants[0].offset));
+	EXPECT_EQ(25000, homa_cores[cpu_number]->metrics.cong_limited_bytes);
+
+	atomic_set(&rpcs[0]->grants_in_progress, 0);
+}
 TEST_F(homa_incoming, homa_create_grants__truncate_grant_to_message_length)
 {
 	struct homa_rpc *rpcs[1];
@@ -2353,6 +3069,8 @@ TEST_F(homa_incoming, homa_remove_grantable_locked__update_statistics)
 	homa_remove_from_grantable(&self->homa, srpc);
 	EXPECT_EQ(6000, homa_cores[cpu_number]->metrics.grantable_rpcs_integral);
 	EXPECT_EQ(2500, self->homa.last_grantable_change);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.latency
+			[HOMA_LAT_GRANTABLE][2][10]);
 }
 
 TEST_F(homa_incoming, homa_remove_from_grantable__basics)
@@ -2575,6 +3293,45 @@ TEST_F(homa_incoming, homa_abort_rpcs__free_server_rpc)
 	unit_log_clear();
 	homa_abort_rpcs(&self->homa, self->client_ip, 0, 0);
 	EXPECT_EQ(RPC_DEAD, srpc->state);
+	EXPECT_EQ(0, srpc->peer->num_rpcs);
+}
+TEST_F(homa_incoming, homa_abort_rpcs__no_such_peer)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 1600);
+	int num_peers = self->homa.peers.num_peers;
+
+	ASSERT_NE(NULL, crpc);
+	homa_abort_rpcs(&self->homa, self->server_ip+1, 0, -ENOTCONN);
+	EXPECT_EQ(num_peers, self->homa.peers.num_peers);
+	EXPECT_EQ(0, crpc->error);
+}
+TEST_F(homa_incoming, homa_abort_peer_rpcs__multiple_batches)
+{
+	struct homa_rpc *crpcs[HOMA_ABORT_BATCH + 5];
+	struct homa_rpc *srpc;
+	int i;
+
+	for (i = 0; i < HOMA_ABORT_BATCH + 5; i++) {
+		crpcs[i] = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
+				self->client_ip, self->server_ip,
+				self->server_port, self->client_id + 2*i,
+				5000, 1600);
+		ASSERT_NE(NULL, crpcs[i]);
+	}
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->server_ip,
+			self->client_ip, self->client_port, self->server_id,
+			20000, 100);
+	ASSERT_NE(NULL, srpc);
+	EXPECT_EQ(HOMA_ABORT_BATCH + 6, srpc->peer->num_rpcs);
+	homa_abort_peer_rpcs(srpc->peer, 0, -ENOTCONN);
+	for (i = 0; i < HOMA_ABORT_BATCH + 5; i++)
+		EXPECT_EQ(ENOTCONN, -crpcs[i]->error);
+	EXPECT_EQ(RPC_DEAD, srpc->state);
+	EXPECT_EQ(HOMA_ABORT_BATCH + 5, crpcs[0]->peer->num_rpcs);
+	EXPECT_EQ(HOMA_ABORT_BATCH + 5,
+			unit_list_length(&self->hsk.ready_responses));
 }
 
 TEST_F(homa_incoming, homa_abort_sock_rpcs__basics)
@@ -2682,6 +3439,31 @@ TEST_F(homa_incoming, homa_register_interests__return_response_by_id)
 			atomic_long_read(&self->interest.ready_rpc));
 	homa_rpc_unlock(crpc);
 }
+TEST_F(homa_incoming, homa_register_interests__publish_steer_hint)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	ASSERT_NE(NULL, crpc);
+
+	int result = homa_register_interests(&self->interest, &self->hsk,
+			0, self->client_id);
+	EXPECT_EQ(0, result);
+	EXPECT_EQ(-1, self->homa.steer_cores[homa_steer_slot(self->hsk.port,
+			0)]);
+	crpc->interest = NULL;
+
+	self->homa.gro_policy |= HOMA_GRO_STEER;
+	cpu_number = 3;
+	result = homa_register_interests(&self->interest, &self->hsk,
+			0, self->client_id);
+	EXPECT_EQ(0, result);
+	EXPECT_EQ(3, self->homa.steer_cores[homa_steer_slot(self->hsk.port,
+			0)]);
+	EXPECT_EQ(3, self->homa.steer_cores[homa_steer_slot(self->hsk.port,
+			self->client_id)]);
+	crpc->interest = NULL;
+}
 TEST_F(homa_incoming, homa_register_interests__socket_shutdown)
 {
 	int result;
@@ -2857,6 +3639,23 @@ TEST_F(homa_incoming, homa_wait_for_message__nothing_ready_nonblocking)
 			self->client_id);
 	EXPECT_EQ(EAGAIN, -PTR_ERR(rpc));
 }
+TEST_F(homa_incoming, homa_wait_for_message__record_receiving_node)
+{
+	struct homa_rpc *rpc;
+
+	mock_numa_node = 1;
+	rpc = homa_wait_for_message(&self->hsk,
+			HOMA_RECVMSG_NONBLOCKING|HOMA_RECVMSG_RESPONSE, 0);
+	EXPECT_EQ(EAGAIN, -PTR_ERR(rpc));
+	EXPECT_EQ(0, self->hsk.buffer_pool.recv_node);
+
+	self->hsk.buffer_pool.num_nodes = 2;
+	rpc = homa_wait_for_message(&self->hsk,
+			HOMA_RECVMSG_NONBLOCKING|HOMA_RECVMSG_RESPONSE, 0);
+	EXPECT_EQ(EAGAIN, -PTR_ERR(rpc));
+	EXPECT_EQ(1, self->hsk.buffer_pool.recv_node);
+	self->hsk.buffer_pool.num_nodes = 0;
+}
 TEST_F(homa_incoming, homa_wait_for_message__rpc_arrives_while_sleeping)
 {
 	struct homa_rpc *rpc;
@@ -3036,6 +3835,84 @@ TEST_F(homa_incoming, homa_wait_for_message__message_complete)
 			& (RPC_PKTS_READY|RPC_COPYING_TO_USER));
 	homa_rpc_unlock(rpc);
 }
+TEST_F(homa_incoming, homa_wait_for_message__stream_piece_available)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 200000);
+	ASSERT_NE(NULL, crpc);
+	self->data.message_length = htonl(200000);
+	self->data.seg.offset = htonl(1400);
+	self->data.seg.segment_length = htonl(70000);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			70000, 1400), crpc, NULL, &self->incoming_delta);
+	mock_copy_to_user_dont_copy = -1;
+
+	rpc = homa_wait_for_message(&self->hsk, HOMA_RECVMSG_RESPONSE
+			|HOMA_RECVMSG_NONBLOCKING|HOMA_RECVMSG_STREAM, 0);
+	ASSERT_FALSE(IS_ERR(rpc));
+	EXPECT_EQ(crpc, rpc);
+	EXPECT_EQ(0, skb_queue_len(&crpc->msgin.packets));
+	homa_rpc_unlock(rpc);
+}
+TEST_F(homa_incoming, homa_wait_for_message__stream_nothing_available)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 200000);
+	ASSERT_NE(NULL, crpc);
+	mock_copy_to_user_dont_copy = -1;
+
+	rpc = homa_wait_for_message(&self->hsk, HOMA_RECVMSG_RESPONSE
+			|HOMA_RECVMSG_NONBLOCKING|HOMA_RECVMSG_STREAM, 0);
+	EXPECT_EQ(EAGAIN, -PTR_ERR(rpc));
+}
+TEST_F(homa_incoming, homa_wait_for_message__record_latency)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc;
+
+	mock_cycles = 1000;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			20000, 2000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(1000, crpc->cold->handoff_cycles);
+	mock_cycles = 3000;
+	rpc = homa_wait_for_message(&self->hsk,
+			HOMA_RECVMSG_RESPONSE|HOMA_RECVMSG_NONBLOCKING, 0);
+	ASSERT_FALSE(IS_ERR(rpc));
+	EXPECT_EQ(crpc, rpc);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.latency
+			[HOMA_LAT_HANDOFF][1][10]);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.latency
+			[HOMA_LAT_COPY_OUT][1][0]);
+	homa_rpc_unlock(rpc);
+}
+TEST_F(homa_incoming, homa_wait_for_message__no_handoff_latency)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc;
+
+	mock_cycles = 1000;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			20000, 2000);
+	ASSERT_NE(NULL, crpc);
+	crpc->cold->handoff_cycles = 0;
+	mock_cycles = 3000;
+	rpc = homa_wait_for_message(&self->hsk,
+			HOMA_RECVMSG_RESPONSE|HOMA_RECVMSG_NONBLOCKING, 0);
+	ASSERT_FALSE(IS_ERR(rpc));
+	EXPECT_EQ(crpc, rpc);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.latency
+			[HOMA_LAT_HANDOFF][1][11]);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.latency
+			[HOMA_LAT_COPY_OUT][1][0]);
+	homa_rpc_unlock(rpc);
+}
 TEST_F(homa_incoming, homa_wait_for_message__signal)
 {
 	struct homa_rpc *rpc;
@@ -3049,7 +3926,7 @@ TEST_F(homa_incoming, homa_choose_interest__empty_list)
 {
 	struct homa_interest *result = homa_choose_interest(&self->homa,
 			&self->hsk.request_interests,
-			offsetof(struct homa_interest, request_links));
+			offsetof(struct homa_interest, request_links), NULL);
 	EXPECT_EQ(NULL, result);
 }
 TEST_F(homa_incoming, homa_choose_interest__find_idle_core)
@@ -3073,7 +3950,7 @@ TEST_F(homa_incoming, homa_choose_interest__find_idle_core)
 
 	struct homa_interest *result = homa_choose_interest(&self->homa,
 			&self->hsk.request_interests,
-			offsetof(struct homa_interest, request_links));
+			offsetof(struct homa_interest, request_links), NULL);
 	ASSERT_NE(NULL, result);
 	EXPECT_EQ(2, result->core);
 	INIT_LIST_HEAD(&self->hsk.request_interests);
@@ -3099,12 +3976,112 @@ TEST_F(homa_incoming, homa_choose_interest__all_cores_busy)
 
 	struct homa_interest *result = homa_choose_interest(&self->homa,
 			&self->hsk.request_interests,
-			offsetof(struct homa_interest, request_links));
+			offsetof(struct homa_interest, request_links), NULL);
 	ASSERT_NE(NULL, result);
 	EXPECT_EQ(1, result->core);
 	INIT_LIST_HEAD(&self->hsk.request_interests);
 }
+TEST_F(homa_incoming, homa_choose_interest__locality)
+{
+	struct homa_interest interest1, interest2, interest3, *result;
+	struct homa_peer *peer = homa_peer_find(&self->homa.peers,
+			self->server_ip, &self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	homa_interest_init(&interest1);
+	interest1.core = 1;
+	list_add_tail(&interest1.request_links, &self->hsk.request_interests);
+	homa_interest_init(&interest2);
+	interest2.core = 2;
+	list_add_tail(&interest2.request_links, &self->hsk.request_interests);
+	homa_interest_init(&interest3);
+	interest3.core = 3;
+	list_add_tail(&interest3.request_links, &self->hsk.request_interests);
+
+	mock_cycles = 5000;
+	self->homa.busy_cycles = 1000;
+	homa_cores[1]->last_active = 2000;
+	homa_cores[2]->last_active = 2000;
+	homa_cores[3]->last_active = 2000;
+	homa_cores[1]->numa_node = 1;
+
+	/* Prefer a core on the current node. */
+	result = homa_choose_interest(&self->homa,
+			&self->hsk.request_interests,
+			offsetof(struct homa_interest, request_links), peer);
+	EXPECT_EQ(2, result->core);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.handoffs_alt_thread);
+
+	/* Stick with the peer's previous core, even if on another node. */
+	peer->handoff_core = 3;
+	homa_cores[3]->numa_node = 1;
+	result = homa_choose_interest(&self->homa,
+			&self->hsk.request_interests,
+			offsetof(struct homa_interest, request_links), peer);
+	EXPECT_EQ(3, result->core);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.handoffs_sticky);
+
+	/* Previous core is busy. */
+	homa_cores[3]->last_active = 4500;
+	result = homa_choose_interest(&self->homa,
+			&self->hsk.request_interests,
+			offsetof(struct homa_interest, request_links), peer);
+	EXPECT_EQ(2, result->core);
+
+	/* Locality disabled. */
+	self->homa.handoff_locality = 0;
+	homa_cores[3]->last_active = 2000;
+	result = homa_choose_interest(&self->homa,
+			&self->hsk.request_interests,
+			offsetof(struct homa_interest, request_links), peer);
+	EXPECT_EQ(1, result->core);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.handoffs_sticky);
+	INIT_LIST_HEAD(&self->hsk.request_interests);
+	homa_peer_put(peer);
+}
+
+TEST_F(homa_incoming, homa_poll_record_arrival)
+{
+	homa_poll_record_arrival(&self->hsk, 1000);
+	EXPECT_EQ(1000, self->hsk.last_arrival);
+	EXPECT_EQ(0, self->hsk.avg_interarrival);
+
+	homa_poll_record_arrival(&self->hsk, 1800);
+	EXPECT_EQ(1800, self->hsk.last_arrival);
+	EXPECT_EQ(800, self->hsk.avg_interarrival);
+
+	homa_poll_record_arrival(&self->hsk, 3400);
+	EXPECT_EQ(900, self->hsk.avg_interarrival);
+}
+TEST_F(homa_incoming, homa_poll_budget)
+{
+	self->homa.poll_cycles = 1000;
+	self->hsk.avg_interarrival = 100;
+
+	/* Adaptive polling disabled. */
+	EXPECT_EQ(1000, homa_poll_budget(&self->hsk));
 
+	/* Rearm after a sleep. */
+	self->homa.adaptive_poll = 1;
+	self->hsk.poll_rearm = 1;
+	EXPECT_EQ(1000, homa_poll_budget(&self->hsk));
+	EXPECT_EQ(0, self->hsk.poll_rearm);
+
+	/* Twice the average interval. */
+	EXPECT_EQ(200, homa_poll_budget(&self->hsk));
+
+	/* Capped at poll_cycles. */
+	self->hsk.avg_interarrival = 600;
+	EXPECT_EQ(1000, homa_poll_budget(&self->hsk));
+
+	/* No estimate yet. */
+	self->hsk.avg_interarrival = 0;
+	EXPECT_EQ(1000, homa_poll_budget(&self->hsk));
+
+	/* Messages arrive too slowly to be worth polling. */
+	self->hsk.avg_interarrival = 1001;
+	EXPECT_EQ(0, homa_poll_budget(&self->hsk));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.poll_skips);
+}
 TEST_F(homa_incoming, homa_rpc_handoff__handoff_already_in_progress)
 {
 	struct homa_interest interest;
@@ -3179,6 +4156,24 @@ TEST_F(homa_incoming, homa_rpc_handoff__interest_on_rpc)
 	EXPECT_STREQ("wake_up_process pid 0", unit_log_get());
 	atomic_andnot(RPC_HANDING_OFF, &crpc->flags);
 }
+TEST_F(homa_incoming, homa_rpc_handoff__locality_info)
+{
+	struct homa_interest interest;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	ASSERT_NE(NULL, crpc);
+
+	homa_interest_init(&interest);
+	interest.thread = &mock_task;
+	interest.core = 4;
+	homa_cores[4]->numa_node = 1;
+	list_add_tail(&interest.response_links, &self->hsk.response_interests);
+	homa_rpc_handoff(crpc);
+	EXPECT_EQ(4, crpc->peer->handoff_core);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.handoffs_cross_node);
+	atomic_andnot(RPC_HANDING_OFF, &crpc->flags);
+}
 TEST_F(homa_incoming, homa_rpc_handoff__response_interests)
 {
 	struct homa_interest interest;
@@ -234,6 +234,27 @@ TEST_F(homa_offload, homa_gro_receive__no_held_skb)
 	EXPECT_EQ(3, homa_cores[cpu_number]->held_bucket);
 	kfree_skb(skb);
 }
+TEST_F(homa_offload, homa_gro_receive__steer_to_receiver)
+{
+	struct sk_buff *skb;
+	homa->gro_policy = HOMA_GRO_STEER|HOMA_GRO_SAME_CORE;
+	mock_cycles = 5000;
+	homa->busy_cycles = 1000;
+	homa_steer_publish(homa, 88, 0, 6);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	homa_cores[cpu_number]->held_skb = NULL;
+	EXPECT_EQ(NULL, homa_gro_receive(&self->empty_list, skb));
+	EXPECT_EQ(6, skb->hash - 32);
+	kfree_skb(skb);
+
+	/* No hint for the destination port. */
+	self->header.common.dport = htons(89);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	homa_cores[cpu_number]->held_skb = NULL;
+	EXPECT_EQ(NULL, homa_gro_receive(&self->empty_list, skb));
+	EXPECT_EQ(cpu_number, skb->hash - 32);
+	kfree_skb(skb);
+}
 TEST_F(homa_offload, homa_gro_receive__empty_merge_list)
 {
 	struct sk_buff *skb;
@@ -284,6 +305,230 @@ TEST_F(homa_offload, homa_gro_receive__merge)
 			"data_length 1400, incoming 10000",
 			unit_log_get());
 }
+TEST_F(homa_offload, homa_gro_receive__merge_control_packets)
+{
+	struct grant_header grant = {{.sport = htons(40000),
+			.dport = htons(99),
+			.sender_id = cpu_to_be64(500),
+			.type = GRANT},
+		        .offset = htonl(5000),
+			.priority = 2,
+			.resend_all = 0};
+	struct busy_header busy = {{.sport = htons(40000),
+			.dport = htons(88),
+			.sender_id = cpu_to_be64(1002),
+			.type = BUSY}};
+	struct need_ack_header need_ack = {{.sport = htons(40000),
+			.dport = htons(88),
+			.sender_id = cpu_to_be64(1004),
+			.type = NEED_ACK}};
+	struct sk_buff *skb;
+
+	homa->max_gro_skbs = 100;
+	homa_cores[cpu_number]->held_skb = self->skb2;
+	homa_cores[cpu_number]->held_bucket = 2;
+
+	/* First grant: no other packets for its port. */
+	skb = mock_skb_new(&self->ip, &grant.common, 0, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
+
+	/* Grouped with the held DATA packet for the same port. */
+	skb = mock_skb_new(&self->ip, &busy.common, 0, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
+
+	/* Merged into the earlier grant. */
+	grant.offset = htonl(7000);
+	grant.priority = 5;
+	grant.resend_all = 1;
+	skb = mock_skb_new(&self->ip, &grant.common, 0, 0);
+	EXPECT_EQ(EINPROGRESS, -PTR_ERR(homa_gro_receive(
+			&self->napi.gro_hash[3].list, skb)));
+
+	/* Merged, but lower offset doesn't reduce the grant. */
+	grant.offset = htonl(6000);
+	grant.priority = 1;
+	grant.resend_all = 0;
+	skb = mock_skb_new(&self->ip, &grant.common, 0, 0);
+	EXPECT_EQ(EINPROGRESS, -PTR_ERR(homa_gro_receive(
+			&self->napi.gro_hash[3].list, skb)));
+
+	/* Different RPC: not merged. */
+	grant.sender_id = cpu_to_be64(502);
+	grant.offset = htonl(100);
+	grant.priority = 0;
+	skb = mock_skb_new(&self->ip, &grant.common, 0, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
+
+	/* Placed after the last packet for its port. */
+	skb = mock_skb_new(&self->ip, &need_ack.common, 0, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
+
+	EXPECT_EQ(5, NAPI_GRO_CB(self->skb2)->count);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.gro_grant_merges);
+	unit_log_clear();
+	unit_log_frag_list(self->skb2, 0);
+	EXPECT_STREQ("BUSY; NEED_ACK; GRANT 7000@1 resend_all; GRANT 100@0",
+			unit_log_get());
+}
+TEST_F(homa_offload, homa_gro_receive__merge_grants_with_acks)
+{
+	struct grant_header grant = {{.sport = htons(40000),
+			.dport = htons(99),
+			.sender_id = cpu_to_be64(500),
+			.type = GRANT},
+		        .offset = htonl(5000),
+			.priority = 2,
+			.resend_all = 0};
+	struct grant_header *h;
+	struct sk_buff *skb, *first;
+
+	homa->max_gro_skbs = 100;
+	homa_cores[cpu_number]->held_skb = self->skb2;
+	homa_cores[cpu_number]->held_bucket = 2;
+
+	first = mock_skb_new(&self->ip, &grant.common, 0, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, first));
+
+	/* The first grant has no ack, so this one's ack moves into it. */
+	grant.offset = htonl(6000);
+	grant.ack.client_id = cpu_to_be64(101);
+	grant.ack.client_port = htons(40000);
+	grant.ack.server_port = htons(99);
+	skb = mock_skb_new(&self->ip, &grant.common, 0, 0);
+	EXPECT_EQ(EINPROGRESS, -PTR_ERR(homa_gro_receive(
+			&self->napi.gro_hash[3].list, skb)));
+	h = (struct grant_header *) skb_transport_header(first);
+	EXPECT_EQ(6000, ntohl(h->offset));
+	EXPECT_EQ(101, be64_to_cpu(h->ack.client_id));
+	EXPECT_EQ(40000, ntohs(h->ack.client_port));
+
+	/* Now there's no room for another ack: not merged. */
+	grant.offset = htonl(7000);
+	grant.ack.client_id = cpu_to_be64(103);
+	skb = mock_skb_new(&self->ip, &grant.common, 0, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
+	EXPECT_EQ(6000, ntohl(h->offset));
+	EXPECT_EQ(101, be64_to_cpu(h->ack.client_id));
+
+	/* Grants without acks can still be merged. */
+	grant.offset = htonl(8000);
+	grant.ack.client_id = 0;
+	skb = mock_skb_new(&self->ip, &grant.common, 0, 0);
+	EXPECT_EQ(EINPROGRESS, -PTR_ERR(homa_gro_receive(
+			&self->napi.gro_hash[3].list, skb)));
+	EXPECT_EQ(8000, ntohl(h->offset));
+
+	EXPECT_EQ(3, NAPI_GRO_CB(self->skb2)->count);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.gro_grant_merges);
+	unit_log_clear();
+	unit_log_frag_list(self->skb2, 0);
+	EXPECT_STREQ("GRANT 8000@2; GRANT 7000@2", unit_log_get());
+}
+TEST_F(homa_offload, homa_gro_receive__sort_data_packets)
+{
+	struct sk_buff *skb;
+
+	homa->max_gro_skbs = 100;
+	homa->gro_policy = 0;
+	homa_cores[cpu_number]->held_skb = self->skb2;
+	homa_cores[cpu_number]->held_bucket = 2;
+
+	/* Long packet for a new RPC: appended. */
+	self->header.common.sender_id = cpu_to_be64(1004);
+	self->header.seg.offset = 0;
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
+
+	/* Short packet: goes in front of all long packets. */
+	self->header.common.sender_id = cpu_to_be64(1006);
+	self->header.message_length = htonl(100);
+	self->header.seg.segment_length = htonl(100);
+	skb = mock_skb_new(&self->ip, &self->header.common, 100, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
+
+	/* Long packet for the held RPC: just after the short packets. */
+	self->header.common.sender_id = cpu_to_be64(1002);
+	self->header.message_length = htonl(10000);
+	self->header.seg.segment_length = htonl(1400);
+	self->header.seg.offset = htonl(5400);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
+
+	/* Short packet for a different port: end of short packets. */
+	self->header.common.dport = htons(99);
+	self->header.common.sender_id = cpu_to_be64(1008);
+	self->header.message_length = htonl(300);
+	self->header.seg.segment_length = htonl(300);
+	self->header.seg.offset = 0;
+	skb = mock_skb_new(&self->ip, &self->header.common, 300, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
+
+	/* Short packet for the held port: grouped with the earlier one. */
+	self->header.common.dport = htons(88);
+	self->header.common.sender_id = cpu_to_be64(1010);
+	self->header.message_length = htonl(200);
+	self->header.seg.segment_length = htonl(200);
+	skb = mock_skb_new(&self->ip, &self->header.common, 200, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
+
+	/* Long packet for an earlier RPC: grouped with that RPC. */
+	self->header.common.sender_id = cpu_to_be64(1004);
+	self->header.message_length = htonl(10000);
+	self->header.seg.segment_length = htonl(1400);
+	self->header.seg.offset = htonl(1400);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
+
+	/* Long packet for a third RPC: appended. */
+	self->header.common.sender_id = cpu_to_be64(1012);
+	self->header.seg.offset = htonl(2800);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
+
+	EXPECT_EQ(8, NAPI_GRO_CB(self->skb2)->count);
+	EXPECT_EQ(skb, NAPI_GRO_CB(self->skb2)->last);
+	unit_log_clear();
+	unit_log_frag_list(self->skb2, 0);
+	EXPECT_STREQ("DATA 100@0; DATA 200@0; DATA 300@0; DATA 1400@5400; "
+			"DATA 1400@0; DATA 1400@1400; DATA 1400@2800",
+			unit_log_get());
+}
+TEST_F(homa_offload, homa_gro_receive__short_held_skb)
+{
+	struct sk_buff *skb;
+
+	homa->max_gro_skbs = 100;
+	homa->gro_policy = 0;
+	self->header.common.sender_id = cpu_to_be64(1004);
+	self->header.message_length = htonl(100);
+	self->header.seg.segment_length = htonl(100);
+	self->header.seg.offset = 0;
+	skb = mock_skb_new(&self->ip, &self->header.common, 100, 0);
+	NAPI_GRO_CB(skb)->last = skb;
+	NAPI_GRO_CB(skb)->count = 1;
+	list_add_tail(&skb->list, &self->napi.gro_hash[2].list);
+	self->napi.gro_hash[2].count++;
+	homa_cores[cpu_number]->held_skb = skb;
+	homa_cores[cpu_number]->held_bucket = 2;
+
+	/* Long packet: not grouped with the held packet. */
+	self->header.common.sender_id = cpu_to_be64(1006);
+	self->header.message_length = htonl(10000);
+	self->header.seg.segment_length = htonl(1400);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list,
+			mock_skb_new(&self->ip, &self->header.common, 1400, 0)));
+
+	/* Short packet for the same port: in front of the long packet. */
+	self->header.common.sender_id = cpu_to_be64(1008);
+	self->header.message_length = htonl(200);
+	self->header.seg.segment_length = htonl(200);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list,
+			mock_skb_new(&self->ip, &self->header.common, 200, 0)));
+
+	unit_log_clear();
+	unit_log_frag_list(skb, 0);
+	EXPECT_STREQ("DATA 200@0; DATA 1400@0", unit_log_get());
+}
 TEST_F(homa_offload, homa_gro_receive__max_gro_skbs)
 {
 	struct sk_buff *skb;
@@ -417,6 +662,166 @@ TEST_F(homa_offload, homa_gro_gen3__all_cores_busy_so_pick_first)
 	EXPECT_EQ(5000, homa_cores[3]->last_active);
 }
 
+TEST_F(homa_offload, homa_gro_adaptive__choose_least_loaded_core)
+{
+	homa->gro_policy = HOMA_GRO_ADAPTIVE;
+	mock_cycles = 10000;
+	homa->busy_cycles = 100;
+	homa->softirq_load_cycles = 1000;
+	cpu_number = 5;
+	homa_cores[6]->softirq_load = 320;
+	homa_cores[6]->softirq_load_start = 9500;
+	homa_cores[7]->softirq_load = 100;
+	homa_cores[7]->softirq_load_start = 9500;
+	homa_cores[7]->last_app_active = 9950;
+	homa_cores[0]->softirq_load = 50;
+	homa_cores[0]->softirq_load_start = 9500;
+	atomic_set(&homa_cores[0]->softirq_backlog, 1);
+	homa_cores[1]->softirq_load = 200;
+	homa_cores[1]->softirq_load_start = 9500;
+	homa_cores[2]->softirq_load = 0;
+	homa_cores[2]->softirq_load_start = 9500;
+
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(1, self->skb->hash - 32);
+	EXPECT_EQ(1, atomic_read(&homa_cores[1]->softirq_backlog));
+
+	/* Now core 1 has a backlog too. */
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(0, self->skb->hash - 32);
+}
+TEST_F(homa_offload, homa_gro_adaptive__skip_cores_on_other_nodes)
+{
+	int i;
+
+	homa->gro_policy = HOMA_GRO_ADAPTIVE;
+	mock_cycles = 10000;
+	homa->softirq_load_cycles = 1000;
+	cpu_number = 5;
+	for (i = 0; i < 8; i++) {
+		homa_cores[i]->softirq_load = 100*i;
+		homa_cores[i]->softirq_load_start = 9500;
+		homa_cores[i]->numa_node = (i >= 4) ? 1 : 0;
+	}
+	homa_cores[5]->numa_node = 0;
+
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(0, self->skb->hash - 32);
+
+	/* No other cores on this node. */
+	homa_cores[5]->numa_node = 2;
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(5, self->skb->hash - 32);
+}
+TEST_F(homa_offload, homa_softirq_load)
+{
+	struct homa_core *core = homa_cores[cpu_number];
+
+	homa->softirq_load_cycles = 1000;
+	core->softirq_load = 500;
+	core->softirq_load_start = 9000;
+	core->softirq_busy = 100;
+	EXPECT_EQ(500, homa_softirq_load(core, 10000));
+
+	/* Average is stale. */
+	core->softirq_load_start = 0;
+	EXPECT_EQ(10, homa_softirq_load(core, 10000));
+
+	/* Average is stale, but partial interval is even busier. */
+	core->softirq_busy = 9000;
+	EXPECT_EQ(500, homa_softirq_load(core, 10000));
+}
+TEST_F(homa_offload, homa_softirq_load_update)
+{
+	struct homa_core *core = homa_cores[cpu_number];
+
+	homa->softirq_load_cycles = 1000;
+	core->softirq_load = 200;
+	core->softirq_load_start = 1000;
+	core->softirq_busy = 0;
+
+	homa_softirq_load_update(core, 1200, 1500);
+	EXPECT_EQ(300, core->softirq_busy);
+	EXPECT_EQ(200, core->softirq_load);
+	EXPECT_EQ(1000, core->softirq_load_start);
+
+	homa_softirq_load_update(core, 1800, 2000);
+	EXPECT_EQ(0, core->softirq_busy);
+	EXPECT_EQ(275, core->softirq_load);
+	EXPECT_EQ(2000, core->softirq_load_start);
+
+	/* Sample can't exceed 1000. */
+	core->softirq_load_start = 3000;
+	homa_softirq_load_update(core, 2000, 4000);
+	EXPECT_EQ(456, core->softirq_load);
+}
+TEST_F(homa_offload, homa_softirq_load__zero_interval)
+{
+	struct homa_core *core = homa_cores[cpu_number];
+
+	homa->softirq_load_cycles = 0;
+	core->softirq_load = 200;
+	core->softirq_load_start = 5000;
+	core->softirq_busy = 100;
+	EXPECT_EQ(200, homa_softirq_load(core, 5000));
+	homa_softirq_load_update(core, 5000, 5000);
+	EXPECT_EQ(200, core->softirq_load);
+	EXPECT_EQ(5000, core->softirq_load_start);
+}
+TEST_F(homa_offload, homa_gro_steer__no_hint)
+{
+	EXPECT_EQ(-1, homa_gro_steer((struct common_header *)
+			skb_transport_header(self->skb)));
+}
+TEST_F(homa_offload, homa_gro_steer__prefer_rpc_hint)
+{
+	mock_cycles = 5000;
+	homa->busy_cycles = 1000;
+	homa_steer_publish(homa, 99, 0, 3);
+	EXPECT_EQ(3, homa_gro_steer((struct common_header *)
+			skb_transport_header(self->skb)));
+	homa_steer_publish(homa, 99, 1001, 4);
+	EXPECT_EQ(4, homa_gro_steer((struct common_header *)
+			skb_transport_header(self->skb)));
+	EXPECT_EQ(3, homa->steer_cores[homa_steer_slot(99, 0)]);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.gro_steered);
+}
+TEST_F(homa_offload, homa_gro_steer__bogus_core)
+{
+	homa->steer_cores[homa_steer_slot(99, 0)] = 1000;
+	EXPECT_EQ(-1, homa_gro_steer((struct common_header *)
+			skb_transport_header(self->skb)));
+}
+TEST_F(homa_offload, homa_gro_steer__receiver_core_busy)
+{
+	mock_cycles = 5000;
+	homa->busy_cycles = 1000;
+	homa_steer_publish(homa, 99, 0, 4);
+	homa_cores[4]->last_app_active = 4500;
+	homa_cores[4]->gen3_softirq_cores[0] = 5;
+	homa_cores[4]->gen3_softirq_cores[1] = 6;
+	homa_cores[4]->gen3_softirq_cores[2] = -1;
+	homa_cores[5]->last_app_active = 4200;
+	homa_cores[6]->last_app_active = 2000;
+	EXPECT_EQ(6, homa_gro_steer((struct common_header *)
+			skb_transport_header(self->skb)));
+
+	/* All cores busy. */
+	homa_cores[6]->last_app_active = 4200;
+	EXPECT_EQ(-1, homa_gro_steer((struct common_header *)
+			skb_transport_header(self->skb)));
+}
+TEST_F(homa_offload, homa_gro_complete__steer)
+{
+	homa->gro_policy = HOMA_GRO_STEER|HOMA_GRO_GEN2;
+	mock_cycles = 5000;
+	homa->busy_cycles = 1000;
+	homa_steer_publish(homa, 99, 0, 2);
+	atomic_set(&homa_cores[2]->softirq_backlog, 0);
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(2, self->skb->hash - 32);
+	EXPECT_EQ(1, atomic_read(&homa_cores[2]->softirq_backlog));
+}
 TEST_F(homa_offload, homa_gro_complete__GRO_IDLE)
 {
 	homa->gro_policy = HOMA_GRO_IDLE;
@@ -38,6 +38,7 @@ FIXTURE(homa_outgoing) {
 	struct homa_sock hsk;
 	sockaddr_in_union server_addr;
 	struct homa_peer *peer;
+	struct homa_nic *nic;
 };
 FIXTURE_SETUP(homa_outgoing)
 {
@@ -49,8 +50,7 @@ FIXTURE_SETUP(homa_outgoing)
 	self->server_id = 1235;
 	homa_init(&self->homa);
 	mock_cycles = 10000;
-	atomic64_set(&self->homa.link_idle_time, 10000);
-	self->homa.cycles_per_kbyte = 1000;
+	atomic64_set(&self->homa.nics[0].link_idle_time, 10000);
 	self->homa.flags |= HOMA_FLAG_DONT_THROTTLE;
 	mock_sock_init(&self->hsk, &self->homa, self->client_port);
 	self->server_addr.in6.sin6_family = AF_INET;
@@ -90,7 +90,7 @@ TEST_F(homa_outgoing, homa_message_out_init__basics)
 			&self->server_addr);
 	ASSERT_FALSE(crpc == NULL);
 	ASSERT_EQ(0, -homa_message_out_init(crpc,
-			unit_iov_iter((void *) 1000, 3000), 0));
+			unit_iov_iter((void *) 1000, 3000), 0, 0));
 	homa_rpc_unlock(crpc);
 	EXPECT_EQ(3000, crpc->msgout.granted);
 	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
@@ -124,7 +124,7 @@ TEST_F(homa_outgoing, homa_message_out_init__gso_force_software)
 	mock_xmit_log_verbose = 1;
 	self->homa.gso_force_software = 0;
 	ASSERT_EQ(0, -homa_message_out_init(crpc1,
-			unit_iov_iter((void *) 1000, 5000), 0));
+			unit_iov_iter((void *) 1000, 5000), 0, 0));
 	unit_log_clear();
 	homa_xmit_data(crpc1, false);
 	EXPECT_SUBSTR("xmit DATA", unit_log_get());
@@ -136,11 +136,54 @@ TEST_F(homa_outgoing, homa_message_out_init__gso_force_software)
 	homa_rpc_unlock(crpc2);
 	self->homa.gso_force_software = 1;
 	ASSERT_EQ(0, -homa_message_out_init(crpc2,
-			unit_iov_iter((void *) 1000, 5000), 0));
+			unit_iov_iter((void *) 1000, 5000), 0, 0));
 	unit_log_clear();
 	homa_xmit_data(crpc2, false);
 	EXPECT_SUBSTR("TSO disabled", unit_log_get());
 }
+TEST_F(homa_outgoing, homa_message_out_init__gso_type)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	homa_rpc_unlock(crpc);
+	mock_net_device.gso_max_size = 10000;
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 5000), 0, 0));
+	EXPECT_EQ((self->hsk.inet.sk.sk_family == AF_INET6)
+			? SKB_GSO_TCPV6 : SKB_GSO_TCPV4,
+			skb_shinfo(crpc->msgout.packets)->gso_type);
+}
+TEST_F(homa_outgoing, homa_message_out_init__gso_max_segs)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	homa_rpc_unlock(crpc);
+	mock_net_device.gso_max_size = 10000;
+	mock_net_device.gso_max_segs = 2;
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 10000), 0, 0));
+	mock_net_device.gso_max_segs = 1000;
+	EXPECT_SUBSTR("gso_pkt_data 2800", unit_log_get());
+}
+TEST_F(homa_outgoing, homa_message_out_init__udp_encapsulation)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	homa_rpc_unlock(crpc);
+	mock_net_device.gso_max_size = 10000;
+	self->homa.udp_port = 4000;
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 3000), 0, 0));
+	EXPECT_SUBSTR("mtu 1500, max_pkt_data 1392, gso_size 1500, "
+			"gso_pkt_data 1392", unit_log_get());
+	EXPECT_EQ(3, crpc->msgout.num_skbs);
+	self->homa.udp_port = 0;
+}
 TEST_F(homa_outgoing, homa_message_out_init__message_too_long)
 {
 	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
@@ -148,7 +191,7 @@ TEST_F(homa_outgoing, homa_message_out_init__message_too_long)
 	ASSERT_FALSE(crpc == NULL);
 	EXPECT_EQ(EINVAL, -homa_message_out_init(crpc,
 			unit_iov_iter((void *) 1000, HOMA_MAX_MESSAGE_LENGTH+1),
-			0));
+			0, 0));
 	homa_rpc_unlock(crpc);
 }
 TEST_F(homa_outgoing, homa_message_out_init__zero_length_message)
@@ -157,7 +200,7 @@ TEST_F(homa_outgoing, homa_message_out_init__zero_length_message)
 			&self->server_addr);
 	ASSERT_FALSE(crpc == NULL);
 	EXPECT_EQ(EINVAL, -homa_message_out_init(crpc,
-			unit_iov_iter((void *) 1000, 0), 0));
+			unit_iov_iter((void *) 1000, 0), 0, 0));
 	homa_rpc_unlock(crpc);
 }
 TEST_F(homa_outgoing, homa_message_out_init__max_gso_size_limit)
@@ -169,7 +212,7 @@ TEST_F(homa_outgoing, homa_message_out_init__max_gso_size_limit)
 	unit_log_clear();
 	mock_net_device.gso_max_size = 10000;
 	ASSERT_EQ(0, -homa_message_out_init(crpc1,
-			unit_iov_iter((void *) 1000, 5000), 0));
+			unit_iov_iter((void *) 1000, 5000), 0, 0));
 	homa_rpc_unlock(crpc1);
 	EXPECT_SUBSTR("gso_size 8600, gso_pkt_data 8400;", unit_log_get());
 
@@ -180,7 +223,7 @@ TEST_F(homa_outgoing, homa_message_out_init__max_gso_size_limit)
 	ASSERT_FALSE(crpc2 == NULL);
 	unit_log_clear();
 	ASSERT_EQ(0, -homa_message_out_init(crpc2,
-			unit_iov_iter((void *) 1000, 5000), 0));
+			unit_iov_iter((void *) 1000, 5000), 0, 0));
 	homa_rpc_unlock(crpc2);
 	EXPECT_SUBSTR("gso_size 2920, gso_pkt_data 2800;", unit_log_get());
 }
@@ -193,7 +236,7 @@ TEST_F(homa_outgoing, homa_message_out_init__gso_limit_less_than_mtu)
 	mock_net_device.gso_max_size = 10000;
 	self->homa.max_gso_size = 1000;
 	ASSERT_EQ(0, -homa_message_out_init(crpc,
-			unit_iov_iter((void *) 1000, 5000), 0));
+			unit_iov_iter((void *) 1000, 5000), 0, 0));
 	homa_rpc_unlock(crpc);
 	EXPECT_SUBSTR("gso_size 1500, gso_pkt_data 1400;", unit_log_get());
 }
@@ -205,7 +248,7 @@ TEST_F(homa_outgoing, homa_message_out_init__packet_header)
 			&self->server_addr);
 	ASSERT_FALSE(crpc == NULL);
 	ASSERT_EQ(0, -homa_message_out_init(crpc,
-			unit_iov_iter((void *) 1000, 20000), 0));
+			unit_iov_iter((void *) 1000, 20000), 0, 0));
 	homa_rpc_unlock(crpc);
 	char buffer[1000];
 	EXPECT_STREQ("DATA from 0.0.0.0:40000, dport 99, id 2, "
@@ -228,7 +271,7 @@ TEST_F(homa_outgoing, homa_message_out_init__compute_skb_length)
 			&self->server_addr);
 	ASSERT_FALSE(crpc == NULL);
 	ASSERT_EQ(0, -homa_message_out_init(crpc,
-			unit_iov_iter((void *) 1000, 6000), 0));
+			unit_iov_iter((void *) 1000, 6000), 0, 0));
 	homa_rpc_unlock(crpc);
 	EXPECT_EQ(2000, crpc->msgout.granted);
 	unit_log_clear();
@@ -252,7 +295,7 @@ TEST_F(homa_outgoing, homa_message_out_init__cant_alloc_skb)
 	ASSERT_FALSE(crpc == NULL);
 	mock_alloc_skb_errors = 1;
 	ASSERT_EQ(ENOMEM, -homa_message_out_init(crpc,
-			unit_iov_iter((void *) 1000, 5000), 0));
+			unit_iov_iter((void *) 1000, 5000), 0, 0));
 	homa_rpc_unlock(crpc);
 }
 TEST_F(homa_outgoing, homa_message_out_init__set_gso_info)
@@ -265,7 +308,7 @@ TEST_F(homa_outgoing, homa_message_out_init__set_gso_info)
 	ASSERT_FALSE(crpc1 == NULL);
 	unit_log_clear();
 	ASSERT_EQ(0, -homa_message_out_init(crpc1,
-			unit_iov_iter((void *) 1000, 2000), 0));
+			unit_iov_iter((void *) 1000, 2000), 0, 0));
 	homa_rpc_unlock(crpc1);
 	EXPECT_EQ(1420, skb_shinfo(crpc1->msgout.packets)->gso_size);
 
@@ -277,7 +320,7 @@ TEST_F(homa_outgoing, homa_message_out_init__set_gso_info)
 	ASSERT_FALSE(crpc2 == NULL);
 	unit_log_clear();
 	ASSERT_EQ(0, -homa_message_out_init(crpc2,
-			unit_iov_iter((void *) 1000, 1000), 0));
+			unit_iov_iter((void *) 1000, 1000), 0, 0));
 	homa_rpc_unlock(crpc2);
 	EXPECT_EQ(0, skb_shinfo(crpc2->msgout.packets)->gso_size);
 
@@ -289,10 +332,70 @@ TEST_F(homa_outgoing, homa_message_out_init__set_gso_info)
 	ASSERT_FALSE(crpc3 == NULL);
 	unit_log_clear();
 	ASSERT_EQ(0, -homa_message_out_init(crpc3,
-			unit_iov_iter((void *) 1000, 1000), 0));
+			unit_iov_iter((void *) 1000, 1000), 0, 0));
 	homa_rpc_unlock(crpc3);
 	EXPECT_EQ(0, skb_shinfo(crpc3->msgout.packets)->gso_size);
 }
+TEST_F(homa_outgoing, homa_message_out_init__zerocopy_cant_alloc_ubuf)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	mock_net_device.gso_max_size = 20000;
+	self->homa.max_gso_size = 20000;
+	self->hsk.zerocopy_min_length = 3000;
+	unit_log_clear();
+
+	/* The mock can't allocate a ubuf_info. */
+	EXPECT_EQ(ENOBUFS, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 10000), 0, 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(7000, crpc->msgout.gso_pkt_data);
+	EXPECT_SUBSTR("msg_zerocopy_realloc", unit_log_get());
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.zerocopy_msgs);
+	EXPECT_EQ(0, crpc->msgout.num_skbs);
+}
+TEST_F(homa_outgoing, homa_message_out_init__message_too_short_for_zerocopy)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	self->hsk.zerocopy_min_length = 3001;
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 3000), 0, 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_NOSUBSTR("msg_zerocopy_realloc", unit_log_get());
+	EXPECT_EQ(3, crpc->msgout.num_skbs);
+}
+TEST_F(homa_outgoing, homa_message_out_init__shared_pages)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	struct bio_vec bvec;
+	struct iov_iter iter;
+	struct sk_buff *skb;
+
+	ASSERT_FALSE(crpc == NULL);
+	bvec.bv_page = mock_alloc_page(GFP_KERNEL);
+	bvec.bv_offset = 0;
+	bvec.bv_len = 3000;
+	iov_iter_bvec(&iter, WRITE, &bvec, 1, 3000);
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_init(crpc, &iter, 0, 1));
+	homa_rpc_unlock(crpc);
+	EXPECT_NOSUBSTR("msg_zerocopy_realloc", unit_log_get());
+	EXPECT_NOSUBSTR("_copy_from_iter", unit_log_get());
+	EXPECT_EQ(3, crpc->msgout.num_skbs);
+	for (skb = crpc->msgout.packets; skb != NULL;
+			skb = homa_get_skb_info(skb)->next_skb) {
+		EXPECT_EQ(1, skb_shinfo(skb)->nr_frags);
+		EXPECT_EQ(bvec.bv_page, skb_frag_page(&skb_shinfo(skb)->frags[0]));
+	}
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.zerocopy_msgs);
+	EXPECT_EQ(3000, homa_cores[cpu_number]->metrics.mcast_shared_bytes);
+	mock_put_page(bvec.bv_page);
+}
 TEST_F(homa_outgoing, homa_message_out_init__include_acks)
 {
 	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
@@ -304,7 +407,7 @@ TEST_F(homa_outgoing, homa_message_out_init__include_acks)
 		.client_id = cpu_to_be64(1000)};
 	crpc->peer->num_acks = 1;
 	ASSERT_EQ(0, -homa_message_out_init(crpc,
-			unit_iov_iter((void *) 1000, 500), 0));
+			unit_iov_iter((void *) 1000, 500), 0, 0));
 	homa_rpc_unlock(crpc);
 	struct data_header *h = (struct data_header *) crpc->msgout.packets->data;
 	EXPECT_STREQ("client_port 100, server_port 200, client_id 1000",
@@ -317,7 +420,7 @@ TEST_F(homa_outgoing, homa_message_out_init__cant_copy_data)
 	ASSERT_FALSE(crpc == NULL);
 	mock_copy_data_errors = 2;
 	ASSERT_EQ(EFAULT, -homa_message_out_init(crpc,
-			unit_iov_iter((void *) 1000, 3000), 0));
+			unit_iov_iter((void *) 1000, 3000), 0, 0));
 	homa_rpc_unlock(crpc);
 }
 TEST_F(homa_outgoing, homa_message_out_init__multiple_segs_per_skbuff)
@@ -328,7 +431,7 @@ TEST_F(homa_outgoing, homa_message_out_init__multiple_segs_per_skbuff)
 	mock_net_device.gso_max_size = 5000;
 	unit_log_clear();
 	ASSERT_EQ(0, -homa_message_out_init(crpc,
-			unit_iov_iter((void *) 1000, 10000), 0));
+			unit_iov_iter((void *) 1000, 10000), 0, 0));
 	homa_rpc_unlock(crpc);
 	EXPECT_SUBSTR("_copy_from_iter 1400 bytes at 1000; "
 			"_copy_from_iter 1400 bytes at 2400; "
@@ -353,7 +456,7 @@ TEST_F(homa_outgoing, homa_message_out_init__add_to_throttled)
 			&self->server_addr);
 	ASSERT_FALSE(crpc == NULL);
 	ASSERT_EQ(0, -homa_message_out_init(crpc,
-			unit_iov_iter((void *) 1000, 5000), 1));
+			unit_iov_iter((void *) 1000, 5000), 1, 0));
 	homa_rpc_unlock(crpc);
 	unit_log_clear();
 	unit_log_filled_skbs(crpc->msgout.packets, 0);
@@ -371,7 +474,7 @@ TEST_F(homa_outgoing, homa_message_out_init__too_short_for_pipelining)
 			&self->server_addr);
 	ASSERT_FALSE(crpc == NULL);
 	ASSERT_EQ(0, -homa_message_out_init(crpc,
-			unit_iov_iter((void *) 1000, 1000), 1));
+			unit_iov_iter((void *) 1000, 1000), 1, 0));
 	homa_rpc_unlock(crpc);
 	EXPECT_SUBSTR("xmit DATA 1000@0", unit_log_get());
 	unit_log_clear();
@@ -423,6 +526,35 @@ TEST_F(homa_outgoing, homa_xmit_control__client_response)
 			unit_log_get());
 	EXPECT_STREQ("7", mock_xmit_prios);
 }
+TEST_F(homa_outgoing, homa_xmit_control__piggyback_ack)
+{
+	struct homa_rpc *crpc;
+	struct grant_header h;
+	struct busy_header busy;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			100, 10000);
+	ASSERT_NE(NULL, crpc);
+	crpc->peer->acks[0] = (struct homa_ack) {
+		.client_port = htons(100),
+		.server_port = htons(200),
+		.client_id = cpu_to_be64(1000)};
+	crpc->peer->num_acks = 1;
+	h.offset = htonl(12345);
+	h.priority = 4;
+	h.resend_all = 0;
+	EXPECT_EQ(0, homa_xmit_control(GRANT, &h, sizeof(h), crpc));
+	EXPECT_STREQ("client_port 100, server_port 200, client_id 1000",
+			unit_ack_string(&h.ack));
+	EXPECT_EQ(0, crpc->peer->num_acks);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.acks_piggybacked);
+
+	/* No more acks available. */
+	EXPECT_EQ(0, homa_xmit_control(BUSY, &busy, sizeof(busy), crpc));
+	EXPECT_EQ(0, busy.ack.client_id);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.acks_piggybacked);
+}
 
 TEST_F(homa_outgoing, __homa_xmit_control__cant_alloc_skb)
 {
@@ -482,6 +614,33 @@ TEST_F(homa_outgoing, __homa_xmit_control__ipv4_error)
 	EXPECT_STREQ("", unit_log_get());
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.control_xmit_errors);
 }
+TEST_F(homa_outgoing, __homa_xmit_control__ipv4_sk_priority)
+{
+	struct homa_rpc *srpc;
+	struct grant_header h;
+
+	// Make sure the test uses IPv4.
+	mock_ipv6 = false;
+	homa_sock_destroy(&self->hsk);
+	mock_sock_init(&self->hsk, &self->homa, self->client_port);
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+		self->server_ip, self->client_port, 1111, 10000, 10000);
+	ASSERT_NE(NULL, srpc);
+	h.offset = htonl(12345);
+	h.priority = 4;
+	h.resend_all = 0;
+
+	/* Without priority_queues, the application's value is kept. */
+	self->hsk.inet.sk.sk_priority = 6;
+	EXPECT_EQ(0, homa_xmit_control(GRANT, &h, sizeof(h), srpc));
+	EXPECT_EQ(6, self->hsk.inet.sk.sk_priority);
+
+	self->homa.priority_queues = 1;
+	EXPECT_EQ(0, homa_xmit_control(GRANT, &h, sizeof(h), srpc));
+	EXPECT_EQ(self->homa.num_priorities - 1,
+			self->hsk.inet.sk.sk_priority);
+}
 TEST_F(homa_outgoing, __homa_xmit_control__ipv6_error)
 {
 	struct homa_rpc *srpc;
@@ -507,6 +666,47 @@ TEST_F(homa_outgoing, __homa_xmit_control__ipv6_error)
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.control_xmit_errors);
 }
 
+TEST_F(homa_outgoing, __homa_xmit_control__udp)
+{
+	struct homa_rpc *srpc;
+	struct grant_header h;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+		self->server_ip, self->client_port, 1111, 10000, 10000);
+	ASSERT_NE(NULL, srpc);
+	unit_log_clear();
+
+	h.offset = htonl(12345);
+	h.priority = 4;
+	h.resend_all = 0;
+	self->homa.udp_port = 4000;
+	EXPECT_EQ(0, homa_xmit_control(GRANT, &h, sizeof(h), srpc));
+	EXPECT_SUBSTR("->4000 GRANT", unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.udp_packets_sent);
+	self->homa.udp_port = 0;
+}
+TEST_F(homa_outgoing, __homa_xmit_control__udp_no_headroom)
+{
+	struct homa_rpc *srpc;
+	struct grant_header h;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+		self->server_ip, self->client_port, 1111, 10000, 10000);
+	ASSERT_NE(NULL, srpc);
+	unit_log_clear();
+
+	h.offset = htonl(12345);
+	h.priority = 4;
+	h.resend_all = 0;
+	self->homa.udp_port = 4000;
+	mock_net_device.needed_headroom = 1000;
+	EXPECT_EQ(ENOMEM, -homa_xmit_control(GRANT, &h, sizeof(h), srpc));
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.udp_packets_sent);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.control_xmit_errors);
+	self->homa.udp_port = 0;
+}
+
 TEST_F(homa_outgoing, homa_xmit_unknown)
 {
 	struct sk_buff *skb;
@@ -568,7 +768,7 @@ TEST_F(homa_outgoing, homa_xmit_data__below_throttle_min)
 			UNIT_OUTGOING, self->client_ip, self->server_ip,
 			self->server_port, self->client_id, 200, 1000);
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 11000);
+	atomic64_set(&self->homa.nics[0].link_idle_time, 11000);
 	self->homa.max_nic_queue_cycles = 500;
 	self->homa.throttle_min_bytes = 250;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
@@ -588,7 +788,7 @@ TEST_F(homa_outgoing, homa_xmit_data__force)
 			self->server_port, self->client_id+2, 5000, 1000);
 
 	/* First, get an RPC on the throttled list. */
-	atomic64_set(&self->homa.link_idle_time, 11000);
+	atomic64_set(&self->homa.nics[0].link_idle_time, 11000);
 	self->homa.max_nic_queue_cycles = 3000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	homa_xmit_data(crpc1, false);
@@ -612,7 +812,7 @@ TEST_F(homa_outgoing, homa_xmit_data__throttle)
 			UNIT_OUTGOING, self->client_ip, self->server_ip,
 			self->server_port, self->client_id, 6000, 1000);
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 11000);
+	atomic64_set(&self->homa.nics[0].link_idle_time, 11000);
 	self->homa.max_nic_queue_cycles = 3000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 
@@ -640,6 +840,53 @@ TEST_F(homa_outgoing, homa_xmit_data__update_next_xmit_offset)
 	EXPECT_EQ(8000, crpc->msgout.next_xmit_offset);
 }
 
+TEST_F(homa_outgoing, homa_xmit_data__flush_full_batch)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 15000, 1000);
+	crpc->msgout.granted = 15000;
+	unit_log_clear();
+	homa_xmit_data(crpc, false);
+	EXPECT_SUBSTR("xmit DATA 1400@9800; xmit DATA 1400@11200; "
+			"xmit DATA 1400@12600; xmit DATA 1000@14000",
+			unit_log_get());
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.xmit_batches);
+	EXPECT_EQ(11, homa_cores[cpu_number]->metrics.packets_sent[0]);
+	EXPECT_EQ(0, atomic_read(&crpc->msgout.active_xmits));
+}
+
+TEST_F(homa_outgoing, homa_xmit_batch_flush)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 1000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+2, 2000, 1000);
+	struct homa_xmit_batch batch;
+
+	homa_xmit_batch_init(&batch);
+	homa_xmit_batch_flush(&batch);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.xmit_batches);
+
+	unit_log_clear();
+	homa_xmit_data_batch(crpc1, false, &batch);
+	homa_xmit_data_batch(crpc2, false, &batch);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(3, batch.num_skbs);
+	EXPECT_EQ(1, atomic_read(&crpc1->msgout.active_xmits));
+	EXPECT_EQ(2, atomic_read(&crpc2->msgout.active_xmits));
+
+	homa_xmit_batch_flush(&batch);
+	EXPECT_STREQ("xmit DATA 1000@0; xmit DATA 1400@0; xmit DATA 600@1400",
+			unit_log_get());
+	EXPECT_EQ(0, batch.num_skbs);
+	EXPECT_EQ(0, atomic_read(&crpc1->msgout.active_xmits));
+	EXPECT_EQ(0, atomic_read(&crpc2->msgout.active_xmits));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.xmit_batches);
+}
+
 TEST_F(homa_outgoing, __homa_xmit_data__update_cutoff_version)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -669,6 +916,43 @@ TEST_F(homa_outgoing, __homa_xmit_data__fill_dst)
 	EXPECT_EQ(dst, skb_dst(crpc->msgout.packets));
 	EXPECT_EQ(old_refcount+1, dst->__refcnt.counter);
 }
+TEST_F(homa_outgoing, __homa_xmit_data__count_tso)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	homa_rpc_unlock(crpc);
+	mock_net_device.gso_max_size = 10000;
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 9000), 0, 0));
+	unit_log_clear();
+
+	/* First packet: device can't segment it. */
+	skb_get(crpc->msgout.packets);
+	__homa_xmit_data(crpc->msgout.packets, crpc, 4);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.tso_skbs);
+
+	/* Second packet: device supports TSO. */
+	mock_net_device.features = NETIF_F_TSO | NETIF_F_TSO6;
+	skb_get(crpc->msgout.packets);
+	__homa_xmit_data(crpc->msgout.packets, crpc, 4);
+	mock_net_device.features = 0;
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.tso_skbs);
+}
+TEST_F(homa_outgoing, __homa_xmit_data__udp)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 1000);
+	ASSERT_NE(NULL, crpc);
+	unit_log_clear();
+	self->homa.udp_port = 4000;
+	skb_get(crpc->msgout.packets);
+	__homa_xmit_data(crpc->msgout.packets, crpc, 4);
+	EXPECT_SUBSTR("->4000 DATA 1000@0", unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.udp_packets_sent);
+	self->homa.udp_port = 0;
+}
 TEST_F(homa_outgoing, __homa_xmit_data__ipv4_transmit_error)
 {
 	// Make sure the test uses IPv4.
@@ -717,12 +1001,9 @@ TEST_F(homa_outgoing, homa_resend_data__basics)
 			"incoming 10000, RETRANSMIT; "
 			"xmit DATA from 0.0.0.0:40000, dport 99, id 1234, "
 			"message_length 16000, offset 8400, data_length 1400, "
-			"incoming 10000, RETRANSMIT; "
-			"xmit DATA from 0.0.0.0:40000, dport 99, id 1234, "
-			"message_length 16000, offset 9800, data_length 200, "
-			"incoming 10000, RETRANSMIT",
+			"incoming 10000, RETRANSMIT, extra segs 200@9800",
 			unit_log_get());
-	EXPECT_STREQ("2 2 2", mock_xmit_prios);
+	EXPECT_STREQ("2 2", mock_xmit_prios);
 
 	unit_log_clear();
 	mock_clear_xmit_prios();
@@ -783,6 +1064,106 @@ TEST_F(homa_outgoing, homa_resend_data__set_homa_info)
 			"homa_info: wire_bytes 1542, data_bytes 1400",
 			unit_log_get());
 }
+TEST_F(homa_outgoing, homa_resend_data__skb_index)
+{
+	mock_net_device.gso_max_size = 5000;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 16000, 1000);
+	struct sk_buff *skb = crpc->msgout.packets;
+
+	/* Packets start at 0, 4200, 8400, 10000, and 14200. */
+	ASSERT_NE(NULL, crpc->msgout.skb_index);
+	EXPECT_EQ(4200, crpc->msgout.gso_pkt_data);
+	EXPECT_EQ(skb, crpc->msgout.skb_index[0]);
+	skb = homa_get_skb_info(skb)->next_skb;
+	EXPECT_EQ(skb, crpc->msgout.skb_index[1]);
+	EXPECT_EQ(4200, homa_get_skb_info(skb)->offset);
+	skb = homa_get_skb_info(skb)->next_skb;
+	EXPECT_EQ(skb, crpc->msgout.skb_index[2]);
+	skb = homa_get_skb_info(skb)->next_skb;
+	EXPECT_EQ(skb, crpc->msgout.skb_index[3]);
+	EXPECT_EQ(10000, homa_get_skb_info(skb)->offset);
+
+	/* Index entry refers to the packet before the one needed. */
+	unit_log_clear();
+	homa_resend_data(crpc, 10000, 10100, 2);
+	EXPECT_STREQ("xmit DATA retrans 1400@10000", unit_log_get());
+}
+TEST_F(homa_outgoing, homa_resend_data__no_skb_index)
+{
+	mock_net_device.gso_max_size = 5000;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 16000, 1000);
+	kfree(crpc->msgout.skb_index);
+	crpc->msgout.skb_index = NULL;
+	unit_log_clear();
+	homa_resend_data(crpc, 12600, 14300, 2);
+	EXPECT_STREQ("xmit DATA retrans 1400@11400; "
+			"xmit DATA retrans 1400@12800; "
+			"xmit DATA retrans 1400@14200", unit_log_get());
+}
+TEST_F(homa_outgoing, homa_resend_data__clone)
+{
+	mock_net_device.gso_max_size = 5000;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 16000, 1000);
+	unit_log_clear();
+	mock_xmit_log_homa_info = 1;
+	homa_resend_data(crpc, 4200, 8400, 2);
+	EXPECT_STREQ("xmit DATA retrans 1400@4200 1400@5600 1400@7000; "
+			"homa_info: wire_bytes 4626, data_bytes 4200",
+			unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.resent_clones);
+	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.resent_packets);
+
+	/* The original's header wasn't modified. */
+	EXPECT_EQ(0, ((struct data_header *) skb_transport_header(
+			homa_get_skb_info(crpc->msgout.packets)->next_skb))
+			->retransmit);
+
+	/* Packet is now cloned, so it must be copied. */
+	unit_log_clear();
+	mock_xmit_log_homa_info = 0;
+	homa_resend_data(crpc, 4200, 8400, 2);
+	EXPECT_STREQ("xmit DATA retrans 1400@4200; "
+			"xmit DATA retrans 1400@5600; "
+			"xmit DATA retrans 1400@7000", unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.resent_clones);
+}
+TEST_F(homa_outgoing, homa_resend_data__dont_clone_packets_not_yet_sent)
+{
+	mock_net_device.gso_max_size = 5000;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 16000, 1000);
+	EXPECT_EQ(10000, crpc->msgout.next_xmit_offset);
+	unit_log_clear();
+	homa_resend_data(crpc, 10000, 14200, 2);
+	EXPECT_STREQ("xmit DATA retrans 1400@10000; "
+			"xmit DATA retrans 1400@11400; "
+			"xmit DATA retrans 1400@12800", unit_log_get());
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.resent_clones);
+}
+TEST_F(homa_outgoing, homa_resend_data__dont_clone_packet_in_flight)
+{
+	mock_net_device.gso_max_size = 5000;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 16000, 1000);
+	struct sk_buff *skb = crpc->msgout.packets;
+
+	skb_get(skb);
+	unit_log_clear();
+	homa_resend_data(crpc, 0, 4200, 2);
+	EXPECT_STREQ("xmit DATA retrans 1400@0; "
+			"xmit DATA retrans 1400@1400; "
+			"xmit DATA retrans 1400@2800", unit_log_get());
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.resent_clones);
+	kfree_skb(skb);
+}
 TEST_F(homa_outgoing, homa_resend_data__advance_next_xmit)
 {
 	char buffer[1000];
@@ -817,6 +1198,57 @@ TEST_F(homa_outgoing, homa_resend_data__advance_next_xmit)
 	EXPECT_STREQ("skb is NULL!", buffer);
 }
 
+TEST_F(homa_outgoing, homa_nic_find__basics)
+{
+	static struct net_device dev1, dev2;
+	struct homa_nic *nic1, *nic2;
+
+	dev1.ifindex = 5;
+	strcpy(dev1.name, "eth0");
+	dev2.ifindex = 6;
+	strcpy(dev2.name, "eth1");
+	strcpy(self->homa.nic_link_mbps, "eth2:500,eth1:100000");
+	self->homa.link_mbps = 10000;
+	nic1 = homa_nic_find(&self->homa, &dev1);
+	nic2 = homa_nic_find(&self->homa, &dev2);
+	EXPECT_EQ(3, self->homa.num_nics);
+	EXPECT_EQ(&self->homa.nics[1], nic1);
+	EXPECT_EQ(&self->homa.nics[2], nic2);
+	EXPECT_STREQ("eth1", nic2->name);
+	EXPECT_EQ(10000, nic1->link_mbps);
+	EXPECT_EQ(808, nic1->cycles_per_kbyte);
+	EXPECT_EQ(100000, nic2->link_mbps);
+	EXPECT_EQ(80, nic2->cycles_per_kbyte);
+	EXPECT_EQ(nic1, homa_nic_find(&self->homa, &dev1));
+	EXPECT_EQ(3, self->homa.num_nics);
+}
+TEST_F(homa_outgoing, homa_nic_find__table_full)
+{
+	static struct net_device devs[HOMA_MAX_NICS];
+	int i;
+
+	for (i = 0; i < HOMA_MAX_NICS; i++) {
+		devs[i].ifindex = 10 + i;
+		homa_nic_find(&self->homa, &devs[i]);
+	}
+	EXPECT_EQ(HOMA_MAX_NICS, self->homa.num_nics);
+
+	/* The last device didn't get its own entry. */
+	EXPECT_EQ(16, self->homa.nics[HOMA_MAX_NICS-1].ifindex);
+	EXPECT_EQ(&self->homa.nics[HOMA_MAX_NICS-1],
+			homa_nic_find(&self->homa, &devs[HOMA_MAX_NICS-1]));
+}
+TEST_F(homa_outgoing, homa_nic_min_idle)
+{
+	static struct net_device dev;
+
+	dev.ifindex = 5;
+	atomic64_set(&self->homa.nics[0].link_idle_time, 5000);
+	atomic64_set(&self->homa.nics[1].link_idle_time, 4000);
+	EXPECT_EQ(5000, homa_nic_min_idle(&self->homa));
+	homa_nic_find(&self->homa, &dev);
+	EXPECT_EQ(4000, homa_nic_min_idle(&self->homa));
+}
 TEST_F(homa_outgoing, homa_outgoing_sysctl_changed)
 {
 	self->homa.link_mbps = 10000;
@@ -830,12 +1262,34 @@ TEST_F(homa_outgoing, homa_outgoing_sysctl_changed)
 	self->homa.link_mbps = 40000;
 	homa_outgoing_sysctl_changed(&self->homa);
 	EXPECT_EQ(202, self->homa.cycles_per_kbyte);
+	EXPECT_EQ(40000, self->nic->link_mbps);
+	EXPECT_EQ(202, self->nic->cycles_per_kbyte);
 
 	self->homa.max_nic_queue_ns = 200;
 	cpu_khz = 2000000;
 	homa_outgoing_sysctl_changed(&self->homa);
 	EXPECT_EQ(400, self->homa.max_nic_queue_cycles);
 }
+TEST_F(homa_outgoing, homa_outgoing_sysctl_changed__num_pacers)
+{
+	self->homa.num_pacers = 3;
+	homa_outgoing_sysctl_changed(&self->homa);
+	EXPECT_EQ(3, self->homa.num_pacers);
+	EXPECT_EQ(3, self->homa.active_pacers);
+
+	self->homa.num_pacers = 100;
+	homa_outgoing_sysctl_changed(&self->homa);
+	EXPECT_EQ(HOMA_MAX_PACERS, self->homa.num_pacers);
+	EXPECT_EQ(HOMA_MAX_PACERS, self->homa.active_pacers);
+
+	self->homa.num_pacers = 0;
+	homa_outgoing_sysctl_changed(&self->homa);
+	EXPECT_EQ(1, self->homa.num_pacers);
+	EXPECT_EQ(1, self->homa.active_pacers);
+	self->homa.cycles_per_kbyte = 1000;
+	self->nic = homa_nic_find(&self->homa, &mock_net_device);
+	self->nic->cycles_per_kbyte = 1000;
+}
 
 TEST_F(homa_outgoing, homa_check_nic_queue__basics)
 {
@@ -844,13 +1298,13 @@ TEST_F(homa_outgoing, homa_check_nic_queue__basics)
 			self->server_port, self->client_id, 500, 1000);
 	homa_get_skb_info(crpc->msgout.packets)->wire_bytes = 500;
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 9000);
+	atomic64_set(&self->homa.nics[0].link_idle_time, 9000);
 	mock_cycles = 8000;
 	self->homa.max_nic_queue_cycles = 1000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
-	EXPECT_EQ(1, homa_check_nic_queue(&self->homa, crpc->msgout.packets,
-			false));
-	EXPECT_EQ(9500, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(1, homa_check_nic_queue(&self->homa, self->nic,
+			crpc->msgout.packets, 0, false));
+	EXPECT_EQ(9500, atomic64_read(&self->homa.nics[0].link_idle_time));
 }
 TEST_F(homa_outgoing, homa_check_nic_queue__queue_full)
 {
@@ -859,13 +1313,13 @@ TEST_F(homa_outgoing, homa_check_nic_queue__queue_full)
 			self->server_port, self->client_id, 500, 1000);
 	homa_get_skb_info(crpc->msgout.packets)->wire_bytes = 500;
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 9000);
+	atomic64_set(&self->homa.nics[0].link_idle_time, 9000);
 	mock_cycles = 7999;
 	self->homa.max_nic_queue_cycles = 1000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
-	EXPECT_EQ(0, homa_check_nic_queue(&self->homa, crpc->msgout.packets,
-			false));
-	EXPECT_EQ(9000, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(0, homa_check_nic_queue(&self->homa, self->nic,
+			crpc->msgout.packets, 0, false));
+	EXPECT_EQ(9000, atomic64_read(&self->homa.nics[0].link_idle_time));
 }
 TEST_F(homa_outgoing, homa_check_nic_queue__queue_full_but_force)
 {
@@ -874,13 +1328,13 @@ TEST_F(homa_outgoing, homa_check_nic_queue__queue_full_but_force)
 			self->server_port, self->client_id, 500, 1000);
 	homa_get_skb_info(crpc->msgout.packets)->wire_bytes = 500;
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 9000);
+	atomic64_set(&self->homa.nics[0].link_idle_time, 9000);
 	mock_cycles = 7999;
 	self->homa.max_nic_queue_cycles = 1000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
-	EXPECT_EQ(1, homa_check_nic_queue(&self->homa, crpc->msgout.packets,
-			true));
-	EXPECT_EQ(9500, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(1, homa_check_nic_queue(&self->homa, self->nic,
+			crpc->msgout.packets, 0, true));
+	EXPECT_EQ(9500, atomic64_read(&self->homa.nics[0].link_idle_time));
 }
 TEST_F(homa_outgoing, homa_check_nic_queue__pacer_metrics)
 {
@@ -890,14 +1344,14 @@ TEST_F(homa_outgoing, homa_check_nic_queue__pacer_metrics)
 	homa_get_skb_info(crpc->msgout.packets)->wire_bytes = 500;
 	homa_add_to_throttled(crpc);
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 9000);
-	self->homa.pacer_wake_time = 9800;
+	atomic64_set(&self->homa.nics[0].link_idle_time, 9000);
+	self->homa.pacers[0].wake_time = 9800;
 	mock_cycles = 10000;
 	self->homa.max_nic_queue_cycles = 1000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
-	EXPECT_EQ(1, homa_check_nic_queue(&self->homa, crpc->msgout.packets,
-			true));
-	EXPECT_EQ(10500, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(1, homa_check_nic_queue(&self->homa, self->nic,
+			crpc->msgout.packets, 0, true));
+	EXPECT_EQ(10500, atomic64_read(&self->homa.nics[0].link_idle_time));
 	EXPECT_EQ(500, homa_cores[cpu_number]->metrics.pacer_bytes);
 	EXPECT_EQ(200, homa_cores[cpu_number]->metrics.pacer_lost_cycles);
 }
@@ -908,13 +1362,49 @@ TEST_F(homa_outgoing, homa_check_nic_queue__queue_empty)
 			self->server_port, self->client_id, 500, 1000);
 	homa_get_skb_info(crpc->msgout.packets)->wire_bytes = 500;
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 9000);
+	atomic64_set(&self->homa.nics[0].link_idle_time, 9000);
 	mock_cycles = 10000;
 	self->homa.max_nic_queue_cycles = 1000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
-	EXPECT_EQ(1, homa_check_nic_queue(&self->homa, crpc->msgout.packets,
-			true));
-	EXPECT_EQ(10500, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(1, homa_check_nic_queue(&self->homa, self->nic,
+			crpc->msgout.packets, 0, true));
+	EXPECT_EQ(10500, atomic64_read(&self->homa.nics[0].link_idle_time));
+}
+TEST_F(homa_outgoing, homa_check_nic_queue__priority_queues)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 500, 1000);
+	homa_get_skb_info(crpc->msgout.packets)->wire_bytes = 500;
+	unit_log_clear();
+	atomic64_set(&self->homa.nics[0].link_idle_time, 20000);
+	atomic64_set(&self->homa.nics[0].prio_idle_time[3], 12000);
+	mock_cycles = 10000;
+	self->homa.max_nic_queue_cycles = 1000;
+	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
+
+	/* Without priority queues, the total backlog counts. */
+	EXPECT_EQ(0, homa_check_nic_queue(&self->homa, self->nic,
+			crpc->msgout.packets, 5, false));
+
+	/* Priority 5 doesn't wait for lower-priority packets. */
+	self->homa.priority_queues = 1;
+	EXPECT_EQ(1, homa_check_nic_queue(&self->homa, self->nic,
+			crpc->msgout.packets, 5, false));
+	EXPECT_EQ(10500, atomic64_read(&self->homa.nics[0].prio_idle_time[5]));
+	EXPECT_EQ(10500, atomic64_read(&self->homa.nics[0].prio_idle_time[4]));
+	EXPECT_EQ(12500, atomic64_read(&self->homa.nics[0].prio_idle_time[3]));
+	EXPECT_EQ(10500, atomic64_read(&self->homa.nics[0].prio_idle_time[1]));
+	EXPECT_EQ(0, atomic64_read(&self->homa.nics[0].prio_idle_time[6]));
+	EXPECT_EQ(20500, atomic64_read(&self->homa.nics[0].link_idle_time));
+
+	/* Priority 3 is backed up. */
+	EXPECT_EQ(0, homa_check_nic_queue(&self->homa, self->nic,
+			crpc->msgout.packets, 3, false));
+
+	/* Priority 0 uses the total backlog. */
+	EXPECT_EQ(0, homa_check_nic_queue(&self->homa, self->nic,
+			crpc->msgout.packets, 0, false));
 }
 
 /* Don't know how to unit test homa_pacer_main... */
@@ -939,7 +1429,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__basics)
 	self->homa.max_nic_queue_cycles = 2000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.pacers[0]);
 	EXPECT_STREQ("xmit DATA 1400@0; xmit DATA 1400@1400",
 		unit_log_get());
 	unit_log_clear();
@@ -968,14 +1458,14 @@ TEST_F(homa_outgoing, homa_pacer_xmit__xmit_fifo)
 
 	/* First attempt: pacer_fifo_count doesn't reach zero. */
 	self->homa.max_nic_queue_cycles = 1300;
-	self->homa.pacer_fifo_count = 200;
+	self->homa.pacers[0].fifo_count = 200;
 	self->homa.pacer_fifo_fraction = 150;
 	mock_cycles = 13000;
-	atomic64_set(&self->homa.link_idle_time, 10000);
+	atomic64_set(&self->homa.nics[0].link_idle_time, 10000);
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
 	mock_xmit_log_verbose = 1;
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.pacers[0]);
 	EXPECT_SUBSTR("id 4, message_length 10000, offset 0, data_length 1400",
 			unit_log_get());
 	unit_log_clear();
@@ -983,12 +1473,12 @@ TEST_F(homa_outgoing, homa_pacer_xmit__xmit_fifo)
 	EXPECT_STREQ("request id 4, next_offset 1400; "
 			"request id 2, next_offset 0; "
 			"request id 6, next_offset 0", unit_log_get());
-	EXPECT_EQ(50, self->homa.pacer_fifo_count);
+	EXPECT_EQ(50, self->homa.pacers[0].fifo_count);
 
 	/* Second attempt: pacer_fifo_count reaches zero. */
-	atomic64_set(&self->homa.link_idle_time, 10000);
+	atomic64_set(&self->homa.nics[0].link_idle_time, 10000);
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.pacers[0]);
 	EXPECT_SUBSTR("id 2, message_length 20000, offset 0, data_length 1400",
 			unit_log_get());
 	unit_log_clear();
@@ -996,7 +1486,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__xmit_fifo)
 	EXPECT_STREQ("request id 4, next_offset 1400; "
 			"request id 2, next_offset 1400; "
 			"request id 6, next_offset 0", unit_log_get());
-	EXPECT_EQ(900, self->homa.pacer_fifo_count);
+	EXPECT_EQ(900, self->homa.pacers[0].fifo_count);
 }
 TEST_F(homa_outgoing, homa_pacer_xmit__pacer_busy)
 {
@@ -1009,7 +1499,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__pacer_busy)
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	mock_trylock_errors = 1;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.pacers[0]);
 	EXPECT_STREQ("", unit_log_get());
 	unit_log_clear();
 	unit_log_throttled(&self->homa);
@@ -1020,7 +1510,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__queue_empty)
 	self->homa.max_nic_queue_cycles = 2000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.pacers[0]);
 	unit_log_throttled(&self->homa);
 	EXPECT_STREQ("", unit_log_get());
 }
@@ -1033,15 +1523,40 @@ TEST_F(homa_outgoing, homa_pacer_xmit__nic_queue_fills)
 	homa_add_to_throttled(crpc);
 	self->homa.max_nic_queue_cycles = 2001;
 	mock_cycles = 10000;
-	atomic64_set(&self->homa.link_idle_time, 12000);
+	atomic64_set(&self->homa.nics[0].link_idle_time, 12000);
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.pacers[0]);
 	EXPECT_STREQ("xmit DATA 1400@0", unit_log_get());
 	unit_log_clear();
 	unit_log_throttled(&self->homa);
 	EXPECT_STREQ("request id 1234, next_offset 1400", unit_log_get());
 }
+TEST_F(homa_outgoing, homa_pacer_xmit__check_queue_of_rpcs_nic)
+{
+	static struct net_device dev;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id,
+			10000, 1000);
+	struct homa_nic *nic;
+
+	dev.ifindex = 5;
+	nic = homa_nic_find(&self->homa, &dev);
+	crpc->peer->nic = nic;
+	homa_add_to_throttled(crpc);
+	self->homa.max_nic_queue_cycles = 2001;
+	mock_cycles = 10000;
+
+	/* The other NIC is idle, but that doesn't matter. */
+	atomic64_set(&self->homa.nics[0].link_idle_time, 0);
+	atomic64_set(&nic->link_idle_time, 12000);
+	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
+	unit_log_clear();
+	homa_pacer_xmit(&self->homa.pacers[0]);
+	EXPECT_STREQ("xmit DATA 1400@0", unit_log_get());
+	EXPECT_LT(12000, atomic64_read(&nic->link_idle_time));
+}
 TEST_F(homa_outgoing, homa_pacer_xmit__rpc_locked)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -1053,12 +1568,12 @@ TEST_F(homa_outgoing, homa_pacer_xmit__rpc_locked)
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
 	mock_trylock_errors = ~1;
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.pacers[0]);
 	EXPECT_STREQ("", unit_log_get());
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.pacer_skipped_rpcs);
 	unit_log_clear();
 	mock_trylock_errors = 0;
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.pacers[0]);
 	EXPECT_STREQ("xmit DATA 1400@0; xmit DATA 1400@1400",
 		unit_log_get());
 }
@@ -1077,7 +1592,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__remove_from_queue)
 	self->homa.max_nic_queue_cycles = 2000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.pacers[0]);
 	EXPECT_STREQ("xmit DATA 1000@0; xmit DATA 1400@0",
 			unit_log_get());
 	unit_log_clear();
@@ -1086,8 +1601,118 @@ TEST_F(homa_outgoing, homa_pacer_xmit__remove_from_queue)
 	EXPECT_TRUE(list_empty(&crpc1->throttled_links));
 }
 
+TEST_F(homa_outgoing, homa_pacer_xmit__rebucket)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id,
+			4000, 1000);
+	homa_add_to_throttled(crpc);
+	EXPECT_EQ(1 << 12, self->homa.pacers[0].nonempty_buckets);
+	self->homa.max_nic_queue_cycles = 2000;
+	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
+	unit_log_clear();
+	homa_pacer_xmit(&self->homa.pacers[0]);
+	EXPECT_STREQ("xmit DATA 1400@0; xmit DATA 1400@1400",
+		unit_log_get());
+
+	/* 1200 bytes are left, so the RPC belongs in bucket 11. */
+	EXPECT_EQ(11, crpc->throttle_bucket);
+	EXPECT_EQ(1 << 11, self->homa.pacers[0].nonempty_buckets);
+	EXPECT_EQ(&crpc->throttled_links,
+			self->homa.pacers[0].throttled_rpcs[11].next);
+}
+
+TEST_F(homa_outgoing, homa_pacer_xmit__one_batch_for_all_rpcs)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 1000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+2, 1200, 1000);
+	homa_add_to_throttled(crpc1);
+	homa_add_to_throttled(crpc2);
+	self->homa.max_nic_queue_cycles = 2000;
+	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
+	unit_log_clear();
+	homa_pacer_xmit(&self->homa.pacers[0]);
+	EXPECT_STREQ("xmit DATA 1000@0; xmit DATA 1200@0", unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.xmit_batches);
+}
+
+TEST_F(homa_outgoing, homa_pacer_xmit__weighted_shares)
+{
+	struct homa_sock hsk2;
+	struct homa_rpc *crpc1, *crpc2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			5000, 1000);
+	crpc2 = unit_client_rpc(&hsk2, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id+2,
+			10000, 1000);
+	homa_add_to_throttled(crpc1);
+	homa_add_to_throttled(crpc2);
+	self->homa.max_nic_queue_cycles = 2000;
+	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
+	self->homa.weighted_shares = 1;
+	self->hsk.pacer_vtime = 5000000;
+	hsk2.weight = 2;
+	unit_log_clear();
+	homa_pacer_xmit(&self->homa.pacers[0]);
+	EXPECT_STREQ("xmit DATA 1400@0; xmit DATA 1400@1400",
+		unit_log_get());
+	unit_log_clear();
+	unit_log_throttled(&self->homa);
+	EXPECT_STREQ("request id 1234, next_offset 0; "
+		"request id 1236, next_offset 2800", unit_log_get());
+	EXPECT_EQ(2800, atomic64_read(&hsk2.paced_bytes));
+	EXPECT_EQ(1400000, hsk2.pacer_vtime);
+	homa_sock_shutdown(&hsk2);
+}
+
 /* Don't know how to unit test homa_pacer_stop... */
 
+TEST_F(homa_outgoing, homa_throttle_choose_weighted)
+{
+	struct homa_sock hsk2;
+	struct homa_pacer *pacer = &self->homa.pacers[0];
+	struct homa_rpc *crpc1, *crpc2, *crpc3;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			5000, 1000);
+	crpc2 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id+2,
+			8000, 1000);
+	crpc3 = unit_client_rpc(&hsk2, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id+4,
+			100000, 1000);
+	EXPECT_EQ(NULL, homa_throttle_choose_weighted(pacer));
+	homa_add_to_throttled(crpc1);
+	homa_add_to_throttled(crpc2);
+	homa_add_to_throttled(crpc3);
+
+	/* Both sockets behind the pacer: SRPT, after one check. */
+	pacer->vtime = 1000;
+	EXPECT_EQ(crpc1, homa_throttle_choose_weighted(pacer));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.pacer_share_checks);
+
+	/* First socket is ahead of the second. */
+	self->hsk.pacer_vtime = 3000;
+	hsk2.pacer_vtime = 2000;
+	EXPECT_EQ(crpc3, homa_throttle_choose_weighted(pacer));
+	EXPECT_EQ(4, homa_cores[cpu_number]->metrics.pacer_share_checks);
+
+	/* Second socket is ahead of the first. */
+	hsk2.pacer_vtime = 4000;
+	EXPECT_EQ(crpc1, homa_throttle_choose_weighted(pacer));
+	homa_sock_shutdown(&hsk2);
+}
+
 TEST_F(homa_outgoing, homa_add_to_throttled__basics)
 {
 	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
@@ -1134,6 +1759,20 @@ TEST_F(homa_outgoing, homa_add_to_throttled__basics)
 		"request id 10, next_offset 0; "
 		"request id 8, next_offset 0; "
 		"request id 6, next_offset 0", unit_log_get());
+
+	/* Already present, but has transmitted enough to move to a
+	 * lower bucket.
+	 */
+	crpc3->msgout.next_xmit_offset = 12000;
+	homa_add_to_throttled(crpc3);
+	unit_log_clear();
+	unit_log_throttled(&self->homa);
+	EXPECT_STREQ("request id 6, next_offset 12000; "
+		"request id 4, next_offset 0; "
+		"request id 2, next_offset 0; "
+		"request id 10, next_offset 0; "
+		"request id 8, next_offset 0", unit_log_get());
+	EXPECT_EQ(12, crpc3->throttle_bucket);
 }
 TEST_F(homa_outgoing, homa_add_to_throttled__inc_metrics)
 {
@@ -1151,13 +1790,43 @@ TEST_F(homa_outgoing, homa_add_to_throttled__inc_metrics)
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.throttle_list_adds);
 	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.throttle_list_checks);
 
+	/* Separate bucket from crpc1: no checks. */
 	homa_add_to_throttled(crpc2);
 	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.throttle_list_adds);
-	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.throttle_list_checks);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.throttle_list_checks);
 
 	homa_add_to_throttled(crpc3);
 	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.throttle_list_adds);
-	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.throttle_list_checks);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.throttle_list_checks);
+}
+TEST_F(homa_outgoing, homa_add_to_throttled__multiple_pacers)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, 2, 10000, 1000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, 4, 5000, 1000);
+
+	self->homa.num_pacers = HOMA_MAX_PACERS;
+	homa_outgoing_sysctl_changed(&self->homa);
+	homa_add_to_throttled(crpc1);
+	homa_add_to_throttled(crpc2);
+
+	/* Both RPCs have the same peer, so they share a pacer. */
+	EXPECT_EQ(crpc1->pacer, crpc2->pacer);
+	EXPECT_EQ(1UL << crpc1->pacer->id, self->homa.throttled_pacers);
+	unit_log_clear();
+	unit_log_throttled(&self->homa);
+	EXPECT_STREQ("request id 4, next_offset 0; "
+		"request id 2, next_offset 0", unit_log_get());
+
+	self->homa.max_nic_queue_cycles = 2000;
+	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
+	unit_log_clear();
+	homa_pacer_xmit(crpc1->pacer);
+	EXPECT_STREQ("xmit DATA 1400@0; xmit DATA 1400@1400",
+		unit_log_get());
 }
 
 TEST_F(homa_outgoing, homa_remove_from_throttled)
@@ -1167,17 +1836,32 @@ TEST_F(homa_outgoing, homa_remove_from_throttled)
 			self->server_port, self->client_id, 5000, 1000);
 
 	homa_add_to_throttled(crpc);
-	EXPECT_FALSE(list_empty(&self->homa.throttled_rpcs));
+	EXPECT_EQ(1, self->homa.throttled_pacers);
+	EXPECT_EQ(1 << 13, self->homa.pacers[0].nonempty_buckets);
 
 	// First attempt will remove.
 	unit_log_clear();
 	homa_remove_from_throttled(crpc);
-	EXPECT_TRUE(list_empty(&self->homa.throttled_rpcs));
+	EXPECT_EQ(0, self->homa.throttled_pacers);
+	EXPECT_EQ(0, self->homa.pacers[0].nonempty_buckets);
 	EXPECT_STREQ("removing id 1234 from throttled list", unit_log_get());
 
 	// Second attempt: nothing to do.
 	unit_log_clear();
 	homa_remove_from_throttled(crpc);
-	EXPECT_TRUE(list_empty(&self->homa.throttled_rpcs));
+	EXPECT_EQ(0, self->homa.throttled_pacers);
 	EXPECT_STREQ("", unit_log_get());
 }
+TEST_F(homa_outgoing, homa_remove_from_throttled__record_latency)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 1000);
+
+	mock_cycles = 1000;
+	homa_add_to_throttled(crpc);
+	mock_cycles = 5000;
+	homa_remove_from_throttled(crpc);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.latency
+			[HOMA_LAT_THROTTLED][1][11]);
+}
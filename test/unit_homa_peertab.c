@@ -183,6 +183,146 @@ TEST_F(homa_peertab, homa_peertab_get_peers__multiple_peers)
 	kfree(peers);
 }
 
+TEST_F(homa_peertab, homa_peertab_resize__basics)
+{
+	struct homa_peer *peer1, *peer2, *peer3;
+	peer1 = homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	peer2 = homa_peer_find(&self->peertab, ip2222, &self->hsk.inet);
+	peer3 = homa_peer_find(&self->peertab, ip3333, &self->hsk.inet);
+	EXPECT_EQ(0, self->peertab.buckets->link);
+
+	EXPECT_EQ(0, -homa_peertab_resize(&self->peertab, 2));
+	EXPECT_EQ(2, self->peertab.buckets->bits);
+	EXPECT_EQ(1, self->peertab.buckets->link);
+	EXPECT_EQ(peer1, homa_peer_find(&self->peertab, ip1111,
+			&self->hsk.inet));
+	EXPECT_EQ(peer2, homa_peer_find(&self->peertab, ip2222,
+			&self->hsk.inet));
+	EXPECT_EQ(peer3, homa_peer_find(&self->peertab, ip3333,
+			&self->hsk.inet));
+	EXPECT_EQ(3, self->peertab.num_peers);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peertab_resizes);
+
+	/* Second resize switches back to the original links. */
+	EXPECT_EQ(0, -homa_peertab_resize(&self->peertab, 12));
+	EXPECT_EQ(0, self->peertab.buckets->link);
+	EXPECT_EQ(peer2, homa_peer_find(&self->peertab, ip2222,
+			&self->hsk.inet));
+	EXPECT_EQ(3, self->peertab.num_peers);
+}
+TEST_F(homa_peertab, homa_peertab_resize__vmalloc_failed)
+{
+	struct homa_peer *peer;
+	peer = homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	mock_vmalloc_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_peertab_resize(&self->peertab, 12));
+	EXPECT_EQ(HOMA_PEERTAB_MIN_BITS, self->peertab.buckets->bits);
+	EXPECT_EQ(peer, homa_peer_find(&self->peertab, ip1111,
+			&self->hsk.inet));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.peertab_resizes);
+}
+
+TEST_F(homa_peertab, homa_peertab_check_resize__not_crowded)
+{
+	homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	homa_peertab_check_resize(&self->peertab);
+	EXPECT_EQ(HOMA_PEERTAB_MIN_BITS, self->peertab.buckets->bits);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.peertab_resizes);
+}
+TEST_F(homa_peertab, homa_peertab_check_resize__grow)
+{
+	self->peertab.num_peers = 5000;
+	homa_peertab_check_resize(&self->peertab);
+	EXPECT_EQ(13, self->peertab.buckets->bits);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peertab_resizes);
+	self->peertab.num_peers = 0;
+}
+TEST_F(homa_peertab, homa_peertab_check_resize__max_size)
+{
+	self->peertab.num_peers = 1 << (HOMA_PEERTAB_MAX_BITS + 2);
+	homa_peertab_check_resize(&self->peertab);
+	EXPECT_EQ(HOMA_PEERTAB_MAX_BITS, self->peertab.buckets->bits);
+	homa_peertab_check_resize(&self->peertab);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peertab_resizes);
+	self->peertab.num_peers = 0;
+}
+
+TEST_F(homa_peertab, homa_peertab_sweep__idle_peer)
+{
+	struct homa_peer *peer;
+	peer = homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	EXPECT_EQ(2, atomic_read(&peer->refs));
+	homa_peer_put(peer);
+	homa_peertab_resize(&self->peertab, 0);
+
+	/* First sweep: peer hasn't been idle long enough. */
+	peer->last_put = jiffies - 100;
+	homa_peertab_sweep(&self->peertab, 200, INT_MAX);
+	EXPECT_EQ(1, self->peertab.num_peers);
+
+	/* Second sweep: now it's idle. */
+	peer->last_put = jiffies - 200;
+	homa_peertab_sweep(&self->peertab, 200, INT_MAX);
+	EXPECT_EQ(0, self->peertab.num_peers);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peer_evictions);
+
+	/* A new lookup creates a new peer. */
+	peer = homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	EXPECT_EQ(1, self->peertab.num_peers);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.peer_new_entries);
+}
+TEST_F(homa_peertab, homa_peertab_sweep__peer_in_use)
+{
+	struct homa_peer *peer;
+	peer = homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	peer->last_put = jiffies - 1000;
+	homa_peertab_resize(&self->peertab, 0);
+	homa_peertab_sweep(&self->peertab, 200, 0);
+	EXPECT_EQ(1, self->peertab.num_peers);
+	homa_peer_put(peer);
+	peer->last_put = jiffies - 1000;
+	homa_peertab_sweep(&self->peertab, 200, INT_MAX);
+	EXPECT_EQ(0, self->peertab.num_peers);
+}
+TEST_F(homa_peertab, homa_peertab_sweep__acks_pending)
+{
+	struct homa_peer *peer;
+	peer = homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	homa_peer_put(peer);
+	peer->last_put = jiffies - 1000;
+	peer->num_acks = 1;
+	homa_peertab_resize(&self->peertab, 0);
+	homa_peertab_sweep(&self->peertab, 200, INT_MAX);
+	EXPECT_EQ(1, self->peertab.num_peers);
+	peer->num_acks = 0;
+	homa_peertab_sweep(&self->peertab, 200, INT_MAX);
+	EXPECT_EQ(0, self->peertab.num_peers);
+}
+TEST_F(homa_peertab, homa_peertab_sweep__over_limit)
+{
+	struct homa_peer *peer1, *peer2, *peer3;
+	peer1 = homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	peer2 = homa_peer_find(&self->peertab, ip2222, &self->hsk.inet);
+	peer3 = homa_peer_find(&self->peertab, ip3333, &self->hsk.inet);
+	homa_peer_put(peer1);
+	homa_peer_put(peer2);
+	homa_peer_put(peer3);
+
+	/* Peers aren't idle, but the table is over its limit; the sweep
+	 * keeps going past its normal chunk until the limit is met.
+	 */
+	homa_peertab_sweep(&self->peertab, 200, 1);
+	EXPECT_EQ(1, self->peertab.num_peers);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.peer_evictions);
+}
+TEST_F(homa_peertab, homa_peertab_sweep__wrap_sweep_bucket)
+{
+	self->peertab.sweep_bucket = (1 << HOMA_PEERTAB_MIN_BITS) - 2;
+	homa_peertab_sweep(&self->peertab, 200, INT_MAX);
+	EXPECT_EQ(2, self->peertab.sweep_bucket);
+}
+
 TEST_F(homa_peertab, homa_peer_find__conflicting_creates)
 {
 	struct homa_peer *peer;
@@ -193,6 +333,7 @@ TEST_F(homa_peertab, homa_peer_find__conflicting_creates)
 	peer = homa_peer_find(&self->peertab, ip3333, &self->hsk.inet);
 	EXPECT_NE(NULL, conflicting_peer);
 	EXPECT_EQ(conflicting_peer, peer);
+	EXPECT_EQ(3, atomic_read(&peer->refs));
 }
 TEST_F(homa_peertab, homa_peer_find__kmalloc_error)
 {
@@ -224,9 +365,11 @@ TEST_F(homa_peertab, homa_dst_refresh__basics)
 	EXPECT_EQ_IP(*ip1111, peer->addr);
 
 	old_dst = homa_get_dst(peer, &self->hsk);
+	peer->nic = &self->homa.nics[3];
 	homa_dst_refresh(&self->homa.peers, peer, &self->hsk);
 	EXPECT_NE(old_dst, peer->dst);
 	EXPECT_EQ(1, dead_count(&self->homa.peers));
+	EXPECT_EQ(homa_nic_find(&self->homa, &mock_net_device), peer->nic);
 }
 TEST_F(homa_peertab, homa_dst_refresh__routing_error)
 {
@@ -327,6 +470,126 @@ TEST_F(homa_peertab, homa_peer_get_dst_ipv6)
 			homa_print_ipv6_addr(&peer->flow.u.ip6.daddr));
 }
 
+TEST_F(homa_peertab, homa_peer_update_rtt)
+{
+	struct homa_peer *peer = homa_peer_find(&self->peertab, ip1111,
+			&self->hsk.inet);
+	unsigned long saved_jiffies = jiffies;
+	ASSERT_FALSE(IS_ERR(peer));
+	EXPECT_EQ(0, peer->rtt_cycles);
+
+	jiffies = 1000;
+	homa_peer_update_rtt(peer, 5000);
+	EXPECT_EQ(5000, peer->rtt_cycles);
+
+	/* Larger samples are ignored, smaller ones kept. */
+	homa_peer_update_rtt(peer, 6000);
+	EXPECT_EQ(5000, peer->rtt_cycles);
+	homa_peer_update_rtt(peer, 4000);
+	EXPECT_EQ(4000, peer->rtt_cycles);
+
+	/* Window has expired. */
+	jiffies += HOMA_RTT_WINDOW + 1;
+	homa_peer_update_rtt(peer, 6000);
+	EXPECT_EQ(6000, peer->rtt_cycles);
+	homa_peer_put(peer);
+	jiffies = saved_jiffies;
+}
+TEST_F(homa_peertab, homa_peer_rtt_bytes)
+{
+	struct homa_peer *peer = homa_peer_find(&self->peertab, ip1111,
+			&self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	homa_nic_find(&self->homa, peer->dst->dev)->cycles_per_kbyte = 1000;
+	peer->rtt_cycles = 5000;
+
+	/* Disabled. */
+	EXPECT_EQ(10000, homa_peer_rtt_bytes(&self->homa, peer, 10000));
+
+	self->homa.peer_rtt = 1;
+	EXPECT_EQ(5000, homa_peer_rtt_bytes(&self->homa, peer, 10000));
+
+	/* Limited to a factor of HOMA_PEER_RTT_RANGE. */
+	peer->rtt_cycles = 1000;
+	EXPECT_EQ(2500, homa_peer_rtt_bytes(&self->homa, peer, 10000));
+	peer->rtt_cycles = 100000;
+	EXPECT_EQ(40000, homa_peer_rtt_bytes(&self->homa, peer, 10000));
+
+	/* No estimate. */
+	peer->rtt_cycles = 0;
+	EXPECT_EQ(10000, homa_peer_rtt_bytes(&self->homa, peer, 10000));
+	homa_peer_put(peer);
+}
+TEST_F(homa_peertab, homa_peer_rtt_bytes__use_peers_nic)
+{
+	struct homa_peer *peer = homa_peer_find(&self->peertab, ip1111,
+			&self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	self->homa.peer_rtt = 1;
+	self->homa.cycles_per_kbyte = 1000;
+	homa_nic_find(&self->homa, peer->dst->dev)->cycles_per_kbyte = 1000;
+	self->homa.nics[1].cycles_per_kbyte = 500;
+	peer->rtt_cycles = 5000;
+	EXPECT_EQ(5000, homa_peer_rtt_bytes(&self->homa, peer, 10000));
+
+	peer->nic = &self->homa.nics[1];
+	EXPECT_EQ(10000, homa_peer_rtt_bytes(&self->homa, peer, 10000));
+	homa_peer_put(peer);
+}
+TEST_F(homa_peertab, homa_peer_congested)
+{
+	struct homa_peer *peer = homa_peer_find(&self->peertab, ip1111,
+			&self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	self->homa.timer_ticks = 10;
+	homa_peer_congested(&self->homa, peer);
+	EXPECT_EQ(1, peer->cong_level);
+	EXPECT_EQ(10, peer->cong_ticks);
+
+	/* Only one increase per tick. */
+	homa_peer_congested(&self->homa, peer);
+	EXPECT_EQ(1, peer->cong_level);
+
+	self->homa.timer_ticks = 11;
+	homa_peer_congested(&self->homa, peer);
+	EXPECT_EQ(2, peer->cong_level);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.cong_level_increases);
+
+	/* Capped at HOMA_MAX_CONG_LEVEL. */
+	peer->cong_level = HOMA_MAX_CONG_LEVEL;
+	self->homa.timer_ticks = 12;
+	homa_peer_congested(&self->homa, peer);
+	EXPECT_EQ(HOMA_MAX_CONG_LEVEL, peer->cong_level);
+	EXPECT_EQ(12, peer->cong_ticks);
+	homa_peer_put(peer);
+}
+TEST_F(homa_peertab, homa_peer_cong_level)
+{
+	struct homa_peer *peer = homa_peer_find(&self->peertab, ip1111,
+			&self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	self->homa.congestion_decay_ticks = 5;
+	self->homa.timer_ticks = 100;
+	peer->cong_level = 2;
+	peer->cong_ticks = 98;
+
+	/* Disabled. */
+	EXPECT_EQ(0, homa_peer_cong_level(&self->homa, peer));
+
+	/* Not yet time to decay. */
+	self->homa.congestion_signal = HOMA_CONG_ECN;
+	EXPECT_EQ(2, homa_peer_cong_level(&self->homa, peer));
+
+	/* Decay one level at a time. */
+	self->homa.timer_ticks = 103;
+	EXPECT_EQ(1, homa_peer_cong_level(&self->homa, peer));
+	EXPECT_EQ(103, peer->cong_ticks);
+	EXPECT_EQ(1, homa_peer_cong_level(&self->homa, peer));
+	self->homa.timer_ticks = 108;
+	EXPECT_EQ(0, homa_peer_cong_level(&self->homa, peer));
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.cong_level_decreases);
+	homa_peer_put(peer);
+}
 TEST_F(homa_peertab, homa_peer_lock_slow)
 {
 	mock_cycles = 10000;
@@ -359,45 +622,140 @@ TEST_F(homa_peertab, homa_peer_add_ack)
 		self->client_ip, self->server_ip, self->server_port,
 		103, 100, 100);
 	struct homa_peer *peer = crpc1->peer;
+	int i;
 	EXPECT_EQ(0, peer->num_acks);
 
-	/* Initialize 3 acks in the peer. */
-	peer->acks[0] = (struct homa_ack) {
-			.client_port = htons(1000),
-			.server_port = htons(self->server_port),
-			.client_id = cpu_to_be64(90)};
-	peer->acks[1] = (struct homa_ack) {
-			.client_port = htons(1001),
-			.server_port = htons(self->server_port),
-			.client_id = cpu_to_be64(91)};
-	peer->acks[2] = (struct homa_ack) {
-			.client_port = htons(1002),
-			.server_port = htons(self->server_port),
-			.client_id = cpu_to_be64(92)};
-	peer->num_acks = 3;
+	/* Fill all but 2 slots in the peer. */
+	for (i = 0; i < HOMA_MAX_PEER_ACKS - 2; i++)
+		peer->acks[i] = (struct homa_ack) {
+				.client_port = htons(1000 + i),
+				.server_port = htons(self->server_port),
+				.client_id = cpu_to_be64(90 + 2*i)};
+	peer->num_acks = HOMA_MAX_PEER_ACKS - 2;
 
 	/* Add one RPC to unacked (fits). */
 	homa_peer_add_ack(crpc1);
-	EXPECT_EQ(4, peer->num_acks);
+	EXPECT_EQ(HOMA_MAX_PEER_ACKS - 1, peer->num_acks);
 	EXPECT_STREQ("client_port 32768, server_port 99, client_id 101",
-			unit_ack_string(&peer->acks[3]));
+			unit_ack_string(&peer->acks[HOMA_MAX_PEER_ACKS - 2]));
 
 	/* Add another RPC to unacked (also fits). */
 	homa_peer_add_ack(crpc2);
-	EXPECT_EQ(5, peer->num_acks);
+	EXPECT_EQ(HOMA_MAX_PEER_ACKS, peer->num_acks);
 	EXPECT_STREQ("client_port 32768, server_port 99, client_id 102",
-			unit_ack_string(&peer->acks[4]));
+			unit_ack_string(&peer->acks[HOMA_MAX_PEER_ACKS - 1]));
 
-	/* Third RPC overflows, triggers ACK transmission. */
+	/* Third RPC overflows, triggers ACK transmission with the
+	 * oldest acks.
+	 */
 	unit_log_clear();
 	mock_xmit_log_verbose = 1;
 	homa_peer_add_ack(crpc3);
-	EXPECT_EQ(0, peer->num_acks);
+	EXPECT_EQ(HOMA_MAX_PEER_ACKS - NUM_PEER_UNACKED_IDS, peer->num_acks);
 	EXPECT_STREQ("xmit ACK from 0.0.0.0:32768, dport 99, id 103, acks "
-			"[cp 1000, sp 99, id 90] [cp 1001, sp 99, id 91] "
-			"[cp 1002, sp 99, id 92] [cp 32768, sp 99, id 101] "
-			"[cp 32768, sp 99, id 102]",
+			"[cp 1000, sp 99, id 90] [cp 1001, sp 99, id 92] "
+			"[cp 1002, sp 99, id 94] [cp 1003, sp 99, id 96] "
+			"[cp 1004, sp 99, id 98]",
 			unit_log_get());
+	EXPECT_STREQ("client_port 1005, server_port 99, client_id 100",
+			unit_ack_string(&peer->acks[0]));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.ack_overflows);
+	peer->num_acks = 0;
+}
+TEST_F(homa_peertab, homa_peer_add_ack__ack_peers)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
+		self->client_ip, self->server_ip, self->server_port,
+		101, 100, 100);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
+		self->client_ip, self->server_ip, self->server_port,
+		102, 100, 100);
+	struct homa_peer *peer = crpc1->peer;
+
+	/* Flushing disabled: peer isn't tracked. */
+	homa_peer_add_ack(crpc1);
+	EXPECT_TRUE(list_empty(&self->homa.ack_peers));
+	peer->num_acks = 0;
+
+	self->homa.ack_flush_usecs = 100;
+	homa_incoming_sysctl_changed(&self->homa);
+	mock_cycles = 5000;
+	homa_peer_add_ack(crpc1);
+	EXPECT_EQ(1, unit_list_length(&self->homa.ack_peers));
+	EXPECT_EQ(5000, peer->ack_cycles);
+
+	/* Second ack doesn't change the list or the time. */
+	mock_cycles = 6000;
+	homa_peer_add_ack(crpc2);
+	EXPECT_EQ(1, unit_list_length(&self->homa.ack_peers));
+	EXPECT_EQ(5000, peer->ack_cycles);
+	peer->num_acks = 0;
+	list_del_init(&peer->ack_links);
+}
+
+TEST_F(homa_peertab, homa_peer_flush_acks)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
+		self->client_ip, self->server_ip, self->server_port,
+		101, 100, 100);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
+		self->client_ip, ip1111, self->server_port,
+		102, 100, 100);
+	struct homa_rpc *crpc3 = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
+		self->client_ip, ip2222, self->server_port,
+		104, 100, 100);
+
+	self->homa.ack_flush_usecs = 100;
+	homa_incoming_sysctl_changed(&self->homa);
+	mock_cycles = 5000;
+	homa_peer_add_ack(crpc1);
+	mock_cycles = 50000;
+	homa_peer_add_ack(crpc2);
+	homa_peer_add_ack(crpc3);
+	crpc3->peer->num_acks = 0;
+	EXPECT_EQ(3, unit_list_length(&self->homa.ack_peers));
+
+	/* First peer has waited long enough; second hasn't; third has
+	 * nothing left to send.
+	 */
+	unit_log_clear();
+	mock_xmit_log_verbose = 1;
+	mock_cycles = 105000;
+	homa_peer_flush_acks(&self->homa);
+	EXPECT_STREQ("xmit ACK from 0.0.0.0:32768, dport 99, id 101, acks "
+			"[cp 32768, sp 99, id 101]", unit_log_get());
+	EXPECT_EQ(0, crpc1->peer->num_acks);
+	EXPECT_EQ(1, unit_list_length(&self->homa.ack_peers));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.ack_flushes);
+
+	unit_log_clear();
+	mock_cycles = 150000;
+	homa_peer_flush_acks(&self->homa);
+	EXPECT_SUBSTR("id 102", unit_log_get());
+	EXPECT_EQ(0, unit_list_length(&self->homa.ack_peers));
+}
+TEST_F(homa_peertab, homa_peer_flush_acks__flushing_disabled)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
+		self->client_ip, self->server_ip, self->server_port,
+		101, 100, 100);
+
+	self->homa.ack_flush_usecs = 100;
+	homa_incoming_sysctl_changed(&self->homa);
+	mock_cycles = 5000;
+	homa_peer_add_ack(crpc);
+	EXPECT_EQ(1, unit_list_length(&self->homa.ack_peers));
+
+	/* The peer leaves the list, but its ack stays buffered. */
+	self->homa.ack_flush_usecs = 0;
+	homa_incoming_sysctl_changed(&self->homa);
+	unit_log_clear();
+	mock_cycles = 1000000;
+	homa_peer_flush_acks(&self->homa);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(0, unit_list_length(&self->homa.ack_peers));
+	EXPECT_EQ(1, crpc->peer->num_acks);
+	crpc->peer->num_acks = 0;
 }
 
 TEST_F(homa_peertab, homa_peer_get_acks)
@@ -411,7 +769,7 @@ TEST_F(homa_peertab, homa_peer_get_acks)
 	struct homa_ack acks[2];
 	EXPECT_EQ(0, homa_peer_get_acks(peer, 2, acks));
 
-	// Second call: retrieve 2 out of 3.
+	// Second call: retrieve the oldest 2 out of 3.
 	peer->acks[0] = (struct homa_ack) {
 			.client_port = htons(4000),
 			.server_port = htons(5000),
@@ -426,14 +784,14 @@ TEST_F(homa_peertab, homa_peer_get_acks)
 			.client_id = cpu_to_be64(102)};
 	peer->num_acks = 3;
 	EXPECT_EQ(2, homa_peer_get_acks(peer, 2, acks));
-	EXPECT_STREQ("client_port 4001, server_port 5001, client_id 101",
+	EXPECT_STREQ("client_port 4000, server_port 5000, client_id 100",
 			unit_ack_string(&acks[0]));
-	EXPECT_STREQ("client_port 4002, server_port 5002, client_id 102",
+	EXPECT_STREQ("client_port 4001, server_port 5001, client_id 101",
 			unit_ack_string(&acks[1]));
 	EXPECT_EQ(1, peer->num_acks);
 
 	// Third call: retrieve final id.
 	EXPECT_EQ(1, homa_peer_get_acks(peer, 2, acks));
-	EXPECT_STREQ("client_port 4000, server_port 5000, client_id 100",
+	EXPECT_STREQ("client_port 4002, server_port 5002, client_id 102",
 			unit_ack_string(&acks[0]));
 }
@@ -225,6 +225,205 @@ TEST_F(homa_plumbing, homa_ioc_abort__nonexistent_rpc)
 			(unsigned long) &args));
 }
 
+TEST_F(homa_plumbing, homa_ioc_send__cant_read_user_args)
+{
+	struct homa_sendmmsg_args args = {0, {0}, NULL};
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_ioc_send(&self->hsk.inet.sk,
+			(unsigned long) &args));
+}
+TEST_F(homa_plumbing, homa_ioc_send__too_many_messages)
+{
+	struct homa_sendmmsg_args args = {HOMA_MAX_SEND_BATCH + 1, {0}, NULL};
+	EXPECT_EQ(EINVAL, -homa_ioc_send(&self->hsk.inet.sk,
+			(unsigned long) &args));
+}
+TEST_F(homa_plumbing, homa_ioc_send__requests_and_response)
+{
+	struct homa_sendmmsg_msg msgs[3];
+	struct homa_sendmmsg_args args = {3, {0}, msgs};
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->server_id, 2000, 100);
+	struct homa_rpc *crpc;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		msgs[i].id = 0;
+		msgs[i].completion_cookie = 100 + i;
+		msgs[i].dest_addr = self->server_addr;
+		msgs[i].iovcnt = 2;
+		msgs[i].iov = self->send_vec;
+		msgs[i].error = 99;
+	}
+	msgs[2].id = self->server_id;
+	msgs[2].completion_cookie = 0;
+	msgs[2].dest_addr = self->client_addr;
+	EXPECT_EQ(3, homa_ioc_send(&self->hsk.inet.sk, (unsigned long) &args));
+	EXPECT_EQ(0, msgs[0].error);
+	EXPECT_EQ(0, msgs[1].error);
+	EXPECT_EQ(0, msgs[2].error);
+	EXPECT_NE(0, msgs[0].id);
+	EXPECT_EQ(msgs[0].id + 2, msgs[1].id);
+	EXPECT_EQ(RPC_OUTGOING, srpc->state);
+	EXPECT_EQ(3, unit_list_length(&self->hsk.active_rpcs));
+	crpc = homa_find_client_rpc(&self->hsk, msgs[1].id);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(101, crpc->completion_cookie);
+	homa_rpc_unlock(crpc);
+}
+TEST_F(homa_plumbing, homa_ioc_send__error_in_one_message)
+{
+	struct homa_sendmmsg_msg msgs[2];
+	struct homa_sendmmsg_args args = {2, {0}, msgs};
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		msgs[i].id = 0;
+		msgs[i].completion_cookie = 0;
+		msgs[i].dest_addr = self->server_addr;
+		msgs[i].iovcnt = 2;
+		msgs[i].iov = self->send_vec;
+	}
+	msgs[0].dest_addr.in6.sin6_family = 1;
+	EXPECT_EQ(1, homa_ioc_send(&self->hsk.inet.sk, (unsigned long) &args));
+	EXPECT_EQ(EAFNOSUPPORT, -msgs[0].error);
+	EXPECT_EQ(0, msgs[1].error);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_ioc_send__error_copying_back_results)
+{
+	struct homa_sendmmsg_msg msgs[1];
+	struct homa_sendmmsg_args args = {1, {0}, msgs};
+
+	msgs[0].id = 0;
+	msgs[0].completion_cookie = 0;
+	msgs[0].dest_addr = self->server_addr;
+	msgs[0].iovcnt = 2;
+	msgs[0].iov = self->send_vec;
+	mock_copy_to_user_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_ioc_send(&self->hsk.inet.sk,
+			(unsigned long) &args));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+
+TEST_F(homa_plumbing, homa_ioc_mcast__cant_read_user_args)
+{
+	struct homa_mcast_args args = {self->send_vec, 2, 1, NULL};
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_ioc_mcast(&self->hsk.inet.sk,
+			(unsigned long) &args));
+}
+TEST_F(homa_plumbing, homa_ioc_mcast__bad_num_dests)
+{
+	struct homa_mcast_args args = {self->send_vec, 2, 0, NULL};
+	EXPECT_EQ(EINVAL, -homa_ioc_mcast(&self->hsk.inet.sk,
+			(unsigned long) &args));
+	args.num_dests = HOMA_MAX_MCAST_DESTS + 1;
+	EXPECT_EQ(EINVAL, -homa_ioc_mcast(&self->hsk.inet.sk,
+			(unsigned long) &args));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.mcast_calls);
+}
+TEST_F(homa_plumbing, homa_ioc_mcast__cant_import_iovec)
+{
+	struct homa_mcast_dest dests[1];
+	struct homa_mcast_args args = {self->send_vec, 2, 1, dests};
+	mock_import_iovec_errors = 1;
+	EXPECT_EQ(EINVAL, -homa_ioc_mcast(&self->hsk.inet.sk,
+			(unsigned long) &args));
+}
+TEST_F(homa_plumbing, homa_ioc_mcast__empty_message)
+{
+	struct homa_mcast_dest dests[1];
+	struct homa_mcast_args args = {self->send_vec, 0, 1, dests};
+	EXPECT_EQ(EINVAL, -homa_ioc_mcast(&self->hsk.inet.sk,
+			(unsigned long) &args));
+}
+TEST_F(homa_plumbing, homa_ioc_mcast__cant_allocate_page)
+{
+	struct homa_mcast_dest dests[1];
+	struct homa_mcast_args args = {self->send_vec, 2, 1, dests};
+	mock_alloc_page_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_ioc_mcast(&self->hsk.inet.sk,
+			(unsigned long) &args));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_ioc_mcast__error_copying_data)
+{
+	struct homa_mcast_dest dests[1];
+	struct homa_mcast_args args = {self->send_vec, 2, 1, dests};
+
+	/* The first copy is for args, the second for the data. */
+	mock_copy_data_errors = 2;
+	EXPECT_EQ(EFAULT, -homa_ioc_mcast(&self->hsk.inet.sk,
+			(unsigned long) &args));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_ioc_mcast__basics)
+{
+	struct homa_mcast_dest dests[3];
+	struct homa_mcast_args args = {self->send_vec, 2, 3, dests};
+	struct homa_rpc *crpc;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		dests[i].id = 99;
+		dests[i].completion_cookie = 100 + i;
+		dests[i].dest_addr = self->server_addr;
+		dests[i].error = 99;
+	}
+	EXPECT_EQ(3, homa_ioc_mcast(&self->hsk.inet.sk, (unsigned long) &args));
+	EXPECT_EQ(0, dests[0].error);
+	EXPECT_EQ(0, dests[1].error);
+	EXPECT_EQ(0, dests[2].error);
+	EXPECT_NE(0, dests[0].id);
+	EXPECT_EQ(dests[0].id + 2, dests[1].id);
+	EXPECT_EQ(dests[1].id + 2, dests[2].id);
+	EXPECT_EQ(3, unit_list_length(&self->hsk.active_rpcs));
+	crpc = homa_find_client_rpc(&self->hsk, dests[2].id);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(102, crpc->completion_cookie);
+	EXPECT_EQ(200, crpc->msgout.length);
+	EXPECT_EQ(1, skb_shinfo(crpc->msgout.packets)->nr_frags);
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.mcast_calls);
+	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.mcast_rpcs);
+	EXPECT_EQ(600, homa_cores[cpu_number]->metrics.mcast_shared_bytes);
+	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.send_calls);
+}
+TEST_F(homa_plumbing, homa_ioc_mcast__error_for_one_destination)
+{
+	struct homa_mcast_dest dests[2];
+	struct homa_mcast_args args = {self->send_vec, 2, 2, dests};
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		dests[i].completion_cookie = 0;
+		dests[i].dest_addr = self->server_addr;
+	}
+	dests[0].dest_addr.in6.sin6_family = 1;
+	EXPECT_EQ(1, homa_ioc_mcast(&self->hsk.inet.sk, (unsigned long) &args));
+	EXPECT_EQ(EAFNOSUPPORT, -dests[0].error);
+	EXPECT_EQ(0, dests[0].id);
+	EXPECT_EQ(0, dests[1].error);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_ioc_mcast__error_copying_back_results)
+{
+	struct homa_mcast_dest dests[2];
+	struct homa_mcast_args args = {self->send_vec, 2, 2, dests};
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		dests[i].completion_cookie = 0;
+		dests[i].dest_addr = self->server_addr;
+	}
+	mock_copy_to_user_errors = 2;
+	EXPECT_EQ(1, homa_ioc_mcast(&self->hsk.inet.sk, (unsigned long) &args));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.mcast_rpcs);
+}
+
 TEST_F(homa_plumbing, homa_set_sock_opt__bad_level)
 {
 	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, 0, 0,
@@ -274,6 +473,336 @@ TEST_F(homa_plumbing, homa_set_sock_opt__success)
 	EXPECT_EQ(64, self->hsk.buffer_pool.num_bpages);
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.so_set_buf_calls);
 }
+TEST_F(homa_plumbing, homa_set_sock_opt__weight_bad_optlen)
+{
+	int weight = 5;
+
+	self->optval.user = &weight;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_WEIGHT, self->optval, sizeof(int) + 1));
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__weight_out_of_range)
+{
+	int weight = 0;
+
+	self->optval.user = &weight;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_WEIGHT, self->optval, sizeof(int)));
+	weight = HOMA_MAX_WEIGHT + 1;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_WEIGHT, self->optval, sizeof(int)));
+	EXPECT_EQ(1, self->hsk.weight);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__weight_success)
+{
+	int weight = 5;
+
+	self->optval.user = &weight;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_WEIGHT, self->optval, sizeof(int)));
+	EXPECT_EQ(5, self->hsk.weight);
+	EXPECT_EQ(0, self->homa.grantable_weight);
+
+	/* Socket has grantable RPCs, so the total weight changes. */
+	self->hsk.num_grantable = 1;
+	self->homa.grantable_weight = 7;
+	weight = 2;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_WEIGHT, self->optval, sizeof(int)));
+	EXPECT_EQ(2, self->hsk.weight);
+	EXPECT_EQ(4, self->homa.grantable_weight);
+	self->hsk.num_grantable = 0;
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__zerocopy_bad_optlen)
+{
+	int min_length = 10000;
+
+	self->optval.user = &min_length;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_ZEROCOPY, self->optval, sizeof(int) + 1));
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__zerocopy_negative_length)
+{
+	int min_length = -1;
+
+	self->optval.user = &min_length;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_ZEROCOPY, self->optval, sizeof(int)));
+	EXPECT_EQ(0, self->hsk.zerocopy_min_length);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__zerocopy_success)
+{
+	int min_length = 10000;
+
+	self->optval.user = &min_length;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_ZEROCOPY, self->optval, sizeof(int)));
+	EXPECT_EQ(10000, self->hsk.zerocopy_min_length);
+}
+
+TEST_F(homa_plumbing, homa_set_sock_opt__buf_extents_bad_optlen)
+{
+	__u64 length = 10*HOMA_BPAGE_SIZE;
+
+	self->optval.user = &length;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_BUF_EXTENTS, self->optval, sizeof(int)));
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__buf_extents_region_already_set)
+{
+	__u64 length = 10*HOMA_BPAGE_SIZE;
+
+	self->optval.user = &length;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_BUF_EXTENTS, self->optval, sizeof(__u64)));
+	EXPECT_EQ(0, self->hsk.buf_extent_length);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__buf_extents_success)
+{
+	struct homa_set_buf_args args;
+	__u64 length = 16*HOMA_BPAGE_SIZE;
+	char buffer[5000];
+
+	self->optval.user = &length;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_BUF_EXTENTS, self->optval, sizeof(__u64)));
+
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	self->optval.user = &args;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(16, self->hsk.buffer_pool.num_extent_bpages);
+	EXPECT_EQ(48, self->hsk.buffer_pool.extent_start);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__buf_nodes_bad_value)
+{
+	int num_nodes = 3;
+
+	self->optval.user = &num_nodes;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_BUF_NODES, self->optval, sizeof(__u64)));
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_BUF_NODES, self->optval, sizeof(int)));
+	num_nodes = -1;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_BUF_NODES, self->optval, sizeof(int)));
+	EXPECT_EQ(0, self->hsk.buf_num_nodes);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__buf_nodes_region_already_set)
+{
+	int num_nodes = 2;
+
+	self->optval.user = &num_nodes;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_BUF_NODES, self->optval, sizeof(int)));
+	EXPECT_EQ(0, self->hsk.buf_num_nodes);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__buf_nodes_success)
+{
+	struct homa_set_buf_args args;
+	int num_nodes = 2;
+	char buffer[5000];
+
+	self->optval.user = &num_nodes;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_BUF_NODES, self->optval, sizeof(int)));
+
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	self->optval.user = &args;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(2, self->hsk.buffer_pool.num_nodes);
+	EXPECT_EQ(32, self->hsk.buffer_pool.node_bpages);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__softirq_copy_bad_value)
+{
+	int min_length = 100000;
+
+	self->optval.user = &min_length;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SOFTIRQ_COPY, self->optval, sizeof(__u64)));
+	min_length = -1;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SOFTIRQ_COPY, self->optval, sizeof(int)));
+	EXPECT_EQ(0, self->hsk.softirq_copy_length);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__softirq_copy_region_already_set)
+{
+	int min_length = 100000;
+
+	self->optval.user = &min_length;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SOFTIRQ_COPY, self->optval, sizeof(int)));
+	EXPECT_EQ(0, self->hsk.softirq_copy_length);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__softirq_copy_success)
+{
+	struct homa_set_buf_args args;
+	int min_length = 100000;
+	char buffer[5000];
+
+	self->optval.user = &min_length;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SOFTIRQ_COPY, self->optval, sizeof(int)));
+	EXPECT_EQ(100000, self->hsk.softirq_copy_length);
+
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	self->optval.user = &args;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_NE(NULL, self->hsk.buffer_pool.pinned_pages);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__softirq_copy_replace_region)
+{
+	struct homa_set_buf_args args;
+	char buffer[5000];
+
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	self->hsk.softirq_copy_length = 100000;
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	self->optval.user = &args;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(64*HOMA_BPAGE_SIZE/PAGE_SIZE, mock_mm.locked_vm);
+
+	/* The first region's pages must be unpinned and uncharged. */
+	args.length = 32*HOMA_BPAGE_SIZE;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(32*HOMA_BPAGE_SIZE/PAGE_SIZE,
+			self->hsk.buffer_pool.num_pinned_pages);
+	EXPECT_EQ(32*HOMA_BPAGE_SIZE/PAGE_SIZE, mock_mm.locked_vm);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__softirq_copy_pin_fails)
+{
+	struct homa_set_buf_args args;
+	char buffer[5000];
+
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	self->hsk.softirq_copy_length = 100000;
+	mock_pin_user_pages_errors = 1;
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	self->optval.user = &args;
+	EXPECT_EQ(EFAULT, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_NE(NULL, self->hsk.buffer_pool.region);
+	EXPECT_EQ(NULL, self->hsk.buffer_pool.pinned_pages);
+}
+#ifdef CONFIG_HUGETLB_PAGE
+TEST_F(homa_plumbing, homa_set_sock_opt__set_buf_huge_pages)
+{
+	struct homa_set_buf_args args;
+	struct vm_area_struct vma;
+	struct mm_struct mm;
+	char buffer[5000];
+
+	memset(&vma, 0, sizeof(vma));
+	vma.vm_flags = VM_HUGETLB;
+	mock_vma = &vma;
+	mock_task.mm = &mm;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	self->optval.user = &args;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.so_set_buf_hugepages);
+}
+#endif
+
+TEST_F(homa_plumbing, homa_getsockopt__unsupported_option)
+{
+	struct homa_pool_stats stats;
+	int length = sizeof(stats);
+
+	EXPECT_EQ(EINVAL, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, (char *) &stats, &length));
+	EXPECT_EQ(EINVAL, -homa_getsockopt(&self->hsk.sock, 0,
+			SO_HOMA_POOL_STATS, (char *) &stats, &length));
+}
+TEST_F(homa_plumbing, homa_getsockopt__cant_read_length)
+{
+	struct homa_pool_stats stats;
+	int length = sizeof(stats);
+
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_POOL_STATS, (char *) &stats, &length));
+}
+TEST_F(homa_plumbing, homa_getsockopt__length_too_short)
+{
+	struct homa_pool_stats stats;
+	int length = sizeof(stats) - 1;
+
+	EXPECT_EQ(EINVAL, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_POOL_STATS, (char *) &stats, &length));
+}
+TEST_F(homa_plumbing, homa_getsockopt__cant_copy_out)
+{
+	struct homa_pool_stats stats;
+	int length = sizeof(stats);
+
+	mock_copy_to_user_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_POOL_STATS, (char *) &stats, &length));
+}
+TEST_F(homa_plumbing, homa_getsockopt__share_stats)
+{
+	struct homa_share_stats stats;
+	int length = sizeof(stats);
+
+	self->hsk.weight = 4;
+	self->hsk.granted_bytes = 20000;
+	self->hsk.share_limited = 3;
+	atomic64_set(&self->hsk.paced_bytes, 7000);
+	EXPECT_EQ(0, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SHARE_STATS, (char *) &stats, &length));
+	EXPECT_EQ(sizeof(stats), length);
+	EXPECT_EQ(4, stats.weight);
+	EXPECT_EQ(20000, stats.granted_bytes);
+	EXPECT_EQ(7000, stats.paced_bytes);
+	EXPECT_EQ(3, stats.share_limited);
+
+	length = sizeof(stats) - 1;
+	EXPECT_EQ(EINVAL, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SHARE_STATS, (char *) &stats, &length));
+}
+TEST_F(homa_plumbing, homa_getsockopt__pool_stats)
+{
+	struct homa_pool_stats stats;
+	int length = sizeof(stats) + 8;
+
+	atomic64_set(&self->hsk.buffer_pool.alloc_failures, 5);
+	EXPECT_EQ(0, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_POOL_STATS, (char *) &stats, &length));
+	EXPECT_EQ(sizeof(stats), length);
+	EXPECT_EQ(self->hsk.buffer_pool.num_bpages, stats.num_bpages);
+	EXPECT_EQ(5, stats.alloc_failures);
+}
 
 TEST_F(homa_plumbing, homa_sendmsg__args_not_in_user_space)
 {
@@ -420,6 +949,13 @@ TEST_F(homa_plumbing, homa_sendmsg__response_succeeds)
 	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
 }
 
+TEST_F(homa_plumbing, homa_recvmsg__error_queue)
+{
+	EXPECT_EQ(EAGAIN, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, MSG_ERRQUEUE, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_SUBSTR("sock_recv_errqueue", unit_log_get());
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.recv_calls);
+}
 TEST_F(homa_plumbing, homa_recvmsg__wrong_args_length)
 {
 	self->recvmsg_hdr.msg_controllen -= 1;
@@ -607,6 +1143,165 @@ TEST_F(homa_plumbing, homa_recvmsg__delete_server_rpc_after_error)
 	EXPECT_EQ(RPC_DEAD, srpc->state);
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
 }
+TEST_F(homa_plumbing, homa_recvmsg__message_too_long_without_streaming)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->server_id, 2000000, 100);
+	int incoming_delta = 0;
+
+	ASSERT_NE(NULL, srpc);
+	self->data.message_length = htonl(2000000);
+	self->data.seg.offset = htonl(1400);
+	self->data.seg.segment_length = htonl(1998600);
+	homa_data_pkt(mock_skb_new(self->client_ip, &self->data.common,
+			1998600, 0), srpc, NULL, &incoming_delta);
+
+	EXPECT_EQ(EMSGSIZE, -homa_recvmsg(&self->hsk.inet.sk,
+			&self->recvmsg_hdr, 0, 0,
+			&self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(self->server_id, self->recvmsg_args.id);
+	EXPECT_EQ(0, self->recvmsg_args.num_bpages);
+	EXPECT_EQ(RPC_DEAD, srpc->state);
+	EXPECT_EQ(31, srpc->msgin.num_bpages);
+	EXPECT_EQ(0, srpc->msgin.stream_bpages);
+}
+TEST_F(homa_plumbing, homa_recvmsg__stream_partial_message)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->server_id, 200000, 100);
+	int incoming_delta = 0;
+
+	ASSERT_NE(NULL, srpc);
+	self->data.message_length = htonl(200000);
+	self->data.seg.offset = htonl(1400);
+	self->data.seg.segment_length = htonl(70000);
+	homa_data_pkt(mock_skb_new(self->client_ip, &self->data.common,
+			70000, 0), srpc, NULL, &incoming_delta);
+	self->recvmsg_args.flags |= HOMA_RECVMSG_STREAM;
+
+	EXPECT_EQ(HOMA_BPAGE_SIZE, homa_recvmsg(&self->hsk.inet.sk,
+			&self->recvmsg_hdr, 0, 0,
+			&self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(self->server_id, self->recvmsg_args.id);
+	EXPECT_EQ(1, self->recvmsg_args.num_bpages);
+	EXPECT_EQ(srpc->msgin.bpage_offsets[0],
+			self->recvmsg_args.bpage_offsets[0]);
+	EXPECT_EQ(0, self->recvmsg_hdr.msg_flags & MSG_EOR);
+	EXPECT_EQ(RPC_INCOMING, srpc->state);
+	EXPECT_EQ(HOMA_BPAGE_SIZE, srpc->msgin.stream_offset);
+	EXPECT_EQ(1, srpc->msgin.stream_bpages);
+	EXPECT_EQ(1, self->hsk.streaming);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_requests));
+
+	/* The rest of the message hasn't arrived yet. */
+	self->recvmsg_hdr.msg_control = &self->recvmsg_args;
+	EXPECT_EQ(EAGAIN, -homa_recvmsg(&self->hsk.inet.sk,
+			&self->recvmsg_hdr, 0, 0,
+			&self->recvmsg_hdr.msg_namelen));
+}
+TEST_F(homa_plumbing, homa_recvmsg__stream_whole_message)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->server_id, 100000, 100);
+
+	ASSERT_NE(NULL, srpc);
+	self->recvmsg_args.flags |= HOMA_RECVMSG_STREAM;
+
+	EXPECT_EQ(100000, homa_recvmsg(&self->hsk.inet.sk,
+			&self->recvmsg_hdr, 0, 0,
+			&self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(2, self->recvmsg_args.num_bpages);
+	EXPECT_EQ(MSG_EOR, self->recvmsg_hdr.msg_flags & MSG_EOR);
+	EXPECT_EQ(RPC_IN_SERVICE, srpc->state);
+	EXPECT_EQ(2, srpc->msgin.stream_bpages);
+}
+TEST_F(homa_plumbing, homa_recvmsg__stream_more_available_immediately)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->server_id, 2000000, 100);
+	int incoming_delta = 0;
+
+	ASSERT_NE(NULL, srpc);
+	self->data.message_length = htonl(2000000);
+	self->data.seg.offset = htonl(1400);
+	self->data.seg.segment_length = htonl(1998600);
+	homa_data_pkt(mock_skb_new(self->client_ip, &self->data.common,
+			1998600, 0), srpc, NULL, &incoming_delta);
+	self->recvmsg_args.flags |= HOMA_RECVMSG_STREAM;
+
+	EXPECT_EQ(HOMA_MAX_BPAGES*HOMA_BPAGE_SIZE, homa_recvmsg(
+			&self->hsk.inet.sk, &self->recvmsg_hdr, 0, 0,
+			&self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(HOMA_MAX_BPAGES, self->recvmsg_args.num_bpages);
+	EXPECT_EQ(0, self->recvmsg_hdr.msg_flags & MSG_EOR);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_requests));
+
+	self->recvmsg_hdr.msg_control = &self->recvmsg_args;
+	self->recvmsg_args.num_bpages = 0;
+	EXPECT_EQ(2000000 - HOMA_MAX_BPAGES*HOMA_BPAGE_SIZE, homa_recvmsg(
+			&self->hsk.inet.sk, &self->recvmsg_hdr, 0, 0,
+			&self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(15, self->recvmsg_args.num_bpages);
+	EXPECT_EQ(srpc->msgin.bpage_offsets[HOMA_MAX_BPAGES],
+			self->recvmsg_args.bpage_offsets[0]);
+	EXPECT_EQ(MSG_EOR, self->recvmsg_hdr.msg_flags & MSG_EOR);
+	EXPECT_EQ(RPC_IN_SERVICE, srpc->state);
+}
+TEST_F(homa_plumbing, homa_recvmsg__stream_error_after_partial_message)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->server_id, 200000, 100);
+	int incoming_delta = 0;
+
+	ASSERT_NE(NULL, srpc);
+	self->data.message_length = htonl(200000);
+	self->data.seg.offset = htonl(1400);
+	self->data.seg.segment_length = htonl(70000);
+	homa_data_pkt(mock_skb_new(self->client_ip, &self->data.common,
+			70000, 0), srpc, NULL, &incoming_delta);
+	self->recvmsg_args.flags |= HOMA_RECVMSG_STREAM;
+	EXPECT_EQ(HOMA_BPAGE_SIZE, homa_recvmsg(&self->hsk.inet.sk,
+			&self->recvmsg_hdr, 0, 0,
+			&self->recvmsg_hdr.msg_namelen));
+
+	srpc->error = -ENOMEM;
+	homa_rpc_handoff(srpc);
+	self->recvmsg_hdr.msg_control = &self->recvmsg_args;
+	self->recvmsg_args.num_bpages = 0;
+	EXPECT_EQ(ENOMEM, -homa_recvmsg(&self->hsk.inet.sk,
+			&self->recvmsg_hdr, 0, 0,
+			&self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(0, self->recvmsg_args.num_bpages);
+	EXPECT_EQ(RPC_DEAD, srpc->state);
+	EXPECT_EQ(4, srpc->msgin.num_bpages);
+	EXPECT_EQ(1, srpc->msgin.stream_bpages);
+}
+TEST_F(homa_plumbing, homa_recvmsg__streamed_message_received_normally)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->server_id, 100000, 100);
+	int incoming_delta = 0;
+
+	ASSERT_NE(NULL, srpc);
+	self->data.message_length = htonl(100000);
+	self->data.seg.offset = htonl(1400);
+	self->data.seg.segment_length = htonl(98600);
+	homa_data_pkt(mock_skb_new(self->client_ip, &self->data.common,
+			98600, 0), srpc, NULL, &incoming_delta);
+	srpc->msgin.streaming = 1;
+
+	EXPECT_EQ(EMSGSIZE, -homa_recvmsg(&self->hsk.inet.sk,
+			&self->recvmsg_hdr, 0, 0,
+			&self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(0, self->recvmsg_args.num_bpages);
+	EXPECT_EQ(RPC_DEAD, srpc->state);
+}
 TEST_F(homa_plumbing, homa_recvmsg__error_copying_out_args)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
@@ -636,6 +1331,259 @@ TEST_F(homa_plumbing, homa_recvmsg__copy_back_args_even_after_error)
 	EXPECT_EQ(0, self->recvmsg_args.num_bpages);
 }
 
+TEST_F(homa_plumbing, homa_recvmmsg__bogus_args)
+{
+	struct homa_recvmmsg_msg msgs[2];
+	struct homa_recvmmsg_args args = {.flags = HOMA_RECVMSG_RESPONSE
+			| HOMA_RECVMSG_NONBLOCKING, .num_msgs = 0,
+			.max_msgs = 2, .msgs = msgs};
+
+	self->recvmsg_hdr.msg_control = &args;
+	self->recvmsg_hdr.msg_controllen = sizeof(args);
+	EXPECT_EQ(EAGAIN, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	self->recvmsg_hdr.msg_control = &args;
+	args.max_msgs = HOMA_MAX_RECV_BATCH + 1;
+	EXPECT_EQ(EINVAL, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	self->recvmsg_hdr.msg_control = &args;
+	args.max_msgs = 2;
+	args.num_msgs = 3;
+	EXPECT_EQ(EINVAL, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(0, args.num_msgs);
+}
+TEST_F(homa_plumbing, homa_recvmmsg__stream_not_allowed)
+{
+	struct homa_recvmmsg_msg msgs[2];
+	struct homa_recvmmsg_args args = {.flags = HOMA_RECVMSG_RESPONSE
+			| HOMA_RECVMSG_NONBLOCKING | HOMA_RECVMSG_STREAM,
+			.num_msgs = 0, .max_msgs = 2, .msgs = msgs};
+
+	self->recvmsg_hdr.msg_control = &args;
+	self->recvmsg_hdr.msg_controllen = sizeof(args);
+	EXPECT_EQ(EINVAL, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+}
+TEST_F(homa_plumbing, homa_recvmmsg__release_buffers)
+{
+	struct homa_recvmmsg_msg msgs[2];
+	struct homa_recvmmsg_args args = {.flags = HOMA_RECVMSG_RESPONSE
+			| HOMA_RECVMSG_NONBLOCKING, .num_msgs = 2,
+			.max_msgs = 2, .msgs = msgs};
+
+	EXPECT_EQ(0, -homa_pool_get_pages(&self->hsk.buffer_pool, 1,
+			msgs[0].bpage_offsets, 0));
+	EXPECT_EQ(0, -homa_pool_get_pages(&self->hsk.buffer_pool, 1,
+			msgs[1].bpage_offsets, 0));
+	msgs[0].num_bpages = 1;
+	msgs[1].num_bpages = 1;
+	EXPECT_EQ(1, atomic_read(&self->hsk.buffer_pool.descriptors[0].refs));
+	EXPECT_EQ(1, atomic_read(&self->hsk.buffer_pool.descriptors[1].refs));
+
+	self->recvmsg_hdr.msg_control = &args;
+	self->recvmsg_hdr.msg_controllen = sizeof(args);
+	EXPECT_EQ(EAGAIN, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool.descriptors[0].refs));
+	EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool.descriptors[1].refs));
+	EXPECT_EQ(0, args.num_msgs);
+}
+TEST_F(homa_plumbing, homa_recvmmsg__multiple_messages)
+{
+	struct homa_recvmmsg_msg msgs[3];
+	struct homa_recvmmsg_args args = {.flags = HOMA_RECVMSG_RESPONSE
+			| HOMA_RECVMSG_REQUEST, .num_msgs = 0,
+			.max_msgs = 3, .msgs = msgs};
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id, 100, 2000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id+2, 100, 3000);
+	EXPECT_NE(NULL, crpc1);
+	EXPECT_NE(NULL, crpc2);
+	crpc1->completion_cookie = 44444;
+	crpc2->completion_cookie = 55555;
+	EXPECT_EQ(2, unit_list_length(&self->hsk.active_rpcs));
+
+	self->recvmsg_hdr.msg_control = &args;
+	self->recvmsg_hdr.msg_controllen = sizeof(args);
+	EXPECT_EQ(2, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(2, args.num_msgs);
+	EXPECT_EQ(self->client_id, msgs[0].id);
+	EXPECT_EQ(2000, msgs[0].length);
+	EXPECT_EQ(44444, msgs[0].completion_cookie);
+	EXPECT_EQ(1, msgs[0].num_bpages);
+	EXPECT_EQ(self->client_id+2, msgs[1].id);
+	EXPECT_EQ(3000, msgs[1].length);
+	EXPECT_EQ(55555, msgs[1].completion_cookie);
+	EXPECT_STREQ("1.2.3.4", homa_print_ipv6_addr(
+			&msgs[1].peer_addr.in6.sin6_addr));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(sizeof(struct homa_recvmmsg_args),
+			(char *) self->recvmsg_hdr.msg_control
+			- (char *) &args);
+}
+TEST_F(homa_plumbing, homa_recvmmsg__rpc_with_error)
+{
+	struct homa_recvmmsg_msg msgs[2];
+	struct homa_recvmmsg_args args = {.flags = HOMA_RECVMSG_RESPONSE
+			| HOMA_RECVMSG_NONBLOCKING, .num_msgs = 0,
+			.max_msgs = 2, .msgs = msgs};
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id, 100, 2000);
+	EXPECT_NE(NULL, crpc);
+	homa_rpc_abort(crpc, -ETIMEDOUT);
+
+	self->recvmsg_hdr.msg_control = &args;
+	self->recvmsg_hdr.msg_controllen = sizeof(args);
+	EXPECT_EQ(1, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(self->client_id, msgs[0].id);
+	EXPECT_EQ(-ETIMEDOUT, msgs[0].length);
+	EXPECT_EQ(0, msgs[0].num_bpages);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_recvmmsg__message_too_long)
+{
+	struct homa_recvmmsg_msg msgs[2];
+	struct homa_recvmmsg_args args = {.flags = HOMA_RECVMSG_REQUEST
+			| HOMA_RECVMSG_NONBLOCKING, .num_msgs = 0,
+			.max_msgs = 2, .msgs = msgs};
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->server_id, 2000000, 100);
+	int incoming_delta = 0;
+
+	ASSERT_NE(NULL, srpc);
+	self->data.message_length = htonl(2000000);
+	self->data.seg.offset = htonl(1400);
+	self->data.seg.segment_length = htonl(1998600);
+	homa_data_pkt(mock_skb_new(self->client_ip, &self->data.common,
+			1998600, 0), srpc, NULL, &incoming_delta);
+
+	self->recvmsg_hdr.msg_control = &args;
+	self->recvmsg_hdr.msg_controllen = sizeof(args);
+	EXPECT_EQ(1, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(self->server_id, msgs[0].id);
+	EXPECT_EQ(-EMSGSIZE, msgs[0].length);
+	EXPECT_EQ(0, msgs[0].num_bpages);
+	EXPECT_EQ(RPC_DEAD, srpc->state);
+}
+TEST_F(homa_plumbing, homa_recvmmsg__error_copying_out_message)
+{
+	struct homa_recvmmsg_msg msgs[2];
+	struct homa_recvmmsg_args args = {.flags = HOMA_RECVMSG_RESPONSE
+			| HOMA_RECVMSG_NONBLOCKING, .num_msgs = 0,
+			.max_msgs = 2, .msgs = msgs};
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id, 100, 2000);
+	EXPECT_NE(NULL, crpc);
+	mock_copy_to_user_errors = 1;
+
+	self->recvmsg_hdr.msg_control = &args;
+	self->recvmsg_hdr.msg_controllen = sizeof(args);
+	EXPECT_EQ(EFAULT, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(0, args.num_msgs);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+
+TEST_F(homa_plumbing, homa_udp_encap_rcv__basics)
+{
+	struct sk_buff *skb;
+	unsigned char *homa_header;
+
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 1400);
+	homa_header = skb->data;
+	memset(skb_push(skb, sizeof(struct udphdr)), 0,
+			sizeof(struct udphdr));
+	EXPECT_EQ(-IPPROTO_HOMA, homa_udp_encap_rcv(NULL, skb));
+	EXPECT_EQ(homa_header, skb->data);
+	EXPECT_EQ(homa_header, skb_transport_header(skb));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.udp_packets_received);
+	kfree_skb(skb);
+}
+TEST_F(homa_plumbing, homa_udp_encap_rcv__adjust_ip_length)
+{
+	struct sk_buff *skb;
+
+	mock_ipv6 = true;
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 1400);
+	memset(skb_push(skb, sizeof(struct udphdr)), 0,
+			sizeof(struct udphdr));
+	ipv6_hdr(skb)->payload_len = htons(skb->len);
+	EXPECT_EQ(-IPPROTO_HOMA, homa_udp_encap_rcv(NULL, skb));
+	EXPECT_EQ(skb->len, ntohs(ipv6_hdr(skb)->payload_len));
+	kfree_skb(skb);
+
+	mock_ipv6 = false;
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 1400);
+	memset(skb_push(skb, sizeof(struct udphdr)), 0,
+			sizeof(struct udphdr));
+	ip_hdr(skb)->tot_len = htons(sizeof(struct iphdr) + skb->len);
+	EXPECT_EQ(-IPPROTO_HOMA, homa_udp_encap_rcv(NULL, skb));
+	EXPECT_EQ(sizeof(struct iphdr) + skb->len,
+			ntohs(ip_hdr(skb)->tot_len));
+	kfree_skb(skb);
+}
+TEST_F(homa_plumbing, homa_udp_encap_rcv__packet_too_short)
+{
+	struct sk_buff *skb;
+
+	skb = mock_skb_new(self->client_ip, &self->data.common, 0, 0);
+	skb_trim(skb, 10);
+	memset(skb_push(skb, sizeof(struct udphdr)), 0,
+			sizeof(struct udphdr));
+	EXPECT_EQ(0, homa_udp_encap_rcv(NULL, skb));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.short_packets);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.udp_packets_received);
+}
+TEST_F(homa_plumbing, homa_udp_config)
+{
+	unit_log_clear();
+	self->homa.udp_port = 4000;
+	EXPECT_EQ(0, homa_udp_config(&self->homa));
+	EXPECT_SUBSTR("udp_sock_create family 10, port 4000; "
+			"setup_udp_tunnel_sock encap_type 1", unit_log_get());
+	EXPECT_NE(NULL, self->homa.udp_sock);
+
+	/* Changing the port reopens the socket. */
+	unit_log_clear();
+	self->homa.udp_port = 4001;
+	EXPECT_EQ(0, homa_udp_config(&self->homa));
+	EXPECT_SUBSTR("udp_tunnel_sock_release; "
+			"udp_sock_create family 10, port 4001", unit_log_get());
+
+	/* Zero closes the socket. */
+	unit_log_clear();
+	self->homa.udp_port = 0;
+	EXPECT_EQ(0, homa_udp_config(&self->homa));
+	EXPECT_STREQ("udp_tunnel_sock_release", unit_log_get());
+	EXPECT_EQ(NULL, self->homa.udp_sock);
+}
+TEST_F(homa_plumbing, homa_udp_config__fall_back_to_ipv4)
+{
+	unit_log_clear();
+	self->homa.udp_port = 4000;
+	mock_udp_sock_errors = 1;
+	EXPECT_EQ(0, homa_udp_config(&self->homa));
+	EXPECT_SUBSTR("udp_sock_create family 2, port 4000", unit_log_get());
+	EXPECT_NE(NULL, self->homa.udp_sock);
+}
+TEST_F(homa_plumbing, homa_udp_config__cant_create_socket)
+{
+	self->homa.udp_port = 4000;
+	mock_udp_sock_errors = 3;
+	EXPECT_EQ(EADDRINUSE, -homa_udp_config(&self->homa));
+	EXPECT_EQ(NULL, self->homa.udp_sock);
+	EXPECT_EQ(0, self->homa.udp_port);
+}
 TEST_F(homa_plumbing, homa_softirq__basics)
 {
 	struct sk_buff *skb;
@@ -643,21 +1591,25 @@ TEST_F(homa_plumbing, homa_softirq__basics)
 	homa_softirq(skb);
 	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
 }
-TEST_F(homa_plumbing, homa_softirq__reorder_incoming_packets)
+TEST_F(homa_plumbing, homa_softirq__long_packet_after_short_packets)
 {
 	struct sk_buff *skb, *skb2, *skb3, *skb4;
 
 	self->data.common.sender_id = cpu_to_be64(2000);
 	self->data.message_length = htonl(2000);
+	self->data.seg.segment_length = htonl(1400);
 	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
 	self->data.common.sender_id = cpu_to_be64(200);
 	self->data.message_length = htonl(200);
+	self->data.seg.segment_length = htonl(200);
 	skb2 = mock_skb_new(self->client_ip, &self->data.common, 200, 0);
 	self->data.common.sender_id = cpu_to_be64(300);
 	self->data.message_length = htonl(300);
+	self->data.seg.segment_length = htonl(300);
 	skb3 = mock_skb_new(self->client_ip, &self->data.common, 300, 0);
 	self->data.common.sender_id = cpu_to_be64(5000);
 	self->data.message_length = htonl(5000);
+	self->data.seg.segment_length = htonl(1400);
 	skb4 = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
 	skb_shinfo(skb)->frag_list = skb2;
 	skb2->next = skb3;
@@ -668,19 +1620,22 @@ TEST_F(homa_plumbing, homa_softirq__reorder_incoming_packets)
 	unit_log_active_ids(&self->hsk);
 	EXPECT_STREQ("201 301 2001 5001", unit_log_get());
 }
-TEST_F(homa_plumbing, homa_softirq__reorder_short_packet_at_front)
+TEST_F(homa_plumbing, homa_softirq__short_packet_first)
 {
 	struct sk_buff *skb, *skb2, *skb3, *skb4;
 
 	self->data.common.sender_id = cpu_to_be64(200);
 	self->data.message_length = htonl(200);
+	self->data.seg.segment_length = htonl(200);
 	skb = mock_skb_new(self->client_ip, &self->data.common, 200, 0);
-	self->data.common.sender_id = cpu_to_be64(4000);
-	self->data.message_length = htonl(4000);
-	skb2 = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
 	self->data.common.sender_id = cpu_to_be64(300);
 	self->data.message_length = htonl(300);
-	skb3 = mock_skb_new(self->client_ip, &self->data.common, 300, 0);
+	self->data.seg.segment_length = htonl(300);
+	skb2 = mock_skb_new(self->client_ip, &self->data.common, 300, 0);
+	self->data.common.sender_id = cpu_to_be64(4000);
+	self->data.message_length = htonl(4000);
+	self->data.seg.segment_length = htonl(1400);
+	skb3 = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
 	self->data.common.sender_id = cpu_to_be64(5000);
 	self->data.message_length = htonl(5000);
 	skb4 = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
@@ -693,10 +1648,11 @@ TEST_F(homa_plumbing, homa_softirq__reorder_short_packet_at_front)
 	unit_log_active_ids(&self->hsk);
 	EXPECT_STREQ("201 301 4001 5001", unit_log_get());
 }
-TEST_F(homa_plumbing, homa_softirq__nothing_to_reorder)
+TEST_F(homa_plumbing, homa_softirq__no_short_packets)
 {
 	struct sk_buff *skb, *skb2, *skb3;
 
+	self->data.seg.segment_length = htonl(1400);
 	self->data.common.sender_id = cpu_to_be64(2000);
 	self->data.message_length = htonl(2000);
 	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
@@ -741,6 +1697,43 @@ TEST_F(homa_plumbing, homa_softirq__packet_too_short)
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.short_packets);
 }
+TEST_F(homa_plumbing, homa_softirq__accept_legacy_resend_length)
+{
+	struct sk_buff *skb;
+	struct resend_header h;
+	memset(&h, 0, sizeof(h));
+	h.common.type = RESEND;
+	skb = mock_skb_new(self->client_ip, &h.common, 0, 0);
+	skb->len = HOMA_RESEND_MIN_LENGTH;
+	homa_softirq(skb);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.short_packets);
+	skb = mock_skb_new(self->client_ip, &h.common, 0, 0);
+	skb->len = HOMA_RESEND_MIN_LENGTH - 1;
+	homa_softirq(skb);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.short_packets);
+}
+TEST_F(homa_plumbing, homa_softirq__accept_legacy_grant_and_busy_lengths)
+{
+	struct sk_buff *skb;
+	struct grant_header h;
+	struct busy_header busy;
+	memset(&h, 0, sizeof(h));
+	h.common.type = GRANT;
+	skb = mock_skb_new(self->client_ip, &h.common, 0, 0);
+	skb->len = HOMA_GRANT_MIN_LENGTH;
+	homa_softirq(skb);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.short_packets);
+	memset(&busy, 0, sizeof(busy));
+	busy.common.type = BUSY;
+	skb = mock_skb_new(self->client_ip, &busy.common, 0, 0);
+	skb->len = HOMA_BUSY_MIN_LENGTH;
+	homa_softirq(skb);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.short_packets);
+	skb = mock_skb_new(self->client_ip, &busy.common, 0, 0);
+	skb->len = HOMA_BUSY_MIN_LENGTH - 1;
+	homa_softirq(skb);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.short_packets);
+}
 TEST_F(homa_plumbing, homa_softirq__bogus_packet_type)
 {
 	struct sk_buff *skb;
@@ -780,6 +1773,27 @@ TEST_F(homa_plumbing, homa_softirq__unknown_socket_ipv6)
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
 	EXPECT_STREQ("icmp6_send type 1, code 4", unit_log_get());
 }
+TEST_F(homa_plumbing, homa_softirq__port_group)
+{
+	struct homa_sock sock2, sock3;
+	struct sk_buff *skb;
+
+	mock_sock_init(&sock2, &self->homa, 0);
+	mock_sock_init(&sock3, &self->homa, 0);
+	sock2.inet.sk.sk_reuseport = 1;
+	sock3.inet.sk.sk_reuseport = 1;
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &sock2, 100));
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &sock3, 100));
+	self->data.common.dport = htons(100);
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 1400);
+	homa_softirq(skb);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_list_length(&sock2.active_rpcs)
+			+ unit_list_length(&sock3.active_rpcs));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.group_lookups);
+	homa_sock_destroy(&sock2);
+	homa_sock_destroy(&sock3);
+}
 TEST_F(homa_plumbing, homa_softirq__multiple_packets_different_sockets)
 {
 	struct sk_buff *skb, *skb2;
@@ -870,6 +1884,92 @@ TEST_F(homa_plumbing, homa_metrics_read__error_copying_to_user)
 	EXPECT_EQ(EFAULT, -homa_metrics_read(NULL, buffer, 5, &offset));
 }
 
+TEST_F(homa_plumbing, homa_metrics_bin_read__header)
+{
+	struct homa_metrics_header header;
+	loff_t offset = 0;
+
+	EXPECT_EQ(sizeof(header), homa_metrics_bin_read(NULL,
+			(char *) &header, sizeof(header), &offset));
+	EXPECT_EQ(HOMA_METRICS_MAGIC, header.magic);
+	EXPECT_EQ(HOMA_METRICS_VERSION, header.version);
+	EXPECT_EQ(sizeof(header), header.header_bytes);
+	EXPECT_EQ(homa_metrics_schema_length, header.num_fields);
+	EXPECT_EQ(nr_cpu_ids, header.num_cores);
+	EXPECT_EQ(sizeof(struct homa_metrics), header.core_bytes);
+	EXPECT_EQ(sizeof(header) + homa_metrics_schema_length
+			* sizeof(struct homa_metrics_field),
+			header.cores_offset);
+	EXPECT_EQ(sizeof(header), offset);
+}
+TEST_F(homa_plumbing, homa_metrics_bin_read__schema_covers_all_metrics)
+{
+	__u32 offset = 0;
+	int i;
+
+	for (i = 0; i < homa_metrics_schema_length; i++) {
+		EXPECT_EQ(offset, homa_metrics_schema[i].offset);
+		offset += homa_metrics_schema[i].count * sizeof(__u64);
+	}
+	EXPECT_EQ(sizeof(struct homa_metrics), offset);
+	EXPECT_STREQ("small_msg_bytes", homa_metrics_schema[0].name);
+	EXPECT_EQ(HOMA_NUM_SMALL_COUNTS, homa_metrics_schema[0].count);
+}
+TEST_F(homa_plumbing, homa_metrics_bin_read__core_records)
+{
+	struct homa_metrics_header header;
+	loff_t offset = 0;
+	__u64 value;
+
+	homa_metrics_bin_read(NULL, (char *) &header, sizeof(header), &offset);
+	homa_cores[2]->metrics.requests_received = 777;
+	offset = header.cores_offset + 2*header.core_bytes
+			+ offsetof(struct homa_metrics, requests_received);
+	EXPECT_EQ(8, homa_metrics_bin_read(NULL, (char *) &value, 8, &offset));
+	EXPECT_EQ(777, value);
+}
+TEST_F(homa_plumbing, homa_metrics_bin_read__span_regions_and_eof)
+{
+	size_t total = sizeof(struct homa_metrics_header)
+			+ homa_metrics_schema_length
+			* sizeof(struct homa_metrics_field)
+			+ nr_cpu_ids * sizeof(struct homa_metrics);
+	char *buffer = kmalloc(total + 100, GFP_KERNEL);
+	loff_t offset = 10;
+
+	EXPECT_EQ(total - 10, homa_metrics_bin_read(NULL, buffer, total + 100,
+			&offset));
+	EXPECT_EQ(total, offset);
+	EXPECT_STREQ("small_msg_bytes", buffer - 10
+			+ sizeof(struct homa_metrics_header));
+
+	unit_log_clear();
+	EXPECT_EQ(0, homa_metrics_bin_read(NULL, buffer, 100, &offset));
+	EXPECT_STREQ("", unit_log_get());
+	kfree(buffer);
+}
+TEST_F(homa_plumbing, homa_metrics_bin_read__error_copying_to_user)
+{
+	char buffer[100];
+	loff_t offset = 0;
+
+	mock_copy_to_user_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_metrics_bin_read(NULL, buffer, 100, &offset));
+}
+
+TEST_F(homa_plumbing, homa_metrics_bin_lseek)
+{
+	struct file file;
+
+	file.f_pos = 100;
+	EXPECT_EQ(40, homa_metrics_bin_lseek(&file, 40, SEEK_SET));
+	EXPECT_EQ(50, homa_metrics_bin_lseek(&file, 10, SEEK_CUR));
+	EXPECT_EQ(50, file.f_pos);
+	EXPECT_EQ(EINVAL, -homa_metrics_bin_lseek(&file, 10, SEEK_END));
+	EXPECT_EQ(EINVAL, -homa_metrics_bin_lseek(&file, -100, SEEK_CUR));
+	EXPECT_EQ(50, file.f_pos);
+}
+
 TEST_F(homa_plumbing, homa_metrics_release)
 {
 	self->homa.metrics_active_opens = 2;
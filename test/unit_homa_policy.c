@@ -0,0 +1,235 @@
+/* Copyright (c) 2023 Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "homa_impl.h"
+#define KSELFTEST_NOT_MAIN 1
+#include "kselftest_harness.h"
+#include "ccutils.h"
+#include "mock.h"
+#include "utils.h"
+
+/* Policy hooks used by the tests below. */
+static int largest_first(struct homa_rpc *rpc1, struct homa_rpc *rpc2)
+{
+	return rpc1->msgin.bytes_remaining > rpc2->msgin.bytes_remaining;
+}
+
+static int hook_priority;
+static int fixed_unsched(struct homa_peer *peer, int length, int priority)
+{
+	return hook_priority;
+}
+
+static int fixed_grant(struct homa_rpc *rpc, int rank, int priority)
+{
+	return hook_priority;
+}
+
+static __u64 newest_first(struct homa_rpc *rpc)
+{
+	return ~rpc->msgin.birth;
+}
+
+FIXTURE(homa_policy) {
+	struct in6_addr client_ip[2];
+	int client_port;
+	struct in6_addr server_ip[1];
+	struct homa homa;
+	struct homa_sock hsk;
+	struct homa_policy_ops ops;
+};
+FIXTURE_SETUP(homa_policy)
+{
+	self->client_ip[0] = unit_get_in_addr("196.168.0.1");
+	self->client_ip[1] = unit_get_in_addr("197.168.0.1");
+	self->client_port = 40000;
+	self->server_ip[0] = unit_get_in_addr("1.2.3.4");
+	homa_init(&self->homa);
+	self->homa.num_priorities = 8;
+	self->homa.max_sched_prio = 3;
+	self->homa.flags |= HOMA_FLAG_DONT_THROTTLE;
+	self->homa.grant_fifo_fraction = 0;
+	mock_sock_init(&self->hsk, &self->homa, 0);
+	memset(&self->ops, 0, sizeof(self->ops));
+	hook_priority = 0;
+	unit_log_clear();
+}
+FIXTURE_TEARDOWN(homa_policy)
+{
+	homa_destroy(&self->homa);
+	unit_teardown();
+}
+
+TEST_F(homa_policy, homa_policy_register__basics)
+{
+	struct homa_policy_ops other;
+
+	memset(&other, 0, sizeof(other));
+	EXPECT_EQ(0, homa_policy_register(&self->homa, &self->ops));
+	EXPECT_EQ(&self->ops, self->homa.policy);
+	EXPECT_EQ(EBUSY, -homa_policy_register(&self->homa, &other));
+	EXPECT_EQ(&self->ops, self->homa.policy);
+
+	/* Unregistering the wrong ops has no effect. */
+	homa_policy_unregister(&self->homa, &other);
+	EXPECT_EQ(&self->ops, self->homa.policy);
+	homa_policy_unregister(&self->homa, &self->ops);
+	EXPECT_EQ(NULL, self->homa.policy);
+}
+TEST_F(homa_policy, homa_policy_register__resort_grantables)
+{
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 1, 20000, 100);
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip+1,
+			self->server_ip, self->client_port, 3, 40000, 100);
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 5, 30000, 100);
+	self->ops.grantable_before = largest_first;
+	EXPECT_EQ(0, homa_policy_register(&self->homa, &self->ops));
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("request from 197.168.0.1, id 3, remaining 38600; "
+			"request from 196.168.0.1, id 5, remaining 28600; "
+			"request from 196.168.0.1, id 1, remaining 18600",
+			unit_log_get());
+	EXPECT_NE(0, homa_cores[cpu_number]->metrics.policy_order_calls);
+
+	homa_policy_unregister(&self->homa, &self->ops);
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("request from 196.168.0.1, id 1, remaining 18600; "
+			"request from 196.168.0.1, id 5, remaining 28600; "
+			"request from 197.168.0.1, id 3, remaining 38600",
+			unit_log_get());
+}
+TEST_F(homa_policy, homa_policy_register__new_rpcs_use_policy)
+{
+	self->ops.grantable_before = largest_first;
+	EXPECT_EQ(0, homa_policy_register(&self->homa, &self->ops));
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 1, 20000, 100);
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 3, 40000, 100);
+	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 5, 30000, 100);
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("request from 196.168.0.1, id 3, remaining 38600; "
+			"request from 196.168.0.1, id 5, remaining 28600; "
+			"request from 196.168.0.1, id 1, remaining 18600",
+			unit_log_get());
+	homa_policy_unregister(&self->homa, &self->ops);
+}
+
+TEST_F(homa_policy, homa_policy_grantable_before__no_hook)
+{
+	struct homa_rpc *srpc1, *srpc2;
+
+	srpc1 = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 1, 20000, 100);
+	srpc2 = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 3, 40000, 100);
+	ASSERT_NE(NULL, srpc1);
+	ASSERT_NE(NULL, srpc2);
+	EXPECT_EQ(-1, homa_policy_grantable_before(srpc1, srpc2));
+	self->ops.fifo_key = newest_first;
+	EXPECT_EQ(0, homa_policy_register(&self->homa, &self->ops));
+	EXPECT_EQ(-1, homa_policy_grantable_before(srpc1, srpc2));
+	self->ops.grantable_before = largest_first;
+	EXPECT_EQ(0, homa_policy_grantable_before(srpc1, srpc2));
+	EXPECT_EQ(1, homa_policy_grantable_before(srpc2, srpc1));
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.policy_order_calls);
+	homa_policy_unregister(&self->homa, &self->ops);
+}
+
+TEST_F(homa_policy, homa_policy_unsched_priority)
+{
+	struct homa_peer peer;
+
+	homa_peer_set_cutoffs(&peer, INT_MAX, 0, 0, INT_MAX, 200, 100, 0, 0);
+	self->homa.num_priorities = 6;
+	self->ops.unsched_priority = fixed_unsched;
+	EXPECT_EQ(0, homa_policy_register(&self->homa, &self->ops));
+	hook_priority = 2;
+	EXPECT_EQ(2, homa_unsched_priority(&self->homa, &peer, 10));
+	hook_priority = 6;
+	EXPECT_EQ(5, homa_unsched_priority(&self->homa, &peer, 10));
+	hook_priority = -1;
+	EXPECT_EQ(0, homa_unsched_priority(&self->homa, &peer, 10));
+	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.policy_unsched_calls);
+	homa_policy_unregister(&self->homa, &self->ops);
+	EXPECT_EQ(5, homa_unsched_priority(&self->homa, &peer, 10));
+}
+
+TEST_F(homa_policy, homa_policy_grant_priority)
+{
+	struct homa_rpc *srpc;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 1, 20000, 100);
+	ASSERT_NE(NULL, srpc);
+	EXPECT_EQ(2, homa_policy_grant_priority(&self->homa, srpc, 0, 2));
+	self->ops.grant_priority = fixed_grant;
+	EXPECT_EQ(0, homa_policy_register(&self->homa, &self->ops));
+	hook_priority = 1;
+	EXPECT_EQ(1, homa_policy_grant_priority(&self->homa, srpc, 0, 2));
+	hook_priority = 4;
+	EXPECT_EQ(3, homa_policy_grant_priority(&self->homa, srpc, 0, 2));
+	hook_priority = -3;
+	EXPECT_EQ(0, homa_policy_grant_priority(&self->homa, srpc, 0, 2));
+	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.policy_grant_calls);
+	homa_policy_unregister(&self->homa, &self->ops);
+}
+TEST_F(homa_policy, homa_policy_grant_priority__used_in_grants)
+{
+	struct homa_rpc *srpc;
+
+	self->ops.grant_priority = fixed_grant;
+	hook_priority = 1;
+	EXPECT_EQ(0, homa_policy_register(&self->homa, &self->ops));
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 1, 20000, 100);
+	ASSERT_NE(NULL, srpc);
+	atomic_set(&self->homa.total_incoming, 10000);
+	self->homa.max_incoming = 11600;
+	unit_log_clear();
+	homa_send_grants(&self->homa);
+	EXPECT_STREQ("xmit GRANT 11400@1", unit_log_get());
+	homa_policy_unregister(&self->homa, &self->ops);
+}
+
+TEST_F(homa_policy, homa_policy_fifo_key)
+{
+	struct homa_rpc *srpc1, *srpc2, *fifo_rpc;
+
+	self->homa.fifo_grant_increment = 5000;
+	mock_cycles = 1000;
+	srpc1 = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 1, 40000, 100);
+	mock_cycles = 2000;
+	srpc2 = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip+1,
+			self->server_ip, self->client_port, 3, 30000, 100);
+	ASSERT_NE(NULL, srpc1);
+	ASSERT_NE(NULL, srpc2);
+	EXPECT_EQ(srpc1->msgin.birth, homa_policy_fifo_key(&self->homa,
+			srpc1));
+
+	self->ops.fifo_key = newest_first;
+	EXPECT_EQ(0, homa_policy_register(&self->homa, &self->ops));
+	fifo_rpc = homa_choose_fifo_grant(&self->homa);
+	EXPECT_EQ(srpc2, fifo_rpc);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.policy_fifo_calls);
+	homa_policy_unregister(&self->homa, &self->ops);
+}
@@ -50,21 +50,8 @@ static void steal_bpages_hook(char *id)
 		return;
 	if (!cur_pool)
 		return;
-	switch (cur_pool->cores[1].next_candidate) {
-	case 1:
-		atomic_set(&cur_pool->descriptors[0].refs, 2);
-		break;
-	case 2:
-		atomic_set(&cur_pool->descriptors[1].refs, 1);
-		cur_pool->descriptors[1].owner = 3;
-		cur_pool->descriptors[1].expiration = mock_cycles + 1;
-	case 3:
-		atomic_set(&cur_pool->descriptors[2].refs, 1);
-		cur_pool->descriptors[2].owner = 3;
-		cur_pool->descriptors[2].expiration = mock_cycles - 1;
-	case 4:
-		atomic_set(&cur_pool->descriptors[3].refs, 1);
-	}
+	atomic_set(&cur_pool->descriptors[cur_pool->cores[2].page_hint].refs,
+			2);
 }
 static void change_owner_hook(char *id)
 {
@@ -75,6 +62,46 @@ static void change_owner_hook(char *id)
 	cur_pool->descriptors[cur_pool->cores[cpu_number].page_hint].owner = -1;
 }
 
+/**
+ * free_stack() - Returns a string containing the indexes of all of the
+ * bpages in a free stack, starting from the top.
+ * @pool:    Pool containing the stack.
+ * @stack:   Head of the stack.
+ */
+static const char *free_stack(struct homa_pool *pool, atomic64_t *stack)
+{
+	__u32 index = (__u32) atomic64_read(stack);
+
+	unit_log_clear();
+	while (index != 0xffffffff) {
+		UNIT_LOG(" ", "%d", index);
+		index = pool->descriptors[index].next_free;
+	}
+	return unit_log_get();
+}
+
+/**
+ * own_page() - Make a bpage look as if it is owned by a core but not
+ * in use by any message.
+ * @pool:        Pool containing the page.
+ * @core:        Core that will own the page.
+ * @expiration:  Expiration time for the page's lease.
+ * Return:       Index of the page.
+ */
+static int own_page(struct homa_pool *pool, int core, __u64 expiration)
+{
+	int saved_core = cpu_number;
+	__u32 pages[1];
+
+	cpu_number = core;
+	homa_pool_get_pages(pool, 1, pages, 1);
+	cpu_number = saved_core;
+	pool->cores[core].page_hint = pages[0];
+	atomic_dec(&pool->descriptors[pages[0]].refs);
+	pool->descriptors[pages[0]].expiration = expiration;
+	return pages[0];
+}
+
 TEST_F(homa_pool, homa_pool_set_bpages_needed)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
@@ -88,6 +115,122 @@ TEST_F(homa_pool, homa_pool_set_bpages_needed)
 	EXPECT_EQ(2, pool->bpages_needed);
 }
 
+TEST_F(homa_pool, homa_pool_page_size__no_mm)
+{
+	EXPECT_EQ(PAGE_SIZE, homa_pool_page_size((void *) 0x1000000));
+}
+TEST_F(homa_pool, homa_pool_page_size__no_vma)
+{
+	struct mm_struct mm;
+
+	mock_task.mm = &mm;
+	EXPECT_EQ(PAGE_SIZE, homa_pool_page_size((void *) 0x1000000));
+}
+TEST_F(homa_pool, homa_pool_page_size__vma_starts_after_region)
+{
+	struct vm_area_struct vma;
+	struct mm_struct mm;
+
+	memset(&vma, 0, sizeof(vma));
+	vma.vm_start = 0x2000000;
+	vma.vm_flags = VM_HUGEPAGE;
+	mock_vma = &vma;
+	mock_task.mm = &mm;
+	EXPECT_EQ(PAGE_SIZE, homa_pool_page_size((void *) 0x1000000));
+}
+TEST_F(homa_pool, homa_pool_page_size__normal_pages)
+{
+	struct vm_area_struct vma;
+	struct mm_struct mm;
+
+	memset(&vma, 0, sizeof(vma));
+	vma.vm_start = 0x1000000;
+	mock_vma = &vma;
+	mock_task.mm = &mm;
+	EXPECT_EQ(PAGE_SIZE, homa_pool_page_size((void *) 0x1000000));
+}
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+TEST_F(homa_pool, homa_pool_page_size__transparent_huge_pages)
+{
+	struct vm_area_struct vma;
+	struct mm_struct mm;
+
+	memset(&vma, 0, sizeof(vma));
+	vma.vm_start = 0x1000000;
+	vma.vm_flags = VM_HUGEPAGE;
+	mock_vma = &vma;
+	mock_task.mm = &mm;
+	EXPECT_EQ(HPAGE_PMD_SIZE, homa_pool_page_size((void *) 0x1000000));
+}
+#endif
+#ifdef CONFIG_HUGETLB_PAGE
+TEST_F(homa_pool, homa_pool_page_size__hugetlb)
+{
+	struct vm_area_struct vma;
+	struct mm_struct mm;
+
+	memset(&vma, 0, sizeof(vma));
+	vma.vm_start = 0x1000000;
+	vma.vm_flags = VM_HUGETLB;
+	mock_vma = &vma;
+	mock_task.mm = &mm;
+	EXPECT_EQ(0x200000, homa_pool_page_size((void *) 0x1000000));
+}
+#endif
+
+TEST_F(homa_pool, homa_pool_pin__basics)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	EXPECT_EQ(0, -homa_pool_pin(pool));
+	EXPECT_EQ(100*HOMA_BPAGE_SIZE/PAGE_SIZE, pool->num_pinned_pages);
+	EXPECT_EQ((struct page *) (0x1000000 + PAGE_SIZE),
+			pool->pinned_pages[1]);
+	EXPECT_EQ(100*HOMA_BPAGE_SIZE/PAGE_SIZE, mock_mm.locked_vm);
+	EXPECT_EQ(&mock_mm, pool->pinned_mm);
+	homa_pool_destroy(pool);
+	EXPECT_EQ(NULL, pool->pinned_pages);
+	EXPECT_EQ(0, mock_mm.locked_vm);
+}
+TEST_F(homa_pool, homa_pool_pin__exceeds_locked_memory_limit)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	mock_locked_vm_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_pool_pin(pool));
+	EXPECT_EQ(NULL, pool->pinned_pages);
+	EXPECT_EQ(0, mock_mm.locked_vm);
+}
+TEST_F(homa_pool, homa_pool_pin__cant_allocate_page_array)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	mock_vmalloc_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_pool_pin(pool));
+	EXPECT_EQ(NULL, pool->pinned_pages);
+	EXPECT_EQ(0, mock_mm.locked_vm);
+}
+TEST_F(homa_pool, homa_pool_pin__pin_fails)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	mock_pin_user_pages_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_pool_pin(pool));
+	EXPECT_EQ(NULL, pool->pinned_pages);
+	EXPECT_EQ(0, mock_mm.locked_vm);
+}
+
+TEST_F(homa_pool, homa_pool_unpin)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	EXPECT_EQ(0, -homa_pool_pin(pool));
+	homa_pool_unpin(pool);
+	EXPECT_EQ(NULL, pool->pinned_pages);
+	EXPECT_EQ(NULL, pool->pinned_mm);
+	EXPECT_EQ(0, pool->num_pinned_pages);
+	EXPECT_EQ(0, mock_mm.locked_vm);
+
+	/* Second call is a no-op. */
+	homa_pool_unpin(pool);
+	EXPECT_EQ(0, mock_mm.locked_vm);
+}
+
 TEST_F(homa_pool, homa_pool_init__basics)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
@@ -99,27 +242,102 @@ TEST_F(homa_pool, homa_pool_init__region_not_page_aligned)
 	homa_pool_destroy(&self->hsk.buffer_pool);
 	EXPECT_EQ(EINVAL, -homa_pool_init(&self->hsk,
 			((char *) 0x1000000) + 10,
-			100*HOMA_BPAGE_SIZE));
+			100*HOMA_BPAGE_SIZE, 0, 0));
 }
 TEST_F(homa_pool, homa_pool_init__region_too_small)
 {
 	homa_pool_destroy(&self->hsk.buffer_pool);
 	EXPECT_EQ(EINVAL, -homa_pool_init(&self->hsk, (void *) 0x1000000,
-			HOMA_BPAGE_SIZE));
+			HOMA_BPAGE_SIZE, 0, 0));
 }
 TEST_F(homa_pool, homa_pool_init__cant_allocate_descriptors)
 {
 	mock_kmalloc_errors = 1;
 	homa_pool_destroy(&self->hsk.buffer_pool);
 	EXPECT_EQ(ENOMEM, -homa_pool_init(&self->hsk, (void *) 0x100000,
-			100*HOMA_BPAGE_SIZE));
+			100*HOMA_BPAGE_SIZE, 0, 0));
 }
 TEST_F(homa_pool, homa_pool_init__cant_allocate_core_info)
 {
 	homa_pool_destroy(&self->hsk.buffer_pool);
 	mock_kmalloc_errors = 2;
 	EXPECT_EQ(ENOMEM, -homa_pool_init(&self->hsk, (void *) 0x100000,
-			100*HOMA_BPAGE_SIZE));
+			100*HOMA_BPAGE_SIZE, 0, 0));
+}
+
+TEST_F(homa_pool, homa_pool_init__extents)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	homa_pool_destroy(pool);
+	EXPECT_EQ(0, -homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 30*HOMA_BPAGE_SIZE + 100, 0));
+	EXPECT_EQ(30, pool->num_extent_bpages);
+	EXPECT_EQ(70, pool->extent_start);
+	EXPECT_EQ(70, atomic_read(&pool->free_bpages));
+	EXPECT_SUBSTR("67 68 69", free_stack(pool, &pool->free_stack));
+	EXPECT_NOSUBSTR("70", free_stack(pool, &pool->free_stack));
+}
+TEST_F(homa_pool, homa_pool_init__extent_area_too_large)
+{
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(EINVAL, -homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 99*HOMA_BPAGE_SIZE, 0));
+}
+TEST_F(homa_pool, homa_pool_init__cant_allocate_extent_map)
+{
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	mock_kmalloc_errors = 4;
+	EXPECT_EQ(ENOMEM, -homa_pool_init(&self->hsk, (void *) 0x100000,
+			100*HOMA_BPAGE_SIZE, 10*HOMA_BPAGE_SIZE, 0));
+}
+TEST_F(homa_pool, homa_pool_init__nodes)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	homa_pool_destroy(pool);
+	mock_nr_node_ids = 4;
+	EXPECT_EQ(0, -homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 0, 3));
+	EXPECT_EQ(3, pool->num_nodes);
+	EXPECT_EQ(33, pool->node_bpages);
+	EXPECT_EQ(100, atomic_read(&pool->free_bpages));
+	EXPECT_STREQ("", free_stack(pool, &pool->free_stack));
+	EXPECT_SUBSTR("0 1 2", free_stack(pool, &pool->node_stacks[0]));
+	EXPECT_SUBSTR("31 32", free_stack(pool, &pool->node_stacks[0]));
+	EXPECT_NOSUBSTR("33", free_stack(pool, &pool->node_stacks[0]));
+	EXPECT_SUBSTR("33 34", free_stack(pool, &pool->node_stacks[1]));
+	EXPECT_NOSUBSTR("66", free_stack(pool, &pool->node_stacks[1]));
+	EXPECT_SUBSTR("66 67", free_stack(pool, &pool->node_stacks[2]));
+	EXPECT_SUBSTR("98 99", free_stack(pool, &pool->node_stacks[2]));
+}
+TEST_F(homa_pool, homa_pool_init__nodes_with_extents)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	homa_pool_destroy(pool);
+	EXPECT_EQ(0, -homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 20*HOMA_BPAGE_SIZE, 2));
+	EXPECT_EQ(40, pool->node_bpages);
+	EXPECT_SUBSTR("38 39", free_stack(pool, &pool->node_stacks[0]));
+	EXPECT_NOSUBSTR("40", free_stack(pool, &pool->node_stacks[0]));
+	EXPECT_SUBSTR("78 79", free_stack(pool, &pool->node_stacks[1]));
+	EXPECT_NOSUBSTR("80", free_stack(pool, &pool->node_stacks[1]));
+}
+TEST_F(homa_pool, homa_pool_init__bad_num_nodes)
+{
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(EINVAL, -homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 0, -1));
+	EXPECT_EQ(EINVAL, -homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 0, 3));
+	mock_nr_node_ids = 4;
+	EXPECT_EQ(EINVAL, -homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 97*HOMA_BPAGE_SIZE, 4));
+}
+TEST_F(homa_pool, homa_pool_init__cant_allocate_node_stacks)
+{
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	mock_kmalloc_errors = 8;
+	EXPECT_EQ(ENOMEM, -homa_pool_init(&self->hsk, (void *) 0x100000,
+			100*HOMA_BPAGE_SIZE, 10*HOMA_BPAGE_SIZE, 2));
 }
 
 TEST_F(homa_pool, homa_pool_destroy__idempotent)
@@ -128,6 +346,13 @@ TEST_F(homa_pool, homa_pool_destroy__idempotent)
 	homa_pool_destroy(&self->hsk.buffer_pool);
 }
 
+TEST_F(homa_pool, homa_pool_init__free_stacks)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	EXPECT_SUBSTR("0 1 2 3 4", free_stack(pool, &pool->free_stack));
+	EXPECT_STREQ("", free_stack(pool, &pool->cores[1].free_stack));
+}
+
 TEST_F(homa_pool, homa_pool_get_pages__basics)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
@@ -137,7 +362,9 @@ TEST_F(homa_pool, homa_pool_get_pages__basics)
 	EXPECT_EQ(1, pages[1]);
 	EXPECT_EQ(1, atomic_read(&pool->descriptors[1].refs));
 	EXPECT_EQ(-1, pool->descriptors[1].owner);
-	EXPECT_EQ(2, pool->cores[cpu_number].next_candidate);
+	EXPECT_STREQ("2 3 4 5 6 7", free_stack(pool,
+			&pool->cores[cpu_number].free_stack));
+	EXPECT_SUBSTR("8 9 10", free_stack(pool, &pool->free_stack));
 	EXPECT_EQ(98, atomic_read(&pool->free_bpages));
 }
 TEST_F(homa_pool, homa_pool_get_pages__not_enough_space)
@@ -149,76 +376,130 @@ TEST_F(homa_pool, homa_pool_get_pages__not_enough_space)
 	atomic_set(&pool->free_bpages, 2);
 	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
 }
-TEST_F(homa_pool, homa_pool_get_pages__set_limit)
+TEST_F(homa_pool, homa_pool_get_pages__partial_refill)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
-	__u32 pages[10];
-	atomic_set(&pool->free_bpages, 62);
-	pool->cores[cpu_number].next_candidate = 49;
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(49, pages[0]);
-	EXPECT_EQ(0, pages[1]);
+	__u32 pages[100];
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 96, pages, 0));
+	EXPECT_STREQ("", free_stack(pool, &pool->cores[cpu_number].free_stack));
+	EXPECT_STREQ("96 97 98 99", free_stack(pool, &pool->free_stack));
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(96, pages[0]);
+	EXPECT_STREQ("97 98 99", free_stack(pool,
+			&pool->cores[cpu_number].free_stack));
+	EXPECT_STREQ("", free_stack(pool, &pool->free_stack));
 }
-TEST_F(homa_pool, homa_pool_get_pages__set_limit_with_MIN_EXTRA)
+TEST_F(homa_pool, homa_pool_get_pages__prefer_receiving_node)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 	__u32 pages[10];
-	atomic_set(&pool->free_bpages, 92);
-	pool->cores[cpu_number].next_candidate = 13;
+	homa_pool_destroy(pool);
+	homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 0, 2);
+	pool->recv_node = 1;
 	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(13, pages[0]);
-	EXPECT_EQ(0, pages[1]);
+	EXPECT_EQ(50, pages[0]);
+	EXPECT_EQ(51, pages[1]);
+	EXPECT_STREQ("52 53 54 55 56 57", free_stack(pool,
+			&pool->cores[cpu_number].free_stack));
+	EXPECT_SUBSTR("0 1 2", free_stack(pool, &pool->node_stacks[0]));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.bpage_remote_refills);
 }
-TEST_F(homa_pool, homa_pool_get_pages__skip_unusable_bpages)
+TEST_F(homa_pool, homa_pool_get_pages__receiving_node_empty)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 	__u32 pages[10];
-	mock_cycles = 1000;
-	atomic_set(&pool->descriptors[0].refs, 2);
-	atomic_set(&pool->descriptors[1].refs, 1);
-	pool->descriptors[1].owner = 3;
-	pool->descriptors[1].expiration = mock_cycles + 1;
-	atomic_set(&pool->descriptors[2].refs, 1);
-	pool->descriptors[2].owner = 3;
-	pool->descriptors[2].expiration = mock_cycles - 1;
-	atomic_set(&pool->descriptors[3].refs, 1);
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(2, pages[0]);
-	EXPECT_EQ(4, pages[1]);
+	homa_pool_destroy(pool);
+	homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 0, 2);
+	pool->recv_node = 1;
+	atomic64_set(&pool->node_stacks[1], 0xffffffff);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(0, pages[0]);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_remote_refills);
 }
-TEST_F(homa_pool, homa_pool_get_pages__cant_lock_pages)
+TEST_F(homa_pool, homa_pool_get_pages__receiving_node_out_of_range)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 	__u32 pages[10];
-	mock_cycles = 1000;
-	mock_trylock_errors = 3;
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(2, pages[0]);
-	EXPECT_EQ(3, pages[1]);
+	homa_pool_destroy(pool);
+	homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 0, 2);
+	pool->recv_node = 3;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(50, pages[0]);
 }
-TEST_F(homa_pool, homa_pool_get_pages__state_changes_while_locking)
+TEST_F(homa_pool, homa_pool_get_pages__steal_from_other_core)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
-	__u32 pages[10];
-	mock_cycles = 1000;
-	unit_hook_register(steal_bpages_hook);
+	__u32 pages[100];
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 88, pages, 0));
+	cpu_number = 3;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(88, pages[0]);
+	cpu_number = 1;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 4, pages, 0));
+	EXPECT_EQ(99, pages[3]);
+	EXPECT_STREQ("", free_stack(pool, &pool->free_stack));
+	EXPECT_STREQ("89 90 91 92 93 94 95", free_stack(pool,
+			&pool->cores[3].free_stack));
 	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(2, pages[0]);
-	EXPECT_EQ(4, pages[1]);
+	EXPECT_EQ(89, pages[0]);
+	EXPECT_EQ(90, pages[1]);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.bpage_steals);
 }
 TEST_F(homa_pool, homa_pool_get_pages__steal_expired_page)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
-	__u32 pages[10];
-	pool->descriptors[0].owner = 5;
+	__u32 pages[100];
+	int owned;
+
 	mock_cycles = 5000;
-	pool->descriptors[0].expiration = mock_cycles - 1;
+	owned = own_page(pool, 5, mock_cycles - 1);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 99, pages, 0));
 	atomic_set(&pool->free_bpages, 20);
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(0, pages[0]);
-	EXPECT_EQ(1, pages[1]);
-	EXPECT_EQ(-1, pool->descriptors[0].owner);
-	EXPECT_EQ(19, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(owned, pages[0]);
+	EXPECT_EQ(-1, pool->descriptors[owned].owner);
+	EXPECT_EQ(1, atomic_read(&pool->descriptors[owned].refs));
+	EXPECT_EQ(20, atomic_read(&pool->free_bpages));
+}
+TEST_F(homa_pool, homa_pool_get_pages__skip_unusable_owned_pages)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[100];
+	int unexpired, in_use, locked, ok;
+
+	mock_cycles = 5000;
+	unexpired = own_page(pool, 2, mock_cycles + 1);
+	in_use = own_page(pool, 3, mock_cycles - 1);
+	atomic_inc(&pool->descriptors[in_use].refs);
+	locked = own_page(pool, 4, mock_cycles - 1);
+	ok = own_page(pool, 5, mock_cycles - 1);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 96, pages, 0));
+	atomic_set(&pool->free_bpages, 1);
+	mock_trylock_errors = 1;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(ok, pages[0]);
+	EXPECT_EQ(2, pool->descriptors[unexpired].owner);
+	EXPECT_EQ(3, pool->descriptors[in_use].owner);
+	EXPECT_EQ(4, pool->descriptors[locked].owner);
+}
+TEST_F(homa_pool, homa_pool_get_pages__owned_page_changes_while_locking)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[100];
+	int changed, ok;
+
+	mock_cycles = 5000;
+	changed = own_page(pool, 2, mock_cycles - 1);
+	ok = own_page(pool, 3, mock_cycles - 1);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 98, pages, 0));
+	atomic_set(&pool->free_bpages, 1);
+	unit_hook_register(steal_bpages_hook);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(ok, pages[0]);
+	EXPECT_EQ(2, pool->descriptors[changed].owner);
 }
 TEST_F(homa_pool, homa_pool_get_pages__set_owner)
 {
@@ -233,6 +514,48 @@ TEST_F(homa_pool, homa_pool_get_pages__set_owner)
 	EXPECT_EQ(2, atomic_read(&pool->descriptors[1].refs));
 }
 
+TEST_F(homa_pool, homa_pool_get_extent__basics)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[10];
+	homa_pool_destroy(pool);
+	homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 10*HOMA_BPAGE_SIZE, 0);
+	EXPECT_EQ(0, homa_pool_get_extent(pool, 3, pages));
+	EXPECT_EQ(90, pages[0]);
+	EXPECT_EQ(92, pages[2]);
+	EXPECT_EQ(1, atomic_read(&pool->descriptors[92].refs));
+	EXPECT_EQ(0, homa_pool_get_extent(pool, 3, pages));
+	EXPECT_EQ(93, pages[0]);
+	EXPECT_EQ(6, pool->extent_hint);
+	EXPECT_EQ(90, atomic_read(&pool->free_bpages));
+}
+TEST_F(homa_pool, homa_pool_get_extent__wrap_around)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[10];
+	homa_pool_destroy(pool);
+	homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 10*HOMA_BPAGE_SIZE, 0);
+	EXPECT_EQ(0, homa_pool_get_extent(pool, 3, pages));
+	pool->extent_hint = 8;
+	EXPECT_EQ(0, homa_pool_get_extent(pool, 4, pages));
+	EXPECT_EQ(93, pages[0]);
+}
+TEST_F(homa_pool, homa_pool_get_extent__no_space)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[20];
+	EXPECT_EQ(-1, homa_pool_get_extent(pool, 2, pages));
+	homa_pool_destroy(pool);
+	homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 10*HOMA_BPAGE_SIZE, 0);
+	EXPECT_EQ(-1, homa_pool_get_extent(pool, 11, pages));
+	EXPECT_EQ(0, homa_pool_get_extent(pool, 4, pages));
+	pool->extent_hint = 0;
+	EXPECT_EQ(-1, homa_pool_get_extent(pool, 7, pages));
+}
+
 TEST_F(homa_pool, homa_pool_allocate__basics)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
@@ -289,7 +612,8 @@ TEST_F(homa_pool, homa_pool_allocate__no_partial_page)
 TEST_F(homa_pool, homa_pool_allocate__owned_page_locked_and_page_stolen)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
-	pool->cores[cpu_number].next_candidate = 2;
+	__u32 pages[2];
+	homa_pool_get_pages(pool, 2, pages, 0);
 	atomic_set(&pool->free_bpages, 40);
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
@@ -335,7 +659,8 @@ TEST_F(homa_pool, homa_pool_allocate__page_wrap_around)
 TEST_F(homa_pool, homa_pool_allocate__owned_page_overflow)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
-	pool->cores[cpu_number].next_candidate = 2;
+	__u32 pages[2];
+	homa_pool_get_pages(pool, 2, pages, 0);
 	atomic_set(&pool->free_bpages, 50);
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
@@ -358,7 +683,8 @@ TEST_F(homa_pool, homa_pool_allocate__owned_page_overflow)
 TEST_F(homa_pool, homa_pool_allocate__reuse_owned_page)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
-	pool->cores[cpu_number].next_candidate = 2;
+	__u32 pages[2];
+	homa_pool_get_pages(pool, 2, pages, 0);
 	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
 			4000, 98, 1000, 2000);
@@ -419,6 +745,55 @@ TEST_F(homa_pool, homa_pool_allocate__out_of_space)
 	EXPECT_EQ(1, pool->bpages_needed);
 }
 
+TEST_F(homa_pool, homa_pool_allocate__use_extent)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	homa_pool_destroy(pool);
+	homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 10*HOMA_BPAGE_SIZE, 0);
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	2*HOMA_BPAGE_SIZE + 100);
+	ASSERT_NE(NULL, crpc);
+
+	EXPECT_EQ(3, crpc->msgin.num_bpages);
+	EXPECT_EQ(90*HOMA_BPAGE_SIZE, crpc->msgin.bpage_offsets[0]);
+	EXPECT_EQ(92*HOMA_BPAGE_SIZE, crpc->msgin.bpage_offsets[2]);
+	EXPECT_EQ(90, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.extent_allocs);
+}
+TEST_F(homa_pool, homa_pool_allocate__message_too_short_for_extent)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	homa_pool_destroy(pool);
+	homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 10*HOMA_BPAGE_SIZE, 0);
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc);
+
+	EXPECT_EQ(1, crpc->msgin.num_bpages);
+	EXPECT_EQ(0, crpc->msgin.bpage_offsets[0]);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.extent_allocs);
+}
+TEST_F(homa_pool, homa_pool_allocate__no_extent_available)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	homa_pool_destroy(pool);
+	homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 2*HOMA_BPAGE_SIZE, 0);
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	2*HOMA_BPAGE_SIZE + 100);
+	ASSERT_NE(NULL, crpc);
+
+	EXPECT_EQ(3, crpc->msgin.num_bpages);
+	EXPECT_EQ(0, crpc->msgin.bpage_offsets[0]);
+	EXPECT_EQ(HOMA_BPAGE_SIZE, crpc->msgin.bpage_offsets[1]);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.extent_allocs);
+}
+
 TEST_F(homa_pool, homa_pool_get_buffer)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
@@ -437,6 +812,33 @@ TEST_F(homa_pool, homa_pool_get_buffer)
 	EXPECT_EQ((void *) (pool->region + 2*HOMA_BPAGE_SIZE + 100), buffer);
 }
 
+TEST_F(homa_pool, homa_pool_get_stats)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_pool_stats stats;
+
+	homa_pool_get_stats(&self->hsk, &stats);
+	EXPECT_EQ(pool->num_bpages, stats.num_bpages);
+	EXPECT_EQ(atomic_read(&pool->free_bpages), stats.free_bpages);
+	EXPECT_EQ(0, stats.waiting_rpcs);
+	EXPECT_EQ(0, stats.bpages_needed);
+
+	atomic_set(&pool->free_bpages, 0);
+	unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 2*HOMA_BPAGE_SIZE);
+	unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 100, 1000, 3*HOMA_BPAGE_SIZE);
+	atomic64_set(&pool->dropped_bytes, 1400);
+	atomic64_set(&pool->grant_skips, 3);
+	homa_pool_get_stats(&self->hsk, &stats);
+	EXPECT_EQ(0, stats.free_bpages);
+	EXPECT_EQ(2, stats.waiting_rpcs);
+	EXPECT_EQ(2, stats.bpages_needed);
+	EXPECT_EQ(2, stats.alloc_failures);
+	EXPECT_EQ(1400, stats.dropped_bytes);
+	EXPECT_EQ(3, stats.grant_skips);
+}
+
 TEST_F(homa_pool, homa_pool_release_buffers__basics)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
@@ -471,6 +873,75 @@ TEST_F(homa_pool, homa_pool_release_buffers__basics)
 	EXPECT_EQ(0, atomic_read(&pool->descriptors[0].refs));
 	pool->region = saved_region;
 }
+TEST_F(homa_pool, homa_pool_release_buffers__extent)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 offsets[3];
+	__u32 pages[3];
+	int i;
+
+	homa_pool_destroy(pool);
+	homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 10*HOMA_BPAGE_SIZE, 0);
+	EXPECT_EQ(0, homa_pool_get_extent(pool, 3, pages));
+	for (i = 0; i < 3; i++)
+		offsets[i] = pages[i] << HOMA_BPAGE_SHIFT;
+	EXPECT_EQ(0x7, pool->extent_map[0]);
+	homa_pool_release_buffers(pool, 3, offsets);
+	EXPECT_EQ(0, pool->extent_map[0]);
+	EXPECT_EQ(0, atomic_read(&pool->descriptors[91].refs));
+	EXPECT_EQ(90, atomic_read(&pool->free_bpages));
+}
+TEST_F(homa_pool, homa_pool_release_buffers__extent_freed_wakes_rpc)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	homa_pool_destroy(pool);
+	homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 10*HOMA_BPAGE_SIZE, 0);
+
+	/* Use up the entire extent area. */
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	10*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc1);
+	EXPECT_EQ(90*HOMA_BPAGE_SIZE, crpc1->msgin.bpage_offsets[0]);
+
+	/* The next RPC can't get either an extent or ordinary bpages. */
+	atomic_set(&pool->free_bpages, 0);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 100, 1000, 3*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc2);
+	EXPECT_EQ(0, crpc2->msgin.num_bpages);
+
+	homa_pool_release_buffers(pool, crpc1->msgin.num_bpages,
+			crpc1->msgin.bpage_offsets);
+	EXPECT_EQ(3, crpc2->msgin.num_bpages);
+	EXPECT_EQ(90*HOMA_BPAGE_SIZE, crpc2->msgin.bpage_offsets[0]);
+	EXPECT_TRUE(list_empty(&self->hsk.waiting_for_bufs));
+}
+TEST_F(homa_pool, homa_pool_release_buffers__nodes)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 offsets[2];
+	__u32 pages[1];
+	homa_pool_destroy(pool);
+	homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 0, 2);
+	homa_pool_get_pages(pool, 1, pages, 0);
+	offsets[0] = pages[0] << HOMA_BPAGE_SHIFT;
+	pool->recv_node = 1;
+	cpu_number = 2;
+	homa_pool_get_pages(pool, 1, pages, 0);
+	offsets[1] = pages[0] << HOMA_BPAGE_SHIFT;
+	EXPECT_EQ(98, atomic_read(&pool->free_bpages));
+
+	homa_pool_release_buffers(pool, 2, offsets);
+	EXPECT_SUBSTR("0 8 9", free_stack(pool, &pool->node_stacks[0]));
+	EXPECT_SUBSTR("50 58 59", free_stack(pool, &pool->node_stacks[1]));
+	EXPECT_STREQ("", free_stack(pool, &pool->free_stack));
+	EXPECT_EQ(100, atomic_read(&pool->free_bpages));
+}
 TEST_F(homa_pool, homa_pool_release_buffers__retry_allocation)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
@@ -0,0 +1,321 @@
+/* Copyright (c) 2023 Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "homa_impl.h"
+#define KSELFTEST_NOT_MAIN 1
+#include "kselftest_harness.h"
+#include "ccutils.h"
+#include "mock.h"
+#include "utils.h"
+
+/* Layout of the ring region used by all of the tests. */
+struct test_rings {
+	struct homa_ring_ctl ctl;
+	struct homa_ring_sqe sq[4];
+	struct homa_ring_cqe cq[2];
+};
+
+FIXTURE(homa_ring) {
+	struct in6_addr client_ip[1];
+	struct in6_addr server_ip[1];
+	int server_port;
+	__u64 client_id;
+	struct homa homa;
+	struct homa_sock hsk;
+	sockaddr_in_union server_addr;
+	struct iovec send_vec[1];
+	char buffer[200];
+	struct test_rings rings;
+	struct homa_set_rings_args args;
+};
+FIXTURE_SETUP(homa_ring)
+{
+	self->client_ip[0] = unit_get_in_addr("196.168.0.1");
+	self->server_ip[0] = unit_get_in_addr("1.2.3.4");
+	self->server_port = 99;
+	self->client_id = 1234;
+	homa_init(&self->homa);
+	mock_sock_init(&self->hsk, &self->homa, 0);
+	self->server_addr.in6.sin6_family = self->hsk.inet.sk.sk_family;
+	self->server_addr.in6.sin6_addr = self->server_ip[0];
+	self->server_addr.in6.sin6_port = htons(self->server_port);
+	if (self->hsk.inet.sk.sk_family == AF_INET)
+		self->server_addr.in4.sin_addr.s_addr =
+			ipv6_to_ipv4(self->server_addr.in6.sin6_addr);
+	self->send_vec[0].iov_base = self->buffer;
+	self->send_vec[0].iov_len = 100;
+	memset(&self->rings, 0, sizeof(self->rings));
+	self->args.start = &self->rings;
+	self->args.length = sizeof(self->rings);
+	self->args.sq_entries = 4;
+	self->args.cq_entries = 2;
+	self->args.recv_flags = HOMA_RECVMSG_RESPONSE;
+	self->args.poll_usecs = 0;
+	unit_log_clear();
+}
+FIXTURE_TEARDOWN(homa_ring)
+{
+	homa_destroy(&self->homa);
+	unit_teardown();
+}
+
+/* Adds a HOMA_SQE_SEND entry for a new request to a ring. */
+static void add_send(FIXTURE_DATA(homa_ring) *self, __u64 user_data)
+{
+	struct homa_ring_sqe *sqe = &self->rings.sq[self->rings.ctl.sq_tail
+			& 3];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = HOMA_SQE_SEND;
+	sqe->user_data = user_data;
+	sqe->send.dest_addr = self->server_addr;
+	sqe->send.iovcnt = 1;
+	sqe->send.iov = self->send_vec;
+	self->rings.ctl.sq_tail++;
+}
+
+TEST_F(homa_ring, homa_ring_init__bad_ring_size)
+{
+	self->args.sq_entries = 3;
+	EXPECT_EQ(EINVAL, -homa_ring_init(&self->hsk, &self->args));
+	self->args.sq_entries = 4;
+	self->args.cq_entries = 0;
+	EXPECT_EQ(EINVAL, -homa_ring_init(&self->hsk, &self->args));
+	EXPECT_EQ(NULL, self->hsk.ring);
+}
+TEST_F(homa_ring, homa_ring_init__bad_recv_flags)
+{
+	self->args.recv_flags = HOMA_RECVMSG_NONBLOCKING;
+	EXPECT_EQ(EINVAL, -homa_ring_init(&self->hsk, &self->args));
+}
+TEST_F(homa_ring, homa_ring_init__region_too_small)
+{
+	self->args.length = sizeof(self->rings) - 1;
+	EXPECT_EQ(EINVAL, -homa_ring_init(&self->hsk, &self->args));
+}
+TEST_F(homa_ring, homa_ring_init__basics)
+{
+	EXPECT_EQ(0, -homa_ring_init(&self->hsk, &self->args));
+	ASSERT_NE(NULL, self->hsk.ring);
+	EXPECT_EQ(3, self->hsk.ring->sq_mask);
+	EXPECT_EQ(1, self->hsk.ring->cq_mask);
+	EXPECT_EQ((void *) self->rings.sq, (void *) self->hsk.ring->sq);
+	EXPECT_EQ((void *) self->rings.cq, (void *) self->hsk.ring->cq);
+	EXPECT_EQ(NULL, self->hsk.ring->thread);
+}
+TEST_F(homa_ring, homa_ring_init__already_has_rings)
+{
+	EXPECT_EQ(0, -homa_ring_init(&self->hsk, &self->args));
+	EXPECT_EQ(EALREADY, -homa_ring_init(&self->hsk, &self->args));
+}
+
+TEST_F(homa_ring, homa_ring_destroy)
+{
+	EXPECT_EQ(0, -homa_ring_init(&self->hsk, &self->args));
+	homa_ring_destroy(&self->hsk);
+	EXPECT_EQ(NULL, self->hsk.ring);
+	homa_ring_destroy(&self->hsk);
+}
+
+TEST_F(homa_ring, homa_ring_process__cant_read_ctl)
+{
+	EXPECT_EQ(0, -homa_ring_init(&self->hsk, &self->args));
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_ring_process(self->hsk.ring, 0));
+}
+TEST_F(homa_ring, homa_ring_process__sends)
+{
+	EXPECT_EQ(0, -homa_ring_init(&self->hsk, &self->args));
+	add_send(self, 101);
+	add_send(self, 102);
+	EXPECT_EQ(2, homa_ring_process(self->hsk.ring, 0));
+	EXPECT_EQ(2, self->rings.ctl.sq_head);
+	EXPECT_EQ(2, self->rings.ctl.cq_tail);
+	EXPECT_EQ(HOMA_CQE_SEND, self->rings.cq[0].type);
+	EXPECT_EQ(101, self->rings.cq[0].user_data);
+	EXPECT_EQ(0, self->rings.cq[0].msg.length);
+	EXPECT_NE(0, self->rings.cq[0].msg.id);
+	EXPECT_EQ(102, self->rings.cq[1].user_data);
+	EXPECT_EQ(self->rings.cq[0].msg.id + 2, self->rings.cq[1].msg.id);
+	EXPECT_EQ(2, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_ring, homa_ring_process__completion_ring_full)
+{
+	EXPECT_EQ(0, -homa_ring_init(&self->hsk, &self->args));
+	add_send(self, 101);
+	add_send(self, 102);
+	add_send(self, 103);
+	EXPECT_EQ(2, homa_ring_process(self->hsk.ring, 0));
+	EXPECT_EQ(2, self->rings.ctl.sq_head);
+	EXPECT_EQ(2, self->rings.ctl.cq_tail);
+
+	self->rings.ctl.cq_head = 2;
+	EXPECT_EQ(1, homa_ring_process(self->hsk.ring, 0));
+	EXPECT_EQ(3, self->rings.ctl.sq_head);
+	EXPECT_EQ(3, self->rings.ctl.cq_tail);
+	EXPECT_EQ(103, self->rings.cq[0].user_data);
+}
+TEST_F(homa_ring, homa_ring_process__send_error)
+{
+	EXPECT_EQ(0, -homa_ring_init(&self->hsk, &self->args));
+	add_send(self, 101);
+	self->rings.sq[0].send.dest_addr.in6.sin6_family = 1;
+	EXPECT_EQ(1, homa_ring_process(self->hsk.ring, 0));
+	EXPECT_EQ(EAFNOSUPPORT, -self->rings.cq[0].msg.length);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_ring, homa_ring_process__unknown_opcode)
+{
+	EXPECT_EQ(0, -homa_ring_init(&self->hsk, &self->args));
+	self->rings.sq[0].opcode = 99;
+	self->rings.ctl.sq_tail = 1;
+	EXPECT_EQ(1, homa_ring_process(self->hsk.ring, 0));
+	EXPECT_EQ(HOMA_CQE_SEND, self->rings.cq[0].type);
+	EXPECT_EQ(EINVAL, -self->rings.cq[0].msg.length);
+}
+TEST_F(homa_ring, homa_ring_process__release_buffers)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[3];
+
+	EXPECT_EQ(0, -homa_ring_init(&self->hsk, &self->args));
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 3, pages, 0));
+	EXPECT_EQ(1, atomic_read(&pool->descriptors[2].refs));
+	self->rings.sq[0].opcode = HOMA_SQE_RELEASE;
+	self->rings.sq[0].release.num_bpages = 1;
+	self->rings.sq[0].release.bpage_offsets[0] = 2*HOMA_BPAGE_SIZE;
+	self->rings.ctl.sq_tail = 1;
+	EXPECT_EQ(1, homa_ring_process(self->hsk.ring, 0));
+	EXPECT_EQ(0, atomic_read(&pool->descriptors[2].refs));
+	EXPECT_EQ(98, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(0, self->rings.ctl.cq_tail);
+}
+TEST_F(homa_ring, homa_ring_process__incoming_messages)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id, 100, 2000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id+2, 100, 3000);
+	struct homa_rpc *crpc3 = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id+4, 100, 4000);
+
+	EXPECT_NE(NULL, crpc1);
+	EXPECT_NE(NULL, crpc2);
+	EXPECT_NE(NULL, crpc3);
+	crpc1->completion_cookie = 44444;
+	EXPECT_EQ(0, -homa_ring_init(&self->hsk, &self->args));
+	EXPECT_EQ(2, homa_ring_process(self->hsk.ring, 0));
+	EXPECT_EQ(2, self->rings.ctl.cq_tail);
+	EXPECT_EQ(HOMA_CQE_MESSAGE, self->rings.cq[0].type);
+	EXPECT_EQ(self->client_id, self->rings.cq[0].msg.id);
+	EXPECT_EQ(44444, self->rings.cq[0].msg.completion_cookie);
+	EXPECT_EQ(2000, self->rings.cq[0].msg.length);
+	EXPECT_EQ(1, self->rings.cq[0].msg.num_bpages);
+	EXPECT_EQ(3000, self->rings.cq[1].msg.length);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_ring, homa_ring_process__no_recv_flags)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id, 100, 2000);
+
+	EXPECT_NE(NULL, crpc);
+	self->args.recv_flags = 0;
+	EXPECT_EQ(0, -homa_ring_init(&self->hsk, &self->args));
+	EXPECT_EQ(0, homa_ring_process(self->hsk.ring, 0));
+	EXPECT_EQ(0, self->rings.ctl.cq_tail);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_ring, homa_ring_process__error_in_wait_for_message)
+{
+	EXPECT_EQ(0, -homa_ring_init(&self->hsk, &self->args));
+	self->hsk.shutdown = true;
+	EXPECT_EQ(ESHUTDOWN, -homa_ring_process(self->hsk.ring, 1));
+	self->hsk.shutdown = false;
+}
+
+TEST_F(homa_ring, homa_ring_thread_pass__basics)
+{
+	struct mm_struct mm;
+
+	EXPECT_EQ(0, -homa_ring_init(&self->hsk, &self->args));
+	atomic_set(&mm.mm_users, 1);
+	self->hsk.ring->mm = &mm;
+	add_send(self, 101);
+	EXPECT_EQ(1, homa_ring_thread_pass(self->hsk.ring));
+	EXPECT_EQ(1, self->rings.ctl.sq_head);
+	EXPECT_EQ(1, atomic_read(&mm.mm_users));
+	self->hsk.ring->mm = NULL;
+}
+TEST_F(homa_ring, homa_ring_thread_pass__application_exited)
+{
+	struct mm_struct mm;
+
+	EXPECT_EQ(0, -homa_ring_init(&self->hsk, &self->args));
+	atomic_set(&mm.mm_users, 0);
+	self->hsk.ring->mm = &mm;
+	add_send(self, 101);
+	EXPECT_EQ(ESRCH, -homa_ring_thread_pass(self->hsk.ring));
+	EXPECT_EQ(0, self->rings.ctl.sq_head);
+	self->hsk.ring->mm = NULL;
+}
+
+TEST_F(homa_ring, homa_ring_wake__thread_not_sleeping)
+{
+	EXPECT_EQ(0, -homa_ring_init(&self->hsk, &self->args));
+	self->hsk.ring->thread = &mock_task;
+	homa_ring_wake(self->hsk.ring);
+	EXPECT_STREQ("", unit_log_get());
+	self->hsk.ring->thread = NULL;
+}
+TEST_F(homa_ring, homa_ring_wake__thread_sleeping)
+{
+	EXPECT_EQ(0, -homa_ring_init(&self->hsk, &self->args));
+	self->hsk.ring->thread = &mock_task;
+	atomic_set(&self->hsk.ring->sleeping, 1);
+	homa_ring_wake(self->hsk.ring);
+	EXPECT_STREQ("wake_up_process pid 0", unit_log_get());
+	EXPECT_EQ(0, atomic_read(&self->hsk.ring->sleeping));
+	self->hsk.ring->thread = NULL;
+}
+
+TEST_F(homa_ring, homa_ioc_ring__no_rings)
+{
+	struct homa_ring_enter_args args = {0, {0}};
+
+	EXPECT_EQ(EINVAL, -homa_ioc_ring(&self->hsk.inet.sk,
+			(unsigned long) &args));
+}
+TEST_F(homa_ring, homa_ioc_ring__nonzero_pad)
+{
+	struct homa_ring_enter_args args = {0, {0, 1, 0}};
+
+	EXPECT_EQ(0, -homa_ring_init(&self->hsk, &self->args));
+	EXPECT_EQ(EINVAL, -homa_ioc_ring(&self->hsk.inet.sk,
+			(unsigned long) &args));
+}
+TEST_F(homa_ring, homa_ioc_ring__process_rings)
+{
+	struct homa_ring_enter_args args = {0, {0}};
+
+	EXPECT_EQ(0, -homa_ring_init(&self->hsk, &self->args));
+	add_send(self, 101);
+	EXPECT_EQ(1, homa_ioc_ring(&self->hsk.inet.sk, (unsigned long) &args));
+	EXPECT_EQ(1, self->rings.ctl.cq_tail);
+}
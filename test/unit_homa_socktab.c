@@ -247,6 +247,230 @@ TEST_F(homa_socktab, homa_sock_bind__socket_shutdown)
 			100));
 }
 
+TEST_F(homa_socktab, homa_sock_bind__create_group)
+{
+	int port = self->hsk.port;
+
+	self->hsk.inet.sk.sk_reuseport = 1;
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &self->hsk, 100));
+	ASSERT_NE(NULL, self->hsk.group);
+	EXPECT_EQ(100, self->hsk.group->port);
+	EXPECT_EQ(1, self->hsk.group->num_socks);
+	EXPECT_EQ(1, self->homa.port_map.num_groups);
+	EXPECT_EQ(port, self->hsk.port);
+	EXPECT_EQ(&self->hsk, homa_sock_find(&self->homa.port_map, port));
+	EXPECT_EQ(NULL, homa_sock_find(&self->homa.port_map, 100));
+	EXPECT_EQ(htons(100), self->hsk.inet.inet_sport);
+}
+TEST_F(homa_socktab, homa_sock_bind__join_group)
+{
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	self->hsk.inet.sk.sk_reuseport = 1;
+	hsk2.inet.sk.sk_reuseport = 1;
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &self->hsk, 100));
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &hsk2, 100));
+	EXPECT_EQ(self->hsk.group, hsk2.group);
+	EXPECT_EQ(2, self->hsk.group->num_socks);
+	EXPECT_EQ(&hsk2, self->hsk.group->socks[1]);
+	EXPECT_EQ(1, self->homa.port_map.num_groups);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_socktab, homa_sock_bind__group_requires_reuseport)
+{
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	self->hsk.inet.sk.sk_reuseport = 1;
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &self->hsk, 100));
+	EXPECT_EQ(EADDRINUSE, -homa_sock_bind(&self->homa.port_map, &hsk2,
+			100));
+	EXPECT_EQ(NULL, hsk2.group);
+	EXPECT_EQ(1, self->hsk.group->num_socks);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_socktab, homa_sock_bind__group_uid_mismatch)
+{
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	self->hsk.inet.sk.sk_reuseport = 1;
+	hsk2.inet.sk.sk_reuseport = 1;
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &self->hsk, 100));
+	mock_uid = 1000;
+	EXPECT_EQ(EADDRINUSE, -homa_sock_bind(&self->homa.port_map, &hsk2,
+			100));
+	EXPECT_EQ(NULL, hsk2.group);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_socktab, homa_sock_bind__group_full)
+{
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	self->hsk.inet.sk.sk_reuseport = 1;
+	hsk2.inet.sk.sk_reuseport = 1;
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &self->hsk, 100));
+	self->hsk.group->num_socks = HOMA_MAX_GROUP_SOCKS;
+	EXPECT_EQ(EADDRINUSE, -homa_sock_bind(&self->homa.port_map, &hsk2,
+			100));
+	self->hsk.group->num_socks = 1;
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_socktab, homa_sock_bind__port_owned_by_ordinary_socket)
+{
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	hsk2.inet.sk.sk_reuseport = 1;
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &self->hsk, 100));
+	EXPECT_EQ(EADDRINUSE, -homa_sock_bind(&self->homa.port_map, &hsk2,
+			100));
+	EXPECT_EQ(0, self->homa.port_map.num_groups);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_socktab, homa_sock_bind__already_bound_to_server_port)
+{
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &self->hsk, 50));
+	self->hsk.inet.sk.sk_reuseport = 1;
+	EXPECT_EQ(EINVAL, -homa_sock_bind(&self->homa.port_map, &self->hsk,
+			100));
+	EXPECT_EQ(NULL, self->hsk.group);
+	EXPECT_EQ(0, self->homa.port_map.num_groups);
+}
+TEST_F(homa_socktab, homa_sock_bind__rebind_group_member)
+{
+	self->hsk.inet.sk.sk_reuseport = 1;
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &self->hsk, 100));
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &self->hsk, 100));
+	EXPECT_EQ(EINVAL, -homa_sock_bind(&self->homa.port_map, &self->hsk,
+			101));
+	EXPECT_EQ(1, self->hsk.group->num_socks);
+}
+
+TEST_F(homa_socktab, homa_group_leave__basics)
+{
+	struct homa_sock hsk2, hsk3;
+	struct homa_port_group *group;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	mock_sock_init(&hsk3, &self->homa, 0);
+	self->hsk.inet.sk.sk_reuseport = 1;
+	hsk2.inet.sk.sk_reuseport = 1;
+	hsk3.inet.sk.sk_reuseport = 1;
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &self->hsk, 100));
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &hsk2, 100));
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &hsk3, 100));
+	group = self->hsk.group;
+	homa_sock_destroy(&self->hsk);
+	EXPECT_EQ(NULL, self->hsk.group);
+	EXPECT_EQ(2, group->num_socks);
+	EXPECT_EQ(&hsk3, group->socks[0]);
+	EXPECT_EQ(&hsk2, group->socks[1]);
+	homa_sock_destroy(&hsk3);
+	EXPECT_EQ(1, group->num_socks);
+	EXPECT_EQ(&hsk2, group->socks[0]);
+	EXPECT_EQ(1, self->homa.port_map.num_groups);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_socktab, homa_group_leave__delete_group)
+{
+	self->hsk.inet.sk.sk_reuseport = 1;
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &self->hsk, 100));
+	homa_sock_destroy(&self->hsk);
+	EXPECT_EQ(0, self->homa.port_map.num_groups);
+	EXPECT_EQ(NULL, homa_group_select(&self->homa, 100, self->client_ip,
+			self->client_port, 1235, 1));
+}
+
+TEST_F(homa_socktab, homa_group_select__no_group)
+{
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	hsk2.inet.sk.sk_reuseport = 1;
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &hsk2, 100));
+	EXPECT_EQ(NULL, homa_group_select(&self->homa, 101, self->client_ip,
+			self->client_port, 1235, 1));
+	homa_sock_destroy(&hsk2);
+	EXPECT_EQ(NULL, homa_group_select(&self->homa, 100, self->client_ip,
+			self->client_port, 1235, 1));
+}
+TEST_F(homa_socktab, homa_group_select__steer_by_rpc)
+{
+	struct homa_sock hsk2;
+	int i, counts[2] = {0, 0};
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	self->hsk.inet.sk.sk_reuseport = 1;
+	hsk2.inet.sk.sk_reuseport = 1;
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &self->hsk, 100));
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &hsk2, 100));
+	for (i = 0; i < 100; i++) {
+		struct homa_sock *hsk = homa_group_select(&self->homa, 100,
+				self->client_ip, self->client_port, 2*i + 1, 1);
+
+		/* Same RPC, same socket. */
+		EXPECT_EQ(hsk, homa_group_select(&self->homa, 100,
+				self->client_ip, self->client_port, 2*i + 1,
+				1));
+		counts[(hsk == &hsk2) ? 1 : 0]++;
+	}
+	EXPECT_NE(0, counts[0]);
+	EXPECT_NE(0, counts[1]);
+	EXPECT_EQ(200, homa_cores[cpu_number]->metrics.group_lookups);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_socktab, homa_group_select__steer_by_peer)
+{
+	struct homa_sock hsk2, *hsk;
+	int i;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	self->hsk.inet.sk.sk_reuseport = 1;
+	hsk2.inet.sk.sk_reuseport = 1;
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &self->hsk, 100));
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &hsk2, 100));
+	self->homa.group_steering = 1;
+	hsk = homa_group_select(&self->homa, 100, self->client_ip,
+			self->client_port, 1, 1);
+	ASSERT_NE(NULL, hsk);
+	for (i = 1; i < 100; i++)
+		EXPECT_EQ(hsk, homa_group_select(&self->homa, 100,
+				self->client_ip, self->client_port, 2*i + 1,
+				1));
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_socktab, homa_group_select__existing_rpc)
+{
+	struct homa_sock hsk2, *selected, *owner;
+	struct homa_rpc *srpc;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	self->hsk.inet.sk.sk_reuseport = 1;
+	hsk2.inet.sk.sk_reuseport = 1;
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &self->hsk, 100));
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &hsk2, 100));
+
+	/* Create the RPC on the member that hashing won't pick, as if
+	 * membership had changed since the RPC was created.
+	 */
+	selected = homa_group_select(&self->homa, 100, self->client_ip,
+			self->client_port, 1235, 1);
+	owner = (selected == &hsk2) ? &self->hsk : &hsk2;
+	srpc = unit_server_rpc(owner, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->client_port, 1235, 100, 3000);
+	ASSERT_NE(NULL, srpc);
+	EXPECT_EQ(owner, homa_group_select(&self->homa, 100, self->client_ip,
+			self->client_port, 1235, 0));
+
+	/* A possible first packet doesn't search for the RPC. */
+	EXPECT_EQ(selected, homa_group_select(&self->homa, 100,
+			self->client_ip, self->client_port, 1235, 1));
+	homa_sock_destroy(&hsk2);
+}
+
 TEST_F(homa_socktab, homa_sock_find__basics)
 {
 	struct homa_sock hsk2;
@@ -289,6 +513,58 @@ TEST_F(homa_socktab, homa_sock_find__long_hash_chain)
 	homa_sock_destroy(&hsk4);
 }
 
+TEST_F(homa_socktab, homa_sock_find_cached__basics)
+{
+	struct homa_sock hsk2;
+	mock_sock_init(&hsk2, &self->homa, 0);
+	EXPECT_EQ(0, homa_sock_bind(&self->homa.port_map, &hsk2, 100));
+
+	EXPECT_EQ(&hsk2, homa_sock_find_cached(&self->homa.port_map, 100));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.socket_cache_hits);
+	EXPECT_EQ(&hsk2, homa_sock_find_cached(&self->homa.port_map, 100));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.socket_cache_hits);
+
+	/* Different port: miss, and the cache now holds the new socket. */
+	EXPECT_EQ(&self->hsk, homa_sock_find_cached(&self->homa.port_map,
+			self->hsk.port));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.socket_cache_hits);
+	EXPECT_EQ(&self->hsk, homa_cores[cpu_number]->cached_sock);
+
+	/* Unknown port: cache unchanged. */
+	EXPECT_EQ(NULL, homa_sock_find_cached(&self->homa.port_map, 101));
+	EXPECT_EQ(&self->hsk, homa_cores[cpu_number]->cached_sock);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_socktab, homa_sock_find_cached__socket_rebound)
+{
+	EXPECT_EQ(0, homa_sock_bind(&self->homa.port_map, &self->hsk, 100));
+	EXPECT_EQ(&self->hsk, homa_sock_find_cached(&self->homa.port_map,
+			100));
+	EXPECT_EQ(0, homa_sock_bind(&self->homa.port_map, &self->hsk, 200));
+	EXPECT_EQ(NULL, homa_sock_find_cached(&self->homa.port_map, 100));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.socket_cache_hits);
+}
+TEST_F(homa_socktab, homa_sock_find_cached__invalidated_by_shutdown)
+{
+	struct homa_sock hsk2;
+	mock_sock_init(&hsk2, &self->homa, 0);
+	EXPECT_EQ(0, homa_sock_bind(&self->homa.port_map, &hsk2, 100));
+	EXPECT_EQ(&hsk2, homa_sock_find_cached(&self->homa.port_map, 100));
+	homa_sock_shutdown(&hsk2);
+	EXPECT_EQ(1, atomic_read(&self->homa.port_map.removals));
+	EXPECT_EQ(NULL, homa_sock_find_cached(&self->homa.port_map, 100));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.socket_cache_hits);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_socktab, homa_socktab_destroy__clear_cache)
+{
+	EXPECT_EQ(&self->hsk, homa_sock_find_cached(&self->homa.port_map,
+			self->hsk.port));
+	homa_socktab_destroy(&self->homa.port_map);
+	EXPECT_EQ(NULL, homa_cores[cpu_number]->cached_sock);
+	EXPECT_EQ(NULL, homa_cores[cpu_number]->cached_socktab);
+}
+
 TEST_F(homa_socktab, homa_sock_lock_slow)
 {
 	mock_cycles = ~0;
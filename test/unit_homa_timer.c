@@ -65,27 +65,27 @@ TEST_F(homa_timer, homa_check_rpc__request_ack)
 
 	/* First call: do nothing (response not fully transmitted). */
 	homa_check_rpc(srpc);
-	EXPECT_EQ(0, srpc->done_timer_ticks);
+	EXPECT_EQ(0, srpc->cold->done_timer_ticks);
 
 	/* Second call: set done_timer_ticks. */
 	homa_xmit_data(srpc, false);
 	unit_log_clear();
 	homa_check_rpc(srpc);
-	EXPECT_EQ(100, srpc->done_timer_ticks);
+	EXPECT_EQ(100, srpc->cold->done_timer_ticks);
 	EXPECT_STREQ("", unit_log_get());
 
 	/* Third call: haven't hit request_ack_ticks yet. */
 	unit_log_clear();
 	self->homa.timer_ticks++;
 	homa_check_rpc(srpc);
-	EXPECT_EQ(100, srpc->done_timer_ticks);
+	EXPECT_EQ(100, srpc->cold->done_timer_ticks);
 	EXPECT_STREQ("", unit_log_get());
 
 	/* Fourth call: request ack. */
 	unit_log_clear();
 	self->homa.timer_ticks++;
 	homa_check_rpc(srpc);
-	EXPECT_EQ(100, srpc->done_timer_ticks);
+	EXPECT_EQ(100, srpc->cold->done_timer_ticks);
 	EXPECT_STREQ("xmit NEED_ACK", unit_log_get());
 }
 TEST_F(homa_timer, homa_check_rpc__all_granted_bytes_received)
@@ -210,13 +210,13 @@ TEST_F(homa_timer, homa_check_rpc__compute_least_recent_rpc)
 	unit_log_clear();
 	srpc->msgout.granted = 0;
 	srpc->silent_ticks = self->homa.resend_ticks;
-	srpc->resend_timer_ticks = self->homa.timer_ticks - 5;
+	srpc->cold->resend_timer_ticks = self->homa.timer_ticks - 5;
 	srpc2->msgout.granted = 0;
 	srpc2->silent_ticks = self->homa.resend_ticks;
-	srpc2->resend_timer_ticks = self->homa.timer_ticks - 10;
+	srpc2->cold->resend_timer_ticks = self->homa.timer_ticks - 10;
 	srpc3->msgout.granted = 0;
 	srpc3->silent_ticks = self->homa.resend_ticks;
-	srpc3->resend_timer_ticks = self->homa.timer_ticks - 3;
+	srpc3->cold->resend_timer_ticks = self->homa.timer_ticks - 3;
 	srpc->peer->current_ticks = self->homa.timer_ticks-1;
 	EXPECT_EQ(0, homa_check_rpc(srpc));
 	EXPECT_EQ(srpc, srpc->peer->least_recent_rpc);
@@ -244,13 +244,13 @@ TEST_F(homa_timer, homa_check_rpc__least_recent_rpc_with_ticks_overflow)
 	unit_log_clear();
 	srpc->msgout.granted = 0;
 	srpc->silent_ticks = self->homa.resend_ticks;
-	srpc->resend_timer_ticks = 5;
+	srpc->cold->resend_timer_ticks = 5;
 	srpc2->msgout.granted = 0;
 	srpc2->silent_ticks = self->homa.resend_ticks;
-	srpc2->resend_timer_ticks = -10;
+	srpc2->cold->resend_timer_ticks = -10;
 	srpc3->msgout.granted = 0;
 	srpc3->silent_ticks = self->homa.resend_ticks;
-	srpc3->resend_timer_ticks = 3;
+	srpc3->cold->resend_timer_ticks = 3;
 	srpc->peer->current_ticks = self->homa.timer_ticks-1;
 	EXPECT_EQ(0, homa_check_rpc(srpc));
 	EXPECT_EQ(srpc, srpc->peer->least_recent_rpc);
@@ -286,7 +286,7 @@ TEST_F(homa_timer, homa_check_rpc__send_resend)
 
 	unit_log_clear();
 	srpc->silent_ticks = self->homa.resend_ticks-1;
-	srpc->resend_timer_ticks = self->homa.timer_ticks - 10;
+	srpc->cold->resend_timer_ticks = self->homa.timer_ticks - 10;
 	srpc->peer->resend_rpc = srpc;
 
 	/* First call: no resend, but choose this RPC for least_recent_rpc. */
@@ -300,11 +300,67 @@ TEST_F(homa_timer, homa_check_rpc__send_resend)
 	srpc->silent_ticks++;
 	EXPECT_EQ(0, homa_check_rpc(srpc));
 	EXPECT_STREQ("xmit RESEND 1400-4999@7", unit_log_get());
-	EXPECT_EQ(self->homa.timer_ticks, srpc->resend_timer_ticks);
+	EXPECT_EQ(self->homa.timer_ticks, srpc->cold->resend_timer_ticks);
 	EXPECT_EQ(self->homa.timer_ticks, srpc->peer->most_recent_resend);
 	EXPECT_EQ(1, srpc->peer->outstanding_resends);
 	EXPECT_EQ(NULL, srpc->peer->least_recent_rpc);
 }
+TEST_F(homa_timer, homa_check_rpc__resend_signals_congestion)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 5000, 5000);
+	ASSERT_NE(NULL, srpc);
+
+	unit_log_clear();
+	self->homa.congestion_signal = HOMA_CONG_RESENDS;
+	srpc->silent_ticks = self->homa.resend_ticks-1;
+	srpc->cold->resend_timer_ticks = self->homa.timer_ticks - 10;
+	EXPECT_EQ(0, homa_check_rpc(srpc));
+	EXPECT_EQ(0, srpc->peer->cong_level);
+
+	self->homa.timer_ticks++;
+	srpc->silent_ticks++;
+	EXPECT_EQ(0, homa_check_rpc(srpc));
+	EXPECT_STREQ("xmit RESEND 1400-4999@7", unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.cong_resend_signals);
+	EXPECT_EQ(1, srpc->peer->cong_level);
+}
+
+TEST_F(homa_timer, homa_timer_delay__basics)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 200);
+	ASSERT_NE(NULL, crpc);
+	self->homa.resend_ticks = 15;
+	crpc->silent_ticks = 0;
+	EXPECT_EQ(14, homa_timer_delay(crpc));
+	crpc->silent_ticks = 10;
+	EXPECT_EQ(4, homa_timer_delay(crpc));
+	crpc->silent_ticks = 14;
+	EXPECT_EQ(1, homa_timer_delay(crpc));
+	crpc->silent_ticks = 20;
+	EXPECT_EQ(1, homa_timer_delay(crpc));
+	self->homa.resend_ticks = 1000;
+	crpc->silent_ticks = 0;
+	EXPECT_EQ(HOMA_TIMER_SLOTS-1, homa_timer_delay(crpc));
+}
+TEST_F(homa_timer, homa_timer_delay__waiting_for_ack)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 100);
+	ASSERT_NE(NULL, srpc);
+	self->homa.resend_ticks = 15;
+	self->homa.request_ack_ticks = 5;
+	homa_xmit_data(srpc, false);
+	srpc->silent_ticks = 0;
+	srpc->cold->done_timer_ticks = self->homa.timer_ticks - 2;
+	EXPECT_EQ(3, homa_timer_delay(srpc));
+	srpc->cold->done_timer_ticks = self->homa.timer_ticks - 10;
+	EXPECT_EQ(1, homa_timer_delay(srpc));
+}
 
 TEST_F(homa_timer, homa_timer__basics)
 {
@@ -338,6 +394,130 @@ TEST_F(homa_timer, homa_timer__basics)
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peer_timeouts);
 	EXPECT_EQ(ETIMEDOUT, -crpc->error);
 }
+TEST_F(homa_timer, homa_timer__freeze_on_resend_rate)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 5000, 5000);
+	ASSERT_NE(NULL, srpc);
+	self->homa.freeze_resends_per_tick = 1;
+	srpc->silent_ticks = self->homa.resend_ticks;
+	srpc->peer->resend_rpc = srpc;
+	EXPECT_EQ(0, homa_check_rpc(srpc));
+	EXPECT_EQ(1, atomic_read(&self->homa.freeze_resends));
+
+	/* One resend in the previous tick: no freeze. */
+	homa_timer(&self->homa);
+	EXPECT_FALSE(tt_frozen);
+
+	/* Too many resends: freeze here, then freeze peers. */
+	atomic_set(&self->homa.freeze_resends, 2);
+	homa_timer(&self->homa);
+	EXPECT_TRUE(tt_frozen);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.freeze_triggers);
+	EXPECT_EQ(0, self->homa.freeze_peers_pending);
+	EXPECT_SUBSTR("xmit FREEZE", unit_log_get());
+}
+TEST_F(homa_timer, homa_timer__auto_cutoffs)
+{
+	self->homa.auto_cutoffs = 2;
+	self->homa.auto_cutoffs_min_msgs = 1;
+	self->homa.timer_ticks = 0;
+	homa_cores[0]->metrics.small_msg_bytes[1] = 300000;
+	homa_timer(&self->homa);
+	EXPECT_EQ(0, self->homa.cutoff_state.prev_bytes[1]);
+	homa_timer(&self->homa);
+	EXPECT_EQ(300000, self->homa.cutoff_state.prev_bytes[1]);
+}
+TEST_F(homa_timer, homa_timer__rpcs_checked_only_when_due)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 200, 5000);
+	ASSERT_NE(NULL, crpc);
+	self->homa.resend_ticks = 5;
+
+	/* First tick: RPC is checked and rescheduled for the point
+	 * where it could need a resend.
+	 */
+	homa_timer(&self->homa);
+	EXPECT_EQ(1, crpc->silent_ticks);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.timer_rpc_checks);
+
+	/* Next 2 ticks: nothing to do. */
+	homa_timer(&self->homa);
+	homa_timer(&self->homa);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.timer_rpc_checks);
+	EXPECT_EQ(1, crpc->silent_ticks);
+
+	/* Fourth tick: checked again, with silent_ticks caught up. */
+	unit_log_clear();
+	homa_timer(&self->homa);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.timer_rpc_checks);
+	EXPECT_EQ(4, crpc->silent_ticks);
+	EXPECT_STREQ("", unit_log_get());
+
+	/* From now on the RPC is checked on every tick. */
+	homa_timer(&self->homa);
+	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.timer_rpc_checks);
+	EXPECT_EQ(5, crpc->silent_ticks);
+	EXPECT_STREQ("xmit RESEND 1400-4999@7", unit_log_get());
+}
+TEST_F(homa_timer, homa_timer__silent_ticks_reset_between_checks)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 200, 5000);
+	ASSERT_NE(NULL, crpc);
+	self->homa.resend_ticks = 5;
+	homa_timer(&self->homa);
+	homa_timer(&self->homa);
+	homa_timer(&self->homa);
+	crpc->silent_ticks = 0;
+	homa_timer(&self->homa);
+	EXPECT_EQ(1, crpc->silent_ticks);
+}
+TEST_F(homa_timer, homa_timer__socket_falls_behind)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 200, 5000);
+	ASSERT_NE(NULL, crpc);
+	self->homa.timer_ticks += 3*HOMA_TIMER_SLOTS;
+	homa_timer(&self->homa);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.timer_rpc_checks);
+	EXPECT_EQ(self->homa.timer_ticks, self->hsk.timer_ticks);
+}
+TEST_F(homa_timer, homa_timer__dead_rpc_removed_from_wheel)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 200, 5000);
+	ASSERT_NE(NULL, crpc);
+	homa_rpc_free(crpc);
+	EXPECT_TRUE(list_empty(&crpc->timer_links));
+	homa_timer(&self->homa);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.timer_rpc_checks);
+}
+TEST_F(homa_timer, homa_timer_scan__socket_in_other_shard)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 200, 5000);
+	ASSERT_NE(NULL, crpc);
+	self->homa.timer_ticks++;
+	homa_timer_scan(&self->homa, (self->hsk.port + 1) % 4, 4);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.timer_rpc_checks);
+	homa_timer_scan(&self->homa, self->hsk.port % 4, 4);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.timer_rpc_checks);
+}
+TEST_F(homa_timer, homa_timer_shards_start__thread_creation_fails)
+{
+	self->homa.num_timer_shards = 3;
+	EXPECT_EQ(ENOMEM, -homa_timer_shards_start(&self->homa));
+	EXPECT_EQ(1, self->homa.active_timer_shards);
+}
+
 TEST_F(homa_timer, homa_timer__reap_dead_rpcs)
 {
 	struct homa_rpc *dead = unit_client_rpc(&self->hsk,
@@ -116,6 +116,12 @@ TEST_F(homa_utils, homa_rpc_new_client__normal)
 	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
 			&self->server_addr);
 	ASSERT_FALSE(IS_ERR(crpc));
+	EXPECT_EQ(1, crpc->peer->num_rpcs);
+	EXPECT_EQ(1, unit_list_length(&crpc->peer->rpcs));
+	ASSERT_NE(NULL, crpc->cold);
+	EXPECT_EQ(crpc->cold->bpage_offsets, crpc->msgin.bpage_offsets);
+	EXPECT_EQ(self->homa.timer_ticks, crpc->cold->resend_timer_ticks);
+	EXPECT_EQ(0, crpc->cold->done_timer_ticks);
 	homa_rpc_free(crpc);
 	homa_rpc_unlock(crpc);
 }
@@ -127,6 +133,15 @@ TEST_F(homa_utils, homa_rpc_new_client__malloc_error)
 	EXPECT_TRUE(IS_ERR(crpc));
 	EXPECT_EQ(ENOMEM, -PTR_ERR(crpc));
 }
+TEST_F(homa_utils, homa_rpc_new_client__cant_allocate_cold)
+{
+	mock_kmalloc_errors = 2;
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	EXPECT_TRUE(IS_ERR(crpc));
+	EXPECT_EQ(ENOMEM, -PTR_ERR(crpc));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
 TEST_F(homa_utils, homa_rpc_new_client__route_error)
 {
 	mock_route_errors = 1;
@@ -342,6 +357,54 @@ TEST_F(homa_utils, homa_rpc_acked__lookup_socket)
 	EXPECT_STREQ("DEAD", homa_symbol_for_state(srpc));
 	homa_sock_destroy(&hsk);
 }
+TEST_F(homa_utils, homa_rpc_acked__port_group)
+{
+	struct homa_sock hsk;
+	mock_sock_init(&hsk, &self->homa, 0);
+	hsk.inet.sk.sk_reuseport = 1;
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &hsk, 100));
+	struct homa_rpc *srpc = unit_server_rpc(&hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 3000);
+	ASSERT_NE(NULL, srpc);
+	struct homa_ack ack = {.client_port = htons(self->client_port),
+			.server_port = htons(100),
+			.client_id = cpu_to_be64(self->client_id)};
+	homa_rpc_acked(&self->hsk, self->client_ip, &ack);
+	EXPECT_EQ(0, unit_list_length(&hsk.active_rpcs));
+	EXPECT_STREQ("DEAD", homa_symbol_for_state(srpc));
+	homa_sock_destroy(&hsk);
+}
+TEST_F(homa_utils, homa_rpc_acked__port_group_membership_changed)
+{
+	struct homa_sock hsk1, hsk2, *selected, *owner;
+	struct homa_rpc *srpc;
+	__u64 id = homa_local_id(cpu_to_be64(self->client_id));
+
+	mock_sock_init(&hsk1, &self->homa, 0);
+	mock_sock_init(&hsk2, &self->homa, 0);
+	hsk1.inet.sk.sk_reuseport = 1;
+	hsk2.inet.sk.sk_reuseport = 1;
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &hsk1, 100));
+	EXPECT_EQ(0, -homa_sock_bind(&self->homa.port_map, &hsk2, 100));
+
+	/* Create the RPC on the member that homa_group_select won't pick. */
+	selected = homa_group_select(&self->homa, 100, self->client_ip,
+			self->client_port, id, 1);
+	owner = (selected == &hsk1) ? &hsk2 : &hsk1;
+	srpc = unit_server_rpc(owner, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 3000);
+	ASSERT_NE(NULL, srpc);
+	struct homa_ack ack = {.client_port = htons(self->client_port),
+			.server_port = htons(100),
+			.client_id = cpu_to_be64(self->client_id)};
+	homa_rpc_acked(&self->hsk, self->client_ip, &ack);
+	EXPECT_EQ(0, unit_list_length(&owner->active_rpcs));
+	EXPECT_STREQ("DEAD", homa_symbol_for_state(srpc));
+	homa_sock_destroy(&hsk1);
+	homa_sock_destroy(&hsk2);
+}
 TEST_F(homa_utils, homa_rpc_acked__no_such_socket)
 {
 	struct homa_sock hsk;
@@ -375,19 +438,142 @@ TEST_F(homa_utils, homa_rpc_acked__no_such_rpc)
 	homa_sock_destroy(&hsk);
 }
 
+TEST_F(homa_utils, homa_bucket_add__grow_bucket)
+{
+	struct homa_rpc *crpcs[5];
+	struct homa_rpc_bucket *bucket;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		atomic64_set(&self->homa.next_outgoing_id,
+				3 + 2*i*HOMA_CLIENT_RPC_BUCKETS);
+		crpcs[i] = homa_rpc_new_client(&self->hsk, &self->server_addr);
+		ASSERT_FALSE(IS_ERR(crpcs[i]));
+		homa_rpc_unlock(crpcs[i]);
+	}
+	bucket = homa_client_rpc_bucket(&self->hsk, crpcs[0]->id);
+	EXPECT_EQ(5, bucket->num_rpcs);
+	EXPECT_EQ(2, bucket->bits);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.rpc_bucket_resizes);
+	for (i = 0; i < 5; i++) {
+		EXPECT_EQ(crpcs[i], homa_find_client_rpc(&self->hsk,
+				crpcs[i]->id));
+		homa_rpc_unlock(crpcs[i]);
+	}
+	for (i = 0; i < 5; i++)
+		homa_rpc_free(crpcs[i]);
+}
+TEST_F(homa_utils, homa_bucket_add__max_bits)
+{
+	struct homa_rpc_bucket *bucket;
+	struct homa_rpc *crpc;
+
+	atomic64_set(&self->homa.next_outgoing_id, 3);
+	bucket = homa_client_rpc_bucket(&self->hsk, 3);
+	EXPECT_EQ(0, homa_bucket_resize(bucket, HOMA_RPC_BUCKET_MAX_BITS));
+	bucket->num_rpcs = HOMA_RPC_BUCKET_LOAD << HOMA_RPC_BUCKET_MAX_BITS;
+	crpc = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(HOMA_RPC_BUCKET_MAX_BITS, bucket->bits);
+	EXPECT_EQ(crpc, homa_find_client_rpc(&self->hsk, crpc->id));
+	homa_rpc_unlock(crpc);
+	bucket->num_rpcs = 1;
+	homa_rpc_free(crpc);
+}
+TEST_F(homa_utils, homa_bucket_remove__shrink_bucket)
+{
+	struct homa_rpc *srpcs[5];
+	struct homa_rpc_bucket *bucket;
+	int created, i;
+
+	for (i = 0; i < 5; i++) {
+		self->data.common.sender_id = cpu_to_be64(self->client_id
+				+ 2*i*HOMA_SERVER_RPC_BUCKETS);
+		srpcs[i] = homa_rpc_new_server(&self->hsk, self->client_ip,
+				&self->data, &created);
+		ASSERT_FALSE(IS_ERR(srpcs[i]));
+		EXPECT_EQ(1, created);
+		homa_rpc_unlock(srpcs[i]);
+	}
+	bucket = homa_server_rpc_bucket(&self->hsk, srpcs[0]->id);
+	EXPECT_EQ(2, bucket->bits);
+
+	homa_rpc_free(srpcs[0]);
+	homa_rpc_free(srpcs[1]);
+	homa_rpc_free(srpcs[2]);
+	EXPECT_EQ(2, bucket->bits);
+	homa_rpc_free(srpcs[3]);
+	EXPECT_EQ(1, bucket->bits);
+	EXPECT_EQ(1, bucket->num_rpcs);
+	EXPECT_EQ(srpcs[4], homa_find_server_rpc(&self->hsk, self->client_ip,
+			self->client_port, srpcs[4]->id));
+	homa_rpc_unlock(srpcs[4]);
+	homa_rpc_free(srpcs[4]);
+	EXPECT_EQ(0, bucket->bits);
+	EXPECT_EQ(&bucket->rpc0, bucket->rpcs);
+}
+TEST_F(homa_utils, homa_bucket_resize__kmalloc_error)
+{
+	struct homa_rpc_bucket *bucket = &self->hsk.client_rpc_buckets[0];
+
+	mock_kmalloc_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_bucket_resize(bucket, 3));
+	EXPECT_EQ(0, bucket->bits);
+	EXPECT_EQ(&bucket->rpc0, bucket->rpcs);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.rpc_bucket_resizes);
+}
+TEST_F(homa_utils, homa_bucket_resize__rehash_rpcs)
+{
+	struct homa_rpc *crpc1, *crpc2;
+	struct homa_rpc_bucket *bucket;
+
+	atomic64_set(&self->homa.next_outgoing_id, 3);
+	crpc1 = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc1));
+	homa_rpc_unlock(crpc1);
+	atomic64_set(&self->homa.next_outgoing_id,
+			3 + 6*HOMA_CLIENT_RPC_BUCKETS);
+	crpc2 = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc2));
+	homa_rpc_unlock(crpc2);
+	bucket = homa_client_rpc_bucket(&self->hsk, crpc1->id);
+	EXPECT_EQ(0, bucket->bits);
+
+	EXPECT_EQ(0, homa_bucket_resize(bucket, 4));
+	EXPECT_EQ(4, bucket->bits);
+	EXPECT_TRUE(hlist_empty(&bucket->rpc0));
+	EXPECT_EQ(crpc1, homa_find_client_rpc(&self->hsk, crpc1->id));
+	homa_rpc_unlock(crpc1);
+	EXPECT_EQ(crpc2, homa_find_client_rpc(&self->hsk, crpc2->id));
+	homa_rpc_unlock(crpc2);
+
+	EXPECT_EQ(0, homa_bucket_resize(bucket, 0));
+	EXPECT_EQ(&bucket->rpc0, bucket->rpcs);
+	EXPECT_EQ(crpc1, homa_find_client_rpc(&self->hsk, crpc1->id));
+	homa_rpc_unlock(crpc1);
+	EXPECT_EQ(crpc2, homa_find_client_rpc(&self->hsk, crpc2->id));
+	homa_rpc_unlock(crpc2);
+	homa_rpc_free(crpc1);
+	homa_rpc_free(crpc2);
+}
 TEST_F(homa_utils, homa_rpc_free__basics)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
 			self->server_port, self->client_id, 1000, 20000);
-	EXPECT_EQ(1, unit_list_length(&self->homa.grantable_rpcs));
+	EXPECT_EQ(1, self->homa.num_grantable_rpcs);
 	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(1, crpc->peer->num_rpcs);
 	unit_log_clear();
 	mock_log_rcu_sched = 1;
 	homa_rpc_free(crpc);
+	EXPECT_EQ(0, crpc->peer->num_rpcs);
+	EXPECT_EQ(1, list_empty(&crpc->peer_links));
 	EXPECT_STREQ("homa_remove_from_grantable invoked",
 			unit_log_get());
-	EXPECT_EQ(0, unit_list_length(&self->homa.grantable_rpcs));
+	EXPECT_EQ(0, self->homa.num_grantable_rpcs);
+	EXPECT_EQ(0, unit_list_length(&self->homa.grantable_peers));
 	EXPECT_EQ(NULL, homa_find_client_rpc(&self->hsk, crpc->id));
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
 	EXPECT_EQ(1, unit_list_length(&self->hsk.dead_rpcs));
@@ -487,10 +673,11 @@ TEST_F(homa_utils, homa_rpc_free__remove_from_throttled_list)
 			UNIT_OUTGOING, self->client_ip, self->server_ip,
 			self->server_port, self->client_id, 10000, 1000);
 	homa_add_to_throttled(crpc);
-	EXPECT_EQ(1, unit_list_length(&self->homa.throttled_rpcs));
+	EXPECT_EQ(1, self->homa.throttled_pacers);
 	unit_log_clear();
 	homa_rpc_free(crpc);
-	EXPECT_EQ(0, unit_list_length(&self->homa.throttled_rpcs));
+	EXPECT_EQ(0, self->homa.throttled_pacers);
+	EXPECT_TRUE(list_empty(&crpc->throttled_links));
 }
 
 TEST_F(homa_utils, homa_rpc_free_rcu)
@@ -529,6 +716,19 @@ TEST_F(homa_utils, homa_rpc_reap__basics)
 	EXPECT_STREQ("1236 1238", dead_rpcs(&self->hsk));
 	EXPECT_EQ(4, self->hsk.dead_skbs);
 }
+TEST_F(homa_utils, homa_rpc_reap__release_peer)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 100);
+	struct homa_peer *peer;
+	ASSERT_NE(NULL, crpc1);
+	peer = crpc1->peer;
+	EXPECT_EQ(2, atomic_read(&peer->refs));
+	homa_rpc_free(crpc1);
+	homa_rpc_reap(&self->hsk, 10);
+	EXPECT_EQ(1, atomic_read(&peer->refs));
+}
 TEST_F(homa_utils, homa_rpc_reap__protected)
 {
 	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
@@ -640,6 +840,170 @@ TEST_F(homa_utils, homa_rpc_reap__nothing_to_reap)
 {
 	EXPECT_EQ(0, homa_rpc_reap(&self->hsk, 10));
 }
+TEST_F(homa_utils, homa_rpc_reap__recycle_rpcs)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 100, 100);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+2, 100, 100);
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	self->homa.rpc_cache_max = 1;
+	homa_rpc_free(crpc1);
+	homa_rpc_free(crpc2);
+	homa_rpc_reap(&self->hsk, 10);
+	EXPECT_STREQ("", dead_rpcs(&self->hsk));
+	EXPECT_EQ(1, self->hsk.rpc_cache_size);
+	EXPECT_EQ(crpc1, list_first_entry(&self->hsk.rpc_cache,
+			struct homa_rpc, dead_links));
+}
+TEST_F(homa_utils, homa_rpc_reap__dont_recycle_after_shutdown)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 100, 100);
+	ASSERT_NE(NULL, crpc);
+	homa_rpc_free(crpc);
+	self->hsk.shutdown = 1;
+	homa_rpc_reap(&self->hsk, 10);
+	self->hsk.shutdown = 0;
+	EXPECT_EQ(0, self->hsk.rpc_cache_size);
+}
+
+TEST_F(homa_utils, homa_reap_choose_core)
+{
+	homa_cores[0]->last_active = 500;
+	homa_cores[2]->last_active = 100;
+	homa_cores[2]->last_app_active = 700;
+	homa_cores[3]->last_active = 300;
+	homa_cores[4]->last_app_active = 200;
+	homa_cores[5]->last_active = 400;
+	homa_cores[6]->last_active = 400;
+	homa_cores[7]->last_active = 400;
+
+	/* The current core (1) is idle but must not be chosen. */
+	EXPECT_EQ(4, homa_reap_choose_core(&self->homa));
+
+	/* Cores on other NUMA nodes are ignored. */
+	homa_cores[4]->numa_node = 1;
+	EXPECT_EQ(3, homa_reap_choose_core(&self->homa));
+
+	/* So are offline cores. */
+	cpumask_clear_cpu(3, &__cpu_online_mask);
+	EXPECT_EQ(5, homa_reap_choose_core(&self->homa));
+}
+TEST_F(homa_utils, homa_reap_queue__basics)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 2000);
+	ASSERT_NE(NULL, crpc);
+	self->homa.reap_worker_skbs = 4;
+	homa_cores[0]->last_active = 100;
+	unit_log_clear();
+	homa_rpc_free(crpc);
+	EXPECT_SUBSTR("queue_work_on core 2", unit_log_get());
+	EXPECT_EQ(1, atomic_read(&self->hsk.reap_queued));
+	EXPECT_EQ(2, refcount_read(&self->hsk.sock.sk_refcnt));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.reap_worker_queues);
+	EXPECT_EQ(&self->hsk.reap_node, homa_cores[2]->reap_socks.first);
+
+	/* Second call: already queued. */
+	unit_log_clear();
+	homa_reap_queue(&self->hsk);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.reap_worker_queues);
+
+	homa_reap_work(&homa_cores[2]->reap_work);
+}
+TEST_F(homa_utils, homa_reap_queue__socket_shutdown)
+{
+	self->hsk.shutdown = true;
+	homa_reap_queue(&self->hsk);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(0, atomic_read(&self->hsk.reap_queued));
+	self->hsk.shutdown = false;
+}
+TEST_F(homa_utils, homa_reap_work)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 2000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+2, 5000, 100);
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	homa_rpc_free(crpc1);
+	homa_rpc_free(crpc2);
+	EXPECT_EQ(9, self->hsk.dead_skbs);
+	self->homa.reap_limit = 3;
+	homa_reap_queue(&self->hsk);
+	unit_log_clear();
+	homa_reap_work(&homa_cores[0]->reap_work);
+	EXPECT_STREQ("reaped 1234; reaped 1236", unit_log_get());
+	EXPECT_EQ(0, self->hsk.dead_skbs);
+	EXPECT_EQ(0, atomic_read(&self->hsk.reap_queued));
+	EXPECT_EQ(1, refcount_read(&self->hsk.sock.sk_refcnt));
+	EXPECT_EQ(NULL, homa_cores[0]->reap_socks.first);
+}
+TEST_F(homa_utils, homa_rpc_alloc__reuse_cached_rpc)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 100, 100);
+	struct homa_rpc *crpc2;
+	ASSERT_NE(NULL, crpc1);
+	homa_rpc_free(crpc1);
+	homa_rpc_reap(&self->hsk, 10);
+	EXPECT_EQ(1, self->hsk.rpc_cache_size);
+	homa_cores[cpu_number]->metrics.rpc_cache_hits = 0;
+	homa_cores[cpu_number]->metrics.rpc_cache_misses = 0;
+
+	mock_kmalloc_errors = 1;
+	crpc2 = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc2));
+	EXPECT_EQ(crpc1, crpc2);
+	EXPECT_EQ(HOMA_RPC_MAGIC, crpc2->magic);
+	EXPECT_EQ(crpc2->cold->bpage_offsets, crpc2->msgin.bpage_offsets);
+	EXPECT_EQ(0, self->hsk.rpc_cache_size);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.rpc_cache_hits);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.rpc_cache_misses);
+	homa_rpc_free(crpc2);
+	homa_rpc_unlock(crpc2);
+}
+TEST_F(homa_utils, homa_rpc_alloc__cache_empty)
+{
+	struct homa_rpc *crpc;
+
+	homa_cores[cpu_number]->metrics.rpc_cache_misses = 0;
+	crpc = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.rpc_cache_misses);
+	homa_rpc_free(crpc);
+	homa_rpc_unlock(crpc);
+}
+
+TEST_F(homa_utils, homa_rpc_cache_drain)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 100, 100);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+2, 100, 100);
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	homa_rpc_free(crpc1);
+	homa_rpc_free(crpc2);
+	homa_rpc_reap(&self->hsk, 10);
+	EXPECT_EQ(2, self->hsk.rpc_cache_size);
+	homa_rpc_cache_drain(&self->hsk);
+	EXPECT_EQ(0, self->hsk.rpc_cache_size);
+	EXPECT_TRUE(list_empty(&self->hsk.rpc_cache));
+}
 
 TEST_F(homa_utils, homa_find_client_rpc)
 {
@@ -773,6 +1137,137 @@ TEST_F(homa_utils, homa_append_metric)
 	EXPECT_EQ(120, self->homa.metrics_capacity);
 }
 
+TEST_F(homa_utils, homa_print_metrics__latency_histograms)
+{
+	homa_cores[1]->metrics.latency[HOMA_LAT_HANDOFF][0][3] = 5;
+	homa_print_metrics(&self->homa);
+	EXPECT_SUBSTR("lat_handoff_0_3                         5  "
+			"Intervals from handoff to user thread of 8-15 cycles, "
+			"messages <= 1500 bytes", self->homa.metrics);
+	EXPECT_EQ(NULL, strstr(self->homa.metrics, "lat_handoff_0_4"));
+}
+
+TEST_F(homa_utils, homa_record_latency)
+{
+	homa_record_latency(HOMA_LAT_COPY_OUT, 1000, 0);
+	homa_record_latency(HOMA_LAT_COPY_OUT, 1000, 1);
+	homa_record_latency(HOMA_LAT_COPY_OUT, 20000, 1000);
+	homa_record_latency(HOMA_LAT_COPY_OUT, 1000000, ~0ULL);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.latency
+			[HOMA_LAT_COPY_OUT][0][0]);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.latency
+			[HOMA_LAT_COPY_OUT][2][9]);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.latency
+			[HOMA_LAT_COPY_OUT][3][HOMA_LAT_BUCKETS-1]);
+}
+
+TEST_F(homa_utils, homa_freeze_trigger__already_frozen)
+{
+	tt_frozen = true;
+	homa_freeze_trigger(&self->homa, GRANTABLE_RPCS, "id %d, count %d",
+			1, 2);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.freeze_triggers);
+	EXPECT_EQ(0, self->homa.freeze_peers_pending);
+}
+TEST_F(homa_utils, homa_freeze_trigger__basics)
+{
+	homa_freeze_trigger(&self->homa, GRANTABLE_RPCS, "id %d, count %d",
+			1, 2);
+	EXPECT_TRUE(tt_frozen);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.freeze_triggers);
+	EXPECT_EQ(1, self->homa.freeze_peers_pending);
+
+	/* Second trigger is ignored until the trace is unfrozen. */
+	homa_freeze_trigger(&self->homa, RESEND_RATE, "id %d, count %d",
+			1, 2);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.freeze_triggers);
+}
+TEST_F(homa_utils, homa_freeze_check_slow)
+{
+	struct homa_rpc *crpc;
+
+	mock_cycles = 1000;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			200, 5000);
+	ASSERT_NE(NULL, crpc);
+	self->homa.freeze_slow_factor = 2;
+	self->homa.freeze_slow_base_usecs = 20;
+	self->homa.cycles_per_kbyte = 1000;
+
+	/* Expected latency: 20000 cycles + 5200 bytes at 1 cycle/byte. */
+	mock_cycles = 1000 + 50400;
+	homa_freeze_check_slow(crpc);
+	EXPECT_FALSE(tt_frozen);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.freeze_triggers);
+
+	mock_cycles++;
+	homa_freeze_check_slow(crpc);
+	EXPECT_TRUE(tt_frozen);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.freeze_triggers);
+}
+
+TEST_F(homa_utils, homa_auto_cutoffs__basics)
+{
+	self->homa.unsched_bytes = 10000;
+	self->homa.auto_cutoffs_min_msgs = 100;
+	homa_cores[0]->metrics.small_msg_bytes[1] = 300000;
+	homa_cores[0]->metrics.small_msg_bytes[15] = 300000;
+	homa_cores[2]->metrics.small_msg_bytes[46] = 300000;
+	homa_cores[3]->metrics.medium_msg_bytes[19] = 2000000;
+	homa_cores[0]->metrics.large_msg_count = 1;
+	homa_cores[0]->metrics.large_msg_bytes = 2000000;
+	homa_auto_cutoffs(&self->homa);
+	EXPECT_EQ(3008, self->homa.unsched_cutoffs[7]);
+	EXPECT_EQ(20480, self->homa.unsched_cutoffs[6]);
+	EXPECT_EQ(HOMA_MAX_MESSAGE_LENGTH, self->homa.unsched_cutoffs[5]);
+	EXPECT_EQ(INT_MAX, self->homa.unsched_cutoffs[0]);
+	EXPECT_EQ(4, self->homa.max_sched_prio);
+	EXPECT_EQ(1, self->homa.cutoff_version);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.auto_cutoff_updates);
+	EXPECT_EQ(2000000,
+			self->homa.cutoff_state.prev_bytes[HOMA_NUM_SMALL_COUNTS
+			+ 19]);
+	EXPECT_EQ(1, self->homa.cutoff_state.prev_large_count);
+}
+TEST_F(homa_utils, homa_auto_cutoffs__not_enough_messages)
+{
+	self->homa.unsched_bytes = 10000;
+	self->homa.auto_cutoffs_min_msgs = 10000;
+	homa_cores[0]->metrics.small_msg_bytes[1] = 300000;
+	homa_auto_cutoffs(&self->homa);
+	EXPECT_EQ(200, self->homa.unsched_cutoffs[7]);
+	EXPECT_EQ(0, self->homa.cutoff_state.prev_bytes[1]);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.auto_cutoff_updates);
+}
+TEST_F(homa_utils, homa_auto_cutoffs__hysteresis)
+{
+	self->homa.unsched_bytes = 10000;
+	self->homa.auto_cutoffs_min_msgs = 100;
+	homa_cores[0]->metrics.small_msg_bytes[1] = 300000;
+	homa_cores[0]->metrics.small_msg_bytes[15] = 300000;
+	homa_cores[0]->metrics.small_msg_bytes[46] = 300000;
+	homa_auto_cutoffs(&self->homa);
+	EXPECT_EQ(128, self->homa.unsched_cutoffs[7]);
+	EXPECT_EQ(1024, self->homa.unsched_cutoffs[6]);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.auto_cutoff_updates);
+
+	/* Same traffic again: cutoffs don't change. */
+	homa_cores[0]->metrics.small_msg_bytes[1] += 300000;
+	homa_cores[0]->metrics.small_msg_bytes[15] += 300000;
+	homa_cores[0]->metrics.small_msg_bytes[46] += 300000;
+	homa_auto_cutoffs(&self->homa);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.auto_cutoff_updates);
+	EXPECT_EQ(600000, self->homa.cutoff_state.prev_bytes[1]);
+}
+TEST_F(homa_utils, homa_auto_cutoffs__one_priority)
+{
+	self->homa.num_priorities = 1;
+	self->homa.auto_cutoffs_min_msgs = 1;
+	homa_cores[0]->metrics.small_msg_bytes[1] = 300000;
+	homa_auto_cutoffs(&self->homa);
+	EXPECT_EQ(0, self->homa.cutoff_state.prev_bytes[1]);
+}
 TEST_F(homa_utils, homa_prios_changed__basics)
 {
 	set_cutoffs(&self->homa, 90, 80, HOMA_MAX_MESSAGE_LENGTH*2, 60, 50,
@@ -77,6 +77,29 @@ TEST_F(timetrace, tt_record__basics)
 			buffer);
 }
 
+TEST_F(timetrace, tt_set_categories)
+{
+	char buffer[1000];
+	memset(buffer, 0, sizeof(buffer));
+	tt_set_categories((1 << TT_GRANT) | (1 << TT_COPY));
+	EXPECT_FALSE(tt_enabled(TT_GRO));
+	EXPECT_TRUE(tt_enabled(TT_GRANT));
+	EXPECT_FALSE(tt_enabled(TT_PACER));
+	EXPECT_TRUE(tt_enabled(TT_COPY));
+	if (tt_enabled(TT_PACER))
+		tt_record("pacer message");
+	if (tt_enabled(TT_GRANT))
+		tt_record("grant message");
+	tt_proc_open(NULL, &self->file);
+	tt_proc_read(&self->file, buffer, sizeof(buffer), 0);
+	tt_proc_release(NULL, &self->file);
+	EXPECT_STREQ("1000 [C01] grant message\n", buffer);
+
+	tt_set_categories(0);
+	EXPECT_FALSE(tt_enabled(TT_GRANT));
+	EXPECT_FALSE(tt_enabled(TT_COPY));
+}
+
 TEST_F(timetrace, tt_record_buf__wraparound)
 {
 	char buffer[100];
@@ -297,4 +320,121 @@ TEST_F(timetrace, tt_proc_release__unfreeze)
 	EXPECT_FALSE(tt_frozen);
 	EXPECT_EQ(NULL, tt_buffers[1]->events[3].format);
 	EXPECT_EQ(0, tt_buffers[1]->next_index);
-}
\ No newline at end of file
+}
+TEST_F(timetrace, tt_stream_open__not_initialized)
+{
+	tt_destroy();
+	EXPECT_EQ(EINVAL, -tt_stream_open(NULL, &self->file));
+	EXPECT_EQ(NULL, self->file.private_data);
+}
+TEST_F(timetrace, tt_stream_read__basics)
+{
+	char buffer[1000];
+	struct tt_stream_header *header = (struct tt_stream_header *) buffer;
+	struct tt_stream_format *format;
+	struct tt_stream_event *event;
+	int length;
+
+	tt_record_buf(tt_buffers[1], 1000, "Event %d", 10, 0, 0, 0);
+	tt_record_buf(tt_buffers[0], 1100, "Other %d %d", 1, 2, 0, 0);
+	tt_record_buf(tt_buffers[1], 1200, "Event %d", 20, 0, 0, 0);
+	EXPECT_EQ(0, tt_stream_open(NULL, &self->file));
+	length = tt_stream_read(&self->file, buffer, sizeof(buffer), 0);
+	EXPECT_EQ(16 + 2*24 + 3*32, length);
+	EXPECT_EQ(TT_STREAM_MAGIC, header->magic);
+	EXPECT_EQ(nr_cpu_ids, header->num_cores);
+
+	format = (struct tt_stream_format *) (buffer + 16);
+	EXPECT_EQ(TT_STREAM_FORMAT, format->type);
+	EXPECT_EQ(16, format->length);
+	EXPECT_STREQ("Event %d", (char *) (format + 1));
+	event = (struct tt_stream_event *) (buffer + 40);
+	EXPECT_EQ(TT_STREAM_EVENT, event->type);
+	EXPECT_EQ(1, event->core);
+	EXPECT_EQ(format->format_id, event->format_id);
+	EXPECT_EQ(1000, event->timestamp);
+	EXPECT_EQ(10, event->args[0]);
+
+	format = (struct tt_stream_format *) (buffer + 72);
+	EXPECT_STREQ("Other %d %d", (char *) (format + 1));
+	event = (struct tt_stream_event *) (buffer + 96);
+	EXPECT_EQ(0, event->core);
+	EXPECT_EQ(2, event->args[1]);
+
+	/* The second "Event" needs no new format record. */
+	event = (struct tt_stream_event *) (buffer + 128);
+	EXPECT_EQ(TT_STREAM_EVENT, event->type);
+	EXPECT_EQ(1200, event->timestamp);
+
+	/* Nothing new. */
+	EXPECT_EQ(0, tt_stream_read(&self->file, buffer, sizeof(buffer), 0));
+
+	/* Only new events are returned, and the trace was never frozen. */
+	EXPECT_EQ(0, tt_freeze_count.counter);
+	tt_record_buf(tt_buffers[1], 1300, "Event %d", 30, 0, 0, 0);
+	EXPECT_EQ(32, tt_stream_read(&self->file, buffer, sizeof(buffer), 0));
+	event = (struct tt_stream_event *) buffer;
+	EXPECT_EQ(1300, event->timestamp);
+	EXPECT_EQ(30, event->args[0]);
+	EXPECT_EQ(0, tt_stream_release(NULL, &self->file));
+}
+TEST_F(timetrace, tt_stream_read__small_user_buffer)
+{
+	char buffer[1000];
+	struct tt_stream_event *event;
+	int length = 0;
+	int count;
+
+	tt_record_buf(tt_buffers[1], 1000, "Event %d", 10, 0, 0, 0);
+	tt_stream_open(NULL, &self->file);
+	while (1) {
+		count = tt_stream_read(&self->file, buffer + length, 10, 0);
+		if (count == 0)
+			break;
+		length += count;
+	}
+	EXPECT_EQ(16 + 24 + 32, length);
+	event = (struct tt_stream_event *) (buffer + 40);
+	EXPECT_EQ(1000, event->timestamp);
+	tt_stream_release(NULL, &self->file);
+}
+TEST_F(timetrace, tt_stream_read__lost_events)
+{
+	char buffer[1000];
+	struct tt_stream_event *event;
+	int i, length;
+
+	tt_buffer_size = 4;
+	tt_record_buf(tt_buffers[1], 1000, "Event", 0, 0, 0, 0);
+	tt_stream_open(NULL, &self->file);
+	tt_stream_read(&self->file, buffer, sizeof(buffer), 0);
+
+	for (i = 1; i <= 6; i++)
+		tt_record_buf(tt_buffers[1], 1000 + 100*i, "Event", i, 0, 0, 0);
+	length = tt_stream_read(&self->file, buffer, sizeof(buffer), 0);
+	EXPECT_EQ(4*32, length);
+	event = (struct tt_stream_event *) buffer;
+	EXPECT_EQ(TT_STREAM_LOST, event->type);
+	EXPECT_EQ(1, event->core);
+	EXPECT_EQ(1400, event->timestamp);
+	event++;
+	EXPECT_EQ(TT_STREAM_EVENT, event->type);
+	EXPECT_EQ(4, event->args[0]);
+	event += 2;
+	EXPECT_EQ(6, event->args[0]);
+	tt_stream_release(NULL, &self->file);
+}
+TEST_F(timetrace, tt_stream_read__error_copying_to_user)
+{
+	char buffer[1000];
+
+	tt_stream_open(NULL, &self->file);
+	mock_copy_to_user_errors = 1;
+	EXPECT_EQ(EFAULT, -tt_stream_read(&self->file, buffer,
+			sizeof(buffer), 0));
+	tt_stream_release(NULL, &self->file);
+}
+TEST_F(timetrace, tt_stream_release__bogus_file)
+{
+	EXPECT_EQ(EINVAL, -tt_stream_release(NULL, &self->file));
+}
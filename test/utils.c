@@ -57,7 +57,8 @@ struct homa_rpc *unit_client_rpc(struct homa_sock *hsk,
 	struct homa_rpc *crpc = homa_rpc_new_client(hsk, &server_addr);
 	if (IS_ERR(crpc))
 		return NULL;
-	if (homa_message_out_init(crpc, unit_iov_iter(NULL, req_length), 0)) {
+	if (homa_message_out_init(crpc, unit_iov_iter(NULL, req_length),
+			0, 0)) {
 		homa_rpc_free(crpc);
 		return NULL;
 	}
@@ -173,18 +174,25 @@ void unit_log_active_ids(struct homa_sock *hsk)
  */
 void unit_log_hashed_rpcs(struct homa_sock *hsk)
 {
-	int i;
+	int i, j;
 	struct homa_rpc *rpc;
+	struct homa_rpc_bucket *bucket;
 	for (i = 0; i < HOMA_CLIENT_RPC_BUCKETS; i++) {
-		hlist_for_each_entry_rcu(rpc, &hsk->client_rpc_buckets[i].rpcs,
-				hash_links) {
-			unit_log_printf(" ", "%llu", rpc->id);
+		bucket = &hsk->client_rpc_buckets[i];
+		for (j = 0; j < (1 << bucket->bits); j++) {
+			hlist_for_each_entry_rcu(rpc, &bucket->rpcs[j],
+					hash_links) {
+				unit_log_printf(" ", "%llu", rpc->id);
+			}
 		}
 	}
 	for (i = 0; i < HOMA_SERVER_RPC_BUCKETS; i++) {
-		hlist_for_each_entry_rcu(rpc, &hsk->server_rpc_buckets[i].rpcs,
-				hash_links) {
-			unit_log_printf(" ", "%llu", rpc->id);
+		bucket = &hsk->server_rpc_buckets[i];
+		for (j = 0; j < (1 << bucket->bits); j++) {
+			hlist_for_each_entry_rcu(rpc, &bucket->rpcs[j],
+					hash_links) {
+				unit_log_printf(" ", "%llu", rpc->id);
+			}
 		}
 	}
 }
@@ -214,22 +222,27 @@ void unit_log_frag_list(struct sk_buff *skb, int verbose)
 
 /**
  * unit_log_grantables() - Append to the test log information about all of
- * the messages in homa->grantable_msgs.
+ * the grantable messages, peer by peer in the order of
+ * homa->grantable_peers.
  * @homa:     Homa's overall state.
  */
 void unit_log_grantables(struct homa *homa)
 {
+	struct homa_peer *peer;
 	struct homa_rpc *rpc;
 	int count = 0;
-	list_for_each_entry(rpc, &homa->grantable_rpcs, grantable_links) {
-		count++;
-		unit_log_printf("; ", "%s from %s, id %lu, "
-				"remaining %d",
-				homa_is_client(rpc->id) ? "response"
-				: "request",
-				homa_print_ipv6_addr(&rpc->peer->addr),
-				(long unsigned int) rpc->id,
-				rpc->msgin.bytes_remaining);
+	list_for_each_entry(peer, &homa->grantable_peers, grantable_links) {
+		list_for_each_entry(rpc, &peer->grantable_rpcs,
+				grantable_links) {
+			count++;
+			unit_log_printf("; ", "%s from %s, id %lu, "
+					"remaining %d",
+					homa_is_client(rpc->id) ? "response"
+					: "request",
+					homa_print_ipv6_addr(&rpc->peer->addr),
+					(long unsigned int) rpc->id,
+					rpc->msgin.bytes_remaining);
+		}
 	}
 	if (count != homa->num_grantable_rpcs) {
 		unit_log_printf("; ", "num_grantable_rpcs error: should "
@@ -313,18 +326,27 @@ void unit_log_skb_list(struct sk_buff_head *packets, int verbose)
 
 /**
  * unit_log_throttled() - Append to the test log information about all of
- * the messages in homa->throttle_rpcs.
+ * the messages in the throttled queues of all pacers, in priority order
+ * for each pacer.
  * @homa:     Homa's overall state.
  */
 void unit_log_throttled(struct homa *homa)
 {
 	struct homa_rpc *rpc;
-	list_for_each_entry_rcu(rpc, &homa->throttled_rpcs, throttled_links) {
-		unit_log_printf("; ", "%s id %lu, next_offset %d",
-				homa_is_client(rpc->id) ? "request"
-				: "response",
-				(long unsigned int) rpc->id,
-				rpc->msgout.next_xmit_offset);
+	int i, bucket;
+
+	for (i = 0; i < HOMA_MAX_PACERS; i++) {
+		for (bucket = 0; bucket < HOMA_THROTTLE_BUCKETS; bucket++) {
+			list_for_each_entry(rpc,
+					&homa->pacers[i].throttled_rpcs[bucket],
+					throttled_links) {
+				unit_log_printf("; ", "%s id %lu, next_offset %d",
+						homa_is_client(rpc->id)
+						? "request" : "response",
+						(long unsigned int) rpc->id,
+						rpc->msgout.next_xmit_offset);
+			}
+		}
 	}
 }
 
@@ -421,7 +443,7 @@ struct homa_rpc *unit_server_rpc(struct homa_sock *hsk,
 	if (state == UNIT_IN_SERVICE)
 		return srpc;
 	if (homa_message_out_init(srpc,
-			unit_iov_iter((void *) 2000, resp_length), 0) != 0)
+			unit_iov_iter((void *) 2000, resp_length), 0, 0) != 0)
 		goto error;
 	srpc->state = RPC_OUTGOING;
 	if (state == UNIT_OUTGOING)
@@ -58,9 +58,22 @@ static const struct proc_ops tt_pops = {
 	.proc_release           = tt_proc_release
 };
 
+/* Describes file operations implemented for streaming timetraces
+ * from /proc.
+ */
+static const struct proc_ops tt_stream_pops = {
+	.proc_open              = tt_stream_open,
+	.proc_read              = tt_stream_read,
+	.proc_lseek             = tt_proc_lseek,
+	.proc_release           = tt_stream_release
+};
+
 /* Used to remove the /proc file during tt_destroy. */
 static struct proc_dir_entry *tt_dir_entry;
 
+/* Used to remove /proc/timetrace_stream during tt_destroy. */
+static struct proc_dir_entry *tt_stream_dir_entry;
+
 /* Synchronizes accesses to global state such as frozen and init.  A mutex
  * isn't safe here, because tt_freeze gets called at times when threads
  * can't sleep.
@@ -78,6 +91,16 @@ atomic_t tt_freeze_count = {.counter = 1};
  */
 bool tt_frozen;
 
+/* One entry for each value of enum tt_category; an entry is enabled if
+ * tt_record calls in that category should be made. Modified only by
+ * tt_set_categories.
+ */
+#ifdef __UNIT_TEST__
+bool tt_category_enabled[TT_NUM_CATEGORIES];
+#else
+DEFINE_STATIC_KEY_ARRAY_FALSE(tt_category_keys, TT_NUM_CATEGORIES);
+#endif
+
 /* True means timetrace has been successfully initialized. */
 static bool init;
 
@@ -132,8 +155,18 @@ int tt_init(char *proc_file, int *temp)
 					"reading\n", proc_file);
 			goto error;
 		}
+		tt_stream_dir_entry = proc_create("timetrace_stream", S_IRUGO,
+				NULL, &tt_stream_pops);
+		if (!tt_stream_dir_entry) {
+			printk(KERN_ERR "couldn't create /proc/timetrace_stream "
+					"for timetrace streaming\n");
+			proc_remove(tt_dir_entry);
+			tt_dir_entry = NULL;
+			goto error;
+		}
 	} else {
 		tt_dir_entry = NULL;
+		tt_stream_dir_entry = NULL;
 	}
 
 	spin_lock_init(&tt_lock);
@@ -178,6 +211,8 @@ void tt_destroy(void)
 		init = false;
 		if (tt_dir_entry != NULL)
 			proc_remove(tt_dir_entry);
+		if (tt_stream_dir_entry != NULL)
+			proc_remove(tt_stream_dir_entry);
 	}
 	for (i = 0; i < nr_cpu_ids; i++) {
 		kfree(tt_buffers[i]);
@@ -224,6 +259,28 @@ void tt_freeze(void)
 	spin_unlock(&tt_lock);
 }
 
+/**
+ * tt_set_categories(): Enable and disable categories of tt_record calls
+ * (see enum tt_category). This function may sleep, so it must not be called
+ * at interrupt level.
+ * @categories:  Bit mask: bit i is 1 if category i should be enabled.
+ */
+void tt_set_categories(int categories)
+{
+	int i;
+
+	for (i = 0; i < TT_NUM_CATEGORIES; i++) {
+#ifdef __UNIT_TEST__
+		tt_category_enabled[i] = (categories >> i) & 1;
+#else
+		if ((categories >> i) & 1)
+			static_branch_enable(&tt_category_keys[i]);
+		else
+			static_branch_disable(&tt_category_keys[i]);
+#endif
+	}
+}
+
 /**
  * tt_record_buf(): record an event in a core-specific tt_buffer.
  *
@@ -540,6 +597,313 @@ int tt_proc_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
+/**
+ * tt_stream_open() - This function is invoked when /proc/timetrace_stream
+ * is opened. Unlike /proc/timetrace, opening this file doesn't freeze the
+ * timetrace: the file returns events continuously as they are recorded.
+ * @inode:    The inode corresponding to the file.
+ * @file:     Information about the open file.
+ *
+ * Return:    0 for success, else a negative errno.
+ */
+int tt_stream_open(struct inode *inode, struct file *file)
+{
+	struct tt_stream_header header;
+	struct tt_stream_file *sf;
+
+	sf = vmalloc(sizeof(*sf));
+	if (sf == NULL)
+		return -ENOMEM;
+	memset(sf, 0, sizeof(*sf));
+	sf->file = file;
+	sf->next_byte = sf->storage;
+
+	spin_lock(&tt_lock);
+	if (!init) {
+		spin_unlock(&tt_lock);
+		vfree(sf);
+		return -EINVAL;
+	}
+	spin_unlock(&tt_lock);
+
+	header.magic = TT_STREAM_MAGIC;
+	header.version = TT_STREAM_VERSION;
+	header.cpu_khz = cpu_khz;
+	header.num_cores = nr_cpu_ids;
+	memcpy(sf->storage, &header, sizeof(header));
+	sf->bytes_available = sizeof(header);
+	file->private_data = sf;
+	return 0;
+}
+
+/**
+ * tt_stream_find_new() - Locate the events in a core's tt_buffer that
+ * haven't yet been returned by a stream, and record their range in
+ * sf->pos and sf->end.
+ * @sf:      Stream for which events will be returned.
+ * @core:    Core whose buffer should be examined.
+ */
+static void tt_stream_find_new(struct tt_stream_file *sf, int core)
+{
+	struct tt_buffer *buffer = tt_buffers[core];
+	int mask = tt_buffer_size - 1;
+	int next = READ_ONCE(buffer->next_index);
+	int oldest, count, low, high;
+	bool wrapped;
+
+	wrapped = buffer->events[mask].format != NULL;
+	if (wrapped) {
+		/* Skip the entry at next, which is about to be overwritten. */
+		oldest = (next + 1) & mask;
+		count = tt_buffer_size - 1;
+	} else {
+		oldest = 0;
+		count = next;
+	}
+
+	/* Events are in increasing time order starting at oldest, so
+	 * binary search for the first one that is newer than the last
+	 * event returned.
+	 */
+	low = 0;
+	high = count;
+	while (low < high) {
+		int mid = (low + high)/2;
+
+		if (buffer->events[(oldest + mid) & mask].timestamp
+				> sf->last_time[core])
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	sf->pos[core] = (oldest + low) & mask;
+	sf->end[core] = (oldest + count) & mask;
+	sf->lost[core] = wrapped && (low == 0) && (low < count)
+			&& (sf->last_time[core] != 0);
+}
+
+/**
+ * tt_stream_append() - Add a record to the storage area of a stream.
+ * @sf:      Stream whose storage should be extended.
+ * @record:  Contents of the record.
+ * @length:  Number of bytes at @record.
+ *
+ * Return:   Zero for success, or -1 if there isn't enough space left for
+ *           the record.
+ */
+static int tt_stream_append(struct tt_stream_file *sf, const void *record,
+		int length)
+{
+	char *next = sf->next_byte + sf->bytes_available;
+
+	if (length > (sf->storage + TT_STREAM_BUF_SIZE - next))
+		return -1;
+	memcpy(next, record, length);
+	sf->bytes_available += length;
+	return 0;
+}
+
+/**
+ * tt_stream_format_id() - Returns the id to use in a stream for a given
+ * format string. If this is the first time the string has been seen,
+ * a TT_STREAM_FORMAT record is added to the stream's storage.
+ * @sf:      Stream for which an id is needed.
+ * @format:  Format string from a tt_event.
+ *
+ * Return:   The id for the string, TT_STREAM_NO_FORMAT if there are too
+ *           many distinct strings, or -1 if there wasn't enough space in
+ *           storage for a TT_STREAM_FORMAT record.
+ */
+static __s64 tt_stream_format_id(struct tt_stream_file *sf,
+		const char *format)
+{
+	char record[sizeof(struct tt_stream_format) + 256];
+	struct tt_stream_format *f = (struct tt_stream_format *) record;
+	int i = hash_ptr(format, ilog2(TT_STREAM_FORMATS));
+	int chars, length;
+
+	while (sf->formats[i] != NULL) {
+		if (sf->formats[i] == format)
+			return i;
+		i = (i + 1) & (TT_STREAM_FORMATS - 1);
+	}
+
+	/* Don't let the table get too full, or probes will get long. */
+	if (sf->num_formats >= TT_STREAM_FORMATS/2)
+		return TT_STREAM_NO_FORMAT;
+	chars = strnlen(format, sizeof(record) - sizeof(*f) - 1);
+	length = (chars + 8) & ~7;
+	memset(record, 0, sizeof(record));
+	f->type = TT_STREAM_FORMAT;
+	f->length = length;
+	f->format_id = i;
+	memcpy(f + 1, format, chars);
+	if (tt_stream_append(sf, record, sizeof(*f) + length) != 0)
+		return -1;
+	sf->formats[i] = format;
+	sf->num_formats++;
+	return i;
+}
+
+/**
+ * tt_stream_fill() - Add records to the storage area of a stream for
+ * as many new events as will fit, in time order across cores. The
+ * caller must hold tt_lock.
+ * @sf:      Stream whose storage should be filled; must currently be
+ *           empty.
+ *
+ * Return:   The number of bytes added to storage.
+ */
+static int tt_stream_fill(struct tt_stream_file *sf)
+{
+	int mask = tt_buffer_size - 1;
+	int i;
+
+	for (i = 0; i < nr_cpu_ids; i++)
+		tt_stream_find_new(sf, i);
+
+	/* Each iteration through this loop processes one event (the one
+	 * with the earliest timestamp).
+	 */
+	while (true) {
+		struct tt_stream_event record;
+		struct tt_event *event = NULL;
+		int current_core = -1;
+		__u64 earliest_time = ~0;
+		__s64 id;
+
+		for (i = 0; i < nr_cpu_ids; i++) {
+			struct tt_event *candidate;
+
+			if (sf->pos[i] == sf->end[i])
+				continue;
+			candidate = &tt_buffers[i]->events[sf->pos[i]];
+			if (candidate->timestamp <= sf->last_time[i]) {
+				/* The core has wrapped around its buffer
+				 * while we were reading it; pick up the
+				 * rest next time.
+				 */
+				sf->end[i] = sf->pos[i];
+				continue;
+			}
+			if (candidate->timestamp < earliest_time) {
+				current_core = i;
+				earliest_time = candidate->timestamp;
+				event = candidate;
+			}
+		}
+		if (current_core < 0)
+			break;
+
+		memset(&record, 0, sizeof(record));
+		record.core = current_core;
+		if (sf->lost[current_core]) {
+			record.type = TT_STREAM_LOST;
+			record.timestamp = event->timestamp;
+			if (tt_stream_append(sf, &record, sizeof(record)) != 0)
+				break;
+			sf->lost[current_core] = 0;
+		}
+		id = tt_stream_format_id(sf, event->format);
+		if (id < 0)
+			break;
+		record.type = TT_STREAM_EVENT;
+		record.format_id = id;
+		record.timestamp = event->timestamp;
+		record.args[0] = event->arg0;
+		record.args[1] = event->arg1;
+		record.args[2] = event->arg2;
+		record.args[3] = event->arg3;
+		if (tt_stream_append(sf, &record, sizeof(record)) != 0)
+			break;
+		sf->last_time[current_core] = event->timestamp;
+		sf->pos[current_core] = (sf->pos[current_core] + 1) & mask;
+	}
+	return sf->bytes_available;
+}
+
+/**
+ * tt_stream_read() - This function is invoked to handle read kernel calls
+ * on /proc/timetrace_stream. It returns records for events recorded since
+ * the previous read (see struct tt_stream_header for the format).
+ * @file:    Information about the file being read.
+ * @user_buf: Address in user space of the buffer in which data from the
+ *           file should be returned.
+ * @length:  Number of bytes available at @user_buf.
+ * @offset:  Current read offset within the file; ignored.
+ *
+ * Return: the number of bytes returned at @user_buf. 0 means that no new
+ * events are available at the moment (reading again later will return more),
+ * and a negative number indicates an error (-errno).
+ */
+ssize_t tt_stream_read(struct file *file, char __user *user_buf,
+		size_t length, loff_t *offset)
+{
+	struct tt_stream_file *sf = file->private_data;
+	int copied_to_user = 0;
+
+	if ((sf == NULL) || (sf->file != file)) {
+		printk(KERN_ERR "tt_stream_read found damaged "
+				"private_data: 0x%p\n", file->private_data);
+		return -EINVAL;
+	}
+
+	while (copied_to_user < length) {
+		int chunk_size;
+
+		if (sf->bytes_available == 0) {
+			int filled = 0;
+
+			sf->next_byte = sf->storage;
+			spin_lock(&tt_lock);
+			if (init)
+				filled = tt_stream_fill(sf);
+			spin_unlock(&tt_lock);
+			if (filled == 0)
+				break;
+		}
+
+		/* Don't hold tt_lock while copying: it's a spinlock, and
+		 * copy_to_user may sleep.
+		 */
+		chunk_size = sf->bytes_available;
+		if (chunk_size > (length - copied_to_user))
+			chunk_size = length - copied_to_user;
+		if (copy_to_user(user_buf + copied_to_user, sf->next_byte,
+				chunk_size)) {
+			if (copied_to_user == 0)
+				copied_to_user = -EFAULT;
+			break;
+		}
+		sf->bytes_available -= chunk_size;
+		sf->next_byte += chunk_size;
+		copied_to_user += chunk_size;
+	}
+	return copied_to_user;
+}
+
+/**
+ * tt_stream_release() - This function is invoked when the last reference
+ * to an open /proc/timetrace_stream is closed.
+ * @inode:    The inode corresponding to the file.
+ * @file:     Information about the open file.
+ *
+ * Return: 0 for success, or a negative errno if there was an error.
+ */
+int tt_stream_release(struct inode *inode, struct file *file)
+{
+	struct tt_stream_file *sf = file->private_data;
+
+	if ((sf == NULL) || (sf->file != file)) {
+		printk(KERN_ERR "tt_stream_release found damaged "
+				"private_data: 0x%p\n", file->private_data);
+		return -EINVAL;
+	}
+	vfree(sf);
+	file->private_data = NULL;
+	return 0;
+}
+
 /**
  * tt_printk() - Print the contents of the timetrace to the system log.
  * Useful in situations where the system is too unstable to extract a
@@ -17,6 +17,9 @@
 #define HOMA_TIMETRACE_H
 
 #include <asm/types.h>
+#ifndef __UNIT_TEST__
+#include <linux/jump_label.h>
+#endif
 
 // Change 1 -> 0 in the following line to disable time tracing globally.
 // Used only in debugging.
@@ -105,12 +108,152 @@ struct tt_proc_file {
 	char *next_byte;
 };
 
+/**
+ * The following definitions describe the binary format of
+ * /proc/timetrace_stream. Unlike /proc/timetrace, this file can be read
+ * continuously without freezing the trace: each read returns the events
+ * recorded since the previous read. The file starts with a struct
+ * tt_stream_header, followed by a sequence of records of varying type,
+ * each of which starts with a one-byte type field. All fields are in
+ * host byte order.
+ */
+#define TT_STREAM_MAGIC   0x54545354
+#define TT_STREAM_VERSION 1
+
+/* Values for the type field of records in /proc/timetrace_stream. */
+#define TT_STREAM_EVENT   1
+#define TT_STREAM_FORMAT  2
+#define TT_STREAM_LOST    3
+
+/**
+ * struct tt_stream_header - Appears once at the beginning of the stream.
+ */
+struct tt_stream_header {
+	/** @magic: Always TT_STREAM_MAGIC. */
+	__u32 magic;
+
+	/** @version: Always TT_STREAM_VERSION. */
+	__u32 version;
+
+	/** @cpu_khz: Clock rate for timestamps, in khz. */
+	__u32 cpu_khz;
+
+	/** @num_cores: Number of cores that may appear in events. */
+	__u32 num_cores;
+};
+
+/**
+ * struct tt_stream_event - Record of type TT_STREAM_EVENT, which describes
+ * one event, or TT_STREAM_LOST, which indicates that events on a core
+ * were overwritten before they could be read (only @type, @core, and
+ * @timestamp are meaningful: it is the time of the oldest event still
+ * available for the core).
+ */
+struct tt_stream_event {
+	/** @type: TT_STREAM_EVENT or TT_STREAM_LOST. */
+	__u8 type;
+
+	__u8 pad;
+
+	/** @core: Core on which the event was recorded. */
+	__u16 core;
+
+	/**
+	 * @format_id: Identifies the event's format string, which will
+	 * have appeared in an earlier TT_STREAM_FORMAT record.
+	 */
+	__u32 format_id;
+
+	/** @timestamp: Time when the event occurred (tt_rdtsc units). */
+	__u64 timestamp;
+
+	/** @args: Arguments to the event's format string. */
+	__u32 args[4];
+};
+
+/**
+ * struct tt_stream_format - Record of type TT_STREAM_FORMAT: defines a
+ * format string id. Each id is defined once, before the first event that
+ * refers to it.
+ */
+struct tt_stream_format {
+	/** @type: Always TT_STREAM_FORMAT. */
+	__u8 type;
+
+	__u8 pad;
+
+	/**
+	 * @length: Number of bytes of string data that follow this
+	 * structure: a NULL-terminated string, padded with NULLs to a
+	 * multiple of 8 bytes.
+	 */
+	__u16 length;
+
+	/** @format_id: Id that will be used for this format string. */
+	__u32 format_id;
+};
+
+/**
+ * define TT_STREAM_FORMATS - Maximum number of distinct format strings
+ * that can be assigned ids for a single open of the stream file;
+ * must be a power of 2. Events with other format strings are output
+ * with format id TT_STREAM_NO_FORMAT.
+ */
+#define TT_STREAM_FORMATS 2048
+#define TT_STREAM_NO_FORMAT 0xffffffff
+
+/**
+ * Holds information about one open of /proc/timetrace_stream.
+ */
+struct tt_stream_file {
+	/* Identifies a particular open file. */
+	struct file *file;
+
+	/* Timestamp of the last event returned for each core (0 means no
+	 * events returned yet).
+	 */
+	__u64 last_time[NR_CPUS];
+
+	/* Hash table mapping format strings (pointers) to ids: entry i is
+	 * either NULL or a format string whose id is i. Uses linear
+	 * probing.
+	 */
+	const char *formats[TT_STREAM_FORMATS];
+
+	/* Number of non-NULL entries in formats. */
+	int num_formats;
+
+	/* The following arrays are used only during tt_stream_fill: for
+	 * each core, pos holds the index of the next event to return, end
+	 * holds the index just after the last event to return, and lost
+	 * is nonzero if events may have been lost before the one at pos.
+	 */
+	int pos[NR_CPUS];
+	int end[NR_CPUS];
+	char lost[NR_CPUS];
+
+	/* Records are collected here, so they can be copied out to
+	 * user space in bulk.
+	 */
+#define TT_STREAM_BUF_SIZE 8192
+	char storage[TT_STREAM_BUF_SIZE];
+
+	/* Number of bytes in storage currently available to copy to
+	 * application.
+	 */
+	int bytes_available;
+
+	/* Address of next byte in storage to copy to application. */
+	char *next_byte;
+};
+
 extern void   tt_destroy(void);
 extern void   tt_freeze(void);
 extern int    tt_init(char *proc_file, int *temp);
 extern void   tt_record_buf(struct tt_buffer* buffer, __u64 timestamp,
 		const char* format, __u32 arg0, __u32 arg1,
 		__u32 arg2, __u32 arg3);
+extern void   tt_set_categories(int categories);
 
 /* Private methods and variables: exposed so they can be accessed
  * by unit tests.
@@ -125,6 +268,10 @@ extern int       tt_proc_open(struct inode *inode, struct file *file);
 extern ssize_t   tt_proc_read(struct file *file, char __user *user_buf,
 			size_t length, loff_t *offset);
 extern int       tt_proc_release(struct inode *inode, struct file *file);
+extern int       tt_stream_open(struct inode *inode, struct file *file);
+extern ssize_t   tt_stream_read(struct file *file, char __user *user_buf,
+			size_t length, loff_t *offset);
+extern int       tt_stream_release(struct inode *inode, struct file *file);
 extern loff_t    tt_proc_lseek(struct file *file, loff_t offset, int whence);
 extern struct    tt_buffer *tt_buffers[];
 extern int       tt_buffer_size;
@@ -139,6 +286,49 @@ extern bool      tt_test_no_khz;
 extern int64_t    tt_debug_int64[100];
 extern void *     tt_debug_ptr[100];
 
+/**
+ * enum tt_category - Groups of tt_record calls on hot paths, which can be
+ * enabled and disabled at runtime with tt_set_categories. The value of
+ * each category is its bit position in the mask passed to
+ * tt_set_categories. Calls to tt_record that aren't made through
+ * tt_record_cat (or guarded by tt_enabled) are always enabled.
+ */
+enum tt_category {
+	/** @TT_GRO: homa_gro_receive and choosing SoftIRQ cores. */
+	TT_GRO                 = 0,
+
+	/** @TT_SOFTIRQ: Packet handling in homa_softirq. */
+	TT_SOFTIRQ             = 1,
+
+	/** @TT_GRANT: Receiving and sending grants, grantable list. */
+	TT_GRANT               = 2,
+
+	/** @TT_PACER: Transmission of data packets, including the pacer. */
+	TT_PACER               = 3,
+
+	/** @TT_COPY: Copying message data to and from user space. */
+	TT_COPY                = 4,
+	TT_NUM_CATEGORIES      = 5,
+};
+
+#define TT_ALL_CATEGORIES ((1 << TT_NUM_CATEGORIES) - 1)
+
+/**
+ * tt_enabled(): returns true if tt_record calls for a given category
+ * (enum tt_category) should be made. Uses static keys, so when a category
+ * is disabled the test costs only a nop.
+ * @cat:    Category of interest.
+ */
+#if !ENABLE_TIME_TRACE
+#define tt_enabled(cat) false
+#elif defined(__UNIT_TEST__)
+extern bool tt_category_enabled[];
+#define tt_enabled(cat) (tt_category_enabled[cat])
+#else
+extern struct static_key_false tt_category_keys[];
+#define tt_enabled(cat) static_branch_unlikely(&tt_category_keys[cat])
+#endif
+
 /**
  * tt_rdtsc(): return the current value of the fine-grain CPU cycle counter
  * (accessed via the RDTSC instruction).
@@ -205,6 +395,38 @@ static inline void tt_record(const char* format)
 #endif
 }
 
+/**
+ * tt_record_catN(): same as tt_recordN, except that the event is recorded
+ * only if category @cat (enum tt_category) is enabled; the arguments
+ * aren't evaluated otherwise.
+ * @cat:       Category for the event.
+ */
+#define tt_record_cat(cat, format)					\
+	do {								\
+		if (tt_enabled(cat))					\
+			tt_record(format);				\
+	} while (0)
+#define tt_record_cat1(cat, format, arg0)				\
+	do {								\
+		if (tt_enabled(cat))					\
+			tt_record1(format, arg0);			\
+	} while (0)
+#define tt_record_cat2(cat, format, arg0, arg1)				\
+	do {								\
+		if (tt_enabled(cat))					\
+			tt_record2(format, arg0, arg1);			\
+	} while (0)
+#define tt_record_cat3(cat, format, arg0, arg1, arg2)			\
+	do {								\
+		if (tt_enabled(cat))					\
+			tt_record3(format, arg0, arg1, arg2);		\
+	} while (0)
+#define tt_record_cat4(cat, format, arg0, arg1, arg2, arg3)		\
+	do {								\
+		if (tt_enabled(cat))					\
+			tt_record4(format, arg0, arg1, arg2, arg3);	\
+	} while (0)
+
 static inline __u32 tt_hi(void *p)
 {
 	return ((__u64) p) >> 32;
@@ -43,9 +43,11 @@
 
 #include <algorithm>
 #include <atomic>
+#include <condition_variable>
 #include <deque>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <random>
@@ -53,7 +55,9 @@
 #include <vector>
 
 #include "dist.h"
+#include "histogram.h"
 #include "homa.h"
+#include "homa_async.h"
 #include "homa_receiver.h"
 #include "test_utils.h"
 #include "time_trace.h"
@@ -71,11 +75,16 @@ int id = -1;
 double net_gbps = 0.0;
 bool tcp_trunc = true;
 bool one_way = false;
+int pattern_width = 10;
 int port_receivers = 1;
 int port_threads = 1;
 std::string protocol_string;
 const char *protocol = "homa";
 int server_ports = 1;
+int server_workers = 0;
+std::string service_dist_string;
+const char *service_dist = "fixed";
+double service_usecs = 0.0;
 bool verbose = false;
 std::string workload_string;
 const char *workload = "100";
@@ -86,6 +95,22 @@ int inet_family = AF_INET;
 int server_core = -1;
 int buf_bpages = 1000;
 
+/**
+ * enum Pattern - Values for the --pattern option: the way in which clients
+ * combine individual RPCs into larger operations.
+ * @INDEPENDENT:  Each RPC is independent (open loop).
+ * @FANOUT:       Each operation issues pattern_width RPCs in parallel to
+ *                different servers and completes when all have finished.
+ * @CHAIN:        Each operation issues pattern_width RPCs one after another,
+ *                each to a different server.
+ * @SHUFFLE:      Like FANOUT, except each operation sends one RPC to every
+ *                server.
+ */
+enum Pattern {INDEPENDENT, FANOUT, CHAIN, SHUFFLE};
+Pattern pattern = INDEPENDENT;
+std::string pattern_string;
+const char *pattern_name = "independent";
+
 /* Node ids for clients to send requests to. */
 std::vector<int> server_ids;
 
@@ -206,6 +231,38 @@ uint64_t last_lag = 0;
  */
 uint64_t last_backups = 0;
 
+/**
+ * @last_rtt_totals: merged RTT histogram counts across all clients (see
+ * client::rtt_hists) as of the last time we printed statistics.
+ */
+std::vector<uint64_t> last_rtt_totals;
+
+/**
+ * @last_net_totals: merged network delay histogram counts (see
+ * client::net_hist) across all clients as of the last time we printed
+ * statistics.
+ */
+std::vector<uint64_t> last_net_totals;
+
+/**
+ * @last_ops: total number of pattern operations (see client::op_hist)
+ * completed by this application as of the last time we printed statistics.
+ */
+uint64_t last_ops = 0;
+
+/**
+ * @last_op_totals: merged operation latency histogram counts across all
+ * clients as of the last time we printed statistics.
+ */
+std::vector<uint64_t> last_op_totals;
+
+/**
+ * @last_failed_ops: total number of pattern operations that included a
+ * failed RPC (see client::failed_ops), as of the last time we printed
+ * statistics.
+ */
+uint64_t last_failed_ops = 0;
+
 /**
  * @last_server_rpcs: total number of server RPCS handled by this
  * application as of the last time we printed statistics.
@@ -230,6 +287,50 @@ uint64_t last_server_bytes_out = 0;
  */
 std::vector<uint64_t> last_per_server_rpcs;
 
+/**
+ * @last_queue_totals: merged homa_server::queue_hist counts as of the
+ * last time we printed statistics.
+ */
+std::vector<uint64_t> last_queue_totals;
+
+/**
+ * @last_service_totals: merged homa_server::service_hist counts as of the
+ * last time we printed statistics.
+ */
+std::vector<uint64_t> last_service_totals;
+
+/**
+ * @last_steals: total homa_server::steals as of the last time we printed
+ * statistics.
+ */
+uint64_t last_steals = 0;
+
+/**
+ * interval_counts() - Given the current counts from a histogram (or a
+ * merged set of histograms) and the counts at the end of the previous
+ * interval, return the counts for just the current interval.
+ * @totals:   Current counts.
+ * @last:     Counts at the end of the previous interval; replaced with
+ *            @totals.
+ */
+std::vector<uint64_t> interval_counts(const std::vector<uint64_t> &totals,
+		std::vector<uint64_t> &last)
+{
+	std::vector<uint64_t> result = totals;
+
+	/* If clients or servers have been deleted since the last interval,
+	 * counts can go down; just use the new counts in that case.
+	 */
+	if (last.size() == totals.size()) {
+		for (size_t i = 0; i < totals.size(); i++) {
+			if (totals[i] >= last[i])
+				result[i] -= last[i];
+		}
+	}
+	last = totals;
+	return result;
+}
+
 /** @log_file: where log messages get printed. */
 FILE* log_file = stdout;
 
@@ -303,6 +404,12 @@ void print_help(const char *name)
 	printf("    --ports           Number of ports on which to send requests (one\n"
 		"                      sending thread per port (default: %d)\n",
 		client_ports);
+	printf("    --pattern         How RPCs are combined into operations: independent,\n"
+		"                      fanout, chain, or shuffle (Homa and TCP; default: %s)\n",
+			pattern_name);
+	printf("    --pattern-width   Number of RPCs in each fanout or chain operation\n"
+		"                      (shuffle always uses one RPC per server) (default: %d)\n",
+			pattern_width);
 	printf("    --port-receivers  Number of threads to listen for responses on each\n"
 		"                      port (default: %d). Zero means senders wait for their\n"
 		"                      own requests synchronously\n",
@@ -324,6 +431,8 @@ void print_help(const char *name)
 			workload);
 	printf("debug value value ... Set one or more int64_t values that may be used for\n"
 		"                      various debugging purposes\n\n");
+	printf("dump_hist file        Log RTT and slowdown percentiles for each message\n"
+		"                      length bucket to file\n\n");
 	printf("dump_times file       Log RTT times (and lengths) to file\n\n");
 	printf("exit                  Exit the application\n\n");
 	printf("log [options] [msg]   Configure logging as determined by the options. If\n"
@@ -342,14 +451,26 @@ void print_help(const char *name)
 	printf("    --iovec           Use homa_replyv instead of homa_reply\n");
 	printf("    --ipv6            Use IPv6 instead of IPv4\n");
 	printf("    --pin             All server threads will be restricted to run only\n"
-	        "                      on the givevn core\n");
+	        "                      on the givevn core (--workers threads are\n"
+	        "                      left unpinned)\n");
 	printf("    --protocol        Transport protocol to use: homa or tcp (default: %s)\n",
 			protocol);
 	printf("    --port-threads    Number of server threads to service each port\n"
 		"                      (Homa only, default: %d)\n",
 			port_threads);
-	printf("    --ports           Number of ports to listen on (default: %d)\n\n",
+	printf("    --ports           Number of ports to listen on (default: %d)\n",
 			server_ports);
+	printf("    --service-dist    Distribution of service times when --workers is\n"
+		"                      nonzero: fixed, exponential, or bimodal (95%% of\n"
+		"                      requests take half the mean, 5%% take 10.5x the\n"
+		"                      mean) (default: %s)\n", service_dist);
+	printf("    --service-time    Mean service time per request, in usecs (default: %.1f)\n",
+			service_usecs);
+	printf("    --workers         If nonzero, each port has a single receiving thread\n"
+		"                      that hands requests to this many worker threads,\n"
+		"                      which steal work from each other (Homa only;\n"
+		"                      --port-threads is ignored) (default: %d)\n\n",
+			server_workers);
 	printf("stop [options]        Stop existing client and/or server threads; each\n"
 		"                      option must be either 'clients' or 'servers'\n\n");
 	printf(" tt [options]         Manage time tracing:\n");
@@ -507,6 +628,15 @@ struct message_header {
 	 * from a given client machine.
 	 */
 	uint32_t msg_id;
+
+	/**
+	 * @server_time: in responses from servers with worker pools (see
+	 * the --workers option), the time in rdtsc cycles (truncated to
+	 * 32 bits) between when the request was received and when its
+	 * service completed, i.e. queueing delay plus service time. Zero
+	 * in requests and in responses from other servers.
+	 */
+	uint32_t server_time;
 };
 
 /**
@@ -800,7 +930,7 @@ int tcp_connection::read(bool loop,
 				}
 			}
 
-			if ((header.length > HOMA_MAX_MESSAGE_LENGTH)
+			if ((header.length > HOMA_MAX_UNSTREAMED_LENGTH)
 					|| (header.length < 0)) {
 				log(NORMAL, "ERROR: invalid message length %d "
 						"from %s, closing connection\n",
@@ -980,9 +1110,48 @@ std::vector<server_metrics *> metrics;
  */
 class homa_server {
 public:
-	homa_server(int port, int id, int inet_family, int num_threads);
+	/**
+	 * struct job - A request waiting to be serviced by a worker
+	 * thread.
+	 */
+	struct job {
+		/** @request: the incoming request. */
+		homa::async_message request;
+
+		/** @arrival: rdtsc time when the request was received. */
+		uint64_t arrival;
+	};
+
+	/**
+	 * struct job_queue - Requests assigned to a particular worker
+	 * thread. The owner takes jobs from the front, and other workers
+	 * steal from the back.
+	 */
+	struct job_queue {
+		/** @mutex: used to synchronize access to @jobs. */
+		std::atomic_bool mutex;
+
+		/**
+		 * @size: number of entries in @jobs; can be read without
+		 * acquiring @mutex.
+		 */
+		std::atomic<int> size;
+
+		/** @jobs: requests waiting for service. */
+		std::deque<job> jobs;
+
+		job_queue() : mutex(false), size(0), jobs() {}
+	};
+
+	homa_server(int port, int id, int inet_family, int num_threads,
+			int num_workers);
 	~homa_server();
+	void enqueue(homa::async_message request);
+	bool next_job(int index, job *j);
 	void server(int thread_id, server_metrics *metrics);
+	void wait_for_job();
+	uint64_t service_time(std::mt19937 &gen);
+	void worker(int index, server_metrics *metrics, uint32_t seed);
 
 	/** @id: Unique identifier for this server among all Homa servers. */
 	int id;
@@ -1004,6 +1173,51 @@ public:
 
 	/** @threads: One or more threads that service incoming requests*/
 	std::vector<std::thread> threads;
+
+	/**
+	 * @async: if there are worker threads, this object receives
+	 * incoming requests and passes them to enqueue; nullptr otherwise.
+	 */
+	std::unique_ptr<homa::async_socket> async;
+
+	/** @queues: one entry for each worker thread. */
+	std::vector<std::unique_ptr<job_queue>> queues;
+
+	/** @next_queue: used to assign requests to @queues round-robin. */
+	uint32_t next_queue;
+
+	/** @stop_workers: true means worker threads should exit. */
+	std::atomic<bool> stop_workers;
+
+	/**
+	 * @idle_mutex: used with @idle_cond to put workers to sleep when
+	 * all of the queues are empty.
+	 */
+	std::mutex idle_mutex;
+
+	/** @idle_cond: signaled when a request is enqueued for idle workers. */
+	std::condition_variable idle_cond;
+
+	/**
+	 * @idle_workers: number of workers waiting on @idle_cond (or about
+	 * to); enqueue only has to signal when this is nonzero.
+	 */
+	std::atomic<int> idle_workers;
+
+	/**
+	 * @queue_hist: time (in rdtsc cycles) that requests spent waiting
+	 * for a worker thread.
+	 */
+	histogram queue_hist;
+
+	/**
+	 * @service_hist: time (in rdtsc cycles) that workers spent servicing
+	 * requests, including sending responses.
+	 */
+	histogram service_hist;
+
+	/** @steals: number of requests serviced by a thief. */
+	std::atomic<uint64_t> steals;
 };
 
 /** @homa_servers: keeps track of all existing Homa servers. */
@@ -1017,16 +1231,28 @@ std::vector<homa_server *> homa_servers;
  *                for time traces.
  * @inet_family:  AF_INET or AF_INET6: determines whether we use IPv4 or IPv6.
  * @num_threads:  How many threads should collctively service requests on
- *                @port.
+ *                @port (ignored if @num_workers is nonzero).
+ * @num_workers:  If nonzero, requests are received by a single thread and
+ *                serviced by this many worker threads.
  */
 homa_server::homa_server(int port, int id, int inet_family,
-		int num_threads)
+		int num_threads, int num_workers)
 	: id(id)
         , fd(-1)
         , port(port)
         , buf_region(NULL)
         , buf_size(0)
         , threads()
+	, async()
+	, queues()
+	, next_queue(0)
+	, stop_workers(false)
+	, idle_mutex()
+	, idle_cond()
+	, idle_workers(0)
+	, queue_hist()
+	, service_hist()
+	, steals(0)
 {
 	sockaddr_in_union addr;
 	struct homa_set_buf_args arg;
@@ -1073,6 +1299,26 @@ homa_server::homa_server(int port, int id, int inet_family,
 		exit(1);
 	}
 
+	if (num_workers > 0) {
+		for (int i = 0; i < num_workers; i++)
+			queues.emplace_back(new job_queue);
+		for (int i = 0; i < num_workers; i++) {
+			server_metrics *thread_metrics = new server_metrics;
+			uint32_t seed = rand_gen();
+
+			metrics.push_back(thread_metrics);
+			threads.emplace_back([this, i, thread_metrics, seed] () {
+				worker(i, thread_metrics, seed);
+			});
+		}
+		async.reset(new homa::async_socket(fd, buf_region));
+		async->serve([this] (homa::async_socket &sock,
+				homa::async_message request) {
+			enqueue(std::move(request));
+		});
+		async->start();
+		return;
+	}
 	for (int i = 0; i < num_threads; i++) {
 		server_metrics *thread_metrics = new server_metrics;
 		metrics.push_back(thread_metrics);
@@ -1088,13 +1334,209 @@ homa_server::homa_server(int port, int id, int inet_family,
 homa_server::~homa_server()
 {
 	log(NORMAL, "Homa server on port %d shutting down\n", port);
+	if (async) {
+		/* Let workers finish their current requests before shutting
+		 * down the socket (otherwise their replies will fail).
+		 */
+		async->stop();
+		{
+			std::lock_guard<std::mutex> lock(idle_mutex);
+			stop_workers = true;
+		}
+		idle_cond.notify_all();
+		for (std::thread &thread: threads)
+			thread.join();
+		threads.clear();
+	}
 	shutdown(fd, SHUT_RDWR);
 	for (std::thread &thread: threads)
 		thread.join();
+
+	/* Requests must be released before their async_socket is deleted. */
+	queues.clear();
+	async.reset();
 	close(fd);
 	munmap(buf_region, buf_size);
 }
 
+/**
+ * homa_server::enqueue() - Invoked on the receiving thread (when there are
+ * worker threads) to assign an incoming request to a worker.
+ * @request:   The incoming request.
+ */
+void homa_server::enqueue(homa::async_message request)
+{
+	job_queue *queue = queues[next_queue % queues.size()].get();
+	uint64_t now = rdtsc();
+
+	next_queue++;
+	{
+		spin_lock lock(&queue->mutex);
+		queue->jobs.push_back(job{std::move(request), now});
+		queue->size++;
+	}
+
+	/* A worker that is going idle increments idle_workers before its
+	 * final check of the queues, so either it sees this request or we
+	 * see it and wake it.
+	 */
+	if (idle_workers > 0) {
+		std::lock_guard<std::mutex> lock(idle_mutex);
+		idle_cond.notify_one();
+	}
+}
+
+/**
+ * homa_server::wait_for_job() - Invoked by a worker thread when all of the
+ * queues are empty; sleeps until a request is enqueued or the workers are
+ * told to stop.
+ */
+void homa_server::wait_for_job()
+{
+	std::unique_lock<std::mutex> lock(idle_mutex);
+
+	idle_workers++;
+	idle_cond.wait(lock, [this] {
+		if (stop_workers)
+			return true;
+		for (std::unique_ptr<job_queue> &queue: queues) {
+			if (queue->size > 0)
+				return true;
+		}
+		return false;
+	});
+	idle_workers--;
+}
+
+/**
+ * homa_server::next_job() - Find a request for a worker thread to
+ * service: first try the worker's own queue, then steal from others.
+ * @index:   Index in @queues of the worker's queue.
+ * @j:       The request is moved to this location.
+ *
+ * Return:   True means a request was found; false means that all of
+ *           the queues are empty.
+ */
+bool homa_server::next_job(int index, job *j)
+{
+	for (size_t i = 0; i < queues.size(); i++) {
+		job_queue *queue = queues[(index + i) % queues.size()].get();
+		if (queue->size == 0)
+			continue;
+		spin_lock lock(&queue->mutex);
+		if (queue->jobs.empty())
+			continue;
+		if (i == 0) {
+			*j = std::move(queue->jobs.front());
+			queue->jobs.pop_front();
+		} else {
+			*j = std::move(queue->jobs.back());
+			queue->jobs.pop_back();
+			steals++;
+		}
+		queue->size--;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * homa_server::service_time() - Choose the service time for a request,
+ * based on the --service-dist and --service-time options.
+ * @gen:     Random number generator to use.
+ *
+ * Return:   Service time, in rdtsc cycles.
+ */
+uint64_t homa_server::service_time(std::mt19937 &gen)
+{
+	double mean = service_usecs*1e-06*get_cycles_per_sec();
+
+	if (mean <= 0)
+		return 0;
+	if (strcmp(service_dist, "exponential") == 0)
+		return std::exponential_distribution<double>(1.0/mean)(gen);
+	if (strcmp(service_dist, "bimodal") == 0) {
+		if (std::uniform_int_distribution<int>(0, 99)(gen) < 95)
+			return 0.5*mean;
+		return 10.5*mean;
+	}
+	return mean;
+}
+
+/**
+ * homa_server::worker() - Top-level method for worker threads (used when
+ * --workers is nonzero): services requests queued by enqueue. Each request
+ * takes a service time chosen by service_time, during which the worker
+ * spins; when there are no requests, the worker sleeps in wait_for_job.
+ * @index:    Index of this worker's queue in @queues.
+ * @metrics:  Used to record statistics for this thread.
+ * @seed:     Seed for this thread's random number generator.
+ */
+void homa_server::worker(int index, server_metrics *metrics, uint32_t seed)
+{
+	char thread_name[50];
+	struct iovec vecs[HOMA_MAX_BPAGES];
+	std::mt19937 gen(seed);
+	message_header *header;
+	uint64_t start, end;
+	int num_vecs;
+	job j;
+
+	snprintf(thread_name, sizeof(thread_name), "W%d.%d", id, index);
+	time_trace::thread_buffer thread_buffer(thread_name);
+
+	/* Workers aren't pinned with --pin: they would all compete with
+	 * each other (and the receiving thread) for one core.
+	 */
+	while (!stop_workers) {
+		if (!next_job(index, &j)) {
+			wait_for_job();
+			continue;
+		}
+		start = rdtsc();
+		queue_hist.record(start - j.arrival);
+		end = start + service_time(gen);
+		header = j.request->get<message_header>(0);
+		if (header == nullptr) {
+			log(NORMAL, "ERROR: Homa request contained %lu bytes; "
+					"need at least %lu\n",
+					j.request->length(), sizeof(*header));
+			j.request.reset();
+			continue;
+		}
+		tt("Servicing Homa request, cid 0x%08x, id %u, length %d",
+				header->cid, header->msg_id, header->length);
+		if ((header->freeze) && !time_trace::frozen) {
+			tt("Freezing timetrace because of request on "
+					"cid 0x%08x", header->cid);
+			log(NORMAL, "Freezing timetrace because of request on "
+					"cid 0x%08x", int(header->cid));
+			time_trace::freeze();
+			kfreeze();
+		}
+		if ((header->short_response) && (header->length > 100)) {
+			header->length = 100;
+		}
+		while (rdtsc() < end) {
+			/* Simulate the work for the request. */
+		}
+		header->server_time = rdtsc() - j.arrival;
+		num_vecs = j.request->iovecs(vecs, HOMA_MAX_BPAGES, 0,
+				header->length);
+		if (async->reply(j.request, vecs, num_vecs) < 0) {
+			log(NORMAL, "FATAL: homa_reply failed for server "
+					"port %d: %s\n",
+					port, strerror(errno));
+			exit(1);
+		}
+		metrics->requests++;
+		metrics->bytes_in += j.request->length();
+		metrics->bytes_out += header->length;
+		j.request.reset();
+		service_hist.record(rdtsc() - start);
+	}
+}
+
 /**
  * homa_server::server() - Handles incoming requests arriving on a Homa
  * socket. Normally invoked as top-level method in a thread.
@@ -1108,7 +1550,6 @@ void homa_server::server(int thread_id, server_metrics *metrics)
 	char thread_name[50];
 	homa::receiver receiver(fd, buf_region);
 	struct iovec vecs[HOMA_MAX_BPAGES];
-	int offset;
 
 	snprintf(thread_name, sizeof(thread_name), "S%d.%d", id, thread_id);
 	time_trace::thread_buffer thread_buffer(thread_name);
@@ -1148,17 +1589,8 @@ void homa_server::server(int thread_id, server_metrics *metrics)
 			header->length = 100;
 		}
 
-		num_vecs = 0;
-		offset = 0;
-		while (offset < header->length) {
-			size_t chunk_size = header->length - offset;
-			if (chunk_size > HOMA_BPAGE_SIZE)
-				chunk_size = HOMA_BPAGE_SIZE;
-			vecs[num_vecs].iov_len = chunk_size;
-			vecs[num_vecs].iov_base = receiver.get<char>(offset);
-			offset += chunk_size;
-			num_vecs++;
-		}
+		num_vecs = receiver.iovecs(vecs, HOMA_MAX_BPAGES, 0,
+				header->length);
 		result = homa_replyv(fd, vecs, num_vecs, receiver.src_addr(),
 				receiver.id());
 		if (result < 0) {
@@ -1545,13 +1977,17 @@ public:
 		/** @request_length: number of bytes in the request message. */
 		int request_length;
 
+		/** @server: index in server_addrs of the request's target. */
+		int server;
+
 		/**
 		 * @active: true means the request has been sent but
 		 * a response hasn't yet been received.
 		 */
 		bool active;
 
-		rinfo() : start_time(0), request_length(0), active(false) {}
+		rinfo() : start_time(0), request_length(0), server(0),
+				active(false) {}
 	};
 
 	client(int id);
@@ -1559,6 +1995,8 @@ public:
 	void check_completion(const char *protocol);
 	int get_rinfo();
 	void record(uint64_t end_time, message_header *header);
+	void record_failure(uint64_t end_time, uint64_t msg_id, int error);
+	void op_rpc_done(uint64_t end_time);
 	virtual void stop_sender(void) {}
 
 	/**
@@ -1601,6 +2039,81 @@ public:
 	/** @length_dist: Generator of message lengths. */
 	dist_point_gen length_dist;
 
+	/**
+	 * struct request_spec - Describes one request in @schedule.
+	 */
+	struct request_spec {
+		/**
+		 * @interval: time (in rdtsc cycles) between the start of
+		 * this request and the start of the next one.
+		 */
+		uint64_t interval;
+
+		/** @length: request length, in bytes. */
+		int length;
+
+		/** @server: index of the server in server_addrs. */
+		int server;
+	};
+
+	/**
+	 * @schedule: precomputed requests, generated from @server_dist,
+	 * @interval_dist, and @length_dist when the client is created so
+	 * that senders don't have to do any distribution math. Senders
+	 * cycle through it repeatedly.
+	 */
+	std::vector<request_spec> schedule;
+
+	/** @SCHEDULE_LENGTH: number of entries in @schedule. */
+	static constexpr size_t SCHEDULE_LENGTH = 250000;
+
+	/** @next_spec: index in @schedule of the next request to issue. */
+	size_t next_spec;
+
+	/**
+	 * next_request() - Return the next request from @schedule.
+	 */
+	const request_spec &next_request()
+	{
+		const request_spec &spec = schedule[next_spec];
+		next_spec++;
+		if (next_spec >= schedule.size())
+			next_spec = 0;
+		return spec;
+	}
+
+	int next_server(const request_spec &spec);
+	bool ready(uint64_t now, uint64_t next_start);
+
+	/**
+	 * @hist_lengths: upper bounds of the message-size buckets for
+	 * @rtt_hists, in increasing order (these are the lengths of the
+	 * points in @length_dist).
+	 */
+	std::vector<int> hist_lengths;
+
+	/**
+	 * @rtt_hists: one histogram of round-trip times (in rdtsc cycles) for
+	 * each bucket in @hist_lengths; covers all RPCs since the
+	 * client was created, in constant space.
+	 */
+	std::vector<histogram> rtt_hists;
+
+	/**
+	 * rtt_hist() - Return the entry in @rtt_hists for a given message
+	 * length.
+	 * @length:   Message length in bytes.
+	 */
+	histogram &rtt_hist(int length)
+	{
+		size_t i = std::lower_bound(hist_lengths.begin(),
+				hist_lengths.end(), length)
+				- hist_lengths.begin();
+		if (i >= rtt_hists.size())
+			i = rtt_hists.size() - 1;
+		return rtt_hists[i];
+	}
+
 	/**
 	 * @actual_lengths: a circular buffer that holds the actual payload
 	 * sizes used for the most recent RPCs.
@@ -1629,6 +2142,13 @@ public:
 	 */
 	std::atomic<uint64_t> *responses;
 
+	/**
+	 * @failures: total number of RPCs to each server that completed
+	 * with an error instead of a response (see record_failure).
+	 * Dynamically allocated, like @responses.
+	 */
+	std::atomic<uint64_t> *failures;
+
 	/**
 	 * @total_requests: total number of RPCs issued so far across all
 	 * servers.
@@ -1665,6 +2185,75 @@ public:
 	 * we just sent should have been sent @lag cycles ago).
 	 */
 	uint64_t lag;
+
+	/**
+	 * @op_width: number of RPCs in each operation, if @pattern isn't
+	 * INDEPENDENT.
+	 */
+	int op_width;
+
+	/**
+	 * @op_rpcs_left: number of RPCs in the current operation that
+	 * haven't yet been issued. Accessed only by the sending thread.
+	 */
+	int op_rpcs_left;
+
+	/**
+	 * @op_server: index in server_addrs of the server for the first
+	 * RPC of the current operation; RPC i goes to server
+	 * @op_server + i (modulo the number of servers).
+	 */
+	int op_server;
+
+	/**
+	 * @op_start: rdtsc time when the current operation started, or 0
+	 * if there is no current operation.
+	 */
+	uint64_t op_start;
+
+	/**
+	 * @op_outstanding: number of RPCs from the current operation that
+	 * have been issued but haven't yet completed.
+	 */
+	std::atomic<int> op_outstanding;
+
+	/**
+	 * @op_end: completion time of the most recent RPC to finish; once
+	 * @op_outstanding reaches zero this is the completion time of the
+	 * current operation (it is gated on the slowest RPC).
+	 */
+	std::atomic<uint64_t> op_end;
+
+	/**
+	 * @op_errors: number of RPCs from the current operation that have
+	 * failed (see record_failure).
+	 */
+	std::atomic<int> op_errors;
+
+	/**
+	 * @total_ops: total number of operations completed so far in
+	 * which every RPC succeeded.
+	 */
+	uint64_t total_ops;
+
+	/**
+	 * @failed_ops: total number of operations completed so far in
+	 * which at least one RPC failed; these aren't included in @op_hist.
+	 */
+	uint64_t failed_ops;
+
+	/**
+	 * @op_hist: latencies (in rdtsc cycles) of all of the operations
+	 * completed so far.
+	 */
+	histogram op_hist;
+
+	/**
+	 * @net_hist: for responses from servers that report the time spent
+	 * in the server (message_header::server_time), the RTT minus that
+	 * time (in rdtsc cycles): network and protocol delay.
+	 */
+	histogram net_hist;
 };
 
 /** @clients: keeps track of all existing clients. */
@@ -1682,7 +2271,11 @@ client::client(int id)
 	, receivers_running(0)
 	, cycles_per_second(get_cycles_per_sec())
 	, server_dist(0, static_cast<int>(num_servers - 1))
-	, length_dist(workload, HOMA_MAX_MESSAGE_LENGTH)
+	, length_dist(workload, HOMA_MAX_UNSTREAMED_LENGTH)
+	, schedule()
+	, next_spec(0)
+	, hist_lengths(length_dist.values())
+	, rtt_hists(hist_lengths.size())
 	, actual_lengths(NUM_CLIENT_STATS, 0)
 	, actual_rtts(NUM_CLIENT_STATS, 0)
 	, total_requests(0)
@@ -1691,15 +2284,40 @@ client::client(int id)
 	, response_bytes(0)
         , total_rtt(0)
         , lag(0)
+	, op_width(pattern_width)
+	, op_rpcs_left(0)
+	, op_server(0)
+	, op_start(0)
+	, op_outstanding(0)
+	, op_end(0)
+	, op_errors(0)
+	, total_ops(0)
+	, failed_ops(0)
+	, op_hist()
+	, net_hist()
 {
-	rinfos.resize(2*client_port_max + 5);
+	if (pattern == SHUFFLE)
+		op_width = num_servers;
+	if (pattern == INDEPENDENT)
+		rinfos.resize(2*client_port_max + 5);
+	else
+		rinfos.resize(2*op_width + 5);
 	double avg_length = length_dist.get_mean();
 	double rate = 1e09*(net_gbps/8.0)/(avg_length*client_ports);
 	interval_dist = std::exponential_distribution<double>(rate);
+	schedule.resize(SCHEDULE_LENGTH);
+	for (request_spec &spec: schedule) {
+		spec.server = server_dist(rand_gen);
+		spec.length = length_dist(rand_gen);
+		spec.interval = interval_dist(rand_gen)*cycles_per_second;
+	}
 	requests.resize(server_addrs.size());
 	responses = new std::atomic<uint64_t>[num_servers];
-	for (size_t i = 0; i < num_servers; i++)
+	failures = new std::atomic<uint64_t>[num_servers];
+	for (size_t i = 0; i < num_servers; i++) {
 		responses[i] = 0;
+		failures[i] = 0;
+	}
 	log(NORMAL, "Average message length %.1f KB, rate %.2f K/sec, "
 			"expected BW %.1f Gbps\n",
 			avg_length*1e-3, rate*1e-3, avg_length*rate*8e-9);
@@ -1712,6 +2330,7 @@ client::client(int id)
 client::~client()
 {
 	delete[] responses;
+	delete[] failures;
 }
 
 /**
@@ -1726,7 +2345,7 @@ void client::check_completion(const char *protocol)
 	int incomplete = total_requests - total_responses;
 	for (size_t i = 0; i < requests.size(); i++) {
 		char buffer[100];
-		int diff = requests[i] - responses[i];
+		int diff = requests[i] - responses[i] - failures[i];
 		if (diff == 0)
 			continue;
 		if (!server_info.empty())
@@ -1769,6 +2388,85 @@ int client::get_rinfo()
 	}
 }
 
+/**
+ * next_server() - Choose the server for the next request to issue.
+ * @spec:    The next request from @schedule.
+ *
+ * Return:   Index in server_addrs of the server to which the request
+ *           should be sent.
+ */
+int client::next_server(const request_spec &spec)
+{
+	int server;
+
+	if (pattern == INDEPENDENT)
+		return spec.server;
+	server = (op_server + op_width - op_rpcs_left) % num_servers;
+	op_rpcs_left--;
+	op_outstanding++;
+	return server;
+}
+
+/**
+ * ready() - Invoked by a sending thread to find out whether it's time to
+ * issue another request. If @pattern isn't INDEPENDENT, this also
+ * records completed operations and starts new ones.
+ * @now:         Current time, in rdtsc cycles.
+ * @next_start:  Time when the next request (or, if @pattern isn't
+ *               INDEPENDENT, the next operation) is scheduled to start.
+ *
+ * Return:       True means the sender should issue a request now (its
+ *               server must be selected with next_server).
+ */
+bool client::ready(uint64_t now, uint64_t next_start)
+{
+	if (pattern == INDEPENDENT)
+		return (now >= next_start) && ((total_requests
+				- total_responses) < client_port_max);
+
+	/* Operations are closed-loop: each sender has at most one
+	 * operation in progress, so client_port_max doesn't apply.
+	 */
+	if (op_outstanding != 0) {
+		if (pattern == CHAIN)
+			return false;
+		return op_rpcs_left > 0;
+	}
+	if (op_rpcs_left > 0)
+		return true;
+	if (op_start != 0) {
+		if (op_errors != 0) {
+			failed_ops++;
+			op_errors = 0;
+		} else {
+			op_hist.record(op_end - op_start);
+			total_ops++;
+		}
+		op_start = 0;
+	}
+	if (now < next_start)
+		return false;
+	op_start = now;
+	op_end = 0;
+	op_rpcs_left = op_width;
+	op_server = schedule[next_spec].server;
+	return true;
+}
+
+/**
+ * op_rpc_done() - Invoked when an RPC belonging to the current operation
+ * completes (successfully or not), when @pattern isn't INDEPENDENT.
+ * @end_time:   Completion time for the RPC, in rdtsc cycles.
+ */
+void client::op_rpc_done(uint64_t end_time)
+{
+	uint64_t end = op_end;
+
+	while ((end < end_time)
+			&& !op_end.compare_exchange_weak(end, end_time)) {}
+	op_outstanding--;
+}
+
 /**
  * record() - Records statistics about a particular request.
  * @end_time:   Completion time for the request, in rdtsc cycles.
@@ -1793,6 +2491,8 @@ void client::record(uint64_t end_time, message_header *header)
 	}
 	rtt = end_time - r->start_time;
 	r->active = false;
+	if (pattern != INDEPENDENT)
+		op_rpc_done(end_time);
 
 	int kcycles = rtt>>10;
 	tt("Received response, cid 0x%08x, id %u, length %d, "
@@ -1824,10 +2524,52 @@ void client::record(uint64_t end_time, message_header *header)
 	request_bytes += r->request_length;
 	response_bytes += header->length;
 	total_rtt += rtt;
+	rtt_hist(header->length).record(rtt);
+	if (header->server_time != 0) {
+		uint32_t net = static_cast<uint32_t>(rtt) - header->server_time;
+
+		net_hist.record(net);
+	}
 	actual_lengths[slot] = header->length;
 	actual_rtts[slot] = rtt;
 }
 
+/**
+ * record_failure() - Invoked instead of record when a request completes
+ * with an error rather than a response. If @pattern isn't INDEPENDENT,
+ * the RPC still counts toward completing its operation, which will be
+ * counted in @failed_ops rather than @op_hist.
+ * @end_time:   Time when the error was detected, in rdtsc cycles.
+ * @msg_id:     Index in rinfos for the request (message_header::msg_id).
+ * @error:      Errno value describing the failure.
+ */
+void client::record_failure(uint64_t end_time, uint64_t msg_id, int error)
+{
+	rinfo *r;
+
+	if (msg_id >= rinfos.size()) {
+		log(NORMAL, "ERROR: msg_id (%lu) exceed rinfos.size (%lu)\n",
+			msg_id, rinfos.size());
+		return;
+	}
+	r = &rinfos[msg_id];
+	if (!r->active) {
+		log(NORMAL, "ERROR: failure reported for inactive msg_id %lu\n",
+			msg_id);
+		return;
+	}
+	log(NORMAL, "ERROR: RPC to %s failed: %s\n",
+			print_address(&server_addrs[r->server]),
+			strerror(error));
+	r->active = false;
+	failures[r->server].fetch_add(1);
+	total_responses.fetch_add(1);
+	if (pattern != INDEPENDENT) {
+		op_errors++;
+		op_rpc_done(end_time);
+	}
+}
+
 /**
  * class homa_client - Holds information about a single Homa client,
  * which consists of one thread issuing requests and one or more threads
@@ -1868,7 +2610,7 @@ public:
 
 	/**
 	 * @sender_buffer: used by the sender to send requests, and also
-	 * by measure_unloaded; malloced, size HOMA_MAX_MESSAGE_LENGTH.
+	 * by measure_unloaded; malloced, size HOMA_MAX_UNSTREAMED_LENGTH.
 	 */
 	char *sender_buffer;
 
@@ -1895,7 +2637,7 @@ homa_client::homa_client(int id)
         , exit_sender(false)
         , exit_receivers(false)
         , sender_exited(false)
-        , sender_buffer(new char[HOMA_MAX_MESSAGE_LENGTH])
+        , sender_buffer(new char[HOMA_MAX_UNSTREAMED_LENGTH])
         , receiving_threads()
         , sending_thread()
 {
@@ -2006,6 +2748,14 @@ bool homa_client::wait_response(homa::receiver *receiver, uint64_t rpc_id)
 	if (length < 0) {
 		if (exit_receivers)
 			return false;
+		if ((pattern != INDEPENDENT) && (receiver->id() != 0)) {
+			/* A single RPC failed (e.g. it timed out); its
+			 * operation must still complete.
+			 */
+			record_failure(rdtsc(), receiver->completion_cookie(),
+					errno);
+			return true;
+		}
 		log(NORMAL, "FATAL: error in recvmsg: %s (id %lu, server %s)\n",
 				strerror(errno), rpc_id,
 				print_address(receiver->src_addr()));
@@ -2055,25 +2805,26 @@ void homa_client::sender()
 				return;
 			}
 			now = rdtsc();
-			if (now < next_start)
-				continue;
-			if ((total_requests - total_responses) < client_port_max)
+			if (ready(now, next_start))
 				break;
 		}
 
+		const request_spec &spec = next_request();
 		rinfos[slot].start_time = now;
-		server = server_dist(rand_gen);
-		header->length = length_dist(rand_gen);
-		if (header->length > HOMA_MAX_MESSAGE_LENGTH)
-			header->length = HOMA_MAX_MESSAGE_LENGTH;
+		server = next_server(spec);
+		header->length = spec.length;
+		if (header->length > HOMA_MAX_UNSTREAMED_LENGTH)
+			header->length = HOMA_MAX_UNSTREAMED_LENGTH;
 		if (header->length < sizeof32(*header))
 			header->length = sizeof32(*header);
 		rinfos[slot].request_length = header->length;
+		rinfos[slot].server = server;
 		header->cid = server_conns[server];
 		header->cid.client_port = id;
 		header->freeze = freeze[header->cid.server];
 		header->short_response = one_way;
 		header->msg_id = slot;
+		header->server_time = 0;
 		tt("sending request, cid 0x%08x, id %u, length %d",
 				header->cid, header->msg_id, header->length);
 		if (client_iovec && (header->length > 20)) {
@@ -2083,10 +2834,10 @@ void homa_client::sender()
 			vec[1].iov_base = sender_buffer + 20;
 			vec[1].iov_len = header->length - 20;
 			status = homa_sendv(fd, vec, 2,
-				&server_addrs[server], &rpc_id, 0);
+				&server_addrs[server], &rpc_id, slot);
 		} else
 			status = homa_send(fd, sender_buffer, header->length,
-		&server_addrs[server], &rpc_id, 0);
+		&server_addrs[server], &rpc_id, slot);
 		if (status < 0) {
 			log(NORMAL, "FATAL: error in homa_send: %s (request "
 					"length %d)\n", strerror(errno),
@@ -2095,8 +2846,9 @@ void homa_client::sender()
 		}
 		requests[server]++;
 		total_requests++;
-		lag = now - next_start;
-		next_start += interval_dist(rand_gen)*cycles_per_second;
+		if (now >= next_start)
+			lag = now - next_start;
+		next_start += spec.interval;
 		if (receivers_running == 0) {
 			/* There isn't a separate receiver thread; wait for
 			 * the response here. */
@@ -2127,7 +2879,7 @@ void homa_client::receiver(int receiver_id)
  * @server:      Identifier of server to use for the request.
  * @length:      Number of message bytes in the request.
  * @buffer:      Block of memory to use for request; must
- *               contain HOMA_MAX_MESSAGE_LENGTH bytes.
+ *               contain HOMA_MAX_UNSTREAMED_LENGTH bytes.
  * @receiver:    Use this to receive responses.
  *
  * Return:       Round-trip time to service the request, in rdtsc cycles.
@@ -2141,12 +2893,13 @@ uint64_t homa_client::measure_rtt(int server, int length, char *buffer,
 	int status;
 
 	header->length = length;
-	if (header->length > HOMA_MAX_MESSAGE_LENGTH)
-		header->length = HOMA_MAX_MESSAGE_LENGTH;
+	if (header->length > HOMA_MAX_UNSTREAMED_LENGTH)
+		header->length = HOMA_MAX_UNSTREAMED_LENGTH;
 	if (header->length < sizeof32(*header))
 		header->length = sizeof32(*header);
 	header->cid = server_conns[server];
 	header->cid.client_port = id;
+	header->server_time = 0;
 	start = rdtsc();
 	status = homa_send(fd, buffer, header->length,
 		&server_addrs[server], &rpc_id, 0);
@@ -2178,7 +2931,7 @@ uint64_t homa_client::measure_rtt(int server, int length, char *buffer,
  */
 void homa_client::measure_unloaded(int count)
 {
-	dist_point_gen length_dist(workload, HOMA_MAX_MESSAGE_LENGTH);
+	dist_point_gen length_dist(workload, HOMA_MAX_UNSTREAMED_LENGTH);
 	std::vector<int> dist_sizes = length_dist.values();
 	int server = 0;
 	int slot;
@@ -2206,6 +2959,7 @@ void homa_client::measure_unloaded(int count)
 			actual_lengths[slot] = length;
 			actual_rtts[slot] = measure_rtt(server, length,
 					sender_buffer, &receiver);
+			rtt_hist(length).record(actual_rtts[slot]);
 			slot++;
 			if (slot >= NUM_CLIENT_STATS) {
 				log(NORMAL, "WARNING: not enough space to "
@@ -2442,9 +3196,7 @@ void tcp_client::sender()
 				return;
 			}
 			now = rdtsc();
-			if ((now >= next_start)
-					&& ((total_requests - total_responses)
-					< client_port_max))
+			if (ready(now, next_start))
 				break;
 
 			/* Try to finish I/O on backed up connections. */
@@ -2458,15 +3210,17 @@ void tcp_client::sender()
 				next_blocked++;
 		}
 
+		const request_spec &spec = next_request();
 		rinfos[slot].start_time = now;
-		server = server_dist(rand_gen);
-		header.length = length_dist(rand_gen);
-		if ((header.length > HOMA_MAX_MESSAGE_LENGTH) && tcp_trunc)
-			header.length = HOMA_MAX_MESSAGE_LENGTH;
+		server = next_server(spec);
+		header.length = spec.length;
+		if ((header.length > HOMA_MAX_UNSTREAMED_LENGTH) && tcp_trunc)
+			header.length = HOMA_MAX_UNSTREAMED_LENGTH;
 		rinfos[slot].request_length = header.length;
 		header.cid = server_conns[server];
 		header.cid.client_port = id;
 		header.msg_id = slot;
+		header.server_time = 0;
 		header.freeze = freeze[header.cid.server];
 		header.short_response = one_way;
 		size_t old_pending = connections[server]->pending();
@@ -2496,8 +3250,9 @@ void tcp_client::sender()
 		if ((bytes_sent[server] - bytes_rcvd[server]) > 100000)
 			backups++;
 		bytes_sent[server] += header.length;
-		lag = now - next_start;
-		next_start += interval_dist(rand_gen)*cycles_per_second;
+		if (now >= next_start)
+			lag = now - next_start;
+		next_start += spec.interval;
 	}
 }
 
@@ -2587,6 +3342,9 @@ void server_stats(uint64_t now)
 	uint64_t server_rpcs = 0;
 	uint64_t server_bytes_in = 0;
 	uint64_t server_bytes_out = 0;
+	uint64_t steals = 0;
+	std::vector<uint64_t> queue_totals, interval_queue;
+	std::vector<uint64_t> service_totals, interval_service;
 	details[0] = 0;
 	for (uint32_t i = 0; i < metrics.size(); i++) {
 		server_metrics *server = metrics[i];
@@ -2603,6 +3361,16 @@ void server_stats(uint64_t now)
 					metrics.size());
 		last_per_server_rpcs[i] = server->requests;
 	}
+	for (homa_server *server: homa_servers) {
+		if (!server->async)
+			continue;
+		server->queue_hist.add_to(queue_totals);
+		server->service_hist.add_to(service_totals);
+		steals += server->steals;
+	}
+	interval_queue = interval_counts(queue_totals, last_queue_totals);
+	interval_service = interval_counts(service_totals,
+			last_service_totals);
 	if ((last_stats_time != 0) && (server_bytes_in != last_server_bytes_in)) {
 		double elapsed = to_seconds(now - last_stats_time);
 		double rpcs = (double) (server_rpcs - last_server_rpcs);
@@ -2617,7 +3385,23 @@ void server_stats(uint64_t now)
 				8.0*out_delta/(1e09*elapsed),
 				in_delta/rpcs);
 		log(NORMAL, "RPCs per server: %s\n", details);
+		if (!queue_totals.empty())
+			log(NORMAL, "Server queueing (us) P50 %.2f P99 %.2f "
+					"P99.9 %.2f, service (us) P50 %.2f "
+					"P99 %.2f, stolen %.1f%%\n",
+					to_seconds(histogram::percentile(
+					interval_queue, 0.5))*1e06,
+					to_seconds(histogram::percentile(
+					interval_queue, 0.99))*1e06,
+					to_seconds(histogram::percentile(
+					interval_queue, 0.999))*1e06,
+					to_seconds(histogram::percentile(
+					interval_service, 0.5))*1e06,
+					to_seconds(histogram::percentile(
+					interval_service, 0.99))*1e06,
+					100.0*(steals - last_steals)/rpcs);
 	}
+	last_steals = steals;
 	last_server_rpcs = server_rpcs;
 	last_server_bytes_in = server_bytes_in;
 	last_server_bytes_out = server_bytes_out;
@@ -2631,24 +3415,22 @@ void server_stats(uint64_t now)
  */
 void client_stats(uint64_t now)
 {
-#define CDF_VALUES 100000
 	uint64_t client_rpcs = 0;
 	uint64_t request_bytes = 0;
 	uint64_t response_bytes = 0;
 	uint64_t total_rtt = 0;
 	uint64_t lag = 0;
 	uint64_t outstanding_rpcs = 0;
-	uint64_t cdf_times[CDF_VALUES];
 	uint64_t backups = 0;
-	int times_per_client;
-	int cdf_index = 0;
+	uint64_t ops = 0;
+	uint64_t failed_ops = 0;
+	std::vector<uint64_t> rtt_totals, interval_rtts;
+	std::vector<uint64_t> op_totals, interval_ops;
+	std::vector<uint64_t> net_totals, interval_net;
 
 	if (clients.size() == 0)
 		return;
 
-	times_per_client = CDF_VALUES/clients.size();
-	if (times_per_client > NUM_CLIENT_STATS)
-		times_per_client = NUM_CLIENT_STATS;
 	for (client *client: clients) {
 		for (size_t i = 0; i < client->num_servers; i++)
 			client_rpcs += client->responses[i];
@@ -2658,25 +3440,21 @@ void client_stats(uint64_t now)
 		lag += client->lag;
 		outstanding_rpcs += client->total_requests
 			- client->total_responses;
-		for (int i = 1; i <= times_per_client; i++) {
-			/* Collect the most recent RTTs from the client for
-			 * computing a CDF.
-			 */
-			int src = (client->total_responses - i)
-					% NUM_CLIENT_STATS;
-			if (client->actual_rtts[src] == 0) {
-				/* Client hasn't accumulated times_per_client
-				 * entries yet; just use what it has. */
-				break;
-			}
-			cdf_times[cdf_index] = client->actual_rtts[src];
-			cdf_index++;
-		}
+		for (histogram &hist: client->rtt_hists)
+			hist.add_to(rtt_totals);
+		ops += client->total_ops;
+		failed_ops += client->failed_ops;
+		client->op_hist.add_to(op_totals);
+		client->net_hist.add_to(net_totals);
 		tcp_client *tclient = dynamic_cast<tcp_client *>(client);
 		if (tclient)
 			backups += tclient->backups;
 	}
-	std::sort(cdf_times, cdf_times + cdf_index);
+
+	/* Percentiles cover just the RPCs completed since the last report. */
+	interval_rtts = interval_counts(rtt_totals, last_rtt_totals);
+	interval_ops = interval_counts(op_totals, last_op_totals);
+	interval_net = interval_counts(net_totals, last_net_totals);
 	if ((last_stats_time != 0) && ((request_bytes != last_client_bytes_out)
 				|| (outstanding_rpcs != 0))){
 		double elapsed = to_seconds(now - last_stats_time);
@@ -2691,10 +3469,37 @@ void client_stats(uint64_t now)
 				rpcs/(1000.0*elapsed),
 				8.0*delta_out/(1e09*elapsed),
 				8.0*delta_in/(1e09*elapsed),
-				to_seconds(cdf_times[cdf_index/2])*1e06,
-				to_seconds(cdf_times[99*cdf_index/100])*1e06,
-				to_seconds(cdf_times[999*cdf_index/1000])*1e06,
+				to_seconds(histogram::percentile(interval_rtts,
+				0.5))*1e06,
+				to_seconds(histogram::percentile(interval_rtts,
+				0.99))*1e06,
+				to_seconds(histogram::percentile(interval_rtts,
+				0.999))*1e06,
 			        delta_out/rpcs);
+		if ((pattern != INDEPENDENT) && (ops > last_ops))
+			log(NORMAL, "Patterns: %s width %d, %.2f Kops/sec, "
+					"latency (us) P50 %.2f P99 %.2f "
+					"P99.9 %.2f\n",
+					pattern_name, clients[0]->op_width,
+					(ops - last_ops)/(1000.0*elapsed),
+					to_seconds(histogram::percentile(
+					interval_ops, 0.5))*1e06,
+					to_seconds(histogram::percentile(
+					interval_ops, 0.99))*1e06,
+					to_seconds(histogram::percentile(
+					interval_ops, 0.999))*1e06);
+		if (failed_ops > last_failed_ops)
+			log(NORMAL, "Pattern operations with failed RPCs: "
+					"%lu\n", failed_ops - last_failed_ops);
+		if (histogram::percentile(interval_net, 1.0) != 0)
+			log(NORMAL, "Network delay (RTT minus server time, us) "
+					"P50 %.2f P99 %.2f P99.9 %.2f\n",
+					to_seconds(histogram::percentile(
+					interval_net, 0.5))*1e06,
+					to_seconds(histogram::percentile(
+					interval_net, 0.99))*1e06,
+					to_seconds(histogram::percentile(
+					interval_net, 0.999))*1e06);
 		double lag_fraction;
 		if (lag > last_lag)
 			lag_fraction = (to_seconds(lag - last_lag)/elapsed)
@@ -2716,6 +3521,8 @@ void client_stats(uint64_t now)
 	if (outstanding_rpcs != 0)
 		log(NORMAL, "Outstanding client RPCs: %lu\n", outstanding_rpcs);
 	last_client_rpcs = client_rpcs;
+	last_ops = ops;
+	last_failed_ops = failed_ops;
 	last_client_bytes_out = request_bytes;
 	last_client_bytes_in = response_bytes;
 	last_total_rtt = total_rtt;
@@ -2763,6 +3570,9 @@ int client_cmd(std::vector<string> &words)
 	protocol = "homa";
 	tcp_trunc = true;
 	one_way = false;
+	pattern = INDEPENDENT;
+	pattern_name = "independent";
+	pattern_width = 10;
 	unloaded = 0;
 	workload = "100";
 	for (unsigned i = 1; i < words.size(); i++) {
@@ -2801,6 +3611,34 @@ int client_cmd(std::vector<string> &words)
 			tcp_trunc = false;
 		} else if (strcmp(option, "--one-way") == 0) {
 			one_way = true;
+		} else if (strcmp(option, "--pattern") == 0) {
+			if ((i + 1) >= words.size()) {
+				printf("No value provided for %s\n",
+						option);
+				return 0;
+			}
+			pattern_string = words[i+1];
+			pattern_name = pattern_string.c_str();
+			if (strcmp(pattern_name, "independent") == 0)
+				pattern = INDEPENDENT;
+			else if (strcmp(pattern_name, "fanout") == 0)
+				pattern = FANOUT;
+			else if (strcmp(pattern_name, "chain") == 0)
+				pattern = CHAIN;
+			else if (strcmp(pattern_name, "shuffle") == 0)
+				pattern = SHUFFLE;
+			else {
+				printf("Unknown pattern '%s'; must be "
+						"independent, fanout, chain, "
+						"or shuffle\n", pattern_name);
+				return 0;
+			}
+			i++;
+		} else if (strcmp(option, "--pattern-width") == 0) {
+			if (!parse(words, i+1, &pattern_width, option,
+					"integer"))
+				return 0;
+			i++;
 		} else if (strcmp(option, "--ports") == 0) {
 			if (!parse(words, i+1, &client_ports, option, "integer"))
 				return 0;
@@ -2878,6 +3716,19 @@ int client_cmd(std::vector<string> &words)
 			server_ids.push_back(first_server + i);
 	}
 
+	if (pattern != INDEPENDENT) {
+		if (port_receivers < 1) {
+			printf("--pattern %s requires --port-receivers > 0\n",
+					pattern_name);
+			return 0;
+		}
+		if (pattern_width < 1) {
+			printf("Bad --pattern-width %d: must be at least 1\n",
+					pattern_width);
+			return 0;
+		}
+	}
+
 	init_server_addrs();
 	client_port_max = client_max/client_ports;
 	if (client_port_max < 1)
@@ -2918,6 +3769,88 @@ int debug_cmd(std::vector<string> &words)
 	return 1;
 }
 
+/**
+ * dump_hist_cmd() - Parse the arguments for a "dump_hist" command and
+ * execute it.
+ * @words:  Command arguments (including the command name as @words[0]).
+ *
+ * Return:  Nonzero means success, zero means there was an error.
+ */
+int dump_hist_cmd(std::vector<string> &words)
+{
+	FILE *f;
+	time_t now;
+	char time_buffer[100];
+	std::vector<int> lengths;
+	std::vector<uint64_t> totals;
+
+	if (words.size() != 2) {
+		printf("Wrong # args; must be 'dump_hist file'\n");
+		return 0;
+	}
+	if (clients.size() == 0) {
+		printf("No clients; nothing to dump\n");
+		return 0;
+	}
+	f = fopen(words[1].c_str(), "w");
+	if (f == NULL) {
+		printf("Couldn't open file %s: %s\n", words[1].c_str(),
+				strerror(errno));
+		return 0;
+	}
+
+	time(&now);
+	strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S",
+			localtime(&now));
+	fprintf(f, "# RTT histograms merged across all clients by cp_node at "
+			"%s\n", time_buffer);
+	fprintf(f, "# --protocol %s, --workload %s, --gpbs %.1f --threads %d,\n",
+			protocol, workload, net_gbps, client_ports);
+	fprintf(f, "# --server-nodes %lu --server-ports %d, --client-max %d\n",
+			server_ids.size(), server_ports, client_max);
+	fprintf(f, "# Length: largest message length in the bucket\n");
+	fprintf(f, "# Count:  number of RPCs in the bucket\n");
+	fprintf(f, "# Min, P50, P99, P99.9: RTTs in usec\n");
+	fprintf(f, "# S50, S99, S99.9: slowdowns (the corresponding RTT "
+			"divided by Min; 0 if Min is 0)\n");
+	fprintf(f, "# Length    Count      Min      P50      P99    P99.9"
+			"     S50     S99   S99.9\n");
+
+	/* All clients use the same workload, hence the same buckets. */
+	lengths = clients[0]->hist_lengths;
+	for (size_t i = 0; i < lengths.size(); i++) {
+		uint64_t count = 0, min;
+		double p50, p99, p999, scale;
+
+		totals.assign(histogram::NUM_BUCKETS, 0);
+		for (client *client: clients) {
+			if (i < client->rtt_hists.size())
+				client->rtt_hists[i].add_to(totals);
+		}
+		for (uint64_t c: totals)
+			count += c;
+		if (count == 0)
+			continue;
+		min = histogram::percentile(totals, 0.0);
+		p50 = histogram::percentile(totals, 0.5);
+		p99 = histogram::percentile(totals, 0.99);
+		p999 = histogram::percentile(totals, 0.999);
+
+		/* A Min in the lowest bucket can be 0, which leaves no
+		 * baseline for slowdowns: report them as 0 instead of
+		 * dividing by zero.
+		 */
+		scale = (min == 0) ? 0.0 : 1.0/min;
+		fprintf(f, "%8d %8lu %8.2f %8.2f %8.2f %8.2f %7.2f %7.2f %7.2f\n",
+				lengths[i], count, 1e06*to_seconds(min),
+				1e06*to_seconds(p50), 1e06*to_seconds(p99),
+				1e06*to_seconds(p999), p50*scale, p99*scale,
+				p999*scale);
+	}
+	fclose(f);
+	return 1;
+}
+
 /**
  * dump_times_cmd() - Parse the arguments for a "dump_times" command and
  * execute it.
@@ -2997,7 +3930,7 @@ int info_cmd(std::vector<string> &words)
 				words[2].c_str());
 		return 0;
 	}
-	dist_point_gen length_dist(workload, HOMA_MAX_MESSAGE_LENGTH);
+	dist_point_gen length_dist(workload, HOMA_MAX_UNSTREAMED_LENGTH);
 	printf("Workload %s: mean %.1f bytes, overhead %.3f\n",
 			workload, length_dist.get_mean(),
 			length_dist.dist_overhead(mtu));
@@ -3093,6 +4026,9 @@ int server_cmd(std::vector<string> &words)
 	server_core = -1;
 	server_ports = 1;
 	server_iovec = false;
+	server_workers = 0;
+	service_dist = "fixed";
+	service_usecs = 0.0;
 
 	for (unsigned i = 1; i < words.size(); i++) {
 		const char *option = words[i].c_str();
@@ -3130,16 +4066,47 @@ int server_cmd(std::vector<string> &words)
 			protocol_string = words[i+1];
 			protocol = protocol_string.c_str();
 			i++;
+		} else if (strcmp(option, "--service-dist") == 0) {
+			if ((i + 1) >= words.size()) {
+				printf("No value provided for %s\n",
+						option);
+				return 0;
+			}
+			service_dist_string = words[i+1];
+			service_dist = service_dist_string.c_str();
+			if ((strcmp(service_dist, "fixed") != 0)
+					&& (strcmp(service_dist, "exponential") != 0)
+					&& (strcmp(service_dist, "bimodal") != 0)) {
+				printf("Unknown service distribution '%s'; "
+						"must be fixed, exponential, "
+						"or bimodal\n", service_dist);
+				return 0;
+			}
+			i++;
+		} else if (strcmp(option, "--service-time") == 0) {
+			if (!parse(words, i+1, &service_usecs, option, "float"))
+				return 0;
+			i++;
+		} else if (strcmp(option, "--workers") == 0) {
+			if (!parse(words, i+1, &server_workers, option,
+					"integer"))
+				return 0;
+			i++;
 		} else {
 			printf("Unknown option '%s'\n", option);
 			return 0;
 		}
 	}
 
+	if ((server_workers > 0) && (strcmp(protocol, "homa") != 0)) {
+		printf("--workers is only supported for Homa\n");
+		return 0;
+	}
 	if (strcmp(protocol, "homa") == 0) {
 		for (int i = 0; i < server_ports; i++) {
 			homa_server *server = new homa_server(first_port + i,
-					i, inet_family, port_threads);
+					i, inet_family, port_threads,
+					server_workers);
 			homa_servers.push_back(server);
 		}
 	} else {
@@ -3149,7 +4116,7 @@ int server_cmd(std::vector<string> &words)
 			tcp_servers.push_back(server);
 		}
 	}
-	last_per_server_rpcs.resize(server_ports*port_threads, 0);
+	last_per_server_rpcs.resize(metrics.size(), 0);
 	last_stats_time = 0;
 	return 1;
 }
@@ -3250,6 +4217,8 @@ int exec_words(std::vector<string> &words)
 		return client_cmd(words);
 	} else if (words[0].compare("debug") == 0) {
 		return debug_cmd(words);
+	} else if (words[0].compare("dump_hist") == 0) {
+		return dump_hist_cmd(words);
 	} else if (words[0].compare("dump_times") == 0) {
 		return dump_times_cmd(words);
 	} else if (words[0].compare("info") == 0) {
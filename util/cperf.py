@@ -86,11 +86,16 @@ default_defaults = {
     'log_dir':             'logs/' + time.strftime('%Y%m%d%H%M%S'),
     'mtu':                 0,
     'no_trunc':            '',
+    'pattern':             'independent',
+    'pattern_width':       10,
     'protocol':            'homa',
     'port_receivers':      3,
     'port_threads':        3,
     'seconds':             30,
     'server_ports':        3,
+    'server_workers':      0,
+    'service_dist':        'fixed',
+    'service_time':        0.0,
     'tcp_client_ports':    4,
     'tcp_port_receivers':  1,
     'tcp_server_ports':    8,
@@ -101,6 +106,11 @@ default_defaults = {
     'workload':            ''
 }
 
+# Keys are experiment names, and each value is a dictionary of summary
+# statistics gathered from node logs by scan_logs: client_gbps, client_kops,
+# server_gbps, and server_kops (each an average per node).
+experiment_stats = {}
+
 # Keys are experiment names, and each value is the digested data for that
 # experiment.  The digest is itself a dictionary containing some or all of
 # the following keys:
@@ -256,6 +266,16 @@ def get_parser(description, usage, defaults = {}):
             help='Compute slowdowns using the approach of the Homa ATC '
             'paper (default: use 15 usec RTT and 100%% link throughput as '
             'reference)')
+    parser.add_argument('--pattern', dest='pattern',
+            choices=['independent', 'fanout', 'chain', 'shuffle'],
+            default=defaults['pattern'],
+            help='How clients combine RPCs into operations: independent '
+            'RPCs, fan-out to several servers, chains of sequential RPCs, or '
+            'shuffles to all servers (default: %s)' % (defaults['pattern']))
+    parser.add_argument('--pattern-width', type=int, dest='pattern_width',
+            metavar='count', default=defaults['pattern_width'],
+            help='Number of RPCs in each fanout or chain operation '
+            '(default: %d)' % (defaults['pattern_width']))
     parser.add_argument('--plot-only', dest='plot_only', action='store_true',
             help='Don\'t run experiments; generate plot(s) with existing data')
     parser.add_argument('--port-receivers', type=int, dest='port_receivers',
@@ -278,6 +298,21 @@ def get_parser(description, usage, defaults = {}):
             metavar='count', default=defaults['server_ports'],
             help='Number of ports on which each server should listen '
             '(default: %d)'% (defaults['server_ports']))
+    parser.add_argument('--server-workers', type=int, dest='server_workers',
+            metavar='count', default=defaults['server_workers'],
+            help='If nonzero, each Homa server port has one receiving thread '
+            'feeding this many worker threads, and --port-threads is ignored '
+            '(default: %d)'% (defaults['server_workers']))
+    parser.add_argument('--service-dist', dest='service_dist',
+            choices=['fixed', 'exponential', 'bimodal'],
+            default=defaults['service_dist'],
+            help='Distribution of request service times for servers with '
+            'workers (default: %s)' % (defaults['service_dist']))
+    parser.add_argument('--service-time', type=float, dest='service_time',
+            metavar='usecs', default=defaults['service_time'],
+            help='Mean service time for requests, in microseconds, for '
+            'servers with workers (default: %.1f)'
+            % (defaults['service_time']))
     parser.add_argument('--set-ids', dest='set_ids', type=boolean,
             default=True, metavar="T/F", help="Boolean value: if true, the "
             "next_id sysctl parameter will be set on each node in order to "
@@ -614,6 +649,7 @@ def start_servers(ids, options):
                  server_ports
                  port_threads
                  protocol
+             and optionally server_workers, service_dist, and service_time
     """
     global server_nodes
     log("Starting %s servers on nodes %s" % (options.protocol, ids))
@@ -622,9 +658,14 @@ def start_servers(ids, options):
         server_nodes = []
     start_nodes(ids, options)
     if options.protocol == "homa":
-        do_cmd("server --ports %d --port-threads %d --protocol %s %s" % (
+        command = "server --ports %d --port-threads %d --protocol %s %s" % (
                 options.server_ports, options.port_threads,
-                options.protocol, options.ipv6), ids)
+                options.protocol, options.ipv6)
+        if ("server_workers" in options) and (options.server_workers > 0):
+            command += " --workers %d --service-dist %s --service-time %.2f" % (
+                    options.server_workers, options.service_dist,
+                    options.service_time)
+        do_cmd(command, ids)
     else:
         do_cmd("server --ports %d --port-threads %d --protocol %s %s" % (
                 options.tcp_server_ports, options.tcp_port_threads,
@@ -644,6 +685,8 @@ def run_experiment(name, clients, options):
                   client_max
                   client_ports
                   gbps
+                  pattern
+                  pattern_width
                   port_receivers
                   protocol
                   seconds
@@ -676,6 +719,9 @@ def run_experiment(name, clients, options):
                     options.ipv6)
             if "unloaded" in options:
                 command += " --unloaded %d" % (options.unloaded)
+            elif options.pattern != "independent":
+                command += " --pattern %s --pattern-width %d" % (
+                        options.pattern, options.pattern_width)
         else:
             if "no_trunc" in options:
                 trunc = '--no-trunc'
@@ -695,6 +741,9 @@ def run_experiment(name, clients, options):
                     options.protocol,
                     id,
                     options.ipv6)
+            if options.pattern != "independent":
+                command += " --pattern %s --pattern-width %d" % (
+                        options.pattern, options.pattern_width)
         active_nodes[id].stdin.write(command + "\n")
         try:
             active_nodes[id].stdin.flush()
@@ -759,7 +808,9 @@ def scan_log(file, node, experiments):
                     name, where
                   * Each value is dictionary indexed by node name, where
                   * Each value is a dictionary with keys such as client_kops,
-                    client_gbps, client_latency, server_kops, or server_Mbps,
+                    client_gbps, client_latency, pattern_latency (a list
+                    of [P50, P99, P99.9] operation latencies), server_kops,
+                    or server_Mbps,
                     each of which is
                   * A list of values measured at regular intervals for that node
     """
@@ -821,6 +872,15 @@ def scan_log(file, node, experiments):
                 node_data["server_gbps"].append(gbps)
                 continue
 
+            match = re.match('.*Patterns: .*latency \\(us\\) P50 ([0-9.]+) '
+                    'P99 ([0-9.]+) P99.9 ([0-9.]+)', line)
+            if match:
+                if not "pattern_latency" in node_data:
+                    node_data["pattern_latency"] = []
+                node_data["pattern_latency"].append([float(match.group(1)),
+                        float(match.group(2)), float(match.group(3))])
+                continue
+
             match = re.match('.*Outstanding client RPCs: ([0-9.]+)', line)
             if match:
                 if not "outstanding_rpcs" in node_data:
@@ -851,7 +911,7 @@ def scan_logs():
     Read all of the node-specific log files produced by a run, and
     extract useful information.
     """
-    global log_dir, verbose
+    global log_dir, verbose, experiment_stats
 
     # This value is described in the header doc for scan_log.
     experiments = {}
@@ -912,6 +972,13 @@ def scan_logs():
             if not key in totals:
                 log("%s missing in node log files" % (key))
                 totals[key] = 0
+        stats = {}
+        for type in ['client', 'server']:
+            for units in ['gbps', 'kops']:
+                key = type + "_" + units
+                stats[key] = totals[key]/len(nodes[type]) \
+                        if len(nodes[type]) > 0 else 0.0
+        experiment_stats[name] = stats
 
         log("\nClients for %s experiment: %d nodes, %.2f Gbps, %.1f Kops/sec "
                 "(avg per node)" % (name, len(nodes["client"]),
@@ -934,6 +1001,17 @@ def scan_logs():
                         ", ".join(map(lambda x: "%d" % (x), counts))))
                 break
 
+        latencies = []
+        for node in sorted(exp.keys()):
+            if "pattern_latency" in exp[node]:
+                latencies.extend(exp[node]["pattern_latency"])
+        if len(latencies) > 0:
+            log("Operation latency for %s experiment (usec, avg over "
+                    "intervals): P50 %.1f, P99 %.1f, P99.9 %.1f" % (name,
+                    sum(l[0] for l in latencies)/len(latencies),
+                    sum(l[1] for l in latencies)/len(latencies),
+                    sum(l[2] for l in latencies)/len(latencies)))
+
         backups = []
         for node in sorted(exp.keys()):
             if "backups" in exp[node]:
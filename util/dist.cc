@@ -52,6 +52,8 @@ dist_point_gen::dist_point_gen(const char* dist, size_t max_length,
 		double min_bucket_frac, double max_size_ratio)
 	: dist_points()
 	, dist_mean(0)
+	, alias_prob()
+	, alias_index()
 	, uniform_dist(0.0, 1.0)
 {
 	char *end;
@@ -63,6 +65,7 @@ dist_point_gen::dist_point_gen(const char* dist, size_t max_length,
 	if ((length != 0) && (*end == 0)) {
 		dist_points.emplace_back(length, 1.0);
 		dist_mean = length;
+		init_alias();
 		return;
 	}
 
@@ -111,9 +114,54 @@ dist_point_gen::dist_point_gen(const char* dist, size_t max_length,
 		dist_mean += point.length * (point.fraction - prev_fraction);
 		prev_fraction = point.fraction;
 	}
+	init_alias();
 	return;
 }
 
+/**
+ * init_alias() - Fill in @alias_prob and @alias_index from @dist_points
+ * (Vose's version of the alias method).
+ */
+void dist_point_gen::init_alias()
+{
+	size_t n = dist_points.size();
+	std::vector<double> scaled(n);
+	std::vector<int> small, large;
+	double prev_fraction = 0.0;
+
+	alias_prob.assign(n, 1.0);
+	alias_index.resize(n);
+	for (size_t i = 0; i < n; i++) {
+		alias_index[i] = i;
+		scaled[i] = (dist_points[i].fraction - prev_fraction) * n;
+		prev_fraction = dist_points[i].fraction;
+		if (scaled[i] < 1.0)
+			small.push_back(i);
+		else
+			large.push_back(i);
+	}
+
+	/* Each small entry is topped up with probability from a large one. */
+	while (!small.empty() && !large.empty()) {
+		int s = small.back();
+		int l = large.back();
+		small.pop_back();
+		alias_prob[s] = scaled[s];
+		alias_index[s] = l;
+		scaled[l] -= 1.0 - scaled[s];
+		if (scaled[l] < 1.0) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+
+	/* Anything left over is 1.0 except for rounding error. */
+	for (int i: small)
+		alias_prob[i] = 1.0;
+	for (int i: large)
+		alias_prob[i] = 1.0;
+}
+
 /**
  * operator() - Generate a value sampled randomly from this workload
  * distribution.
@@ -123,14 +171,17 @@ dist_point_gen::dist_point_gen(const char* dist, size_t max_length,
  */
 int dist_point_gen::operator()(std::mt19937 &rand_gen)
 {
-	double cdf_fraction = uniform_dist(rand_gen);
-	for (cdf_point &point: dist_points) {
-		if (point.fraction >= cdf_fraction)
-			return point.length;
-	}
-	fprintf(stderr, "ERROR: dist_point_gen::operator() failed to return"
-			"a value\n");
-	abort();
+	/* A single uniform sample supplies both the entry (integer part)
+	 * and the coin flip between it and its alias (fractional part).
+	 */
+	double scaled = uniform_dist(rand_gen) * dist_points.size();
+	size_t i = static_cast<size_t>(scaled);
+
+	if (i >= dist_points.size())
+		i = dist_points.size() - 1;
+	if ((scaled - i) >= alias_prob[i])
+		i = alias_index[i];
+	return dist_points[i].length;
 }
 
 /**
@@ -67,9 +67,23 @@ class dist_point_gen {
 	 */
 	double dist_mean;
 
+	/**
+	 * @alias_prob: one entry for each entry in @dist_points. Together
+	 * with @alias_index this forms a table for sampling with Walker's
+	 * alias method: a sample picks entry i uniformly, then returns
+	 * dist_points[i] with probability alias_prob[i] and otherwise
+	 * dist_points[alias_index[i]]. This makes sampling O(1) regardless
+	 * of the number of points.
+	 */
+	std::vector<double> alias_prob;
+
+	/** @alias_index: see @alias_prob. */
+	std::vector<int> alias_index;
+
 	/** @uniform_dist: used to generate values in the range [0, 1). */
 	std::uniform_real_distribution<double> uniform_dist;
 
 	static int dist_msg_overhead(int length, int mtu);
+	void init_alias();
 };
 #endif /* _DIST_H */
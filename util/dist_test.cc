@@ -23,12 +23,6 @@
 #include "dist.h"
 #include "test_utils.h"
 
-/**
- * define HOMA_MAX_MESSAGE_LENGTH - Maximum bytes of payload in a Homa
- * request or response message.
- */
-#define HOMA_MAX_MESSAGE_LENGTH 1000000
-
 /** @rand_gen: random number generator. */
 static std::mt19937 rand_gen(
 		std::chrono::system_clock::now().time_since_epoch().count());
@@ -51,7 +45,7 @@ static std::mt19937 rand_gen(
  */
 int main (int argc, char**argv)
 {
-	int max_message_length = HOMA_MAX_MESSAGE_LENGTH;
+	int max_message_length = HOMA_MAX_UNSTREAMED_LENGTH;
 	size_t num_points = 10;
 	if (argc < 2) {
 		fprintf(stderr, "Usage: %s workload [# points] [max_message_length]",
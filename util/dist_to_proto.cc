@@ -31,7 +31,7 @@
  */
 int main (int argc, char**argv)
 {
-	int max_message_length = HOMA_MAX_MESSAGE_LENGTH;
+	int max_message_length = HOMA_MAX_UNSTREAMED_LENGTH;
 	double min_bucket_frac = 0.0025;
 	double max_size_ratio = 1.2;
 	double gbps = 20.0;
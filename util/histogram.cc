@@ -0,0 +1,86 @@
+/* Copyright (c) 2023 Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* This file contains the implementation of class histogram. */
+
+#include "histogram.h"
+
+/**
+ * histogram() - Constructor for histograms; all counts start at zero.
+ */
+histogram::histogram()
+	: counts(new std::atomic<uint64_t>[NUM_BUCKETS]())
+{
+}
+
+/**
+ * add_to() - Add the counts from this histogram into a snapshot (this
+ * is how the histograms from different threads are merged).
+ * @totals:   Counts for each bucket; resized to NUM_BUCKETS if needed.
+ */
+void histogram::add_to(std::vector<uint64_t> &totals) const
+{
+	if (totals.size() != NUM_BUCKETS)
+		totals.resize(NUM_BUCKETS, 0);
+	for (int i = 0; i < NUM_BUCKETS; i++)
+		totals[i] += counts[i].load(std::memory_order_relaxed);
+}
+
+/**
+ * percentile() - Compute a percentile from a snapshot of bucket counts.
+ * @totals:    Counts for each bucket, as produced by add_to.
+ * @fraction:  Desired percentile, as a fraction (e.g. 0.99 for P99).
+ *
+ * Return:     A value such that roughly @fraction of all the counted
+ *             values are less than or equal to it, or 0 if @totals is
+ *             empty.
+ */
+uint64_t histogram::percentile(const std::vector<uint64_t> &totals,
+		double fraction)
+{
+	uint64_t total = 0, target, sum = 0;
+
+	for (uint64_t count: totals)
+		total += count;
+	if (total == 0)
+		return 0;
+	target = static_cast<uint64_t>(fraction * total);
+	if (target < 1)
+		target = 1;
+	for (size_t i = 0; i < totals.size(); i++) {
+		sum += totals[i];
+		if (sum >= target)
+			return value(i);
+	}
+	return value(totals.size() - 1);
+}
+
+/**
+ * value() - Return a representative value (the midpoint) for the values
+ * counted in a given bucket.
+ * @index:   Index of a bucket.
+ */
+uint64_t histogram::value(int index)
+{
+	int exp, shift;
+
+	if (index < (1 << SUB_BITS))
+		return index;
+	exp = (index >> SUB_BITS) + SUB_BITS - 1;
+	shift = exp - SUB_BITS;
+	return ((static_cast<uint64_t>((1 << SUB_BITS)
+			+ (index & ((1 << SUB_BITS) - 1))) << shift)
+			+ ((1UL << shift) >> 1));
+}
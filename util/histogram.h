@@ -0,0 +1,91 @@
+/* Copyright (c) 2023 Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* This file defines a log-linear histogram (in the style of HdrHistogram)
+ * for recording latencies in constant space.
+ */
+
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * class histogram - Counts values in log-linear buckets: each power of two
+ * is divided into 2^SUB_BITS equal-width buckets, so every bucket's width
+ * is at most 1/2^SUB_BITS (about 3%) of its values. Values are recorded
+ * with relaxed atomic increments, so any number of threads can record
+ * into a histogram concurrently, and counts can be read (e.g., for
+ * merging into a snapshot) while recording is in progress.
+ */
+class histogram {
+	public:
+	/**
+	 * define SUB_BITS: log2 of the number of buckets per power of two.
+	 */
+	static const int SUB_BITS = 5;
+
+	/**
+	 * define MAX_EXP: values of 2^(MAX_EXP+1) or more are counted in
+	 * the last bucket (with cycle counts this is several minutes).
+	 */
+	static const int MAX_EXP = 40;
+
+	/** define NUM_BUCKETS: number of counters in a histogram. */
+	static const int NUM_BUCKETS = (MAX_EXP - SUB_BITS + 2) << SUB_BITS;
+
+	histogram();
+
+	/**
+	 * index() - Return the bucket in which a value is counted.
+	 * @value:   Value of interest.
+	 */
+	static inline int index(uint64_t value)
+	{
+		int exp;
+
+		if (value < (1U << SUB_BITS))
+			return value;
+		exp = 63 - __builtin_clzll(value);
+		if (exp > MAX_EXP)
+			return NUM_BUCKETS - 1;
+		return ((exp - SUB_BITS + 1) << SUB_BITS)
+				+ ((value >> (exp - SUB_BITS))
+				& ((1 << SUB_BITS) - 1));
+	}
+
+	/**
+	 * record() - Count one occurrence of a value.
+	 * @value:   Value to record.
+	 */
+	inline void record(uint64_t value)
+	{
+		counts[index(value)].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void add_to(std::vector<uint64_t> &totals) const;
+	static uint64_t percentile(const std::vector<uint64_t> &totals,
+			double fraction);
+	static uint64_t value(int index);
+
+	private:
+	/** @counts: one counter for each bucket. */
+	std::unique_ptr<std::atomic<uint64_t>[]> counts;
+};
+
+#endif /* _HISTOGRAM_H */
@@ -822,7 +822,7 @@ int main(int argc, char** argv)
 	sockaddr_in_union dest;
 	struct addrinfo hints;
 	char *host, *port_name;
-	char buffer[HOMA_MAX_MESSAGE_LENGTH];
+	char buffer[HOMA_MAX_UNSTREAMED_LENGTH];
 
 	if ((argc >= 2) && (strcmp(argv[1], "--help") == 0)) {
 		print_help(argv[0]);
@@ -869,8 +869,8 @@ int main(int argc, char** argv)
 			length = get_int(argv[next_arg],
 				"Bad message length %s; must be positive "
 				"integer\n");
-			if (length > HOMA_MAX_MESSAGE_LENGTH) {
-				length = HOMA_MAX_MESSAGE_LENGTH;
+			if (length > HOMA_MAX_UNSTREAMED_LENGTH) {
+				length = HOMA_MAX_UNSTREAMED_LENGTH;
 				printf("Reducing message length to %d\n", length);
 			}
 		} else if (strcmp(argv[next_arg], "--seed") == 0) {
@@ -17,17 +17,20 @@
 """
 This program reads timetrace information from /proc/timetrace (or from
 the first argument, if given) and prints it out in a different form,
-with times in nanoseconds instead of clock cycles.
+with times in nanoseconds instead of clock cycles. The argument may also
+be a binary file captured from /proc/timetrace_stream by ttstream.py.
 """
 
 from __future__ import division, print_function
 from glob import glob
 from optparse import OptionParser
+import io
 import math
 import os
 import re
 import string
 import sys
+import ttstream
 
 # Clock cycles per nanosecond.
 cpu_ghz  = 0.0
@@ -41,7 +44,13 @@ prev_time = 0
 file_name = "/proc/timetrace"
 if len(sys.argv) > 1:
     file_name = sys.argv[1]
-f = open(file_name)
+if (file_name != "/proc/timetrace") and ttstream.is_stream(file_name):
+    # Binary file captured from /proc/timetrace_stream.
+    f = io.StringIO()
+    ttstream.decode(file_name, f)
+    f.seek(0)
+else:
+    f = open(file_name)
 
 # Read initial line containing clock rate.
 line = f.readline()
@@ -0,0 +1,153 @@
+#!/usr/bin/python3
+
+# Copyright (c) 2019-2023 Stanford University
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+"""
+Captures and decodes binary timetraces from /proc/timetrace_stream.
+With --capture, reads the stream continuously and appends it to a file;
+otherwise decodes a previously captured file and prints it in the same
+textual form as /proc/timetrace, so the result can be fed to ttprint.py
+(which also accepts binary files directly).
+Usage: ttstream.py [--capture file [--seconds secs]] [file]
+"""
+
+from __future__ import division, print_function
+from optparse import OptionParser
+import re
+import struct
+import sys
+import time
+
+# These must match the definitions in timetrace.h.
+TT_STREAM_MAGIC = 0x54545354
+TT_STREAM_EVENT = 1
+TT_STREAM_FORMAT = 2
+TT_STREAM_LOST = 3
+TT_STREAM_NO_FORMAT = 0xffffffff
+
+def is_stream(file_name):
+    """
+    Returns True if the given file contains a binary timetrace stream.
+    """
+    with open(file_name, 'rb') as f:
+        data = f.read(4)
+    return (len(data) == 4) and (struct.unpack('<I', data)[0]
+            == TT_STREAM_MAGIC)
+
+def c_format(format, args):
+    """
+    Formats a timetrace message the way the kernel's snprintf would.
+    format:  Format string from the kernel (C syntax).
+    args:    List of 4 unsigned 32-bit arguments.
+    """
+    result = []
+    next_arg = 0
+    pos = 0
+    for match in re.finditer(r'%([-+ #0]*[0-9]*(?:\.[0-9]+)?)'
+            r'(?:hh|h|ll|l|z|j|t)?([diouxXcsp%])', format):
+        result.append(format[pos:match.start()])
+        pos = match.end()
+        flags, conv = match.group(1), match.group(2)
+        if conv == '%':
+            result.append('%')
+            continue
+        value = args[next_arg] if next_arg < len(args) else 0
+        next_arg += 1
+        if conv in 'di':
+            if value >= 0x80000000:
+                value -= 0x100000000
+            conv = 'd'
+        elif conv in 'up':
+            conv = 'd' if conv == 'u' else 'x'
+        elif conv == 's':
+            conv = 'x'
+        result.append(('%' + flags + conv) % (value))
+    result.append(format[pos:])
+    return ''.join(result)
+
+def decode(file_name, out=sys.stdout):
+    """
+    Reads a binary timetrace stream and prints it in textual form (the
+    same format as /proc/timetrace).
+    """
+    formats = {}
+    with open(file_name, 'rb') as f:
+        data = f.read()
+    if len(data) < 16:
+        return
+    magic, version, cpu_khz, num_cores = struct.unpack_from('<IIII', data, 0)
+    if magic != TT_STREAM_MAGIC:
+        print('%s isn\'t a timetrace stream' % (file_name), file=sys.stderr)
+        return
+    print('cpu_khz: %u' % (cpu_khz), file=out)
+    pos = 16
+    while pos + 8 <= len(data):
+        type = data[pos]
+        if type == TT_STREAM_FORMAT:
+            length, id = struct.unpack_from('<HI', data, pos+2)
+            string = data[pos+8:pos+8+length].split(b'\0')[0]
+            formats[id] = string.decode('utf-8', 'replace')
+            pos += 8 + length
+            continue
+        if pos + 32 > len(data):
+            break
+        core, id, timestamp = struct.unpack_from('<HIQ', data, pos+2)
+        args = struct.unpack_from('<IIII', data, pos+16)
+        pos += 32
+        if type == TT_STREAM_LOST:
+            message = 'Timetrace events lost before this point'
+        elif id in formats:
+            message = c_format(formats[id], args)
+        else:
+            message = 'Unknown format id %d, args %d %d %d %d' % (id,
+                    args[0], args[1], args[2], args[3])
+        print('%d [C%02d] %s' % (timestamp, core, message), file=out)
+
+def capture(file_name, seconds, poll_interval=0.01):
+    """
+    Reads /proc/timetrace_stream continuously, appending its contents
+    to a file, until interrupted or until the given number of seconds
+    has elapsed (0 means no limit).
+    """
+    start = time.time()
+    with open('/proc/timetrace_stream', 'rb', buffering=0) as src, \
+            open(file_name, 'wb') as dst:
+        try:
+            while (seconds == 0) or (time.time() - start < seconds):
+                data = src.read(1 << 20)
+                if data:
+                    dst.write(data)
+                else:
+                    time.sleep(poll_interval)
+        except KeyboardInterrupt:
+            pass
+
+if __name__ == '__main__':
+    parser = OptionParser(description='Capture or decode binary timetraces '
+            'from /proc/timetrace_stream.',
+            usage='%prog [options] [file]')
+    parser.add_option('--capture', dest='capture', default=None,
+            metavar='FILE', help='read the stream and write it to FILE')
+    parser.add_option('--seconds', type='float', dest='seconds', default=0,
+            help='with --capture: stop after this many seconds (default: '
+            'run until interrupted)')
+    (options, args) = parser.parse_args()
+    if options.capture:
+        capture(options.capture, options.seconds)
+    elif len(args) == 1:
+        decode(args[0])
+    else:
+        parser.print_help()
+        exit(1)